@@ -0,0 +1,304 @@
+#include "adapter_registry.h"
+#include "latency_histogram.h"
+#include "jni_logger.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+struct Entry {
+	std::shared_ptr<llama_model> model;  // An adapter keeps its base model alive
+	std::string path;
+	std::string key;
+	llama_adapter_lora* lora = nullptr;  // nullptr while not resident
+	size_t size = 0;                     // File size, the estimate of its memory
+	int opens = 0;
+	int holds = 0;
+	bool loading = false;
+	bool queued = false;                 // Waiting for the background loader
+	bool failed = false;                 // The last load failed
+	uint64_t last_use = 0;
+};
+
+std::mutex registry_mutex;
+std::condition_variable load_cv;  // Signalled whenever a load finished
+std::unordered_map<int64_t, Entry> entries;
+std::unordered_map<std::string, int64_t> keys;
+int64_t next_handle = 1;
+uint64_t use_clock = 0;
+size_t budget = 0;
+size_t resident_bytes = 0;
+
+std::atomic<int64_t> n_loads{0};
+std::atomic<int64_t> n_load_failures{0};
+std::atomic<int64_t> n_hits{0};
+std::atomic<int64_t> n_evictions{0};
+std::atomic<int64_t> n_prefetches{0};
+LatencyHistogram load_latency;
+LatencyHistogram evict_latency;
+
+size_t file_size(const std::string& path) {
+	FILE* file = std::fopen(path.c_str(), "rb");
+	if (!file) return 0;
+	long size = std::fseek(file, 0, SEEK_END) == 0 ? std::ftell(file) : 0;
+	std::fclose(file);
+	return size > 0 ? (size_t)size : 0;
+}
+
+void free_adapter_locked(Entry& entry) {
+	llama_adapter_lora_free(entry.lora);
+	entry.lora = nullptr;
+	resident_bytes -= entry.size;
+}
+
+// Forget a handle nobody opens or holds anymore
+void drop_unused_locked(int64_t handle) {
+	auto it = entries.find(handle);
+	if (it == entries.end()) return;
+	Entry& entry = it->second;
+	if (entry.opens > 0 || entry.holds > 0 || entry.loading) return;
+	if (entry.lora) free_adapter_locked(entry);
+	keys.erase(entry.key);
+	entries.erase(it);
+}
+
+// Free the least recently used adapters nobody holds until the resident ones fit the budget
+void evict_locked(int64_t keep) {
+	while (budget > 0 && resident_bytes > budget) {
+		Entry* victim = nullptr;
+		for (auto& candidate : entries) {
+			Entry& entry = candidate.second;
+			if (!entry.lora || entry.holds > 0 || candidate.first == keep) continue;
+			if (!victim || entry.last_use < victim->last_use) victim = &entry;
+		}
+		if (!victim) break;
+		uint64_t t_evict = LatencyHistogram::now_ns();
+		free_adapter_locked(*victim);
+		evict_latency.record(LatencyHistogram::now_ns() - t_evict);
+		n_evictions++;
+	}
+}
+
+// Load the adapter of handle unless it is resident, or wait for the load already running
+void load_locked(std::unique_lock<std::mutex>& lock, int64_t handle) {
+	for (;;) {
+		auto it = entries.find(handle);
+		if (it == entries.end() || it->second.lora) return;
+		if (!it->second.loading) break;
+		load_cv.wait(lock);
+	}
+
+	// The entry is not erased while loading, and map nodes never move
+	Entry& entry = entries.at(handle);
+	entry.loading = true;
+	std::shared_ptr<llama_model> model = entry.model;
+	std::string path = entry.path;
+	lock.unlock();
+	uint64_t t_load = LatencyHistogram::now_ns();
+	llama_adapter_lora* lora = llama_adapter_lora_init(model.get(), path.c_str());
+	uint64_t t_loaded = LatencyHistogram::now_ns();
+	lock.lock();
+
+	entry.loading = false;
+	if (lora) {
+		entry.lora = lora;
+		entry.failed = false;
+		resident_bytes += entry.size;
+		load_latency.record(t_loaded - t_load);
+		n_loads++;
+	} else {
+		JNI_LOG_WARN("Failed to load LoRA adapter from %s", path.c_str());
+		entry.failed = true;
+		n_load_failures++;
+	}
+	load_cv.notify_all();
+	drop_unused_locked(handle);
+	evict_locked(handle);
+}
+
+// Loads the adapters queued by holds that do not wait, started with the first of them
+class Loader {
+public:
+	void enqueue(int64_t handle) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push_back(handle);
+		if (!thread_.joinable()) thread_ = std::thread(&Loader::loop, this);
+		cv_.notify_one();
+	}
+
+	~Loader() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		cv_.notify_one();
+		if (thread_.joinable()) thread_.join();
+	}
+
+private:
+	void loop() {
+		for (;;) {
+			int64_t handle;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+				if (stopping_) return;
+				handle = queue_.front();
+				queue_.pop_front();
+			}
+
+			std::unique_lock<std::mutex> lock(registry_mutex);
+			auto it = entries.find(handle);
+			if (it == entries.end()) continue;
+			it->second.queued = false;
+			// Released before its turn, the adapter is loaded on its next use instead
+			if (it->second.holds == 0) continue;
+			load_locked(lock, handle);
+		}
+	}
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<int64_t> queue_;
+	std::thread thread_;
+	bool stopping_ = false;
+};
+
+// Destroyed before the entries, so the loader thread is gone before them
+Loader loader;
+
+}
+
+int64_t AdapterRegistry::open(const std::shared_ptr<llama_model>& model, const std::string& path) {
+	if (!model) return -1;
+	std::string key = std::to_string(reinterpret_cast<uintptr_t>(model.get())) + "|" + path;
+
+	std::unique_lock<std::mutex> lock(registry_mutex);
+	int64_t handle;
+	auto found = keys.find(key);
+	if (found != keys.end()) {
+		handle = found->second;
+	} else {
+		handle = next_handle++;
+		Entry& entry = entries[handle];
+		entry.model = model;
+		entry.path = path;
+		entry.key = key;
+		entry.size = file_size(path);
+		keys[key] = handle;
+	}
+
+	// Held while loading so that its own load does not evict it
+	Entry& entry = entries.at(handle);
+	entry.opens++;
+	entry.holds++;
+	entry.last_use = ++use_clock;
+	load_locked(lock, handle);
+	entry.holds--;
+	if (!entry.lora) {
+		entry.opens--;
+		drop_unused_locked(handle);
+		return -1;
+	}
+	evict_locked(handle);
+	return handle;
+}
+
+void AdapterRegistry::close(int64_t handle) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto it = entries.find(handle);
+	if (it == entries.end() || it->second.opens == 0) return;
+	it->second.opens--;
+	drop_unused_locked(handle);
+}
+
+bool AdapterRegistry::hold(int64_t handle, bool wait, llama_adapter_lora*& adapter) {
+	adapter = nullptr;
+	std::unique_lock<std::mutex> lock(registry_mutex);
+	auto it = entries.find(handle);
+	if (it == entries.end()) return false;
+	Entry& entry = it->second;
+	entry.holds++;
+	entry.last_use = ++use_clock;
+	if (entry.lora) {
+		n_hits++;
+		adapter = entry.lora;
+		return true;
+	}
+
+	if (wait) {
+		load_locked(lock, handle);
+		adapter = entry.lora;
+	} else if (!entry.loading && !entry.queued) {
+		entry.queued = true;
+		entry.failed = false;
+		n_prefetches++;
+		loader.enqueue(handle);
+	}
+	return true;
+}
+
+void AdapterRegistry::release(int64_t handle) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto it = entries.find(handle);
+	if (it == entries.end() || it->second.holds == 0) return;
+	it->second.holds--;
+	it->second.last_use = ++use_clock;
+	drop_unused_locked(handle);
+	evict_locked(0);
+}
+
+llama_adapter_lora* AdapterRegistry::resident(int64_t handle, bool& failed) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto it = entries.find(handle);
+	if (it == entries.end()) {
+		failed = true;
+		return nullptr;
+	}
+	failed = it->second.failed;
+	return it->second.lora;
+}
+
+const llama_model* AdapterRegistry::model(int64_t handle) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto it = entries.find(handle);
+	return it == entries.end() ? nullptr : it->second.model.get();
+}
+
+void AdapterRegistry::set_budget(size_t bytes) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	budget = bytes;
+	evict_locked(0);
+}
+
+std::string AdapterRegistry::stats_json() {
+	size_t n_resident = 0;
+	size_t bytes;
+	size_t limit;
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		for (const auto& entry : entries) {
+			if (entry.second.lora) n_resident++;
+		}
+		bytes = resident_bytes;
+		limit = budget;
+	}
+	std::string json = "{";
+	json += "\"resident_count\":" + std::to_string(n_resident) + ",";
+	json += "\"resident_bytes\":" + std::to_string(bytes) + ",";
+	json += "\"budget_bytes\":" + std::to_string(limit) + ",";
+	json += "\"hit_count\":" + std::to_string(n_hits.load()) + ",";
+	json += "\"load_count\":" + std::to_string(n_loads.load()) + ",";
+	json += "\"load_failure_count\":" + std::to_string(n_load_failures.load()) + ",";
+	json += "\"prefetch_count\":" + std::to_string(n_prefetches.load()) + ",";
+	json += "\"eviction_count\":" + std::to_string(n_evictions.load()) + ",";
+	json += "\"load_latency\":" + load_latency.to_json() + ",";
+	json += "\"evict_latency\":" + evict_latency.to_json();
+	json += "}";
+	return json;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include "llama.h"
+
+// Process-wide registry of LoRA adapters, keyed by base model and file. All contexts of a model
+// share one copy of an adapter. Adapters stay resident within a byte budget (0 for no limit),
+// estimated by their file size; beyond it the least recently used adapters nobody holds are freed
+// and loaded again on their next use. Handles stay valid across evictions until they are closed.
+//
+// A context holds every adapter it may apply, from the submission of the request naming it until
+// the request is freed, so held adapters are never evicted. Holding without waiting queues the
+// load on a background thread, which lets queued requests prefetch their adapters.
+class AdapterRegistry {
+public:
+	// Register the adapter file for the model and load it, returns its handle or -1 if loading
+	// failed. Opening a file the model already opened returns the same handle.
+	static int64_t open(const std::shared_ptr<llama_model>& model, const std::string& path);
+
+	// Drop one open of the handle, its adapter is freed once it is closed as often as opened and
+	// no longer held
+	static void close(int64_t handle);
+
+	// Hold the adapter resident. With wait, it is loaded on this thread if needed and nullptr
+	// means the handle is unknown or loading failed. Without, a background load is queued and
+	// nullptr may only mean the adapter is not resident yet. Returns false for an unknown handle,
+	// a successful hold is paired with release.
+	static bool hold(int64_t handle, bool wait, llama_adapter_lora*& adapter);
+	static void release(int64_t handle);
+
+	// The adapter of a held handle if resident, failed is set once its load failed
+	static llama_adapter_lora* resident(int64_t handle, bool& failed);
+
+	// Base model the handle was opened for, nullptr for an unknown handle
+	static const llama_model* model(int64_t handle);
+
+	static void set_budget(size_t bytes);
+
+	// Resident adapters and bytes, load and eviction counts and their latency histograms, as JSON
+	static std::string stats_json();
+};
+
+// Holds an adapter for the scope, loading it first if needed
+class AdapterHold {
+public:
+	explicit AdapterHold(int64_t handle) : handle_(handle) {
+		held_ = AdapterRegistry::hold(handle, true, adapter_);
+	}
+
+	~AdapterHold() {
+		if (held_) AdapterRegistry::release(handle_);
+	}
+
+	llama_adapter_lora* get() const { return adapter_; }
+
+	AdapterHold(const AdapterHold&) = delete;
+	AdapterHold& operator=(const AdapterHold&) = delete;
+
+private:
+	int64_t handle_;
+	bool held_ = false;
+	llama_adapter_lora* adapter_ = nullptr;
+};
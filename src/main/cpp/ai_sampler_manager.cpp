@@ -2,20 +2,11 @@
 #include "jni_utils.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
+#include "server_table.h"
 #include <mutex>
 #include <unordered_map>
 #include <memory>
 
-// External global server management (defined in jllama.cpp)
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
-
 // Static initialization to ensure backend is ready
 static std::once_flag g_backend_init_flag;
 static bool g_backend_initialized = false;
@@ -630,13 +621,13 @@ jint AISamplerManager::sampleToken(JNIEnv* env, jobject obj, jlong samplerHandle
 		return -1;
 	}
 	
-	llama_context* ctx = getContext(env, obj);
-	if (!ctx) {
+	ServerRef server = getServer(env, obj);
+	if (!server) {
 		return -1;
 	}
 	
 	llama_sampler* sampler = reinterpret_cast<llama_sampler*>(samplerHandle);
-	llama_token token = llama_sampler_sample(sampler, ctx, -1);
+	llama_token token = llama_sampler_sample(sampler, server->ctx, -1);
 	
 	return static_cast<jint>(token);
 	
@@ -695,27 +686,27 @@ jstring AISamplerManager::getSamplerName(JNIEnv* env, jlong samplerHandle) {
 
 // Helper methods
 
-struct llama_context* AISamplerManager::getContext(JNIEnv* env, jobject obj) {
+ServerRef AISamplerManager::getServer(JNIEnv* env, jobject obj) {
 	jclass cls = env->GetObjectClass(obj);
 	if (!cls) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get object class");
-		return nullptr;
+		return ServerRef();
 	}
 	
-	jfieldID field = env->GetFieldID(cls, "ctx", "J");
+	jfieldID field = JniUtils::ctx_field(env, cls);
 	if (!field) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get ctx field");
-		return nullptr;
+		return ServerRef();
 	}
 	
 	jlong handle = env->GetLongField(obj, field);
-	LlamaServer* server = get_server(handle);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid server handle");
-		return nullptr;
+		return ServerRef();
 	}
 	
-	return server->ctx;
+	return server;
 }
 
 const struct llama_vocab* AISamplerManager::getVocab(JNIEnv* env, jobject obj) {
@@ -725,14 +716,14 @@ const struct llama_vocab* AISamplerManager::getVocab(JNIEnv* env, jobject obj) {
 		return nullptr;
 	}
 	
-	jfieldID field = env->GetFieldID(cls, "ctx", "J");
+	jfieldID field = JniUtils::ctx_field(env, cls);
 	if (!field) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get ctx field");
 		return nullptr;
 	}
 	
 	jlong handle = env->GetLongField(obj, field);
-	LlamaServer* server = get_server(handle);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server || !server->model) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid server or model handle");
 		return nullptr;
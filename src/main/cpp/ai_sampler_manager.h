@@ -3,6 +3,7 @@
 
 #include <jni.h>
 #include "llama.h"
+#include "server_table.h"
 
 /**
  * AI Sampler Manager for comprehensive sampling strategies.
@@ -59,7 +60,7 @@ public:
 	
 private:
 	// Helper methods
-	static struct llama_context* getContext(JNIEnv* env, jobject obj);
+	static ServerRef getServer(JNIEnv* env, jobject obj);
 	static const struct llama_vocab* getVocab(JNIEnv* env, jobject obj);
 	static bool validateSamplerHandle(jlong handle);
 };
@@ -0,0 +1,326 @@
+#include "auto_tuner.h"
+#include "jni_logger.h"
+#include "common.h"
+#include "ggml-backend.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+// A candidate only replaces the current best when it is clearly faster, small differences are noise
+static const double TUNING_MARGIN = 1.02;
+
+namespace {
+
+struct TuningSetting {
+	int n_threads;
+	int n_threads_batch;
+	uint32_t n_batch;
+	uint32_t n_ubatch;
+};
+
+struct TuningResult {
+	double prefill_tps = 0.0;
+	double decode_tps = 0.0;
+};
+
+uint64_t fnv1a(const std::string& text) {
+	uint64_t hash = 1469598103934665603ull;
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::string cpu_model_name() {
+	std::ifstream file("/proc/cpuinfo");
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.compare(0, 10, "model name") == 0 || line.compare(0, 9, "Processor") == 0) {
+			size_t colon = line.find(':');
+			if (colon != std::string::npos) return line.substr(colon + 1);
+		}
+	}
+	return "";
+}
+
+// Powers of two up to max_threads, plus the math cores and max_threads themselves
+std::vector<int> thread_candidates(int max_threads) {
+	std::vector<int> candidates;
+	for (int n = 1; n <= max_threads; n *= 2) candidates.push_back(n);
+	int math = cpu_get_num_math();
+	if (math > 0 && math <= max_threads) candidates.push_back(math);
+	candidates.push_back(max_threads);
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	return candidates;
+}
+
+// Decode the prompt and the generated tokens on a fresh context with the setting.
+// Only the phases asked for are run, the fastest of the repetitions counts.
+bool measure(llama_model* model, const TuningRequest& request, const TuningSetting& setting,
+		bool prefill, bool generate, TuningResult& result) {
+	llama_context_params params = llama_context_default_params();
+	params.n_ctx = request.n_prompt + request.n_generate + 1;
+	params.n_batch = setting.n_batch;
+	params.n_ubatch = setting.n_ubatch;
+	params.n_seq_max = 1;
+	params.n_threads = setting.n_threads;
+	params.n_threads_batch = setting.n_threads_batch;
+	params.no_perf = false;
+
+	llama_context* ctx = llama_init_from_model(model, params);
+	if (!ctx) return false;
+
+	// Content does not matter for the timings, any valid tokens will do
+	const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+	std::vector<llama_token> tokens(request.n_prompt + request.n_generate);
+	for (size_t i = 0; i < tokens.size(); i++) {
+		tokens[i] = (llama_token)((i * 7919 + 13) % n_vocab);
+	}
+
+	llama_memory_t memory = llama_get_memory(ctx);
+	bool ok = true;
+	result = TuningResult();
+	// The first pass is a warmup that pays for buffer allocation and page faults
+	for (int rep = 0; rep <= request.repetitions && ok; rep++) {
+		llama_memory_clear(memory, true);
+		llama_perf_context_reset(ctx);
+
+		// The prompt always runs so that generation decodes at a realistic depth
+		for (int i = 0; i < request.n_prompt && ok; i += setting.n_batch) {
+			int32_t n = std::min<int32_t>(setting.n_batch, request.n_prompt - i);
+			ok = llama_decode(ctx, llama_batch_get_one(tokens.data() + i, n)) == 0;
+		}
+		for (int i = 0; generate && i < request.n_generate && ok; i++) {
+			ok = llama_decode(ctx, llama_batch_get_one(tokens.data() + request.n_prompt + i, 1)) == 0;
+		}
+		llama_synchronize(ctx);
+		if (!ok || rep == 0) continue;
+
+		llama_perf_context_data perf = llama_perf_context(ctx);
+		if (prefill && perf.t_p_eval_ms > 0) {
+			result.prefill_tps = std::max(result.prefill_tps, 1e3 * perf.n_p_eval / perf.t_p_eval_ms);
+		}
+		if (generate && perf.t_eval_ms > 0) {
+			result.decode_tps = std::max(result.decode_tps, 1e3 * perf.n_eval / perf.t_eval_ms);
+		}
+	}
+	llama_free(ctx);
+	return ok;
+}
+
+json setting_json(const char* stage, const TuningSetting& setting, const TuningResult& result) {
+	return {
+		{"stage", stage},
+		{"n_threads", setting.n_threads},
+		{"n_threads_batch", setting.n_threads_batch},
+		{"n_batch", setting.n_batch},
+		{"n_ubatch", setting.n_ubatch},
+		{"prefill_tps", result.prefill_tps},
+		{"decode_tps", result.decode_tps}
+	};
+}
+
+}
+
+std::string AutoTuner::fingerprint(const llama_model* model) {
+	char desc[256];
+	llama_model_desc(model, desc, sizeof(desc));
+	std::string key = desc;
+	key += ";size=" + std::to_string(llama_model_size(model));
+	key += ";params=" + std::to_string(llama_model_n_params(model));
+	key += ";cpu=" + cpu_model_name();
+	key += ";threads=" + std::to_string(std::thread::hardware_concurrency());
+	key += ";system=";
+	key += llama_print_system_info();
+	for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+		ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+		key += ";dev=";
+		key += ggml_backend_dev_name(dev);
+		key += ":";
+		key += ggml_backend_dev_description(dev);
+	}
+
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)fnv1a(key));
+	return hex;
+}
+
+bool AutoTuner::tune(llama_model* model, const TuningRequest& request, TuningProfile& profile,
+		std::string& json_out, std::string& error) {
+	if (request.n_prompt < 2 || request.n_generate < 1 || request.repetitions < 1) {
+		error = "Tuning needs at least 2 prompt tokens, 1 generated token and 1 repetition";
+		return false;
+	}
+	int max_threads = request.max_threads > 0 ? request.max_threads
+		: (int)std::max(1u, std::thread::hardware_concurrency());
+	max_threads = std::min(max_threads, GGML_MAX_N_THREADS);
+	std::vector<int> threads = thread_candidates(max_threads);
+	uint32_t n_prompt = (uint32_t)request.n_prompt;
+
+	TuningSetting best = { cpu_get_num_math(), cpu_get_num_math(), n_prompt, std::min<uint32_t>(512, n_prompt) };
+	best.n_threads = std::min(std::max(1, best.n_threads), max_threads);
+	best.n_threads_batch = best.n_threads;
+	TuningResult best_result;
+	json measurements = json::array();
+
+	// Generation threads, measured by single token decodes
+	double best_decode = 0.0;
+	for (int n : threads) {
+		TuningSetting setting = best;
+		setting.n_threads = n;
+		TuningResult result;
+		if (!measure(model, request, setting, false, true, result)) continue;
+		measurements.push_back(setting_json("threads", setting, result));
+		if (result.decode_tps > best_decode * TUNING_MARGIN) {
+			best_decode = result.decode_tps;
+			best.n_threads = n;
+		}
+	}
+	if (best_decode <= 0.0) {
+		error = "No thread count could be measured, the model may not fit a scratch context";
+		return false;
+	}
+	best_result.decode_tps = best_decode;
+
+	// Then everything prompt processing depends on, each stage keeping the best of the previous ones
+	auto sweep = [&](const char* stage, const std::vector<TuningSetting>& settings) {
+		for (const TuningSetting& setting : settings) {
+			TuningResult result;
+			if (!measure(model, request, setting, true, false, result)) continue;
+			measurements.push_back(setting_json(stage, setting, result));
+			if (result.prefill_tps > best_result.prefill_tps * TUNING_MARGIN) {
+				best_result.prefill_tps = result.prefill_tps;
+				best = setting;
+			}
+		}
+	};
+
+	std::vector<TuningSetting> settings;
+	for (int n : threads) {
+		TuningSetting setting = best;
+		setting.n_threads_batch = n;
+		settings.push_back(setting);
+	}
+	sweep("threads_batch", settings);
+
+	settings.clear();
+	for (uint32_t n_ubatch = 32; n_ubatch <= std::min<uint32_t>(2048, n_prompt); n_ubatch *= 2) {
+		TuningSetting setting = best;
+		setting.n_ubatch = n_ubatch;
+		setting.n_batch = std::max(n_ubatch, n_prompt);
+		settings.push_back(setting);
+	}
+	sweep("ubatch", settings);
+
+	// A larger logical batch only changes how often the prompt is split into decode calls
+	settings.clear();
+	for (uint32_t n_batch = best.n_ubatch; n_batch < n_prompt; n_batch *= 2) {
+		TuningSetting setting = best;
+		setting.n_batch = n_batch;
+		settings.push_back(setting);
+	}
+	sweep("batch", settings);
+
+	if (best_result.prefill_tps <= 0.0) {
+		error = "No batch setting could be measured";
+		return false;
+	}
+
+	profile.fingerprint = fingerprint(model);
+	profile.n_threads = best.n_threads;
+	profile.n_threads_batch = best.n_threads_batch;
+	profile.n_batch = best.n_batch;
+	profile.n_ubatch = best.n_ubatch;
+	profile.prefill_tps = best_result.prefill_tps;
+	profile.decode_tps = best_result.decode_tps;
+
+	json result = {
+		{"fingerprint", profile.fingerprint},
+		{"n_threads", profile.n_threads},
+		{"n_threads_batch", profile.n_threads_batch},
+		{"n_batch", profile.n_batch},
+		{"n_ubatch", profile.n_ubatch},
+		{"prefill_tps", profile.prefill_tps},
+		{"decode_tps", profile.decode_tps},
+		{"n_prompt", request.n_prompt},
+		{"n_generate", request.n_generate},
+		{"measurements", measurements}
+	};
+	json_out = result.dump();
+
+	JNI_LOG_INFO("Tuned model: %d threads, %d batch threads, n_batch %u, n_ubatch %u (%.1f prefill, %.1f decode tokens/s)",
+		profile.n_threads, profile.n_threads_batch, profile.n_batch, profile.n_ubatch,
+		profile.prefill_tps, profile.decode_tps);
+	return true;
+}
+
+bool AutoTuner::parse(const std::string& text, TuningProfile& profile) {
+	json data = json::parse(text, nullptr, false);
+	if (data.is_discarded() || !data.is_object()) return false;
+	try {
+		profile.fingerprint = data.at("fingerprint").get<std::string>();
+		profile.n_threads = data.at("n_threads").get<int>();
+		profile.n_threads_batch = data.at("n_threads_batch").get<int>();
+		profile.n_batch = data.at("n_batch").get<uint32_t>();
+		profile.n_ubatch = data.at("n_ubatch").get<uint32_t>();
+		profile.prefill_tps = data.value("prefill_tps", 0.0);
+		profile.decode_tps = data.value("decode_tps", 0.0);
+	} catch (const json::exception&) {
+		return false;
+	}
+	return profile.n_threads > 0 && profile.n_threads_batch > 0 && profile.n_ubatch > 0 &&
+		profile.n_batch >= profile.n_ubatch;
+}
+
+bool AutoTuner::load(const std::string& path, const std::string& fingerprint, TuningProfile& profile,
+		std::string& json_out) {
+	std::ifstream file(path);
+	if (!file) return false;
+	std::stringstream text;
+	text << file.rdbuf();
+
+	TuningProfile stored;
+	if (!parse(text.str(), stored)) {
+		JNI_LOG_WARN("Tuning profile %s is not readable", path.c_str());
+		return false;
+	}
+	if (stored.fingerprint != fingerprint) {
+		JNI_LOG_INFO("Tuning profile %s was made for another model or host", path.c_str());
+		return false;
+	}
+	profile = stored;
+	json_out = text.str();
+	return true;
+}
+
+bool AutoTuner::save(const std::string& path, const std::string& json_text) {
+	// Written next to the profile and renamed, so that concurrent loads never read a partial one
+	std::string staging = path + ".tmp" + std::to_string(reinterpret_cast<uintptr_t>(&json_text));
+	{
+		std::ofstream file(staging, std::ios::binary | std::ios::trunc);
+		if (!file) return false;
+		file << json_text;
+		if (!file.flush()) {
+			file.close();
+			std::remove(staging.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	// rename does not replace existing files on Windows
+	std::remove(path.c_str());
+#endif
+	if (std::rename(staging.c_str(), path.c_str()) != 0) {
+		std::remove(staging.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include "llama.h"
+
+// What a tuning run measures
+struct TuningRequest {
+	int n_prompt = 256;      // Prompt tokens decoded to measure prefill
+	int n_generate = 32;     // Single token decodes to measure generation
+	int max_threads = 0;     // Largest thread count tried, 0 for all hardware threads
+	int repetitions = 2;     // Runs per setting, the fastest counts
+};
+
+// The best settings found for a model on a host
+struct TuningProfile {
+	std::string fingerprint;
+	int n_threads = 0;
+	int n_threads_batch = 0;
+	uint32_t n_batch = 0;
+	uint32_t n_ubatch = 0;
+	double prefill_tps = 0.0;
+	double decode_tps = 0.0;
+};
+
+// Measures the hardware instead of guessing: generation threads, batch threads, n_ubatch and
+// n_batch are swept one after another, each stage keeping the best value of the previous ones.
+// Every setting runs on a scratch context of the model, so a server using the model keeps its
+// context, but measurements compete with its work for the CPU.
+//
+// Profiles are JSON and carry a fingerprint of the model and the host (CPU, backends and build
+// features), a stored profile is only used where the fingerprint matches.
+class AutoTuner {
+public:
+	// Run the sweep, returns false with error set if no setting could be measured
+	static bool tune(llama_model* model, const TuningRequest& request, TuningProfile& profile,
+		std::string& json, std::string& error);
+
+	// Fingerprint of the model and the host
+	static std::string fingerprint(const llama_model* model);
+
+	// Read a stored profile, false if it is missing, unreadable or for another model or host
+	static bool load(const std::string& path, const std::string& fingerprint, TuningProfile& profile,
+		std::string& json);
+
+	static bool save(const std::string& path, const std::string& json);
+
+	static bool parse(const std::string& json, TuningProfile& profile);
+};
@@ -1,26 +1,42 @@
 #include "batch_manager.h"
 #include "jni_utils.h"
+#include "llama_server.h"
+#include "jni_error_handler.h"
+#include <cstring>
 #include <memory>
 #include <unordered_map>
 #include <mutex>
 
+// A batch with the sizes it was allocated with, which llama_batch does not keep
+struct BatchEntry {
+	llama_batch batch;
+	int32_t capacity;
+	int32_t embd;
+	int32_t n_seq_max;
+};
+
 static std::mutex batchMutex;
-static std::unordered_map<jlong, std::unique_ptr<llama_batch>> batchRegistry;
+static std::unordered_map<jlong, std::unique_ptr<BatchEntry>> batchRegistry;
 static jlong nextBatchId = 1;
 
 llama_batch* BatchManager::getBatch(jlong handle) {
+	BatchEntry* entry = getEntry(handle);
+	return entry ? &entry->batch : nullptr;
+}
+
+BatchEntry* BatchManager::getEntry(jlong handle) {
 	std::lock_guard<std::mutex> lock(batchMutex);
 	auto it = batchRegistry.find(handle);
 	return (it != batchRegistry.end()) ? it->second.get() : nullptr;
 }
 
-llama_context* BatchManager::getContext(JNIEnv* env, jobject modelObj) {
+ServerRef BatchManager::getServer(JNIEnv* env, jobject modelObj) {
 	jclass cls = env->GetObjectClass(modelObj);
-	jfieldID contextField = env->GetFieldID(cls, "ctx", "J");
-	if (!contextField) return nullptr;
+	jfieldID contextField = JniUtils::ctx_field(env, cls);
+	if (!contextField) return ServerRef();
 
-	jlong contextHandle = env->GetLongField(modelObj, contextField);
-	return reinterpret_cast<llama_context*>(contextHandle);
+	// The handle refers to the server owning the context
+	return ServerTable::acquire(env->GetLongField(modelObj, contextField));
 }
 
 jlong BatchManager::initializeBatch(JNIEnv* env, jint tokenCount, jint embeddingSize, jint maxSequences) {
@@ -31,7 +47,7 @@ jlong BatchManager::initializeBatch(JNIEnv* env, jint tokenCount, jint embedding
 	printf("[DEBUG] initializeBatch: llama_batch_init completed\n");
 	fflush(stdout);
 
-	auto batchPtr = std::make_unique<llama_batch>(batch);
+	auto batchPtr = std::make_unique<BatchEntry>(BatchEntry{ batch, tokenCount, embeddingSize, maxSequences });
 	printf("[DEBUG] initializeBatch: Created unique_ptr\n");
 	fflush(stdout);
 
@@ -49,7 +65,7 @@ void BatchManager::freeBatch(JNIEnv* env, jlong batchHandle) {
 	std::lock_guard<std::mutex> lock(batchMutex);
 	auto it = batchRegistry.find(batchHandle);
 	if (it != batchRegistry.end()) {
-		llama_batch_free(*it->second);
+		llama_batch_free(it->second->batch);
 		batchRegistry.erase(it);
 	}
 }
@@ -58,7 +74,8 @@ jint BatchManager::encodeContext(JNIEnv* env, jobject modelObj, jlong batchHandl
 	printf("[DEBUG] encodeContext: Starting\n");
 	fflush(stdout);
 
-	llama_context* ctx = getContext(env, modelObj);
+	ServerRef server = getServer(env, modelObj);
+	llama_context* ctx = server ? server->ctx : nullptr;
 	printf("[DEBUG] encodeContext: Got context: %p\n", ctx);
 	fflush(stdout);
 
@@ -137,7 +154,8 @@ jint BatchManager::encodeContext(JNIEnv* env, jobject modelObj, jlong batchHandl
 }
 
 jint BatchManager::decodeTokens(JNIEnv* env, jobject modelObj, jlong batchHandle) {
-	llama_context* ctx = getContext(env, modelObj);
+	ServerRef server = getServer(env, modelObj);
+	llama_context* ctx = server ? server->ctx : nullptr;
 	llama_batch* batch = getBatch(batchHandle);
 
 	if (!ctx || !batch) {
@@ -357,4 +375,122 @@ jbyteArray BatchManager::getBatchLogitFlags(JNIEnv* env, jlong batchHandle) {
 jint BatchManager::getBatchTokenCount(JNIEnv* env, jlong batchHandle) {
 	llama_batch* batch = getBatch(batchHandle);
 	return batch ? static_cast<jint>(batch->n_tokens) : 0;
-}
\ No newline at end of file
+}
+BatchManager::PackedLayout BatchManager::packedLayout(const BatchEntry& entry) {
+	const size_t n = static_cast<size_t>(entry.capacity);
+	PackedLayout layout;
+	layout.inputs = PACKED_HEADER_BYTES;
+	layout.positions = layout.inputs + n * sizeof(int32_t) * (entry.embd > 0 ? entry.embd : 1);
+	layout.sequence_ids = layout.positions + n * sizeof(int32_t);
+	layout.logit_flags = layout.sequence_ids + n * sizeof(int32_t);
+	layout.size = layout.logit_flags + n;
+	return layout;
+}
+
+BatchEntry* BatchManager::fillFromPacked(JNIEnv* env, jlong batchHandle, jobject packed) {
+	BatchEntry* entry = getEntry(batchHandle);
+	if (!entry) {
+		JNIErrorHandler::throw_illegal_state(env, "Batch is not initialized");
+		return nullptr;
+	}
+	const PackedLayout layout = packedLayout(*entry);
+	const uint8_t* data = packed ? static_cast<const uint8_t*>(env->GetDirectBufferAddress(packed)) : nullptr;
+	if (!data || env->GetDirectBufferCapacity(packed) < static_cast<jlong>(layout.size)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Packed batch must be a direct buffer of " +
+			std::to_string(layout.size) + " bytes");
+		return nullptr;
+	}
+
+	int32_t n_tokens;
+	std::memcpy(&n_tokens, data, sizeof(n_tokens));
+	if (n_tokens <= 0 || n_tokens > entry->capacity) {
+		JNIErrorHandler::throw_illegal_argument(env, "Packed token count " + std::to_string(n_tokens) +
+			" is outside of 1.." + std::to_string(entry->capacity));
+		return nullptr;
+	}
+
+	// Fields are read with memcpy, the caller's buffer need not be aligned
+	llama_batch& batch = entry->batch;
+	const size_t n = static_cast<size_t>(n_tokens);
+	if (entry->embd > 0) {
+		std::memcpy(batch.embd, data + layout.inputs, n * entry->embd * sizeof(float));
+	} else {
+		std::memcpy(batch.token, data + layout.inputs, n * sizeof(llama_token));
+	}
+	std::memcpy(batch.pos, data + layout.positions, n * sizeof(llama_pos));
+	std::memcpy(batch.logits, data + layout.logit_flags, n);
+	const uint8_t* sequence_ids = data + layout.sequence_ids;
+	for (size_t i = 0; i < n; i++) {
+		llama_seq_id seq_id;
+		std::memcpy(&seq_id, sequence_ids + i * sizeof(seq_id), sizeof(seq_id));
+		if (seq_id < 0) {
+			JNIErrorHandler::throw_illegal_argument(env, "Negative sequence id at token " + std::to_string(i));
+			return nullptr;
+		}
+		batch.n_seq_id[i] = 1;
+		batch.seq_id[i][0] = seq_id;
+	}
+	batch.n_tokens = n_tokens;
+	return entry;
+}
+
+void BatchManager::fillBatch(JNIEnv* env, jlong batchHandle, jobject packed) {
+	fillFromPacked(env, batchHandle, packed);
+}
+
+jint BatchManager::decodeAndCollect(JNIEnv* env, jobject modelObj, jlong batchHandle, jobject packed,
+		jobject output, jint offset, jboolean embeddings) {
+	BatchEntry* entry = fillFromPacked(env, batchHandle, packed);
+	if (!entry) return -1;
+
+	ServerRef server = getServer(env, modelObj);
+	if (!server || !server->ctx) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return -1;
+	}
+	float* out = output ? static_cast<float*>(env->GetDirectBufferAddress(output)) : nullptr;
+	jlong out_capacity = out ? env->GetDirectBufferCapacity(output) : 0;
+	if (!out || offset < 0) {
+		JNIErrorHandler::throw_illegal_argument(env, "Output must be a direct FloatBuffer and offset non-negative");
+		return -1;
+	}
+
+	const llama_batch& batch = entry->batch;
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+	llama_context* ctx = server->ctx;
+	const llama_model* model = llama_get_model(ctx);
+	const int32_t width = embeddings ? llama_model_n_embd(model) : llama_vocab_n_tokens(llama_model_get_vocab(model));
+	int32_t n_rows = 0;
+	for (int32_t i = 0; i < batch.n_tokens; i++) {
+		if (batch.logits[i]) n_rows++;
+	}
+	if (offset + static_cast<jlong>(n_rows) * width > out_capacity) {
+		JNIErrorHandler::throw_illegal_argument(env, "Output needs " + std::to_string((int64_t)n_rows * width) +
+			" floats after offset " + std::to_string(offset));
+		return -1;
+	}
+
+	int result = llama_decode(ctx, batch);
+	if (result != 0) {
+		JNIErrorHandler::throw_runtime_exception(env, "llama_decode failed with " + std::to_string(result));
+		return -1;
+	}
+
+	// One row per flagged token, in batch order. Pooled embeddings are those of the token's sequence.
+	const bool pooled = embeddings && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE;
+	float* row = out + offset;
+	for (int32_t i = 0; i < batch.n_tokens; i++) {
+		if (!batch.logits[i]) continue;
+		const float* values = !embeddings ? llama_get_logits_ith(ctx, i)
+			: pooled ? llama_get_embeddings_seq(ctx, batch.seq_id[i][0])
+			: llama_get_embeddings_ith(ctx, i);
+		if (!values) {
+			JNIErrorHandler::throw_illegal_state(env, embeddings ? "Context does not output embeddings"
+				: "No logits for token " + std::to_string(i));
+			return -1;
+		}
+		std::memcpy(row, values, width * sizeof(float));
+		row += width;
+	}
+	return n_rows;
+}
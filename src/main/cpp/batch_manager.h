@@ -3,6 +3,10 @@
 
 #include <jni.h>
 #include "llama.h"
+#include "server_table.h"
+#include <cstddef>
+
+struct BatchEntry;
 
 class BatchManager {
 public:
@@ -26,9 +30,32 @@ public:
 
 	static jint getBatchTokenCount(JNIEnv* env, jlong batchHandle);
 
+	// Packed batches: one direct buffer in native byte order holding an int32 token count, 4 reserved
+	// bytes, then arrays sized to the batch capacity: int32 tokens (or float embeddings for embedding
+	// batches), int32 positions, int32 sequence ids (one per token) and int8 logit flags.
+	static void fillBatch(JNIEnv* env, jlong batchHandle, jobject packed);
+	// Fill, decode, and write one row of logits or embeddings per flagged token to the direct FloatBuffer
+	// output at offset. Returns the number of rows, or -1 with a pending exception.
+	static jint decodeAndCollect(JNIEnv* env, jobject modelObj, jlong batchHandle, jobject packed,
+		jobject output, jint offset, jboolean embeddings);
+
+	static const size_t PACKED_HEADER_BYTES = 8;
+
 private:
+	struct PackedLayout {
+		size_t inputs;
+		size_t positions;
+		size_t sequence_ids;
+		size_t logit_flags;
+		size_t size;
+	};
+
 	static llama_batch* getBatch(jlong handle);
-	static llama_context* getContext(JNIEnv* env, jobject modelObj);
+	static BatchEntry* getEntry(jlong handle);
+	static PackedLayout packedLayout(const BatchEntry& entry);
+	// Copy a packed buffer into the batch, nullptr with a pending exception if it does not fit
+	static BatchEntry* fillFromPacked(JNIEnv* env, jlong batchHandle, jobject packed);
+	static ServerRef getServer(JNIEnv* env, jobject modelObj);
 };
 
 #endif // BATCH_MANAGER_H
\ No newline at end of file
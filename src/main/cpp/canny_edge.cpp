@@ -0,0 +1,229 @@
+#include "canny_edge.h"
+#include "worker_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static const int ROWS_PER_PART = 32;
+
+// Run fn(first_row, end_row) over blocks of rows, in parallel
+template <typename Fn>
+static void for_rows(int height, Fn fn) {
+    const size_t n_parts = (height + ROWS_PER_PART - 1) / ROWS_PER_PART;
+    WorkerPool::shared().run(n_parts, [&](size_t part) {
+        int first = (int)part * ROWS_PER_PART;
+        fn(first, std::min(height, first + ROWS_PER_PART));
+    });
+}
+
+// Resized gray value of every target pixel, 0.2989 R + 0.5870 G + 0.1140 B in [0, 1]
+static void resize_gray(const uint8_t* src, int src_width, int src_height, int channels,
+                        float* gray, int width, int height) {
+    const float weights_rgb[3] = { 0.2989f / 255.0f, 0.5870f / 255.0f, 0.1140f / 255.0f };
+    const float scale_x = (float)src_width / width;
+    const float scale_y = (float)src_height / height;
+
+    // Source columns and blend factors are the same for every row
+    std::vector<int> x0(width), x1(width);
+    std::vector<float> fx(width);
+    for (int x = 0; x < width; x++) {
+        float sx = std::max(0.0f, (x + 0.5f) * scale_x - 0.5f);
+        x0[x] = std::min((int)sx, src_width - 1);
+        x1[x] = std::min(x0[x] + 1, src_width - 1);
+        fx[x] = sx - x0[x];
+    }
+
+    for_rows(height, [&](int first, int end) {
+        std::vector<float> row0(src_width), row1(src_width);
+        for (int y = first; y < end; y++) {
+            float sy = std::max(0.0f, (y + 0.5f) * scale_y - 0.5f);
+            int y0 = std::min((int)sy, src_height - 1);
+            int y1 = std::min(y0 + 1, src_height - 1);
+            float fy = sy - y0;
+
+            // Gray source rows first, then the bilinear blend
+            for (int pass = 0; pass < 2; pass++) {
+                const uint8_t* in = src + (size_t)(pass ? y1 : y0) * src_width * channels;
+                float* out = pass ? row1.data() : row0.data();
+                if (channels >= 3) {
+                    for (int x = 0; x < src_width; x++) {
+                        const uint8_t* px = in + (size_t)x * channels;
+                        out[x] = px[0] * weights_rgb[0] + px[1] * weights_rgb[1] + px[2] * weights_rgb[2];
+                    }
+                } else {
+                    for (int x = 0; x < src_width; x++) out[x] = in[x] * (1.0f / 255.0f);
+                }
+            }
+            float* target = gray + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                float top = row0[x0[x]] + (row0[x1[x]] - row0[x0[x]]) * fx[x];
+                float bottom = row1[x0[x]] + (row1[x1[x]] - row1[x0[x]]) * fx[x];
+                target[x] = top + (bottom - top) * fy;
+            }
+        }
+    });
+}
+
+// 5x5 Gaussian of sigma 1.4 with zero padding, as two separable passes. The kernel is scaled
+// like stable-diffusion.cpp's, by 1 / (2 pi sigma^2) and not to a sum of 1.
+static void gaussian_blur(float* image, float* scratch, int width, int height) {
+    const float sigma = 1.4f;
+    float kernel[5];
+    for (int i = 0; i < 5; i++) {
+        float d = (float)(i - 2);
+        kernel[i] = std::exp(-d * d / (2.0f * sigma * sigma));
+    }
+    const float normal = 1.0f / (2.0f * (float)M_PI * sigma * sigma);
+
+    for_rows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            const float* in = image + (size_t)y * width;
+            float* out = scratch + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                float sum = 0.0f;
+                for (int k = 0; k < 5; k++) {
+                    int sx = x + k - 2;
+                    if (sx >= 0 && sx < width) sum += kernel[k] * in[sx];
+                }
+                out[x] = sum;
+            }
+        }
+    });
+    for_rows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            float* out = image + (size_t)y * width;
+            std::fill(out, out + width, 0.0f);
+            for (int k = 0; k < 5; k++) {
+                int sy = y + k - 2;
+                if (sy < 0 || sy >= height) continue;
+                const float* in = scratch + (size_t)sy * width;
+                const float weight = kernel[k] * normal;
+                for (int x = 0; x < width; x++) out[x] += weight * in[x];
+            }
+        }
+    });
+}
+
+enum Direction : uint8_t { DIR_0, DIR_45, DIR_90, DIR_135 };
+
+// Sobel gradient magnitude and its direction, quantized to 45 degrees, returns the largest magnitude
+static float sobel(const float* image, float* magnitude, uint8_t* direction, int width, int height) {
+    const float tan_22_5 = 0.41421356f;
+    const float tan_67_5 = 2.41421356f;
+    std::vector<float> row_max((height + ROWS_PER_PART - 1) / ROWS_PER_PART, 0.0f);
+
+    for_rows(height, [&](int first, int end) {
+        std::vector<float> zero(width + 2, 0.0f), above(width + 2), center(width + 2), below(width + 2);
+        auto padded = [&](int y, std::vector<float>& row) {
+            if (y < 0 || y >= height) {
+                row = zero;
+                return;
+            }
+            std::copy(image + (size_t)y * width, image + (size_t)(y + 1) * width, row.begin() + 1);
+            row[0] = row[width + 1] = 0.0f;
+        };
+        float local_max = 0.0f;
+        for (int y = first; y < end; y++) {
+            padded(y - 1, above);
+            padded(y, center);
+            padded(y + 1, below);
+            float* mag = magnitude + (size_t)y * width;
+            uint8_t* dir = direction + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                // Columns x, x + 1, x + 2 of the padded rows are the neighbourhood of x
+                float gx = (above[x + 2] - above[x]) + 2.0f * (center[x + 2] - center[x]) + (below[x + 2] - below[x]);
+                float gy = (above[x] + 2.0f * above[x + 1] + above[x + 2]) - (below[x] + 2.0f * below[x + 1] + below[x + 2]);
+                mag[x] = std::sqrt(gx * gx + gy * gy);
+                float ax = std::fabs(gx), ay = std::fabs(gy);
+                dir[x] = ay <= ax * tan_22_5 ? DIR_0 : ay >= ax * tan_67_5 ? DIR_90 : gx * gy > 0.0f ? DIR_45 : DIR_135;
+            }
+            local_max = std::max(local_max, *std::max_element(mag, mag + width));
+        }
+        row_max[first / ROWS_PER_PART] = local_max;
+    });
+    return *std::max_element(row_max.begin(), row_max.end());
+}
+
+// Thin edges to the local maxima along the gradient and classify them as strong, weak or none
+static void suppress_and_threshold(const float* magnitude, const uint8_t* direction, float* edges,
+                                   int width, int height, float high, float low, const CannyParams& params) {
+    for_rows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            float* out = edges + (size_t)y * width;
+            if (y == 0 || y == height - 1) {
+                std::fill(out, out + width, 0.0f);
+                continue;
+            }
+            const float* row = magnitude + (size_t)y * width;
+            out[0] = out[width - 1] = 0.0f;
+            for (int x = 1; x < width - 1; x++) {
+                // The gradient points up for a positive y, rows grow downwards
+                float q, r;
+                switch (direction[(size_t)y * width + x]) {
+                    case DIR_0:  q = row[x + 1];          r = row[x - 1];          break;
+                    case DIR_45: q = row[x + 1 - width];  r = row[x - 1 + width];  break;
+                    case DIR_90: q = row[x - width];      r = row[x + width];      break;
+                    default:     q = row[x - 1 - width];  r = row[x + 1 + width];  break;
+                }
+                float value = row[x] >= q && row[x] >= r ? row[x] : 0.0f;
+                out[x] = value >= high ? params.strong : value >= low && value > 0.0f ? params.weak : 0.0f;
+            }
+        }
+    });
+}
+
+// Keep weak edges next to a strong one, write the result to every channel
+static void hysteresis_to_image(const float* edges, uint8_t* dst, int width, int height, int channels,
+                                const CannyParams& params) {
+    for_rows(height, [&](int first, int end) {
+        for (int y = first; y < end; y++) {
+            const float* row = edges + (size_t)y * width;
+            uint8_t* out = dst + (size_t)y * width * channels;
+            for (int x = 0; x < width; x++) {
+                float value = row[x];
+                if (value == params.weak && value != params.strong) {
+                    bool strong = false;
+                    for (int dy = -1; dy <= 1 && !strong; dy++) {
+                        int ny = y + dy;
+                        if (ny < 0 || ny >= height) continue;
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int nx = x + dx;
+                            if (nx >= 0 && nx < width && edges[(size_t)ny * width + nx] == params.strong) {
+                                strong = true;
+                                break;
+                            }
+                        }
+                    }
+                    value = strong ? params.strong : 0.0f;
+                }
+                if (params.inverse) value = 1.0f - value;
+                uint8_t level = (uint8_t)std::clamp(value * 255.0f + 0.5f, 0.0f, 255.0f);
+                for (int c = 0; c < channels; c++) out[(size_t)x * channels + c] = level;
+            }
+        }
+    });
+}
+
+bool CannyEdge::detect(const uint8_t* src, int src_width, int src_height, int src_channels,
+                       uint8_t* dst, int dst_width, int dst_height, int dst_channels, const CannyParams& params) {
+    auto valid_channels = [](int channels) { return channels == 1 || channels == 3 || channels == 4; };
+    if (!src || !dst || src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0 ||
+            !valid_channels(src_channels) || !valid_channels(dst_channels)) {
+        return false;
+    }
+
+    const size_t n_pixels = (size_t)dst_width * dst_height;
+    std::vector<float> gray(n_pixels), scratch(n_pixels);
+    std::vector<uint8_t> direction(n_pixels);
+
+    // src is fully read here, before dst is first written
+    resize_gray(src, src_width, src_height, src_channels, gray.data(), dst_width, dst_height);
+    gaussian_blur(gray.data(), scratch.data(), dst_width, dst_height);
+    float max = sobel(gray.data(), scratch.data(), direction.data(), dst_width, dst_height);
+
+    const float high = max * params.high_threshold;
+    const float low = high * params.low_threshold;
+    suppress_and_threshold(scratch.data(), direction.data(), gray.data(), dst_width, dst_height, high, low, params);
+    hysteresis_to_image(gray.data(), dst, dst_width, dst_height, dst_channels, params);
+    return true;
+}
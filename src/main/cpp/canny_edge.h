@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+// Canny edge detection for ControlNet inputs, with the thresholds, weak/strong levels and
+// inversion of stable-diffusion.cpp's preprocess_canny. Thresholds are fractions of the largest
+// gradient: pixels at or above max * high are strong, pixels at or above max * high * low are weak
+// and kept only next to a strong one.
+//
+// Every stage works on whole float rows that the compiler vectorizes and is split into row
+// blocks over the shared worker pool.
+struct CannyParams {
+    float high_threshold = 0.08f;
+    float low_threshold = 0.08f;
+    float weak = 0.8f;
+    float strong = 1.0f;
+    bool inverse = false;
+};
+
+namespace CannyEdge {
+
+// Resize src (bilinear, 1, 3 or 4 channels) to the size of dst while converting it to gray, detect
+// the edges and write them to every channel of dst. src and dst may be the same buffer when the
+// sizes and channels match. Returns false for invalid sizes or channel counts.
+bool detect(const uint8_t* src, int src_width, int src_height, int src_channels,
+            uint8_t* dst, int dst_width, int dst_height, int dst_channels, const CannyParams& params);
+
+}
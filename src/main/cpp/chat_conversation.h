@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include <unordered_set>
+#include "llama.h"
+
+// A chat history whose template rendering and tokens are kept between turns, so that
+// every turn renders and tokenizes only the messages appended since the last one
+struct ChatConversation {
+	std::mutex mutex;
+
+	// Role and content of every message, in order
+	std::vector<std::pair<std::string, std::string>> messages;
+
+	// Template output of the first n_rendered messages, without the generation prompt
+	std::string rendered;
+	std::vector<llama_token> tokens;
+	size_t n_rendered = 0;
+
+	// End of every rendered message, in characters of rendered and in tokens
+	std::vector<size_t> text_ends;
+	std::vector<size_t> token_ends;
+
+	// Roles whose messages were verified to render the same on their own as after the history
+	std::unordered_set<std::string> separable_roles;
+	std::unordered_set<std::string> joined_roles;
+
+	// Text the template appends after the history to open the assistant turn
+	std::string generation_prompt;
+	std::vector<llama_token> generation_tokens;
+	bool has_generation_prompt = false;
+};
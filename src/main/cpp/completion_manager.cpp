@@ -2,101 +2,287 @@
 #include "jni_utils.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
-#include "pattern_preprocessor.h"
+#include "server_table.h"
+#include "template_manager.h"
+#include "completion_request.h"
+#include "adapter_registry.h"
+#include "native_trace.h"
 #include <vector>
 #include <string>
 #include <mutex>
 #include <unordered_map>
 #include <memory>
+#include <algorithm>
 
-// These are defined in jllama.cpp but we need access to them
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
+jint CompletionManager::requestCompletion(JNIEnv* env, jobject obj, jstring params) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return -1;
+	
+	std::string param_str = JniUtils::jstring_to_string(env, params);
+	JNI_LOG_DEBUG("requestCompletion params: %s", param_str.c_str());
+	
+	// All parameters are decoded in one pass over the JSON
+	CompletionRequest request;
+	std::string error;
+	if (!CompletionRequest::from_json(param_str, llama_model_get_vocab(server->model), request, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return -1;
+	}
+	
+	return submitCompletion(server, request);
+	
+	JNI_CATCH_RET(env, -1)
+}
 
-static LlamaServer* get_completion_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
+jint CompletionManager::requestCompletionCallback(JNIEnv* env, jobject obj, jstring params, jobject callback) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return -1;
+	}
+	if (!callback) {
+		JNIErrorHandler::throw_illegal_argument(env, "callback must not be null");
+		return -1;
+	}
+	
+	std::string param_str = JniUtils::jstring_to_string(env, params);
+	CompletionRequest request;
+	std::string error;
+	if (!CompletionRequest::from_json(param_str, llama_model_get_vocab(server->model), request, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return -1;
+	}
+	
+	// Tokens are pushed from the server's dispatcher thread, the caller returns right away
+	request.stream = true;
+	request.push_delivery = true;
+	jint task_id = submitCompletion(server, request);
+	if (task_id < 0) return -1;
+	if (!server->push.add(env, task_id, callback)) {
+		server->release_task(task_id);
+		JNIErrorHandler::throw_illegal_state(env, "Model is closing");
+		return -1;
+	}
+	return task_id;
+	
+	JNI_CATCH_RET(env, -1)
 }
 
-jint CompletionManager::requestCompletion(JNIEnv* env, jobject obj, jstring params) {
+jint CompletionManager::requestCompletionBinary(JNIEnv* env, jobject obj, jobject buffer, jint length) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_completion_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return -1;
+	
+	// The request is read in place from the direct buffer, nothing is copied through the JVM
+	const uint8_t* data = buffer ? static_cast<const uint8_t*>(env->GetDirectBufferAddress(buffer)) : nullptr;
+	jlong capacity = buffer ? env->GetDirectBufferCapacity(buffer) : -1;
+	if (!data || capacity < 0) {
+		JNIErrorHandler::throw_illegal_argument(env, "Completion request must be a direct ByteBuffer");
+		return -1;
+	}
+	if (length < 0 || length > capacity) {
+		JNIErrorHandler::throw_illegal_argument(env, "Completion request length exceeds the buffer");
+		return -1;
+	}
+	
+	CompletionRequest request;
+	std::string error;
+	if (!CompletionRequest::from_binary(data, (size_t)length, llama_model_get_vocab(server->model), request, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return -1;
+	}
+	
+	return submitCompletion(server, request);
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jint CompletionManager::requestConversationCompletion(JNIEnv* env, jobject obj, jlong conversation, jstring params) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return -1;
 	
 	std::string param_str = JniUtils::jstring_to_string(env, params);
-	JNI_LOG_DEBUG("requestCompletion params: %s", param_str.c_str());
+	JNI_LOG_DEBUG("requestConversationCompletion params: %s", param_str.c_str());
 	
-	// Parse JSON parameters
-	int n_predict = parseNPredict(param_str);
-	std::string prompt = parsePrompt(param_str);
-	std::string grammar = parseGrammar(param_str);
+	CompletionRequest request;
+	std::string error;
+	if (!CompletionRequest::from_json(param_str, llama_model_get_vocab(server->model), request, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return -1;
+	}
 	
-	if (prompt.empty()) {
-		prompt = "Hello";  // Fallback prompt
+	// The conversation keeps the tokens of its history, so the prompt shares its prefix with the
+	// previous turn token for token and the scheduler reuses that sequence's KV cache
+	request.prompt_tokens.clear();
+	if (!TemplateManager::conversationPrompt(server, conversation, request.prompt_tokens)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown or empty conversation, or failed to apply chat template");
+		return -1;
 	}
 	
-	// Create task synchronously (with grammar if provided)
-	auto task = std::make_unique<CompletionTask>(server->next_task_id++, prompt, n_predict, grammar);
+	return submitCompletion(server, request);
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jintArray CompletionManager::requestCompletions(JNIEnv* env, jobject obj, jstring params) {
+	JNI_TRY(env)
 	
-	// Tokenize the actual prompt
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return nullptr;
+	}
+	
+	std::string param_str = JniUtils::jstring_to_string(env, params);
+	CompletionRequest request;
+	std::string error;
+	if (!CompletionRequest::from_json(param_str, llama_model_get_vocab(server->model), request, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return nullptr;
+	}
+	if (request.n < 1 || request.n > (int)llama_n_seq_max(server->ctx)) {
+		JNIErrorHandler::throw_illegal_argument(env, "n must be between 1 and the number of parallel sequences");
+		return nullptr;
+	}
+	
+	std::vector<jint> ids;
+	if (submitCompletions(server, request, ids) < 0) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to create completion tasks");
+		return nullptr;
+	}
+	jintArray result = env->NewIntArray((jsize)ids.size());
+	if (!result) return nullptr;
+	env->SetIntArrayRegion(result, 0, (jsize)ids.size(), ids.data());
+	return result;
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jint CompletionManager::submitCompletion(LlamaServer* server, CompletionRequest& request) {
+	// Only requestCompletions hands out the ids of all branches
+	request.n = 1;
+	std::vector<jint> ids;
+	return submitCompletions(server, request, ids);
+}
+
+jint CompletionManager::submitCompletions(LlamaServer* server, CompletionRequest& request, std::vector<jint>& ids) {
 	const llama_vocab* vocab = llama_model_get_vocab(server->model);
-	std::vector<llama_token> tokens;
-	tokens.resize(prompt.length() + 1);
 	
-	int n_tokens = llama_tokenize(vocab, prompt.c_str(), prompt.length(), 
-								  tokens.data(), tokens.size(), true, false);
+	std::vector<llama_token> tokens = std::move(request.prompt_tokens);
+	if (tokens.empty()) {
+		std::string& prompt = request.prompt;
+		if (prompt.empty()) {
+			prompt = "Hello";  // Fallback prompt
+		}
+		
+		// Tokenize the actual prompt
+		JLLAMA_TRACE_SPAN("tokenize", "tokenize_prompt");
+		uint64_t t_tokenize = LatencyHistogram::now_ns();
+		tokens.resize(prompt.length() + 1);
+		
+		int n_tokens = llama_tokenize(vocab, prompt.c_str(), prompt.length(), 
+									  tokens.data(), tokens.size(), true, false);
+		
+		if (n_tokens < 0) {
+			tokens.resize(-n_tokens);
+			n_tokens = llama_tokenize(vocab, prompt.c_str(), prompt.length(),
+									  tokens.data(), tokens.size(), true, false);
+		}
+		
+		if (n_tokens <= 0) return -1;
+		
+		tokens.resize(n_tokens);
+		server->latency.tokenize.record(LatencyHistogram::now_ns() - t_tokenize);
+	}
 	
-	if (n_tokens < 0) {
-		tokens.resize(-n_tokens);
-		n_tokens = llama_tokenize(vocab, prompt.c_str(), prompt.length(),
-								  tokens.data(), tokens.size(), true, false);
+	// A negative n_predict generates until the context is full
+	int n_predict = request.n_predict;
+	if (n_predict < 0) {
+		n_predict = std::max(0, (int)llama_n_ctx(server->ctx) - (int)tokens.size());
 	}
 	
-	if (n_tokens < 0) return -1;
+	// Every branch of an n-best request gets its own sampler, the prompt is prefilled once and forked
+	int n_branches = std::max(1, request.n);
+	std::vector<std::unique_ptr<CompletionTask>> tasks;
+	for (int branch = 0; branch < n_branches; branch++) {
+		std::unique_ptr<CompletionTask> task = buildTask(server, request, tokens, n_predict, branch);
+		if (!task) return -1;
+		tasks.push_back(std::move(task));
+	}
 	
-	tokens.resize(n_tokens);
-	task->prompt_tokens = tokens;
-	task->state = TASK_STATE_PROCESSING_PROMPT;
-	
-	// Clear sequence 0 to ensure a clean state for this new request
-	llama_memory_t memory = llama_get_memory(server->ctx);
-	llama_memory_seq_rm(memory, 0, -1, -1);
-	
-	// Process prompt synchronously
-	llama_batch batch = llama_batch_init(n_tokens, 0, 1);
-	for (int i = 0; i < n_tokens; i++) {
-		batch.token[i] = tokens[i];
-		batch.pos[i] = i;
-		batch.n_seq_id[i] = 1;
-		batch.seq_id[i][0] = 0;
-		batch.logits[i] = (i == n_tokens - 1); // Only compute logits for last token
+	// Prefill and generation run on the server thread, batched with all other active tasks
+	std::vector<int> task_ids;
+	server->submit_group(std::move(tasks), task_ids);
+	ids.assign(task_ids.begin(), task_ids.end());
+	
+	JNI_LOG_DEBUG("requestCompletion created %d task(s) with first id %d, prompt: '%s', grammar: '%s'", 
+		   n_branches, ids.front(), request.prompt.c_str(), request.grammar.c_str());
+	return ids.front();
+}
+
+std::unique_ptr<CompletionTask> CompletionManager::buildTask(LlamaServer* server, const CompletionRequest& request,
+		const std::vector<llama_token>& tokens, int n_predict, int branch) {
+	const llama_vocab* vocab = llama_model_get_vocab(server->model);
+	const std::string& prompt = request.prompt;
+	const std::string& grammar = request.grammar;
+	
+	// The id is assigned by the scheduler on submission
+	auto task = std::make_unique<CompletionTask>(0, prompt, n_predict, grammar);
+	task->stream = request.stream;
+	task->push_delivery = request.push_delivery;
+	task->priority = std::min(std::max(request.priority, 0), TASK_PRIORITY_COUNT - 1);
+	if (request.deadline_ms > 0) {
+		task->t_deadline = LatencyHistogram::now_ns() + (uint64_t)request.deadline_ms * 1000000ull;
 	}
-	batch.n_tokens = n_tokens;
+	task->n_probs = std::max(0, request.n_probs);
+	task->prompt_tokens = tokens;
 	
-	if (llama_decode(server->ctx, batch) != 0) {
-		llama_batch_free(batch);
-		return -1;
+	// Adapters the request names, sorted so that equal sets compare equal; a zero scale is no adapter.
+	// Holding them prefetches the ones that are not resident while the task waits for a sequence.
+	if (request.has_lora) {
+		LoraSet lora;
+		for (const auto& entry : request.lora) {
+			if (AdapterRegistry::model(entry.first) != server->model) return nullptr;
+			auto same = [&entry](const LoraScale& scale) { return scale.handle == entry.first; };
+			lora.erase(std::remove_if(lora.begin(), lora.end(), same), lora.end());
+			if (entry.second != 0.0f) lora.push_back({ entry.first, entry.second });
+		}
+		std::sort(lora.begin(), lora.end(), [](const LoraScale& a, const LoraScale& b) { return a.handle < b.handle; });
+		task->lora_selected = true;
+		task->set_lora(lora);
 	}
 	
-	llama_batch_free(batch);
-	task->current_pos = n_tokens;
-	task->state = TASK_STATE_GENERATING;
+	// Sampling parameters compile into a cached pipeline, requests that set none use the server's greedy sampler.
+	// Branches of an n-best request sample with consecutive seeds so that their candidates differ.
+	llama_sampler* pipeline = nullptr;
+	if (request.has_sampling) {
+		SamplingParams sampling = request.sampling;
+		if (branch > 0 && sampling.seed != LLAMA_DEFAULT_SEED) sampling.seed += (uint32_t)branch;
+		pipeline = server->sampler_cache.acquire(server->model, llama_n_ctx(server->ctx), sampling);
+	}
 	
 	// Create grammar sampler if grammar is provided
 	if (!grammar.empty()) {
 		JNI_LOG_DEBUG("Creating grammar sampler with original grammar: '%s'", grammar.c_str());
 		
-		// Preprocess the regex pattern for llama.cpp's constraint system
-		std::string processed_pattern = PatternPreprocessor::preprocess(grammar);
-		JNI_LOG_DEBUG("Adapted pattern: '%s'", processed_pattern.c_str());
-		
-		// Create a grammar sampler
-		const llama_vocab* vocab = llama_model_get_vocab(server->model);
-		llama_sampler* grammar_sampler = llama_sampler_init_grammar(vocab, processed_pattern.c_str(), "root");
+		// Preprocessed and parsed once per distinct grammar, every task gets a clone
+		llama_sampler* grammar_sampler;
+		{
+			JLLAMA_TRACE_SPAN("grammar", "grammar_acquire");
+			grammar_sampler = server->grammar_cache.acquire(vocab, grammar);
+		}
 		
 		if (grammar_sampler) {
 			// Create a sampler chain that includes the grammar
@@ -105,147 +291,107 @@ jint CompletionManager::requestCompletion(JNIEnv* env, jobject obj, jstring para
 			
 			// Add grammar sampler first to constrain the output
 			llama_sampler_chain_add(chain, grammar_sampler);
-			// Then add greedy sampling
-			llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+			// Then the request's sampling pipeline
+			llama_sampler_chain_add(chain, pipeline ? pipeline : llama_sampler_init_greedy());
 			
 			task->task_sampler = chain;
 			JNI_LOG_DEBUG("Grammar sampler created successfully");
 		} else {
 			JNI_LOG_ERROR("Failed to create grammar sampler - this is a hard error like in original llama.cpp");
+			if (pipeline) llama_sampler_free(pipeline);
 			// Match original llama.cpp behavior: if grammar fails to parse, the entire request fails
-			return -1;  // Return error to indicate grammar parsing failure
+			return nullptr;
 		}
+	} else {
+		task->task_sampler = pipeline;
 	}
-	
-	int task_id = task->id;
-	{
-		std::lock_guard<std::mutex> tasks_lock(server->active_tasks_mutex);
-		server->active_tasks[task_id] = std::move(task);
-	}
-	
-	JNI_LOG_DEBUG("requestCompletion created task with id %d, prompt: '%s', grammar: '%s'", 
-		   task_id, prompt.c_str(), grammar.c_str());
-	return task_id;
-	
-	JNI_CATCH_RET(env, -1)
+	return task;
 }
 
 jobject CompletionManager::receiveCompletion(JNIEnv* env, jobject obj, jint id) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_completion_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNI_LOG_DEBUG("receiveCompletion server is null for id %d", id);
 		return nullptr;
 	}
 	
-	// Find the task
-	std::lock_guard<std::mutex> tasks_lock(server->active_tasks_mutex);
-	auto task_it = server->active_tasks.find(id);
-	if (task_it == server->active_tasks.end()) {
+	// Wait for the scheduler to produce the next piece of this task
+	TaskResult result(id, "");
+	if (!server->wait_result(id, result)) {
 		JNI_LOG_DEBUG("receiveCompletion task not found for id %d", id);
 		return nullptr;
 	}
 	
-	CompletionTask* task = task_it->second.get();
-	if (task->cancelled) return nullptr;
-	
-	// Check if we've reached the generation limit BEFORE generating a new token
-	if (task->generated_tokens.size() >= task->n_predict) {
-		// Return final result - we've reached the limit
-		jclass output_class = env->FindClass("de/kherud/llama/LlamaOutput");
-		if (!output_class) return nullptr;
-		
-		jmethodID constructor = env->GetMethodID(output_class, "<init>", "([BLjava/util/Map;Z)V");
-		if (!constructor) return nullptr;
-		
-		// Return empty byte array to signal completion
-		jbyteArray byte_array = env->NewByteArray(0);
-		
-		jclass hashmap_class = env->FindClass("java/util/HashMap");
-		jmethodID hashmap_init = env->GetMethodID(hashmap_class, "<init>", "()V");
-		jobject probabilities = env->NewObject(hashmap_class, hashmap_init);
-		
-		return env->NewObject(output_class, constructor, byte_array, probabilities, (jboolean)true);
+	if (result.is_error) {
+		JNIErrorHandler::throw_runtime_exception(env, result.error_msg);
+		return nullptr;
 	}
 	
-	// Generate one token synchronously (use task-specific sampler if available, e.g., for grammar)
-	llama_sampler* sampler_to_use = task->task_sampler ? task->task_sampler : server->sampler;
-	llama_token new_token = llama_sampler_sample(sampler_to_use, server->ctx, -1);
+	// Streaming results carry only the new token's text piece, not the cumulative text
+	uint64_t t_marshal = LatencyHistogram::now_ns();
+	const TokenProbs& top = result.top_probs;
+	jobject output = JniUtils::new_llama_output(env, result.text.data(), result.text.length(), nullptr, result.is_final,
+		reinterpret_cast<const jint*>(top.ids.data()), top.probs.data(), top.ids.size());
+	server->latency.marshal.record(LatencyHistogram::now_ns() - t_marshal);
+	return output;
 	
-	// Accept the token to update grammar state if using task-specific sampler
-	if (task->task_sampler) {
-		llama_sampler_accept(task->task_sampler, new_token);
-	}
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jobject CompletionManager::receiveCompletionChunk(JNIEnv* env, jobject obj, jint id, jint max_tokens, jlong timeout_ms) {
+	JNI_TRY(env)
 	
-	// Check for end of generation
-	const llama_vocab* vocab = llama_model_get_vocab(server->model);
-	if (llama_vocab_is_eog(vocab, new_token)) {
-		jclass output_class = env->FindClass("de/kherud/llama/LlamaOutput");
-		if (!output_class) return nullptr;
-		
-		jmethodID constructor = env->GetMethodID(output_class, "<init>", "([BLjava/util/Map;Z)V");
-		if (!constructor) return nullptr;
-		
-		jbyteArray byte_array = env->NewByteArray(task->current_text.length());
-		env->SetByteArrayRegion(byte_array, 0, task->current_text.length(), 
-							   (jbyte*)task->current_text.data());
-		
-		jclass hashmap_class = env->FindClass("java/util/HashMap");
-		jmethodID hashmap_init = env->GetMethodID(hashmap_class, "<init>", "()V");
-		jobject probabilities = env->NewObject(hashmap_class, hashmap_init);
-		
-		return env->NewObject(output_class, constructor, byte_array, probabilities, (jboolean)true);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return nullptr;
 	}
 	
-	// Add token to generation
-	task->generated_tokens.push_back(new_token);
-	
-	// Convert token to text
-	char piece[256];
-	int piece_len = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, true);
-	if (piece_len > 0) {
-		task->current_text.append(piece, piece_len);
-		if (task->task_sampler) {
-			JNI_LOG_DEBUG("Grammar generated token: %d -> '%.*s', total text: '%s'", 
-				   new_token, piece_len, piece, task->current_text.c_str());
-		}
+	if (max_tokens <= 0) {
+		JNIErrorHandler::throw_illegal_argument(env, "maxTokens must be positive");
+		return nullptr;
 	}
 	
-	// Process next token for context
-	llama_batch batch = llama_batch_init(1, 0, 1);
-	batch.token[0] = new_token;
-	batch.pos[0] = task->current_pos++;
-	batch.n_seq_id[0] = 1;
-	batch.seq_id[0][0] = 0;
-	batch.logits[0] = true;
-	batch.n_tokens = 1;
-	
-	if (llama_decode(server->ctx, batch) != 0) {
-		llama_batch_free(batch);
+	std::vector<TaskResult> results;
+	if (!server->wait_results(id, (size_t)max_tokens, (int64_t)timeout_ms, results)) {
+		JNIErrorHandler::throw_illegal_state(env, "Unknown completion task " + std::to_string(id));
 		return nullptr;
 	}
 	
-	llama_batch_free(batch);
-	
-	// Return partial result (just the new token's text, not cumulative)
-	jclass output_class = env->FindClass("de/kherud/llama/LlamaOutput");
-	if (!output_class) return nullptr;
-	
-	jmethodID constructor = env->GetMethodID(output_class, "<init>", "([BLjava/util/Map;Z)V");
-	if (!constructor) return nullptr;
-	
-	// Only return the new token's text piece, not the cumulative text
-	jbyteArray byte_array = env->NewByteArray(piece_len);
-	env->SetByteArrayRegion(byte_array, 0, piece_len, (jbyte*)piece);
-	
-	jclass hashmap_class = env->FindClass("java/util/HashMap");
-	jmethodID hashmap_init = env->GetMethodID(hashmap_class, "<init>", "()V");
-	jobject probabilities = env->NewObject(hashmap_class, hashmap_init);
+	// Pack all pieces into one byte buffer, token i spans offsets[i] to offsets[i + 1]
+	uint64_t t_marshal = LatencyHistogram::now_ns();
+	std::string bytes;
+	std::vector<jint> tokens;
+	std::vector<jint> offsets;
+	std::vector<jint> top_tokens;
+	std::vector<float> top_probs;
+	bool stop = false;
+	
+	tokens.reserve(results.size());
+	offsets.reserve(results.size() + 1);
+	for (const TaskResult& result : results) {
+		if (result.is_error) {
+			JNIErrorHandler::throw_runtime_exception(env, result.error_msg);
+			return nullptr;
+		}
+		if (result.token >= 0) {
+			tokens.push_back(result.token);
+			offsets.push_back((jint)bytes.size());
+		}
+		bytes += result.text;
+		top_tokens.insert(top_tokens.end(), result.top_probs.ids.begin(), result.top_probs.ids.end());
+		top_probs.insert(top_probs.end(), result.top_probs.probs.begin(), result.top_probs.probs.end());
+		stop = stop || result.is_final;
+	}
+	offsets.push_back((jint)bytes.size());
 	
-	return env->NewObject(output_class, constructor, byte_array, probabilities, (jboolean)false);
+	jobject chunk = JniUtils::new_llama_chunk(env, bytes, tokens, offsets, stop, top_tokens, top_probs);
+	server->latency.marshal.record(LatencyHistogram::now_ns() - t_marshal);
+	return chunk;
 	
 	JNI_CATCH_RET(env, nullptr)
 }
@@ -253,16 +399,11 @@ jobject CompletionManager::receiveCompletion(JNIEnv* env, jobject obj, jint id)
 void CompletionManager::cancelCompletion(JNIEnv* env, jobject obj, jint id) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_completion_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return;
 	
-	std::lock_guard<std::mutex> tasks_lock(server->active_tasks_mutex);
-	auto task_it = server->active_tasks.find(id);
-	if (task_it != server->active_tasks.end()) {
-		task_it->second->cancelled = true;
-	}
+	server->cancel_task(id);
 	
 	JNI_CATCH(env)
 }
@@ -270,123 +411,12 @@ void CompletionManager::cancelCompletion(JNIEnv* env, jobject obj, jint id) {
 void CompletionManager::releaseTask(JNIEnv* env, jobject obj, jint id) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_completion_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return;
 	
-	// Clean up task
-	{
-		std::lock_guard<std::mutex> tasks_lock(server->active_tasks_mutex);
-		server->active_tasks.erase(id);
-	}
-	{
-		std::lock_guard<std::mutex> result_lock(server->result_mutex);
-		server->task_results.erase(id);
-	}
+	// The server thread frees the task and its sequence on its next step
+	server->release_task(id);
 	
 	JNI_CATCH(env)
 }
-
-// Helper functions for JSON parsing
-int CompletionManager::parseNPredict(const std::string& json) {
-	int n_predict = 10;  // Default value
-	
-	// Simple JSON parsing for n_predict - look for "n_predict":value pattern
-	size_t pos = json.find("\"n_predict\":");
-	if (pos != std::string::npos) {
-		size_t start = json.find_first_of("0123456789", pos);
-		if (start != std::string::npos) {
-			size_t end = json.find_first_not_of("0123456789", start);
-			if (end != std::string::npos) {
-				std::string num_str = json.substr(start, end - start);
-				n_predict = std::stoi(num_str);
-			}
-		}
-	}
-	
-	return n_predict;
-}
-
-std::string CompletionManager::parsePrompt(const std::string& json) {
-	std::string prompt;
-	
-	// Parse prompt - look for "prompt":"value" pattern
-	size_t pos = json.find("\"prompt\":");
-	if (pos != std::string::npos) {
-		size_t start = json.find('"', pos + 9);  // Find opening quote after "prompt":
-		if (start != std::string::npos) {
-			start++; // Move past opening quote
-			size_t end = start;
-			// Find closing quote, handling escaped quotes
-			while (end < json.length()) {
-				if (json[end] == '"' && (end == start || json[end - 1] != '\\')) {
-					break;
-				}
-				end++;
-			}
-			if (end < json.length()) {
-				prompt = json.substr(start, end - start);
-			}
-		}
-	}
-	
-	return prompt;
-}
-
-std::string CompletionManager::parseGrammar(const std::string& json) {
-	std::string grammar;
-	
-	// Parse grammar - look for "grammar":"value" pattern
-	size_t pos = json.find("\"grammar\":");
-	if (pos != std::string::npos) {
-		size_t start = json.find('"', pos + 10);  // Find opening quote after "grammar":
-		if (start != std::string::npos) {
-			start++; // Move past opening quote
-			size_t end = start;
-			// Find closing quote, handling escaped quotes and escaped backslashes
-			while (end < json.length()) {
-				if (json[end] == '"') {
-					// Count preceding backslashes
-					int backslash_count = 0;
-					int check_pos = end - 1;
-					while (check_pos >= (int)start && json[check_pos] == '\\') {
-						backslash_count++;
-						check_pos--;
-					}
-					// If even number of backslashes (or zero), the quote is not escaped
-					if (backslash_count % 2 == 0) {
-						break;
-					}
-				}
-				end++;
-			}
-			if (end < json.length()) {
-				grammar = json.substr(start, end - start);
-				grammar = unescapeString(grammar);
-			}
-		}
-	}
-	
-	return grammar;
-}
-
-std::string CompletionManager::unescapeString(const std::string& str) {
-	std::string unescaped;
-	for (size_t i = 0; i < str.length(); i++) {
-		if (str[i] == '\\' && i + 1 < str.length()) {
-			if (str[i + 1] == '"') {
-				unescaped += '"';
-				i++;
-			} else if (str[i + 1] == '\\') {
-				unescaped += '\\';
-				i++;
-			} else {
-				unescaped += str[i];
-			}
-		} else {
-			unescaped += str[i];
-		}
-	}
-	return unescaped;
-}
\ No newline at end of file
@@ -3,16 +3,37 @@
 
 #include <jni.h>
 #include <string>
+#include <vector>
+#include <memory>
 #include "llama.h"
 
+struct LlamaServer;
+struct CompletionRequest;
+class CompletionTask;
+
 class CompletionManager {
 public:
 	// Request a new completion
 	static jint requestCompletion(JNIEnv* env, jobject obj, jstring params);
 	
+	// Request a streamed completion whose outputs are pushed to a LlamaModel.CompletionCallback
+	static jint requestCompletionCallback(JNIEnv* env, jobject obj, jstring params, jobject callback);
+	
+	// Request a completion encoded in a direct ByteBuffer, see CompletionRequest::from_binary
+	static jint requestCompletionBinary(JNIEnv* env, jobject obj, jobject buffer, jint length);
+	
+	// Request the n candidate completions of a request, returns the task id of every branch
+	static jintArray requestCompletions(JNIEnv* env, jobject obj, jstring params);
+	
+	// Request a completion continuing a chat conversation, its cached tokens are used as the prompt
+	static jint requestConversationCompletion(JNIEnv* env, jobject obj, jlong conversation, jstring params);
+	
 	// Receive completion results
 	static jobject receiveCompletion(JNIEnv* env, jobject obj, jint id);
 	
+	// Receive up to max_tokens results in one packed LlamaChunk, waiting at most timeout_ms for the first
+	static jobject receiveCompletionChunk(JNIEnv* env, jobject obj, jint id, jint max_tokens, jlong timeout_ms);
+	
 	// Cancel a completion
 	static void cancelCompletion(JNIEnv* env, jobject obj, jint id);
 	
@@ -20,11 +41,15 @@ public:
 	static void releaseTask(JNIEnv* env, jobject obj, jint id);
 
 private:
-	// Helper functions for JSON parsing
-	static int parseNPredict(const std::string& json);
-	static std::string parsePrompt(const std::string& json);
-	static std::string parseGrammar(const std::string& json);
-	static std::string unescapeString(const std::string& str);
+	// Tokenize the prompt if needed, configure sampling and hand the task to the scheduler
+	static jint submitCompletion(LlamaServer* server, CompletionRequest& request);
+	
+	// Same for all n branches of a request, which share one prefill; returns the id of the first
+	static jint submitCompletions(LlamaServer* server, CompletionRequest& request, std::vector<jint>& ids);
+	
+	// The task of one branch, nullptr if its grammar does not parse
+	static std::unique_ptr<CompletionTask> buildTask(LlamaServer* server, const CompletionRequest& request,
+		const std::vector<llama_token>& tokens, int n_predict, int branch);
 };
 
 #endif // COMPLETION_MANAGER_H
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "completion_request.h"
+#include <nlohmann/json.hpp>
+#include <cstring>
+
+using json = nlohmann::json;
+
+static bool valid_tokens(const std::vector<llama_token>& tokens, const llama_vocab* vocab) {
+	const int n_vocab = llama_vocab_n_tokens(vocab);
+	for (llama_token token : tokens) {
+		if (token < 0 || token >= n_vocab) return false;
+	}
+	return true;
+}
+
+bool CompletionRequest::from_json(const std::string& text, const llama_vocab* vocab, CompletionRequest& out,
+		std::string& error) {
+	json request = json::parse(text, nullptr, false);
+	if (!request.is_object()) {
+		error = "Completion parameters are not a JSON object";
+		return false;
+	}
+
+	// A prompt is either text or, like llama.cpp's server accepts it, an array of token ids
+	auto prompt = request.find("prompt");
+	if (prompt != request.end()) {
+		if (prompt->is_string()) {
+			out.prompt = prompt->get<std::string>();
+		} else if (prompt->is_array()) {
+			out.prompt_tokens.reserve(prompt->size());
+			for (const json& token : *prompt) {
+				if (!token.is_number_integer()) {
+					error = "Prompt token arrays must contain integers only";
+					return false;
+				}
+				out.prompt_tokens.push_back(token.get<llama_token>());
+			}
+			if (!valid_tokens(out.prompt_tokens, vocab)) {
+				error = "Prompt token outside of the vocabulary";
+				return false;
+			}
+		}
+	}
+
+	auto get = [&](const char* name, auto& value) {
+		auto it = request.find(name);
+		if (it != request.end() && !it->is_null()) value = it->get<std::decay_t<decltype(value)>>();
+	};
+	try {
+		get("n_predict", out.n_predict);
+		get("grammar", out.grammar);
+		get("stream", out.stream);
+		get("n_probs", out.n_probs);
+		get("n", out.n);
+		get("priority", out.priority);
+		get("deadline_ms", out.deadline_ms);
+
+		// Like llama.cpp's server: [{"id": adapter, "scale": 1.0}, ...], with adapter handles as ids
+		auto lora = request.find("lora");
+		if (lora != request.end() && !lora->is_null()) {
+			if (!lora->is_array()) {
+				error = "lora must be an array of adapters";
+				return false;
+			}
+			out.has_lora = true;
+			for (const json& adapter : *lora) {
+				if (!adapter.is_object() || !adapter.contains("id")) {
+					error = "Every lora entry needs an adapter id";
+					return false;
+				}
+				out.lora.emplace_back(adapter.at("id").get<int64_t>(), adapter.value("scale", 1.0f));
+			}
+		}
+	} catch (const json::exception& e) {
+		error = std::string("Invalid completion parameter: ") + e.what();
+		return false;
+	}
+
+	out.has_sampling = SamplingParams::parse(request, vocab, out.sampling);
+	return true;
+}
+
+// Bounds-checked reader over the binary encoding
+namespace {
+struct BinaryReader {
+	const uint8_t* data;
+	size_t size;
+	size_t pos = 0;
+
+	template <typename T>
+	bool read(T& value) {
+		if (size - pos < sizeof(T)) return false;
+		std::memcpy(&value, data + pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
+	}
+
+	bool read_bytes(size_t n, std::string& out) {
+		if (size - pos < n) return false;
+		out.assign(reinterpret_cast<const char*>(data + pos), n);
+		pos += n;
+		return true;
+	}
+};
+}
+
+bool CompletionRequest::from_binary(const uint8_t* data, size_t size, const llama_vocab* vocab,
+		CompletionRequest& out, std::string& error) {
+	BinaryReader reader{ data, size };
+
+	uint32_t magic, flags;
+	int32_t n_predict, n_probs, n_prompt_tokens, n_prompt_bytes, n_grammar_bytes, n_logit_bias, priority, deadline_ms;
+	if (!reader.read(magic) || !reader.read(flags) || !reader.read(n_predict) || !reader.read(n_probs) ||
+			!reader.read(n_prompt_tokens) || !reader.read(n_prompt_bytes) || !reader.read(n_grammar_bytes) ||
+			!reader.read(n_logit_bias) || !reader.read(priority) || !reader.read(deadline_ms)) {
+		error = "Truncated completion request header";
+		return false;
+	}
+	if (magic != BINARY_MAGIC) {
+		error = "Not a binary completion request";
+		return false;
+	}
+	if (n_prompt_tokens < 0 || n_prompt_bytes < 0 || n_grammar_bytes < 0 || n_logit_bias < 0) {
+		error = "Negative length in completion request";
+		return false;
+	}
+
+	out.n_predict = n_predict;
+	out.n_probs = n_probs;
+	out.stream = (flags & FLAG_STREAM) != 0;
+	out.priority = priority;
+	out.deadline_ms = deadline_ms;
+
+	SamplingParams& s = out.sampling;
+	if (!reader.read(s.temperature) || !reader.read(s.dynatemp_range) || !reader.read(s.dynatemp_exponent) ||
+			!reader.read(s.top_k) || !reader.read(s.top_p) || !reader.read(s.min_p) || !reader.read(s.typical_p) ||
+			!reader.read(s.min_keep) || !reader.read(s.repeat_last_n) || !reader.read(s.repeat_penalty) ||
+			!reader.read(s.frequency_penalty) || !reader.read(s.presence_penalty) || !reader.read(s.dry_multiplier) ||
+			!reader.read(s.dry_base) || !reader.read(s.dry_allowed_length) || !reader.read(s.dry_penalty_last_n) ||
+			!reader.read(s.seed)) {
+		error = "Truncated completion request sampling parameters";
+		return false;
+	}
+
+	// Token ids are 32 bit on both sides, so the prompt is copied as it is
+	static_assert(sizeof(llama_token) == sizeof(int32_t), "llama_token must be 32 bit");
+	if ((size - reader.pos) / sizeof(llama_token) < (size_t)n_prompt_tokens) {
+		error = "Truncated completion request prompt tokens";
+		return false;
+	}
+	out.prompt_tokens.resize(n_prompt_tokens);
+	if (n_prompt_tokens > 0) {
+		std::memcpy(out.prompt_tokens.data(), data + reader.pos, n_prompt_tokens * sizeof(llama_token));
+		reader.pos += n_prompt_tokens * sizeof(llama_token);
+	}
+	if (!valid_tokens(out.prompt_tokens, vocab)) {
+		error = "Prompt token outside of the vocabulary";
+		return false;
+	}
+
+	const int n_vocab = llama_vocab_n_tokens(vocab);
+	s.logit_bias.reserve(n_logit_bias);
+	for (int32_t i = 0; i < n_logit_bias; i++) {
+		llama_logit_bias entry;
+		if (!reader.read(entry.token) || !reader.read(entry.bias)) {
+			error = "Truncated completion request logit bias";
+			return false;
+		}
+		if (entry.token >= 0 && entry.token < n_vocab) s.logit_bias.push_back(entry);
+	}
+
+	if (!reader.read_bytes(n_prompt_bytes, out.prompt) || !reader.read_bytes(n_grammar_bytes, out.grammar)) {
+		error = "Truncated completion request text";
+		return false;
+	}
+
+	out.has_sampling = (flags & FLAG_SAMPLING) != 0;
+	if (out.has_sampling) s.update_key();
+	return true;
+}
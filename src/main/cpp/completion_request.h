@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include "llama.h"
+#include "sampler_pipeline.h"
+#include "completion_task.h"
+
+// A completion request decoded in one pass, either from its JSON params or from the binary
+// encoding written by de.kherud.llama.CompletionRequest.
+//
+// The binary encoding is in native byte order, all fields are 32 bit:
+//   header    magic, flags, n_predict, n_probs, n_prompt_tokens, n_prompt_bytes, n_grammar_bytes, n_logit_bias,
+//             priority, deadline_ms
+//   sampling  temperature, dynatemp_range, dynatemp_exponent, top_k, top_p, min_p, typical_p, min_keep,
+//             repeat_last_n, repeat_penalty, frequency_penalty, presence_penalty, dry_multiplier, dry_base,
+//             dry_allowed_length, dry_penalty_last_n, seed (only used when FLAG_SAMPLING is set)
+//   body      prompt tokens, logit bias pairs (token, bias), prompt UTF-8 bytes, grammar UTF-8 bytes
+struct CompletionRequest {
+	static constexpr uint32_t BINARY_MAGIC = 0x4C524331;  // "LRC1"
+	static constexpr uint32_t FLAG_STREAM = 1u << 0;
+	static constexpr uint32_t FLAG_SAMPLING = 1u << 1;
+	static constexpr size_t BINARY_HEADER_FIELDS = 10;
+	static constexpr size_t BINARY_SAMPLING_FIELDS = 17;
+
+	std::string prompt;
+	std::vector<llama_token> prompt_tokens;  // Set for pre-tokenized prompts, which skip tokenization
+	int n_predict = 10;
+	std::string grammar;
+	bool stream = true;
+	int n_probs = 0;
+	int n = 1;  // Candidate completions sharing the prefill of the prompt
+	bool push_delivery = false;  // Set by the JNI call for callback-driven completions
+	int priority = TASK_PRIORITY_NORMAL;
+	int64_t deadline_ms = 0;     // Milliseconds after submission the request must be done in, 0 for none
+
+	// LoRA adapter handles and scales the request decodes with, JSON only. Without has_lora the
+	// server's default adapters are used, an empty set selects the base model.
+	bool has_lora = false;
+	std::vector<std::pair<int64_t, float>> lora;
+
+	// False if the request sets no sampling parameter, the server's greedy sampler is used then
+	bool has_sampling = false;
+	SamplingParams sampling;
+
+	// Decode a request, on failure error describes the problem
+	static bool from_json(const std::string& text, const llama_vocab* vocab, CompletionRequest& out, std::string& error);
+	static bool from_binary(const uint8_t* data, size_t size, const llama_vocab* vocab, CompletionRequest& out,
+		std::string& error);
+};
@@ -1,7 +1,13 @@
 #include "completion_task.h"
+#include "adapter_registry.h"
 
 CompletionTask::CompletionTask(int task_id, const std::string& p, int predict, const std::string& g) 
-	: id(task_id), prompt(p), grammar(g), n_predict(predict) {
+	: id(task_id), prompt(p), grammar(g), generated_tokens(ArenaAllocator<llama_token>(*arena)),
+	  n_predict(predict), draft_tokens(ArenaAllocator<llama_token>(*arena)) {
+	// Growing in an arena leaves the old buffers behind, size for the usual request up front
+	if (n_predict > 0) {
+		generated_tokens.reserve(std::min(n_predict, 4096));
+	}
 }
 
 CompletionTask::~CompletionTask() {
@@ -9,4 +15,18 @@ CompletionTask::~CompletionTask() {
 		llama_sampler_free(task_sampler);
 		task_sampler = nullptr;
 	}
+	set_lora({});
+}
+
+void CompletionTask::set_lora(const LoraSet& set) {
+	LoraSet held;
+	for (const LoraScale& entry : set) {
+		LoraScale scale = entry;
+		if (AdapterRegistry::hold(entry.handle, false, scale.adapter)) held.push_back(scale);
+	}
+	for (const LoraScale& entry : lora) {
+		AdapterRegistry::release(entry.handle);
+	}
+	lora = std::move(held);
+	lora_key = lora_set_key(lora);
 }
\ No newline at end of file
@@ -4,31 +4,178 @@
 #include <vector>
 #include <atomic>
 #include <mutex>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include "llama.h"
+#include "memory_manager.h"
 
 enum TaskState {
     TASK_STATE_PENDING,
     TASK_STATE_PROCESSING_PROMPT,
     TASK_STATE_GENERATING,
     TASK_STATE_COMPLETED,
-    TASK_STATE_CANCELLED
+    TASK_STATE_CANCELLED,
+    TASK_STATE_SWAPPED   // Preempted, its KV state waits in host memory for a free sequence
+};
+
+// Scheduling classes, a waiting task is admitted before all tasks of the classes after it
+enum TaskPriority {
+    TASK_PRIORITY_INTERACTIVE,
+    TASK_PRIORITY_NORMAL,
+    TASK_PRIORITY_BATCH,
+    TASK_PRIORITY_COUNT
+};
+
+// Most probable candidates of the distributions tokens were sampled from, n_probs entries per token, best first
+struct TokenProbs {
+    std::vector<llama_token> ids;
+    std::vector<float> probs;
+};
+
+// A LoRA adapter of the AdapterRegistry and the scale a task decodes with it
+struct LoraScale {
+    int64_t handle;
+    float scale;
+    llama_adapter_lora* adapter = nullptr;  // Resolved once the adapter is resident
+
+    bool operator==(const LoraScale& other) const { return handle == other.handle && scale == other.scale; }
+    bool operator!=(const LoraScale& other) const { return !(*this == other); }
+};
+
+// Adapters of a task sorted by handle, empty for the base model
+using LoraSet = std::vector<LoraScale>;
+
+// Tells apart the KV states computed with different adapter sets, 0 for the base model
+inline uint64_t lora_set_key(const LoraSet& set) {
+    uint64_t key = 0;
+    for (const LoraScale& lora : set) {
+        uint32_t scale_bits;
+        std::memcpy(&scale_bits, &lora.scale, sizeof(scale_bits));
+        key = (key ^ (uint64_t)lora.handle) * 1099511628211ull;
+        key = (key ^ scale_bits) * 1099511628211ull;
+    }
+    return key;
+}
+
+struct TaskResult {
+    int task_id;
+    std::string text;
+    bool is_final;
+    bool is_error;
+    std::string error_msg;
+    llama_token token = -1;  // Generated token behind text, -1 for final and error results
+    TokenProbs top_probs;    // Filled when the task requested n_probs
+
+    TaskResult(int id = -1, const std::string& t = "", bool final = false, bool error = false, const std::string& err = "")
+        : task_id(id), text(t), is_final(final), is_error(error), error_msg(err) {}
+};
+
+// FIFO of results between the server thread and the Java reader, stored in a ring of preallocated slots.
+// The scheduler stops generating for a task while it holds CompletionTask::max_pending_results, so the
+// ring only grows past its initial capacity if one step emits more than the slack (long speculative runs).
+class TaskResultRing {
+public:
+    explicit TaskResultRing(size_t capacity) : slots_(std::max<size_t>(capacity, 1)) {}
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    TaskResult& front() { return slots_[head_]; }
+    TaskResult& back() { return slots_[(head_ + size_ - 1) % slots_.size()]; }
+
+    void push(TaskResult&& result) {
+        if (size_ == slots_.size()) grow();
+        slots_[(head_ + size_) % slots_.size()] = std::move(result);
+        size_++;
+    }
+
+    void pop() {
+        slots_[head_] = TaskResult();
+        head_ = (head_ + 1) % slots_.size();
+        size_--;
+    }
+
+    void clear() {
+        while (!empty()) pop();
+        head_ = 0;
+    }
+
+private:
+    void grow() {
+        std::vector<TaskResult> slots(slots_.size() * 2);
+        for (size_t i = 0; i < size_; i++) {
+            slots[i] = std::move(slots_[(head_ + i) % slots_.size()]);
+        }
+        slots_.swap(slots);
+        head_ = 0;
+    }
+
+    std::vector<TaskResult> slots_;
+    size_t head_ = 0;
+    size_t size_ = 0;
 };
 
 class CompletionTask {
 public:
+    // Memory of the request, reset and back in the shared pool once the task is freed.
+    // Declared first so that it outlives the containers allocating from it.
+    PooledArena arena;
+
     int id;
     std::string prompt;
     std::string grammar;  // Grammar string for constrained generation
     llama_sampler* task_sampler = nullptr;  // Task-specific sampler (with grammar if provided)
     TaskState state = TASK_STATE_PENDING;
     std::vector<llama_token> prompt_tokens;
-    std::vector<llama_token> generated_tokens;
+    ArenaVector<llama_token> generated_tokens;
     std::string current_text;
+    std::string pending_bytes;  // Streamed text held back until its UTF-8 sequence is complete
     int n_predict = 10;
     int current_pos = 0;
+    bool stream = true;  // Stream per-token pieces instead of one final result
+    int n_probs = 0;     // Number of top token probabilities to report per generated token
+    TokenProbs all_probs;  // Probabilities of all generated tokens, reported with the final result when not streaming
     std::atomic<bool> cancelled{false};
+    std::atomic<bool> released{false};  // Java side is done, server thread may free the task
+    bool push_delivery = false;  // Results are delivered to a callback by the server's PushDispatcher
+    int priority = TASK_PRIORITY_NORMAL;
+    uint64_t t_deadline = 0;     // LatencyHistogram::now_ns time the task must be done by, 0 for none
+    bool lora_selected = false;  // The request named its adapters, other tasks take the server's default set
+    LoraSet lora;                // Adapters the task decodes with and holds, fixed once it has a sequence
+    uint64_t lora_key = 0;       // lora_set_key of lora
+
+    // Scheduler state, owned by the server thread
+    llama_seq_id seq_id = -1;     // KV sequence assigned while the task is running
+    size_t n_prefilled = 0;       // Prompt tokens already submitted for decoding
+    int n_keep = 0;               // Leading tokens a context shift never discards
+    llama_token last_token = 0;   // Sampled token waiting to be decoded
+    int i_batch = -1;             // Index of this task's logits in the current batch
+    std::vector<llama_token> cache_tokens;  // Tokens submitted to the KV sequence so far
+    ArenaVector<llama_token> draft_tokens;  // Speculative tokens decoded after last_token in this step
+    size_t n_draft_past = 0;                // Tokens of cache_tokens already in the draft context
+    int n_reserved = 0;                     // KV cells projected for the task while it holds a sequence
+    std::vector<uint8_t> swapped_state;     // Sequence state of a preempted task
+    TaskState swapped_from = TASK_STATE_PENDING;  // State to continue in once it is restored
+    std::vector<int> fork_ids;              // Branches of an n-best request forked from this task's prompt
+
+    // Latency timestamps in LatencyHistogram::now_ns time, 0 until reached
+    uint64_t t_submitted = 0;
+    uint64_t t_admitted = 0;
+    uint64_t t_last_token = 0;
+
+    // Results produced by the server thread, guarded by mutex. Generation pauses while
+    // max_pending_results are unread, the final result is always accepted.
+    static constexpr size_t max_pending_results = 64;
+    TaskResultRing results{max_pending_results + 16};
     std::mutex mutex;
+    std::condition_variable result_cv;
     
     CompletionTask(int task_id, const std::string& p, int predict = 10, const std::string& g = "");
     ~CompletionTask();
+
+    // Decode with set, holding its adapters in the AdapterRegistry instead of the previous ones.
+    // Adapters that are not resident yet are prefetched.
+    void set_lora(const LoraSet& set);
 };
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include "device_placement.h"
+#include "jni_logger.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <mutex>
+#include <set>
+
+static std::vector<std::string> split_list(const std::string& list) {
+	std::vector<std::string> items;
+	size_t pos = 0;
+	while (pos <= list.size()) {
+		size_t next = list.find(',', pos);
+		if (next == std::string::npos) next = list.size();
+		std::string item = list.substr(pos, next - pos);
+		item.erase(0, item.find_first_not_of(" \t"));
+		item.erase(item.find_last_not_of(" \t") + 1);
+		if (!item.empty()) items.push_back(item);
+		pos = next + 1;
+	}
+	return items;
+}
+
+static const char* device_type_name(ggml_backend_dev_t dev) {
+	switch (ggml_backend_dev_type(dev)) {
+		case GGML_BACKEND_DEVICE_TYPE_CPU: return "cpu";
+		case GGML_BACKEND_DEVICE_TYPE_GPU: return "gpu";
+		default: return "accel";
+	}
+}
+
+bool DevicePlacement::add_rpc_servers(const std::string& endpoints, std::string& error) {
+	static std::mutex rpc_mutex;
+	static std::set<std::string> registered;
+
+	std::vector<std::string> servers = split_list(endpoints);
+	if (servers.empty()) return true;
+
+	ggml_backend_reg_t rpc_reg = ggml_backend_reg_by_name("RPC");
+	if (!rpc_reg) {
+		error = "RPC offloading is not supported by this build";
+		return false;
+	}
+	// Older ggml adds one device per server, newer ggml a registry with a device per server device
+	typedef ggml_backend_dev_t (*rpc_add_device_fn)(const char* endpoint);
+	typedef ggml_backend_reg_t (*rpc_add_server_fn)(const char* endpoint);
+	auto add_device = (rpc_add_device_fn)ggml_backend_reg_get_proc_address(rpc_reg, "ggml_backend_rpc_add_device");
+	auto add_server = (rpc_add_server_fn)ggml_backend_reg_get_proc_address(rpc_reg, "ggml_backend_rpc_add_server");
+	if (!add_device && !add_server) {
+		error = "RPC backend does not support adding servers";
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(rpc_mutex);
+	for (const std::string& server : servers) {
+		if (registered.count(server)) continue;
+		if (add_device) {
+			ggml_backend_dev_t dev = add_device(server.c_str());
+			if (!dev) {
+				error = "Failed to add RPC server " + server;
+				return false;
+			}
+			ggml_backend_device_register(dev);
+		} else {
+			ggml_backend_reg_t reg = add_server(server.c_str());
+			if (!reg) {
+				error = "Failed to add RPC server " + server;
+				return false;
+			}
+			ggml_backend_register(reg);
+		}
+		registered.insert(server);
+		JNI_LOG_INFO("Added RPC server %s", server.c_str());
+	}
+	return true;
+}
+
+bool DevicePlacement::parse_devices(const std::string& names, std::vector<ggml_backend_dev_t>& devices,
+		std::string& error) {
+	devices.clear();
+	if (names != "none") {
+		for (const std::string& name : split_list(names)) {
+			ggml_backend_dev_t dev = ggml_backend_dev_by_name(name.c_str());
+			if (!dev || ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) {
+				error = "Unknown offload device: " + name;
+				return false;
+			}
+			devices.push_back(dev);
+		}
+	}
+	devices.push_back(nullptr);
+	return true;
+}
+
+std::vector<ggml_backend_dev_t> DevicePlacement::offload_devices(const llama_model_params& params) {
+	std::vector<ggml_backend_dev_t> devices;
+	if (params.devices) {
+		for (ggml_backend_dev_t* dev = params.devices; *dev; dev++) {
+			devices.push_back(*dev);
+		}
+	} else {
+		for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+			ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+			if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) devices.push_back(dev);
+		}
+	}
+	// Without a split the model goes to the main GPU alone
+	if (params.split_mode == LLAMA_SPLIT_MODE_NONE && !devices.empty()) {
+		if (params.main_gpu < 0 || params.main_gpu >= (int)devices.size()) return {};
+		return { devices[params.main_gpu] };
+	}
+	return devices;
+}
+
+std::vector<DeviceMemory> DevicePlacement::memory() {
+	std::vector<DeviceMemory> memory(ggml_backend_dev_count());
+	for (size_t i = 0; i < memory.size(); i++) {
+		ggml_backend_dev_memory(ggml_backend_dev_get(i), &memory[i].free, &memory[i].total);
+	}
+	return memory;
+}
+
+std::string DevicePlacement::report(const llama_model* model, const llama_model_params& params,
+		const std::vector<DeviceMemory>& before) {
+	std::vector<ggml_backend_dev_t> devices = offload_devices(params);
+	std::vector<DeviceMemory> after = memory();
+	const int n_layer = llama_model_n_layer(model);
+
+	// Split points over the offloaded layers, as llama.cpp computes them: the tensor split, or the free
+	// memory of every device without one, accumulated and normalized
+	std::vector<float> splits(devices.size(), 0.0f);
+	bool all_zero = true;
+	if (params.tensor_split) {
+		for (size_t i = 0; i < devices.size() && i < llama_max_devices(); i++) {
+			splits[i] = params.tensor_split[i];
+			all_zero = all_zero && splits[i] == 0.0f;
+		}
+	}
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (all_zero) {
+			// The free memory before loading, which llama.cpp saw when it placed the layers
+			for (size_t d = 0; d < ggml_backend_dev_count() && d < before.size(); d++) {
+				if (ggml_backend_dev_get(d) == devices[i]) splits[i] = (float)before[d].free;
+			}
+		}
+		if (i > 0) splits[i] += splits[i - 1];
+	}
+	if (!splits.empty() && splits.back() > 0.0f) {
+		float sum = splits.back();
+		for (float& split : splits) split /= sum;
+	} else {
+		for (size_t i = 0; i < splits.size(); i++) splits[i] = (float)(i + 1) / splits.size();
+	}
+
+	const int n_gpu_layers = params.n_gpu_layers < 0 ? n_layer + 1 : params.n_gpu_layers;
+	const int gpu_start = std::max(n_layer - n_gpu_layers, 0);
+	const int n_offloaded = devices.empty() ? 0 : std::min(n_gpu_layers, n_layer + 1);
+	// Index into devices of a layer, the output layer being n_layer, or -1 for the CPU
+	auto device_of = [&](int il) {
+		if (il < gpu_start || il - gpu_start >= n_offloaded) return -1;
+		float point = (float)(il - gpu_start) / n_offloaded;
+		size_t d = std::upper_bound(splits.begin(), splits.end(), point) - splits.begin();
+		return (int)std::min(d, devices.size() - 1);
+	};
+
+	std::vector<int> layers(devices.size(), 0);
+	int cpu_layers = 0;
+	for (int il = 0; il < n_layer; il++) {
+		int d = device_of(il);
+		if (d < 0) cpu_layers++; else layers[d]++;
+	}
+	int output = device_of(n_layer);
+
+	nlohmann::json json;
+	json["split_mode"] = params.split_mode == LLAMA_SPLIT_MODE_ROW ? "row" :
+		params.split_mode == LLAMA_SPLIT_MODE_LAYER ? "layer" : "none";
+	json["n_layer"] = n_layer;
+	json["n_gpu_layers"] = std::min(n_gpu_layers, n_layer + 1);
+	json["output_device"] = output < 0 ? "CPU" : ggml_backend_dev_name(devices[output]);
+	json["devices"] = nlohmann::json::array();
+	for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+		ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+		auto offload = std::find(devices.begin(), devices.end(), dev);
+		bool is_cpu = ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU;
+		int n = offload != devices.end() ? layers[offload - devices.begin()] : is_cpu ? cpu_layers : 0;
+		size_t free_before = i < before.size() ? before[i].free : after[i].free;
+
+		nlohmann::json device;
+		device["name"] = ggml_backend_dev_name(dev);
+		device["description"] = ggml_backend_dev_description(dev);
+		device["type"] = device_type_name(dev);
+		device["layers"] = n;
+		device["allocated_bytes"] = free_before > after[i].free ? free_before - after[i].free : 0;
+		device["free_bytes"] = after[i].free;
+		device["total_bytes"] = after[i].total;
+		json["devices"].push_back(device);
+	}
+	return json.dump();
+}
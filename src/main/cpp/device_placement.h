@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "llama.h"
+#include "ggml-backend.h"
+
+struct DeviceMemory {
+	size_t free = 0;
+	size_t total = 0;
+};
+
+// Which devices the weights of a model are offloaded to: explicit device lists, RPC servers registered
+// as devices, and a report of the layers and memory of every device once the model is loaded.
+class DevicePlacement {
+public:
+	// Register every endpoint of a comma separated "host:port" list as an RPC device. Endpoints already
+	// registered by an earlier load are skipped. Returns false with the error if RPC is unavailable.
+	static bool add_rpc_servers(const std::string& endpoints, std::string& error);
+
+	// Resolve a comma separated list of device names, "none" to offload nothing. The list is null
+	// terminated, as llama_model_params.devices expects it.
+	static bool parse_devices(const std::string& names, std::vector<ggml_backend_dev_t>& devices, std::string& error);
+
+	// The devices params offloads to: its explicit list, or every GPU, RPC servers included
+	static std::vector<ggml_backend_dev_t> offload_devices(const llama_model_params& params);
+
+	// Free and total memory of every backend device, in ggml_backend_dev_get order
+	static std::vector<DeviceMemory> memory();
+
+	// The layers of every device as llama.cpp assigns them for params, and the memory of every device
+	// as JSON. With a row split the matrices of the offloaded layers are spread over all devices by the
+	// tensor split, the other tensors stay with the device of their layer. before is memory() taken
+	// before loading, the difference is reported as what the load allocated and includes anything other
+	// loads allocated on the same devices in the meantime.
+	static std::string report(const llama_model* model, const llama_model_params& params,
+		const std::vector<DeviceMemory>& before);
+};
@@ -0,0 +1,51 @@
+#include "embedding_format.h"
+#include "ggml.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+size_t EmbeddingFormat::row_bytes(EmbeddingEncoding encoding, size_t dims) {
+    switch (encoding) {
+        case EMBEDDING_F16: return dims * sizeof(ggml_fp16_t);
+        case EMBEDDING_I8: return dims;
+        case EMBEDDING_BINARY: return (dims + 7) / 8;
+        default: return dims * sizeof(float);
+    }
+}
+
+float EmbeddingFormat::encode(const float* embedding, size_t dims, bool normalize, EmbeddingEncoding encoding,
+        uint8_t* out) {
+    // Every encoding reads the truncated, normalized values once more, they live in a scratch row
+    thread_local std::vector<float> row;
+    row.assign(embedding, embedding + dims);
+    if (normalize) {
+        float sum = 0.0f;
+        for (size_t i = 0; i < dims; i++) sum += row[i] * row[i];
+        float inv = sum > 0.0f ? 1.0f / std::sqrt(sum) : 0.0f;
+        for (size_t i = 0; i < dims; i++) row[i] *= inv;
+    }
+
+    switch (encoding) {
+        case EMBEDDING_F16:
+            ggml_fp32_to_fp16_row(row.data(), reinterpret_cast<ggml_fp16_t*>(out), (int64_t)dims);
+            return 1.0f;
+        case EMBEDDING_I8: {
+            float max_abs = 0.0f;
+            for (size_t i = 0; i < dims; i++) max_abs = std::max(max_abs, std::fabs(row[i]));
+            float inv = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+            int8_t* codes = reinterpret_cast<int8_t*>(out);
+            for (size_t i = 0; i < dims; i++) codes[i] = (int8_t)std::lrint(row[i] * inv);
+            return max_abs / 127.0f;
+        }
+        case EMBEDDING_BINARY:
+            std::memset(out, 0, (dims + 7) / 8);
+            for (size_t i = 0; i < dims; i++) {
+                if (row[i] > 0.0f) out[i / 8] |= (uint8_t)(0x80 >> (i % 8));
+            }
+            return 1.0f;
+        default:
+            std::memcpy(out, row.data(), dims * sizeof(float));
+            return 1.0f;
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Compact encodings of embeddings, applied natively before they are copied to Java: truncation to
+// the leading dimensions (Matryoshka embeddings), L2 normalization and quantization.
+enum EmbeddingEncoding : int32_t {
+    EMBEDDING_F32 = 0,
+    EMBEDDING_F16 = 1,
+    EMBEDDING_I8 = 2,     // Symmetric, value = code * scale
+    EMBEDDING_BINARY = 3, // One sign bit per dimension, most significant bit first, 1 for positive
+};
+
+namespace EmbeddingFormat {
+
+// Bytes of one encoded embedding of dims dimensions
+size_t row_bytes(EmbeddingEncoding encoding, size_t dims);
+
+// Encode the first dims values of embedding into out, normalized to unit length after the
+// truncation if normalize is set. Returns the scale of an int8 encoding, 1 otherwise.
+float encode(const float* embedding, size_t dims, bool normalize, EmbeddingEncoding encoding, uint8_t* out);
+
+}
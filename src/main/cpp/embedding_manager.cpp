@@ -2,30 +2,27 @@
 #include "jni_utils.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
+#include "server_table.h"
 #include "memory_manager.h"
+#include "native_trace.h"
+#include "reranking_manager.h"
+#include "vector_index_manager.h"
+#include "embedding_format.h"
 #include <vector>
 #include <string>
 #include <mutex>
 #include <unordered_map>
 #include <memory>
-
-// These are defined in jllama.cpp but we need access to them
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_embedding_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
+#include <algorithm>
+#include <functional>
 
 jfloatArray EmbeddingManager::createEmbedding(JNIEnv* env, jobject obj, jstring text) {
 	JNI_TRY(env)
 
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_embedding_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return nullptr;
+	SequenceLease lease(server, 1);
 	
 	// Check if embedding mode is enabled
 	if (!server->embedding_mode) {
@@ -46,41 +43,87 @@ jfloatArray EmbeddingManager::createEmbedding(JNIEnv* env, jobject obj, jstring
 	*/
 	
 	std::string input = JniUtils::jstring_to_string(env, text);
+	const float* embd = computeEmbedding(env, server, lease, input);
+	if (!embd) return nullptr;
 	
-	// Tokenize the input text
-	const llama_vocab* vocab = llama_model_get_vocab(server->model);
-	std::vector<llama_token> tokens;
-	tokens.resize(input.length() + 1);
+	// Get embedding dimension
+	int n_embd = llama_model_n_embd(server->model);
 	
-	int n_tokens = llama_tokenize(vocab, input.c_str(), input.length(), 
-								  tokens.data(), tokens.size(), true, false);
+	// Create Java float array and copy embeddings
+	jfloatArray result = env->NewFloatArray(n_embd);
+	if (!result) {
+		JNIErrorHandler::throw_out_of_memory(env, 
+			"Could not allocate embedding array");
+		return nullptr;
+	}
 	
-	if (n_tokens < 0) {
-		tokens.resize(-n_tokens);
-		n_tokens = llama_tokenize(vocab, input.c_str(), input.length(),
-								  tokens.data(), tokens.size(), true, false);
+	env->SetFloatArrayRegion(result, 0, n_embd, embd);
+	
+	return result;
+
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jint EmbeddingManager::createEmbeddingInto(JNIEnv* env, jobject obj, jstring text, jobject buffer, jint offset) {
+	JNI_TRY(env)
+
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return -1;
+	SequenceLease lease(server, 1);
+	
+	if (!server->embedding_mode) {
+		JNIErrorHandler::throw_illegal_state(env, 
+			"Model was not loaded with embedding support (see ModelParameters#enableEmbedding())");
+		return -1;
 	}
 	
-	if (n_tokens < 0) {
-		JNIErrorHandler::throw_runtime_exception(env, 
-			"Failed to tokenize input for embedding");
+	std::string input = JniUtils::jstring_to_string(env, text);
+	const float* embd = computeEmbedding(env, server, lease, input);
+	if (!embd) return -1;
+	
+	return JniUtils::copy_to_float_buffer(env, buffer, offset, embd, llama_model_n_embd(server->model));
+
+	JNI_CATCH_RET(env, -1)
+}
+
+const float* EmbeddingManager::computeEmbedding(JNIEnv* env, LlamaServer* server, const SequenceLease& lease,
+		const std::string& input) {
+	JLLAMA_TRACE_SPAN("embedding", "embed");
+	
+	if (lease.empty()) {
+		JNIErrorHandler::throw_illegal_state(env, "The server is stopped");
 		return nullptr;
 	}
+	const llama_seq_id seq = lease[0];
 	
-	tokens.resize(n_tokens);
+	// Tokens live in the thread's scratch arena for the duration of the call
+	ArenaScope scratch(g_scratch_arena);
 	
-	// Clear previous memory (embeddings don't need persistent context)
-	llama_memory_clear(llama_get_memory(server->ctx), true);
+	// Tokenize the input text
+	const llama_vocab* vocab = llama_model_get_vocab(server->model);
+	ArenaVector<llama_token> tokens{ArenaAllocator<llama_token>(g_scratch_arena)};
+	if (!tokenizeInput(vocab, input, tokens)) {
+		JNIErrorHandler::throw_runtime_exception(env, 
+			"Failed to tokenize input for embedding");
+		return nullptr;
+	}
+	int n_tokens = (int)tokens.size();
 	
-	// Use RAII for batch management to ensure cleanup
-	BatchRAII batch_raii(n_tokens, 0, 1);
-	llama_batch* batch = batch_raii.get();
+	BatchLease batch = server->batches.lease();
+	if (n_tokens > server->batches.capacity()) {
+		JNIErrorHandler::throw_illegal_argument(env, 
+			"Input has " + std::to_string(n_tokens) + " tokens, the batch size is " + 
+			std::to_string(server->batches.capacity()));
+		return nullptr;
+	}
 	
+	// The leased sequence is empty, the sequences of running completions are left alone
 	for (int i = 0; i < n_tokens; i++) {
 		batch->token[i] = tokens[i];
 		batch->pos[i] = i;
 		batch->n_seq_id[i] = 1;
-		batch->seq_id[i][0] = 0;
+		batch->seq_id[i][0] = seq;
 		batch->logits[i] = true; // We need embeddings for all tokens or just the last one
 	}
 	batch->n_tokens = n_tokens;
@@ -92,9 +135,6 @@ jfloatArray EmbeddingManager::createEmbedding(JNIEnv* env, jobject obj, jstring
 		return nullptr;
 	}
 	
-	// Get embedding dimension
-	int n_embd = llama_model_n_embd(server->model);
-	
 	// Get embeddings based on pooling type
 	const float* embd = nullptr;
 	enum llama_pooling_type pooling_type = llama_pooling_type(server->ctx);
@@ -104,39 +144,351 @@ jfloatArray EmbeddingManager::createEmbedding(JNIEnv* env, jobject obj, jstring
 		embd = llama_get_embeddings_ith(server->ctx, n_tokens - 1);
 	} else {
 		// For models with pooling, get the sequence embedding
-		embd = llama_get_embeddings_seq(server->ctx, 0);
+		embd = llama_get_embeddings_seq(server->ctx, seq);
 	}
 	
-	// Batch will be automatically freed by RAII
-	
 	if (!embd) {
 		JNIErrorHandler::throw_runtime_exception(env, 
 			"Failed to get embeddings from context");
 		return nullptr;
 	}
 	
-	// Create Java float array and copy embeddings
-	jfloatArray result = env->NewFloatArray(n_embd);
+	return embd;
+}
+
+jfloatArray EmbeddingManager::embedBatch(JNIEnv* env, jobject obj, jobjectArray texts) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return nullptr;
+	SequenceLease lease(server, (size_t)env->GetArrayLength(texts));
+	
+	if (!server->embedding_mode) {
+		JNIErrorHandler::throw_illegal_state(env, 
+			"Model was not loaded with embedding support (see ModelParameters#enableEmbedding())");
+		return nullptr;
+	}
+	
+	std::vector<std::string> inputs = toStrings(env, texts);
+	const int n_embd = llama_model_n_embd(server->model);
+	jfloatArray result = env->NewFloatArray((jsize)inputs.size() * n_embd);
 	if (!result) {
 		JNIErrorHandler::throw_out_of_memory(env, 
 			"Could not allocate embedding array");
 		return nullptr;
 	}
 	
-	env->SetFloatArrayRegion(result, 0, n_embd, embd);
+	bool ok = embedTexts(env, server, lease, inputs, [&](size_t i, const float* embd) {
+		env->SetFloatArrayRegion(result, (jsize)(i * n_embd), n_embd, embd);
+	});
+	return ok ? result : nullptr;
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jbyteArray EmbeddingManager::embedCompact(JNIEnv* env, jobject obj, jobjectArray texts, jint dimensions,
+		jboolean normalize, jint encoding, jfloatArray scales) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return nullptr;
+	SequenceLease lease(server, (size_t)env->GetArrayLength(texts));
+	
+	if (!server->embedding_mode) {
+		JNIErrorHandler::throw_illegal_state(env, 
+			"Model was not loaded with embedding support (see ModelParameters#enableEmbedding())");
+		return nullptr;
+	}
+	
+	const int n_embd = llama_model_n_embd(server->model);
+	if (dimensions < 0 || dimensions > n_embd) {
+		JNIErrorHandler::throw_illegal_argument(env, "Cannot truncate embeddings of " + std::to_string(n_embd) +
+			" dimensions to " + std::to_string(dimensions));
+		return nullptr;
+	}
+	if (encoding < EMBEDDING_F32 || encoding > EMBEDDING_BINARY) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown embedding encoding " + std::to_string(encoding));
+		return nullptr;
+	}
+	const size_t dims = dimensions == 0 ? (size_t)n_embd : (size_t)dimensions;
+	const size_t row_bytes = EmbeddingFormat::row_bytes((EmbeddingEncoding)encoding, dims);
+	
+	std::vector<std::string> inputs = toStrings(env, texts);
+	if (env->GetArrayLength(scales) < (jsize)inputs.size()) {
+		JNIErrorHandler::throw_illegal_argument(env, "Expected one scale per text");
+		return nullptr;
+	}
 	
+	// Encoded while the embeddings are still in the context, only the compact rows cross JNI
+	std::vector<uint8_t> encoded(inputs.size() * row_bytes);
+	std::vector<float> row_scales(inputs.size());
+	bool ok = embedTexts(env, server, lease, inputs, [&](size_t i, const float* embd) {
+		row_scales[i] = EmbeddingFormat::encode(embd, dims, normalize == JNI_TRUE, (EmbeddingEncoding)encoding,
+			encoded.data() + i * row_bytes);
+	});
+	if (!ok) return nullptr;
+	
+	jbyteArray result = env->NewByteArray((jsize)encoded.size());
+	if (!result) {
+		JNIErrorHandler::throw_out_of_memory(env, 
+			"Could not allocate embedding array");
+		return nullptr;
+	}
+	env->SetByteArrayRegion(result, 0, (jsize)encoded.size(), reinterpret_cast<const jbyte*>(encoded.data()));
+	env->SetFloatArrayRegion(scales, 0, (jsize)row_scales.size(), row_scales.data());
 	return result;
+	
+	JNI_CATCH_RET(env, nullptr)
+}
 
+jint EmbeddingManager::embedIntoIndex(JNIEnv* env, jobject obj, jlong indexHandle, jobjectArray texts) {
+	JNI_TRY(env)
+	
+	VectorIndex* index = VectorIndexManager::get(env, indexHandle);
+	if (!index) return -1;
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return -1;
+	SequenceLease lease(server, (size_t)env->GetArrayLength(texts));
+	
+	if (!server->embedding_mode) {
+		JNIErrorHandler::throw_illegal_state(env, 
+			"Model was not loaded with embedding support (see ModelParameters#enableEmbedding())");
+		return -1;
+	}
+	
+	const size_t n_embd = (size_t)llama_model_n_embd(server->model);
+	if (n_embd != index->dim()) {
+		JNIErrorHandler::throw_illegal_argument(env, "The model embeds " + std::to_string(n_embd) +
+			" dimensions, the index holds " + std::to_string(index->dim()));
+		return -1;
+	}
+	
+	// Embeddings stay native, the whole batch is added at once so that its entries are consecutive
+	std::vector<std::string> inputs = toStrings(env, texts);
+	std::vector<float> vectors(inputs.size() * n_embd);
+	bool ok = embedTexts(env, server, lease, inputs, [&](size_t i, const float* embd) {
+		std::copy(embd, embd + n_embd, vectors.begin() + i * n_embd);
+	});
+	if (!ok) return -1;
+	return (jint)index->add(vectors.data(), inputs.size(), inputs.data());
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+bool EmbeddingManager::searchHits(JNIEnv* env, jobject obj, const VectorIndex* index, const std::string& query,
+		size_t k, size_t ef, std::vector<VectorHit>& hits) {
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return false;
+	SequenceLease lease(server, 1);
+	
+	if (!server->embedding_mode) {
+		JNIErrorHandler::throw_illegal_state(env, 
+			"Model was not loaded with embedding support (see ModelParameters#enableEmbedding())");
+		return false;
+	}
+	if ((size_t)llama_model_n_embd(server->model) != index->dim()) {
+		JNIErrorHandler::throw_illegal_argument(env, "The model embeds " +
+			std::to_string(llama_model_n_embd(server->model)) + " dimensions, the index holds " +
+			std::to_string(index->dim()));
+		return false;
+	}
+	
+	// The embedding is searched where llama.cpp left it
+	const float* embd = computeEmbedding(env, server, lease, query);
+	if (!embd) return false;
+	JLLAMA_TRACE_SPAN("vector_index", "search");
+	hits = index->search(embd, k, ef);
+	return true;
+}
+
+jobject EmbeddingManager::searchIndex(JNIEnv* env, jobject obj, jlong indexHandle, jstring query, jint k, jint ef) {
+	JNI_TRY(env)
+	
+	VectorIndex* index = VectorIndexManager::get(env, indexHandle);
+	if (!index) return nullptr;
+	
+	std::vector<VectorHit> hits;
+	if (!searchHits(env, obj, index, JniUtils::jstring_to_string(env, query), (size_t)std::max(0, (int)k),
+			(size_t)std::max(0, (int)ef), hits)) {
+		return nullptr;
+	}
+	return VectorIndexManager::newResult(env, hits);
+	
 	JNI_CATCH_RET(env, nullptr)
 }
 
+jobject EmbeddingManager::searchAndRerank(JNIEnv* env, jobject obj, jlong indexHandle, jstring query,
+		jint candidates, jint ef, jobject reranker, jint k) {
+	JNI_TRY(env)
+	
+	VectorIndex* index = VectorIndexManager::get(env, indexHandle);
+	if (!index) return nullptr;
+	
+	std::string query_str = JniUtils::jstring_to_string(env, query);
+	std::vector<VectorHit> hits;
+	if (!searchHits(env, obj, index, query_str, (size_t)std::max(0, (int)candidates),
+			(size_t)std::max(0, (int)ef), hits)) {
+		return nullptr;
+	}
+	if (hits.empty()) {
+		return VectorIndexManager::newResult(env, hits);
+	}
+	
+	// The embedding model is unlocked again, so reranker may be the same model
+	std::vector<std::string> documents;
+	documents.reserve(hits.size());
+	for (const VectorHit& hit : hits) {
+		documents.push_back(index->text(hit.entry));
+	}
+	
+	ServerRef rerank_server = ServerTable::acquire(JniUtils::get_handle(env, reranker));
+	if (!rerank_server) return nullptr;
+	SequenceLease rerank_lease(rerank_server, documents.size() + 1);
+	
+	std::vector<jint> order;
+	std::vector<float> scores;
+	if (!RerankingManager::rankTopK(env, rerank_server, rerank_lease, query_str, documents, (size_t)std::max(0, (int)k),
+			order, scores)) {
+		return nullptr;
+	}
+	for (jint& i : order) {
+		i = (jint)hits[i].entry;
+	}
+	return JniUtils::new_rerank_result(env, order, scores);
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+std::vector<std::string> EmbeddingManager::toStrings(JNIEnv* env, jobjectArray texts) {
+	jsize n_texts = env->GetArrayLength(texts);
+	std::vector<std::string> result;
+	result.reserve(n_texts);
+	for (jsize i = 0; i < n_texts; i++) {
+		jstring text = (jstring)env->GetObjectArrayElement(texts, i);
+		result.push_back(JniUtils::jstring_to_string(env, text));
+		env->DeleteLocalRef(text);
+	}
+	return result;
+}
+
+bool EmbeddingManager::embedTexts(JNIEnv* env, LlamaServer* server, const SequenceLease& lease,
+		const std::vector<std::string>& texts, const std::function<void(size_t, const float*)>& sink) {
+	JLLAMA_TRACE_SPAN("embedding", "embed_batch");
+	
+	if (lease.empty()) {
+		JNIErrorHandler::throw_illegal_state(env, "The server is stopped");
+		return false;
+	}
+	
+	// Tokenize all inputs up front
+	const llama_vocab* vocab = llama_model_get_vocab(server->model);
+	const size_t n_texts = texts.size();
+	ArenaScope scratch(g_scratch_arena);
+	ArenaVector<ArenaVector<llama_token>> inputs{ArenaAllocator<ArenaVector<llama_token>>(g_scratch_arena)};
+	inputs.reserve(n_texts);
+	for (size_t i = 0; i < n_texts; i++) {
+		inputs.emplace_back(ArenaAllocator<llama_token>(g_scratch_arena));
+		if (!tokenizeInput(vocab, texts[i], inputs[i])) {
+			JNIErrorHandler::throw_runtime_exception(env, 
+				"Failed to tokenize input " + std::to_string(i) + " for embedding");
+			return false;
+		}
+	}
+	
+	// Every sequence of a pack has to fit into one ubatch for pooled embeddings
+	const int n_budget = (int)std::min(llama_n_batch(server->ctx), llama_n_ubatch(server->ctx));
+	const size_t n_seqs = lease.size();
+	const enum llama_pooling_type pooling_type = llama_pooling_type(server->ctx);
+	llama_memory_t memory = llama_get_memory(server->ctx);
+	
+	BatchLease batch = server->batches.lease();
+	ArenaVector<int> last_index(n_seqs, 0, ArenaAllocator<int>(g_scratch_arena));
+	
+	size_t next = 0;
+	while (next < n_texts) {
+		// Pack as many inputs as fit into the token budget, one leased sequence each
+		size_t first = next;
+		batch->n_tokens = 0;
+		while (next < n_texts && next - first < n_seqs) {
+			const ArenaVector<llama_token>& tokens = inputs[next];
+			if ((int)tokens.size() > n_budget) {
+				JNIErrorHandler::throw_illegal_argument(env, 
+					"Input " + std::to_string(next) + " has " + std::to_string(tokens.size()) + 
+					" tokens, the batch size is " + std::to_string(n_budget));
+				return false;
+			}
+			if (batch->n_tokens + (int)tokens.size() > n_budget) break;
+			
+			llama_seq_id seq = lease[next - first];
+			for (size_t j = 0; j < tokens.size(); j++) {
+				int k = batch->n_tokens++;
+				batch->token[k] = tokens[j];
+				batch->pos[k] = (llama_pos)j;
+				batch->n_seq_id[k] = 1;
+				batch->seq_id[k][0] = seq;
+				batch->logits[k] = true;
+			}
+			last_index[next - first] = batch->n_tokens - 1;
+			next++;
+		}
+		
+		if (llama_decode(server->ctx, *batch) != 0) {
+			JNIErrorHandler::throw_runtime_exception(env, 
+				"Failed to compute embeddings");
+			return false;
+		}
+		
+		for (size_t i = first; i < next; i++) {
+			const float* embd = pooling_type == LLAMA_POOLING_TYPE_NONE
+				? llama_get_embeddings_ith(server->ctx, last_index[i - first])
+				: llama_get_embeddings_seq(server->ctx, lease[i - first]);
+			if (!embd) {
+				JNIErrorHandler::throw_runtime_exception(env, 
+					"Failed to get embeddings from context");
+				return false;
+			}
+			sink(i, embd);
+		}
+		
+		// Empty the sequences for the next pack
+		for (size_t j = 0; j < next - first; j++) {
+			llama_memory_seq_rm(memory, lease[j], -1, -1);
+		}
+	}
+	return true;
+}
+
+bool EmbeddingManager::tokenizeInput(const llama_vocab* vocab, const std::string& text, 
+		ArenaVector<llama_token>& tokens) {
+	tokens.resize(text.length() + 1);
+	
+	int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), 
+								  tokens.data(), tokens.size(), true, false);
+	
+	if (n_tokens < 0) {
+		tokens.resize(-n_tokens);
+		n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
+								  tokens.data(), tokens.size(), true, false);
+	}
+	
+	if (n_tokens <= 0) return false;
+	
+	tokens.resize(n_tokens);
+	return true;
+}
+
 jfloatArray EmbeddingManager::getAllEmbeddings(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_embedding_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return nullptr;
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	// Get all embeddings from the context using llama_get_embeddings
 	const float* embd = llama_get_embeddings(server->ctx);
@@ -167,10 +519,10 @@ jfloatArray EmbeddingManager::getAllEmbeddings(JNIEnv* env, jobject obj) {
 void EmbeddingManager::setEmbeddingMode(JNIEnv* env, jobject obj, jboolean embeddings) {
 	JNI_TRY(env)
 
-	jlong handle = env->GetLongField(obj,
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_embedding_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return;
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 
 	// Set embedding mode using llama_set_embeddings
 	llama_set_embeddings(server->ctx, embeddings == JNI_TRUE);
@@ -181,13 +533,13 @@ void EmbeddingManager::setEmbeddingMode(JNIEnv* env, jobject obj, jboolean embed
 jfloatArray EmbeddingManager::getLogitsIth(JNIEnv* env, jobject obj, jint i) {
 	JNI_TRY(env)
 
-	jlong handle = env->GetLongField(obj,
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_embedding_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model context is null");
 		return nullptr;
 	}
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 
 	// Get logits for specific position using llama_get_logits_ith
 	const float* logits = llama_get_logits_ith(server->ctx, i);
@@ -218,13 +570,13 @@ jfloatArray EmbeddingManager::getLogitsIth(JNIEnv* env, jobject obj, jint i) {
 jfloatArray EmbeddingManager::getEmbeddingsIth(JNIEnv* env, jobject obj, jint i) {
 	JNI_TRY(env)
 
-	jlong handle = env->GetLongField(obj,
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_embedding_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model context is null");
 		return nullptr;
 	}
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 
 	// Get embeddings for specific position using llama_get_embeddings_ith
 	const float* embd = llama_get_embeddings_ith(server->ctx, i);
@@ -250,3 +602,51 @@ jfloatArray EmbeddingManager::getEmbeddingsIth(JNIEnv* env, jobject obj, jint i)
 
 	JNI_CATCH_RET(env, nullptr)
 }
+
+jint EmbeddingManager::getLogitsIthInto(JNIEnv* env, jobject obj, jint i, jobject buffer, jint offset) {
+	JNI_TRY(env)
+
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model context is null");
+		return -1;
+	}
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+
+	const float* logits = llama_get_logits_ith(server->ctx, i);
+	if (!logits) {
+		JNIErrorHandler::throw_illegal_state(env,
+			"No logits available at position " + std::to_string(i) + ". Ensure inference has been performed.");
+		return -1;
+	}
+
+	// Copy straight from the context's logits into the caller's buffer, no Java array in between
+	int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(server->model));
+	return JniUtils::copy_to_float_buffer(env, buffer, offset, logits, n_vocab);
+
+	JNI_CATCH_RET(env, -1)
+}
+
+jint EmbeddingManager::getEmbeddingsIthInto(JNIEnv* env, jobject obj, jint i, jobject buffer, jint offset) {
+	JNI_TRY(env)
+
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model context is null");
+		return -1;
+	}
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+
+	const float* embd = llama_get_embeddings_ith(server->ctx, i);
+	if (!embd) {
+		JNIErrorHandler::throw_illegal_state(env,
+			"No embeddings available at position " + std::to_string(i) + ". Ensure context has been processed and embeddings are enabled.");
+		return -1;
+	}
+
+	return JniUtils::copy_to_float_buffer(env, buffer, offset, embd, llama_model_n_embd(server->model));
+
+	JNI_CATCH_RET(env, -1)
+}
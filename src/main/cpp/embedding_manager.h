@@ -2,12 +2,41 @@
 #define EMBEDDING_MANAGER_H
 
 #include <jni.h>
+#include <functional>
+#include <string>
+#include <vector>
 #include "llama.h"
+#include "memory_manager.h"
+#include "vector_index.h"
+
+struct LlamaServer;
+class SequenceLease;
 
 class EmbeddingManager {
 public:
 	static jfloatArray createEmbedding(JNIEnv* env, jobject obj, jstring text);
 	
+	// Same as createEmbedding, but writes into a direct FloatBuffer at offset, returns n_embd
+	static jint createEmbeddingInto(JNIEnv* env, jobject obj, jstring text, jobject buffer, jint offset);
+	
+	// Embed many texts with one llama_decode per pack of sequences, returns n * n_embd floats
+	static jfloatArray embedBatch(JNIEnv* env, jobject obj, jobjectArray texts);
+	
+	// Same as embedBatch, but truncated to dimensions (0 for all), optionally normalized and encoded as an
+	// EmbeddingEncoding. Returns the rows one after another and writes the int8 scale of every row to scales.
+	static jbyteArray embedCompact(JNIEnv* env, jobject obj, jobjectArray texts, jint dimensions,
+		jboolean normalize, jint encoding, jfloatArray scales);
+	
+	// Same as embedBatch, but adds the embeddings and texts to a VectorIndex, returns the first entry
+	static jint embedIntoIndex(JNIEnv* env, jobject obj, jlong indexHandle, jobjectArray texts);
+	
+	// Embed the query and return the k nearest entries of the index
+	static jobject searchIndex(JNIEnv* env, jobject obj, jlong indexHandle, jstring query, jint k, jint ef);
+	
+	// Search the candidates nearest entries, then rerank their texts on reranker and return the k best
+	static jobject searchAndRerank(JNIEnv* env, jobject obj, jlong indexHandle, jstring query,
+		jint candidates, jint ef, jobject reranker, jint k);
+	
 	// Get all embeddings from context (llama_get_embeddings)
 	static jfloatArray getAllEmbeddings(JNIEnv* env, jobject obj);
 	
@@ -20,7 +49,23 @@ public:
 	// Get embeddings for specific position (llama_get_embeddings_ith)
 	static jfloatArray getEmbeddingsIth(JNIEnv* env, jobject obj, jint i);
 
+	// Direct FloatBuffer variants of getLogitsIth and getEmbeddingsIth, return the number of floats written
+	static jint getLogitsIthInto(JNIEnv* env, jobject obj, jint i, jobject buffer, jint offset);
+	static jint getEmbeddingsIthInto(JNIEnv* env, jobject obj, jint i, jobject buffer, jint offset);
+
 private:
+	static std::vector<std::string> toStrings(JNIEnv* env, jobjectArray texts);
+	// Embed texts in packs of the leased sequences and pass every embedding to sink, false with a pending exception
+	static bool embedTexts(JNIEnv* env, LlamaServer* server, const SequenceLease& lease,
+		const std::vector<std::string>& texts, const std::function<void(size_t, const float*)>& sink);
+	// Embed query on the model of obj and search the index, false with a pending exception
+	static bool searchHits(JNIEnv* env, jobject obj, const VectorIndex* index, const std::string& query,
+		size_t k, size_t ef, std::vector<VectorHit>& hits);
+	// Decode input on the first leased sequence and return its pooled embedding, nullptr with a pending
+	// exception on failure
+	static const float* computeEmbedding(JNIEnv* env, LlamaServer* server, const SequenceLease& lease,
+		const std::string& input);
+	static bool tokenizeInput(const llama_vocab* vocab, const std::string& text, ArenaVector<llama_token>& tokens);
 	static struct llama_context* getContext(JNIEnv* env, jobject obj);
 	static struct llama_model* getModel(JNIEnv* env, jobject obj);
 	static bool isEmbeddingEnabled(JNIEnv* env, jobject obj);
@@ -0,0 +1,292 @@
+#include "evaluation_manager.h"
+#include "jni_utils.h"
+#include "jni_error_handler.h"
+#include "llama_server.h"
+#include "server_table.h"
+#include "memory_manager.h"
+#include "native_trace.h"
+#include "worker_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Saved log-probabilities: a header, the corpus tokens, then one record per scored token in
+// corpus order, its log-probabilities quantized to 16 bits between the smallest one and 0
+const char LOGITS_MAGIC[4] = { 'J', 'L', 'K', 'L' };
+const uint32_t LOGITS_VERSION = 1;
+const float MIN_LOG_PROB = -64.0f;
+const int POSITIONS_PER_STEP = 32;  // Scored tokens whose records are buffered at once
+
+struct LogitsHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_vocab;
+	uint32_t n_ctx;
+	uint32_t n_tokens;
+};
+
+struct LogProbRecord {
+	float min;
+	float scale;
+};
+
+size_t record_size(int n_vocab) {
+	return sizeof(LogProbRecord) + sizeof(uint16_t) * n_vocab;
+}
+
+void log_softmax(const float* logits, int n_vocab, float* log_probs) {
+	float max_logit = *std::max_element(logits, logits + n_vocab);
+	double sum = 0.0;
+	for (int v = 0; v < n_vocab; v++) {
+		sum += std::exp(logits[v] - max_logit);
+	}
+	float log_sum = max_logit + (float)std::log(sum);
+	for (int v = 0; v < n_vocab; v++) {
+		log_probs[v] = logits[v] - log_sum;
+	}
+}
+
+void encode_record(const float* log_probs, int n_vocab, uint8_t* out) {
+	float min = 0.0f;
+	for (int v = 0; v < n_vocab; v++) min = std::min(min, log_probs[v]);
+	min = std::max(min, MIN_LOG_PROB);
+	LogProbRecord record = { min, min < 0.0f ? -min / 65535.0f : 1.0f };
+	std::memcpy(out, &record, sizeof(record));
+	uint16_t* q = reinterpret_cast<uint16_t*>(out + sizeof(record));
+	for (int v = 0; v < n_vocab; v++) {
+		float level = (std::max(log_probs[v], min) - min) / record.scale;
+		q[v] = (uint16_t)std::min(65535.0f, std::round(level));
+	}
+}
+
+// KL(reference || model) of one token, and whether both agree on the most likely token
+double kl_divergence(const uint8_t* reference, const float* log_probs, int n_vocab, bool& same_top) {
+	LogProbRecord record;
+	std::memcpy(&record, reference, sizeof(record));
+	const uint16_t* q = reinterpret_cast<const uint16_t*>(reference + sizeof(record));
+	double kl = 0.0;
+	int top_reference = 0;
+	int top_model = 0;
+	for (int v = 0; v < n_vocab; v++) {
+		float ref_log_prob = record.min + record.scale * q[v];
+		kl += std::exp((double)ref_log_prob) * (ref_log_prob - log_probs[v]);
+		if (q[v] > q[top_reference]) top_reference = v;
+		if (log_probs[v] > log_probs[top_model]) top_model = v;
+	}
+	same_top = top_reference == top_model;
+	return std::max(0.0, kl);
+}
+
+class FileCloser {
+public:
+	explicit FileCloser(FILE* file) : file_(file) {}
+	~FileCloser() { if (file_) fclose(file_); }
+	FILE* get() const { return file_; }
+	FileCloser(const FileCloser&) = delete;
+	FileCloser& operator=(const FileCloser&) = delete;
+private:
+	FILE* file_;
+};
+
+}
+
+jobject EvaluationManager::evaluatePerplexity(JNIEnv* env, jobject obj, jintArray tokens, jint n_ctx, jint n_parallel,
+		jstring save_path, jstring reference_path) {
+	JNI_TRY(env)
+
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return nullptr;
+
+	if (!tokens) {
+		JNIErrorHandler::throw_illegal_argument(env, "Tokens cannot be null");
+		return nullptr;
+	}
+	if (n_ctx < 4 || n_parallel < 1) {
+		JNIErrorHandler::throw_illegal_argument(env, "Window size must be at least 4 and parallelism at least 1");
+		return nullptr;
+	}
+	jsize n_tokens = env->GetArrayLength(tokens);
+	std::vector<llama_token> corpus(n_tokens);
+	env->GetIntArrayRegion(tokens, 0, n_tokens, reinterpret_cast<jint*>(corpus.data()));
+
+	const llama_vocab* vocab = llama_model_get_vocab(server->model);
+	const int n_vocab = llama_vocab_n_tokens(vocab);
+	for (llama_token token : corpus) {
+		if (token < 0 || token >= n_vocab) {
+			JNIErrorHandler::throw_illegal_argument(env, "Token out of vocabulary range: " + std::to_string(token));
+			return nullptr;
+		}
+	}
+	const int n_chunks = n_tokens / n_ctx;
+	if (n_chunks == 0) {
+		JNIErrorHandler::throw_illegal_argument(env, "The corpus is shorter than one window");
+		return nullptr;
+	}
+
+	LogitsHeader header;
+	std::memcpy(header.magic, LOGITS_MAGIC, sizeof(LOGITS_MAGIC));
+	header.version = LOGITS_VERSION;
+	header.n_vocab = (uint32_t)n_vocab;
+	header.n_ctx = (uint32_t)n_ctx;
+	header.n_tokens = (uint32_t)n_tokens;
+
+	FileCloser save_file(save_path ? fopen(JniUtils::jstring_to_string(env, save_path).c_str(), "wb") : nullptr);
+	if (save_path && (!save_file.get() || fwrite(&header, sizeof(header), 1, save_file.get()) != 1 ||
+			fwrite(corpus.data(), sizeof(llama_token), corpus.size(), save_file.get()) != corpus.size())) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to write log-probabilities file");
+		return nullptr;
+	}
+
+	// The reference must have scored the same corpus with the same windows and vocabulary
+	FileCloser reference_file(reference_path ? fopen(JniUtils::jstring_to_string(env, reference_path).c_str(), "rb") : nullptr);
+	if (reference_path) {
+		LogitsHeader reference_header;
+		std::vector<llama_token> reference_tokens(n_tokens);
+		if (!reference_file.get() || fread(&reference_header, sizeof(reference_header), 1, reference_file.get()) != 1 ||
+				std::memcmp(reference_header.magic, LOGITS_MAGIC, sizeof(LOGITS_MAGIC)) != 0 ||
+				reference_header.version != LOGITS_VERSION) {
+			JNIErrorHandler::throw_runtime_exception(env, "Failed to read reference log-probabilities file");
+			return nullptr;
+		}
+		if (reference_header.n_vocab != header.n_vocab || reference_header.n_ctx != header.n_ctx ||
+				reference_header.n_tokens != header.n_tokens ||
+				fread(reference_tokens.data(), sizeof(llama_token), n_tokens, reference_file.get()) != (size_t)n_tokens ||
+				reference_tokens != corpus) {
+			JNIErrorHandler::throw_illegal_argument(env, "The reference was saved for another corpus, window size or vocabulary");
+			return nullptr;
+		}
+	}
+
+	// A context of its own, the windows must not disturb the sequences of the server
+	const int n_seq = std::min(n_parallel, n_chunks);
+	llama_context_params params = llama_context_default_params();
+	params.n_ctx = (uint32_t)(n_ctx * n_seq);
+	params.n_batch = (uint32_t)(n_ctx * n_seq);
+	params.n_seq_max = (uint32_t)n_seq;
+	params.n_threads = llama_n_threads(server->ctx);
+	params.n_threads_batch = llama_n_threads_batch(server->ctx);
+	llama_context* ctx = llama_init_from_model(server->model, params);
+	if (!ctx) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to create evaluation context");
+		return nullptr;
+	}
+	std::unique_ptr<llama_context, void (*)(llama_context*)> ctx_guard(ctx, llama_free);
+	llama_memory_t memory = llama_get_memory(ctx);
+
+	// Every window starts at BOS like the perplexity tool of llama.cpp, the second half is scored
+	const bool add_bos = llama_vocab_get_add_bos(vocab);
+	const int first = n_ctx / 2;
+	const int n_scored = n_ctx - 1 - first;
+	const size_t n_record = record_size(n_vocab);
+	BatchRAII batch(n_ctx * n_seq, 0, 1);
+
+	std::vector<double> chunk_nll(n_chunks, 0.0);
+	std::vector<double> chunk_kl(reference_path ? n_chunks : 0, 0.0);
+	double total_nll = 0.0;
+	double total_kl = 0.0;
+	int64_t n_same_top = 0;
+
+	std::vector<float> log_probs((size_t)POSITIONS_PER_STEP * n_vocab);
+	// Records read from the reference, then replaced by those to save. Each position only uses its own.
+	std::vector<uint8_t> records((size_t)POSITIONS_PER_STEP * n_record);
+	std::vector<double> nll(POSITIONS_PER_STEP);
+	std::vector<double> kl(POSITIONS_PER_STEP);
+	std::vector<char> same_top(POSITIONS_PER_STEP);
+
+	for (int chunk = 0; chunk < n_chunks; chunk += n_seq) {
+		const int n_group = std::min(n_seq, n_chunks - chunk);
+		llama_memory_clear(memory, true);
+
+		batch->n_tokens = 0;
+		for (int s = 0; s < n_group; s++) {
+			const llama_token* window = corpus.data() + (size_t)(chunk + s) * n_ctx;
+			for (int i = 0; i < n_ctx; i++) {
+				int32_t k = batch->n_tokens++;
+				batch->token[k] = (i == 0 && add_bos) ? llama_vocab_bos(vocab) : window[i];
+				batch->pos[k] = i;
+				batch->n_seq_id[k] = 1;
+				batch->seq_id[k][0] = s;
+				batch->logits[k] = i >= first && i < n_ctx - 1;
+			}
+		}
+
+		{
+			JLLAMA_TRACE_SPAN("eval", "perplexity_decode");
+			if (llama_decode(ctx, *batch) != 0) {
+				JNIErrorHandler::throw_runtime_exception(env, "Failed to decode evaluation windows");
+				return nullptr;
+			}
+		}
+
+		// Scored positions of the group in corpus order, a step at a time so that the records
+		// of the reference and the saved file stay bounded
+		const int n_positions = n_group * n_scored;
+		for (int step = 0; step < n_positions; step += POSITIONS_PER_STEP) {
+			const int n_step = std::min(POSITIONS_PER_STEP, n_positions - step);
+			if (reference_file.get() && fread(records.data(), n_record, n_step, reference_file.get()) != (size_t)n_step) {
+				JNIErrorHandler::throw_runtime_exception(env, "Reference log-probabilities file is truncated");
+				return nullptr;
+			}
+
+			WorkerPool::shared().run(n_step, [&](size_t p) {
+				const int position = step + (int)p;
+				const int s = position / n_scored;
+				const int i = first + position % n_scored;
+				float* out = log_probs.data() + p * n_vocab;
+				log_softmax(llama_get_logits_ith(ctx, s * n_ctx + i), n_vocab, out);
+				const llama_token target = corpus[(size_t)(chunk + s) * n_ctx + i + 1];
+				nll[p] = -out[target];
+				bool same = false;
+				kl[p] = reference_path ? kl_divergence(records.data() + p * n_record, out, n_vocab, same) : 0.0;
+				same_top[p] = same;
+				if (save_path) encode_record(out, n_vocab, records.data() + p * n_record);
+			});
+
+			if (save_file.get() && fwrite(records.data(), n_record, n_step, save_file.get()) != (size_t)n_step) {
+				JNIErrorHandler::throw_runtime_exception(env, "Failed to write log-probabilities file");
+				return nullptr;
+			}
+			for (int p = 0; p < n_step; p++) {
+				const int c = chunk + (step + p) / n_scored;
+				chunk_nll[c] += nll[p];
+				total_nll += nll[p];
+				if (reference_path) {
+					chunk_kl[c] += kl[p];
+					total_kl += kl[p];
+					n_same_top += same_top[p];
+				}
+			}
+		}
+	}
+
+	for (double& value : chunk_nll) value /= n_scored;
+	for (double& value : chunk_kl) value /= n_scored;
+	const int64_t n_total = (int64_t)n_chunks * n_scored;
+	const double mean_nll = total_nll / n_total;
+
+	jdoubleArray nll_array = env->NewDoubleArray((jsize)chunk_nll.size());
+	jdoubleArray kl_array = env->NewDoubleArray((jsize)chunk_kl.size());
+	if (!nll_array || !kl_array) return nullptr;
+	env->SetDoubleArrayRegion(nll_array, 0, (jsize)chunk_nll.size(), chunk_nll.data());
+	env->SetDoubleArrayRegion(kl_array, 0, (jsize)chunk_kl.size(), chunk_kl.data());
+
+	const JniCache& jni = JniUtils::cache();
+	if (!jni.perplexity_result_init) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to find PerplexityResult class");
+		return nullptr;
+	}
+	return env->NewObject(jni.perplexity_result_class, jni.perplexity_result_init, std::exp(mean_nll),
+		nll_array, kl_array,
+		reference_path ? total_kl / n_total : 0.0,
+		reference_path ? (double)n_same_top / n_total : 0.0,
+		(jlong)n_total);
+
+	JNI_CATCH_RET(env, nullptr)
+}
@@ -0,0 +1,17 @@
+#ifndef EVALUATION_MANAGER_H
+#define EVALUATION_MANAGER_H
+
+#include <jni.h>
+
+class EvaluationManager {
+public:
+	// Perplexity of a tokenized corpus, split into windows of n_ctx tokens that are scored
+	// n_parallel at a time as separate sequences of one decode. Only the second half of every
+	// window is scored, with the first half as its context. Optionally the log-probabilities of
+	// the scored tokens are saved to save_path, and the KL divergence against those of a reference
+	// model previously saved to reference_path is measured.
+	static jobject evaluatePerplexity(JNIEnv* env, jobject obj, jintArray tokens, jint n_ctx, jint n_parallel,
+		jstring save_path, jstring reference_path);
+};
+
+#endif // EVALUATION_MANAGER_H
@@ -0,0 +1,203 @@
+#include "gguf_inspector.h"
+#include "gguf.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+static nlohmann::json array_element(const void* data, gguf_type type, size_t i) {
+	switch (type) {
+		case GGUF_TYPE_UINT8:   return static_cast<const uint8_t*>(data)[i];
+		case GGUF_TYPE_INT8:    return static_cast<const int8_t*>(data)[i];
+		case GGUF_TYPE_UINT16:  return static_cast<const uint16_t*>(data)[i];
+		case GGUF_TYPE_INT16:   return static_cast<const int16_t*>(data)[i];
+		case GGUF_TYPE_UINT32:  return static_cast<const uint32_t*>(data)[i];
+		case GGUF_TYPE_INT32:   return static_cast<const int32_t*>(data)[i];
+		case GGUF_TYPE_FLOAT32: return static_cast<const float*>(data)[i];
+		case GGUF_TYPE_UINT64:  return static_cast<const uint64_t*>(data)[i];
+		case GGUF_TYPE_INT64:   return static_cast<const int64_t*>(data)[i];
+		case GGUF_TYPE_FLOAT64: return static_cast<const double*>(data)[i];
+		case GGUF_TYPE_BOOL:    return static_cast<const int8_t*>(data)[i] != 0;
+		default:                return nullptr;
+	}
+}
+
+static nlohmann::json value_of(const gguf_context* gguf, int64_t key) {
+	switch (gguf_get_kv_type(gguf, key)) {
+		case GGUF_TYPE_UINT8:   return gguf_get_val_u8(gguf, key);
+		case GGUF_TYPE_INT8:    return gguf_get_val_i8(gguf, key);
+		case GGUF_TYPE_UINT16:  return gguf_get_val_u16(gguf, key);
+		case GGUF_TYPE_INT16:   return gguf_get_val_i16(gguf, key);
+		case GGUF_TYPE_UINT32:  return gguf_get_val_u32(gguf, key);
+		case GGUF_TYPE_INT32:   return gguf_get_val_i32(gguf, key);
+		case GGUF_TYPE_FLOAT32: return gguf_get_val_f32(gguf, key);
+		case GGUF_TYPE_UINT64:  return gguf_get_val_u64(gguf, key);
+		case GGUF_TYPE_INT64:   return gguf_get_val_i64(gguf, key);
+		case GGUF_TYPE_FLOAT64: return gguf_get_val_f64(gguf, key);
+		case GGUF_TYPE_BOOL:    return gguf_get_val_bool(gguf, key);
+		case GGUF_TYPE_STRING:  return gguf_get_val_str(gguf, key);
+		case GGUF_TYPE_ARRAY: {
+			gguf_type type = gguf_get_arr_type(gguf, key);
+			size_t n = gguf_get_arr_n(gguf, key);
+			if (n > GGUFInspector::MAX_ARRAY_VALUES) {
+				nlohmann::json summary;
+				summary["type"] = gguf_type_name(type);
+				summary["length"] = n;
+				return summary;
+			}
+			nlohmann::json values = nlohmann::json::array();
+			const void* data = type == GGUF_TYPE_STRING ? nullptr : gguf_get_arr_data(gguf, key);
+			for (size_t i = 0; i < n; i++) {
+				if (type == GGUF_TYPE_STRING) {
+					values.push_back(gguf_get_arr_str(gguf, key, i));
+				} else {
+					values.push_back(array_element(data, type, i));
+				}
+			}
+			return values;
+		}
+		default:
+			return nullptr;
+	}
+}
+
+// An integer value, or the largest element of an array of per layer values
+static bool integer_of(const gguf_context* gguf, const std::string& name, int64_t& out) {
+	int64_t key = gguf_find_key(gguf, name.c_str());
+	if (key < 0) return false;
+	if (gguf_get_kv_type(gguf, key) == GGUF_TYPE_ARRAY) {
+		gguf_type type = gguf_get_arr_type(gguf, key);
+		if (type == GGUF_TYPE_STRING || type == GGUF_TYPE_ARRAY) return false;
+		const void* data = gguf_get_arr_data(gguf, key);
+		bool found = false;
+		for (size_t i = 0; i < gguf_get_arr_n(gguf, key); i++) {
+			nlohmann::json element = array_element(data, type, i);
+			if (!element.is_number_integer()) continue;
+			out = found ? std::max(out, element.get<int64_t>()) : element.get<int64_t>();
+			found = true;
+		}
+		return found;
+	}
+	nlohmann::json value = value_of(gguf, key);
+	if (!value.is_number_integer()) return false;
+	out = value.get<int64_t>();
+	return true;
+}
+
+bool GGUFInspector::inspect(const std::string& path, GGUFSummary& summary, std::string& error) {
+	// Without allocation the context only holds the tensor infos, no data is read
+	ggml_context* meta = nullptr;
+	gguf_init_params params = { /*no_alloc*/ true, &meta };
+	gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+	if (!gguf) {
+		error = "Failed to read GGUF header: " + path;
+		return false;
+	}
+
+	summary = GGUFSummary();
+	summary.version = gguf_get_version(gguf);
+	summary.data_offset = gguf_get_data_offset(gguf);
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (file) summary.file_bytes = (size_t)file.tellg();
+
+	for (int64_t key = 0; key < gguf_get_n_kv(gguf); key++) {
+		summary.metadata.emplace_back(gguf_get_key(gguf, key), value_of(gguf, key).dump());
+	}
+	int64_t key = gguf_find_key(gguf, "general.architecture");
+	if (key >= 0 && gguf_get_kv_type(gguf, key) == GGUF_TYPE_STRING) summary.architecture = gguf_get_val_str(gguf, key);
+	key = gguf_find_key(gguf, "general.name");
+	if (key >= 0 && gguf_get_kv_type(gguf, key) == GGUF_TYPE_STRING) summary.name = gguf_get_val_str(gguf, key);
+	integer_of(gguf, "general.file_type", summary.file_type);
+
+	std::map<ggml_type, size_t> type_bytes;
+	for (int64_t i = 0; i < gguf_get_n_tensors(gguf); i++) {
+		GGUFTensorEntry tensor;
+		tensor.name = gguf_get_tensor_name(gguf, i);
+		tensor.type = gguf_get_tensor_type(gguf, i);
+		tensor.bytes = gguf_get_tensor_size(gguf, i);
+		tensor.offset = gguf_get_tensor_offset(gguf, i);
+		if (const ggml_tensor* info = ggml_get_tensor(meta, tensor.name.c_str())) {
+			tensor.shape.assign(info->ne, info->ne + ggml_n_dims(info));
+			summary.n_params += (uint64_t)ggml_nelements(info);
+		}
+		summary.shape.model_bytes += tensor.bytes;
+		type_bytes[tensor.type] += tensor.bytes;
+		summary.tensors.push_back(std::move(tensor));
+	}
+	auto dominant = std::max_element(type_bytes.begin(), type_bytes.end(),
+		[](const auto& a, const auto& b) { return a.second < b.second; });
+	if (dominant != type_bytes.end()) summary.weight_type = ggml_type_name(dominant->first);
+
+	// The hyperparameters llama.cpp reads for the architecture, with its defaults
+	ModelShape& shape = summary.shape;
+	const std::string arch = summary.architecture + ".";
+	int64_t value = 0;
+	if (integer_of(gguf, arch + "context_length", value)) shape.n_ctx_train = (uint32_t)value;
+	integer_of(gguf, arch + "embedding_length", shape.n_embd);
+	integer_of(gguf, arch + "block_count", shape.n_layer);
+	integer_of(gguf, arch + "attention.head_count", shape.n_head);
+	int64_t n_head_kv = shape.n_head;
+	integer_of(gguf, arch + "attention.head_count_kv", n_head_kv);
+	int64_t key_length = shape.n_embd / std::max<int64_t>(1, shape.n_head);
+	int64_t value_length = key_length;
+	integer_of(gguf, arch + "attention.key_length", key_length);
+	integer_of(gguf, arch + "attention.value_length", value_length);
+	shape.n_embd_k_gqa = key_length * n_head_kv;
+	shape.n_embd_v_gqa = value_length * n_head_kv;
+	key = gguf_find_key(gguf, "tokenizer.ggml.tokens");
+	if (key >= 0 && gguf_get_kv_type(gguf, key) == GGUF_TYPE_ARRAY) {
+		shape.n_vocab = (int64_t)gguf_get_arr_n(gguf, key);
+	} else {
+		integer_of(gguf, arch + "vocab_size", shape.n_vocab);
+	}
+	// State space and RWKV models keep a fixed size state instead of a KV cache
+	shape.recurrent = gguf_find_key(gguf, (arch + "ssm.state_size").c_str()) >= 0 ||
+		gguf_find_key(gguf, (arch + "wkv.head_size").c_str()) >= 0;
+
+	gguf_free(gguf);
+	ggml_free(meta);
+	return true;
+}
+
+std::string GGUFSummary::to_json(bool include_tensors) const {
+	nlohmann::json json;
+	json["version"] = version;
+	json["file_bytes"] = file_bytes;
+	json["data_offset"] = data_offset;
+	json["architecture"] = architecture;
+	json["name"] = name;
+	json["file_type"] = file_type;
+	json["weight_type"] = weight_type;
+	json["parameter_count"] = n_params;
+	json["weight_bytes"] = shape.model_bytes;
+	json["context_length"] = shape.n_ctx_train;
+	json["n_layer"] = shape.n_layer;
+	json["n_embd"] = shape.n_embd;
+	json["n_head"] = shape.n_head;
+	json["n_embd_k_gqa"] = shape.n_embd_k_gqa;
+	json["n_embd_v_gqa"] = shape.n_embd_v_gqa;
+	json["n_vocab"] = shape.n_vocab;
+	json["recurrent"] = shape.recurrent;
+	json["tensor_count"] = tensors.size();
+
+	nlohmann::json entries = nlohmann::json::object();
+	for (const auto& entry : metadata) {
+		entries[entry.first] = nlohmann::json::parse(entry.second);
+	}
+	json["metadata"] = entries;
+
+	if (include_tensors) {
+		nlohmann::json list = nlohmann::json::array();
+		for (const GGUFTensorEntry& tensor : tensors) {
+			nlohmann::json item;
+			item["name"] = tensor.name;
+			item["type"] = ggml_type_name(tensor.type);
+			item["shape"] = tensor.shape;
+			item["bytes"] = tensor.bytes;
+			item["offset"] = tensor.offset;
+			list.push_back(item);
+		}
+		json["tensors"] = list;
+	}
+	return json.dump();
+}
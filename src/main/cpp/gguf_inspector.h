@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "ggml.h"
+#include "memory_planner.h"
+
+struct GGUFTensorEntry {
+	std::string name;
+	ggml_type type = GGML_TYPE_F32;
+	std::vector<int64_t> shape;
+	size_t bytes = 0;
+	size_t offset = 0;   // From the start of the tensor data
+};
+
+// What the header of a GGUF file tells about the model, without mapping or reading any tensor data
+struct GGUFSummary {
+	uint32_t version = 0;
+	size_t file_bytes = 0;
+	size_t data_offset = 0;
+	std::string architecture;
+	std::string name;
+	int64_t file_type = -1;       // general.file_type, a llama_ftype, -1 if absent
+	std::string weight_type;      // The tensor type holding most of the weight bytes, e.g. "q4_K"
+	uint64_t n_params = 0;
+	ModelShape shape;
+	std::vector<std::pair<std::string, std::string>> metadata;  // Values as JSON, long arrays summarized
+	std::vector<GGUFTensorEntry> tensors;
+
+	std::string to_json(bool include_tensors) const;
+};
+
+// Reads the header, key-value metadata and tensor infos of a GGUF file through the gguf API. Takes
+// milliseconds where a model load takes seconds, so schedulers can size and pick models up front.
+class GGUFInspector {
+public:
+	// Read the header of path, false with the error if it is not a readable GGUF file
+	static bool inspect(const std::string& path, GGUFSummary& summary, std::string& error);
+
+	// Arrays up to this many elements are kept in the metadata, longer ones like the vocabulary are summarized
+	static const size_t MAX_ARRAY_VALUES = 64;
+};
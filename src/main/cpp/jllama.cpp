@@ -26,10 +26,12 @@
 #include "model_info_manager.h"
 #include "quantization_manager.h"
 #include "embedding_manager.h"
+#include "vector_index_manager.h"
 #include "completion_manager.h"
 #include "template_manager.h"
 #include "threading_manager.h"
 #include "reranking_manager.h"
+#include "evaluation_manager.h"
 #include "schema_grammar_manager.h"
 #include "model_loader_manager.h"
 #include "utility_manager.h"
@@ -40,22 +42,29 @@
 #include "stable_diffusion_manager.h"
 #endif
 
-// Global server management
-std::mutex g_servers_mutex;
-std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
+// JNI function implementations based on real llama.cpp API
 
-// Utility functions
+extern "C" {
 
-static LlamaServer* get_server(jlong handle) {
-    std::lock_guard<std::mutex> lock(g_servers_mutex);
-    auto it = g_servers.find(handle);
-    return (it != g_servers.end()) ? it->second.get() : nullptr;
+// Resolve classes, methods and fields used on hot paths once per library load
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    if (!JniUtils::initialize_cache(env)) {
+        return JNI_ERR;
+    }
+    return JNI_VERSION_1_6;
 }
 
-
-// JNI function implementations based on real llama.cpp API
-
-extern "C" {
+JNIEXPORT void JNICALL JNI_OnUnload(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK) {
+        JNILogger::shutdown(env);
+        JniUtils::release_cache(env);
+    }
+}
 
 JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_loadModel
   (JNIEnv* env, jobject obj, jobjectArray args) {
@@ -63,8 +72,33 @@ JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_loadModel
 }
 
 JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_loadModelFromSplits
-  (JNIEnv* env, jclass cls, jobjectArray paths, jobject params) {
-    return ModelLoaderManager::loadModelFromSplits(env, cls, paths, params);
+  (JNIEnv* env, jclass cls, jobjectArray paths, jobjectArray args) {
+    return ModelLoaderManager::loadModelFromSplits(env, cls, paths, args);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_startModelLoad
+  (JNIEnv* env, jclass cls, jobjectArray paths, jobjectArray args) {
+    return ModelLoaderManager::startModelLoad(env, cls, paths, args);
+}
+
+JNIEXPORT jfloat JNICALL Java_de_kherud_llama_LlamaModel_getModelLoadProgress
+  (JNIEnv* env, jclass cls, jlong job) {
+    return ModelLoaderManager::getModelLoadProgress(env, cls, job);
+}
+
+JNIEXPORT jboolean JNICALL Java_de_kherud_llama_LlamaModel_awaitModelLoad
+  (JNIEnv* env, jclass cls, jlong job, jlong timeoutMs) {
+    return ModelLoaderManager::awaitModelLoad(env, cls, job, timeoutMs);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_cancelModelLoad
+  (JNIEnv* env, jclass cls, jlong job) {
+    ModelLoaderManager::cancelModelLoad(env, cls, job);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_finishModelLoad
+  (JNIEnv* env, jclass cls, jlong job) {
+    return ModelLoaderManager::finishModelLoad(env, cls, job);
 }
 
 JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_saveModelToFile
@@ -77,6 +111,11 @@ JNIEXPORT jintArray JNICALL Java_de_kherud_llama_LlamaModel_encode
     return TokenizationHandler::encode(env, obj, text);
 }
 
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_encodeBatchNative
+  (JNIEnv* env, jobject obj, jobjectArray texts) {
+    return TokenizationHandler::encodeBatch(env, obj, texts);
+}
+
 JNIEXPORT jbyteArray JNICALL Java_de_kherud_llama_LlamaModel_decodeBytes
   (JNIEnv* env, jobject obj, jintArray token_array) {
     return TokenizationHandler::decodeBytes(env, obj, token_array);
@@ -87,6 +126,36 @@ JNIEXPORT jfloatArray JNICALL Java_de_kherud_llama_LlamaModel_embed
     return EmbeddingManager::createEmbedding(env, obj, text);
 }
 
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_embedIntoNative
+  (JNIEnv* env, jobject obj, jstring text, jobject buffer, jint offset) {
+    return EmbeddingManager::createEmbeddingInto(env, obj, text, buffer, offset);
+}
+
+JNIEXPORT jfloatArray JNICALL Java_de_kherud_llama_LlamaModel_embedBatchNative
+  (JNIEnv* env, jobject obj, jobjectArray texts) {
+    return EmbeddingManager::embedBatch(env, obj, texts);
+}
+
+JNIEXPORT jbyteArray JNICALL Java_de_kherud_llama_LlamaModel_embedCompactNative
+  (JNIEnv* env, jobject obj, jobjectArray texts, jint dimensions, jboolean normalize, jint encoding, jfloatArray scales) {
+    return EmbeddingManager::embedCompact(env, obj, texts, dimensions, normalize, encoding, scales);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_embedIntoIndexNative
+  (JNIEnv* env, jobject obj, jlong indexHandle, jobjectArray texts) {
+    return EmbeddingManager::embedIntoIndex(env, obj, indexHandle, texts);
+}
+
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_searchIndexNative
+  (JNIEnv* env, jobject obj, jlong indexHandle, jstring query, jint k, jint ef) {
+    return EmbeddingManager::searchIndex(env, obj, indexHandle, query, k, ef);
+}
+
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_searchAndRerankNative
+  (JNIEnv* env, jobject obj, jlong indexHandle, jstring query, jint candidates, jint ef, jobject reranker, jint k) {
+    return EmbeddingManager::searchAndRerank(env, obj, indexHandle, query, candidates, ef, reranker, k);
+}
+
 JNIEXPORT jfloatArray JNICALL Java_de_kherud_llama_LlamaModel_getAllEmbeddings
   (JNIEnv* env, jobject obj) {
     return EmbeddingManager::getAllEmbeddings(env, obj);
@@ -107,11 +176,26 @@ JNIEXPORT jfloatArray JNICALL Java_de_kherud_llama_LlamaModel_getEmbeddingsIthNa
     return EmbeddingManager::getEmbeddingsIth(env, obj, i);
 }
 
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_getLogitsIthIntoNative
+  (JNIEnv* env, jobject obj, jint i, jobject buffer, jint offset) {
+    return EmbeddingManager::getLogitsIthInto(env, obj, i, buffer, offset);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_getEmbeddingsIthIntoNative
+  (JNIEnv* env, jobject obj, jint i, jobject buffer, jint offset) {
+    return EmbeddingManager::getEmbeddingsIthInto(env, obj, i, buffer, offset);
+}
+
 JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_delete
   (JNIEnv* env, jobject obj) {
     ModelManager::deleteModel(env, obj);
 }
 
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_getResidentModelCount
+  (JNIEnv* env, jclass cls) {
+    return ModelManager::getResidentModelCount(env, cls);
+}
+
 JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_setLogger
   (JNIEnv* env, jclass cls, jobject logger, jobject format) {
     // Placeholder for logging setup
@@ -122,11 +206,36 @@ JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_requestCompletion
     return CompletionManager::requestCompletion(env, obj, params);
 }
 
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_requestCompletionCallback
+  (JNIEnv* env, jobject obj, jstring params, jobject callback) {
+    return CompletionManager::requestCompletionCallback(env, obj, params, callback);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_requestCompletionBinary
+  (JNIEnv* env, jobject obj, jobject buffer, jint length) {
+    return CompletionManager::requestCompletionBinary(env, obj, buffer, length);
+}
+
+JNIEXPORT jintArray JNICALL Java_de_kherud_llama_LlamaModel_requestCompletions
+  (JNIEnv* env, jobject obj, jstring params) {
+    return CompletionManager::requestCompletions(env, obj, params);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_requestConversationCompletion
+  (JNIEnv* env, jobject obj, jlong conversation, jstring params) {
+    return CompletionManager::requestConversationCompletion(env, obj, conversation, params);
+}
+
 JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_receiveCompletion
   (JNIEnv* env, jobject obj, jint id) {
     return CompletionManager::receiveCompletion(env, obj, id);
 }
 
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_receiveCompletionChunk
+  (JNIEnv* env, jobject obj, jint id, jint maxTokens, jlong timeoutMs) {
+    return CompletionManager::receiveCompletionChunk(env, obj, id, maxTokens, timeoutMs);
+}
+
 JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_cancelCompletion
   (JNIEnv* env, jobject obj, jint id) {
     CompletionManager::cancelCompletion(env, obj, id);
@@ -147,11 +256,91 @@ JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_rerank
     return RerankingManager::rerank(env, obj, query, documents);
 }
 
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_rerankTopKNative
+  (JNIEnv* env, jobject obj, jstring query, jobjectArray documents, jint k) {
+    return RerankingManager::rerankTopK(env, obj, query, documents, k);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_VectorIndex_createNative
+  (JNIEnv* env, jclass cls, jint dimension, jint storage, jint metric, jint m, jint efConstruction) {
+    return VectorIndexManager::create(env, cls, dimension, storage, metric, m, efConstruction);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_VectorIndex_openNative
+  (JNIEnv* env, jclass cls, jstring path) {
+    return VectorIndexManager::open(env, cls, path);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_VectorIndex_saveNative
+  (JNIEnv* env, jclass cls, jlong handle, jstring path) {
+    VectorIndexManager::save(env, cls, handle, path);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_VectorIndex_freeNative
+  (JNIEnv* env, jclass cls, jlong handle) {
+    VectorIndexManager::free(env, cls, handle);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_VectorIndex_sizeNative
+  (JNIEnv* env, jclass cls, jlong handle) {
+    return VectorIndexManager::size(env, cls, handle);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_VectorIndex_dimensionNative
+  (JNIEnv* env, jclass cls, jlong handle) {
+    return VectorIndexManager::dimension(env, cls, handle);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_VectorIndex_addNative
+  (JNIEnv* env, jclass cls, jlong handle, jfloatArray vectors, jobjectArray texts) {
+    return VectorIndexManager::add(env, cls, handle, vectors, texts);
+}
+
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_VectorIndex_searchNative
+  (JNIEnv* env, jclass cls, jlong handle, jfloatArray query, jint k, jint ef) {
+    return VectorIndexManager::search(env, cls, handle, query, k, ef);
+}
+
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_VectorIndex_textNative
+  (JNIEnv* env, jclass cls, jlong handle, jint entry) {
+    return VectorIndexManager::text(env, cls, handle, entry);
+}
+
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_evaluatePerplexityNative
+  (JNIEnv* env, jobject obj, jintArray tokens, jint windowSize, jint parallel, jstring savePath, jstring referencePath) {
+    return EvaluationManager::evaluatePerplexity(env, obj, tokens, windowSize, parallel, savePath, referencePath);
+}
+
 JNIEXPORT jstring JNICALL Java_de_kherud_llama_LlamaModel_applyTemplate
   (JNIEnv* env, jobject obj, jstring params) {
     return TemplateManager::applyTemplate(env, obj, params);
 }
 
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_createConversationNative
+  (JNIEnv* env, jobject obj) {
+    return TemplateManager::createConversation(env, obj);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_appendConversationMessageNative
+  (JNIEnv* env, jobject obj, jlong conversation, jstring role, jstring content) {
+    TemplateManager::appendConversationMessage(env, obj, conversation, role, content);
+}
+
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_LlamaModel_renderConversationNative
+  (JNIEnv* env, jobject obj, jlong conversation) {
+    return TemplateManager::renderConversation(env, obj, conversation);
+}
+
+JNIEXPORT jintArray JNICALL Java_de_kherud_llama_LlamaModel_getConversationTokensNative
+  (JNIEnv* env, jobject obj, jlong conversation) {
+    return TemplateManager::getConversationTokens(env, obj, conversation);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_freeConversationNative
+  (JNIEnv* env, jobject obj, jlong conversation) {
+    TemplateManager::freeConversation(env, obj, conversation);
+}
+
 // State persistence functions
 JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_getStateSize
   (JNIEnv* env, jobject obj) {
@@ -203,6 +392,41 @@ JNIEXPORT jintArray JNICALL Java_de_kherud_llama_LlamaModel_loadSequenceFromFile
     return StateManager::loadSequenceFromFile(env, obj, path, seq_id, max_tokens);
 }
 
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_getStateIntoNative
+  (JNIEnv* env, jobject obj, jint seq_id, jobject buffer, jint offset, jint length) {
+    return StateManager::getStateInto(env, obj, seq_id, buffer, offset, length);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_setStateFromNative
+  (JNIEnv* env, jobject obj, jint seq_id, jobject buffer, jint offset, jint length) {
+    return StateManager::setStateFrom(env, obj, seq_id, buffer, offset, length);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_exportStateFileNative
+  (JNIEnv* env, jobject obj, jint seq_id, jstring path, jboolean compress) {
+    return StateManager::exportStateFile(env, obj, seq_id, path, compress);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_importStateFileNative
+  (JNIEnv* env, jobject obj, jint seq_id, jstring path) {
+    return StateManager::importStateFile(env, obj, seq_id, path);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_exportStateChannelNative
+  (JNIEnv* env, jobject obj, jint seq_id, jobject channel, jint chunk_size, jboolean compress) {
+    return StateManager::exportStateChannel(env, obj, seq_id, channel, chunk_size, compress);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_importStateChannelNative
+  (JNIEnv* env, jobject obj, jint seq_id, jobject channel, jint chunk_size) {
+    return StateManager::importStateChannel(env, obj, seq_id, channel, chunk_size);
+}
+
+JNIEXPORT jboolean JNICALL Java_de_kherud_llama_LlamaModel_isStateCompressionAvailable
+  (JNIEnv* env, jclass cls) {
+    return StateManager::isStateCompressionAvailable(env, cls);
+}
+
 // LoRA adapter functions
 JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_loadLoRAAdapterNative
   (JNIEnv* env, jobject obj, jstring lora_path) {
@@ -583,6 +807,21 @@ JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_getTokenAttributesNative
     return ModelInfoManager::getTokenAttributes(env, obj, token);
 }
 
+JNIEXPORT jobject JNICALL Java_de_kherud_llama_LlamaModel_exportVocabularyNative
+  (JNIEnv* env, jobject obj) {
+    return ModelInfoManager::exportVocabulary(env, obj);
+}
+
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_ModelHeader_readNative
+  (JNIEnv* env, jclass cls, jstring path, jboolean includeTensors) {
+    return ModelInfoManager::inspectFile(env, cls, path, includeTensors);
+}
+
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_ModelHeader_estimateMemoryNative
+  (JNIEnv* env, jclass cls, jstring path, jint nCtx, jstring typeK, jstring typeV, jboolean flashAttn) {
+    return ModelInfoManager::estimateFileMemory(env, cls, path, nCtx, typeK, typeV, flashAttn);
+}
+
 JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_getBosTokenNative
   (JNIEnv* env, jobject obj) {
     return ModelInfoManager::getBosToken(env, obj);
@@ -665,6 +904,26 @@ JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaUtils_timeUsNative
     return UtilityManager::timeUs(env, cls);
 }
 
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaUtils_startTracingNative
+  (JNIEnv* env, jclass cls) {
+    UtilityManager::startTracing(env, cls);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaUtils_stopTracingNative
+  (JNIEnv* env, jclass cls) {
+    UtilityManager::stopTracing(env, cls);
+}
+
+JNIEXPORT jboolean JNICALL Java_de_kherud_llama_LlamaUtils_isTracingNative
+  (JNIEnv* env, jclass cls) {
+    return UtilityManager::isTracing(env, cls);
+}
+
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaUtils_writeTraceNative
+  (JNIEnv* env, jclass cls, jstring path) {
+    return UtilityManager::writeTrace(env, cls, path);
+}
+
 JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaUtils_setLogCallbackNative
   (JNIEnv* env, jclass cls, jobject callback) {
     UtilityManager::setLogCallback(env, cls, callback);
@@ -760,6 +1019,11 @@ JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaModel_resetPerformanceDataNativ
     UtilityManager::resetPerformanceData(env, obj);
 }
 
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_LlamaModel_getLatencyStatsNative
+  (JNIEnv* env, jobject obj) {
+    return UtilityManager::getLatencyStats(env, obj);
+}
+
 JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_getModelLayerCountNative
   (JNIEnv* env, jobject obj) {
     return UtilityManager::getModelLayerCount(env, obj);
@@ -807,6 +1071,21 @@ JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_getModelKeyValueHeadsNat
     return UtilityManager::getModelKeyValueHeads(env, obj);
 }
 
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_LlamaModel_getMemoryPlanNative
+  (JNIEnv* env, jobject obj) {
+    return UtilityManager::getMemoryPlan(env, obj);
+}
+
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_LlamaModel_getDevicePlacementNative
+  (JNIEnv* env, jobject obj) {
+    return UtilityManager::getDevicePlacement(env, obj);
+}
+
+JNIEXPORT jstring JNICALL Java_de_kherud_llama_LlamaModel_tuneNative
+  (JNIEnv* env, jobject obj, jint nPrompt, jint nGenerate, jint maxThreads, jint repetitions, jstring profilePath) {
+    return UtilityManager::tuneModel(env, obj, nPrompt, nGenerate, maxThreads, repetitions, profilePath);
+}
+
 JNIEXPORT jboolean JNICALL Java_de_kherud_llama_LlamaModel_isRecurrentModelNative
   (JNIEnv* env, jobject obj) {
     return UtilityManager::isRecurrentModel(env, obj);
@@ -866,6 +1145,31 @@ JNIEXPORT jintArray JNICALL Java_de_kherud_llama_ThreadingManager_getModelThread
     return ThreadingManager::getModelThreading(env, model);
 }
 
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_ThreadingManager_createThreadPool
+  (JNIEnv* env, jclass cls, jint nThreads, jintArray cpus, jint priority, jint poll, jboolean strictCpu) {
+    return ThreadingManager::createThreadPool(env, cls, nThreads, cpus, priority, poll, strictCpu);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_ThreadingManager_freeThreadPool
+  (JNIEnv* env, jclass cls, jlong pool) {
+    ThreadingManager::freeThreadPool(env, cls, pool);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_ThreadingManager_getNumaNodeCount
+  (JNIEnv* env, jclass cls) {
+    return ThreadingManager::getNumaNodeCount(env, cls);
+}
+
+JNIEXPORT jintArray JNICALL Java_de_kherud_llama_ThreadingManager_getNumaNodeCpus
+  (JNIEnv* env, jclass cls, jint node) {
+    return ThreadingManager::getNumaNodeCpus(env, cls, node);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_ThreadingManager_getModelNumaNode
+  (JNIEnv* env, jclass cls, jobject model) {
+    return ThreadingManager::getModelNumaNode(env, model);
+}
+
 JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaModel_getVocabMaskTokenNative
   (JNIEnv* env, jobject obj) {
     return UtilityManager::getVocabMaskToken(env, obj);
@@ -1000,6 +1304,17 @@ JNIEXPORT jint JNICALL Java_de_kherud_llama_BatchProcessor_decodeTokensNative
     return BatchManager::decodeTokens(env, modelObj, batchHandle);
 }
 
+JNIEXPORT void JNICALL Java_de_kherud_llama_BatchProcessor_fillBatchNative
+  (JNIEnv* env, jclass cls, jlong batchHandle, jobject packed) {
+    BatchManager::fillBatch(env, batchHandle, packed);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_BatchProcessor_decodeAndCollectNative
+  (JNIEnv* env, jclass cls, jobject modelObj, jlong batchHandle, jobject packed, jobject output, jint offset,
+   jboolean embeddings) {
+    return BatchManager::decodeAndCollect(env, modelObj, batchHandle, packed, output, offset, embeddings);
+}
+
 JNIEXPORT void JNICALL Java_de_kherud_llama_BatchProcessor_setBatchTokensNative
   (JNIEnv* env, jclass cls, jlong batchHandle, jintArray tokens) {
     BatchManager::setBatchTokens(env, batchHandle, tokens);
@@ -1069,7 +1384,42 @@ JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaQuantizer_quantizeModelNative
     return QuantizationManager::quantizeModel(env, inputPath, outputPath, params);
 }
 
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaQuantizer_startQuantizeNative
+  (JNIEnv* env, jclass cls, jstring inputPath, jstring outputPath, jobject params) {
+    return QuantizationManager::startQuantize(env, inputPath, outputPath, params);
+}
+
+JNIEXPORT jint JNICALL Java_de_kherud_llama_LlamaQuantizer_getQuantizeTensorCountNative
+  (JNIEnv* env, jclass cls, jlong job) {
+    return QuantizationManager::getQuantizeTensorCount(env, job);
+}
+
+JNIEXPORT jobjectArray JNICALL Java_de_kherud_llama_LlamaQuantizer_getQuantizeTensorsNative
+  (JNIEnv* env, jclass cls, jlong job, jint from) {
+    return QuantizationManager::getQuantizeTensors(env, job, from);
+}
+
+JNIEXPORT jboolean JNICALL Java_de_kherud_llama_LlamaQuantizer_awaitQuantizeNative
+  (JNIEnv* env, jclass cls, jlong job, jlong timeoutMs) {
+    return QuantizationManager::awaitQuantize(env, job, timeoutMs);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaQuantizer_cancelQuantizeNative
+  (JNIEnv* env, jclass cls, jlong job) {
+    QuantizationManager::cancelQuantize(env, job);
+}
+
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaQuantizer_finishQuantizeNative
+  (JNIEnv* env, jclass cls, jlong job) {
+    QuantizationManager::finishQuantize(env, job);
+}
+
 // Training Management JNI bindings
+JNIEXPORT jlong JNICALL Java_de_kherud_llama_LlamaModel_writeTokenShardNative
+  (JNIEnv* env, jobject obj, jstring textPath, jstring shardPath) {
+    return TrainingManager::writeTokenShard(env, obj, textPath, shardPath);
+}
+
 JNIEXPORT jboolean JNICALL Java_de_kherud_llama_LlamaTrainer_validateDatasetNative
   (JNIEnv* env, jclass cls, jstring datasetPath) {
     return TrainingManager::validateDataset(env, cls, datasetPath);
@@ -1100,6 +1450,11 @@ JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaTrainer_loadCheckpointNative
     TrainingManager::loadCheckpoint(env, cls, trainingHandle, checkpointPath);
 }
 
+JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaTrainer_awaitCheckpointNative
+  (JNIEnv* env, jclass cls, jlong trainingHandle) {
+    TrainingManager::awaitCheckpoint(env, cls, trainingHandle);
+}
+
 JNIEXPORT void JNICALL Java_de_kherud_llama_LlamaTrainer_finishTrainingNative
   (JNIEnv* env, jclass cls, jlong trainingHandle) {
     TrainingManager::finishTraining(env, cls, trainingHandle);
@@ -0,0 +1,413 @@
+// Micro-benchmark of the JNI hot paths, runs the Java API of jllama in an embedded JVM.
+// Reports ns/op and native heap allocations per op, so that changes to marshaling can be
+// compared against a baseline. Raw llama.cpp calls of the same work are measured alongside,
+// the difference between a JNI op and its raw counterpart is what the binding costs.
+//
+// Usage: jllama_benchmark --model PATH [--embedding-model PATH] [--rerank-model PATH]
+//            [--classpath DIR] [--lib-path DIR] [--iterations N] [--gpu-layers N] [--n-predict N] [--json]
+
+#include <jni.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// Native heap allocations of every thread, the JVM loads jllama into this process so that its
+// operator new resolves to the counting one below. JVM internals allocate with malloc and are not counted.
+static std::atomic<uint64_t> g_allocations{0};
+static std::atomic<uint64_t> g_allocated_bytes{0};
+
+void* operator new(size_t size) {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	return std::malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+	return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+
+static const char* BENCH_TEXT =
+	"int main(int argc, char** argv) {\n"
+	"    std::vector<std::string> args(argv + 1, argv + argc);\n"
+	"    for (const auto& arg : args) {\n"
+	"        if (arg == \"--help\") { print_usage(); return 0; }\n"
+	"    }\n"
+	"    return run(args);\n"
+	"}\n";
+
+struct BenchOptions {
+	std::string model;
+	std::string embedding_model;
+	std::string rerank_model;
+	std::string classpath = "target/classes";
+	std::string lib_path;
+	int iterations = 200;
+	int gpu_layers = 0;
+	int n_predict = 32;
+	bool json = false;
+};
+
+struct BenchResult {
+	std::string name;
+	uint64_t ops = 0;
+	double ns_per_op = 0.0;
+	double allocs_per_op = 0.0;
+	double bytes_per_op = 0.0;
+};
+
+// One benchmark iteration, returns the number of ops it performed or -1 on failure.
+// Ops that time only part of an iteration add their own time to elapsed_ns.
+using BenchFn = std::function<long(uint64_t& elapsed_ns)>;
+
+static std::vector<BenchResult> g_results;
+
+static uint64_t now_ns() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool check_exception(JNIEnv* env, const char* what) {
+	if (!env->ExceptionCheck()) return true;
+	fprintf(stderr, "%s threw:\n", what);
+	env->ExceptionDescribe();
+	env->ExceptionClear();
+	return false;
+}
+
+// Local references of every iteration are dropped with a frame, env is nullptr for raw benchmarks
+static bool run_bench(JNIEnv* env, const std::string& name, int iterations, const BenchFn& fn) {
+	// Warmup, the first calls resolve JNI methods and fill caches
+	uint64_t ignored = 0;
+	for (int i = 0; i < std::max(1, iterations / 10); i++) {
+		if (env) env->PushLocalFrame(64);
+		long ops = fn(ignored);
+		if (env) env->PopLocalFrame(nullptr);
+		if (ops < 0) {
+			fprintf(stderr, "%s failed\n", name.c_str());
+			return false;
+		}
+	}
+
+	BenchResult result;
+	result.name = name;
+	uint64_t elapsed = 0;
+	uint64_t allocations = g_allocations.load();
+	uint64_t bytes = g_allocated_bytes.load();
+	for (int i = 0; i < iterations; i++) {
+		if (env) env->PushLocalFrame(64);
+		uint64_t timed = 0;
+		uint64_t start = now_ns();
+		long ops = fn(timed);
+		uint64_t end = now_ns();
+		if (env) env->PopLocalFrame(nullptr);
+		if (ops < 0) {
+			fprintf(stderr, "%s failed\n", name.c_str());
+			return false;
+		}
+		elapsed += timed ? timed : end - start;
+		result.ops += (uint64_t)ops;
+	}
+	if (result.ops == 0) return false;
+	result.ns_per_op = (double)elapsed / result.ops;
+	result.allocs_per_op = (double)(g_allocations.load() - allocations) / result.ops;
+	result.bytes_per_op = (double)(g_allocated_bytes.load() - bytes) / result.ops;
+	g_results.push_back(result);
+	return true;
+}
+
+static jobject load_model(JNIEnv* env, const std::string& path, int gpu_layers, const char* mode) {
+	jclass params_cls = env->FindClass("de/kherud/llama/ModelParameters");
+	jclass model_cls = env->FindClass("de/kherud/llama/LlamaModel");
+	if (!check_exception(env, "FindClass")) return nullptr;
+
+	jobject params = env->NewObject(params_cls, env->GetMethodID(params_cls, "<init>", "()V"));
+	const char* sig = "(Ljava/lang/String;)Lde/kherud/llama/ModelParameters;";
+	jstring jpath = env->NewStringUTF(path.c_str());
+	env->CallObjectMethod(params, env->GetMethodID(params_cls, "setModel", sig), jpath);
+	env->CallObjectMethod(params, env->GetMethodID(params_cls, "setGpuLayers", "(I)Lde/kherud/llama/ModelParameters;"), gpu_layers);
+	env->CallObjectMethod(params, env->GetMethodID(params_cls, "setCtxSize", "(I)Lde/kherud/llama/ModelParameters;"), 1024);
+	if (mode) {
+		env->CallObjectMethod(params, env->GetMethodID(params_cls, mode, "()Lde/kherud/llama/ModelParameters;"));
+	}
+	if (!check_exception(env, "ModelParameters")) return nullptr;
+
+	jobject model = env->NewObject(model_cls,
+		env->GetMethodID(model_cls, "<init>", "(Lde/kherud/llama/ModelParameters;)V"), params);
+	if (!check_exception(env, "LlamaModel") || !model) return nullptr;
+	return env->NewGlobalRef(model);
+}
+
+static void close_model(JNIEnv* env, jobject model) {
+	if (!model) return;
+	jclass model_cls = env->GetObjectClass(model);
+	env->CallVoidMethod(model, env->GetMethodID(model_cls, "close", "()V"));
+	check_exception(env, "close");
+	env->DeleteGlobalRef(model);
+}
+
+// The native calls of the hot paths, private natives are reachable through JNI as well
+static bool bench_completion_model(JNIEnv* env, const BenchOptions& options) {
+	jobject model = load_model(env, options.model, options.gpu_layers, nullptr);
+	if (!model) return false;
+	jclass cls = env->GetObjectClass(model);
+	jmethodID get_ctx_size = env->GetMethodID(cls, "getContextSizeNative", "()J");
+	jmethodID encode = env->GetMethodID(cls, "encode", "(Ljava/lang/String;)[I");
+	jmethodID decode = env->GetMethodID(cls, "decode", "([I)Ljava/lang/String;");
+	jmethodID request = env->GetMethodID(cls, "requestCompletion", "(Ljava/lang/String;)I");
+	jmethodID receive = env->GetMethodID(cls, "receiveCompletion", "(I)Lde/kherud/llama/LlamaOutput;");
+	jmethodID get_state = env->GetMethodID(cls, "getStateData", "()[B");
+	jmethodID set_state = env->GetMethodID(cls, "setStateData", "([B)J");
+	jclass output_cls = env->FindClass("de/kherud/llama/LlamaOutput");
+	jfieldID stop = output_cls ? env->GetFieldID(output_cls, "stop", "Z") : nullptr;
+	if (!check_exception(env, "LlamaModel methods")) {
+		close_model(env, model);
+		return false;
+	}
+	jstring text = (jstring)env->NewGlobalRef(env->NewStringUTF(BENCH_TEXT));
+	jintArray tokens = (jintArray)env->NewGlobalRef(env->CallObjectMethod(model, encode, text));
+	bool ok = check_exception(env, "encode");
+
+	ok = ok && run_bench(env, "jni_call", options.iterations * 50, [&](uint64_t&) -> long {
+		env->CallLongMethod(model, get_ctx_size);
+		return env->ExceptionCheck() ? -1 : 1;
+	});
+	ok = ok && run_bench(env, "tokenize", options.iterations, [&](uint64_t&) -> long {
+		env->CallObjectMethod(model, encode, text);
+		return env->ExceptionCheck() ? -1 : 1;
+	});
+	ok = ok && run_bench(env, "detokenize", options.iterations, [&](uint64_t&) -> long {
+		env->CallObjectMethod(model, decode, tokens);
+		return env->ExceptionCheck() ? -1 : 1;
+	});
+
+	// Only the receive calls are timed, one op is one streamed token
+	std::string params = "{\"prompt\":\"int main() {\",\"n_predict\":" + std::to_string(options.n_predict) +
+		",\"stream\":true,\"temperature\":0}";
+	jstring jparams = (jstring)env->NewGlobalRef(env->NewStringUTF(params.c_str()));
+	ok = ok && run_bench(env, "receive_token", std::max(1, options.iterations / 20), [&](uint64_t& elapsed) -> long {
+		jint task = env->CallIntMethod(model, request, jparams);
+		if (env->ExceptionCheck()) return -1;
+		long received = 0;
+		uint64_t start = now_ns();
+		for (;;) {
+			jobject output = env->CallObjectMethod(model, receive, task);
+			if (env->ExceptionCheck() || !output) return -1;
+			received++;
+			bool done = env->GetBooleanField(output, stop);
+			env->DeleteLocalRef(output);
+			if (done) break;
+		}
+		elapsed += now_ns() - start;
+		return received;
+	});
+
+	jbyteArray state = ok ? (jbyteArray)env->CallObjectMethod(model, get_state) : nullptr;
+	ok = ok && check_exception(env, "getStateData") && state;
+	if (ok) state = (jbyteArray)env->NewGlobalRef(state);
+	ok = ok && run_bench(env, "state_save", std::max(1, options.iterations / 10), [&](uint64_t&) -> long {
+		env->CallObjectMethod(model, get_state);
+		return env->ExceptionCheck() ? -1 : 1;
+	});
+	ok = ok && run_bench(env, "state_load", std::max(1, options.iterations / 10), [&](uint64_t&) -> long {
+		env->CallLongMethod(model, set_state, state);
+		return env->ExceptionCheck() ? -1 : 1;
+	});
+
+	check_exception(env, "benchmark");
+	if (state) env->DeleteGlobalRef(state);
+	env->DeleteGlobalRef(jparams);
+	env->DeleteGlobalRef(tokens);
+	env->DeleteGlobalRef(text);
+	close_model(env, model);
+	return ok;
+}
+
+static bool bench_embedding_model(JNIEnv* env, const BenchOptions& options) {
+	jobject model = load_model(env, options.embedding_model, options.gpu_layers, "enableEmbedding");
+	if (!model) return false;
+	jmethodID embed = env->GetMethodID(env->GetObjectClass(model), "embed", "(Ljava/lang/String;)[F");
+	jstring text = (jstring)env->NewGlobalRef(env->NewStringUTF(BENCH_TEXT));
+	bool ok = check_exception(env, "embed") && run_bench(env, "embed", std::max(1, options.iterations / 10),
+		[&](uint64_t&) -> long {
+			env->CallObjectMethod(model, embed, text);
+			return env->ExceptionCheck() ? -1 : 1;
+		});
+	check_exception(env, "embed");
+	env->DeleteGlobalRef(text);
+	close_model(env, model);
+	return ok;
+}
+
+static bool bench_rerank_model(JNIEnv* env, const BenchOptions& options) {
+	jobject model = load_model(env, options.rerank_model, options.gpu_layers, "enableReranking");
+	if (!model) return false;
+	jmethodID rerank = env->GetMethodID(env->GetObjectClass(model), "rerank",
+		"(Ljava/lang/String;[Ljava/lang/String;)Lde/kherud/llama/LlamaOutput;");
+	jstring query = (jstring)env->NewGlobalRef(env->NewStringUTF("How is the exit code returned?"));
+	jobjectArray documents = (jobjectArray)env->NewGlobalRef(
+		env->NewObjectArray(4, env->FindClass("java/lang/String"), nullptr));
+	for (int i = 0; i < 4; i++) {
+		env->SetObjectArrayElement(documents, i, env->NewStringUTF(BENCH_TEXT + i * 16));
+	}
+	// One op is one scored document
+	bool ok = check_exception(env, "rerank") && run_bench(env, "rerank_document", std::max(1, options.iterations / 10),
+		[&](uint64_t&) -> long {
+			env->CallObjectMethod(model, rerank, query, documents);
+			return env->ExceptionCheck() ? -1 : 4;
+		});
+	check_exception(env, "rerank");
+	env->DeleteGlobalRef(documents);
+	env->DeleteGlobalRef(query);
+	close_model(env, model);
+	return ok;
+}
+
+// The same tokenization without the binding, on a vocabulary-only load of the model
+static bool bench_raw(const BenchOptions& options) {
+	llama_model_params params = llama_model_default_params();
+	params.vocab_only = true;
+	llama_model* model = llama_model_load_from_file(options.model.c_str(), params);
+	if (!model) {
+		fprintf(stderr, "Failed to load the vocabulary of %s\n", options.model.c_str());
+		return false;
+	}
+	const llama_vocab* vocab = llama_model_get_vocab(model);
+	const int32_t text_len = (int32_t)strlen(BENCH_TEXT);
+	std::vector<llama_token> tokens(text_len + 2);
+	int32_t n_tokens = llama_tokenize(vocab, BENCH_TEXT, text_len, tokens.data(), tokens.size(), true, true);
+	std::vector<char> text(text_len * 4 + 16);
+
+	// Buffers are reused like a caller that cares would, so the allocations are llama.cpp's own
+	bool ok = n_tokens > 0;
+	ok = ok && run_bench(nullptr, "raw_tokenize", options.iterations, [&](uint64_t&) -> long {
+		return llama_tokenize(vocab, BENCH_TEXT, text_len, tokens.data(), tokens.size(), true, true) > 0 ? 1 : -1;
+	});
+	ok = ok && run_bench(nullptr, "raw_detokenize", options.iterations, [&](uint64_t&) -> long {
+		return llama_detokenize(vocab, tokens.data(), n_tokens, text.data(), text.size(), false, false) >= 0 ? 1 : -1;
+	});
+	llama_model_free(model);
+	return ok;
+}
+
+static void print_results(bool json) {
+	if (json) {
+		printf("[");
+		for (size_t i = 0; i < g_results.size(); i++) {
+			const BenchResult& r = g_results[i];
+			printf("%s{\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}",
+				i ? "," : "", r.name.c_str(), (unsigned long long)r.ops, r.ns_per_op, r.allocs_per_op, r.bytes_per_op);
+		}
+		printf("]\n");
+		return;
+	}
+	printf("%-18s %10s %14s %12s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "bytes/op");
+	for (const BenchResult& r : g_results) {
+		printf("%-18s %10llu %14.1f %12.2f %12.1f\n", r.name.c_str(), (unsigned long long)r.ops,
+			r.ns_per_op, r.allocs_per_op, r.bytes_per_op);
+	}
+}
+
+static void print_usage(const char* program) {
+	fprintf(stderr,
+		"Usage: %s --model PATH [options]\n"
+		"  --embedding-model PATH  model for the embed benchmark (default: --model)\n"
+		"  --rerank-model PATH     reranking model, the rerank benchmark is skipped without one\n"
+		"  --classpath DIR         jllama classes (default: target/classes)\n"
+		"  --lib-path DIR          directory of the jllama library (default: the loader's lookup)\n"
+		"  --iterations N          iterations of the cheap benchmarks (default: 200)\n"
+		"  --gpu-layers N          layers offloaded to the GPU (default: 0)\n"
+		"  --n-predict N           tokens per streamed completion (default: 32)\n"
+		"  --json                  print the results as JSON\n", program);
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--model" && has_value) {
+			options.model = argv[++i];
+		} else if (arg == "--embedding-model" && has_value) {
+			options.embedding_model = argv[++i];
+		} else if (arg == "--rerank-model" && has_value) {
+			options.rerank_model = argv[++i];
+		} else if (arg == "--classpath" && has_value) {
+			options.classpath = argv[++i];
+		} else if (arg == "--lib-path" && has_value) {
+			options.lib_path = argv[++i];
+		} else if (arg == "--iterations" && has_value) {
+			options.iterations = std::max(1, atoi(argv[++i]));
+		} else if (arg == "--gpu-layers" && has_value) {
+			options.gpu_layers = atoi(argv[++i]);
+		} else if (arg == "--n-predict" && has_value) {
+			options.n_predict = std::max(1, atoi(argv[++i]));
+		} else if (arg == "--json") {
+			options.json = true;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (options.model.empty()) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if (options.embedding_model.empty()) options.embedding_model = options.model;
+
+	std::vector<std::string> jvm_options = { "-Djava.class.path=" + options.classpath };
+	if (!options.lib_path.empty()) jvm_options.push_back("-Dde.kherud.llama.lib.path=" + options.lib_path);
+	std::vector<JavaVMOption> vm_options(jvm_options.size());
+	for (size_t i = 0; i < jvm_options.size(); i++) {
+		vm_options[i].optionString = const_cast<char*>(jvm_options[i].c_str());
+		vm_options[i].extraInfo = nullptr;
+	}
+	JavaVMInitArgs vm_args;
+	vm_args.version = JNI_VERSION_1_8;
+	vm_args.nOptions = (jint)vm_options.size();
+	vm_args.options = vm_options.data();
+	vm_args.ignoreUnrecognized = JNI_FALSE;
+
+	JavaVM* jvm = nullptr;
+	JNIEnv* env = nullptr;
+	if (JNI_CreateJavaVM(&jvm, (void**)&env, &vm_args) != JNI_OK) {
+		fprintf(stderr, "Failed to create the JVM\n");
+		return 1;
+	}
+
+	llama_backend_init();
+	bool ok = bench_raw(options);
+	ok = bench_completion_model(env, options) && ok;
+	ok = bench_embedding_model(env, options) && ok;
+	if (!options.rerank_model.empty()) {
+		ok = bench_rerank_model(env, options) && ok;
+	}
+	print_results(options.json);
+
+	jvm->DestroyJavaVM();
+	return ok ? 0 : 1;
+}
@@ -69,7 +69,7 @@ public:
     
     // Check for null pointers and throw appropriate exception
     template<typename T>
-    static bool check_null(JNIEnv* env, T* ptr, const std::string& name) {
+    static bool check_null(JNIEnv* env, const T& ptr, const std::string& name) {
         if (!ptr) {
             throw_null_pointer(env, name + " is null");
             return true;
@@ -1,13 +1,74 @@
 #include "jni_logger.h"
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <memory>
+#include <thread>
+
+namespace {
+
+enum RecordKind : uint8_t {
+    RECORD_LOG = 0,
+    RECORD_CALLBACK = 1
+};
+
+// A slot is free for the producer of position p while its sequence is p, and
+// holds a finished record for the consumer once its sequence is p + 1
+struct LogRecord {
+    std::atomic<uint64_t> sequence;
+    RecordKind kind;
+    int level;
+    char text[JNILogger::MESSAGE_SIZE];
+};
+
+std::unique_ptr<LogRecord[]> g_ring;
+std::atomic<uint64_t> g_tail{0};
+uint64_t g_head = 0;              // Only touched by the drain thread
+std::atomic<uint64_t> g_printed{0};
+
+// The thread is never destroyed at exit, a joinable std::thread would terminate the process
+std::thread* g_drain_thread = nullptr;
+std::atomic<bool> g_stop{false};
+std::mutex g_wake_mutex;
+std::condition_variable g_wake;
+
+// Claim the next free slot, nullptr when the ring is full
+LogRecord* claim_slot(uint64_t& position) {
+    uint64_t pos = g_tail.load(std::memory_order_relaxed);
+    for (;;) {
+        LogRecord& slot = g_ring[pos & (JNILogger::CAPACITY - 1)];
+        uint64_t seq = slot.sequence.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if (diff == 0) {
+            if (g_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                position = pos;
+                return &slot;
+            }
+        } else if (diff < 0) {
+            return nullptr;
+        } else {
+            pos = g_tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void publish_slot(LogRecord* slot, uint64_t position, bool urgent) {
+    slot->sequence.store(position + 1, std::memory_order_release);
+    // Everything else waits for the next poll of the drain thread
+    if (urgent) g_wake.notify_one();
+}
+
+}
 
 // Static member definitions
 std::mutex JNILogger::logger_mutex_;
 JavaVM* JNILogger::jvm_ = nullptr;
-bool JNILogger::initialized_ = false;
-JNILogger::Level JNILogger::min_level_ = JNILogger::DEBUG;
+std::atomic<bool> JNILogger::initialized_{false};
+std::atomic<int> JNILogger::min_level_{JNILogger::DEBUG};
+std::atomic<uint64_t> JNILogger::dropped_{0};
+std::atomic<JNILogger::CallbackHandler> JNILogger::callback_handler_{nullptr};
 
 jclass JNILogger::system_class_ = nullptr;
 jfieldID JNILogger::out_field_ = nullptr;
@@ -17,7 +78,7 @@ jmethodID JNILogger::println_method_ = nullptr;
 bool JNILogger::initialize(JNIEnv* env) {
     std::lock_guard<std::mutex> lock(logger_mutex_);
     
-    if (initialized_) return true;
+    if (initialized_.load(std::memory_order_relaxed)) return true;
     
     // Get JavaVM reference
     if (env->GetJavaVM(&jvm_) != JNI_OK) {
@@ -46,15 +107,36 @@ bool JNILogger::initialize(JNIEnv* env) {
     env->DeleteLocalRef(printstream_class);
     
     if (!println_method_) return false;
+
+    g_ring.reset(new LogRecord[CAPACITY]);
+    for (uint32_t i = 0; i < CAPACITY; i++) {
+        g_ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    g_tail.store(0, std::memory_order_relaxed);
+    g_head = 0;
+    g_printed.store(0, std::memory_order_relaxed);
+    dropped_.store(0, std::memory_order_relaxed);
+    g_stop.store(false, std::memory_order_relaxed);
+    g_drain_thread = new std::thread(drain_loop);
     
-    initialized_ = true;
+    initialized_.store(true, std::memory_order_release);
     return true;
 }
 
 void JNILogger::shutdown(JNIEnv* env) {
     std::lock_guard<std::mutex> lock(logger_mutex_);
     
-    if (!initialized_) return;
+    if (!initialized_.load(std::memory_order_relaxed)) return;
+    initialized_.store(false, std::memory_order_relaxed);
+
+    // The drain thread prints what is left before it exits
+    g_stop.store(true, std::memory_order_release);
+    g_wake.notify_one();
+    if (g_drain_thread) {
+        g_drain_thread->join();
+        delete g_drain_thread;
+        g_drain_thread = nullptr;
+    }
     
     if (system_class_) {
         env->DeleteGlobalRef(system_class_);
@@ -65,105 +147,165 @@ void JNILogger::shutdown(JNIEnv* env) {
     err_field_ = nullptr;
     println_method_ = nullptr;
     jvm_ = nullptr;
-    initialized_ = false;
 }
 
 void JNILogger::set_level(Level level) {
-    std::lock_guard<std::mutex> lock(logger_mutex_);
-    min_level_ = level;
+    min_level_.store(level, std::memory_order_relaxed);
+}
+
+void JNILogger::set_callback_handler(CallbackHandler handler) {
+    callback_handler_.store(handler, std::memory_order_release);
 }
 
 void JNILogger::debug(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    
-    char buffer[1024];
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_internal(DEBUG, format, args);
     va_end(args);
-    
-    log_internal(DEBUG, buffer);
 }
 
 void JNILogger::info(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    
-    char buffer[1024];
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_internal(INFO, format, args);
     va_end(args);
-    
-    log_internal(INFO, buffer);
 }
 
 void JNILogger::warn(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    
-    char buffer[1024];
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_internal(WARN, format, args);
     va_end(args);
-    
-    log_internal(WARN, buffer);
 }
 
 void JNILogger::error(const char* format, ...) {
     va_list args;
     va_start(args, format);
-    
-    char buffer[1024];
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_internal(ERROR, format, args);
     va_end(args);
-    
-    log_internal(ERROR, buffer);
 }
 
 void JNILogger::log(Level level, const char* format, ...) {
     va_list args;
     va_start(args, format);
-    
-    char buffer[1024];
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_internal(level, format, args);
     va_end(args);
-    
-    log_internal(level, buffer);
 }
 
-void JNILogger::log_internal(Level level, const std::string& message) {
-    std::lock_guard<std::mutex> lock(logger_mutex_);
-    
-    // Check if logging is enabled for this level
-    if (level < min_level_ || !initialized_) return;
-    
-    JNIEnvGuard env_guard;
-    JNIEnv* env = env_guard.get();
-    if (!env) return;
-    
-    // Format message with level prefix
-    std::string formatted = std::string("[") + level_string(level) + "] " + message;
-    
-    // Convert to Java string
-    jstring java_message = env->NewStringUTF(formatted.c_str());
-    if (!java_message) return;
-    
-    // Get appropriate output stream (stdout for INFO/DEBUG, stderr for WARN/ERROR)
-    jobject output_stream;
-    if (level >= WARN) {
-        output_stream = env->GetStaticObjectField(system_class_, err_field_);
-    } else {
-        output_stream = env->GetStaticObjectField(system_class_, out_field_);
+void JNILogger::log_internal(Level level, const char* format, va_list args) {
+    // Check if logging is enabled for this level before paying for the formatting
+    if (!is_enabled(level)) return;
+
+    uint64_t position;
+    LogRecord* slot = claim_slot(position);
+    if (!slot) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
     }
-    
-    if (output_stream) {
-        // Call println method
-        env->CallVoidMethod(output_stream, println_method_, java_message);
-        
-        // Clear any potential exception
-        if (env->ExceptionCheck()) {
-            env->ExceptionClear();
+
+    // Format straight into the slot, the drain thread waits until it is published
+    slot->kind = RECORD_LOG;
+    slot->level = level;
+    vsnprintf(slot->text, MESSAGE_SIZE, format, args);
+    publish_slot(slot, position, level >= WARN);
+}
+
+void JNILogger::submit_callback(int level, const char* text) {
+    if (!initialized_.load(std::memory_order_acquire) || !callback_handler_.load(std::memory_order_relaxed)) return;
+
+    uint64_t position;
+    LogRecord* slot = claim_slot(position);
+    if (!slot) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    slot->kind = RECORD_CALLBACK;
+    slot->level = level;
+    strncpy(slot->text, text, MESSAGE_SIZE - 1);
+    slot->text[MESSAGE_SIZE - 1] = '\0';
+    publish_slot(slot, position, false);
+}
+
+void JNILogger::flush(int timeout_ms) {
+    if (!initialized_.load(std::memory_order_acquire)) return;
+
+    uint64_t target = g_tail.load(std::memory_order_acquire);
+    g_wake.notify_one();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (g_printed.load(std::memory_order_acquire) < target && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+void JNILogger::drain_loop() {
+    // Attached once as a daemon, so the JVM does not wait for this thread when it exits
+    JNIEnv* env = nullptr;
+    JavaVMAttachArgs attach_args = { JNI_VERSION_1_6, (char*)"jllama-logger", nullptr };
+    if (jvm_->AttachCurrentThreadAsDaemon((void**)&env, &attach_args) != JNI_OK) {
+        return;
+    }
+
+    uint64_t reported_dropped = 0;
+    std::string formatted;
+    for (;;) {
+        bool stopping = g_stop.load(std::memory_order_acquire);
+
+        for (;;) {
+            LogRecord& slot = g_ring[g_head & (CAPACITY - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != g_head + 1) break;
+
+            if (slot.kind == RECORD_CALLBACK) {
+                CallbackHandler handler = callback_handler_.load(std::memory_order_acquire);
+                if (handler) handler(env, slot.level, slot.text);
+            } else {
+                // Format message with level prefix
+                formatted.assign("[").append(level_string((Level)slot.level)).append("] ").append(slot.text);
+                jstring java_message = env->NewStringUTF(formatted.c_str());
+                if (java_message) {
+                    // Get appropriate output stream (stdout for INFO/DEBUG, stderr for WARN/ERROR)
+                    jobject output_stream = env->GetStaticObjectField(system_class_, slot.level >= WARN ? err_field_ : out_field_);
+                    if (output_stream) {
+                        env->CallVoidMethod(output_stream, println_method_, java_message);
+                        env->DeleteLocalRef(output_stream);
+                    }
+                    env->DeleteLocalRef(java_message);
+                }
+            }
+            // Clear any potential exception
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+            }
+
+            slot.sequence.store(g_head + CAPACITY, std::memory_order_release);
+            g_head++;
+            g_printed.store(g_head, std::memory_order_release);
+        }
+
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reported_dropped) {
+            char message[96];
+            snprintf(message, sizeof(message), "[WARN] Log buffer full, %llu records dropped",
+                     (unsigned long long)(dropped - reported_dropped));
+            reported_dropped = dropped;
+            jstring java_message = env->NewStringUTF(message);
+            jobject output_stream = env->GetStaticObjectField(system_class_, err_field_);
+            if (java_message && output_stream) {
+                env->CallVoidMethod(output_stream, println_method_, java_message);
+            }
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+            }
+            if (output_stream) env->DeleteLocalRef(output_stream);
+            if (java_message) env->DeleteLocalRef(java_message);
         }
+
+        if (stopping) break;
+        std::unique_lock<std::mutex> lock(g_wake_mutex);
+        g_wake.wait_for(lock, std::chrono::milliseconds(5));
     }
-    
-    env->DeleteLocalRef(java_message);
+
+    jvm_->DetachCurrentThread();
 }
 
 const char* JNILogger::level_string(Level level) {
@@ -198,4 +340,4 @@ JNIEnvGuard::~JNIEnvGuard() {
     if (needs_detach_ && JNILogger::jvm_) {
         JNILogger::jvm_->DetachCurrentThread();
     }
-}
\ No newline at end of file
+}
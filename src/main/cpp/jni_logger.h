@@ -1,6 +1,9 @@
 #pragma once
 
 #include <jni.h>
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
 #include <string>
 #include <sstream>
 #include <mutex>
@@ -8,6 +11,10 @@
 /**
  * JNI-based logging system to avoid JVM channel corruption
  * Redirects native C++ logging through JVM's System.out/System.err
+ *
+ * Records are formatted into a lock-free multi-producer ring and printed by one
+ * background thread attached to the JVM, so logging threads never wait on the JVM
+ * or on each other. A record that finds the ring full is dropped and counted.
  */
 class JNILogger {
 public:
@@ -18,10 +25,19 @@ public:
         ERROR = 3
     };
 
+    // Receives records submitted with submit_callback on the drain thread, e.g. ggml logs for a Java callback
+    typedef void (*CallbackHandler)(JNIEnv* env, int level, const char* text);
+
+    // Ring slots, a power of two
+    static const uint32_t CAPACITY = 1024;
+    static const size_t MESSAGE_SIZE = 1024;
+
 private:
     static std::mutex logger_mutex_;
-    static bool initialized_;
-    static Level min_level_;
+    static std::atomic<bool> initialized_;
+    static std::atomic<int> min_level_;
+    static std::atomic<uint64_t> dropped_;
+    static std::atomic<CallbackHandler> callback_handler_;
 
     // Cached method IDs for performance
     static jclass system_class_;
@@ -31,14 +47,19 @@ private:
 
 public:
     static JavaVM* jvm_; // Make public for JNIEnvGuard access
-    // Initialize the logger with JVM reference
+    // Initialize the logger with JVM reference and start the drain thread
     static bool initialize(JNIEnv* env);
     
-    // Cleanup resources
+    // Print what is queued, stop the drain thread and cleanup resources
     static void shutdown(JNIEnv* env);
     
     // Set minimum log level
     static void set_level(Level level);
+
+    // Whether records of a level are kept, checked before anything is formatted
+    static bool is_enabled(Level level) {
+        return level >= min_level_.load(std::memory_order_relaxed) && initialized_.load(std::memory_order_relaxed);
+    }
     
     // Log functions that route through JVM
     static void debug(const char* format, ...);
@@ -49,21 +70,32 @@ public:
     // Generic log function
     static void log(Level level, const char* format, ...);
 
+    // Queue text for the callback handler, regardless of the minimum level
+    static void submit_callback(int level, const char* text);
+    static void set_callback_handler(CallbackHandler handler);
+
+    // Wait until the records queued so far have been printed, at most timeout_ms
+    static void flush(int timeout_ms = 1000);
+
+    // Records lost to a full ring since initialization
+    static uint64_t dropped() { return dropped_.load(std::memory_order_relaxed); }
+
 private:
-    static void log_internal(Level level, const std::string& message);
+    static void log_internal(Level level, const char* format, va_list args);
+    static void drain_loop();
     static const char* level_string(Level level);
 };
 
-// Convenience macros
+// Convenience macros, arguments are not evaluated for filtered levels
 #ifdef DEBUG
-#define JNI_LOG_DEBUG(fmt, ...) JNILogger::debug(fmt, ##__VA_ARGS__)
+#define JNI_LOG_DEBUG(fmt, ...) do { if (JNILogger::is_enabled(JNILogger::DEBUG)) JNILogger::debug(fmt, ##__VA_ARGS__); } while (0)
 #else
 #define JNI_LOG_DEBUG(fmt, ...)
 #endif
 
-#define JNI_LOG_INFO(fmt, ...)  JNILogger::info(fmt, ##__VA_ARGS__)
-#define JNI_LOG_WARN(fmt, ...)  JNILogger::warn(fmt, ##__VA_ARGS__)
-#define JNI_LOG_ERROR(fmt, ...) JNILogger::error(fmt, ##__VA_ARGS__)
+#define JNI_LOG_INFO(fmt, ...)  do { if (JNILogger::is_enabled(JNILogger::INFO)) JNILogger::info(fmt, ##__VA_ARGS__); } while (0)
+#define JNI_LOG_WARN(fmt, ...)  do { if (JNILogger::is_enabled(JNILogger::WARN)) JNILogger::warn(fmt, ##__VA_ARGS__); } while (0)
+#define JNI_LOG_ERROR(fmt, ...) do { if (JNILogger::is_enabled(JNILogger::ERROR)) JNILogger::error(fmt, ##__VA_ARGS__); } while (0)
 
 // RAII class for safe JNI environment acquisition
 class JNIEnvGuard {
@@ -77,4 +109,4 @@ public:
     
     JNIEnv* get() const { return env_; }
     bool is_valid() const { return env_ != nullptr; }
-};
\ No newline at end of file
+};
@@ -1,4 +1,8 @@
 #include "jni_utils.h"
+#include "jni_error_handler.h"
+#include <cstring>
+
+static JniCache g_jni_cache;
 
 std::string JniUtils::jstring_to_string(JNIEnv* env, jstring jstr) {
     if (!jstr) return "";
@@ -10,4 +14,312 @@ std::string JniUtils::jstring_to_string(JNIEnv* env, jstring jstr) {
 
 jstring JniUtils::string_to_jstring(JNIEnv* env, const std::string& str) {
     return env->NewStringUTF(str.c_str());
-}
\ No newline at end of file
+}
+
+static jclass find_global_class(JNIEnv* env, const char* name) {
+    jclass local = env->FindClass(name);
+    if (!local) {
+        env->ExceptionClear();
+        return nullptr;
+    }
+    jclass global = static_cast<jclass>(env->NewGlobalRef(local));
+    env->DeleteLocalRef(local);
+    return global;
+}
+
+static jmethodID find_method(JNIEnv* env, jclass cls, const char* name, const char* signature) {
+    if (!cls) return nullptr;
+    jmethodID method = env->GetMethodID(cls, name, signature);
+    if (!method) env->ExceptionClear();
+    return method;
+}
+
+static jmethodID find_static_method(JNIEnv* env, jclass cls, const char* name, const char* signature) {
+    if (!cls) return nullptr;
+    jmethodID method = env->GetStaticMethodID(cls, name, signature);
+    if (!method) env->ExceptionClear();
+    return method;
+}
+
+static jfieldID find_field(JNIEnv* env, jclass cls, const char* name, const char* signature) {
+    if (!cls) return nullptr;
+    jfieldID field = env->GetFieldID(cls, name, signature);
+    if (!field) env->ExceptionClear();
+    return field;
+}
+
+// Method ID of an interface, valid for every implementing class
+static jmethodID find_interface_method(JNIEnv* env, const char* interface_name, const char* name,
+        const char* signature) {
+    jclass cls = env->FindClass(interface_name);
+    if (!cls) {
+        env->ExceptionClear();
+        return nullptr;
+    }
+    jmethodID method = find_method(env, cls, name, signature);
+    env->DeleteLocalRef(cls);
+    return method;
+}
+
+bool JniUtils::initialize_cache(JNIEnv* env) {
+    JniCache& c = g_jni_cache;
+    if (c.initialized) return true;
+
+    c.llama_model_class = find_global_class(env, "de/kherud/llama/LlamaModel");
+    if (c.llama_model_class) {
+        c.llama_model_ctx = env->GetFieldID(c.llama_model_class, "ctx", "J");
+        if (!c.llama_model_ctx) env->ExceptionClear();
+    }
+
+    c.llama_output_class = find_global_class(env, "de/kherud/llama/LlamaOutput");
+    c.llama_output_init = find_method(env, c.llama_output_class, "<init>", "([BLjava/util/Map;Z[I[F)V");
+
+    c.llama_chunk_class = find_global_class(env, "de/kherud/llama/LlamaChunk");
+    c.llama_chunk_init = find_method(env, c.llama_chunk_class, "<init>", "([B[I[IZ[I[F)V");
+
+    c.rerank_result_class = find_global_class(env, "de/kherud/llama/RerankResult");
+    c.rerank_result_init = find_method(env, c.rerank_result_class, "<init>", "([I[F)V");
+
+    c.token_batch_class = find_global_class(env, "de/kherud/llama/TokenBatch");
+    c.token_batch_init = find_method(env, c.token_batch_class, "<init>", "([I[I)V");
+
+    c.hashmap_class = find_global_class(env, "java/util/HashMap");
+    c.hashmap_init = find_method(env, c.hashmap_class, "<init>", "()V");
+    c.hashmap_put = find_method(env, c.hashmap_class, "put",
+        "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+
+    c.float_class = find_global_class(env, "java/lang/Float");
+    c.float_init = find_method(env, c.float_class, "<init>", "(F)V");
+
+    c.string_class = find_global_class(env, "java/lang/String");
+
+    // Method IDs of interfaces are valid for every implementing class
+    jclass abort_callback = env->FindClass("de/kherud/llama/LlamaModel$AbortCallback");
+    if (abort_callback) {
+        c.abort_callback_should_abort = find_method(env, abort_callback, "shouldAbort", "()Z");
+        env->DeleteLocalRef(abort_callback);
+    } else {
+        env->ExceptionClear();
+    }
+
+    jclass log_callback = env->FindClass("de/kherud/llama/LlamaUtils$LogCallback");
+    if (log_callback) {
+        c.log_callback_on_log = find_method(env, log_callback, "onLog", "(ILjava/lang/String;)V");
+        env->DeleteLocalRef(log_callback);
+    } else {
+        env->ExceptionClear();
+    }
+
+    jclass completion_callback = env->FindClass("de/kherud/llama/LlamaModel$CompletionCallback");
+    if (completion_callback) {
+        c.completion_callback_on_output = find_method(env, completion_callback, "onOutput",
+            "(Lde/kherud/llama/LlamaOutput;)V");
+        c.completion_callback_on_complete = find_method(env, completion_callback, "onComplete", "()V");
+        c.completion_callback_on_error = find_method(env, completion_callback, "onError", "(Ljava/lang/String;)V");
+        env->DeleteLocalRef(completion_callback);
+    } else {
+        env->ExceptionClear();
+    }
+
+    c.perplexity_result_class = find_global_class(env, "de/kherud/llama/PerplexityResult");
+    c.perplexity_result_init = find_method(env, c.perplexity_result_class, "<init>", "(D[D[DDDJ)V");
+
+    c.vocabulary_class = find_global_class(env, "de/kherud/llama/Vocabulary");
+    c.vocabulary_init = find_method(env, c.vocabulary_class, "<init>", "([B[I[F[I)V");
+
+    c.writable_channel_write = find_interface_method(env, "java/nio/channels/WritableByteChannel", "write",
+        "(Ljava/nio/ByteBuffer;)I");
+    c.readable_channel_read = find_interface_method(env, "java/nio/channels/ReadableByteChannel", "read",
+        "(Ljava/nio/ByteBuffer;)I");
+
+    c.quantization_params_class = find_global_class(env, "de/kherud/llama/LlamaQuantizer$QuantizationParams");
+    jclass params = c.quantization_params_class;
+    c.quantization_params_init = find_method(env, params, "<init>", "()V");
+    c.quantization_params_nthread = find_field(env, params, "nthread", "I");
+    c.quantization_params_ftype = find_field(env, params, "ftype", "I");
+    c.quantization_params_allow_requantize = find_field(env, params, "allowRequantize", "Z");
+    c.quantization_params_quantize_output_tensor = find_field(env, params, "quantizeOutputTensor", "Z");
+    c.quantization_params_only_copy = find_field(env, params, "onlyCopy", "Z");
+    c.quantization_params_pure = find_field(env, params, "pure", "Z");
+    c.quantization_params_keep_split = find_field(env, params, "keepSplit", "Z");
+    c.quantization_params_output_tensor_type = find_field(env, params, "outputTensorType", "Ljava/lang/String;");
+    c.quantization_params_token_embedding_type = find_field(env, params, "tokenEmbeddingType", "Ljava/lang/String;");
+    c.quantization_params_tensor_type_patterns = find_field(env, params, "tensorTypePatterns", "[Ljava/lang/String;");
+    c.quantization_params_tensor_type_names = find_field(env, params, "tensorTypeNames", "[Ljava/lang/String;");
+    c.quantization_params_imatrix_path = find_field(env, params, "imatrixPath", "Ljava/lang/String;");
+
+    c.training_metrics_class = find_global_class(env, "de/kherud/llama/LlamaTrainer$TrainingMetrics");
+    c.training_metrics_init = find_method(env, c.training_metrics_class, "<init>", "(FFIJJ)V");
+    c.evaluation_metrics_class = find_global_class(env, "de/kherud/llama/LlamaTrainer$EvaluationMetrics");
+    c.evaluation_metrics_init = find_method(env, c.evaluation_metrics_class, "<init>", "(FFFI)V");
+
+    c.diffusion_result_class = find_global_class(env, "de/kherud/llama/diffusion/StableDiffusionResult");
+    c.diffusion_result_init = find_method(env, c.diffusion_result_class, "<init>", "(ZLjava/lang/String;[BIIFII)V");
+    c.upscale_result_class = find_global_class(env, "de/kherud/llama/diffusion/UpscaleResult");
+    c.upscale_result_success = find_static_method(env, c.upscale_result_class, "success",
+        "([BIII)Lde/kherud/llama/diffusion/UpscaleResult;");
+    c.upscale_result_failure = find_static_method(env, c.upscale_result_class, "failure",
+        "(Ljava/lang/String;)Lde/kherud/llama/diffusion/UpscaleResult;");
+
+    c.initialized = c.llama_model_ctx && c.llama_output_init && c.llama_chunk_init && c.rerank_result_init &&
+        c.token_batch_init && c.hashmap_init && c.hashmap_put && c.float_init && c.string_class;
+    return c.initialized;
+}
+
+void JniUtils::release_cache(JNIEnv* env) {
+    JniCache& c = g_jni_cache;
+    jclass* classes[] = { &c.llama_model_class, &c.llama_output_class, &c.llama_chunk_class, &c.rerank_result_class,
+        &c.token_batch_class, &c.hashmap_class, &c.float_class, &c.string_class, &c.perplexity_result_class,
+        &c.vocabulary_class, &c.quantization_params_class, &c.training_metrics_class, &c.evaluation_metrics_class,
+        &c.diffusion_result_class, &c.upscale_result_class };
+    for (jclass* cls : classes) {
+        if (*cls) {
+            env->DeleteGlobalRef(*cls);
+            *cls = nullptr;
+        }
+    }
+    c = JniCache();
+}
+
+const JniCache& JniUtils::cache() {
+    return g_jni_cache;
+}
+
+jfieldID JniUtils::ctx_field(JNIEnv* env, jclass cls) {
+    const JniCache& c = g_jni_cache;
+    if (c.llama_model_ctx && env->IsAssignableFrom(cls, c.llama_model_class)) {
+        return c.llama_model_ctx;
+    }
+    return env->GetFieldID(cls, "ctx", "J");
+}
+
+jlong JniUtils::get_handle(JNIEnv* env, jobject obj) {
+    const JniCache& c = g_jni_cache;
+    if (c.llama_model_ctx && env->IsInstanceOf(obj, c.llama_model_class)) {
+        return env->GetLongField(obj, c.llama_model_ctx);
+    }
+
+    jclass cls = env->GetObjectClass(obj);
+    jfieldID field = env->GetFieldID(cls, "ctx", "J");
+    env->DeleteLocalRef(cls);
+    if (!field) return 0;
+    return env->GetLongField(obj, field);
+}
+
+jobject JniUtils::new_hashmap(JNIEnv* env) {
+    const JniCache& c = g_jni_cache;
+    return env->NewObject(c.hashmap_class, c.hashmap_init);
+}
+
+jobject JniUtils::new_llama_output(JNIEnv* env, const char* bytes, size_t length,
+        jobject probabilities, bool stop, const jint* top_tokens, const float* top_probs, size_t n_top) {
+    const JniCache& c = g_jni_cache;
+
+    jbyteArray byte_array = env->NewByteArray((jsize)length);
+    if (!byte_array) return nullptr;
+    if (length > 0) {
+        env->SetByteArrayRegion(byte_array, 0, (jsize)length, reinterpret_cast<const jbyte*>(bytes));
+    }
+
+    bool owns_map = false;
+    if (!probabilities) {
+        probabilities = new_hashmap(env);
+        owns_map = true;
+    }
+
+    jintArray top_token_array = nullptr;
+    jfloatArray top_prob_array = nullptr;
+    if (n_top > 0) {
+        top_token_array = env->NewIntArray((jsize)n_top);
+        top_prob_array = env->NewFloatArray((jsize)n_top);
+        if (!top_token_array || !top_prob_array) return nullptr;
+        env->SetIntArrayRegion(top_token_array, 0, (jsize)n_top, top_tokens);
+        env->SetFloatArrayRegion(top_prob_array, 0, (jsize)n_top, top_probs);
+    }
+
+    jobject output = env->NewObject(c.llama_output_class, c.llama_output_init,
+        byte_array, probabilities, (jboolean)stop, top_token_array, top_prob_array);
+
+    env->DeleteLocalRef(byte_array);
+    if (top_token_array) env->DeleteLocalRef(top_token_array);
+    if (top_prob_array) env->DeleteLocalRef(top_prob_array);
+    if (owns_map && probabilities) env->DeleteLocalRef(probabilities);
+    return output;
+}
+
+jobject JniUtils::new_llama_chunk(JNIEnv* env, const std::string& bytes, const std::vector<jint>& tokens,
+        const std::vector<jint>& offsets, bool stop,
+        const std::vector<jint>& top_tokens, const std::vector<float>& top_probs) {
+    const JniCache& c = g_jni_cache;
+
+    jbyteArray byte_array = env->NewByteArray((jsize)bytes.size());
+    jintArray token_array = env->NewIntArray((jsize)tokens.size());
+    jintArray offset_array = env->NewIntArray((jsize)offsets.size());
+    if (!byte_array || !token_array || !offset_array) return nullptr;
+
+    if (!bytes.empty()) {
+        env->SetByteArrayRegion(byte_array, 0, (jsize)bytes.size(), reinterpret_cast<const jbyte*>(bytes.data()));
+    }
+    if (!tokens.empty()) {
+        env->SetIntArrayRegion(token_array, 0, (jsize)tokens.size(), tokens.data());
+    }
+    if (!offsets.empty()) {
+        env->SetIntArrayRegion(offset_array, 0, (jsize)offsets.size(), offsets.data());
+    }
+
+    jintArray top_token_array = nullptr;
+    jfloatArray top_prob_array = nullptr;
+    if (!top_tokens.empty()) {
+        top_token_array = env->NewIntArray((jsize)top_tokens.size());
+        top_prob_array = env->NewFloatArray((jsize)top_probs.size());
+        if (!top_token_array || !top_prob_array) return nullptr;
+        env->SetIntArrayRegion(top_token_array, 0, (jsize)top_tokens.size(), top_tokens.data());
+        env->SetFloatArrayRegion(top_prob_array, 0, (jsize)top_probs.size(), top_probs.data());
+    }
+
+    jobject chunk = env->NewObject(c.llama_chunk_class, c.llama_chunk_init,
+        byte_array, token_array, offset_array, (jboolean)stop, top_token_array, top_prob_array);
+
+    env->DeleteLocalRef(byte_array);
+    env->DeleteLocalRef(token_array);
+    env->DeleteLocalRef(offset_array);
+    if (top_token_array) env->DeleteLocalRef(top_token_array);
+    if (top_prob_array) env->DeleteLocalRef(top_prob_array);
+    return chunk;
+}
+
+jobject JniUtils::new_rerank_result(JNIEnv* env, const std::vector<jint>& indices, const std::vector<float>& scores) {
+    const JniCache& c = g_jni_cache;
+    jintArray index_array = env->NewIntArray((jsize)indices.size());
+    jfloatArray score_array = env->NewFloatArray((jsize)scores.size());
+    if (!index_array || !score_array) return nullptr;
+
+    if (!indices.empty()) {
+        env->SetIntArrayRegion(index_array, 0, (jsize)indices.size(), indices.data());
+    }
+    if (!scores.empty()) {
+        env->SetFloatArrayRegion(score_array, 0, (jsize)scores.size(), scores.data());
+    }
+
+    jobject result = env->NewObject(c.rerank_result_class, c.rerank_result_init, index_array, score_array);
+
+    env->DeleteLocalRef(index_array);
+    env->DeleteLocalRef(score_array);
+    return result;
+}
+
+jint JniUtils::copy_to_float_buffer(JNIEnv* env, jobject buffer, jint offset, const float* src, jint count) {
+    float* dst = static_cast<float*>(env->GetDirectBufferAddress(buffer));
+    if (!dst) {
+        JNIErrorHandler::throw_illegal_argument(env, "Buffer must be a direct FloatBuffer");
+        return -1;
+    }
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if (offset < 0 || (jlong)offset + count > capacity) {
+        JNIErrorHandler::throw_illegal_argument(env, "Buffer has " + std::to_string(capacity - offset) +
+            " floats remaining, " + std::to_string(count) + " are required");
+        return -1;
+    }
+    std::memcpy(dst + offset, src, (size_t)count * sizeof(float));
+    return count;
+}
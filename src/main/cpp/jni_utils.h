@@ -2,10 +2,117 @@
 
 #include <jni.h>
 #include <string>
+#include <vector>
+
+// Global class references and member IDs resolved once in JNI_OnLoad.
+// The library refuses to load if one of the core entries cannot be resolved,
+// only the callback method IDs and the entries of optional features may be null.
+struct JniCache {
+    jclass llama_model_class = nullptr;
+    jfieldID llama_model_ctx = nullptr;
+
+    jclass llama_output_class = nullptr;
+    jmethodID llama_output_init = nullptr;
+
+    jclass llama_chunk_class = nullptr;
+    jmethodID llama_chunk_init = nullptr;
+
+    jclass rerank_result_class = nullptr;
+    jmethodID rerank_result_init = nullptr;
+
+    jclass token_batch_class = nullptr;
+    jmethodID token_batch_init = nullptr;
+
+    jclass hashmap_class = nullptr;
+    jmethodID hashmap_init = nullptr;
+    jmethodID hashmap_put = nullptr;
+
+    jclass float_class = nullptr;
+    jmethodID float_init = nullptr;
+
+    jclass string_class = nullptr;
+
+    jmethodID abort_callback_should_abort = nullptr;
+    jmethodID log_callback_on_log = nullptr;
+
+    jmethodID completion_callback_on_output = nullptr;
+    jmethodID completion_callback_on_complete = nullptr;
+    jmethodID completion_callback_on_error = nullptr;
+
+    // Optional features, null if their classes are not on the class path
+    jclass perplexity_result_class = nullptr;
+    jmethodID perplexity_result_init = nullptr;
+
+    jclass vocabulary_class = nullptr;
+    jmethodID vocabulary_init = nullptr;
+
+    jmethodID writable_channel_write = nullptr;
+    jmethodID readable_channel_read = nullptr;
+
+    jclass quantization_params_class = nullptr;
+    jmethodID quantization_params_init = nullptr;
+    jfieldID quantization_params_nthread = nullptr;
+    jfieldID quantization_params_ftype = nullptr;
+    jfieldID quantization_params_allow_requantize = nullptr;
+    jfieldID quantization_params_quantize_output_tensor = nullptr;
+    jfieldID quantization_params_only_copy = nullptr;
+    jfieldID quantization_params_pure = nullptr;
+    jfieldID quantization_params_keep_split = nullptr;
+    jfieldID quantization_params_output_tensor_type = nullptr;
+    jfieldID quantization_params_token_embedding_type = nullptr;
+    jfieldID quantization_params_tensor_type_patterns = nullptr;
+    jfieldID quantization_params_tensor_type_names = nullptr;
+    jfieldID quantization_params_imatrix_path = nullptr;
+
+    jclass training_metrics_class = nullptr;
+    jmethodID training_metrics_init = nullptr;
+    jclass evaluation_metrics_class = nullptr;
+    jmethodID evaluation_metrics_init = nullptr;
+
+    jclass diffusion_result_class = nullptr;
+    jmethodID diffusion_result_init = nullptr;
+    jclass upscale_result_class = nullptr;
+    jmethodID upscale_result_success = nullptr;
+    jmethodID upscale_result_failure = nullptr;
+
+    bool initialized = false;
+};
 
 // JNI utility functions for string conversion and common operations
 class JniUtils {
 public:
     static std::string jstring_to_string(JNIEnv* env, jstring jstr);
     static jstring string_to_jstring(JNIEnv* env, const std::string& str);
-};
\ No newline at end of file
+
+    // Reflection cache, filled by JNI_OnLoad and released by JNI_OnUnload
+    static bool initialize_cache(JNIEnv* env);
+    static void release_cache(JNIEnv* env);
+    static const JniCache& cache();
+
+    // Field ID of the native handle field "ctx" of cls, cached for LlamaModel
+    static jfieldID ctx_field(JNIEnv* env, jclass cls);
+
+    // Native handle stored in the "ctx" field of a Java object
+    static jlong get_handle(JNIEnv* env, jobject obj);
+
+    // new LlamaChunk(bytes, tokens, offsets, stop, topTokens, topProbabilities)
+    static jobject new_llama_chunk(JNIEnv* env, const std::string& bytes, const std::vector<jint>& tokens,
+        const std::vector<jint>& offsets, bool stop,
+        const std::vector<jint>& top_tokens = {}, const std::vector<float>& top_probs = {});
+
+    // new RerankResult(indices, scores)
+    static jobject new_rerank_result(JNIEnv* env, const std::vector<jint>& indices, const std::vector<float>& scores);
+
+    // new HashMap()
+    static jobject new_hashmap(JNIEnv* env);
+
+    // new LlamaOutput(bytes, probabilities, stop, topTokens, topProbabilities); an empty HashMap is used
+    // if probabilities is null, the top arrays are only created when n_top is positive
+    static jobject new_llama_output(JNIEnv* env, const char* bytes, size_t length,
+        jobject probabilities, bool stop,
+        const jint* top_tokens = nullptr, const float* top_probs = nullptr, size_t n_top = 0);
+
+    // Copy count floats into a direct FloatBuffer starting at element offset, returns count.
+    // Throws IllegalArgumentException and returns -1 if the buffer is not direct or too small.
+    static jint copy_to_float_buffer(JNIEnv* env, jobject buffer, jint offset, const float* src, jint count);
+};
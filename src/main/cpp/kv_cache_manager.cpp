@@ -2,6 +2,7 @@
 #include "jni_utils.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
+#include "server_table.h"
 
 // Sequence copying and manipulation
 
@@ -11,7 +12,8 @@ void KVCacheManager::copySequence(JNIEnv* env, jobject obj, jint srcSeqId, jint
 	validateSequenceId(env, srcSeqId);
 	validateSequenceId(env, dstSeqId);
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return;
@@ -28,7 +30,8 @@ void KVCacheManager::keepSequence(JNIEnv* env, jobject obj, jint seqId) {
 	
 	validateSequenceId(env, seqId);
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return;
@@ -52,7 +55,8 @@ void KVCacheManager::addPositionDelta(JNIEnv* env, jobject obj, jint seqId, jint
 		}
 	}
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return;
@@ -82,7 +86,8 @@ void KVCacheManager::dividePositions(JNIEnv* env, jobject obj, jint seqId, jint
 		return;
 	}
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return;
@@ -102,7 +107,8 @@ jint KVCacheManager::getSequenceMinPosition(JNIEnv* env, jobject obj, jint seqId
 	
 	validateSequenceId(env, seqId);
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return -1;
@@ -119,7 +125,8 @@ jint KVCacheManager::getSequenceMaxPosition(JNIEnv* env, jobject obj, jint seqId
 	
 	validateSequenceId(env, seqId);
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return -1;
@@ -136,7 +143,8 @@ jint KVCacheManager::getSequenceMaxPosition(JNIEnv* env, jobject obj, jint seqId
 jboolean KVCacheManager::canShiftContext(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return JNI_FALSE;
@@ -153,13 +161,21 @@ jboolean KVCacheManager::canShiftContext(JNIEnv* env, jobject obj) {
 void KVCacheManager::clearMemory(JNIEnv* env, jobject obj, jboolean clearData) {
 	JNI_TRY(env)
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return;
 	}
 	
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+	if (!server->running_tasks.empty()) {
+		JNIErrorHandler::throw_illegal_state(env, "Cannot clear memory while completions are running");
+		return;
+	}
 	llama_memory_clear(memory, clearData == JNI_TRUE);
+	// The scheduler must not reuse prompt prefixes of the free sequences that are gone now
+	server->forget_sequences();
 	
 	JNI_CATCH_RET(env, void())
 }
@@ -179,7 +195,8 @@ jboolean KVCacheManager::removeSequenceTokens(JNIEnv* env, jobject obj, jint seq
 		}
 	}
 	
-	llama_memory_t memory = getMemory(env, obj);
+	ServerRef server = getServer(env, obj);
+	llama_memory_t memory = server ? llama_get_memory(server->ctx) : nullptr;
 	if (!memory) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get memory context");
 		return JNI_FALSE;
@@ -194,24 +211,16 @@ jboolean KVCacheManager::removeSequenceTokens(JNIEnv* env, jobject obj, jint seq
 
 // Helper methods
 
-struct llama_context* KVCacheManager::getContext(JNIEnv* env, jobject obj) {
+ServerRef KVCacheManager::getServer(JNIEnv* env, jobject obj) {
 	jclass cls = env->GetObjectClass(obj);
-	jfieldID fieldId = env->GetFieldID(cls, "ctx", "J");
+	jfieldID fieldId = JniUtils::ctx_field(env, cls);
 	if (!fieldId) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get context field");
-		return nullptr;
+		return ServerRef();
 	}
 	
-	jlong ctxHandle = env->GetLongField(obj, fieldId);
-	return reinterpret_cast<struct llama_context*>(ctxHandle);
-}
-
-llama_memory_t KVCacheManager::getMemory(JNIEnv* env, jobject obj) {
-	struct llama_context* ctx = getContext(env, obj);
-	if (!ctx) {
-		return nullptr;
-	}
-	return llama_get_memory(ctx);
+	// The handle refers to the server owning the context, not to the context itself
+	return ServerTable::acquire(env->GetLongField(obj, fieldId));
 }
 
 void KVCacheManager::validateSequenceId(JNIEnv* env, jint seqId) {
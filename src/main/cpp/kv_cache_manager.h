@@ -3,6 +3,7 @@
 
 #include <jni.h>
 #include "llama.h"
+#include "server_table.h"
 
 /**
  * KV Cache Manager for advanced memory operations.
@@ -31,8 +32,7 @@ public:
 
 private:
 	// Helper methods
-	static struct llama_context* getContext(JNIEnv* env, jobject obj);
-	static llama_memory_t getMemory(JNIEnv* env, jobject obj);
+	static ServerRef getServer(JNIEnv* env, jobject obj);
 	static void validateSequenceId(JNIEnv* env, jint seqId);
 	static void validatePosition(JNIEnv* env, jint position);
 };
@@ -0,0 +1,107 @@
+#include "latency_histogram.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static int highest_bit(uint64_t value) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+uint64_t LatencyHistogram::now_ns() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Values below 16 get a bucket each, above that the top 5 bits select the bucket
+int LatencyHistogram::bucket_index(uint64_t ns) {
+	if (ns < SUB_BUCKETS) return (int)ns;
+	int exponent = highest_bit(ns);
+	if (exponent >= MAX_EXPONENT) return BUCKETS - 1;
+	int sub = (int)((ns >> (exponent - 4)) & (SUB_BUCKETS - 1));
+	return (exponent - 3) * SUB_BUCKETS + sub;
+}
+
+uint64_t LatencyHistogram::bucket_upper(int index) {
+	if (index < SUB_BUCKETS) return (uint64_t)index;
+	int exponent = index / SUB_BUCKETS + 3;
+	uint64_t sub = (uint64_t)(index % SUB_BUCKETS);
+	uint64_t width = 1ull << (exponent - 4);
+	return ((SUB_BUCKETS + sub) << (exponent - 4)) + width - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+	buckets_[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(ns, std::memory_order_relaxed);
+	uint64_t max = max_.load(std::memory_order_relaxed);
+	while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+	}
+}
+
+uint64_t LatencyHistogram::percentile(double q) const {
+	uint64_t total = 0;
+	for (int i = 0; i < BUCKETS; i++) total += buckets_[i].load(std::memory_order_relaxed);
+	if (total == 0) return 0;
+
+	// Rank of the quantile, at least the first record
+	uint64_t rank = (uint64_t)(q * (double)total + 0.5);
+	if (rank == 0) rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		seen += buckets_[i].load(std::memory_order_relaxed);
+		if (seen >= rank) return std::min(bucket_upper(i), max_.load(std::memory_order_relaxed));
+	}
+	return max_.load(std::memory_order_relaxed);
+}
+
+std::string LatencyHistogram::to_json() const {
+	uint64_t n = count();
+	double mean = n ? (double)sum_.load(std::memory_order_relaxed) / n / 1e3 : 0.0;
+	char buf[256];
+	snprintf(buf, sizeof(buf),
+		"{\"count\":%llu,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p95_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}",
+		(unsigned long long)n, mean, percentile(0.50) / 1e3, percentile(0.95) / 1e3, percentile(0.99) / 1e3,
+		max_.load(std::memory_order_relaxed) / 1e3);
+	return buf;
+}
+
+void LatencyHistogram::reset() {
+	for (int i = 0; i < BUCKETS; i++) buckets_[i].store(0, std::memory_order_relaxed);
+	count_.store(0, std::memory_order_relaxed);
+	sum_.store(0, std::memory_order_relaxed);
+	max_.store(0, std::memory_order_relaxed);
+}
+
+std::string LatencyStats::to_json() const {
+	std::string json = "{";
+	json += "\"queue_wait\":" + queue_wait.to_json() + ",";
+	json += "\"tokenize\":" + tokenize.to_json() + ",";
+	json += "\"prefill\":" + prefill.to_json() + ",";
+	json += "\"first_token\":" + first_token.to_json() + ",";
+	json += "\"decode\":" + decode.to_json() + ",";
+	json += "\"token_interval\":" + token_interval.to_json() + ",";
+	json += "\"sampling\":" + sampling.to_json() + ",";
+	json += "\"marshal\":" + marshal.to_json();
+	json += "}";
+	return json;
+}
+
+void LatencyStats::reset() {
+	queue_wait.reset();
+	tokenize.reset();
+	prefill.reset();
+	first_token.reset();
+	decode.reset();
+	token_interval.reset();
+	sampling.reset();
+	marshal.reset();
+}
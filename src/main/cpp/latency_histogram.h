@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Log-linear histogram of durations in nanoseconds, in the style of HDR histograms: every power of
+// two is split into 16 linear buckets, so recorded values keep about 6% precision from 1 ns up to
+// several minutes. Recording is a few relaxed atomic increments and safe from any thread; reads are
+// a snapshot that may miss records made while reading.
+class LatencyHistogram {
+public:
+	static const int SUB_BUCKETS = 16;
+	static const int MAX_EXPONENT = 40;  // Values from 2^40 ns (about 18 minutes) land in the last bucket
+	static const int BUCKETS = (MAX_EXPONENT - 3) * SUB_BUCKETS;
+
+	void record(uint64_t ns);
+
+	uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+	// Upper bound of the bucket holding the q-th quantile (0..1), 0 without records
+	uint64_t percentile(double q) const;
+
+	// count, mean, p50, p95, p99 and max in microseconds
+	std::string to_json() const;
+
+	void reset();
+
+	// Monotonic time for the durations
+	static uint64_t now_ns();
+
+private:
+	static int bucket_index(uint64_t ns);
+	static uint64_t bucket_upper(int index);
+
+	std::atomic<uint64_t> buckets_[BUCKETS] = {};
+	std::atomic<uint64_t> count_{0};
+	std::atomic<uint64_t> sum_{0};
+	std::atomic<uint64_t> max_{0};
+};
+
+// Where the time of completion requests goes, recorded by the scheduler and the JNI calls of a server
+struct LatencyStats {
+	LatencyHistogram queue_wait;      // Submission until the task got a sequence
+	LatencyHistogram tokenize;        // Tokenizing the prompt of a request
+	LatencyHistogram prefill;         // Sequence assigned until the prompt was decoded
+	LatencyHistogram first_token;     // Submission until the first generated token
+	LatencyHistogram decode;          // One llama_decode of a scheduler step
+	LatencyHistogram token_interval;  // Between consecutive tokens of a task
+	LatencyHistogram sampling;        // Sampling the tokens of a task in one step
+	LatencyHistogram marshal;         // Turning results into Java objects
+
+	std::string to_json() const;
+
+	void reset();
+};
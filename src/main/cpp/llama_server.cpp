@@ -1,132 +1,1374 @@
 #include "llama_server.h"
+#include "common.h"
 #include "sampling.h"
+#include "native_trace.h"
+#include "memory_manager.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 
+// Length of the longest prefix of text that does not end inside a UTF-8 multibyte sequence
+static size_t utf8_complete_length(const std::string& text) {
+	size_t n = text.size();
+	for (size_t back = 1; back <= std::min<size_t>(4, n); back++) {
+		unsigned char c = (unsigned char)text[n - back];
+		if ((c & 0xC0) == 0x80) continue;  // Continuation byte, keep looking for the lead byte
+		size_t expected = (c & 0x80) == 0x00 ? 1
+			: (c & 0xE0) == 0xC0 ? 2
+			: (c & 0xF0) == 0xE0 ? 3
+			: (c & 0xF8) == 0xF0 ? 4 : 1;
+		return back < expected ? n - back : n;
+	}
+	return n;  // Nothing but continuation bytes, invalid anyway, pass it through
+}
+
+static std::string token_to_piece(const llama_vocab* vocab, llama_token token) {
+	char buf[256];
+	int n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true);
+	if (n >= 0) return std::string(buf, n);
+
+	std::string piece(-n, '\0');
+	n = llama_token_to_piece(vocab, token, &piece[0], (int32_t)piece.size(), 0, true);
+	piece.resize(std::max(n, 0));
+	return piece;
+}
+
+// Text of a task's final result: the whole text when not streaming, otherwise whatever is still held back
+static std::string final_text(CompletionTask* task) {
+	if (!task->stream) return task->current_text;
+	std::string text;
+	text.swap(task->pending_bytes);
+	return text;
+}
+
+void LlamaServer::start_server() {
+	n_batch = llama_n_batch(ctx);
+	batch = llama_batch_init(n_batch, 0, 1);
+	if (draft_ctx) {
+		draft_batch = llama_batch_init(n_batch, 0, 1);
+	}
+
+	// Every parallel sequence of the context is a scheduling slot
+	int n_seq_max = (int)llama_n_seq_max(ctx);
+	batches.init(n_batch, n_seq_max);
+	n_ctx_seq = (int)llama_n_ctx(ctx) / n_seq_max;
+
+	// A step always has room for the next token of every sequence and at least one prompt token
+	n_prefill_chunk = std::min(n_prefill_chunk > 0 ? n_prefill_chunk : (int)llama_n_ubatch(ctx), n_batch);
+	n_step_tokens = std::min(std::max(n_step_tokens > 0 ? n_step_tokens : n_batch, n_seq_max + 1), n_batch);
+	free_seq_ids.clear();
+	seq_tokens.assign(n_seq_max, {});
+	seq_lora.assign(n_seq_max, 0);
+	for (int seq = n_seq_max - 1; seq >= 0; seq--) {
+		free_seq_ids.push_back(seq);
+	}
+	// A warm start left the shared prompt prefix in sequence 0
+	seq_tokens[0] = warm_tokens;
+
+	// Cancellations interrupt a decode in flight, e.g. the prefill of a long prompt
+	llama_set_abort_callback(ctx, abort_decode, this);
+
+	server_thread = std::thread(&LlamaServer::server_loop, this);
+}
+
+void LlamaServer::stop_server() {
+	// Callbacks may still call into the server, they finish before anything is torn down
+	push.stop();
+	should_stop = true;
+	task_queue_cv.notify_all();
+	seq_free_cv.notify_all();
+
+	// Wake up every Java thread still waiting for results
+	{
+		std::lock_guard<std::mutex> tasks_lock(active_tasks_mutex);
+		for (auto& entry : active_tasks) {
+			std::lock_guard<std::mutex> task_lock(entry.second->mutex);
+			entry.second->result_cv.notify_all();
+		}
+	}
+
+	if (server_thread.joinable()) {
+		server_thread.join();
+	}
+}
+
+int LlamaServer::submit_task(std::unique_ptr<CompletionTask> task) {
+	std::vector<std::unique_ptr<CompletionTask>> tasks;
+	tasks.push_back(std::move(task));
+	std::vector<int> ids;
+	submit_group(std::move(tasks), ids);
+	return ids.front();
+}
+
+void LlamaServer::submit_group(std::vector<std::unique_ptr<CompletionTask>> tasks, std::vector<int>& ids) {
+	// Every task is registered before the first one is queued, so the forks exist once its prompt is done
+	std::shared_ptr<CompletionTask> shared;
+	{
+		std::lock_guard<std::mutex> tasks_lock(active_tasks_mutex);
+		for (std::unique_ptr<CompletionTask>& task : tasks) {
+			task->id = next_task_id++;
+			task->state = TASK_STATE_PENDING;
+			task->t_submitted = LatencyHistogram::now_ns();
+			ids.push_back(task->id);
+			if (shared) shared->fork_ids.push_back(task->id);
+			std::shared_ptr<CompletionTask> entry(std::move(task));
+			active_tasks[entry->id] = entry;
+			if (!shared) shared = entry;
+		}
+	}
+	int task_id = shared->id;
+
+	// A prompt that can never fit is turned away before it waits for a sequence
+	if (!context_shift && shared->prompt_tokens.size() > (size_t)n_ctx_seq) {
+		n_rejected_oversized++;
+		reject_task(shared.get(), "Prompt does not fit into the context");
+		return;
+	}
+
+	bool accepted = true;
+	int displaced = -1;
+	{
+		std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+		if (max_queued > 0 && n_queued >= (size_t)max_queued) {
+			// A full queue makes room by turning away the newest waiting task of the lowest class below this one
+			accepted = false;
+			for (int priority = TASK_PRIORITY_COUNT - 1; priority > shared->priority; priority--) {
+				if (task_queues[priority].empty()) continue;
+				displaced = task_queues[priority].back().id;
+				task_queues[priority].pop_back();
+				n_queued--;
+				accepted = true;
+				break;
+			}
+		}
+		if (accepted) {
+			task_queues[shared->priority].push_back({ task_id, shared->t_deadline });
+			n_queued++;
+		}
+	}
+
+	// Neither task is known to the server thread anymore, so rejecting them here does not race with it
+	if (displaced >= 0) {
+		std::shared_ptr<CompletionTask> other = find_task(displaced);
+		if (other) {
+			n_rejected_queue_full++;
+			reject_task(other.get(), "Queue is full");
+		}
+	}
+	if (!accepted) {
+		n_rejected_queue_full++;
+		reject_task(shared.get(), "Queue is full");
+		return;
+	}
+	task_queue_cv.notify_one();
+}
+
+size_t LlamaServer::queue_depth(int priority) {
+	std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+	return task_queues[priority].size();
+}
+
+// Also rejects the branches waiting for the task's prompt
+void LlamaServer::reject_task(CompletionTask* task, const std::string& reason) {
+	task->state = TASK_STATE_COMPLETED;
+	push_result(task, "", true, true, reason);
+	std::vector<int> fork_ids;
+	fork_ids.swap(task->fork_ids);
+	for (int fork_id : fork_ids) {
+		std::shared_ptr<CompletionTask> fork = find_task(fork_id);
+		if (fork) reject_task(fork.get(), reason);
+	}
+}
+
+// Queue the branches of a task that ends before its prompt could be forked, they prefill on their own
+void LlamaServer::queue_forks(CompletionTask* task) {
+	if (task->fork_ids.empty()) return;
+	std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+	for (int fork_id : task->fork_ids) {
+		task_queues[task->priority].push_back({ fork_id, task->t_deadline });
+		n_queued++;
+	}
+	task->fork_ids.clear();
+}
+
+std::shared_ptr<CompletionTask> LlamaServer::find_task(int task_id) {
+	std::lock_guard<std::mutex> tasks_lock(active_tasks_mutex);
+	auto it = active_tasks.find(task_id);
+	return it != active_tasks.end() ? it->second : nullptr;
+}
+
+bool LlamaServer::wait_result(int task_id, TaskResult& result) {
+	std::vector<TaskResult> results;
+	if (!wait_results(task_id, 1, -1, results) || results.empty()) {
+		return false;
+	}
+	result = std::move(results.front());
+	return true;
+}
+
+bool LlamaServer::wait_results(int task_id, size_t max_results, int64_t timeout_ms,
+		std::vector<TaskResult>& results) {
+	std::shared_ptr<CompletionTask> task = find_task(task_id);
+	if (!task) return false;
+
+	std::unique_lock<std::mutex> lock(task->mutex);
+	auto ready = [this, &task] {
+		return should_stop || task->released || !task->results.empty();
+	};
+	if (timeout_ms < 0) {
+		task->result_cv.wait(lock, ready);
+	} else {
+		task->result_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+	}
+
+	if (task->released || (should_stop && task->results.empty())) {
+		return false;
+	}
+	bool was_backlogged = task->results.size() >= CompletionTask::max_pending_results;
+	while (!task->results.empty() && results.size() < max_results) {
+		bool is_final = task->results.front().is_final;
+		results.push_back(std::move(task->results.front()));
+		task->results.pop();
+		if (is_final) break;
+	}
+	bool backlogged = task->results.size() >= CompletionTask::max_pending_results;
+	lock.unlock();
+
+	// The reader made room, let the server thread resume generating for this task
+	if (was_backlogged && !backlogged) {
+		{
+			std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+		}
+		task_queue_cv.notify_one();
+	}
+	return true;
+}
+
+void LlamaServer::cancel_task(int task_id) {
+	std::shared_ptr<CompletionTask> task = find_task(task_id);
+	if (!task) return;
+	task->cancelled = true;
+	cancel_requested = true;
+	task_queue_cv.notify_one();
+}
+
+void LlamaServer::release_task(int task_id) {
+	std::shared_ptr<CompletionTask> task = find_task(task_id);
+	if (!task) return;
+	{
+		std::lock_guard<std::mutex> task_lock(task->mutex);
+		task->cancelled = true;
+		task->released = true;
+		task->results.clear();
+	}
+	task->result_cv.notify_all();
+	cancel_requested = true;
+	{
+		std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+		reap_requested = true;
+	}
+	task_queue_cv.notify_one();
+}
+
 void LlamaServer::server_loop() {
 	while (!should_stop) {
-		std::unique_lock<std::mutex> lock(task_queue_mutex);
-		task_queue_cv.wait(lock, [this] { return !task_queue.empty() || should_stop; });
-		
+		{
+			std::unique_lock<std::mutex> lock(task_queue_mutex);
+			auto ready = [this] { return should_stop || has_work(); };
+			// Wake up for the next deadline even if nothing else happens, and poll for adapters loading
+			// in the background
+			uint64_t t_deadline = next_deadline();
+			if (lora_loading()) {
+				uint64_t t_poll = LatencyHistogram::now_ns() + 2000000ull;
+				if (t_deadline == 0 || t_poll < t_deadline) t_deadline = t_poll;
+			}
+			if (t_deadline == 0) {
+				task_queue_cv.wait(lock, ready);
+			} else {
+				uint64_t now = LatencyHistogram::now_ns();
+				task_queue_cv.wait_for(lock, std::chrono::nanoseconds(t_deadline > now ? t_deadline - now : 0), ready);
+			}
+		}
+
 		if (should_stop) break;
-		
-		if (!task_queue.empty()) {
-			TaskRequest request = task_queue.front();
-			task_queue.pop();
-			lock.unlock();
-			
-			process_task(request);
+
+		// The server thread is the only owner of decoding; control operations
+		// from Java never wait for this lock
+		std::lock_guard<std::mutex> ctx_lock(ctx_mutex);
+		reap_finished_tasks();
+		expire_queued_tasks();
+		admit_pending_tasks();
+		if (!running_tasks.empty()) {
+			update_tasks();
 		}
 	}
 }
 
-void LlamaServer::process_task(const TaskRequest& request) {
-	auto task = std::make_unique<CompletionTask>(request.id, request.prompt, request.n_predict);
-	
-	// Tokenize prompt
-	const llama_vocab* vocab = llama_model_get_vocab(model);
-	std::vector<llama_token> tokens;
-	tokens.resize(request.prompt.length() + 1);
-	
-	int n_tokens = llama_tokenize(vocab, request.prompt.c_str(), request.prompt.length(), 
-								  tokens.data(), tokens.size(), true, false);
-	
-	if (n_tokens < 0) {
-		tokens.resize(-n_tokens);
-		n_tokens = llama_tokenize(vocab, request.prompt.c_str(), request.prompt.length(),
-								  tokens.data(), tokens.size(), true, false);
-	}
-	
-	if (n_tokens < 0) {
-		std::lock_guard<std::mutex> result_lock(result_mutex);
-		task_results[request.id].emplace(request.id, "", true, true, "Tokenization failed");
-		return;
+// Called with task_queue_mutex held
+bool LlamaServer::has_work() {
+	if (reap_requested || (n_queued > 0 && !free_seq_ids.empty())) return true;
+	if (!swapped_tasks.empty() && !free_seq_ids.empty()) return true;
+	for (CompletionTask* task : swapped_tasks) {
+		if (task->cancelled) return true;
 	}
-	
-	tokens.resize(n_tokens);
-	task->prompt_tokens = tokens;
-	task->state = TASK_STATE_PROCESSING_PROMPT;
-	
-	// Process prompt
-	llama_batch batch = llama_batch_init(n_tokens, 0, 1);
-	for (int i = 0; i < n_tokens; i++) {
-		batch.token[i] = tokens[i];
-		batch.pos[i] = i;
-		batch.n_seq_id[i] = 1;
-		batch.seq_id[i][0] = 0;
-		batch.logits[i] = (i == n_tokens - 1); // Only compute logits for last token
-	}
-	batch.n_tokens = n_tokens;
-	
-	if (llama_decode(ctx, batch) != 0) {
-		llama_batch_free(batch);
-		std::lock_guard<std::mutex> result_lock(result_mutex);
-		task_results[request.id].emplace(request.id, "", true, true, "Prompt processing failed");
-		return;
+	if (n_queued > 0 && free_seq_ids.empty() && swap_budget > 0 && !swap_full) {
+		for (int priority = 0; priority < TASK_PRIORITY_COUNT; priority++) {
+			if (task_queues[priority].empty()) continue;
+			if (preemption_victim(priority)) return true;
+			break;
+		}
 	}
-	
-	llama_batch_free(batch);
-	task->current_pos = n_tokens;
-	task->state = TASK_STATE_GENERATING;
-	
-	// Store task
+	uint64_t t_deadline = next_deadline();
+	if (t_deadline != 0 && t_deadline <= LatencyHistogram::now_ns()) return true;
+	// Running tasks only count while they can make progress, backlogged streams wait for their reader
+	for (CompletionTask* task : running_tasks) {
+		if (task->cancelled) return true;
+		// Tasks waiting for their adapters are polled for by the loop
+		if (lora_status(task) == 0) continue;
+		if (task->state != TASK_STATE_GENERATING || !is_backlogged(task)) return true;
+	}
+	return false;
+}
+
+bool LlamaServer::is_backlogged(CompletionTask* task) {
+	std::lock_guard<std::mutex> task_lock(task->mutex);
+	return task->results.size() >= CompletionTask::max_pending_results;
+}
+
+void LlamaServer::reap_finished_tasks() {
+	if (!reap_requested.exchange(false)) return;
+
+	// Unlink released tasks under the map lock, free their sequences outside of it
+	std::vector<std::shared_ptr<CompletionTask>> reaped;
 	{
 		std::lock_guard<std::mutex> tasks_lock(active_tasks_mutex);
-		active_tasks[request.id] = std::move(task);
-	}
-	
-	// Generate tokens
-	generate_tokens(active_tasks[request.id].get());
-}
-
-void LlamaServer::generate_tokens(CompletionTask* task) {
-	for (int i = 0; i < task->n_predict && !task->cancelled; i++) {
-		// Sample next token
-		llama_token new_token = llama_sampler_sample(sampler, ctx, -1);
-		
-		// Check for end of generation
-		const llama_vocab* vocab = llama_model_get_vocab(model);
-		if (llama_vocab_is_eog(vocab, new_token)) {
-			std::lock_guard<std::mutex> result_lock(result_mutex);
-			task_results[task->id].emplace(task->id, task->current_text, true);
-			task->state = TASK_STATE_COMPLETED;
-			return;
+		for (auto it = active_tasks.begin(); it != active_tasks.end();) {
+			if (it->second->released) {
+				reaped.push_back(std::move(it->second));
+				it = active_tasks.erase(it);
+			} else {
+				++it;
+			}
 		}
-		
-		// Convert token to text
-		char piece[256];
-		int piece_len = llama_token_to_piece(vocab, new_token, piece, sizeof(piece), 0, true);
-		if (piece_len > 0) {
-			task->current_text.append(piece, piece_len);
+	}
+
+	for (const std::shared_ptr<CompletionTask>& task : reaped) {
+		if (task->state == TASK_STATE_SWAPPED) {
+			drop_swapped(task.get());
+		}
+		if (task->seq_id >= 0) {
+			finish_task(task.get());
+		}
+		running_tasks.erase(std::remove(running_tasks.begin(), running_tasks.end(), task.get()), running_tasks.end());
+	}
+}
+
+// Earliest deadline of the waiting and running tasks, 0 if none has one. Called with task_queue_mutex held.
+uint64_t LlamaServer::next_deadline() {
+	uint64_t t_next = 0;
+	auto consider = [&t_next](uint64_t t_deadline) {
+		if (t_deadline != 0 && (t_next == 0 || t_deadline < t_next)) t_next = t_deadline;
+	};
+	for (const std::deque<QueuedTask>& queue : task_queues) {
+		for (const QueuedTask& queued : queue) consider(queued.t_deadline);
+	}
+	for (CompletionTask* task : running_tasks) consider(task->t_deadline);
+	for (CompletionTask* task : swapped_tasks) consider(task->t_deadline);
+	return t_next;
+}
+
+// Reject waiting tasks whose deadline passed, no matter whether a sequence is free
+void LlamaServer::expire_queued_tasks() {
+	uint64_t now = LatencyHistogram::now_ns();
+	std::vector<int> expired;
+	{
+		std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+		for (std::deque<QueuedTask>& queue : task_queues) {
+			for (auto it = queue.begin(); it != queue.end();) {
+				if (it->t_deadline != 0 && it->t_deadline <= now) {
+					expired.push_back(it->id);
+					it = queue.erase(it);
+					n_queued--;
+				} else {
+					++it;
+				}
+			}
 		}
-		
-		// Add result to queue
+	}
+	for (int task_id : expired) {
+		std::shared_ptr<CompletionTask> task = find_task(task_id);
+		if (!task || task->released) continue;
+		n_deadline_misses++;
+		reject_task(task.get(), "Deadline exceeded");
+	}
+}
+
+void LlamaServer::admit_pending_tasks() {
+	expire_swapped_tasks();
+	for (;;) {
+		// Classes in order, first come first served within a class
+		int task_id = -1;
+		int priority = TASK_PRIORITY_COUNT;
 		{
-			std::lock_guard<std::mutex> result_lock(result_mutex);
-			task_results[task->id].emplace(task->id, task->current_text, false);
-		}
-		
-		// Process next token
-		llama_batch batch = llama_batch_init(1, 0, 1);
-		batch.token[0] = new_token;
-		batch.pos[0] = task->current_pos++;
-		batch.n_seq_id[0] = 1;
-		batch.seq_id[0][0] = 0;
-		batch.logits[0] = true;
-		batch.n_tokens = 1;
-		
-		if (llama_decode(ctx, batch) != 0) {
-			llama_batch_free(batch);
-			std::lock_guard<std::mutex> result_lock(result_mutex);
-			task_results[task->id].emplace(task->id, task->current_text, true, true, "Token generation failed");
+			std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+			for (int p = 0; p < TASK_PRIORITY_COUNT; p++) {
+				if (task_queues[p].empty()) continue;
+				task_id = task_queues[p].front().id;
+				priority = p;
+				break;
+			}
+		}
+
+		// A preempted task continues before the waiting tasks of its class and the classes after it
+		CompletionTask* swapped = nullptr;
+		for (CompletionTask* task : swapped_tasks) {
+			if (!swapped || task->priority < swapped->priority) swapped = task;
+		}
+		if (swapped && swapped->priority <= priority) {
+			if (free_seq_ids.empty()) break;
+			resume_task(swapped);
+			continue;
+		}
+		if (task_id < 0) break;
+
+		// Without a free sequence, only a task that can swap out one of a lower class is taken
+		CompletionTask* victim = nullptr;
+		if (free_seq_ids.empty()) {
+			victim = swap_budget > 0 && !swap_full ? preemption_victim(priority) : nullptr;
+			if (!victim) break;
+		}
+
+		// Submissions may have displaced the head meanwhile, only this thread takes it
+		{
+			std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+			std::deque<QueuedTask>& queue = task_queues[priority];
+			if (queue.empty() || queue.front().id != task_id) continue;
+			queue.pop_front();
+			n_queued--;
+		}
+
+		// Released tasks are only erased on this thread, so the raw pointer stays valid
+		std::shared_ptr<CompletionTask> found = find_task(task_id);
+		CompletionTask* task = found.get();
+		if (!task || task->released) continue;
+
+		if (task->cancelled) {
+			task->state = TASK_STATE_CANCELLED;
+			push_result(task, "", true);
+			queue_forks(task);
+			continue;
+		}
+
+		if (victim && !preempt_task(victim)) {
+			// The swap space is exhausted, the task keeps its place
+			std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+			task_queues[priority].push_front({ task_id, task->t_deadline });
+			n_queued++;
+			break;
+		}
+
+		// Tasks naming no adapters decode with the default set as it was at their admission
+		if (!task->lora_selected) task->set_lora(lora_default);
+		task->seq_id = acquire_sequence(task);
+		task->n_reserved = (int)std::min(task->prompt_tokens.size() + (size_t)std::max(0, task->n_predict),
+			(size_t)n_ctx_seq);
+		n_cells_reserved += task->n_reserved;
+		task->t_admitted = LatencyHistogram::now_ns();
+		latency.queue_wait.record(task->t_admitted - task->t_submitted);
+		task->i_batch = -1;
+		task->state = TASK_STATE_PROCESSING_PROMPT;
+		running_tasks.push_back(task);
+	}
+}
+
+// Take the free sequence whose cached tokens share the longest prefix with the task's prompt,
+// decoded with the task's adapters, trim its KV cache to that prefix and prefill only the rest
+llama_seq_id LlamaServer::acquire_sequence(CompletionTask* task) {
+	const std::vector<llama_token>& prompt = task->prompt_tokens;
+
+	size_t best = 0;
+	size_t best_prefix = 0;
+	for (size_t i = 0; i < free_seq_ids.size(); i++) {
+		if (seq_lora[free_seq_ids[i]] != task->lora_key) continue;
+		const std::vector<llama_token>& cached = seq_tokens[free_seq_ids[i]];
+		size_t n = std::min(cached.size(), prompt.size());
+		size_t prefix = 0;
+		while (prefix < n && cached[prefix] == prompt[prefix]) prefix++;
+		if (prefix > best_prefix) {
+			best = i;
+			best_prefix = prefix;
+		}
+	}
+	if (best_prefix == 0) {
+		// Prefer the least recently freed sequence when nothing matches
+		best = 0;
+	}
+
+	llama_seq_id seq = free_seq_ids[best];
+	free_seq_ids.erase(free_seq_ids.begin() + best);
+
+	// The last prompt token is always decoded again so that it produces logits
+	size_t n_keep = std::min(best_prefix, prompt.size() - 1);
+
+	// Snapshot what the sequence holds beyond the kept prefix before it is overwritten
+	if (seq_cache.enabled() && seq_tokens[seq].size() > n_keep) {
+		JLLAMA_TRACE_SPAN("state", "seq_cache_store");
+		seq_cache.store(ctx, seq, seq_tokens[seq], seq_lora[seq]);
+	}
+
+	llama_memory_t memory = llama_get_memory(ctx);
+	if (n_keep == 0 || !llama_memory_seq_rm(memory, seq, (llama_pos)n_keep, -1)) {
+		// Partial removal is not supported by every memory type, start over
+		llama_memory_seq_rm(memory, seq, -1, -1);
+		n_keep = 0;
+	}
+
+	// A returning session may find a longer prefix in the host or disk cache than in the context
+	if (seq_cache.enabled()) {
+		JLLAMA_TRACE_SPAN("state", "seq_cache_restore");
+		seq_cache.restore(ctx, seq, prompt, n_keep, task->lora_key);
+	}
+
+	task->cache_tokens.assign(prompt.begin(), prompt.begin() + n_keep);
+	task->n_prefilled = n_keep;
+	// At most half of the sequence is protected from shifting so that every shift makes progress
+	task->n_keep = std::min(n_shift_keep < 0 ? (int)prompt.size() : n_shift_keep, n_ctx_seq / 2);
+
+	// The draft sequence is rebuilt lazily from cache_tokens
+	if (draft_ctx) {
+		llama_memory_seq_rm(llama_get_memory(draft_ctx), seq, -1, -1);
+	}
+	task->n_draft_past = 0;
+	task->current_pos = (int)n_keep;
+	seq_tokens[seq].clear();
+
+	n_prompt_tokens_reused += (int64_t)n_keep;
+	return seq;
+}
+
+// Take the free sequence at index i of free_seq_ids, snapshotting and removing what it kept
+llama_seq_id LlamaServer::take_sequence(size_t i) {
+	llama_seq_id seq = free_seq_ids[i];
+	{
+		// has_work reads the free sequences under task_queue_mutex alone
+		std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+		free_seq_ids.erase(free_seq_ids.begin() + i);
+	}
+	if (seq_cache.enabled() && !seq_tokens[seq].empty()) {
+		seq_cache.store(ctx, seq, seq_tokens[seq], seq_lora[seq]);
+	}
+	llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1);
+	if (draft_ctx) {
+		llama_memory_seq_rm(llama_get_memory(draft_ctx), seq, -1, -1);
+	}
+	seq_tokens[seq].clear();
+	seq_lora[seq] = 0;
+	return seq;
+}
+
+size_t LlamaServer::lease_sequences(size_t n_max, std::vector<llama_seq_id>& seqs) {
+	while (seqs.size() < n_max && !free_seq_ids.empty()) {
+		// Sequences keeping no tokens first, the others may still serve a prompt prefix
+		size_t i = 0;
+		while (i + 1 < free_seq_ids.size() && !seq_tokens[free_seq_ids[i]].empty()) i++;
+		seqs.push_back(take_sequence(i));
+	}
+	return seqs.size();
+}
+
+void LlamaServer::return_sequences(std::vector<llama_seq_id>& seqs) {
+	if (seqs.empty()) return;
+	llama_memory_t memory = llama_get_memory(ctx);
+	for (llama_seq_id seq : seqs) {
+		llama_memory_seq_rm(memory, seq, -1, -1);
+	}
+	{
+		std::lock_guard<std::mutex> queue_lock(task_queue_mutex);
+		free_seq_ids.insert(free_seq_ids.end(), seqs.begin(), seqs.end());
+	}
+	seqs.clear();
+	// Waiting tasks may be admitted now
+	task_queue_cv.notify_one();
+	seq_free_cv.notify_all();
+}
+
+void LlamaServer::forget_sequences() {
+	for (llama_seq_id seq : free_seq_ids) {
+		seq_tokens[seq].clear();
+		seq_lora[seq] = 0;
+	}
+	warm_tokens.clear();
+	seq_cache.clear();
+}
+
+SequenceLease::SequenceLease(LlamaServer* server, size_t n_max) : server_(server), ctx_lock_(server->ctx_mutex) {
+	n_max = std::max<size_t>(n_max, 1);
+	// Sequences are freed by scheduler steps, which need ctx_mutex
+	while (server_->lease_sequences(n_max, seqs_) == 0 && !server_->should_stop) {
+		ctx_lock_.unlock();
+		{
+			std::unique_lock<std::mutex> queue_lock(server_->task_queue_mutex);
+			server_->seq_free_cv.wait_for(queue_lock, std::chrono::milliseconds(5));
+		}
+		ctx_lock_.lock();
+	}
+}
+
+SequenceLease::~SequenceLease() {
+	server_->return_sequences(seqs_);
+}
+
+// Called from the compute threads of llama_decode, between graph nodes on the CPU backend and
+// between ubatches otherwise. Without a pending cancellation this is a single relaxed load.
+bool LlamaServer::abort_decode(void* data) {
+	LlamaServer* server = static_cast<LlamaServer*>(data);
+	if (server->cancel_requested.load(std::memory_order_relaxed) && server->decoding_tasks) {
+		for (CompletionTask* task : *server->decoding_tasks) {
+			if (task->cancelled) return true;
+		}
+	}
+	ggml_abort_callback user_callback = server->user_abort_callback.load(std::memory_order_acquire);
+	return user_callback && user_callback(server->user_abort_data.load(std::memory_order_relaxed));
+}
+
+// The running task of the lowest class after priority that has made the least progress, if any
+CompletionTask* LlamaServer::preemption_victim(int priority) {
+	CompletionTask* victim = nullptr;
+	for (CompletionTask* task : running_tasks) {
+		if (task->priority <= priority || task->cancelled) continue;
+		if (task->state != TASK_STATE_PROCESSING_PROMPT && task->state != TASK_STATE_GENERATING) continue;
+		if (!victim || task->priority > victim->priority ||
+				(task->priority == victim->priority && task->t_admitted > victim->t_admitted)) {
+			victim = task;
+		}
+	}
+	return victim;
+}
+
+// Move the KV state of a running task to host memory and free its sequence. Its sampler, position and
+// tokens stay with the task, so it continues exactly where it stopped once restored.
+bool LlamaServer::preempt_task(CompletionTask* task) {
+	JLLAMA_TRACE_SPAN("state", "swap_out");
+	llama_seq_id seq = task->seq_id;
+	size_t size = llama_state_seq_get_size(ctx, seq);
+	if ((size_t)swap_bytes.load() + size > swap_budget) {
+		swap_full = true;
+		return false;
+	}
+	task->swapped_state.resize(size);
+	if (llama_state_seq_get_data(ctx, task->swapped_state.data(), size, seq) != size) {
+		std::vector<uint8_t>().swap(task->swapped_state);
+		swap_full = true;
+		return false;
+	}
+	swap_bytes += (int64_t)size;
+
+	llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1);
+	if (draft_ctx) {
+		llama_memory_seq_rm(llama_get_memory(draft_ctx), seq, -1, -1);
+	}
+	task->n_draft_past = 0;
+	seq_tokens[seq].clear();
+	free_seq_ids.push_back(seq);
+	seq_free_cv.notify_all();
+	task->seq_id = -1;
+	n_cells_reserved -= task->n_reserved;
+	task->n_reserved = 0;
+
+	task->swapped_from = task->state;
+	task->state = TASK_STATE_SWAPPED;
+	running_tasks.erase(std::remove(running_tasks.begin(), running_tasks.end(), task), running_tasks.end());
+	swapped_tasks.push_back(task);
+	n_preemptions++;
+	return true;
+}
+
+// Restore a preempted task into the least recently freed sequence
+void LlamaServer::resume_task(CompletionTask* task) {
+	JLLAMA_TRACE_SPAN("state", "swap_in");
+	llama_seq_id seq = take_sequence(0);
+	llama_memory_t memory = llama_get_memory(ctx);
+
+	bool restored = llama_state_seq_set_data(ctx, task->swapped_state.data(), task->swapped_state.size(), seq) > 0;
+	drop_swapped(task);
+	task->seq_id = seq;
+	task->state = task->swapped_from;
+	if (!restored) {
+		// Prefill what the sequence held again, as after a rebuild of memory that cannot shift
+		llama_memory_seq_rm(memory, seq, -1, -1);
+		std::vector<llama_token> tokens(task->cache_tokens.begin(), task->cache_tokens.end());
+		if (task->state == TASK_STATE_GENERATING) {
+			tokens.push_back(task->last_token);
+		} else {
+			tokens.insert(tokens.end(), task->prompt_tokens.begin() + task->n_prefilled, task->prompt_tokens.end());
+		}
+		task->prompt_tokens = std::move(tokens);
+		task->cache_tokens.clear();
+		task->n_prefilled = 0;
+		task->current_pos = 0;
+		task->state = TASK_STATE_PROCESSING_PROMPT;
+	}
+	task->n_reserved = (int)std::min(task->prompt_tokens.size() + (size_t)std::max(0, task->n_predict),
+		(size_t)n_ctx_seq);
+	n_cells_reserved += task->n_reserved;
+	task->i_batch = -1;
+	running_tasks.push_back(task);
+	n_swap_restores++;
+}
+
+// Free the host copy of a preempted task and forget it
+void LlamaServer::drop_swapped(CompletionTask* task) {
+	swap_bytes -= (int64_t)task->swapped_state.size();
+	std::vector<uint8_t>().swap(task->swapped_state);
+	swap_full = false;
+	swapped_tasks.erase(std::remove(swapped_tasks.begin(), swapped_tasks.end(), task), swapped_tasks.end());
+}
+
+// Finish preempted tasks that were cancelled or missed their deadline while swapped out
+void LlamaServer::expire_swapped_tasks() {
+	uint64_t now = LatencyHistogram::now_ns();
+	std::vector<CompletionTask*> swapped = swapped_tasks;
+	for (CompletionTask* task : swapped) {
+		if (task->cancelled) {
+			drop_swapped(task);
+			task->state = TASK_STATE_CANCELLED;
+			push_result(task, final_text(task), true);
+			queue_forks(task);
+		} else if (task->t_deadline != 0 && task->t_deadline <= now) {
+			drop_swapped(task);
+			n_deadline_misses++;
+			task->state = TASK_STATE_COMPLETED;
+			push_result(task, "", true, true, "Deadline exceeded");
+			queue_forks(task);
+		}
+	}
+}
+
+void LlamaServer::update_tasks() {
+	// Later cancellations abort the decode of this step
+	cancel_requested = false;
+
+	// Drop cancelled and overdue tasks before spending decode work on them
+	uint64_t now = LatencyHistogram::now_ns();
+	for (CompletionTask* task : running_tasks) {
+		if (task->cancelled) {
+			task->state = TASK_STATE_CANCELLED;
+			push_result(task, final_text(task), true);
+			finish_task(task);
+		} else if (task->t_deadline != 0 && task->t_deadline <= now) {
+			n_deadline_misses++;
+			task->state = TASK_STATE_COMPLETED;
+			push_result(task, "", true, true, "Deadline exceeded");
+			finish_task(task);
+		}
+	}
+	select_lora();
+	auto is_done = [](CompletionTask* task) {
+		return task->state == TASK_STATE_COMPLETED || task->state == TASK_STATE_CANCELLED;
+	};
+	running_tasks.erase(std::remove_if(running_tasks.begin(), running_tasks.end(), is_done), running_tasks.end());
+	if (running_tasks.empty()) return;
+
+	common_batch_clear(batch);
+	std::vector<CompletionTask*> batch_tasks;
+
+	// Where every task of the batch stood before this step, to take the step back after an abort
+	struct StepStart {
+		int pos;
+		size_t n_cache;
+		size_t n_prefilled;
+	};
+	std::vector<StepStart> step_starts;
+
+	// Drafts leave a chunk of the step budget to waiting prompts
+	bool prompt_waiting = std::any_of(running_tasks.begin(), running_tasks.end(), [this](CompletionTask* task) {
+		return task->state == TASK_STATE_PROCESSING_PROMPT && task->lora == lora_active;
+	});
+	const int n_draft_budget = n_step_tokens - (prompt_waiting ? n_prefill_chunk : 0);
+
+	// One decode token for every generating sequence of the active adapter set, followed by its draft
+	// tokens if any
+	for (CompletionTask* task : running_tasks) {
+		if (task->state != TASK_STATE_GENERATING || task->lora != lora_active) continue;
+		// Back-pressure: no new tokens until the reader drained some results
+		if (is_backlogged(task)) continue;
+		// A full sequence is shifted, or rebuilt and prefilled below
+		if (!make_room(task, 1)) continue;
+
+		task->draft_tokens.clear();
+		if (draft_ctx && n_draft_max > 0) {
+			int n_remaining = task->n_predict - (int)task->generated_tokens.size() - 1;
+			int n_room = std::min(n_draft_budget - batch.n_tokens, n_ctx_seq - task->current_pos) - 1;
+			int n_max = std::min(n_draft_max, std::min(n_remaining, n_room));
+			if (n_max >= std::max(1, n_draft_min)) {
+				draft_for_task(task, n_max);
+			}
+		}
+
+		step_starts.push_back({ task->current_pos, task->cache_tokens.size(), task->n_prefilled });
+		task->i_batch = batch.n_tokens;
+		common_batch_add(batch, task->last_token, task->current_pos++, { task->seq_id }, true);
+		task->cache_tokens.push_back(task->last_token);
+		for (llama_token draft : task->draft_tokens) {
+			common_batch_add(batch, draft, task->current_pos++, { task->seq_id }, true);
+			task->cache_tokens.push_back(draft);
+		}
+		batch_tasks.push_back(task);
+	}
+
+	// Fill the rest of the step budget with prompt chunks of at most n_prefill_chunk tokens, in
+	// admission order, so a long prompt is prefilled over several steps between the decode tokens of
+	// running streams instead of holding them up for its whole prefill
+	const int n_generation_tokens = batch.n_tokens;
+	const int n_budget = std::min(std::max(n_step_tokens, n_generation_tokens + 1), n_batch);
+	for (CompletionTask* task : running_tasks) {
+		if (batch.n_tokens >= n_budget) break;
+		if (task->state != TASK_STATE_PROCESSING_PROMPT || task->lora != lora_active) continue;
+
+		size_t n_chunk = (size_t)std::min(n_prefill_chunk, n_budget - batch.n_tokens);
+		size_t n_take = std::min(task->prompt_tokens.size() - task->n_prefilled, n_chunk);
+		if (!make_room(task, (int)n_take) && task->state != TASK_STATE_PROCESSING_PROMPT) continue;
+
+		// The prompt may have been rebuilt, and a chunk never overflows the sequence
+		size_t n_prompt = task->prompt_tokens.size();
+		n_take = std::min(n_prompt - task->n_prefilled, n_chunk);
+		n_take = std::min(n_take, (size_t)std::max(0, n_ctx_seq - task->current_pos));
+		if (n_take == 0) continue;
+		step_starts.push_back({ task->current_pos, task->cache_tokens.size(), task->n_prefilled });
+		for (size_t i = 0; i < n_take; i++) {
+			size_t idx = task->n_prefilled + i;
+			bool is_last = idx == n_prompt - 1;
+			if (is_last) task->i_batch = batch.n_tokens;
+			common_batch_add(batch, task->prompt_tokens[idx], task->current_pos++, { task->seq_id }, is_last);
+			task->cache_tokens.push_back(task->prompt_tokens[idx]);
+		}
+		task->n_prefilled += n_take;
+		batch_tasks.push_back(task);
+	}
+
+	if (batch.n_tokens == 0) return;
+
+	uint64_t t_decode = LatencyHistogram::now_ns();
+	int decode_status;
+	{
+		// Steps without generating sequences only prefill
+		TraceSpan span("scheduler", n_generation_tokens > 0 ? "decode" : "prefill");
+		span.arg("n_tokens", batch.n_tokens);
+		decoding_tasks = &batch_tasks;
+		decode_status = llama_decode(ctx, batch);
+		decoding_tasks = nullptr;
+	}
+	latency.decode.record(LatencyHistogram::now_ns() - t_decode);
+
+	bool any_cancelled = std::any_of(batch_tasks.begin(), batch_tasks.end(),
+		[](CompletionTask* task) { return task->cancelled.load(); });
+	if (decode_status == 2 && any_cancelled) {
+		// Interrupted for a cancellation: llama_decode kept the ubatches it finished, everything
+		// from the start of this step is dropped
+		n_decodes_aborted++;
+		llama_memory_t memory = llama_get_memory(ctx);
+		for (size_t i = 0; i < batch_tasks.size(); i++) {
+			CompletionTask* task = batch_tasks[i];
+			if (task->cancelled) {
+				// Free the KV cells of the sequence right away instead of keeping a partial prompt
+				task->cache_tokens.clear();
+				task->state = TASK_STATE_CANCELLED;
+				push_result(task, final_text(task), true);
+				finish_task(task);
+				continue;
+			}
+			// The other tasks decode the same tokens again on the next step
+			const StepStart& start = step_starts[i];
+			llama_memory_seq_rm(memory, task->seq_id, start.pos, -1);
+			task->current_pos = start.pos;
+			task->cache_tokens.resize(start.n_cache);
+			task->n_prefilled = start.n_prefilled;
+			task->draft_tokens.clear();
+			task->i_batch = -1;
+			if (draft_ctx && task->n_draft_past > task->cache_tokens.size()) {
+				task->n_draft_past = task->cache_tokens.size();
+				llama_memory_seq_rm(llama_get_memory(draft_ctx), task->seq_id, (llama_pos)task->n_draft_past, -1);
+			}
+		}
+		running_tasks.erase(std::remove_if(running_tasks.begin(), running_tasks.end(), is_done), running_tasks.end());
+		return;
+	}
+	if (decode_status != 0) {
+		for (CompletionTask* task : batch_tasks) {
+			// Nothing in this sequence can be trusted for reuse anymore
+			task->cache_tokens.clear();
+			task->state = TASK_STATE_COMPLETED;
+			push_result(task, "", true, true, decode_status == 2 ? "Decoding was aborted" : "Decoding failed");
+			finish_task(task);
+		}
+		running_tasks.erase(std::remove_if(running_tasks.begin(), running_tasks.end(), is_done), running_tasks.end());
+		return;
+	}
+
+	for (CompletionTask* task : batch_tasks) {
+		if (task->i_batch >= 0) {
+			sample_task(task);
+			task->i_batch = -1;
+		}
+	}
+	running_tasks.erase(std::remove_if(running_tasks.begin(), running_tasks.end(), is_done), running_tasks.end());
+}
+
+int32_t LlamaServer::apply_lora(const LoraSet& set) {
+	if (set == lora_active) return 0;
+	JLLAMA_TRACE_SPAN("scheduler", "lora_switch");
+	// Applied adapters are held, so they stay resident while ctx uses them
+	for (const LoraScale& active : lora_active) {
+		bool kept = std::any_of(set.begin(), set.end(),
+			[&](const LoraScale& lora) { return lora.handle == active.handle; });
+		if (kept) continue;
+		llama_rm_adapter_lora(ctx, active.adapter);
+		AdapterRegistry::release(active.handle);
+	}
+	// Every adapter of lora_active is applied and holds exactly one hold, released when it leaves
+	LoraSet applied_set;
+	int32_t result = 0;
+	for (const LoraScale& lora : set) {
+		auto applied = std::find_if(lora_active.begin(), lora_active.end(),
+			[&](const LoraScale& active) { return active.handle == lora.handle; });
+		if (applied != lora_active.end() && applied->scale == lora.scale) {
+			applied_set.push_back(*applied);
+			continue;
+		}
+		llama_adapter_lora* adapter = nullptr;
+		if (applied == lora_active.end()) {
+			if (!AdapterRegistry::hold(lora.handle, false, adapter)) {
+				result = -1;
+				continue;
+			}
+			if (!adapter) {
+				AdapterRegistry::release(lora.handle);
+				result = -1;
+				continue;
+			}
+		} else {
+			adapter = applied->adapter;
+		}
+		int32_t status = llama_set_adapter_lora(ctx, adapter, lora.scale);
+		if (status != 0) {
+			llama_rm_adapter_lora(ctx, adapter);
+			AdapterRegistry::release(lora.handle);
+			result = status;
+			continue;
+		}
+		applied_set.push_back({ lora.handle, lora.scale, adapter });
+	}
+	lora_active = std::move(applied_set);
+	n_lora_switches++;
+	return result;
+}
+
+// 1 once all adapters of the task are resident, 0 while one is still loading, -1 if one failed to load
+int LlamaServer::lora_status(CompletionTask* task) {
+	for (LoraScale& lora : task->lora) {
+		if (lora.adapter) continue;
+		bool failed = false;
+		lora.adapter = AdapterRegistry::resident(lora.handle, failed);
+		if (!lora.adapter) return failed ? -1 : 0;
+	}
+	return 1;
+}
+
+bool LlamaServer::lora_loading() {
+	return std::any_of(running_tasks.begin(), running_tasks.end(),
+		[this](CompletionTask* task) { return lora_status(task) == 0; });
+}
+
+// Pick the adapter set of this step. Sequences of the active set are decoded as long as they have
+// work, the set only changes when none of them has or when tasks of another set waited for
+// lora_quantum steps, to the set of the longest running of those tasks. Tasks wait until their
+// adapters are resident. Called before the finished tasks are dropped, tasks whose adapters fail to
+// load or apply are finished with an error.
+void LlamaServer::select_lora() {
+	bool active_ready = false;
+	CompletionTask* waiting = nullptr;
+	for (CompletionTask* task : running_tasks) {
+		if (task->state == TASK_STATE_COMPLETED || task->state == TASK_STATE_CANCELLED) continue;
+		int status = lora_status(task);
+		if (status < 0) {
+			task->cache_tokens.clear();
+			task->state = TASK_STATE_COMPLETED;
+			push_result(task, "", true, true, "Failed to load LoRA adapter");
+			finish_task(task);
+			continue;
+		}
+		bool ready = status > 0 && (task->state == TASK_STATE_PROCESSING_PROMPT ||
+			(task->state == TASK_STATE_GENERATING && !is_backlogged(task)));
+		if (!ready) continue;
+		if (task->lora == lora_active) {
+			active_ready = true;
+		} else if (!waiting) {
+			waiting = task;
+		}
+	}
+	if (!waiting) {
+		n_lora_steps = 0;
+		return;
+	}
+	if (active_ready && n_lora_steps < lora_quantum) {
+		n_lora_steps++;
+		return;
+	}
+
+	LoraSet set = waiting->lora;
+	n_lora_steps = 1;
+	if (apply_lora(set) == 0) return;
+	for (CompletionTask* task : running_tasks) {
+		if (task->lora != set || task->state == TASK_STATE_COMPLETED || task->state == TASK_STATE_CANCELLED) continue;
+		task->cache_tokens.clear();
+		task->state = TASK_STATE_COMPLETED;
+		push_result(task, "", true, true, "Failed to apply LoRA adapters");
+		finish_task(task);
+	}
+}
+
+// Make room for n_tokens more tokens in the task's sequence. Returns false if the task cannot
+// continue as it is: it was finished, or, for memory that cannot shift positions, sent back to
+// prompt processing with its shortened history.
+bool LlamaServer::make_room(CompletionTask* task, int n_tokens) {
+	int n_over = task->current_pos + n_tokens - n_ctx_seq;
+	if (n_over <= 0) return true;
+
+	if (!context_shift) {
+		if (task->state == TASK_STATE_GENERATING) {
+			// The sequence is full, end the generation with what was produced so far
 			task->state = TASK_STATE_COMPLETED;
+			push_result(task, final_text(task), true, false, "", -1,
+				task->stream ? nullptr : &task->all_probs);
+		} else {
+			task->state = TASK_STATE_COMPLETED;
+			push_result(task, "", true, true, "Prompt does not fit into the context");
+		}
+		finish_task(task);
+		return false;
+	}
+
+	// Keep the first n_keep tokens, drop the oldest of the rest
+	int n_keep = std::min(task->n_keep, task->current_pos);
+	int n_left = task->current_pos - n_keep;
+	int n_discard = std::min(n_left, std::max(n_over, (int)(n_left * shift_discard)));
+	if (n_discard <= 0) return true;
+
+	llama_memory_t memory = llama_get_memory(ctx);
+	auto kept = task->cache_tokens.begin() + n_keep;
+
+	// The draft sequence is rebuilt lazily from cache_tokens
+	if (draft_ctx) {
+		llama_memory_seq_rm(llama_get_memory(draft_ctx), task->seq_id, -1, -1);
+		task->n_draft_past = 0;
+	}
+
+	if (llama_memory_can_shift(memory) &&
+			llama_memory_seq_rm(memory, task->seq_id, n_keep, n_keep + n_discard)) {
+		llama_memory_seq_add(memory, task->seq_id, n_keep + n_discard, task->current_pos, -n_discard);
+		task->cache_tokens.erase(kept, kept + n_discard);
+		task->current_pos -= n_discard;
+		n_context_shifts++;
+		return true;
+	}
+
+	// Positions cannot be shifted (e.g. recurrent memory), prefill the kept tokens again. A generating
+	// task continues after its last sampled token, a prompt with what was not submitted yet.
+	std::vector<llama_token> tokens(task->cache_tokens.begin(), kept);
+	tokens.insert(tokens.end(), kept + n_discard, task->cache_tokens.end());
+	if (task->state == TASK_STATE_GENERATING) {
+		tokens.push_back(task->last_token);
+	} else {
+		tokens.insert(tokens.end(), task->prompt_tokens.begin() + task->n_prefilled, task->prompt_tokens.end());
+	}
+	llama_memory_seq_rm(memory, task->seq_id, -1, -1);
+	task->prompt_tokens = std::move(tokens);
+	task->cache_tokens.clear();
+	task->n_prefilled = 0;
+	task->current_pos = 0;
+	task->state = TASK_STATE_PROCESSING_PROMPT;
+	n_context_rebuilds++;
+	return false;
+}
+
+// Softmax over raw logits, keeping only the n_probs most probable tokens (appended to out, best first).
+// The max and exp-sum passes are plain loops over the vocabulary so the compiler can vectorize them;
+// the selection keeps a small sorted window and rejects most logits with a single comparison.
+static void top_token_probs(const float* logits, int n_vocab, int n_probs, TokenProbs& out) {
+	n_probs = std::min(n_probs, n_vocab);
+
+	float max_logit = logits[0];
+	for (int i = 1; i < n_vocab; i++) {
+		max_logit = std::max(max_logit, logits[i]);
+	}
+	float sum = 0.0f;
+	for (int i = 0; i < n_vocab; i++) {
+		sum += std::exp(logits[i] - max_logit);
+	}
+
+	ArenaScope scratch(g_scratch_arena);
+	ArenaVector<float> top(n_probs, -INFINITY, ArenaAllocator<float>(g_scratch_arena));
+	ArenaVector<llama_token> ids(n_probs, -1, ArenaAllocator<llama_token>(g_scratch_arena));
+	for (int i = 0; i < n_vocab; i++) {
+		float logit = logits[i];
+		if (logit <= top[n_probs - 1]) continue;
+		int k = n_probs - 1;
+		while (k > 0 && top[k - 1] < logit) {
+			top[k] = top[k - 1];
+			ids[k] = ids[k - 1];
+			k--;
+		}
+		top[k] = logit;
+		ids[k] = i;
+	}
+
+	for (int k = 0; k < n_probs; k++) {
+		out.ids.push_back(ids[k]);
+		out.probs.push_back(std::exp(top[k] - max_logit) / sum);
+	}
+}
+
+// Fork the branches of an n-best request off the task's decoded prompt: each takes a free sequence,
+// shares the prompt's KV cells through llama_memory_seq_cp and samples its first token from the same
+// logits with its own sampler. Branches without a free sequence prefill the prompt on their own.
+void LlamaServer::fork_task(CompletionTask* task) {
+	JLLAMA_TRACE_SPAN("scheduler", "fork");
+	std::vector<int> fork_ids;
+	fork_ids.swap(task->fork_ids);
+	llama_memory_t memory = llama_get_memory(ctx);
+	for (int fork_id : fork_ids) {
+		std::shared_ptr<CompletionTask> found = find_task(fork_id);
+		CompletionTask* fork = found.get();
+		if (!fork || fork->released) continue;
+		if (fork->cancelled) {
+			fork->state = TASK_STATE_CANCELLED;
+			push_result(fork, "", true);
+			continue;
+		}
+		if (free_seq_ids.empty()) {
+			task->fork_ids.push_back(fork_id);
+			continue;
+		}
+
+		llama_seq_id seq = take_sequence(0);
+		llama_memory_seq_cp(memory, task->seq_id, seq, -1, -1);
+
+		fork->seq_id = seq;
+		fork->set_lora(task->lora);
+		fork->prompt_tokens = task->prompt_tokens;
+		fork->cache_tokens = task->cache_tokens;
+		fork->n_prefilled = task->n_prefilled;
+		fork->current_pos = task->current_pos;
+		fork->n_keep = task->n_keep;
+		fork->n_draft_past = 0;
+		fork->n_reserved = task->n_reserved;
+		n_cells_reserved += fork->n_reserved;
+		fork->t_admitted = task->t_admitted;
+		latency.queue_wait.record(fork->t_admitted - fork->t_submitted);
+		fork->state = TASK_STATE_PROCESSING_PROMPT;
+		fork->i_batch = task->i_batch;
+		running_tasks.push_back(fork);
+		n_forks++;
+
+		sample_task(fork);
+		fork->i_batch = -1;
+	}
+	queue_forks(task);
+}
+
+void LlamaServer::sample_task(CompletionTask* task) {
+	if (!task->fork_ids.empty() && task->state == TASK_STATE_PROCESSING_PROMPT) {
+		fork_task(task);
+	}
+	JLLAMA_TRACE_SPAN("sampling", "sample");
+	// Use task-specific sampler if available, e.g. for grammar; sampling also accepts the token
+	llama_sampler* sampler_to_use = task->task_sampler ? task->task_sampler : sampler;
+	const llama_vocab* vocab = llama_model_get_vocab(model);
+	uint64_t t_sample = LatencyHistogram::now_ns();
+	// The prompt of a task is done once its first token is sampled, later prefills only rebuild it
+	if (task->t_last_token == 0 && task->state == TASK_STATE_PROCESSING_PROMPT) {
+		latency.prefill.record(t_sample - task->t_admitted);
+	}
+	task->state = TASK_STATE_GENERATING;
+
+	// Verify the drafts: logits at i_batch + j predict the token after draft j - 1. Every
+	// sampled token is kept, sampling stops at the first one that differs from its draft.
+	size_t n_drafts = task->draft_tokens.size();
+	ArenaScope scratch(g_scratch_arena);
+	ArenaVector<llama_token> accepted{ArenaAllocator<llama_token>(g_scratch_arena)};
+	accepted.reserve(n_drafts + 1);
+	std::vector<TokenProbs> accepted_probs;
+	const int n_vocab = llama_vocab_n_tokens(vocab);
+	for (size_t j = 0; j <= n_drafts; j++) {
+		if (task->n_probs > 0) {
+			// Read the distribution before sampling, the sampler chain only modifies its own copy
+			accepted_probs.emplace_back();
+			top_token_probs(llama_get_logits_ith(ctx, task->i_batch + (int)j), n_vocab, task->n_probs,
+				accepted_probs.back());
+		}
+		llama_token new_token = llama_sampler_sample(sampler_to_use, ctx, task->i_batch + (int)j);
+		accepted.push_back(new_token);
+		if (j == n_drafts || new_token != task->draft_tokens[j] || llama_vocab_is_eog(vocab, new_token)) {
+			break;
+		}
+	}
+	latency.sampling.record(LatencyHistogram::now_ns() - t_sample);
+
+	if (n_drafts > 0) {
+		size_t n_accepted = accepted.size() - 1;
+		n_draft_tokens += (int64_t)n_drafts;
+		n_draft_accepted += (int64_t)n_accepted;
+
+		// Drop the KV cells of rejected drafts from both contexts
+		int n_rejected = (int)(n_drafts - n_accepted);
+		if (n_rejected > 0) {
+			task->current_pos -= n_rejected;
+			task->cache_tokens.resize(task->cache_tokens.size() - n_rejected);
+			llama_memory_seq_rm(llama_get_memory(ctx), task->seq_id, task->current_pos, -1);
+		}
+		if (task->n_draft_past > task->cache_tokens.size()) {
+			task->n_draft_past = task->cache_tokens.size();
+			llama_memory_seq_rm(llama_get_memory(draft_ctx), task->seq_id, (llama_pos)task->n_draft_past, -1);
+		}
+		task->draft_tokens.clear();
+	}
+
+	for (size_t j = 0; j < accepted.size(); j++) {
+		TokenProbs* top_probs = task->n_probs > 0 ? &accepted_probs[j] : nullptr;
+		if (!emit_token(task, accepted[j], top_probs)) return;
+	}
+}
+
+// Draft up to n_max tokens following the task's last token with the draft model
+void LlamaServer::draft_for_task(CompletionTask* task, int n_max) {
+	JLLAMA_TRACE_SPAN("scheduler", "draft");
+	llama_memory_t draft_memory = llama_get_memory(draft_ctx);
+
+	// Catch the draft sequence up with everything the target has seen, plus the last token
+	ArenaScope scratch(g_scratch_arena);
+	ArenaVector<llama_token> pending{ArenaAllocator<llama_token>(g_scratch_arena)};
+	pending.reserve(task->cache_tokens.size() - task->n_draft_past + 1);
+	pending.assign(task->cache_tokens.begin() + task->n_draft_past, task->cache_tokens.end());
+	pending.push_back(task->last_token);
+
+	size_t n_done = 0;
+	while (n_done < pending.size()) {
+		common_batch_clear(draft_batch);
+		size_t n_take = std::min(pending.size() - n_done, (size_t)n_batch);
+		for (size_t i = 0; i < n_take; i++) {
+			bool is_last = n_done + i == pending.size() - 1;
+			common_batch_add(draft_batch, pending[n_done + i], (llama_pos)(task->n_draft_past + n_done + i),
+				{ task->seq_id }, is_last);
+		}
+		if (llama_decode(draft_ctx, draft_batch) != 0) {
+			// Start the draft sequence over on the next step
+			llama_memory_seq_rm(draft_memory, task->seq_id, -1, -1);
+			task->n_draft_past = 0;
 			return;
 		}
-		
-		llama_batch_free(batch);
+		n_done += n_take;
 	}
-	
-	// Generation completed
-	std::lock_guard<std::mutex> result_lock(result_mutex);
-	task_results[task->id].emplace(task->id, task->current_text, true);
-	task->state = TASK_STATE_COMPLETED;
-}
\ No newline at end of file
+	task->n_draft_past += pending.size();
+
+	const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(draft_model));
+	const llama_vocab* vocab = llama_model_get_vocab(model);
+	for (int i = 0; i < n_max; i++) {
+		// Greedy drafting, the target decides what is kept
+		const float* logits = llama_get_logits_ith(draft_ctx, -1);
+		llama_token best = (llama_token)(std::max_element(logits, logits + n_vocab) - logits);
+		task->draft_tokens.push_back(best);
+		if (llama_vocab_is_eog(vocab, best) || i == n_max - 1) break;
+
+		common_batch_clear(draft_batch);
+		common_batch_add(draft_batch, best, (llama_pos)task->n_draft_past, { task->seq_id }, true);
+		if (llama_decode(draft_ctx, draft_batch) != 0) break;
+		task->n_draft_past++;
+	}
+}
+
+// Hand one generated token to the task, returns false once the task is finished
+bool LlamaServer::emit_token(CompletionTask* task, llama_token new_token, TokenProbs* top_probs) {
+	const llama_vocab* vocab = llama_model_get_vocab(model);
+	if (llama_vocab_is_eog(vocab, new_token)) {
+		task->state = TASK_STATE_COMPLETED;
+		push_result(task, final_text(task), true, false, "", -1,
+			task->stream ? nullptr : &task->all_probs);
+		finish_task(task);
+		return false;
+	}
+
+	task->generated_tokens.push_back(new_token);
+
+	uint64_t now = LatencyHistogram::now_ns();
+	if (task->t_last_token == 0) {
+		latency.first_token.record(now - task->t_submitted);
+	} else {
+		latency.token_interval.record(now - task->t_last_token);
+	}
+	task->t_last_token = now;
+
+	std::string piece = token_to_piece(vocab, new_token);
+
+	if (task->stream) {
+		// Only complete UTF-8 sequences are streamed, a partial multibyte piece waits for the next token
+		task->pending_bytes += piece;
+		size_t n_complete = utf8_complete_length(task->pending_bytes);
+		std::string text = task->pending_bytes.substr(0, n_complete);
+		task->pending_bytes.erase(0, n_complete);
+		push_result(task, text, false, false, "", new_token, top_probs);
+	} else {
+		task->current_text += piece;
+		if (top_probs) {
+			task->all_probs.ids.insert(task->all_probs.ids.end(), top_probs->ids.begin(), top_probs->ids.end());
+			task->all_probs.probs.insert(task->all_probs.probs.end(), top_probs->probs.begin(), top_probs->probs.end());
+		}
+	}
+
+	if ((int)task->generated_tokens.size() >= task->n_predict) {
+		task->state = TASK_STATE_COMPLETED;
+		push_result(task, final_text(task), true, false, "", -1,
+			task->stream ? nullptr : &task->all_probs);
+		finish_task(task);
+		return false;
+	}
+
+	task->last_token = new_token;
+	return true;
+}
+
+void LlamaServer::push_result(CompletionTask* task, const std::string& text, bool is_final,
+		bool is_error, const std::string& error_msg, llama_token token, TokenProbs* top_probs) {
+	{
+		std::lock_guard<std::mutex> task_lock(task->mutex);
+		if (task->released) return;
+		task->results.push(TaskResult(task->id, text, is_final, is_error, error_msg));
+		task->results.back().token = token;
+		if (top_probs) {
+			task->results.back().top_probs = std::move(*top_probs);
+		}
+	}
+	task->result_cv.notify_all();
+	if (task->push_delivery) push.notify();
+}
+
+void LlamaServer::finish_task(CompletionTask* task) {
+	queue_forks(task);
+	if (task->seq_id >= 0) {
+		// Keep the KV cells of the sequence so that a later prompt can reuse its prefix
+		if (task->cache_tokens.empty()) {
+			llama_memory_seq_rm(llama_get_memory(ctx), task->seq_id, -1, -1);
+		}
+		seq_tokens[task->seq_id] = std::move(task->cache_tokens);
+		seq_lora[task->seq_id] = task->lora_key;
+		task->cache_tokens.clear();
+		free_seq_ids.push_back(task->seq_id);
+		seq_free_cv.notify_all();
+		task->seq_id = -1;
+		n_cells_reserved -= task->n_reserved;
+		task->n_reserved = 0;
+	}
+	if (task->state != TASK_STATE_CANCELLED) {
+		task->state = TASK_STATE_COMPLETED;
+	}
+}
@@ -5,76 +5,302 @@
 #include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <cstdint>
 #include <thread>
-#include <queue>
+#include <deque>
 #include <condition_variable>
 #include <atomic>
 #include "llama.h"
 #include "completion_task.h"
-
-struct TaskRequest {
-	int id;
-	std::string prompt;
-	int n_predict = 10;
-};
-
-struct TaskResult {
-	int task_id;
-	std::string text;
-	bool is_final;
-	bool is_error;
-	std::string error_msg;
-	
-	TaskResult(int id, const std::string& t, bool final = false, bool error = false, const std::string& err = "") 
-		: task_id(id), text(t), is_final(final), is_error(error), error_msg(err) {}
-};
+#include "sampler_pipeline.h"
+#include "chat_conversation.h"
+#include "sequence_cache.h"
+#include "thread_placement.h"
+#include "latency_histogram.h"
+#include "memory_manager.h"
+#include "push_dispatcher.h"
+#include "adapter_registry.h"
 
 struct LlamaServer {
+	// Weights are shared between servers through the ModelRegistry, the references keep them resident
+	std::shared_ptr<llama_model> model_ref;
+	std::shared_ptr<llama_model> draft_model_ref;
+
 	llama_model* model = nullptr;
 	llama_context* ctx = nullptr;
 	llama_sampler* sampler = nullptr;
 	bool embedding_mode = false;
 	bool reranking_mode = false;
-	
-	// Task management
-	std::queue<TaskRequest> task_queue;
+
+	// Optional draft model for speculative decoding, shares the sequence ids of ctx
+	llama_model* draft_model = nullptr;
+	llama_context* draft_ctx = nullptr;
+	int n_draft_max = 8;
+	int n_draft_min = 0;
+
+	// Thread pools owned by the server, nullptr when ggml's default pool is used, and the NUMA node
+	// the server was placed on, -1 if none
+	ggml_threadpool_t threadpool = nullptr;
+	ggml_threadpool_t threadpool_batch = nullptr;
+	int numa_node = -1;
+
+	// Compiled per-request sampler chains and grammars, cloned into every task
+	SamplerPipelineCache sampler_cache;
+	GrammarCache grammar_cache;
+
+	// Host RAM and disk snapshots of sequences, restored on a prompt prefix hit
+	SequenceCache seq_cache;
+
+	// Context shifting, off by default: a sequence outgrowing its share of the context keeps its
+	// first n_shift_keep tokens (-1 for the whole prompt) and drops shift_discard of the rest
+	bool context_shift = false;
+	int n_shift_keep = 0;
+	float shift_discard = 0.5f;
+	int n_ctx_seq = 0;  // Context cells available to every sequence
+
+	// Tokens decoded per scheduler step and prompt tokens one task prefills per step, 0 for n_batch
+	// and n_ubatch. Generating sequences are batched first, prompt chunks fill the rest of the budget.
+	int n_step_tokens = 0;
+	int n_prefill_chunk = 0;
+
+	// LoRA adapters of the AdapterRegistry: the set applied to ctx, and the set of tasks naming none,
+	// which setLoRAAdapter and friends change; the server holds the adapters of both. A step decodes the
+	// tasks of one set only; while tasks of other sets wait, the scheduler stays with the active set
+	// for at most lora_quantum steps. Both under ctx_mutex.
+	LoraSet lora_active;
+	LoraSet lora_default;
+	int lora_quantum = 16;
+
+	// Warmup prompt held by sequence 0 when the server starts until memory is cleared, and whether it
+	// came from the warm image
+	std::vector<llama_token> warm_tokens;
+	bool warm_restored = false;
+
+	// Memory plan the context was created with, as JSON
+	std::string memory_plan;
+
+	// Layers and memory of every device after loading, as JSON
+	std::string device_placement;
+
+	// Chat conversations keeping their rendered history and tokens between turns
+	std::unordered_map<int64_t, std::shared_ptr<ChatConversation>> conversations;
+	std::mutex conversations_mutex;
+	int64_t next_conversation_id = 1;
+
+	// Serializes all use of ctx; the server thread holds it for every scheduler step,
+	// other managers take it before touching the context
+	std::mutex ctx_mutex;
+
+	// Task management: submitted tasks waiting for a free sequence, one FIFO per priority class.
+	// Beyond max_queued waiting tasks (0 for no limit) a submission displaces the newest task of a
+	// lower class or is rejected.
+	struct QueuedTask {
+		int id;
+		uint64_t t_deadline;
+	};
+	std::deque<QueuedTask> task_queues[TASK_PRIORITY_COUNT];
+	size_t n_queued = 0;
+	int max_queued = 0;
 	std::mutex task_queue_mutex;
 	std::condition_variable task_queue_cv;
-	
-	// Result management
-	std::unordered_map<int, std::queue<TaskResult>> task_results;
-	std::mutex result_mutex;
-	
-	// Active tasks
-	std::unordered_map<int, std::unique_ptr<CompletionTask>> active_tasks;
+	std::condition_variable seq_free_cv;  // A sequence was freed, for SequenceLease waiting on task_queue_mutex
+
+	// Active tasks, the mutex only guards the map itself and is never held across decoding.
+	// Per-task state and results are guarded by CompletionTask::mutex.
+	std::unordered_map<int, std::shared_ptr<CompletionTask>> active_tasks;
 	std::mutex active_tasks_mutex;
-	
+
+	// Scheduler state, touched by the server thread and by SequenceLease, both under ctx_mutex;
+	// free_seq_ids also under task_queue_mutex when leased, has_work reads it without ctx_mutex
+	std::vector<CompletionTask*> running_tasks;
+	std::vector<CompletionTask*> swapped_tasks;  // Preempted tasks, oldest first
+	bool swap_full = false;  // The last preemption failed, retried once swap space is freed
+	std::vector<llama_seq_id> free_seq_ids;
+	std::vector<std::vector<llama_token>> seq_tokens;  // Tokens kept in the KV cache of each free sequence
+	std::vector<uint64_t> seq_lora;                    // lora_set_key the kept tokens were decoded with
+	int n_lora_steps = 0;                              // Steps since the active adapter set was applied
+	llama_batch batch = {};
+	llama_batch draft_batch = {};
+	int n_batch = 0;
+
+	// n_batch sized batches for decoding outside the scheduler (embeddings, reranking), under ctx_mutex
+	BatchPool batches;
+
 	// Server thread
 	std::thread server_thread;
 	std::atomic<bool> should_stop{false};
-	int next_task_id = 1;
-	
+	std::atomic<bool> reap_requested{false};
+	std::atomic<bool> cancel_requested{false};  // A task was cancelled since the current step began
+	std::atomic<int> next_task_id{1};
+
+	// Prompt tokens served from a cached KV prefix instead of being decoded
+	std::atomic<int64_t> n_prompt_tokens_reused{0};
+
+	// Context shifts done in place, and rebuilds of memory that cannot shift positions
+	std::atomic<int64_t> n_context_shifts{0};
+	std::atomic<int64_t> n_context_rebuilds{0};
+
+	// Admission control: rejected submissions, tasks that missed their deadline, and the KV cells
+	// projected for the tasks holding a sequence (prompt + n_predict, at most a sequence's share)
+	std::atomic<int64_t> n_rejected_queue_full{0};
+	std::atomic<int64_t> n_rejected_oversized{0};
+	std::atomic<int64_t> n_deadline_misses{0};
+	std::atomic<int> n_cells_reserved{0};
+
+	// Preemption: with a swap budget, a task waiting for a sequence evicts a running task of a lower
+	// class, whose sequence state is kept in host memory until a sequence is free again
+	size_t swap_budget = 0;
+	std::atomic<int64_t> swap_bytes{0};
+	std::atomic<int64_t> n_preemptions{0};
+	std::atomic<int64_t> n_swap_restores{0};
+
+	// Branches of n-best requests that shared the prefill of their prompt
+	std::atomic<int64_t> n_forks{0};
+
+	// Changes of the adapter set applied to ctx
+	std::atomic<int64_t> n_lora_switches{0};
+
+	// Decodes interrupted by a cancellation, the other tasks of the batch decoded their tokens again
+	std::atomic<int64_t> n_decodes_aborted{0};
+
+	// Abort callback set from Java for the decodes of the context, chained behind the
+	// cancellation check of the scheduler
+	std::atomic<ggml_abort_callback> user_abort_callback{nullptr};
+	std::atomic<void*> user_abort_data{nullptr};
+
+	// Speculative decoding statistics
+	std::atomic<int64_t> n_draft_tokens{0};
+	std::atomic<int64_t> n_draft_accepted{0};
+
+	// Latency breakdown of completion requests
+	LatencyStats latency;
+
+	// Delivers results of callback-driven completions, its thread starts with the first one
+	PushDispatcher push{this};
+
+	// Hand a tokenized task to the scheduler, returns its id
+	int submit_task(std::unique_ptr<CompletionTask> task);
+
+	// Hand the branches of an n-best request to the scheduler, all with the same prompt. Only the
+	// first is queued, the others fork its KV sequence once the prompt is decoded.
+	void submit_group(std::vector<std::unique_ptr<CompletionTask>> tasks, std::vector<int>& ids);
+
+	// Look up a task, the returned pointer stays valid after the task is released
+	std::shared_ptr<CompletionTask> find_task(int task_id);
+
+	// Block until the next result of a task is available
+	bool wait_result(int task_id, TaskResult& result);
+
+	// Wait up to timeout_ms for at least one result, then drain up to max_results of them
+	bool wait_results(int task_id, size_t max_results, int64_t timeout_ms, std::vector<TaskResult>& results);
+
+	// Tasks of a priority class waiting for a sequence
+	size_t queue_depth(int priority);
+
+	// Stop generating for a task, its pending results stay readable
+	void cancel_task(int task_id);
+
+	// Drop a task and its results, the server thread frees it on its next step
+	void release_task(int task_id);
+
+	// Make set the adapters of ctx, adapters already applied with the same scale are left alone.
+	// Returns 0, or the error of llama_set_adapter_lora and -1 for an adapter that is not resident;
+	// lora_active then keeps only the adapters that were applied. Under ctx_mutex.
+	int32_t apply_lora(const LoraSet& set);
+
+	// Take up to n_max free sequences for decoding outside the scheduler, emptied of the tokens they
+	// kept. Returns the number taken. Under ctx_mutex.
+	size_t lease_sequences(size_t n_max, std::vector<llama_seq_id>& seqs);
+
+	// Remove what leased sequences hold and hand them back to the scheduler. Under ctx_mutex.
+	void return_sequences(std::vector<llama_seq_id>& seqs);
+
+	// Forget the tokens kept by the free sequences, the warmup prompt and the snapshots once memory
+	// was cleared outside the scheduler, so that no prompt reuses a prefix that is gone. Under ctx_mutex.
+	void forget_sequences();
+
 	// Server main loop
 	void server_loop();
-	void process_task(const TaskRequest& request);
-	void generate_tokens(CompletionTask* task);
-	
-	void start_server() {
-		server_thread = std::thread(&LlamaServer::server_loop, this);
-	}
-	
-	void stop_server() {
-		should_stop = true;
-		task_queue_cv.notify_all();
-		if (server_thread.joinable()) {
-			server_thread.join();
-		}
-	}
-	
+
+	void start_server();
+
+	void stop_server();
+
 	~LlamaServer() {
 		stop_server();
+		if (batch.token) llama_batch_free(batch);
+		if (draft_batch.token) llama_batch_free(draft_batch);
+		if (draft_ctx) llama_free(draft_ctx);
+		draft_model_ref.reset();
+		sampler_cache.clear();
+		grammar_cache.clear();
+		seq_cache.clear();
 		if (sampler) llama_sampler_free(sampler);
 		if (ctx) llama_free(ctx);
-		if (model) llama_model_free(model);
+		for (const LoraScale& lora : lora_active) AdapterRegistry::release(lora.handle);
+		for (const LoraScale& lora : lora_default) AdapterRegistry::release(lora.handle);
+		ThreadPlacement::free_pool(threadpool_batch);
+		ThreadPlacement::free_pool(threadpool);
+		ThreadPlacement::release_node(numa_node);
+		model_ref.reset();
 	}
-};
\ No newline at end of file
+
+private:
+	// Scheduler steps
+	void admit_pending_tasks();
+	void expire_queued_tasks();
+	uint64_t next_deadline();
+	void reject_task(CompletionTask* task, const std::string& reason);
+	void queue_forks(CompletionTask* task);
+	void fork_task(CompletionTask* task);
+	CompletionTask* preemption_victim(int priority);
+	bool preempt_task(CompletionTask* task);
+	void resume_task(CompletionTask* task);
+	void drop_swapped(CompletionTask* task);
+	void expire_swapped_tasks();
+	llama_seq_id acquire_sequence(CompletionTask* task);
+	llama_seq_id take_sequence(size_t i);
+	void reap_finished_tasks();
+	bool has_work();
+	bool is_backlogged(CompletionTask* task);
+	int lora_status(CompletionTask* task);
+	bool lora_loading();
+	void select_lora();
+	void update_tasks();
+	bool make_room(CompletionTask* task, int n_tokens);
+	void sample_task(CompletionTask* task);
+	void draft_for_task(CompletionTask* task, int n_max);
+	bool emit_token(CompletionTask* task, llama_token new_token, TokenProbs* top_probs = nullptr);
+
+	void push_result(CompletionTask* task, const std::string& text, bool is_final,
+		bool is_error = false, const std::string& error_msg = "", llama_token token = -1,
+		TokenProbs* top_probs = nullptr);
+	void finish_task(CompletionTask* task);
+
+	// Aborts llama_decode once a task of the batch in flight is cancelled
+	static bool abort_decode(void* data);
+
+	// Tasks of the batch in flight, only set while the server thread is inside llama_decode
+	const std::vector<CompletionTask*>* decoding_tasks = nullptr;
+};
+
+// Sequences of a server leased for decoding outside the scheduler (embeddings, reranking), so that
+// running completions keep theirs. Holds ctx_mutex for the scope and waits for at least one free
+// sequence; it is only empty if the server stopped first.
+class SequenceLease {
+public:
+	SequenceLease(LlamaServer* server, size_t n_max);
+	~SequenceLease();
+
+	bool empty() const { return seqs_.empty(); }
+	size_t size() const { return seqs_.size(); }
+	llama_seq_id operator[](size_t i) const { return seqs_[i]; }
+
+	SequenceLease(const SequenceLease&) = delete;
+	SequenceLease& operator=(const SequenceLease&) = delete;
+
+private:
+	LlamaServer* server_;
+	std::unique_lock<std::mutex> ctx_lock_;
+	std::vector<llama_seq_id> seqs_;
+};
@@ -0,0 +1,41 @@
+#include "log_router.h"
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+namespace {
+
+std::atomic<ggml_log_callback> g_sink{nullptr};
+thread_local ggml_log_callback t_observer = nullptr;
+thread_local void* t_observer_data = nullptr;
+
+void route_log(ggml_log_level level, const char* text, void* user_data) {
+	if (t_observer) {
+		t_observer(level, text, t_observer_data);
+	}
+	ggml_log_callback sink = g_sink.load(std::memory_order_acquire);
+	if (sink) {
+		sink(level, text, nullptr);
+	} else {
+		fputs(text, stderr);
+		fflush(stderr);
+	}
+}
+
+void install() {
+	static std::once_flag installed;
+	std::call_once(installed, [] { llama_log_set(route_log, nullptr); });
+}
+
+}
+
+void LogRouter::set_sink(ggml_log_callback sink) {
+	g_sink.store(sink, std::memory_order_release);
+	install();
+}
+
+void LogRouter::observe(ggml_log_callback observer, void* user_data) {
+	install();
+	t_observer = observer;
+	t_observer_data = user_data;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "llama.h"
+
+// The one llama.cpp log callback of the process. Lines go to the sink of LlamaUtils.setLogCallback,
+// or to stderr without one, like llama.cpp's default. A thread may observe the lines it logs itself
+// before they reach the sink, for operations that report their progress only by logging, such as
+// the per-tensor lines of llama_model_quantize.
+class LogRouter {
+public:
+	// Route llama.cpp's logs to the sink, nullptr for stderr
+	static void set_sink(ggml_log_callback sink);
+
+	// Observe the lines logged by the calling thread, nullptr to stop. An observer may throw to
+	// abort the llama.cpp call that is logging.
+	static void observe(ggml_log_callback observer, void* user_data);
+};
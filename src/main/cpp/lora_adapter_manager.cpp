@@ -1,21 +1,12 @@
 #include "lora_adapter_manager.h"
 #include "jni_utils.h"
 #include "jni_error_handler.h"
+#include "adapter_registry.h"
 #include <mutex>
 #include <unordered_map>
 #include <memory>
 #include <algorithm>
 
-// External global server management (defined in jllama.cpp)
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
-
 jlong LoRAAdapterManager::loadAdapter(JNIEnv* env, jobject obj, jstring path_lora) {
 	JNI_TRY(env)
 	
@@ -23,21 +14,19 @@ jlong LoRAAdapterManager::loadAdapter(JNIEnv* env, jobject obj, jstring path_lor
 		return -1;
 	}
 
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->model, "server->model", -1);
 
 	std::string lora_path = JniUtils::jstring_to_string(env, path_lora);
 	
-	// Load LoRA adapter
-	llama_adapter_lora* adapter = llama_adapter_lora_init(server->model, lora_path.c_str());
-	if (!adapter) {
+	// Shared with every context of the same model, a file opened before is not read again
+	int64_t handle = AdapterRegistry::open(server->model_ref, lora_path);
+	if (handle < 0) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to load LoRA adapter from: " + lora_path);
 		return -1;
 	}
-
-	// Return adapter pointer as handle
-	return reinterpret_cast<jlong>(adapter);
+	return (jlong)handle;
 
 	JNI_CATCH_RET(env, -1)
 }
@@ -45,17 +34,8 @@ jlong LoRAAdapterManager::loadAdapter(JNIEnv* env, jobject obj, jstring path_lor
 void LoRAAdapterManager::freeAdapter(JNIEnv* env, jlong adapter_handle) {
 	JNI_TRY(env)
 	
-	// Early validation before calling getAdapter
-	if (adapter_handle <= 0 || adapter_handle == -1 || 
-		adapter_handle < 0x1000 || adapter_handle >= 0x7FFFFFFFFFFFFFFFLL) {
-		// Invalid handle, silently return without attempting to free
-		return;
-	}
-	
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
-	if (adapter) {
-		llama_adapter_lora_free(adapter);
-	}
+	// Unknown handles are ignored, requests and contexts still holding the adapter keep it loaded
+	AdapterRegistry::close(adapter_handle);
 
 	JNI_CATCH(env)
 }
@@ -63,18 +43,40 @@ void LoRAAdapterManager::freeAdapter(JNIEnv* env, jlong adapter_handle) {
 jint LoRAAdapterManager::setAdapter(JNIEnv* env, jobject obj, jlong adapter_handle, jfloat scale) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
+	// The default set holds its adapters
+	llama_adapter_lora* adapter = nullptr;
+	bool held = AdapterRegistry::model(adapter_handle) == server->model &&
+		AdapterRegistry::hold(adapter_handle, true, adapter);
 	if (!adapter) {
+		if (held) AdapterRegistry::release(adapter_handle);
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
 		return -1;
 	}
 
-	// Apply LoRA adapter to context
-	int32_t result = llama_set_adapter_lora(server->ctx, adapter, scale);
+	// Tasks naming no adapters and admitted from now on decode with the new default set, the
+	// scheduler applies the set of every step itself
+	LoraSet previous = server->lora_default;
+	LoraSet& lora = server->lora_default;
+	auto pos = std::lower_bound(lora.begin(), lora.end(), adapter_handle,
+		[](const LoraScale& entry, jlong value) { return entry.handle < value; });
+	bool added = pos == lora.end() || pos->handle != adapter_handle;
+	if (added) {
+		lora.insert(pos, { adapter_handle, scale, adapter });
+	} else {
+		pos->scale = scale;
+		AdapterRegistry::release(adapter_handle);
+	}
+	int32_t result = server->apply_lora(lora);
+	if (result != 0) {
+		lora = previous;
+		server->apply_lora(lora);
+		if (added) AdapterRegistry::release(adapter_handle);
+	}
 	return (jint)result;
 
 	JNI_CATCH_RET(env, -1)
@@ -83,19 +85,20 @@ jint LoRAAdapterManager::setAdapter(JNIEnv* env, jobject obj, jlong adapter_hand
 jint LoRAAdapterManager::removeAdapter(JNIEnv* env, jobject obj, jlong adapter_handle) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
-
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
-	if (!adapter) {
-		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
-		return -1;
-	}
-
-	// Remove LoRA adapter from context
-	int32_t result = llama_rm_adapter_lora(server->ctx, adapter);
-	return (jint)result;
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+
+	// Remove LoRA adapter from the default set
+	LoraSet& lora = server->lora_default;
+	auto pos = std::find_if(lora.begin(), lora.end(),
+		[adapter_handle](const LoraScale& entry) { return entry.handle == adapter_handle; });
+	if (pos == lora.end()) return -1;
+	lora.erase(pos);
+	server->apply_lora(lora);
+	AdapterRegistry::release(adapter_handle);
+	return 0;
 
 	JNI_CATCH_RET(env, -1)
 }
@@ -103,12 +106,18 @@ jint LoRAAdapterManager::removeAdapter(JNIEnv* env, jobject obj, jlong adapter_h
 void LoRAAdapterManager::clearAdapters(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_VOID(env, server, "server");
 	JNI_CHECK_NULL_VOID(env, server->ctx, "server->ctx");
-
-	// Clear all LoRA adapters from context
-	llama_clear_adapter_lora(server->ctx);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+
+	// Clear all LoRA adapters from the default set
+	LoraSet cleared;
+	cleared.swap(server->lora_default);
+	server->apply_lora(server->lora_default);
+	for (const LoraScale& lora : cleared) {
+		AdapterRegistry::release(lora.handle);
+	}
 
 	JNI_CATCH(env)
 }
@@ -116,9 +125,10 @@ void LoRAAdapterManager::clearAdapters(JNIEnv* env, jobject obj) {
 jint LoRAAdapterManager::applyControlVector(JNIEnv* env, jobject obj, jfloatArray data) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 
 	if (!data) {
 		// Clear control vector by passing null data
@@ -160,7 +170,9 @@ jstring LoRAAdapterManager::getAdapterMetaValue(JNIEnv* env, jlong adapter_handl
 		return nullptr;
 	}
 
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
+	// Loaded again for the call if it was evicted
+	AdapterHold hold(adapter_handle);
+	llama_adapter_lora* adapter = hold.get();
 	if (!adapter) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
 		return nullptr;
@@ -189,7 +201,8 @@ jstring LoRAAdapterManager::getAdapterMetaValue(JNIEnv* env, jlong adapter_handl
 jint LoRAAdapterManager::getAdapterMetaCount(JNIEnv* env, jlong adapter_handle) {
 	JNI_TRY(env)
 	
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
+	AdapterHold hold(adapter_handle);
+	llama_adapter_lora* adapter = hold.get();
 	if (!adapter) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
 		return -1;
@@ -204,7 +217,8 @@ jint LoRAAdapterManager::getAdapterMetaCount(JNIEnv* env, jlong adapter_handle)
 jstring LoRAAdapterManager::getAdapterMetaKeyByIndex(JNIEnv* env, jlong adapter_handle, jint index) {
 	JNI_TRY(env)
 	
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
+	AdapterHold hold(adapter_handle);
+	llama_adapter_lora* adapter = hold.get();
 	if (!adapter) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
 		return nullptr;
@@ -231,7 +245,8 @@ jstring LoRAAdapterManager::getAdapterMetaKeyByIndex(JNIEnv* env, jlong adapter_
 jstring LoRAAdapterManager::getAdapterMetaValueByIndex(JNIEnv* env, jlong adapter_handle, jint index) {
 	JNI_TRY(env)
 	
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
+	AdapterHold hold(adapter_handle);
+	llama_adapter_lora* adapter = hold.get();
 	if (!adapter) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
 		return nullptr;
@@ -258,7 +273,8 @@ jstring LoRAAdapterManager::getAdapterMetaValueByIndex(JNIEnv* env, jlong adapte
 jlong LoRAAdapterManager::getAloraInvocationTokenCount(JNIEnv* env, jlong adapter_handle) {
 	JNI_TRY(env)
 	
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
+	AdapterHold hold(adapter_handle);
+	llama_adapter_lora* adapter = hold.get();
 	if (!adapter) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
 		return 0;
@@ -273,7 +289,8 @@ jlong LoRAAdapterManager::getAloraInvocationTokenCount(JNIEnv* env, jlong adapte
 jintArray LoRAAdapterManager::getAloraInvocationTokens(JNIEnv* env, jlong adapter_handle) {
 	JNI_TRY(env)
 	
-	llama_adapter_lora* adapter = getAdapter(adapter_handle);
+	AdapterHold hold(adapter_handle);
+	llama_adapter_lora* adapter = hold.get();
 	if (!adapter) {
 		JNIErrorHandler::throw_runtime_exception(env, "Invalid adapter handle");
 		return nullptr;
@@ -302,35 +319,19 @@ jintArray LoRAAdapterManager::getAloraInvocationTokens(JNIEnv* env, jlong adapte
 	JNI_CATCH_RET(env, nullptr)
 }
 
-LlamaServer* LoRAAdapterManager::getServer(JNIEnv* env, jobject obj) {
+ServerRef LoRAAdapterManager::getServer(JNIEnv* env, jobject obj) {
 	jclass cls = env->GetObjectClass(obj);
 	if (!cls) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get object class");
 		return nullptr;
 	}
 
-	jfieldID field = env->GetFieldID(cls, "ctx", "J");
+	jfieldID field = JniUtils::ctx_field(env, cls);
 	if (!field) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get ctx field");
 		return nullptr;
 	}
 
 	jlong handle = env->GetLongField(obj, field);
-	return get_server(handle);
+	return ServerTable::acquire(handle);
 }
-
-llama_adapter_lora* LoRAAdapterManager::getAdapter(jlong handle) {
-	// Reject invalid handles immediately
-	if (handle <= 0 || handle == -1) {
-		return nullptr;
-	}
-	
-	// Additional safety check - reject handles that are clearly invalid pointers
-	// Real pointers should be in reasonable memory ranges
-	// Reject Long.MAX_VALUE and other extreme values
-	if (handle < 0x1000 || handle >= 0x7FFFFFFFFFFFFFFFLL) {
-		return nullptr;
-	}
-	
-	return reinterpret_cast<llama_adapter_lora*>(handle);
-}
\ No newline at end of file
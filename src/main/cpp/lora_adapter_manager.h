@@ -4,6 +4,7 @@
 #include <string>
 #include "llama.h"
 #include "llama_server.h"
+#include "server_table.h"
 
 /**
  * Handles LoRA adapter operations for llama.cpp contexts.
@@ -12,7 +13,7 @@
 class LoRAAdapterManager {
 public:
 	/**
-	 * Load a LoRA adapter from file.
+	 * Load a LoRA adapter from file into the AdapterRegistry, shared by all contexts of the model.
 	 * @param env JNI environment
 	 * @param obj Java LlamaModel object
 	 * @param path_lora Path to the LoRA adapter file
@@ -120,12 +121,5 @@ private:
 	 * @param obj Java LlamaModel object
 	 * @return LlamaServer pointer, or nullptr if not found
 	 */
-	static LlamaServer* getServer(JNIEnv* env, jobject obj);
-
-	/**
-	 * Convert adapter handle to pointer.
-	 * @param handle Java long handle
-	 * @return llama_adapter_lora pointer, or nullptr if invalid
-	 */
-	static llama_adapter_lora* getAdapter(jlong handle);
+	static ServerRef getServer(JNIEnv* env, jobject obj);
 };
\ No newline at end of file
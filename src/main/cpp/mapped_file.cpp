@@ -0,0 +1,131 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+static void* open_file(const std::string& path, DWORD access, DWORD creation, DWORD flags) {
+    HANDLE file = CreateFileA(path.c_str(), access, FILE_SHARE_READ, nullptr, creation, flags, nullptr);
+    return file == INVALID_HANDLE_VALUE ? nullptr : file;
+}
+
+bool MappedFile::create(const std::string& path, size_t size) {
+    close();
+    file_ = open_file(path, GENERIC_READ | GENERIC_WRITE, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL);
+    return file_ && map(size, true);
+}
+
+bool MappedFile::open_read(const std::string& path) {
+    close();
+    file_ = open_file(path, GENERIC_READ, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL);
+    LARGE_INTEGER size;
+    if (!file_ || !GetFileSizeEx(file_, &size)) {
+        close();
+        return false;
+    }
+    return map((size_t)size.QuadPart, false);
+}
+
+bool MappedFile::create_temporary(size_t size) {
+    close();
+    char dir[MAX_PATH];
+    char path[MAX_PATH];
+    if (!GetTempPathA(MAX_PATH, dir) || !GetTempFileNameA(dir, "jll", 0, path)) return false;
+    file_ = open_file(path, GENERIC_READ | GENERIC_WRITE, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE);
+    return file_ && map(size, true);
+}
+
+bool MappedFile::map(size_t size, bool writable) {
+    size_ = size;
+    if (size == 0) return true;
+    mapping_ = CreateFileMappingA(file_, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+        (DWORD)((uint64_t)size >> 32), (DWORD)(size & 0xFFFFFFFF), nullptr);
+    if (mapping_) {
+        data_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size));
+    }
+    if (!data_) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_) CloseHandle(file_);
+    data_ = nullptr;
+    mapping_ = nullptr;
+    file_ = nullptr;
+    size_ = 0;
+}
+
+#else
+
+bool MappedFile::create(const std::string& path, size_t size) {
+    close();
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0 || ftruncate(fd_, (off_t)size) != 0) {
+        close();
+        return false;
+    }
+    return map(size, true);
+}
+
+bool MappedFile::open_read(const std::string& path) {
+    close();
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0) {
+        close();
+        return false;
+    }
+    return map((size_t)st.st_size, false);
+}
+
+bool MappedFile::create_temporary(size_t size) {
+    close();
+    const char* dir = std::getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/jllama-XXXXXX";
+    fd_ = mkstemp(&path[0]);
+    if (fd_ < 0) return false;
+    // Unlinked right away, the space is released when the mapping is closed
+    unlink(path.c_str());
+    if (ftruncate(fd_, (off_t)size) != 0) {
+        close();
+        return false;
+    }
+    return map(size, true);
+}
+
+bool MappedFile::map(size_t size, bool writable) {
+    size_ = size;
+    if (size == 0) return true;
+    void* addr = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+        close();
+        return false;
+    }
+    data_ = static_cast<uint8_t*>(addr);
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_) munmap(data_, size_);
+    if (fd_ >= 0) ::close(fd_);
+    data_ = nullptr;
+    fd_ = -1;
+    size_ = 0;
+}
+
+#endif
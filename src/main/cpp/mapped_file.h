@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A file mapped into memory. Data staged in a mapping lives in the page cache, which the kernel
+// can write back and evict, instead of in anonymous memory or on the Java heap.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Create or truncate path to size bytes and map it writable
+    bool create(const std::string& path, size_t size);
+
+    // Map an existing file read-only
+    bool open_read(const std::string& path);
+
+    // Map a writable scratch file of size bytes that is removed once closed
+    bool create_temporary(size_t size);
+
+    void close();
+
+    uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    bool map(size_t size, bool writable);
+
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
@@ -2,146 +2,351 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+
+namespace {
+
+// Counters of one thread, only written by it. Counters of finished threads stay registered,
+// their allocations may still be freed by other threads.
+struct ThreadCounters {
+    std::atomic<int64_t> bytes{0};
+    std::atomic<int64_t> count{0};
+    int64_t unflushed = 0;
+};
+
+std::mutex g_counters_mutex;
+std::vector<std::shared_ptr<ThreadCounters>> g_counters;
+
+ThreadCounters& thread_counters() {
+    thread_local std::shared_ptr<ThreadCounters> counters;
+    if (!counters) {
+        counters = std::make_shared<ThreadCounters>();
+        std::lock_guard<std::mutex> lock(g_counters_mutex);
+        g_counters.push_back(counters);
+    }
+    return *counters;
+}
+
+void sum_counters(int64_t& bytes, int64_t& count) {
+    bytes = 0;
+    count = 0;
+    std::lock_guard<std::mutex> lock(g_counters_mutex);
+    for (const std::shared_ptr<ThreadCounters>& counters : g_counters) {
+        bytes += counters->bytes.load(std::memory_order_relaxed);
+        count += counters->count.load(std::memory_order_relaxed);
+    }
+}
+
+// Single writer, a plain load and store instead of a locked read-modify-write
+void add_relaxed(std::atomic<int64_t>& counter, int64_t delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+}
 
 // Static member definitions
-std::mutex MemoryTracker::tracker_mutex_;
-std::unordered_map<void*, MemoryTracker::AllocationInfo> MemoryTracker::allocations_;
-size_t MemoryTracker::total_allocated_ = 0;
-size_t MemoryTracker::peak_usage_ = 0;
-bool MemoryTracker::tracking_enabled_ = false;
+std::atomic<bool> MemoryTracker::tracking_enabled_{true};
+#ifdef DEBUG_MEMORY
+std::atomic<bool> MemoryTracker::record_sites_{true};
+#else
+std::atomic<bool> MemoryTracker::record_sites_{false};
+#endif
+std::atomic<int64_t> MemoryTracker::flushed_usage_{0};
+std::atomic<int64_t> MemoryTracker::peak_usage_{0};
+std::atomic<int64_t> MemoryTracker::baseline_usage_{0};
+std::atomic<int64_t> MemoryTracker::baseline_count_{0};
+MemoryTracker::SiteShard MemoryTracker::site_shards_[MemoryTracker::SITE_SHARDS];
 
-// Thread-local memory pool
-thread_local MemoryPool g_memory_pool;
+// Thread-local scratch arena
+thread_local MemoryArena g_scratch_arena;
 
 // MemoryTracker implementation
-void MemoryTracker::enable_tracking(bool enable) {
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
-    tracking_enabled_ = enable;
+MemoryTracker::SiteShard& MemoryTracker::site_shard(void* ptr) {
+    // Low bits of heap pointers are alignment, mix the higher ones
+    uintptr_t bits = reinterpret_cast<uintptr_t>(ptr);
+    return site_shards_[((bits >> 4) ^ (bits >> 12)) % SITE_SHARDS];
+}
+
+void MemoryTracker::enable_tracking(bool enable, bool record_sites) {
+    tracking_enabled_.store(enable, std::memory_order_relaxed);
+    record_sites_.store(enable && record_sites, std::memory_order_relaxed);
     if (enable) {
-        allocations_.clear();
-        total_allocated_ = 0;
-        peak_usage_ = 0;
+        reset_stats();
     }
 }
 
 void MemoryTracker::track_allocation(void* ptr, size_t size, const char* file, int line) {
-    if (!tracking_enabled_ || !ptr) return;
+    if (!is_enabled() || !ptr) return;
+    
+    ThreadCounters& counters = thread_counters();
+    add_relaxed(counters.bytes, (int64_t)size);
+    add_relaxed(counters.count, 1);
     
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
-    AllocationInfo info;
-    info.size = size;
-    info.timestamp = std::chrono::steady_clock::now();
-    info.file = file ? file : "unknown";
-    info.line = line;
-    allocations_[ptr] = info;
+    counters.unflushed += (int64_t)size;
+    if (counters.unflushed >= PEAK_GRANULE) {
+        int64_t usage = flushed_usage_.fetch_add(counters.unflushed, std::memory_order_relaxed) + counters.unflushed;
+        counters.unflushed = 0;
+        int64_t peak = peak_usage_.load(std::memory_order_relaxed);
+        while (usage > peak && !peak_usage_.compare_exchange_weak(peak, usage, std::memory_order_relaxed)) {
+        }
+    }
     
-    total_allocated_ += size;
-    if (total_allocated_ > peak_usage_) {
-        peak_usage_ = total_allocated_;
+    if (record_sites_.load(std::memory_order_relaxed)) {
+        SiteShard& shard = site_shard(ptr);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.allocations[ptr] = AllocationInfo{ size, std::chrono::steady_clock::now(), file ? file : "unknown", line };
     }
 }
 
-void MemoryTracker::track_deallocation(void* ptr) {
-    if (!tracking_enabled_ || !ptr) return;
+void MemoryTracker::track_deallocation(void* ptr, size_t size) {
+    if (!is_enabled() || !ptr) return;
     
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
-    auto it = allocations_.find(ptr);
-    if (it != allocations_.end()) {
-        total_allocated_ -= it->second.size;
-        allocations_.erase(it);
+    ThreadCounters& counters = thread_counters();
+    add_relaxed(counters.bytes, -(int64_t)size);
+    add_relaxed(counters.count, -1);
+    
+    counters.unflushed -= (int64_t)size;
+    if (counters.unflushed <= -PEAK_GRANULE) {
+        flushed_usage_.fetch_add(counters.unflushed, std::memory_order_relaxed);
+        counters.unflushed = 0;
+    }
+    
+    if (record_sites_.load(std::memory_order_relaxed)) {
+        SiteShard& shard = site_shard(ptr);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.allocations.erase(ptr);
     }
 }
 
 size_t MemoryTracker::get_current_usage() {
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
-    return total_allocated_;
+    int64_t bytes, count;
+    sum_counters(bytes, count);
+    return (size_t)std::max<int64_t>(0, bytes - baseline_usage_.load(std::memory_order_relaxed));
 }
 
 size_t MemoryTracker::get_peak_usage() {
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
-    return peak_usage_;
+    int64_t peak = peak_usage_.load(std::memory_order_relaxed) - baseline_usage_.load(std::memory_order_relaxed);
+    return std::max((size_t)std::max<int64_t>(0, peak), get_current_usage());
 }
 
 size_t MemoryTracker::get_allocation_count() {
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
-    return allocations_.size();
+    int64_t bytes, count;
+    sum_counters(bytes, count);
+    return (size_t)std::max<int64_t>(0, count - baseline_count_.load(std::memory_order_relaxed));
 }
 
 void MemoryTracker::print_leak_report() {
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
+    size_t leaked = get_current_usage();
+    size_t count = get_allocation_count();
+    size_t peak = get_peak_usage();
     
-    if (allocations_.empty()) {
+    if (count == 0) {
         std::cout << "✅ No memory leaks detected!" << std::endl;
-        std::cout << "Peak memory usage: " << peak_usage_ << " bytes" << std::endl;
+        std::cout << "Peak memory usage: " << peak << " bytes" << std::endl;
         return;
     }
     
     std::cout << "🚨 MEMORY LEAKS DETECTED!" << std::endl;
-    std::cout << "Total leaked: " << total_allocated_ << " bytes in " << allocations_.size() << " allocations" << std::endl;
-    std::cout << "Peak usage: " << peak_usage_ << " bytes" << std::endl;
+    std::cout << "Total leaked: " << leaked << " bytes in " << count << " allocations" << std::endl;
+    std::cout << "Peak usage: " << peak << " bytes" << std::endl;
+    if (!record_sites_.load(std::memory_order_relaxed)) return;
     std::cout << "\nLeak details:" << std::endl;
     
     auto now = std::chrono::steady_clock::now();
-    for (const auto& [ptr, info] : allocations_) {
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - info.timestamp);
-        std::cout << "  - " << info.size << " bytes at " << ptr 
-                  << " (allocated " << duration.count() << "ms ago)"
-                  << " [" << info.file << ":" << info.line << "]" << std::endl;
+    for (SiteShard& shard : site_shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& [ptr, info] : shard.allocations) {
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - info.timestamp);
+            std::cout << "  - " << info.size << " bytes at " << ptr 
+                      << " (allocated " << duration.count() << "ms ago)"
+                      << " [" << info.file << ":" << info.line << "]" << std::endl;
+        }
     }
 }
 
 void MemoryTracker::reset_stats() {
-    std::lock_guard<std::mutex> lock(tracker_mutex_);
-    allocations_.clear();
-    total_allocated_ = 0;
-    peak_usage_ = 0;
-}
-
-// MemoryPool implementation
-void* MemoryPool::allocate(size_t size) {
-    std::lock_guard<std::mutex> lock(pool_mutex_);
-    
-    // Find a block with enough space
-    for (auto& block : blocks_) {
-        if (block->offset + size <= block->size) {
-            void* ptr = block->memory.get() + block->offset;
-            block->offset += size;
-            return ptr;
+    // The counters belong to their threads, a reset moves the baseline instead
+    int64_t bytes, count;
+    sum_counters(bytes, count);
+    baseline_usage_.store(bytes, std::memory_order_relaxed);
+    baseline_count_.store(count, std::memory_order_relaxed);
+    peak_usage_.store(bytes, std::memory_order_relaxed);
+    flushed_usage_.store(bytes, std::memory_order_relaxed);
+    for (SiteShard& shard : site_shards_) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.allocations.clear();
+    }
+}
+
+// MemoryArena implementation
+MemoryArena::Block::Block(size_t sz) : memory(std::make_unique<char[]>(sz)), size(sz), offset(0) {
+    MemoryTracker::track_allocation(memory.get(), size, __FILE__, __LINE__);
+}
+
+MemoryArena::Block::~Block() {
+    MemoryTracker::track_deallocation(memory.get(), size);
+}
+
+void* MemoryArena::allocate(size_t size, size_t align) {
+    // Use the current block, then the free blocks after it, resetting each one entered
+    while (current_ < blocks_.size()) {
+        Block& block = *blocks_[current_];
+        uintptr_t base = reinterpret_cast<uintptr_t>(block.memory.get());
+        size_t start = ((base + block.offset + align - 1) & ~(uintptr_t)(align - 1)) - base;
+        if (start + size <= block.size) {
+            block.offset = start + size;
+            return block.memory.get() + start;
         }
+        if (current_ + 1 == blocks_.size()) break;
+        blocks_[++current_]->offset = 0;
     }
     
-    // Need a new block
-    size_t block_size = std::max(size, DEFAULT_BLOCK_SIZE);
-    auto new_block = std::make_unique<Block>(block_size);
-    void* ptr = new_block->memory.get();
-    new_block->offset = size;
-    blocks_.push_back(std::move(new_block));
+    // Need a new block, make_unique<char[]> memory is aligned for any fundamental type
+    size_t block_size = std::max(size + align, block_size_);
+    blocks_.push_back(std::make_unique<Block>(block_size));
+    current_ = blocks_.size() - 1;
+    Block& block = *blocks_.back();
+    uintptr_t base = reinterpret_cast<uintptr_t>(block.memory.get());
+    size_t start = ((base + align - 1) & ~(uintptr_t)(align - 1)) - base;
+    block.offset = start + size;
+    return block.memory.get() + start;
+}
+
+MemoryArena::Mark MemoryArena::mark() const {
+    if (blocks_.empty()) return Mark{0, 0};
+    return Mark{current_, blocks_[current_]->offset};
+}
+
+void MemoryArena::rewind(const Mark& mark) {
+    if (mark.block >= blocks_.size()) return;
+    current_ = mark.block;
+    blocks_[current_]->offset = mark.offset;
+}
+
+void MemoryArena::trim(size_t max_bytes) {
+    size_t kept = 0;
+    size_t n_keep = 0;
+    while (n_keep < blocks_.size() && kept + blocks_[n_keep]->size <= max_bytes) {
+        kept += blocks_[n_keep]->size;
+        n_keep++;
+    }
+    // Blocks in use are never given back
+    n_keep = std::max(n_keep, std::min(current_ + 1, blocks_.size()));
+    blocks_.resize(n_keep);
+}
+
+size_t MemoryArena::capacity() const {
+    size_t total = 0;
+    for (const auto& block : blocks_) {
+        total += block->size;
+    }
+    return total;
+}
+
+// ArenaPool implementation
+ArenaPool& ArenaPool::shared() {
+    // Never destroyed, tasks may release arenas during static destruction
+    static ArenaPool* pool = new ArenaPool();
+    return *pool;
+}
+
+MemoryArena* ArenaPool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty()) {
+            MemoryArena* arena = free_.back().release();
+            free_.pop_back();
+            return arena;
+        }
+    }
+    return new MemoryArena();
+}
+
+void ArenaPool::release(MemoryArena* arena) {
+    if (!arena) return;
+    arena->reset();
+    arena->trim(MAX_POOLED_BYTES);
     
-    return ptr;
+    std::unique_ptr<MemoryArena> owned(arena);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.size() < MAX_POOLED) {
+        free_.push_back(std::move(owned));
+    }
+}
+
+size_t ArenaPool::pooled() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return free_.size();
+}
+
+// BatchPool implementation
+BatchLease::~BatchLease() {
+    if (pool_ && batch_) pool_->give_back(std::move(batch_));
+}
+
+std::unique_ptr<BatchRAII> BatchPool::create() {
+    auto batch = std::make_unique<BatchRAII>(n_tokens_, 0, n_seq_max_);
+    // Touch every buffer now, a large prompt would otherwise fault its pages in on the hot path
+    llama_batch& b = **batch;
+    memset(b.token, 0, sizeof(llama_token) * n_tokens_);
+    memset(b.pos, 0, sizeof(llama_pos) * n_tokens_);
+    memset(b.n_seq_id, 0, sizeof(int32_t) * n_tokens_);
+    memset(b.logits, 0, sizeof(int8_t) * n_tokens_);
+    for (int i = 0; i < n_tokens_; i++) {
+        memset(b.seq_id[i], 0, sizeof(llama_seq_id) * n_seq_max_);
+    }
+    return batch;
+}
+
+void BatchPool::init(int n_tokens, int n_seq_max, size_t n_prealloc) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    n_tokens_ = std::max(n_tokens, 1);
+    n_seq_max_ = std::max(n_seq_max, 1);
+    free_.clear();
+    for (size_t i = 0; i < n_prealloc; i++) {
+        free_.push_back(create());
+    }
 }
 
-void MemoryPool::reset() {
-    std::lock_guard<std::mutex> lock(pool_mutex_);
-    for (auto& block : blocks_) {
-        block->offset = 0;
+BatchLease BatchPool::lease() {
+    std::unique_ptr<BatchRAII> batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty()) {
+            batch = std::move(free_.back());
+            free_.pop_back();
+        }
     }
+    if (!batch) {
+        batch = create();
+    }
+    (*batch)->n_tokens = 0;
+    return BatchLease(this, std::move(batch));
 }
 
-MemoryPool::~MemoryPool() {
-    // Blocks will be automatically cleaned up by unique_ptr
+void BatchPool::give_back(std::unique_ptr<BatchRAII> batch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.size() < MAX_POOLED) {
+        free_.push_back(std::move(batch));
+    }
 }
 
-// Tracked allocation functions
+// Tracked allocation functions, the size is kept in a header in front of the allocation
 #ifdef DEBUG_MEMORY
 void* tracked_malloc(size_t size, const char* file, int line) {
-    void* ptr = malloc(size);
+    char* base = static_cast<char*>(malloc(size + sizeof(std::max_align_t)));
+    if (!base) return nullptr;
+    *reinterpret_cast<size_t*>(base) = size;
+    void* ptr = base + sizeof(std::max_align_t);
     MemoryTracker::track_allocation(ptr, size, file, line);
     return ptr;
 }
 
 void tracked_free(void* ptr, const char* file, int line) {
-    MemoryTracker::track_deallocation(ptr);
-    free(ptr);
+    if (!ptr) return;
+    char* base = static_cast<char*>(ptr) - sizeof(std::max_align_t);
+    MemoryTracker::track_deallocation(ptr, *reinterpret_cast<size_t*>(base));
+    free(base);
 }
 #endif
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <jni.h>
+#include <atomic>
+#include <cstddef>
 #include <memory>
 #include <vector>
 #include <mutex>
@@ -41,6 +43,51 @@ public:
     llama_batch* operator->() { return &batch_; }
 };
 
+class BatchPool;
+
+// Batch of a BatchPool, returned to the pool when the lease ends
+class BatchLease {
+private:
+    BatchPool* pool_;
+    std::unique_ptr<BatchRAII> batch_;
+
+public:
+    BatchLease(BatchPool* pool, std::unique_ptr<BatchRAII> batch) : pool_(pool), batch_(std::move(batch)) {}
+    BatchLease(BatchLease&& other) noexcept = default;
+    ~BatchLease();
+
+    llama_batch* get() { return batch_->get(); }
+    llama_batch& operator*() { return **batch_; }
+    llama_batch* operator->() { return batch_->get(); }
+
+    BatchLease(const BatchLease&) = delete;
+    BatchLease& operator=(const BatchLease&) = delete;
+    BatchLease& operator=(BatchLease&&) = delete;
+};
+
+// Batches of one size kept for reuse, so that decoding calls neither allocate nor fault in
+// fresh pages. Leases come back empty (n_tokens 0), their contents are not cleared.
+class BatchPool {
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<BatchRAII>> free_;
+    int n_tokens_ = 0;
+    int n_seq_max_ = 1;
+    static const size_t MAX_POOLED = 4;
+
+    std::unique_ptr<BatchRAII> create();
+
+public:
+    // Size the batches and allocate n_prealloc of them up front, before the first lease
+    void init(int n_tokens, int n_seq_max, size_t n_prealloc = 1);
+
+    // Tokens a leased batch holds
+    int capacity() const { return n_tokens_; }
+
+    BatchLease lease();
+    void give_back(std::unique_ptr<BatchRAII> batch);
+};
+
 // RAII wrapper for JNI local reference management
 class JNILocalFrameRAII {
 private:
@@ -69,26 +116,42 @@ public:
     bool isValid() const { return pushed_; }
 };
 
-// Memory usage tracking for leak detection
+// Memory usage tracking, cheap enough to stay enabled: every thread counts into its own
+// counters and readers sum them, so tracking an allocation never takes a lock or contends
+// on a shared cache line. The peak is advanced in steps of PEAK_GRANULE per thread.
+// Per-allocation records for leak reports are only kept with record_sites, in sharded maps.
 class MemoryTracker {
 private:
     struct AllocationInfo {
         size_t size;
         std::chrono::steady_clock::time_point timestamp;
-        std::string file;
+        const char* file;
         int line;
     };
-    
-    static std::mutex tracker_mutex_;
-    static std::unordered_map<void*, AllocationInfo> allocations_;
-    static size_t total_allocated_;
-    static size_t peak_usage_;
-    static bool tracking_enabled_;
+
+    struct SiteShard {
+        std::mutex mutex;
+        std::unordered_map<void*, AllocationInfo> allocations;
+    };
+
+    static const size_t SITE_SHARDS = 16;
+    static const int64_t PEAK_GRANULE = 64 * 1024;
+
+    static std::atomic<bool> tracking_enabled_;
+    static std::atomic<bool> record_sites_;
+    static std::atomic<int64_t> flushed_usage_;  // Sum of the per-thread granules, drives the peak
+    static std::atomic<int64_t> peak_usage_;
+    static std::atomic<int64_t> baseline_usage_;  // Counter sums at the last reset
+    static std::atomic<int64_t> baseline_count_;
+    static SiteShard site_shards_[SITE_SHARDS];
+
+    static SiteShard& site_shard(void* ptr);
 
 public:
-    static void enable_tracking(bool enable = true);
+    static void enable_tracking(bool enable = true, bool record_sites = false);
+    static bool is_enabled() { return tracking_enabled_.load(std::memory_order_relaxed); }
     static void track_allocation(void* ptr, size_t size, const char* file, int line);
-    static void track_deallocation(void* ptr);
+    static void track_deallocation(void* ptr, size_t size);
     static size_t get_current_usage();
     static size_t get_peak_usage();
     static size_t get_allocation_count();
@@ -96,29 +159,127 @@ public:
     static void reset_stats();
 };
 
-// Memory pool for frequent small allocations
-class MemoryPool {
+// Bump allocator for short-lived allocations with a common lifetime, e.g. everything
+// of one request. Not thread-safe, an arena has one owner at a time. Memory is only
+// given back by rewind and reset, which keep the blocks for the next use.
+class MemoryArena {
 private:
     struct Block {
         std::unique_ptr<char[]> memory;
         size_t size;
         size_t offset;
         
-        Block(size_t sz) : memory(std::make_unique<char[]>(sz)), size(sz), offset(0) {}
+        Block(size_t sz);
+        ~Block();
     };
     
     std::vector<std::unique_ptr<Block>> blocks_;
-    std::mutex pool_mutex_;
-    static const size_t DEFAULT_BLOCK_SIZE = 64 * 1024; // 64KB blocks
+    size_t current_ = 0;  // Blocks after the current one are free, their offsets are stale
+    size_t block_size_;
     
 public:
-    void* allocate(size_t size);
-    void reset(); // Reset all blocks but keep memory allocated
-    ~MemoryPool();
+    static const size_t DEFAULT_BLOCK_SIZE = 64 * 1024; // 64KB blocks
+
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    explicit MemoryArena(size_t block_size = DEFAULT_BLOCK_SIZE) : block_size_(block_size) {}
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    template<typename T>
+    T* allocate_array(size_t n) { return static_cast<T*>(allocate(n * sizeof(T), alignof(T))); }
+
+    // Position to rewind to, for scratch allocations of a scope
+    Mark mark() const;
+    void rewind(const Mark& mark);
+
+    // Free everything in O(1), the blocks stay allocated
+    void reset() { rewind(Mark{0, 0}); }
+
+    // Give back blocks beyond max_bytes, for arenas that grew on an unusually large request
+    void trim(size_t max_bytes);
+
+    size_t capacity() const;
+
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+};
+
+// Rewinds an arena to where it was on construction
+class ArenaScope {
+private:
+    MemoryArena& arena_;
+    MemoryArena::Mark mark_;
+
+public:
+    explicit ArenaScope(MemoryArena& arena) : arena_(arena), mark_(arena.mark()) {}
+    ~ArenaScope() { arena_.rewind(mark_); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+// STL allocator on an arena, deallocation is a no-op
+template<typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    MemoryArena* arena;
+
+    explicit ArenaAllocator(MemoryArena& a) noexcept : arena(&a) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t n) { return arena->allocate_array<T>(n); }
+    void deallocate(T*, size_t) noexcept {}
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena == other.arena; }
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const noexcept { return arena != other.arena; }
+};
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// Arenas handed out to requests, warm blocks are reused instead of allocated per request
+class ArenaPool {
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<MemoryArena>> free_;
+    static const size_t MAX_POOLED = 32;
+    static const size_t MAX_POOLED_BYTES = 1024 * 1024; // Larger arenas are trimmed on release
+
+public:
+    static ArenaPool& shared();
+
+    MemoryArena* acquire();
+    void release(MemoryArena* arena);
+    size_t pooled();
+};
+
+// Arena of the shared pool for the lifetime of its owner
+class PooledArena {
+private:
+    MemoryArena* arena_;
+
+public:
+    PooledArena() : arena_(ArenaPool::shared().acquire()) {}
+    ~PooledArena() { ArenaPool::shared().release(arena_); }
+
+    MemoryArena& operator*() const { return *arena_; }
+    MemoryArena* get() const { return arena_; }
+
+    PooledArena(const PooledArena&) = delete;
+    PooledArena& operator=(const PooledArena&) = delete;
 };
 
-// Global memory pool instance
-extern thread_local MemoryPool g_memory_pool;
+// Per-thread scratch arena for JNI calls, used under an ArenaScope
+extern thread_local MemoryArena g_scratch_arena;
 
 // Macros for tracked allocation
 #ifdef DEBUG_MEMORY
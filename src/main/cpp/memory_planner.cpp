@@ -0,0 +1,136 @@
+#include "memory_planner.h"
+#include <algorithm>
+#include <vector>
+
+// Contexts are planned in steps of the KV cache padding llama.cpp applies anyway
+static const uint32_t CTX_STEP = 256;
+
+static size_t row_bytes(ggml_type type, int64_t n) {
+	int64_t block = ggml_blck_size(type);
+	return (size_t)((n + block - 1) / block) * ggml_type_size(type);
+}
+
+ModelShape ModelShape::of(const llama_model* model) {
+	ModelShape shape;
+	shape.model_bytes = llama_model_size(model);
+	shape.n_embd = llama_model_n_embd(model);
+	shape.n_head = llama_model_n_head(model);
+	shape.n_embd_k_gqa = llama_model_n_head_kv(model) * (shape.n_embd / std::max<int64_t>(1, shape.n_head));
+	shape.n_embd_v_gqa = shape.n_embd_k_gqa;
+	shape.n_layer = llama_model_n_layer(model);
+	shape.n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+	shape.n_ctx_train = (uint32_t)std::max(0, llama_model_n_ctx_train(model));
+	shape.recurrent = llama_model_is_recurrent(model);
+	return shape;
+}
+
+size_t MemoryPlanner::kv_bytes(const ModelShape& shape, uint32_t n_ctx, ggml_type type_k, ggml_type type_v) {
+	// Recurrent state does not grow with the context
+	if (shape.recurrent) return 0;
+
+	size_t per_cell = (size_t)shape.n_layer * (row_bytes(type_k, shape.n_embd_k_gqa) + row_bytes(type_v, shape.n_embd_v_gqa));
+	return per_cell * n_ctx;
+}
+
+size_t MemoryPlanner::compute_bytes(const ModelShape& shape, uint32_t n_ctx, const MemoryPlanRequest& request) {
+	const size_t n_vocab = (size_t)shape.n_vocab;
+	const size_t n_embd = (size_t)shape.n_embd;
+
+	// Logits of a whole micro-batch and a generous allowance for the activations of one layer
+	size_t bytes = (size_t)request.n_ubatch * (n_vocab + 16 * n_embd) * sizeof(float);
+	if (!request.flash_attn) {
+		// Without flash attention the attention scores of one layer are materialized
+		bytes += (size_t)request.n_ubatch * n_ctx * (size_t)shape.n_head * sizeof(float);
+	}
+	return bytes;
+}
+
+MemoryPlan MemoryPlanner::plan(const llama_model* model, const MemoryPlanRequest& request) {
+	return plan(ModelShape::of(model), request);
+}
+
+MemoryPlan MemoryPlanner::plan(const ModelShape& shape, const MemoryPlanRequest& request) {
+	MemoryPlan plan;
+	plan.model_bytes = shape.model_bytes;
+	plan.budget_bytes = request.budget;
+
+	auto finish = [&](MemoryPlan& p) {
+		p.kv_bytes = kv_bytes(shape, p.n_ctx, p.type_k, p.type_v);
+		p.compute_bytes = compute_bytes(shape, p.n_ctx, request);
+		p.fits = p.n_ctx > 0 && (request.budget == 0 || p.total_bytes() <= request.budget);
+	};
+
+	if (request.budget == 0) {
+		plan.n_ctx = request.n_ctx;
+		plan.type_k = request.type_k;
+		plan.type_v = request.type_v;
+		finish(plan);
+		return plan;
+	}
+
+	// Every sequence can use up to the training context
+	uint32_t target = request.n_ctx > 0 ? request.n_ctx : std::max(shape.n_ctx_train, CTX_STEP) * request.n_seq;
+
+	std::vector<std::pair<ggml_type, ggml_type>> candidates;
+	if (request.fixed_types) {
+		candidates.emplace_back(request.type_k, request.type_v);
+	} else {
+		// llama.cpp only supports a quantized V cache with flash attention
+		candidates.emplace_back(GGML_TYPE_F16, GGML_TYPE_F16);
+		candidates.emplace_back(GGML_TYPE_Q8_0, request.flash_attn ? GGML_TYPE_Q8_0 : GGML_TYPE_F16);
+		candidates.emplace_back(GGML_TYPE_Q4_0, request.flash_attn ? GGML_TYPE_Q4_0 : GGML_TYPE_F16);
+	}
+
+	// Memory is linear in the context: fixed weights and buffers plus a cost per cell
+	size_t fixed = plan.model_bytes + compute_bytes(shape, 0, request);
+	size_t avail = request.budget > fixed ? request.budget - fixed : 0;
+	size_t score_bytes = request.flash_attn ? 0 : (size_t)request.n_ubatch * shape.n_head * sizeof(float);
+
+	// The best quality types reaching the target, otherwise the types giving the largest context
+	bool found = false;
+	for (const auto& types : candidates) {
+		size_t per_cell = kv_bytes(shape, 1, types.first, types.second) + score_bytes;
+		size_t n_fit = per_cell > 0 ? avail / per_cell : target;
+		uint32_t n_ctx = n_fit >= target ? target : (uint32_t)(n_fit / CTX_STEP * CTX_STEP);
+
+		if (!found || n_ctx > plan.n_ctx) {
+			plan.n_ctx = n_ctx;
+			plan.type_k = types.first;
+			plan.type_v = types.second;
+			found = true;
+		}
+		if (n_ctx >= target) break;
+	}
+
+	finish(plan);
+	return plan;
+}
+
+bool MemoryPlanner::parse_cache_type(const std::string& name, ggml_type& type) {
+	static const ggml_type types[] = {
+		GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0,
+		GGML_TYPE_Q4_1, GGML_TYPE_IQ4_NL, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1,
+	};
+	for (ggml_type candidate : types) {
+		if (name == ggml_type_name(candidate)) {
+			type = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+std::string MemoryPlan::to_json() const {
+	std::string json = "{";
+	json += "\"fits\":" + std::string(fits ? "true" : "false") + ",";
+	json += "\"n_ctx\":" + std::to_string(n_ctx) + ",";
+	json += "\"type_k\":\"" + std::string(ggml_type_name(type_k)) + "\",";
+	json += "\"type_v\":\"" + std::string(ggml_type_name(type_v)) + "\",";
+	json += "\"model_bytes\":" + std::to_string(model_bytes) + ",";
+	json += "\"kv_bytes\":" + std::to_string(kv_bytes) + ",";
+	json += "\"compute_bytes\":" + std::to_string(compute_bytes) + ",";
+	json += "\"total_bytes\":" + std::to_string(total_bytes()) + ",";
+	json += "\"budget_bytes\":" + std::to_string(budget_bytes);
+	json += "}";
+	return json;
+}
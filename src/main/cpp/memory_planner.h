@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include "llama.h"
+
+// What the planner may choose from, filled from the model arguments
+struct MemoryPlanRequest {
+	size_t budget = 0;          // Bytes for weights, KV cache and compute buffers, 0 to only report
+	uint32_t n_ctx = 0;         // Requested context size, 0 for the largest that fits
+	uint32_t n_seq = 1;
+	uint32_t n_ubatch = 512;
+	bool flash_attn = false;
+	bool fixed_types = false;   // Cache types were given explicitly and are not planned
+	ggml_type type_k = GGML_TYPE_F16;
+	ggml_type type_v = GGML_TYPE_F16;
+};
+
+// The dimensions the planner sizes a context from, of a loaded model or read from the header of its file
+struct ModelShape {
+	size_t model_bytes = 0;
+	int64_t n_embd = 0;
+	int64_t n_head = 0;
+	int64_t n_embd_k_gqa = 0;   // K and V widths of one layer and cell over all KV heads
+	int64_t n_embd_v_gqa = 0;
+	int64_t n_layer = 0;
+	int64_t n_vocab = 0;
+	uint32_t n_ctx_train = 0;
+	bool recurrent = false;
+
+	static ModelShape of(const llama_model* model);
+};
+
+struct MemoryPlan {
+	bool fits = false;
+	uint32_t n_ctx = 0;
+	ggml_type type_k = GGML_TYPE_F16;
+	ggml_type type_v = GGML_TYPE_F16;
+	size_t model_bytes = 0;
+	size_t kv_bytes = 0;
+	size_t compute_bytes = 0;   // Estimate, the graph is only allocated with the context
+	size_t budget_bytes = 0;
+
+	size_t total_bytes() const { return model_bytes + kv_bytes + compute_bytes; }
+	std::string to_json() const;
+};
+
+// Sizes a context before it is allocated. The KV cache is computed from the layer and head
+// counts of the model, compute buffers are a rough upper estimate (logits, activations and,
+// without flash attention, the attention scores). Sliding window layers are sized like full ones.
+class MemoryPlanner {
+public:
+	// Largest context and best cache types within the budget, or the requested ones without a budget.
+	// Cache types are tried from F16 down to Q4_0, V is only quantized with flash attention.
+	static MemoryPlan plan(const llama_model* model, const MemoryPlanRequest& request);
+	static MemoryPlan plan(const ModelShape& shape, const MemoryPlanRequest& request);
+
+	// Bytes of the KV cache for n_ctx cells of all sequences
+	static size_t kv_bytes(const ModelShape& shape, uint32_t n_ctx, ggml_type type_k, ggml_type type_v);
+
+	// Parse a cache type name like "q8_0", returns false if it is unknown
+	static bool parse_cache_type(const std::string& name, ggml_type& type);
+
+private:
+	static size_t compute_bytes(const ModelShape& shape, uint32_t n_ctx, const MemoryPlanRequest& request);
+};
@@ -1,7 +1,10 @@
 #include "model_info_manager.h"
 #include "jni_utils.h"
 #include "jni_error_handler.h"
+#include "gguf_inspector.h"
+#include <algorithm>
 #include <string>
+#include <vector>
 
 // Model information functions
 
@@ -230,8 +233,110 @@ jint ModelInfoManager::getTokenAttributes(JNIEnv* env, jobject obj, jint token)
 	JNI_CATCH_RET(env, 0)
 }
 
+jobject ModelInfoManager::exportVocabulary(JNIEnv* env, jobject obj) {
+	JNI_TRY(env)
+
+	const struct llama_vocab* vocab = getVocab(env, obj);
+	validateVocab(env, vocab);
+	if (env->ExceptionCheck()) {
+		return nullptr;
+	}
+
+	const int32_t n_tokens = llama_vocab_n_tokens(vocab);
+	std::vector<jbyte> bytes;
+	std::vector<jint> offsets(n_tokens + 1);
+	std::vector<jfloat> scores(n_tokens);
+	std::vector<jint> attributes(n_tokens);
+	bytes.reserve(static_cast<size_t>(n_tokens) * 8);
+
+	std::vector<char> piece(64);
+	for (int32_t token = 0; token < n_tokens; token++) {
+		offsets[token] = static_cast<jint>(bytes.size());
+		// Render special tokens as their text too, the same bytes the detokenizer emits for them
+		int32_t n = llama_token_to_piece(vocab, token, piece.data(), (int32_t)piece.size(), 0, true);
+		if (n < 0) {
+			piece.resize(-n);
+			n = llama_token_to_piece(vocab, token, piece.data(), (int32_t)piece.size(), 0, true);
+		}
+		if (n > 0) {
+			bytes.insert(bytes.end(), piece.data(), piece.data() + n);
+		}
+		scores[token] = llama_vocab_get_score(vocab, token);
+		attributes[token] = static_cast<jint>(llama_vocab_get_attr(vocab, token));
+	}
+	offsets[n_tokens] = static_cast<jint>(bytes.size());
+
+	jbyteArray bytes_array = env->NewByteArray((jsize)bytes.size());
+	jintArray offsets_array = env->NewIntArray((jsize)offsets.size());
+	jfloatArray scores_array = env->NewFloatArray(n_tokens);
+	jintArray attributes_array = env->NewIntArray(n_tokens);
+	if (!bytes_array || !offsets_array || !scores_array || !attributes_array) return nullptr;
+	env->SetByteArrayRegion(bytes_array, 0, (jsize)bytes.size(), bytes.data());
+	env->SetIntArrayRegion(offsets_array, 0, (jsize)offsets.size(), offsets.data());
+	env->SetFloatArrayRegion(scores_array, 0, n_tokens, scores.data());
+	env->SetIntArrayRegion(attributes_array, 0, n_tokens, attributes.data());
+
+	const JniCache& jni = JniUtils::cache();
+	if (!jni.vocabulary_init) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to find Vocabulary class");
+		return nullptr;
+	}
+	return env->NewObject(jni.vocabulary_class, jni.vocabulary_init, bytes_array, offsets_array, scores_array,
+		attributes_array);
+
+	JNI_CATCH_RET(env, nullptr)
+}
+
 // Special token functions
 
+jstring ModelInfoManager::inspectFile(JNIEnv* env, jclass cls, jstring path, jboolean includeTensors) {
+	JNI_TRY(env)
+
+	if (!path) {
+		JNIErrorHandler::throw_illegal_argument(env, "Path must not be null");
+		return nullptr;
+	}
+	GGUFSummary summary;
+	std::string error;
+	if (!GGUFInspector::inspect(JniUtils::jstring_to_string(env, path), summary, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return nullptr;
+	}
+	return JniUtils::string_to_jstring(env, summary.to_json(includeTensors));
+
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jstring ModelInfoManager::estimateFileMemory(JNIEnv* env, jclass cls, jstring path, jint nCtx, jstring typeK,
+		jstring typeV, jboolean flashAttn) {
+	JNI_TRY(env)
+
+	if (!path || !typeK || !typeV) {
+		JNIErrorHandler::throw_illegal_argument(env, "Path and cache types must not be null");
+		return nullptr;
+	}
+	MemoryPlanRequest request;
+	request.n_ctx = (uint32_t)std::max(0, (int)nCtx);
+	request.flash_attn = flashAttn;
+	const std::string type_k = JniUtils::jstring_to_string(env, typeK);
+	const std::string type_v = JniUtils::jstring_to_string(env, typeV);
+	if (!MemoryPlanner::parse_cache_type(type_k, request.type_k) ||
+			!MemoryPlanner::parse_cache_type(type_v, request.type_v)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown cache type: " + type_k + ", " + type_v);
+		return nullptr;
+	}
+
+	GGUFSummary summary;
+	std::string error;
+	if (!GGUFInspector::inspect(JniUtils::jstring_to_string(env, path), summary, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return nullptr;
+	}
+	return JniUtils::string_to_jstring(env, MemoryPlanner::plan(summary.shape, request).to_json());
+
+	JNI_CATCH_RET(env, nullptr)
+}
+
 jint ModelInfoManager::getBosToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 
@@ -356,7 +461,7 @@ jboolean ModelInfoManager::isControlToken(JNIEnv* env, jobject obj, jint token)
 
 const struct llama_model* ModelInfoManager::getModel(JNIEnv* env, jobject obj) {
 	jclass cls = env->GetObjectClass(obj);
-	jfieldID fieldId = env->GetFieldID(cls, "ctx", "J");
+	jfieldID fieldId = JniUtils::ctx_field(env, cls);
 	if (!fieldId) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get context field");
 		return nullptr;
@@ -24,6 +24,15 @@ public:
 	static jstring getTokenText(JNIEnv* env, jobject obj, jint token);
 	static jfloat getTokenScore(JNIEnv* env, jobject obj, jint token);
 	static jint getTokenAttributes(JNIEnv* env, jobject obj, jint token);
+	// The decoded bytes, scores and attributes of every token in one Vocabulary object, the bytes
+	// packed one token after another with n + 1 offsets, instead of one JNI call per token
+	static jobject exportVocabulary(JNIEnv* env, jobject obj);
+	
+	// Header of a GGUF file as JSON, read without loading the model
+	static jstring inspectFile(JNIEnv* env, jclass cls, jstring path, jboolean includeTensors);
+	// Memory plan of a context of the model in a GGUF file, from its header
+	static jstring estimateFileMemory(JNIEnv* env, jclass cls, jstring path, jint nCtx, jstring typeK,
+		jstring typeV, jboolean flashAttn);
 	
 	// Special token functions
 	static jint getBosToken(JNIEnv* env, jobject obj);
@@ -1,104 +1,197 @@
 #include "model_loader_manager.h"
+#include "model_manager.h"
 #include "jni_utils.h"
+#include "jni_logger.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
+#include "server_table.h"
 #include <vector>
 #include <string>
 #include <mutex>
 #include <unordered_map>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 
-// These are defined in jllama.cpp but we need access to them
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
+// A model load running on its own thread. Progress comes from llama.cpp's progress callback,
+// which also aborts the load once the job is cancelled.
+struct ModelLoadJob {
+	ModelLoadOptions options;
+	std::thread thread;
+	std::atomic<float> progress{0.0f};
+	std::atomic<bool> cancelled{false};
 
-static LlamaServer* get_model_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
+	std::mutex mutex;
+	std::condition_variable done_cv;
+	bool done = false;
+	std::unique_ptr<LlamaServer> server;
+	ModelLoadError error;
 
-jlong ModelLoaderManager::loadModelFromSplits(JNIEnv* env, jclass cls, jobjectArray paths, jobject params) {
-	JNI_TRY(env)
-	
-	if (!paths) {
-		JNIErrorHandler::throw_illegal_argument(env, "Paths array cannot be null");
-		return 0;
+	// An abandoned job may be freed by its own thread or at exit
+	~ModelLoadJob() {
+		if (thread.joinable()) thread.detach();
 	}
-	
-	// Get array length
-	jsize pathCount = env->GetArrayLength(paths);
-	if (pathCount == 0) {
-		JNIErrorHandler::throw_illegal_argument(env, "Paths array cannot be empty");
-		return 0;
+};
+
+static std::mutex g_load_jobs_mutex;
+static std::unordered_map<jlong, std::shared_ptr<ModelLoadJob>> g_load_jobs;
+
+static std::shared_ptr<ModelLoadJob> get_load_job(jlong handle) {
+	std::lock_guard<std::mutex> lock(g_load_jobs_mutex);
+	auto it = g_load_jobs.find(handle);
+	return (it != g_load_jobs.end()) ? it->second : nullptr;
+}
+
+static bool load_progress(float progress, void* user_data) {
+	ModelLoadJob* job = static_cast<ModelLoadJob*>(user_data);
+	job->progress = progress;
+	return !job->cancelled;
+}
+
+// Parse the paths and arguments, paths default to --model
+static bool parse_load_options(JNIEnv* env, jobjectArray paths, jobjectArray args, ModelLoadOptions& options) {
+	if (!args) {
+		JNIErrorHandler::throw_illegal_argument(env, "Arguments cannot be null");
+		return false;
 	}
 	
-	// Convert Java string array to C++ string vector
-	std::vector<std::string> pathStrings;
-	std::vector<const char*> pathPtrs;
-	pathStrings.reserve(pathCount);
-	pathPtrs.reserve(pathCount);
-	
+	jsize pathCount = paths ? env->GetArrayLength(paths) : 0;
 	for (jsize i = 0; i < pathCount; i++) {
 		jstring jPath = (jstring)env->GetObjectArrayElement(paths, i);
 		if (!jPath) {
 			JNIErrorHandler::throw_illegal_argument(env, "Path element cannot be null");
-			return 0;
+			return false;
 		}
-		
-		std::string pathStr = JniUtils::jstring_to_string(env, jPath);
-		pathStrings.push_back(pathStr);
-		pathPtrs.push_back(pathStrings.back().c_str());
-		
+		options.paths.push_back(JniUtils::jstring_to_string(env, jPath));
 		env->DeleteLocalRef(jPath);
 	}
 	
-	// Create model parameters (using default for now)
-	llama_model_params model_params = llama_model_default_params();
-	// TODO: Parse Java params object to set model_params if needed
+	if (!ModelManager::parseOptions(env, args, options)) {
+		return false;
+	}
+	if (options.paths.empty() || options.paths.front().empty()) {
+		JNIErrorHandler::throw_illegal_argument(env, "No model path specified");
+		return false;
+	}
+	return true;
+}
+
+jlong ModelLoaderManager::loadModelFromSplits(JNIEnv* env, jclass cls, jobjectArray paths, jobjectArray args) {
+	JNI_TRY(env)
 	
-	// Initialize backend if not already done
-	llama_backend_init();
+	JNILogger::initialize(env);
 	
-	// Load the model from splits
-	llama_model* model = llama_model_load_from_splits(
-		pathPtrs.data(),
-		pathCount,
-		model_params
-	);
+	if (!paths || env->GetArrayLength(paths) == 0) {
+		JNIErrorHandler::throw_illegal_argument(env, "Paths array cannot be null or empty");
+		return 0;
+	}
 	
-	if (!model) {
-		JNIErrorHandler::throw_runtime_exception(env, 
-			"Failed to load model from split files");
+	ModelLoadOptions options;
+	if (!parse_load_options(env, paths, args, options)) {
 		return 0;
 	}
 	
-	// Create context with default parameters
-	llama_context_params ctx_params = llama_context_default_params();
-	llama_context* ctx = llama_new_context_with_model(model, ctx_params);
+	ModelLoadError error;
+	std::unique_ptr<LlamaServer> server = ModelManager::buildServer(options, error);
+	if (!server) {
+		ModelManager::throwLoadError(env, error);
+		return 0;
+	}
+	return ModelManager::registerServer(env, std::move(server));
 	
-	if (!ctx) {
-		llama_free_model(model);
-		JNIErrorHandler::throw_runtime_exception(env, 
-			"Failed to create context for loaded model");
+	JNI_CATCH_RET(env, 0)
+}
+
+jlong ModelLoaderManager::startModelLoad(JNIEnv* env, jclass cls, jobjectArray paths, jobjectArray args) {
+	JNI_TRY(env)
+	
+	JNILogger::initialize(env);
+	
+	auto job = std::make_shared<ModelLoadJob>();
+	if (!parse_load_options(env, paths, args, job->options)) {
 		return 0;
 	}
+	job->options.model_params.progress_callback = load_progress;
+	job->options.model_params.progress_callback_user_data = job.get();
+	
+	// The thread only uses the job, never JNI
+	job->thread = std::thread([job]() {
+		ModelLoadError error;
+		std::unique_ptr<LlamaServer> server = ModelManager::buildServer(job->options, error);
+		if (server && job->cancelled) {
+			server.reset();
+		}
+		if (!server && job->cancelled) {
+			error.message = "Model load was cancelled";
+			error.illegal_argument = false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(job->mutex);
+			job->server = std::move(server);
+			job->error = error;
+			job->done = true;
+		}
+		job->progress = 1.0f;
+		job->done_cv.notify_all();
+	});
 	
-	// Create server instance
-	auto server = std::make_unique<LlamaServer>();
-	server->model = model;
-	server->ctx = ctx;
+	jlong handle = reinterpret_cast<jlong>(job.get());
+	{
+		std::lock_guard<std::mutex> lock(g_load_jobs_mutex);
+		g_load_jobs[handle] = job;
+	}
+	return handle;
 	
-	// Generate unique handle
-	jlong handle = reinterpret_cast<jlong>(server.get());
+	JNI_CATCH_RET(env, 0)
+}
+
+jfloat ModelLoaderManager::getModelLoadProgress(JNIEnv* env, jclass cls, jlong job_handle) {
+	std::shared_ptr<ModelLoadJob> job = get_load_job(job_handle);
+	return job ? job->progress.load() : 1.0f;
+}
+
+jboolean ModelLoaderManager::awaitModelLoad(JNIEnv* env, jclass cls, jlong job_handle, jlong timeout_ms) {
+	std::shared_ptr<ModelLoadJob> job = get_load_job(job_handle);
+	if (!job) {
+		return JNI_TRUE;
+	}
+	std::unique_lock<std::mutex> lock(job->mutex);
+	job->done_cv.wait_for(lock, std::chrono::milliseconds(std::max<jlong>(0, timeout_ms)), 
+		[&job] { return job->done; });
+	return job->done ? JNI_TRUE : JNI_FALSE;
+}
+
+void ModelLoaderManager::cancelModelLoad(JNIEnv* env, jclass cls, jlong job_handle) {
+	std::shared_ptr<ModelLoadJob> job = get_load_job(job_handle);
+	if (job) {
+		job->cancelled = true;
+	}
+}
+
+jlong ModelLoaderManager::finishModelLoad(JNIEnv* env, jclass cls, jlong job_handle) {
+	JNI_TRY(env)
 	
-	// Store in global map
+	std::shared_ptr<ModelLoadJob> job;
 	{
-		std::lock_guard<std::mutex> lock(g_servers_mutex);
-		g_servers[handle] = std::move(server);
+		std::lock_guard<std::mutex> lock(g_load_jobs_mutex);
+		auto it = g_load_jobs.find(job_handle);
+		if (it == g_load_jobs.end()) {
+			JNIErrorHandler::throw_illegal_state(env, "Model load was already finished");
+			return 0;
+		}
+		job = std::move(it->second);
+		g_load_jobs.erase(it);
 	}
 	
-	return handle;
+	// Blocks until the load completed or noticed its cancellation
+	job->thread.join();
+	if (!job->server) {
+		ModelManager::throwLoadError(env, job->error);
+		return 0;
+	}
+	return ModelManager::registerServer(env, std::move(job->server));
 	
 	JNI_CATCH_RET(env, 0)
 }
@@ -111,9 +204,8 @@ void ModelLoaderManager::saveModelToFile(JNIEnv* env, jobject obj, jstring path)
 		return;
 	}
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_model_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
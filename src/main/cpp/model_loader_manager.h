@@ -5,11 +5,26 @@
 
 class ModelLoaderManager {
 public:
-	// Load model from multiple split files (llama_model_load_from_splits)
-	static jlong loadModelFromSplits(JNIEnv* env, jclass cls, jobjectArray paths, jobject params);
+	// Load model from multiple split files (llama_model_load_from_splits) with the model arguments
+	static jlong loadModelFromSplits(JNIEnv* env, jclass cls, jobjectArray paths, jobjectArray args);
+	
+	// Load a model on a background thread, returns a job handle. Without paths --model is loaded.
+	static jlong startModelLoad(JNIEnv* env, jclass cls, jobjectArray paths, jobjectArray args);
+	
+	// Fraction of the weights loaded so far
+	static jfloat getModelLoadProgress(JNIEnv* env, jclass cls, jlong job);
+	
+	// Wait up to timeout_ms for the load to end, returns true once it did
+	static jboolean awaitModelLoad(JNIEnv* env, jclass cls, jlong job, jlong timeout_ms);
+	
+	// Abort the load at its next progress report
+	static void cancelModelLoad(JNIEnv* env, jclass cls, jlong job);
+	
+	// Wait for the load and free the job, returns the server handle or throws the load error
+	static jlong finishModelLoad(JNIEnv* env, jclass cls, jlong job);
 	
 	// Save model to file (llama_model_save_to_file) 
 	static void saveModelToFile(JNIEnv* env, jobject obj, jstring path);
 };
 
-#endif // MODEL_LOADER_MANAGER_H
\ No newline at end of file
+#endif // MODEL_LOADER_MANAGER_H
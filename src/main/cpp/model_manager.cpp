@@ -2,13 +2,14 @@
 #include "jni_utils.h"
 #include "jni_logger.h"
 #include "jni_error_handler.h"
+#include "model_registry.h"
+#include "adapter_registry.h"
+#include "server_table.h"
 #include <mutex>
 #include <unordered_map>
 #include <memory>
-
-// External global server management (defined in jllama.cpp)
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
+#include <algorithm>
+#include <iterator>
 
 void ModelManager::loadModel(JNIEnv* env, jobject obj, jobjectArray args) {
 	JNIExceptionGuard exception_guard(env);
@@ -23,45 +24,349 @@ void ModelManager::loadModel(JNIEnv* env, jobject obj, jobjectArray args) {
 		return;
 	}
 	
-	// Initialize llama backend
-	llama_backend_init();
-	
 	// Parse model path
-	std::string model_path = parseModelPath(env, args);
-	if (model_path.empty()) {
+	ModelLoadOptions options;
+	if (!parseOptions(env, args, options)) {
+		return;
+	}
+	if (options.paths.empty()) {
 		env->ThrowNew(env->FindClass("java/lang/RuntimeException"), 
 			"No model path specified in arguments");
 		return;
 	}
 	
-	// Create model parameters with defaults
-	llama_model_params model_params = llama_model_default_params();
-	model_params.n_gpu_layers = parseGpuLayers(env, args);
+	ModelLoadError error;
+	std::unique_ptr<LlamaServer> server = buildServer(options, error);
+	if (!server) {
+		throwLoadError(env, error);
+		return;
+	}
 	
-	// Load model using real llama.cpp API
-	llama_model* model = llama_model_load_from_file(model_path.c_str(), model_params);
-	if (!model) {
-		env->ThrowNew(env->FindClass("java/lang/RuntimeException"), 
-			"Failed to load model");
+	// Store server and return handle
+	jlong handle = registerServer(env, std::move(server));
+	if (handle == 0) {
 		return;
 	}
 	
+	// Set the handle in Java object
+	jclass cls = env->GetObjectClass(obj);
+	jfieldID field = JniUtils::ctx_field(env, cls);
+	if (field) {
+		env->SetLongField(obj, field, handle);
+	}
+	
+	JNI_CATCH(env)
+}
+
+bool ModelManager::parseOptions(JNIEnv* env, jobjectArray args, ModelLoadOptions& options) {
+	if (options.paths.empty()) {
+		std::string model_path = parseModelPath(env, args);
+		if (!model_path.empty()) options.paths.push_back(model_path);
+	}
+	if (!parseModelParams(env, args, options)) {
+		return false;
+	}
+	
 	// Create context parameters
-	llama_context_params ctx_params = llama_context_default_params();
-	ctx_params.n_ctx = 512; // Default context size for streaming
+	options.ctx_params = llama_context_default_params();
+	options.ctx_params.n_ctx = 512; // Default context size for streaming
 	
 	// Parse additional parameters
-	bool embedding_mode = false;
-	bool reranking_mode = false;
-	parseAdditionalParams(env, args, ctx_params, embedding_mode, reranking_mode);
+	parseAdditionalParams(env, args, options.ctx_params, options.embedding_mode, options.reranking_mode);
+	if (env->ExceptionCheck()) {
+		return false;
+	}
+	
+	// Thread pools and NUMA placement
+	if (!parseThreadOptions(env, args, options)) {
+		return false;
+	}
+	
+	// Memory planning, with a budget an unspecified context grows to the largest that fits
+	MemoryPlanRequest& request = options.plan_request;
+	std::string budget = parseStringArg(env, args, "--memory-budget");
+	if (!budget.empty()) request.budget = (size_t)std::max(0, std::stoi(budget)) << 20;
+	options.fixed_ctx = !parseStringArg(env, args, "--ctx-size").empty();
+	request.fixed_types = !parseStringArg(env, args, "--cache-type-k").empty() || 
+		!parseStringArg(env, args, "--cache-type-v").empty();
+	
+	// Draft model for speculative decoding
+	options.draft_path = parseStringArg(env, args, "--model-draft");
+	options.draft_model_params = llama_model_default_params();
+	std::string gpu_layers_draft = parseStringArg(env, args, "--gpu-layers-draft");
+	options.draft_model_params.n_gpu_layers = gpu_layers_draft.empty() 
+		? options.model_params.n_gpu_layers : std::stoi(gpu_layers_draft);
+	std::string devices_draft = parseStringArg(env, args, "--device-draft");
+	if (!devices_draft.empty()) {
+		std::string error;
+		if (!DevicePlacement::parse_devices(devices_draft, options.draft_devices, error)) {
+			JNIErrorHandler::throw_illegal_argument(env, error);
+			return false;
+		}
+		options.draft_model_params.devices = options.draft_devices.data();
+	}
+	std::string draft_max = parseStringArg(env, args, "--draft-max");
+	if (!draft_max.empty()) options.n_draft_max = std::max(0, std::stoi(draft_max));
+	std::string draft_min = parseStringArg(env, args, "--draft-min");
+	if (!draft_min.empty()) options.n_draft_min = std::max(0, std::stoi(draft_min));
+	
+	// Sequence cache budgets are given in MiB
+	SequenceCache::Config& cache = options.seq_cache;
+	std::string ram = parseStringArg(env, args, "--seq-cache-ram");
+	if (!ram.empty()) cache.ram_budget = (size_t)std::max(0, std::stoi(ram)) << 20;
+	cache.disk_dir = parseStringArg(env, args, "--seq-cache-dir");
+	std::string disk = parseStringArg(env, args, "--seq-cache-disk");
+	if (!disk.empty()) cache.disk_budget = (size_t)std::max(0, std::stoi(disk)) << 20;
+	std::string block = parseStringArg(env, args, "--seq-cache-block");
+	if (!block.empty()) cache.block_size = (size_t)std::max(1, std::stoi(block));
+	
+	// Context shifting
+	options.context_shift = hasArg(env, args, "--context-shift") && !hasArg(env, args, "--no-context-shift");
+	std::string keep = parseStringArg(env, args, "--keep");
+	if (!keep.empty()) options.n_shift_keep = std::max(-1, std::stoi(keep));
+	std::string discard = parseStringArg(env, args, "--context-shift-discard");
+	if (!discard.empty()) options.shift_discard = std::min(1.0f, std::max(0.0f, std::stof(discard)));
+	
+	// Scheduler token budgets, 0 for the batch sizes of the context
+	std::string step_tokens = parseStringArg(env, args, "--step-tokens");
+	if (!step_tokens.empty()) options.n_step_tokens = std::max(0, std::stoi(step_tokens));
+	std::string prefill_chunk = parseStringArg(env, args, "--prefill-chunk");
+	if (!prefill_chunk.empty()) options.n_prefill_chunk = std::max(0, std::stoi(prefill_chunk));
+	std::string max_queued = parseStringArg(env, args, "--max-queued");
+	if (!max_queued.empty()) options.max_queued = std::max(0, std::stoi(max_queued));
+	std::string swap_budget = parseStringArg(env, args, "--kv-swap-budget");
+	if (!swap_budget.empty()) options.swap_budget = (size_t)std::max(0, std::stoi(swap_budget)) << 20;
+	std::string lora_quantum = parseStringArg(env, args, "--lora-quantum");
+	if (!lora_quantum.empty()) options.lora_quantum = std::max(1, std::stoi(lora_quantum));
+	std::string lora_cache_budget = parseStringArg(env, args, "--lora-cache-budget");
+	if (!lora_cache_budget.empty()) options.lora_cache_budget = (int64_t)std::max(0, std::stoi(lora_cache_budget)) << 20;
+	
+	// Warm start from the shared prompt prefix
+	options.warm_start.prompt = parseStringArg(env, args, "--warmup-prompt");
+	options.warm_start.image = parseStringArg(env, args, "--warm-image");
+	
+	// Tuned thread counts and batch sizes, explicit arguments take precedence
+	options.tuning_profile = parseStringArg(env, args, "--tuning-profile");
+	options.fixed_threads = !parseStringArg(env, args, "--threads").empty();
+	options.fixed_threads_batch = !parseStringArg(env, args, "--threads-batch").empty();
+	options.fixed_batch = !parseStringArg(env, args, "--batch-size").empty();
+	options.fixed_ubatch = !parseStringArg(env, args, "--ubatch-size").empty();
+	
+	return true;
+}
+
+bool ModelManager::parseModelParams(JNIEnv* env, jobjectArray args, ModelLoadOptions& options) {
+	// Create model parameters with defaults
+	llama_model_params& model_params = options.model_params;
+	model_params = llama_model_default_params();
+	model_params.n_gpu_layers = parseGpuLayers(env, args);
+	model_params.use_mmap = !hasArg(env, args, "--no-mmap");
+	model_params.use_mlock = hasArg(env, args, "--mlock");
+	model_params.check_tensors = hasArg(env, args, "--check-tensors");
+	
+	std::string main_gpu = parseStringArg(env, args, "--main-gpu");
+	if (!main_gpu.empty()) model_params.main_gpu = std::stoi(main_gpu);
+	
+	std::string split_mode = parseStringArg(env, args, "--split-mode");
+	if (split_mode == "none") {
+		model_params.split_mode = LLAMA_SPLIT_MODE_NONE;
+	} else if (split_mode == "layer") {
+		model_params.split_mode = LLAMA_SPLIT_MODE_LAYER;
+	} else if (split_mode == "row") {
+		model_params.split_mode = LLAMA_SPLIT_MODE_ROW;
+	} else if (!split_mode.empty()) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown split mode: " + split_mode);
+		return false;
+	}
+	
+	// Proportions of the model per device, e.g. "3,1"
+	std::string tensor_split = parseStringArg(env, args, "--tensor-split");
+	if (!tensor_split.empty()) {
+		options.tensor_split.assign(llama_max_devices(), 0.0f);
+		size_t device = 0;
+		size_t pos = 0;
+		while (pos <= tensor_split.size()) {
+			size_t next = tensor_split.find_first_of(",/", pos);
+			if (next == std::string::npos) next = tensor_split.size();
+			if (device >= options.tensor_split.size()) {
+				JNIErrorHandler::throw_illegal_argument(env, "Tensor split has more entries than devices");
+				return false;
+			}
+			options.tensor_split[device++] = std::stof(tensor_split.substr(pos, next - pos));
+			pos = next + 1;
+		}
+		model_params.tensor_split = options.tensor_split.data();
+	}
+	
+	// RPC servers become devices, which --device may then name, e.g. "RPC[host:50052]"
+	std::string error;
+	std::string rpc = parseStringArg(env, args, "--rpc");
+	if (!rpc.empty() && !DevicePlacement::add_rpc_servers(rpc, error)) {
+		JNIErrorHandler::throw_illegal_argument(env, error);
+		return false;
+	}
+	std::string devices = parseStringArg(env, args, "--device");
+	if (!devices.empty()) {
+		if (!DevicePlacement::parse_devices(devices, options.devices, error)) {
+			JNIErrorHandler::throw_illegal_argument(env, error);
+			return false;
+		}
+		model_params.devices = options.devices.data();
+	}
+	return true;
+}
+
+bool ModelManager::parseThreadOptions(JNIEnv* env, jobjectArray args, ModelLoadOptions& options) {
+	ThreadPoolOptions& threads = options.threads;
+	llama_context_params& ctx_params = options.ctx_params;
+	
+	bool has_threads = !parseStringArg(env, args, "--threads").empty();
+	std::string threads_batch = parseStringArg(env, args, "--threads-batch");
+	if (!threads_batch.empty()) {
+		ctx_params.n_threads_batch = std::max(1, std::stoi(threads_batch));
+	} else if (has_threads) {
+		ctx_params.n_threads_batch = ctx_params.n_threads;
+	}
+	
+	// The batch pool inherits every option of the generation pool it does not override
+	auto parse_pool = [&](cpu_params& cpu, const std::string& suffix) {
+		std::string mask = parseStringArg(env, args, ("--cpu-mask" + suffix).c_str());
+		if (!mask.empty()) {
+			std::fill(std::begin(cpu.cpumask), std::end(cpu.cpumask), false);
+			if (!parse_cpu_mask(mask, cpu.cpumask)) {
+				JNIErrorHandler::throw_illegal_argument(env, "Invalid CPU mask: " + mask);
+				return false;
+			}
+			cpu.mask_valid = true;
+		}
+		std::string range = parseStringArg(env, args, ("--cpu-range" + suffix).c_str());
+		if (!range.empty()) {
+			if (mask.empty()) std::fill(std::begin(cpu.cpumask), std::end(cpu.cpumask), false);
+			if (!parse_cpu_range(range, cpu.cpumask)) {
+				JNIErrorHandler::throw_illegal_argument(env, "Invalid CPU range: " + range);
+				return false;
+			}
+			cpu.mask_valid = true;
+		}
+		std::string strict = parseStringArg(env, args, ("--cpu-strict" + suffix).c_str());
+		if (!strict.empty()) cpu.strict_cpu = std::stoi(strict) != 0;
+		std::string prio = parseStringArg(env, args, ("--prio" + suffix).c_str());
+		if (!prio.empty()) cpu.priority = (ggml_sched_priority)std::min(3, std::max(0, std::stoi(prio)));
+		std::string poll = parseStringArg(env, args, ("--poll" + suffix).c_str());
+		if (!poll.empty()) cpu.poll = (uint32_t)std::min(100, std::max(0, std::stoi(poll)));
+		threads.custom = threads.custom || !mask.empty() || !range.empty() || !strict.empty() ||
+			!prio.empty() || !poll.empty();
+		return true;
+	};
+	if (!parse_pool(threads.cpu, "")) return false;
+	threads.cpu_batch = threads.cpu;
+	if (!parse_pool(threads.cpu_batch, "-batch")) return false;
+	
+	// Without explicit counts, pools take the size of their node or the number of math cores
+	threads.cpu.n_threads = has_threads ? ctx_params.n_threads : -1;
+	threads.cpu_batch.n_threads = has_threads || !threads_batch.empty() ? ctx_params.n_threads_batch : -1;
+	
+	std::string node = parseStringArg(env, args, "--numa-node");
+	if (node == "auto") {
+		threads.numa_node = -1;
+	} else if (!node.empty()) {
+		threads.numa_node = std::stoi(node);
+		if (threads.numa_node < 0) {
+			JNIErrorHandler::throw_illegal_argument(env, "Invalid NUMA node: " + node);
+			return false;
+		}
+	}
+	threads.custom = threads.custom || threads.numa_node != -2;
+	
+	std::string numa = parseStringArg(env, args, "--numa");
+	if (numa == "distribute") {
+		options.numa = GGML_NUMA_STRATEGY_DISTRIBUTE;
+	} else if (numa == "isolate") {
+		options.numa = GGML_NUMA_STRATEGY_ISOLATE;
+	} else if (numa == "numactl") {
+		options.numa = GGML_NUMA_STRATEGY_NUMACTL;
+	} else if (!numa.empty() && numa != "disabled") {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown NUMA strategy: " + numa);
+		return false;
+	}
+	return true;
+}
+
+std::unique_ptr<LlamaServer> ModelManager::buildServer(ModelLoadOptions& options, ModelLoadError& error) {
+	// Initialize llama backend
+	llama_backend_init();
+	
+	// ggml's NUMA strategy is process wide and only affects models loaded after it was set
+	if (options.numa != GGML_NUMA_STRATEGY_DISABLED) {
+		llama_numa_init(options.numa);
+	}
+	
+	// A placed server claims a node, loading on it allocates the weights from its memory
+	struct NodeClaim {
+		int node = -1;
+		~NodeClaim() { ThreadPlacement::release_node(node); }
+	} claim;
+	if (options.threads.numa_node != -2) {
+		claim.node = ThreadPlacement::acquire_node(options.threads.numa_node);
+		if (claim.node < 0) {
+			error.message = "Unknown NUMA node " + std::to_string(options.threads.numa_node);
+			error.illegal_argument = true;
+			return nullptr;
+		}
+		if (options.numa != GGML_NUMA_STRATEGY_DISABLED) {
+			JNI_LOG_WARN("ggml's NUMA strategy re-pins compute threads and overrides the placement on node %d", claim.node);
+		}
+	}
+	NodeAffinityScope load_affinity(claim.node);
+	
+	// Load the model, or attach to it if another server already holds the same weights
+	if (!options.tensor_split.empty()) {
+		options.model_params.tensor_split = options.tensor_split.data();
+	}
+	if (!options.devices.empty()) {
+		options.model_params.devices = options.devices.data();
+	}
+	if (!options.draft_devices.empty()) {
+		options.draft_model_params.devices = options.draft_devices.data();
+	}
+	std::vector<DeviceMemory> memory_before = DevicePlacement::memory();
+	std::shared_ptr<llama_model> model_ref = ModelRegistry::acquire(options.paths, options.model_params);
+	llama_model* model = model_ref.get();
+	if (!model) {
+		error.message = "Failed to load model";
+		return nullptr;
+	}
+	
+	// Tuned settings first, the memory plan depends on the batch sizes
+	llama_context_params ctx_params = options.ctx_params;
+	ThreadPoolOptions threads = options.threads;
+	if (!options.tuning_profile.empty()) {
+		applyTuningProfile(options, model, ctx_params, threads);
+	}
+	
+	// Size the context and its KV cache before anything is allocated
+	MemoryPlan plan;
+	if (!planMemory(options, model, ctx_params, plan, error)) {
+		return nullptr;
+	}
+	
+	// Thread counts follow the pools, which take the CPUs of the claimed node
+	if (threads.custom) {
+		if (claim.node >= 0) {
+			ThreadPlacement::apply_node(claim.node, threads.cpu);
+			ThreadPlacement::apply_node(claim.node, threads.cpu_batch);
+		}
+		if (threads.cpu.n_threads <= 0) threads.cpu.n_threads = cpu_get_num_math();
+		if (threads.cpu_batch.n_threads <= 0) threads.cpu_batch.n_threads = threads.cpu.n_threads;
+		ctx_params.n_threads = threads.cpu.n_threads;
+		ctx_params.n_threads_batch = threads.cpu_batch.n_threads;
+	}
 	
 	// Create context
 	llama_context* ctx = llama_init_from_model(model, ctx_params);
 	if (!ctx) {
-		llama_model_free(model);
-		env->ThrowNew(env->FindClass("java/lang/RuntimeException"), 
-			"Failed to create context");
-		return;
+		error.message = "Failed to create context";
+		return nullptr;
 	}
 	
 	// Create sampler
@@ -70,38 +375,94 @@ void ModelManager::loadModel(JNIEnv* env, jobject obj, jobjectArray args) {
 	llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
 	
 	// Create and configure server
-	auto server = createServer(model, ctx, sampler, embedding_mode, reranking_mode);
+	auto server = createServer(model, ctx, sampler, options.embedding_mode, options.reranking_mode);
+	server->model_ref = std::move(model_ref);
+	server->memory_plan = plan.to_json();
+	server->device_placement = DevicePlacement::report(model, options.model_params, memory_before);
 	
-	// Start the background server
-	server->start_server();
+	// Attach the draft model for speculative decoding, if one was requested
+	if (!loadDraftModel(options, ctx_params, server.get(), error)) {
+		return nullptr;
+	}
 	
-	// Store server and return handle
-	jlong handle = reinterpret_cast<jlong>(server.get());
-	{
-		std::lock_guard<std::mutex> lock(g_servers_mutex);
-		g_servers[handle] = std::move(server);
+	// Own thread pools, shared by the draft context which decodes in turn with the target
+	if (threads.custom) {
+		if (!ThreadPlacement::attach(ctx, threads, server->threadpool, server->threadpool_batch)) {
+			error.message = "Failed to create thread pools";
+			return nullptr;
+		}
+		if (server->draft_ctx) {
+			llama_attach_threadpool(server->draft_ctx, server->threadpool, server->threadpool_batch);
+		}
+		server->numa_node = claim.node;
+		claim.node = -1;
+		if (server->numa_node >= 0) {
+			JNI_LOG_INFO("Placed on NUMA node %d with %d generation and %d batch threads", server->numa_node,
+				threads.cpu.n_threads, threads.cpu_batch.n_threads);
+		}
 	}
 	
-	// Set the handle in Java object
-	jclass cls = env->GetObjectClass(obj);
-	jfieldID field = env->GetFieldID(cls, "ctx", "J");
-	if (field) {
-		env->SetLongField(obj, field, handle);
+	server->seq_cache.configure(options.seq_cache);
+	
+	server->context_shift = options.context_shift;
+	server->n_shift_keep = options.n_shift_keep;
+	server->shift_discard = options.shift_discard;
+	server->n_step_tokens = options.n_step_tokens;
+	server->n_prefill_chunk = options.n_prefill_chunk;
+	server->max_queued = options.max_queued;
+	server->swap_budget = options.swap_budget;
+	if (options.lora_quantum > 0) server->lora_quantum = options.lora_quantum;
+	if (options.lora_cache_budget >= 0) AdapterRegistry::set_budget((size_t)options.lora_cache_budget);
+	if (server->context_shift) {
+		JNI_LOG_INFO("Context shift enabled: keeping %d tokens, discarding %.0f%% of the rest", 
+			server->n_shift_keep, server->shift_discard * 100.0f);
 	}
 	
-	JNI_CATCH(env)
+	// Prefill the shared prompt prefix, or restore it from the warm image, before the server is ready
+	if (!options.warm_start.prompt.empty() && !options.embedding_mode && !options.reranking_mode) {
+		std::string key = WarmStart::key(options.paths, ctx_params, options.warm_start.prompt);
+		server->warm_tokens = WarmStart::apply(ctx, options.warm_start, key, server->warm_restored);
+		if (server->seq_cache.enabled() && !server->warm_tokens.empty()) {
+			// Every sequence can restore the prefix, not only the one holding it
+			server->seq_cache.store(ctx, 0, server->warm_tokens);
+		}
+	}
+	
+	// Start the background server
+	server->start_server();
+	return server;
+}
+
+jlong ModelManager::registerServer(JNIEnv* env, std::unique_ptr<LlamaServer> server) {
+	jlong handle = ServerTable::insert(std::move(server));
+	if (handle == 0) {
+		JNIErrorHandler::throw_illegal_state(env, "Too many models loaded, at most " +
+			std::to_string(ServerTable::CAPACITY) + " can be open at once");
+	}
+	return handle;
+}
+
+void ModelManager::throwLoadError(JNIEnv* env, const ModelLoadError& error) {
+	if (error.illegal_argument) {
+		JNIErrorHandler::throw_illegal_argument(env, error.message);
+	} else {
+		JNIErrorHandler::throw_runtime_exception(env, error.message);
+	}
 }
 
 void ModelManager::deleteModel(JNIEnv* env, jobject obj) {
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
+	jlong handle = JniUtils::get_handle(env, obj);
 	
+	// Calls still using the server return early, the last of them frees it
 	if (handle != 0) {
-		std::lock_guard<std::mutex> lock(g_servers_mutex);
-		g_servers.erase(handle);
+		ServerTable::remove(handle);
 	}
 }
 
+jint ModelManager::getResidentModelCount(JNIEnv* env, jclass cls) {
+	return static_cast<jint>(ModelRegistry::resident_count());
+}
+
 std::string ModelManager::parseModelPath(JNIEnv* env, jobjectArray args) {
 	jsize args_length = env->GetArrayLength(args);
 	
@@ -149,6 +510,29 @@ void ModelManager::parseAdditionalParams(JNIEnv* env, jobjectArray args,
 			jstring value_jstr = (jstring)env->GetObjectArrayElement(args, i + 1);
 			std::string value_str = JniUtils::jstring_to_string(env, value_jstr);
 			ctx_params.n_threads = std::stoi(value_str);
+		} else if (arg_str == "--parallel" && i + 1 < args_length) {
+			// Each parallel sequence is one completion slot of the server scheduler
+			jstring value_jstr = (jstring)env->GetObjectArrayElement(args, i + 1);
+			std::string value_str = JniUtils::jstring_to_string(env, value_jstr);
+			ctx_params.n_seq_max = std::max(1, std::stoi(value_str));
+		} else if (arg_str == "--batch-size" && i + 1 < args_length) {
+			jstring value_jstr = (jstring)env->GetObjectArrayElement(args, i + 1);
+			std::string value_str = JniUtils::jstring_to_string(env, value_jstr);
+			ctx_params.n_batch = std::max(1, std::stoi(value_str));
+		} else if (arg_str == "--ubatch-size" && i + 1 < args_length) {
+			jstring value_jstr = (jstring)env->GetObjectArrayElement(args, i + 1);
+			std::string value_str = JniUtils::jstring_to_string(env, value_jstr);
+			ctx_params.n_ubatch = std::max(1, std::stoi(value_str));
+		} else if ((arg_str == "--cache-type-k" || arg_str == "--cache-type-v") && i + 1 < args_length) {
+			jstring value_jstr = (jstring)env->GetObjectArrayElement(args, i + 1);
+			std::string value_str = JniUtils::jstring_to_string(env, value_jstr);
+			ggml_type& type = arg_str == "--cache-type-k" ? ctx_params.type_k : ctx_params.type_v;
+			if (!MemoryPlanner::parse_cache_type(value_str, type)) {
+				JNIErrorHandler::throw_illegal_argument(env, "Unknown KV cache type: " + value_str);
+				return;
+			}
+		} else if (arg_str == "--flash-attn") {
+			ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
 		} else if (arg_str == "--embedding") {
 			embedding_mode = true;
 			ctx_params.embeddings = true;
@@ -159,6 +543,138 @@ void ModelManager::parseAdditionalParams(JNIEnv* env, jobjectArray args,
 	}
 }
 
+std::string ModelManager::parseStringArg(JNIEnv* env, jobjectArray args, const char* name) {
+	jsize args_length = env->GetArrayLength(args);
+	
+	for (jsize i = 0; i < args_length - 1; i++) {
+		jstring arg = (jstring)env->GetObjectArrayElement(args, i);
+		std::string arg_str = JniUtils::jstring_to_string(env, arg);
+		env->DeleteLocalRef(arg);
+		if (arg_str == name) {
+			jstring value_jstr = (jstring)env->GetObjectArrayElement(args, i + 1);
+			std::string value_str = JniUtils::jstring_to_string(env, value_jstr);
+			env->DeleteLocalRef(value_jstr);
+			return value_str;
+		}
+	}
+	return "";
+}
+
+bool ModelManager::hasArg(JNIEnv* env, jobjectArray args, const char* name) {
+	jsize args_length = env->GetArrayLength(args);
+	
+	for (jsize i = 0; i < args_length; i++) {
+		jstring arg = (jstring)env->GetObjectArrayElement(args, i);
+		std::string arg_str = JniUtils::jstring_to_string(env, arg);
+		env->DeleteLocalRef(arg);
+		if (arg_str == name) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ModelManager::loadDraftModel(const ModelLoadOptions& options, const llama_context_params& ctx_params, 
+		LlamaServer* server, ModelLoadError& error) {
+	if (options.draft_path.empty()) {
+		return true;
+	}
+	
+	std::shared_ptr<llama_model> draft_model_ref = ModelRegistry::acquire({ options.draft_path }, options.draft_model_params);
+	llama_model* draft_model = draft_model_ref.get();
+	if (!draft_model) {
+		error.message = "Failed to load draft model: " + options.draft_path;
+		return false;
+	}
+	
+	// Drafts are verified token by token against the target, so both must share a vocabulary
+	if (llama_vocab_n_tokens(llama_model_get_vocab(draft_model)) != 
+			llama_vocab_n_tokens(llama_model_get_vocab(server->model))) {
+		error.message = "Draft model vocabulary does not match the target model";
+		error.illegal_argument = true;
+		return false;
+	}
+	
+	// The draft context mirrors every sequence of the target context
+	llama_context_params draft_ctx_params = ctx_params;
+	draft_ctx_params.embeddings = false;
+	llama_context* draft_ctx = llama_init_from_model(draft_model, draft_ctx_params);
+	if (!draft_ctx) {
+		error.message = "Failed to create draft context";
+		return false;
+	}
+	
+	server->draft_model_ref = std::move(draft_model_ref);
+	server->draft_model = draft_model;
+	server->draft_ctx = draft_ctx;
+	
+	if (options.n_draft_max >= 0) server->n_draft_max = options.n_draft_max;
+	if (options.n_draft_min >= 0) server->n_draft_min = options.n_draft_min;
+	
+	JNI_LOG_INFO("Speculative decoding enabled with draft model %s (max %d tokens)", 
+		options.draft_path.c_str(), server->n_draft_max);
+	return true;
+}
+
+void ModelManager::applyTuningProfile(const ModelLoadOptions& options, const llama_model* model,
+		llama_context_params& ctx_params, ThreadPoolOptions& threads) {
+	TuningProfile profile;
+	std::string json;
+	if (!AutoTuner::load(options.tuning_profile, AutoTuner::fingerprint(model), profile, json)) {
+		JNI_LOG_WARN("No matching tuning profile at %s, using the default settings", options.tuning_profile.c_str());
+		return;
+	}
+	
+	if (!options.fixed_threads) {
+		ctx_params.n_threads = profile.n_threads;
+		threads.cpu.n_threads = profile.n_threads;
+	}
+	if (!options.fixed_threads_batch) {
+		ctx_params.n_threads_batch = profile.n_threads_batch;
+		threads.cpu_batch.n_threads = profile.n_threads_batch;
+	}
+	if (!options.fixed_batch) {
+		ctx_params.n_batch = profile.n_batch;
+	}
+	if (!options.fixed_ubatch) {
+		ctx_params.n_ubatch = std::min(profile.n_ubatch, ctx_params.n_batch);
+	}
+	JNI_LOG_INFO("Applied tuning profile %s: %d threads, %d batch threads, n_batch %u, n_ubatch %u",
+		options.tuning_profile.c_str(), ctx_params.n_threads, ctx_params.n_threads_batch,
+		ctx_params.n_batch, ctx_params.n_ubatch);
+}
+
+bool ModelManager::planMemory(const ModelLoadOptions& options, const llama_model* model, 
+		llama_context_params& ctx_params, MemoryPlan& plan, ModelLoadError& error) {
+	MemoryPlanRequest request = options.plan_request;
+	request.n_ctx = request.budget == 0 || options.fixed_ctx ? ctx_params.n_ctx : 0;
+	request.n_seq = std::max(1u, ctx_params.n_seq_max);
+	request.n_ubatch = std::min(ctx_params.n_ubatch, ctx_params.n_batch);
+	request.flash_attn = ctx_params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_ENABLED;
+	request.type_k = ctx_params.type_k;
+	request.type_v = ctx_params.type_v;
+	
+	plan = MemoryPlanner::plan(model, request);
+	JNI_LOG_INFO("Memory plan: n_ctx %u, K %s, V %s, %zu MiB weights + %zu MiB KV + ~%zu MiB compute", 
+		plan.n_ctx, ggml_type_name(plan.type_k), ggml_type_name(plan.type_v), 
+		plan.model_bytes >> 20, plan.kv_bytes >> 20, plan.compute_bytes >> 20);
+	
+	if (request.budget == 0) {
+		return true;
+	}
+	if (!plan.fits || (options.fixed_ctx && plan.n_ctx < request.n_ctx)) {
+		error.message = "The model does not fit into the memory budget of " + 
+			std::to_string(request.budget >> 20) + " MiB, the closest plan is " + plan.to_json();
+		error.illegal_argument = true;
+		return false;
+	}
+	
+	ctx_params.n_ctx = plan.n_ctx;
+	ctx_params.type_k = plan.type_k;
+	ctx_params.type_v = plan.type_v;
+	return true;
+}
+
 std::unique_ptr<LlamaServer> ModelManager::createServer(llama_model* model, llama_context* ctx, 
 		llama_sampler* sampler, bool embedding_mode, bool reranking_mode) {
 	auto server = std::make_unique<LlamaServer>();
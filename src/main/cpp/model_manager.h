@@ -5,8 +5,69 @@
 #include <vector>
 #include "llama.h"
 #include "llama_server.h"
+#include "memory_planner.h"
+#include "warm_start.h"
+#include "thread_placement.h"
+#include "auto_tuner.h"
+#include "device_placement.h"
 #include "jni_error_handler.h"
 
+/**
+ * Everything a model load reads from the Java arguments. Parsing needs the JNI thread,
+ * building the server from the options does not, so loads can run in the background.
+ */
+struct ModelLoadOptions {
+	std::vector<std::string> paths;    // The model file, or all splits of a split model
+	llama_model_params model_params = llama_model_default_params();
+	std::vector<float> tensor_split;   // Backing storage of model_params.tensor_split
+	std::vector<ggml_backend_dev_t> devices;  // Backing storage of model_params.devices, null terminated
+	llama_context_params ctx_params = llama_context_default_params();
+	bool embedding_mode = false;
+	bool reranking_mode = false;
+
+	MemoryPlanRequest plan_request;
+	bool fixed_ctx = false;
+
+	std::string draft_path;
+	llama_model_params draft_model_params = llama_model_default_params();
+	std::vector<ggml_backend_dev_t> draft_devices;
+	int n_draft_max = -1;
+	int n_draft_min = -1;
+
+	SequenceCache::Config seq_cache;
+
+	bool context_shift = false;
+	int n_shift_keep = 0;
+	float shift_discard = 0.5f;
+
+	int n_step_tokens = 0;
+	int n_prefill_chunk = 0;
+	int max_queued = 0;
+	size_t swap_budget = 0;
+	int lora_quantum = 0;
+	int64_t lora_cache_budget = -1;  // Bytes, -1 leaves the process-wide budget as it is
+
+	WarmStartConfig warm_start;
+
+	ThreadPoolOptions threads;
+	ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
+
+	// Profile of AutoTuner, it fills in whichever of these settings were not given
+	std::string tuning_profile;
+	bool fixed_threads = false;
+	bool fixed_threads_batch = false;
+	bool fixed_batch = false;
+	bool fixed_ubatch = false;
+};
+
+/**
+ * Why building a server failed, thrown as IllegalArgumentException or RuntimeException.
+ */
+struct ModelLoadError {
+	std::string message;
+	bool illegal_argument = false;
+};
+
 /**
  * Handles model loading, initialization, and cleanup operations.
  * Manages the lifecycle of llama.cpp models and contexts.
@@ -16,7 +77,7 @@ public:
 	/**
 	 * Load a model from parameters array and initialize the context.
 	 * @param env JNI environment
-	 * @param obj Java LlamaModel object 
+	 * @param obj Java LlamaModel object
 	 * @param args Model parameters array
 	 */
 	static void loadModel(JNIEnv* env, jobject obj, jobjectArray args);
@@ -28,6 +89,46 @@ public:
 	 */
 	static void deleteModel(JNIEnv* env, jobject obj);
 
+	/**
+	 * Count the distinct models resident in the process, servers share models with the same weights.
+	 * @param env JNI environment
+	 * @param cls Java LlamaModel class
+	 * @return Number of resident models
+	 */
+	static jint getResidentModelCount(JNIEnv* env, jclass cls);
+
+	/**
+	 * Parse the model, context and server options from the arguments.
+	 * @param env JNI environment
+	 * @param args Arguments array
+	 * @param options Output parameter for the options, paths are taken from --model unless set
+	 * @return false if a Java exception was thrown, true otherwise
+	 */
+	static bool parseOptions(JNIEnv* env, jobjectArray args, ModelLoadOptions& options);
+
+	/**
+	 * Load or attach to the model, create its context and start the server. Does not use JNI.
+	 * @param options Parsed options, the model parameters may carry a progress callback
+	 * @param error Output parameter describing a failure
+	 * @return The running server, nullptr on failure
+	 */
+	static std::unique_ptr<LlamaServer> buildServer(ModelLoadOptions& options, ModelLoadError& error);
+
+	/**
+	 * Register a server in the global handle table.
+	 * @param env JNI environment
+	 * @param server Running server
+	 * @return Handle of the server, 0 with a Java exception if the table is full
+	 */
+	static jlong registerServer(JNIEnv* env, std::unique_ptr<LlamaServer> server);
+
+	/**
+	 * Throw a load error as a Java exception.
+	 * @param env JNI environment
+	 * @param error Failure to report
+	 */
+	static void throwLoadError(JNIEnv* env, const ModelLoadError& error);
+
 private:
 	/**
 	 * Parse model path from arguments array.
@@ -45,6 +146,25 @@ private:
 	 */
 	static int parseGpuLayers(JNIEnv* env, jobjectArray args);
 
+	/**
+	 * Parse the weight placement: GPU layers, split mode, tensor split, main GPU, offload devices,
+	 * RPC servers, mmap and mlock.
+	 * @param env JNI environment
+	 * @param args Arguments array
+	 * @param options Options receiving the model parameters
+	 * @return false if a Java exception was thrown, true otherwise
+	 */
+	static bool parseModelParams(JNIEnv* env, jobjectArray args, ModelLoadOptions& options);
+
+	/**
+	 * Parse the thread pool options: thread counts, CPU masks and ranges, priority, polling and NUMA placement.
+	 * @param env JNI environment
+	 * @param args Arguments array
+	 * @param options Options receiving the thread pool options and thread counts
+	 * @return false if a Java exception was thrown, true otherwise
+	 */
+	static bool parseThreadOptions(JNIEnv* env, jobjectArray args, ModelLoadOptions& options);
+
 	/**
 	 * Parse additional model parameters from arguments.
 	 * @param env JNI environment
@@ -53,9 +173,61 @@ private:
 	 * @param embedding_mode Output parameter for embedding mode
 	 * @param reranking_mode Output parameter for reranking mode
 	 */
-	static void parseAdditionalParams(JNIEnv* env, jobjectArray args, 
+	static void parseAdditionalParams(JNIEnv* env, jobjectArray args,
 		llama_context_params& ctx_params, bool& embedding_mode, bool& reranking_mode);
 
+	/**
+	 * Find the value following a named argument.
+	 * @param env JNI environment
+	 * @param args Arguments array
+	 * @param name Argument name, e.g. "--model-draft"
+	 * @return Argument value, empty if not found
+	 */
+	static std::string parseStringArg(JNIEnv* env, jobjectArray args, const char* name);
+
+	/**
+	 * Check whether a flag is present.
+	 * @param env JNI environment
+	 * @param args Arguments array
+	 * @param name Flag name, e.g. "--context-shift"
+	 * @return true if the flag was given
+	 */
+	static bool hasArg(JNIEnv* env, jobjectArray args, const char* name);
+
+	/**
+	 * Load the draft model given by --model-draft and attach it to the server.
+	 * @param options Parsed options
+	 * @param ctx_params Context parameters of the target context
+	 * @param server Server receiving the draft model and context
+	 * @param error Output parameter describing a failure
+	 * @return false on failure, true otherwise
+	 */
+	static bool loadDraftModel(const ModelLoadOptions& options, const llama_context_params& ctx_params,
+		LlamaServer* server, ModelLoadError& error);
+
+	/**
+	 * Plan the context size and KV cache types for --memory-budget, or report the requested ones.
+	 * @param options Parsed options
+	 * @param model Loaded model
+	 * @param ctx_params Context parameters, updated with the plan when a budget is given
+	 * @param plan Output parameter for the plan
+	 * @param error Output parameter describing a failure
+	 * @return false if the model does not fit, true otherwise
+	 */
+	static bool planMemory(const ModelLoadOptions& options, const llama_model* model,
+		llama_context_params& ctx_params, MemoryPlan& plan, ModelLoadError& error);
+
+	/**
+	 * Apply the tuning profile of --tuning-profile to the settings not given explicitly.
+	 * A profile made for another model or host is ignored.
+	 * @param options Parsed options
+	 * @param model Loaded model
+	 * @param ctx_params Context parameters receiving the thread counts and batch sizes
+	 * @param threads Thread pools receiving the thread counts
+	 */
+	static void applyTuningProfile(const ModelLoadOptions& options, const llama_model* model,
+		llama_context_params& ctx_params, ThreadPoolOptions& threads);
+
 	/**
 	 * Create and configure a LlamaServer instance.
 	 * @param model Loaded llama model
@@ -65,6 +237,6 @@ private:
 	 * @param reranking_mode Whether reranking mode is enabled
 	 * @return Unique pointer to configured server
 	 */
-	static std::unique_ptr<LlamaServer> createServer(llama_model* model, llama_context* ctx, 
+	static std::unique_ptr<LlamaServer> createServer(llama_model* model, llama_context* ctx,
 		llama_sampler* sampler, bool embedding_mode, bool reranking_mode);
-};
\ No newline at end of file
+};
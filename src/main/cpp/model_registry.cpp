@@ -0,0 +1,91 @@
+#include "model_registry.h"
+#include "jni_logger.h"
+#include "ggml-backend.h"
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+std::mutex registry_mutex;
+std::unordered_map<std::string, std::weak_ptr<llama_model>> registry;
+}
+
+std::string ModelRegistry::key(const std::vector<std::string>& paths, const llama_model_params& params) {
+	std::string path;
+	for (const std::string& split : paths) {
+		path += split + "|";
+	}
+
+	// Context parameters are per server, only these decide where and how the weights are placed
+	std::string split;
+	if (params.tensor_split) {
+		for (size_t i = 0; i < llama_max_devices(); i++) {
+			split += std::to_string(params.tensor_split[i]) + ",";
+		}
+	}
+	std::string devices;
+	if (params.devices) {
+		for (ggml_backend_dev_t* dev = params.devices; *dev; dev++) {
+			devices += std::string(ggml_backend_dev_name(*dev)) + ",";
+		}
+	} else {
+		devices = "default";
+	}
+	return path + "gpu=" + std::to_string(params.n_gpu_layers) +
+		"|split=" + std::to_string((int)params.split_mode) +
+		"|main=" + std::to_string(params.main_gpu) +
+		"|mmap=" + std::to_string(params.use_mmap) +
+		"|mlock=" + std::to_string(params.use_mlock) +
+		"|vocab=" + std::to_string(params.vocab_only) +
+		"|tensors=" + split +
+		"|devices=" + devices;
+}
+
+std::shared_ptr<llama_model> ModelRegistry::acquire(const std::vector<std::string>& paths,
+		const llama_model_params& params) {
+	if (paths.empty()) return nullptr;
+	std::string model_key = key(paths, params);
+
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto it = registry.find(model_key);
+	if (it != registry.end()) {
+		if (std::shared_ptr<llama_model> model = it->second.lock()) {
+			JNI_LOG_INFO("Sharing resident model %s", paths.front().c_str());
+			return model;
+		}
+	}
+
+	llama_model* raw;
+	if (paths.size() == 1) {
+		raw = llama_model_load_from_file(paths.front().c_str(), params);
+	} else {
+		std::vector<const char*> splits;
+		for (const std::string& split : paths) {
+			splits.push_back(split.c_str());
+		}
+		raw = llama_model_load_from_splits(splits.data(), splits.size(), params);
+	}
+	if (!raw) return nullptr;
+
+	std::shared_ptr<llama_model> model(raw, [model_key](llama_model* released) {
+		{
+			// A reload of the same key may already have replaced the entry
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			auto entry = registry.find(model_key);
+			if (entry != registry.end() && entry->second.expired()) {
+				registry.erase(entry);
+			}
+		}
+		llama_model_free(released);
+	});
+	registry[model_key] = model;
+	return model;
+}
+
+size_t ModelRegistry::resident_count() {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	size_t count = 0;
+	for (const auto& entry : registry) {
+		if (!entry.second.expired()) count++;
+	}
+	return count;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include "llama.h"
+
+// Process-wide registry of loaded models, keyed by path and the load parameters that change the
+// resident weights. Servers loading the same model with different context settings share one
+// llama_model; it is freed when the last reference goes away.
+class ModelRegistry {
+public:
+	// Return the resident model for the file, or all splits of a split model, and params, loading it if
+	// needed. Returns nullptr if loading failed or was cancelled by the progress callback of params.
+	// Loads are serialized, so concurrent loads of one model share it.
+	static std::shared_ptr<llama_model> acquire(const std::vector<std::string>& paths, const llama_model_params& params);
+
+	// Number of distinct models currently resident
+	static size_t resident_count();
+
+private:
+	static std::string key(const std::vector<std::string>& paths, const llama_model_params& params);
+};
@@ -0,0 +1,168 @@
+#include "native_trace.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+std::atomic<bool> NativeTrace::enabled_{false};
+
+namespace {
+
+struct TraceEvent {
+	const char* category;
+	const char* name;
+	uint64_t start_ns;
+	uint64_t dur_ns;
+	const char* arg_name;
+	int64_t arg;
+};
+
+// Written only by its thread. The count is published with release, readers see every event below it.
+// A buffer of an older epoch is stale and reset by its thread on the next record.
+struct ThreadBuffer {
+	std::unique_ptr<TraceEvent[]> events{new TraceEvent[NativeTrace::THREAD_CAPACITY]};
+	std::atomic<uint32_t> count{0};
+	std::atomic<uint64_t> epoch{0};
+	std::atomic<uint64_t> dropped{0};
+	uint64_t tid = 0;
+};
+
+std::atomic<uint64_t> g_epoch{0};
+std::atomic<uint64_t> g_start_ns{0};
+
+// Buffers outlive their threads so that spans of finished threads can still be written
+std::mutex g_buffers_mutex;
+std::vector<std::shared_ptr<ThreadBuffer>> g_buffers;
+
+// Serializes start and write
+std::mutex g_control_mutex;
+
+uint64_t current_tid() {
+#ifdef __linux__
+	return (uint64_t)syscall(SYS_gettid);
+#else
+	return (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+}
+
+ThreadBuffer* thread_buffer() {
+	thread_local std::shared_ptr<ThreadBuffer> buffer;
+	if (!buffer) {
+		buffer = std::make_shared<ThreadBuffer>();
+		buffer->tid = current_tid();
+		std::lock_guard<std::mutex> lock(g_buffers_mutex);
+		g_buffers.push_back(buffer);
+	}
+	return buffer.get();
+}
+
+}
+
+uint64_t NativeTrace::now_ns() {
+#ifdef __linux__
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#else
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void NativeTrace::start() {
+	std::lock_guard<std::mutex> lock(g_control_mutex);
+	g_start_ns.store(now_ns(), std::memory_order_relaxed);
+	g_epoch.fetch_add(1, std::memory_order_release);
+	enabled_.store(true, std::memory_order_relaxed);
+}
+
+void NativeTrace::stop() {
+	enabled_.store(false, std::memory_order_relaxed);
+}
+
+void NativeTrace::record(const char* category, const char* name, uint64_t start_ns, uint64_t end_ns,
+		const char* arg_name, int64_t arg) {
+	if (!enabled() || start_ns < g_start_ns.load(std::memory_order_relaxed)) return;
+
+	ThreadBuffer* buffer = thread_buffer();
+	uint64_t epoch = g_epoch.load(std::memory_order_acquire);
+	if (buffer->epoch.load(std::memory_order_relaxed) != epoch) {
+		buffer->count.store(0, std::memory_order_relaxed);
+		buffer->dropped.store(0, std::memory_order_relaxed);
+		buffer->epoch.store(epoch, std::memory_order_release);
+	}
+
+	uint32_t n = buffer->count.load(std::memory_order_relaxed);
+	if (n >= THREAD_CAPACITY) {
+		buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	buffer->events[n] = { category, name, start_ns, end_ns - start_ns, arg_name, arg };
+	buffer->count.store(n + 1, std::memory_order_release);
+}
+
+uint64_t NativeTrace::dropped() {
+	uint64_t epoch = g_epoch.load(std::memory_order_acquire);
+	uint64_t dropped = 0;
+	std::lock_guard<std::mutex> lock(g_buffers_mutex);
+	for (const std::shared_ptr<ThreadBuffer>& buffer : g_buffers) {
+		if (buffer->epoch.load(std::memory_order_acquire) == epoch) {
+			dropped += buffer->dropped.load(std::memory_order_relaxed);
+		}
+	}
+	return dropped;
+}
+
+long NativeTrace::write(const std::string& path) {
+	std::lock_guard<std::mutex> control_lock(g_control_mutex);
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	{
+		std::lock_guard<std::mutex> lock(g_buffers_mutex);
+		buffers = g_buffers;
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) return -1;
+#ifdef _WIN32
+	long pid = (long)_getpid();
+#else
+	long pid = (long)getpid();
+#endif
+
+	// Complete events ("X") with microsecond timestamps, the unit of the format
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	fprintf(file, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%ld,\"tid\":0,\"args\":{\"name\":\"jllama\"}}", pid);
+	uint64_t epoch = g_epoch.load(std::memory_order_acquire);
+	long written = 0;
+	for (const std::shared_ptr<ThreadBuffer>& buffer : buffers) {
+		if (buffer->epoch.load(std::memory_order_acquire) != epoch) continue;
+		uint32_t n = buffer->count.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < n; i++) {
+			const TraceEvent& event = buffer->events[i];
+			fprintf(file, ",\n{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%ld,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f",
+				event.category, event.name, pid, (unsigned long long)buffer->tid,
+				event.start_ns / 1e3, event.dur_ns / 1e3);
+			if (event.arg_name) {
+				fprintf(file, ",\"args\":{\"%s\":%lld}", event.arg_name, (long long)event.arg);
+			}
+			fputc('}', file);
+			written++;
+		}
+	}
+	fprintf(file, "]}\n");
+	bool ok = fflush(file) == 0;
+	ok = fclose(file) == 0 && ok;
+	return ok ? written : -1;
+}
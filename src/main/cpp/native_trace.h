@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Span tracing of native operations, exported as Chrome trace JSON (chrome://tracing, Perfetto).
+//
+// Every thread writes its spans into its own buffer without locks or atomics beyond a release
+// store of the count, a flush reads the buffers of all threads. Timestamps are CLOCK_MONOTONIC,
+// the clock of System.nanoTime and of async-profiler on Linux, and thread ids are kernel tids, so
+// traces line up with JVM profiles of the same process. While tracing is off a span costs one
+// relaxed load. Names and categories must be string literals, only their pointers are kept.
+class NativeTrace {
+public:
+	// Spans kept per thread, later spans of a full buffer are counted as dropped
+	static const uint32_t THREAD_CAPACITY = 1 << 16;
+
+	// Discard recorded spans and start recording
+	static void start();
+
+	static void stop();
+
+	static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+	// Write the spans recorded since start as Chrome trace JSON, returns the number written or -1
+	static long write(const std::string& path);
+
+	// Spans lost to full buffers since start
+	static uint64_t dropped();
+
+	// Record a finished span, with an optional counter argument (arg_name nullptr for none)
+	static void record(const char* category, const char* name, uint64_t start_ns, uint64_t end_ns,
+		const char* arg_name = nullptr, int64_t arg = 0);
+
+	static uint64_t now_ns();
+
+private:
+	static std::atomic<bool> enabled_;
+};
+
+// Records a span from construction to destruction while tracing is on
+class TraceSpan {
+public:
+	TraceSpan(const char* category, const char* name)
+		: category_(category), name_(name), start_(NativeTrace::enabled() ? NativeTrace::now_ns() : 0) {}
+
+	~TraceSpan() {
+		if (start_) NativeTrace::record(category_, name_, start_, NativeTrace::now_ns(), arg_name_, arg_);
+	}
+
+	// Attach a counter to the span, e.g. the tokens of a batch
+	void arg(const char* name, int64_t value) {
+		arg_name_ = name;
+		arg_ = value;
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	const char* category_;
+	const char* name_;
+	uint64_t start_;
+	const char* arg_name_ = nullptr;
+	int64_t arg_ = 0;
+};
+
+#define JLLAMA_TRACE_CONCAT_(a, b) a##b
+#define JLLAMA_TRACE_CONCAT(a, b) JLLAMA_TRACE_CONCAT_(a, b)
+
+// Span for the rest of the enclosing scope
+#define JLLAMA_TRACE_SPAN(category, name) TraceSpan JLLAMA_TRACE_CONCAT(trace_span_, __LINE__)(category, name)
@@ -0,0 +1,152 @@
+#include "push_dispatcher.h"
+#include "jni_utils.h"
+#include "jni_logger.h"
+#include "llama_server.h"
+#include <string>
+#include <vector>
+
+bool PushDispatcher::add(JNIEnv* env, int task_id, jobject callback) {
+	{
+		std::lock_guard<std::mutex> lock(start_mutex_);
+		if (state_->stopping) return false;
+		if (!thread_.joinable()) {
+			if (env->GetJavaVM(&state_->jvm) != JNI_OK) return false;
+			thread_ = std::thread(run, state_, server_);
+		}
+	}
+	
+	jobject global = env->NewGlobalRef(callback);
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex);
+		state_->callbacks[task_id] = global;
+		// Results may have arrived before the registration
+		state_->signaled = true;
+	}
+	state_->cv.notify_one();
+	return true;
+}
+
+void PushDispatcher::notify() {
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex);
+		if (state_->callbacks.empty()) return;
+		state_->signaled = true;
+	}
+	state_->cv.notify_one();
+}
+
+void PushDispatcher::stop() {
+	std::lock_guard<std::mutex> lock(start_mutex_);
+	{
+		std::lock_guard<std::mutex> state_lock(state_->mutex);
+		state_->stopping = true;
+	}
+	state_->cv.notify_one();
+	if (!thread_.joinable()) return;
+	if (thread_.get_id() == std::this_thread::get_id()) {
+		// Closed from a callback, the thread finishes on its own once the callback returns
+		thread_.detach();
+	} else {
+		thread_.join();
+	}
+}
+
+void PushDispatcher::run(std::shared_ptr<State> state, LlamaServer* server) {
+	// Attached once as a daemon, so the JVM does not wait for this thread when it exits
+	JNIEnv* env = nullptr;
+	JavaVMAttachArgs attach_args = { JNI_VERSION_1_6, (char*)"jllama-push", nullptr };
+	if (state->jvm->AttachCurrentThreadAsDaemon((void**)&env, &attach_args) != JNI_OK) {
+		JNI_LOG_ERROR("Failed to attach the completion callback thread");
+		return;
+	}
+	
+	const JniCache& jni = JniUtils::cache();
+	std::vector<std::pair<int, jobject>> pending;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->cv.wait(lock, [&state] { return state->stopping || state->signaled; });
+			if (state->stopping) break;
+			state->signaled = false;
+			pending.assign(state->callbacks.begin(), state->callbacks.end());
+		}
+		
+		for (const auto& entry : pending) {
+			// The server is gone once a callback closed the model, it must not be touched after one
+			if (state->stopping) break;
+			if (deliver(env, *state, server, entry.first, entry.second)) continue;
+			
+			// Finished, cancelled after a failing callback, or released by the caller
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->callbacks.erase(entry.first);
+			}
+			env->DeleteGlobalRef(entry.second);
+			if (!state->stopping) server->release_task(entry.first);
+		}
+	}
+	
+	// Tasks that did not finish before the model was closed
+	std::unordered_map<int, jobject> callbacks;
+	{
+		std::lock_guard<std::mutex> lock(state->mutex);
+		callbacks.swap(state->callbacks);
+	}
+	for (const auto& entry : callbacks) {
+		if (jni.completion_callback_on_error) {
+			jstring message = env->NewStringUTF("Model was closed");
+			env->CallVoidMethod(entry.second, jni.completion_callback_on_error, message);
+			env->DeleteLocalRef(message);
+			if (env->ExceptionCheck()) env->ExceptionClear();
+		}
+		env->DeleteGlobalRef(entry.second);
+	}
+	state->jvm->DetachCurrentThread();
+}
+
+// Hand the pending results of a task to its callback, returns false once the task is done with
+bool PushDispatcher::deliver(JNIEnv* env, State& state, LlamaServer* server, int task_id, jobject callback) {
+	const JniCache& jni = JniUtils::cache();
+	std::vector<TaskResult> results;
+	for (;;) {
+		results.clear();
+		if (!server->wait_results(task_id, CompletionTask::max_pending_results, 0, results)) return false;
+		if (results.empty()) return true;
+		
+		for (const TaskResult& result : results) {
+			if (result.is_error) {
+				jstring message = env->NewStringUTF(result.error_msg.c_str());
+				env->CallVoidMethod(callback, jni.completion_callback_on_error, message);
+				env->DeleteLocalRef(message);
+				if (env->ExceptionCheck()) env->ExceptionClear();
+				return false;
+			}
+			
+			const TokenProbs& top = result.top_probs;
+			if (!result.text.empty() || !top.ids.empty()) {
+				uint64_t t_marshal = LatencyHistogram::now_ns();
+				jobject output = JniUtils::new_llama_output(env, result.text.data(), result.text.length(), nullptr,
+					result.is_final, reinterpret_cast<const jint*>(top.ids.data()), top.probs.data(), top.ids.size());
+				server->latency.marshal.record(LatencyHistogram::now_ns() - t_marshal);
+				if (output) {
+					env->CallVoidMethod(callback, jni.completion_callback_on_output, output);
+					env->DeleteLocalRef(output);
+				}
+				if (state.stopping) return false;
+				if (env->ExceptionCheck()) {
+					// A throwing callback ends its completion
+					env->ExceptionDescribe();
+					env->ExceptionClear();
+					server->cancel_task(task_id);
+					return false;
+				}
+			}
+			
+			if (result.is_final) {
+				env->CallVoidMethod(callback, jni.completion_callback_on_complete);
+				if (env->ExceptionCheck()) env->ExceptionClear();
+				return false;
+			}
+		}
+	}
+}
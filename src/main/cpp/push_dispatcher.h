@@ -0,0 +1,53 @@
+#pragma once
+
+#include <jni.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct LlamaServer;
+
+// Delivers the results of callback-driven completions to their Java callbacks. One native thread
+// per server, attached to the JVM once and started by the first registration, drains the result
+// rings of all registered tasks, so no Java thread is parked per stream. A callback runs on that
+// thread and delays the others while it runs.
+class PushDispatcher {
+public:
+	explicit PushDispatcher(LlamaServer* server) : server_(server) {}
+	~PushDispatcher() { stop(); }
+
+	// Deliver the results of a submitted task to a LlamaModel.CompletionCallback, the task is
+	// released once its final result or an error was delivered
+	bool add(JNIEnv* env, int task_id, jobject callback);
+
+	// Results are pending for a registered task, called by the server thread
+	void notify();
+
+	// Report unfinished tasks as failed and stop the thread, safe to call from a callback
+	void stop();
+
+	PushDispatcher(const PushDispatcher&) = delete;
+	PushDispatcher& operator=(const PushDispatcher&) = delete;
+
+private:
+	// Shared with the thread, which outlives the dispatcher when a callback closed the model
+	struct State {
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::unordered_map<int, jobject> callbacks;  // Global references by task id
+		bool signaled = false;
+		std::atomic<bool> stopping{false};
+		JavaVM* jvm = nullptr;
+	};
+
+	static void run(std::shared_ptr<State> state, LlamaServer* server);
+	static bool deliver(JNIEnv* env, State& state, LlamaServer* server, int task_id, jobject callback);
+
+	LlamaServer* server_;
+	std::shared_ptr<State> state_ = std::make_shared<State>();
+	std::mutex start_mutex_;
+	std::thread thread_;
+};
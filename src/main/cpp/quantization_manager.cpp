@@ -1,7 +1,208 @@
 #include "quantization_manager.h"
 #include "jni_utils.h"
 #include "jni_error_handler.h"
+#include "log_router.h"
+#include "native_trace.h"
+#include "gguf.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
+
+// A quantization, on its own thread for jobs. llama_model_quantize has no progress or abort hook,
+// it logs a "[ i/ n] name - [shape] ..." line before each tensor instead. The job observes the
+// lines of its thread to follow the tensors, and aborts by throwing from the line of the next
+// tensor once cancelled, which llama_model_quantize reports as a failure.
+struct QuantizeJob {
+	std::string input;
+	std::string output;
+	QuantizeOptions options;
+	std::thread thread;
+	std::atomic<bool> cancelled{false};
+	bool aborted = false;  // Only used by the quantizing thread
+
+	std::mutex mutex;
+	std::condition_variable done_cv;
+	bool done = false;
+	int n_tensors = 0;
+	std::vector<std::string> tensors;  // Reached so far
+	std::string error;
+
+	// An abandoned job may be freed by its own thread or at exit
+	~QuantizeJob() {
+		if (thread.joinable()) thread.detach();
+	}
+};
+
+static std::mutex g_quantize_jobs_mutex;
+static std::unordered_map<jlong, std::shared_ptr<QuantizeJob>> g_quantize_jobs;
+
+static std::shared_ptr<QuantizeJob> get_quantize_job(jlong handle) {
+	std::lock_guard<std::mutex> lock(g_quantize_jobs_mutex);
+	auto it = g_quantize_jobs.find(handle);
+	return (it != g_quantize_jobs.end()) ? it->second : nullptr;
+}
+
+static void quantize_observer(ggml_log_level level, const char* text, void* user_data) {
+	QuantizeJob* job = static_cast<QuantizeJob*>(user_data);
+	int index = 0;
+	int count = 0;
+	char name[256];
+	// Only the tensor lines of llama_model_quantize, thrown through C++ frames alone
+	if (level != GGML_LOG_LEVEL_INFO || text[0] != '[' || !std::strstr(text, " - [") ||
+			std::sscanf(text, "[%d/%d] %255s", &index, &count, name) != 3) {
+		return;
+	}
+	if (job->cancelled && !job->aborted) {
+		job->aborted = true;
+		throw std::runtime_error("quantization was cancelled");
+	}
+	std::lock_guard<std::mutex> lock(job->mutex);
+	job->n_tensors = count;
+	job->tensors.push_back(name);
+}
+
+static ggml_type parse_ggml_type(const std::string& name) {
+	for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+		const char* type_name = ggml_type_name(static_cast<ggml_type>(i));
+		if (!type_name || std::strlen(type_name) != name.size()) continue;
+		bool equal = true;
+		for (size_t c = 0; c < name.size() && equal; c++) {
+			equal = std::tolower((unsigned char)type_name[c]) == std::tolower((unsigned char)name[c]);
+		}
+		if (equal) return static_cast<ggml_type>(i);
+	}
+	return GGML_TYPE_COUNT;
+}
+
+// Importance matrix of llama-imatrix, either GGUF (per tensor "<name>.in_sum2" and "<name>.counts")
+// or the legacy .dat format, as the mean squared activations llama_model_quantize expects
+static bool load_imatrix(const std::string& path, std::unordered_map<std::string, std::vector<float>>& imatrix,
+		std::string& error) {
+	std::ifstream in(path, std::ios::binary);
+	char magic[4] = {0};
+	if (!in || !in.read(magic, sizeof(magic))) {
+		error = "Failed to read imatrix file: " + path;
+		return false;
+	}
+
+	if (std::memcmp(magic, "GGUF", 4) == 0) {
+		in.close();
+		ggml_context* ctx = nullptr;
+		gguf_init_params gguf_params = { /* no_alloc */ false, &ctx };
+		gguf_context* gguf = gguf_init_from_file(path.c_str(), gguf_params);
+		if (!gguf) {
+			error = "Failed to read imatrix file: " + path;
+			return false;
+		}
+		const std::string sums_suffix = ".in_sum2";
+		for (int64_t i = 0; i < gguf_get_n_tensors(gguf); i++) {
+			std::string tensor_name = gguf_get_tensor_name(gguf, i);
+			if (tensor_name.size() <= sums_suffix.size() ||
+					tensor_name.compare(tensor_name.size() - sums_suffix.size(), sums_suffix.size(), sums_suffix) != 0) {
+				continue;
+			}
+			std::string name = tensor_name.substr(0, tensor_name.size() - sums_suffix.size());
+			ggml_tensor* sums = ggml_get_tensor(ctx, tensor_name.c_str());
+			ggml_tensor* counts = ggml_get_tensor(ctx, (name + ".counts").c_str());
+			if (!sums || !counts || sums->type != GGML_TYPE_F32 || counts->type != GGML_TYPE_F32 ||
+					ggml_nelements(counts) != sums->ne[1]) {
+				error = "Malformed imatrix entry " + name + " in " + path;
+				gguf_free(gguf);
+				ggml_free(ctx);
+				return false;
+			}
+			// One row per expert, rows nothing was collected for stay neutral
+			const int64_t ne0 = sums->ne[0];
+			const float* sums_data = static_cast<const float*>(sums->data);
+			const float* counts_data = static_cast<const float*>(counts->data);
+			std::vector<float>& values = imatrix[name];
+			values.resize(ggml_nelements(sums));
+			for (int64_t row = 0; row < sums->ne[1]; row++) {
+				float count = counts_data[row];
+				for (int64_t col = 0; col < ne0; col++) {
+					values[row * ne0 + col] = count > 0.0f ? sums_data[row * ne0 + col] / count : 1.0f;
+				}
+			}
+		}
+		gguf_free(gguf);
+		ggml_free(ctx);
+		return true;
+	}
+
+	int32_t n_entries;
+	std::memcpy(&n_entries, magic, sizeof(n_entries));
+	for (int32_t i = 0; i < n_entries; i++) {
+		int32_t len = 0;
+		int32_t ncall = 0;
+		int32_t nval = 0;
+		std::string name;
+		bool ok = in.read(reinterpret_cast<char*>(&len), sizeof(len)) && len > 0;
+		if (ok) {
+			name.resize(len);
+			ok = in.read(&name[0], len) && in.read(reinterpret_cast<char*>(&ncall), sizeof(ncall)) &&
+				in.read(reinterpret_cast<char*>(&nval), sizeof(nval)) && nval > 0;
+		}
+		std::vector<float>& values = imatrix[name];
+		if (ok) {
+			values.resize(nval);
+			ok = (bool)in.read(reinterpret_cast<char*>(values.data()), nval * sizeof(float));
+		}
+		if (!ok) {
+			error = "Malformed imatrix file: " + path;
+			imatrix.clear();
+			return false;
+		}
+		if (ncall > 0) {
+			for (float& value : values) value /= ncall;
+		}
+	}
+	return true;
+}
+
+// Quantize on the calling thread, the error is left in the job. Without keep_split the output is
+// written next to its path and renamed once complete, so a failed or cancelled run never leaves a
+// truncated file behind that a rerun would take for finished.
+static bool run_quantize(QuantizeJob& job) {
+	QuantizeOptions& options = job.options;
+	if (!options.imatrix_path.empty() && !load_imatrix(options.imatrix_path, options.imatrix, job.error)) {
+		return false;
+	}
+	options.bind();
+
+	std::string target = options.params.keep_split ? job.output : job.output + ".part";
+	uint32_t result;
+	{
+		JLLAMA_TRACE_SPAN("quantize", "quantize_model");
+		LogRouter::observe(quantize_observer, &job);
+		result = llama_model_quantize(job.input.c_str(), target.c_str(), &options.params);
+		LogRouter::observe(nullptr, nullptr);
+	}
+
+	if (result != 0 || job.cancelled) {
+		if (!options.params.keep_split) std::remove(target.c_str());
+		job.error = job.cancelled ? "Quantization was cancelled"
+			: "Model quantization failed with error code: " + std::to_string(result);
+		return false;
+	}
+	if (!options.params.keep_split) {
+		std::remove(job.output.c_str());
+		if (std::rename(target.c_str(), job.output.c_str()) != 0) {
+			job.error = "Failed to rename " + target + " to " + job.output;
+			return false;
+		}
+	}
+	return true;
+}
 
 jobject QuantizationManager::getDefaultQuantizationParams(JNIEnv* env) {
 	JNI_TRY(env)
@@ -20,145 +221,284 @@ jint QuantizationManager::quantizeModel(JNIEnv* env, jstring inputPath, jstring
 		return -1;
 	}
 
-	const char* inputStr = env->GetStringUTFChars(inputPath, nullptr);
-	if (!inputStr) {
-		JNIErrorHandler::throw_runtime_exception(env, "Failed to get input path string");
+	QuantizeJob job;
+	job.input = JniUtils::jstring_to_string(env, inputPath);
+	job.output = JniUtils::jstring_to_string(env, outputPath);
+	if (!convertJavaParams(env, params, job.options)) {
 		return -1;
 	}
 
-	const char* outputStr = env->GetStringUTFChars(outputPath, nullptr);
-	if (!outputStr) {
-		env->ReleaseStringUTFChars(inputPath, inputStr);
-		JNIErrorHandler::throw_runtime_exception(env, "Failed to get output path string");
+	if (!run_quantize(job)) {
+		JNIErrorHandler::throw_java_exception(env, "de/kherud/llama/LlamaException", job.error);
 		return -1;
 	}
+	return 0;
+
+	JNI_CATCH_RET(env, -1)
+}
 
-	llama_model_quantize_params quantizeParams;
-	if (params) {
-		quantizeParams = convertJavaParams(env, params);
-		if (env->ExceptionCheck()) {
-			env->ReleaseStringUTFChars(inputPath, inputStr);
-			env->ReleaseStringUTFChars(outputPath, outputStr);
-			return -1;
+jlong QuantizationManager::startQuantize(JNIEnv* env, jstring inputPath, jstring outputPath, jobject params) {
+	JNI_TRY(env)
+
+	if (!inputPath || !outputPath) {
+		JNIErrorHandler::throw_illegal_argument(env, "Input and output paths cannot be null");
+		return 0;
+	}
+
+	auto job = std::make_shared<QuantizeJob>();
+	job->input = JniUtils::jstring_to_string(env, inputPath);
+	job->output = JniUtils::jstring_to_string(env, outputPath);
+	if (!convertJavaParams(env, params, job->options)) {
+		return 0;
+	}
+
+	// The thread only uses the job, never JNI
+	job->thread = std::thread([job]() {
+		run_quantize(*job);
+		{
+			std::lock_guard<std::mutex> lock(job->mutex);
+			job->done = true;
 		}
-	} else {
-		quantizeParams = llama_model_quantize_default_params();
+		job->done_cv.notify_all();
+	});
+
+	jlong handle = reinterpret_cast<jlong>(job.get());
+	{
+		std::lock_guard<std::mutex> lock(g_quantize_jobs_mutex);
+		g_quantize_jobs[handle] = job;
 	}
+	return handle;
 
-	uint32_t result = llama_model_quantize(inputStr, outputStr, &quantizeParams);
+	JNI_CATCH_RET(env, 0)
+}
 
-	env->ReleaseStringUTFChars(inputPath, inputStr);
-	env->ReleaseStringUTFChars(outputPath, outputStr);
+jint QuantizationManager::getQuantizeTensorCount(JNIEnv* env, jlong job_handle) {
+	std::shared_ptr<QuantizeJob> job = get_quantize_job(job_handle);
+	if (!job) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> lock(job->mutex);
+	return job->n_tensors;
+}
 
-	return static_cast<jint>(result);
+jobjectArray QuantizationManager::getQuantizeTensors(JNIEnv* env, jlong job_handle, jint from) {
+	JNI_TRY(env)
 
-	JNI_CATCH_RET(env, -1)
+	std::vector<std::string> names;
+	std::shared_ptr<QuantizeJob> job = get_quantize_job(job_handle);
+	if (job) {
+		std::lock_guard<std::mutex> lock(job->mutex);
+		for (size_t i = from > 0 ? (size_t)from : 0; i < job->tensors.size(); i++) {
+			names.push_back(job->tensors[i]);
+		}
+	}
+
+	jobjectArray result = env->NewObjectArray((jsize)names.size(), JniUtils::cache().string_class, nullptr);
+	if (!result) {
+		return nullptr;
+	}
+	for (size_t i = 0; i < names.size(); i++) {
+		jstring name = env->NewStringUTF(names[i].c_str());
+		env->SetObjectArrayElement(result, (jsize)i, name);
+		env->DeleteLocalRef(name);
+	}
+	return result;
+
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jboolean QuantizationManager::awaitQuantize(JNIEnv* env, jlong job_handle, jlong timeout_ms) {
+	std::shared_ptr<QuantizeJob> job = get_quantize_job(job_handle);
+	if (!job) {
+		return JNI_TRUE;
+	}
+	std::unique_lock<std::mutex> lock(job->mutex);
+	job->done_cv.wait_for(lock, std::chrono::milliseconds(std::max<jlong>(0, timeout_ms)),
+		[&job] { return job->done; });
+	return job->done ? JNI_TRUE : JNI_FALSE;
 }
 
-llama_model_quantize_params QuantizationManager::convertJavaParams(JNIEnv* env, jobject javaParams) {
-	llama_model_quantize_params params = llama_model_quantize_default_params();
+void QuantizationManager::cancelQuantize(JNIEnv* env, jlong job_handle) {
+	std::shared_ptr<QuantizeJob> job = get_quantize_job(job_handle);
+	if (job) {
+		job->cancelled = true;
+	}
+}
+
+void QuantizationManager::finishQuantize(JNIEnv* env, jlong job_handle) {
+	JNI_TRY(env)
+
+	std::shared_ptr<QuantizeJob> job;
+	{
+		std::lock_guard<std::mutex> lock(g_quantize_jobs_mutex);
+		auto it = g_quantize_jobs.find(job_handle);
+		if (it == g_quantize_jobs.end()) {
+			JNIErrorHandler::throw_illegal_state(env, "Quantization was already finished");
+			return;
+		}
+		job = std::move(it->second);
+		g_quantize_jobs.erase(it);
+	}
+
+	// Blocks until the job completed or noticed its cancellation at the next tensor
+	job->thread.join();
+	if (!job->error.empty()) {
+		JNIErrorHandler::throw_java_exception(env, "de/kherud/llama/LlamaException", job->error);
+	}
+
+	JNI_CATCH_RET(env, /* void */)
+}
+
+bool QuantizationManager::convertJavaParams(JNIEnv* env, jobject javaParams, QuantizeOptions& options) {
+	llama_model_quantize_params& params = options.params;
 
 	if (!javaParams) {
-		return params;
+		return true;
 	}
 
-	jclass paramsClass = env->GetObjectClass(javaParams);
+	const JniCache& jni = JniUtils::cache();
 
 	// Get nthread field
-	jfieldID nthreadField = env->GetFieldID(paramsClass, "nthread", "I");
+	jfieldID nthreadField = jni.quantization_params_nthread;
 	if (nthreadField) {
 		params.nthread = env->GetIntField(javaParams, nthreadField);
 	}
 
 	// Get ftype field (as int)
-	jfieldID ftypeField = env->GetFieldID(paramsClass, "ftype", "I");
+	jfieldID ftypeField = jni.quantization_params_ftype;
 	if (ftypeField) {
 		int ftype = env->GetIntField(javaParams, ftypeField);
 		params.ftype = static_cast<llama_ftype>(ftype);
 	}
 
 	// Get boolean fields
-	jfieldID allowRequantizeField = env->GetFieldID(paramsClass, "allowRequantize", "Z");
+	jfieldID allowRequantizeField = jni.quantization_params_allow_requantize;
 	if (allowRequantizeField) {
 		params.allow_requantize = env->GetBooleanField(javaParams, allowRequantizeField);
 	}
 
-	jfieldID quantizeOutputField = env->GetFieldID(paramsClass, "quantizeOutputTensor", "Z");
+	jfieldID quantizeOutputField = jni.quantization_params_quantize_output_tensor;
 	if (quantizeOutputField) {
 		params.quantize_output_tensor = env->GetBooleanField(javaParams, quantizeOutputField);
 	}
 
-	jfieldID onlyCopyField = env->GetFieldID(paramsClass, "onlyCopy", "Z");
+	jfieldID onlyCopyField = jni.quantization_params_only_copy;
 	if (onlyCopyField) {
 		params.only_copy = env->GetBooleanField(javaParams, onlyCopyField);
 	}
 
-	jfieldID pureField = env->GetFieldID(paramsClass, "pure", "Z");
+	jfieldID pureField = jni.quantization_params_pure;
 	if (pureField) {
 		params.pure = env->GetBooleanField(javaParams, pureField);
 	}
 
-	jfieldID keepSplitField = env->GetFieldID(paramsClass, "keepSplit", "Z");
+	jfieldID keepSplitField = jni.quantization_params_keep_split;
 	if (keepSplitField) {
 		params.keep_split = env->GetBooleanField(javaParams, keepSplitField);
 	}
 
-	return params;
+	// Type names as ggml spells them, e.g. "q6_K", empty for the default of the ftype
+	jfieldID typeFields[] = { jni.quantization_params_output_tensor_type, jni.quantization_params_token_embedding_type };
+	ggml_type* typeTargets[] = { &params.output_tensor_type, &params.token_embedding_type };
+	for (int i = 0; i < 2; i++) {
+		jfieldID typeField = typeFields[i];
+		jstring typeName = typeField ? (jstring)env->GetObjectField(javaParams, typeField) : nullptr;
+		if (!typeName) continue;
+		std::string name = JniUtils::jstring_to_string(env, typeName);
+		env->DeleteLocalRef(typeName);
+		if (name.empty()) continue;
+		*typeTargets[i] = parse_ggml_type(name);
+		if (*typeTargets[i] == GGML_TYPE_COUNT) {
+			JNIErrorHandler::throw_illegal_argument(env, "Unknown tensor type: " + name);
+			return false;
+		}
+	}
+
+	// Overrides by tensor name pattern, the first matching one applies
+	jfieldID patternsField = jni.quantization_params_tensor_type_patterns;
+	jfieldID typesField = jni.quantization_params_tensor_type_names;
+	jobjectArray patterns = patternsField ? (jobjectArray)env->GetObjectField(javaParams, patternsField) : nullptr;
+	jobjectArray types = typesField ? (jobjectArray)env->GetObjectField(javaParams, typesField) : nullptr;
+	jsize n_overrides = patterns && types ? std::min(env->GetArrayLength(patterns), env->GetArrayLength(types)) : 0;
+	for (jsize i = 0; i < n_overrides; i++) {
+		jstring pattern = (jstring)env->GetObjectArrayElement(patterns, i);
+		jstring type = (jstring)env->GetObjectArrayElement(types, i);
+		TensorQuantization tensor_type;
+		tensor_type.name = pattern ? JniUtils::jstring_to_string(env, pattern) : "";
+		std::string type_name = type ? JniUtils::jstring_to_string(env, type) : "";
+		env->DeleteLocalRef(pattern);
+		env->DeleteLocalRef(type);
+		tensor_type.quant = parse_ggml_type(type_name);
+		if (tensor_type.name.empty() || tensor_type.quant == GGML_TYPE_COUNT) {
+			JNIErrorHandler::throw_illegal_argument(env, "Invalid tensor type override: " + tensor_type.name + "=" + type_name);
+			return false;
+		}
+		options.tensor_types.push_back(tensor_type);
+	}
+
+	// Read by the quantizing thread, a large matrix should not block the caller
+	jfieldID imatrixField = jni.quantization_params_imatrix_path;
+	jstring imatrixPath = imatrixField ? (jstring)env->GetObjectField(javaParams, imatrixField) : nullptr;
+	if (imatrixPath) {
+		options.imatrix_path = JniUtils::jstring_to_string(env, imatrixPath);
+		env->DeleteLocalRef(imatrixPath);
+	}
+
+	return !env->ExceptionCheck();
 }
 
 jobject QuantizationManager::createJavaParams(JNIEnv* env, const llama_model_quantize_params& params) {
-	jclass paramsClass = env->FindClass("de/kherud/llama/LlamaQuantizer$QuantizationParams");
-	if (!paramsClass) {
+	const JniCache& jni = JniUtils::cache();
+	if (!jni.quantization_params_class) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to find QuantizationParams class");
 		return nullptr;
 	}
 
-	jmethodID constructor = env->GetMethodID(paramsClass, "<init>", "()V");
-	if (!constructor) {
+	if (!jni.quantization_params_init) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to find QuantizationParams constructor");
 		return nullptr;
 	}
 
-	jobject javaParams = env->NewObject(paramsClass, constructor);
+	jobject javaParams = env->NewObject(jni.quantization_params_class, jni.quantization_params_init);
 	if (!javaParams) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to create QuantizationParams object");
 		return nullptr;
 	}
 
 	// Set nthread field
-	jfieldID nthreadField = env->GetFieldID(paramsClass, "nthread", "I");
+	jfieldID nthreadField = jni.quantization_params_nthread;
 	if (nthreadField) {
 		env->SetIntField(javaParams, nthreadField, params.nthread);
 	}
 
 	// Set ftype field
-	jfieldID ftypeField = env->GetFieldID(paramsClass, "ftype", "I");
+	jfieldID ftypeField = jni.quantization_params_ftype;
 	if (ftypeField) {
 		env->SetIntField(javaParams, ftypeField, static_cast<int>(params.ftype));
 	}
 
 	// Set boolean fields
-	jfieldID allowRequantizeField = env->GetFieldID(paramsClass, "allowRequantize", "Z");
+	jfieldID allowRequantizeField = jni.quantization_params_allow_requantize;
 	if (allowRequantizeField) {
 		env->SetBooleanField(javaParams, allowRequantizeField, params.allow_requantize);
 	}
 
-	jfieldID quantizeOutputField = env->GetFieldID(paramsClass, "quantizeOutputTensor", "Z");
+	jfieldID quantizeOutputField = jni.quantization_params_quantize_output_tensor;
 	if (quantizeOutputField) {
 		env->SetBooleanField(javaParams, quantizeOutputField, params.quantize_output_tensor);
 	}
 
-	jfieldID onlyCopyField = env->GetFieldID(paramsClass, "onlyCopy", "Z");
+	jfieldID onlyCopyField = jni.quantization_params_only_copy;
 	if (onlyCopyField) {
 		env->SetBooleanField(javaParams, onlyCopyField, params.only_copy);
 	}
 
-	jfieldID pureField = env->GetFieldID(paramsClass, "pure", "Z");
+	jfieldID pureField = jni.quantization_params_pure;
 	if (pureField) {
 		env->SetBooleanField(javaParams, pureField, params.pure);
 	}
 
-	jfieldID keepSplitField = env->GetFieldID(paramsClass, "keepSplit", "Z");
+	jfieldID keepSplitField = jni.quantization_params_keep_split;
 	if (keepSplitField) {
 		env->SetBooleanField(javaParams, keepSplitField, params.keep_split);
 	}
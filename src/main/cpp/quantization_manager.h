@@ -3,15 +3,56 @@
 
 #include <jni.h>
 #include "llama.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Same layout as llama-quant.cpp's tensor_quantization, the element type llama_model_quantize
+// expects behind llama_model_quantize_params::tensor_types
+struct TensorQuantization {
+	std::string name;  // Regex matched against tensor names
+	ggml_type quant = GGML_TYPE_COUNT;
+};
+
+// Quantization parameters with the storage their pointers refer to. Copies must call bind again.
+struct QuantizeOptions {
+	llama_model_quantize_params params = llama_model_quantize_default_params();
+	std::vector<TensorQuantization> tensor_types;
+	std::string imatrix_path;
+	std::unordered_map<std::string, std::vector<float>> imatrix;
+
+	void bind() {
+		params.tensor_types = tensor_types.empty() ? nullptr : &tensor_types;
+		params.imatrix = imatrix.empty() ? nullptr : &imatrix;
+	}
+};
 
 class QuantizationManager {
 public:
 	static jobject getDefaultQuantizationParams(JNIEnv* env);
 	static jint quantizeModel(JNIEnv* env, jstring inputPath, jstring outputPath, jobject params);
 
+	// Quantize on a background thread, returns a job handle
+	static jlong startQuantize(JNIEnv* env, jstring inputPath, jstring outputPath, jobject params);
+
+	// Tensors of the model, 0 until the input was read
+	static jint getQuantizeTensorCount(JNIEnv* env, jlong job);
+
+	// Names of the tensors quantization reached since the given index, in model order
+	static jobjectArray getQuantizeTensors(JNIEnv* env, jlong job, jint from);
+
+	// Wait up to timeout_ms for the job to end, returns true once it did
+	static jboolean awaitQuantize(JNIEnv* env, jlong job, jlong timeout_ms);
+
+	// Abort the job before its next tensor
+	static void cancelQuantize(JNIEnv* env, jlong job);
+
+	// Wait for the job and free it, throws if quantization failed or was cancelled
+	static void finishQuantize(JNIEnv* env, jlong job);
+
 private:
-	static llama_model_quantize_params convertJavaParams(JNIEnv* env, jobject javaParams);
+	static bool convertJavaParams(JNIEnv* env, jobject javaParams, QuantizeOptions& options);
 	static jobject createJavaParams(JNIEnv* env, const llama_model_quantize_params& params);
 };
 
-#endif // QUANTIZATION_MANAGER_H
\ No newline at end of file
+#endif // QUANTIZATION_MANAGER_H
@@ -2,150 +2,279 @@
 #include "jni_utils.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
+#include "server_table.h"
+#include "jni_logger.h"
+#include "native_trace.h"
+#include "memory_manager.h"
 #include <vector>
 #include <string>
 #include <mutex>
 #include <unordered_map>
 #include <memory>
+#include <algorithm>
 
-// These are defined in jllama.cpp but we need access to them
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_reranking_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
+jobject RerankingManager::rerank(JNIEnv* env, jobject obj, jstring query, jobjectArray documents) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return nullptr;
+	// One sequence per document and one for the shared query prefix, as many as are free
+	SequenceLease lease(server, (size_t)env->GetArrayLength(documents) + 1);
+	
+	std::vector<jsize> doc_indices;
+	std::vector<float> scores;
+	std::vector<bool> scored;
+	if (!scoreDocuments(env, server, lease, JniUtils::jstring_to_string(env, query), toStrings(env, documents),
+			doc_indices, scores, scored)) {
+		return nullptr;
+	}
+	
+	// Create HashMap for probabilities (document -> score mapping), keyed by the caller's own strings
+	const JniCache& jni = JniUtils::cache();
+	jobject probabilities = JniUtils::new_hashmap(env);
+	
+	for (size_t i = 0; i < doc_indices.size(); i++) {
+		if (!scored[i]) continue;
+		
+		jobject doc_key = env->GetObjectArrayElement(documents, doc_indices[i]);
+		jobject score_obj = env->NewObject(jni.float_class, jni.float_init, scores[i]);
+		
+		env->CallObjectMethod(probabilities, jni.hashmap_put, doc_key, score_obj);
+		
+		env->DeleteLocalRef(doc_key);
+		env->DeleteLocalRef(score_obj);
+	}
+	
+	// Reranking doesn't return text content
+	return JniUtils::new_llama_output(env, nullptr, 0, probabilities, true);
+	
+	JNI_CATCH_RET(env, nullptr)
 }
 
-jobject RerankingManager::rerank(JNIEnv* env, jobject obj, jstring query, jobjectArray documents) {
+jobject RerankingManager::rerankTopK(JNIEnv* env, jobject obj, jstring query, jobjectArray documents, jint k) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_reranking_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return nullptr;
+	SequenceLease lease(server, (size_t)env->GetArrayLength(documents) + 1);
+	
+	std::vector<jint> top_indices;
+	std::vector<float> top_scores;
+	if (!rankTopK(env, server, lease, JniUtils::jstring_to_string(env, query), toStrings(env, documents),
+			(size_t)std::max(0, (int)k), top_indices, top_scores)) {
+		return nullptr;
+	}
+	
+	return JniUtils::new_rerank_result(env, top_indices, top_scores);
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+bool RerankingManager::rankTopK(JNIEnv* env, LlamaServer* server, const SequenceLease& lease, const std::string& query,
+		const std::vector<std::string>& documents, size_t k, std::vector<jint>& indices, std::vector<float>& scores) {
+	std::vector<jsize> doc_indices;
+	std::vector<float> doc_scores;
+	std::vector<bool> scored;
+	if (!scoreDocuments(env, server, lease, query, documents, doc_indices, doc_scores, scored)) {
+		return false;
+	}
+	
+	// Select the k best scored documents, only those are sorted
+	std::vector<size_t> order;
+	order.reserve(doc_indices.size());
+	for (size_t i = 0; i < doc_indices.size(); i++) {
+		if (scored[i]) order.push_back(i);
+	}
+	size_t n_top = std::min(order.size(), k);
+	std::partial_sort(order.begin(), order.begin() + n_top, order.end(), [&](size_t a, size_t b) {
+		return doc_scores[a] > doc_scores[b] || (doc_scores[a] == doc_scores[b] && doc_indices[a] < doc_indices[b]);
+	});
+	
+	indices.resize(n_top);
+	scores.resize(n_top);
+	for (size_t i = 0; i < n_top; i++) {
+		indices[i] = doc_indices[order[i]];
+		scores[i] = doc_scores[order[i]];
+	}
+	return true;
+}
+
+std::vector<std::string> RerankingManager::toStrings(JNIEnv* env, jobjectArray documents) {
+	jsize num_documents = env->GetArrayLength(documents);
+	std::vector<std::string> result;
+	result.reserve(num_documents);
+	for (jsize i = 0; i < num_documents; i++) {
+		jstring doc_jstr = (jstring)env->GetObjectArrayElement(documents, i);
+		result.push_back(JniUtils::jstring_to_string(env, doc_jstr));
+		env->DeleteLocalRef(doc_jstr);
+	}
+	return result;
+}
+
+bool RerankingManager::scoreDocuments(JNIEnv* env, LlamaServer* server, const SequenceLease& lease,
+		const std::string& query_str, const std::vector<std::string>& documents,
+		std::vector<jsize>& doc_indices, std::vector<float>& scores, std::vector<bool>& scored) {
+	JLLAMA_TRACE_SPAN("rerank", "score_documents");
 	
 	// Check if reranking mode is enabled
 	if (!server->reranking_mode) {
 		JNIErrorHandler::throw_illegal_state(env,
 			"Model was not loaded with reranking support (see ModelParameters#enableReranking())");
-		return nullptr;
+		return false;
+	}
+	if (lease.empty()) {
+		JNIErrorHandler::throw_illegal_state(env, "The server is stopped");
+		return false;
 	}
 	
-	std::string query_str = JniUtils::jstring_to_string(env, query);
-	
-	// Get documents from Java array
-	jsize num_documents = env->GetArrayLength(documents);
+	jsize num_documents = (jsize)documents.size();
 	if (num_documents == 0) {
 		JNIErrorHandler::throw_illegal_argument(env,
 			"No documents provided for reranking");
-		return nullptr;
+		return false;
 	}
 	
 	const llama_vocab* vocab = llama_model_get_vocab(server->model);
 	
+	// Token vectors live in the thread's scratch arena for the duration of the call
+	ArenaScope scratch(g_scratch_arena);
+	
 	// Tokenize query
-	std::vector<llama_token> query_tokens = tokenizeText(vocab, query_str);
-	if (query_tokens.empty()) {
+	ArenaVector<llama_token> query_tokens{ArenaAllocator<llama_token>(g_scratch_arena)};
+	if (!tokenizeText(vocab, query_str, query_tokens) || query_tokens.empty()) {
 		JNIErrorHandler::throw_runtime_exception(env,
 			"Failed to tokenize query for reranking");
-		return nullptr;
+		return false;
+	}
+	
+	// Build rerank token sequences: [BOS]query[EOS][SEP]doc[EOS],
+	// documents that fail to tokenize are skipped
+	ArenaVector<ArenaVector<llama_token>> sequences{ArenaAllocator<ArenaVector<llama_token>>(g_scratch_arena)};
+	sequences.reserve(num_documents);
+	ArenaVector<llama_token> doc_tokens{ArenaAllocator<llama_token>(g_scratch_arena)};
+	for (jsize i = 0; i < num_documents; i++) {
+		if (!tokenizeText(vocab, documents[i], doc_tokens) || doc_tokens.empty()) continue;
+		doc_indices.push_back(i);
+		sequences.emplace_back(ArenaAllocator<llama_token>(g_scratch_arena));
+		buildRerankTokenSequence(vocab, query_tokens, doc_tokens, sequences.back());
 	}
 	
-	// Create LlamaOutput result object
-	jclass output_class = env->FindClass("de/kherud/llama/LlamaOutput");
-	if (!output_class) return nullptr;
+	scores.assign(sequences.size(), 0.0f);
+	scored.assign(sequences.size(), false);
+	scoreSequences(server->ctx, server->batches, lease, vocab, query_tokens, sequences, scores, scored);
+	return true;
+}
+
+// Helper function implementations
+size_t RerankingManager::sharedPrefixLength(const llama_vocab* vocab, const ArenaVector<llama_token>& query_tokens) {
+	size_t n_prefix = query_tokens.size();
+	if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) n_prefix++;
+	if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) n_prefix++;
+	if (llama_vocab_sep(vocab) != LLAMA_TOKEN_NULL) n_prefix++;
+	return n_prefix;
+}
+
+void RerankingManager::scoreSequences(llama_context* ctx, BatchPool& batches, const SequenceLease& lease,
+		const llama_vocab* vocab, const ArenaVector<llama_token>& query_tokens,
+		const ArenaVector<ArenaVector<llama_token>>& sequences,
+		std::vector<float>& scores, std::vector<bool>& scored) {
+	if (sequences.empty()) return;
 	
-	jmethodID constructor = env->GetMethodID(output_class, "<init>", "([BLjava/util/Map;Z)V");
-	if (!constructor) return nullptr;
+	const enum llama_pooling_type pooling_type = llama_pooling_type(ctx);
+	const int n_budget = (int)std::min(llama_n_batch(ctx), llama_n_ubatch(ctx));
+	const size_t n_seqs = lease.size();
+	llama_memory_t mem = llama_get_memory(ctx);
 	
-	// Create empty byte array (reranking doesn't return text content)
-	jbyteArray byte_array = env->NewByteArray(0);
+	// With last-token pooling a document only attends to what precedes it, so the query prefix
+	// can be decoded once in the first leased sequence and copied into every document sequence. CLS
+	// and rank pooling read the first token of the sequence and need the whole sequence in one ubatch.
+	const bool share_prefix = pooling_type == LLAMA_POOLING_TYPE_LAST && n_seqs > 1;
+	const size_t n_prefix = share_prefix ? sharedPrefixLength(vocab, query_tokens) : 0;
+	const size_t first_slot = share_prefix ? 1 : 0;
 	
-	// Create HashMap for probabilities (document -> score mapping)
-	jclass hashmap_class = env->FindClass("java/util/HashMap");
-	jmethodID hashmap_init = env->GetMethodID(hashmap_class, "<init>", "()V");
-	jmethodID hashmap_put = env->GetMethodID(hashmap_class, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-	jobject probabilities = env->NewObject(hashmap_class, hashmap_init);
+	BatchLease batch = batches.lease();
 	
-	// Process each document
-	for (jsize i = 0; i < num_documents; i++) {
-		jstring doc_jstr = (jstring)env->GetObjectArrayElement(documents, i);
-		std::string doc_str = JniUtils::jstring_to_string(env, doc_jstr);
-		
-		// Tokenize document
-		std::vector<llama_token> doc_tokens = tokenizeText(vocab, doc_str);
-		if (doc_tokens.empty()) {
-			env->DeleteLocalRef(doc_jstr);
-			continue; // Skip this document
+	if (share_prefix) {
+		if ((int)n_prefix > n_budget) {
+			JNI_LOG_WARN("Rerank query has %zu tokens, the batch size is %d", n_prefix, n_budget);
+			return;
 		}
-		
-		// Build rerank token sequence: [BOS]query[EOS][SEP]doc[EOS]
-		std::vector<llama_token> rerank_tokens = buildRerankTokenSequence(vocab, query_tokens, doc_tokens);
-		int total_tokens = rerank_tokens.size();
-		
-		// Clear previous memory for clean state
-		llama_memory_clear(llama_get_memory(server->ctx), true);
-		
-		// Create batch for reranking computation
-		llama_batch batch = llama_batch_init(total_tokens, 0, 1);
-		for (int j = 0; j < total_tokens; j++) {
-			batch.token[j] = rerank_tokens[j];
-			batch.pos[j] = j;
-			batch.n_seq_id[j] = 1;
-			batch.seq_id[j][0] = 0;
-			batch.logits[j] = true; // We need embeddings for reranking
+		const ArenaVector<llama_token>& first = sequences.front();
+		batch->n_tokens = 0;
+		for (size_t j = 0; j < n_prefix; j++) {
+			int k = batch->n_tokens++;
+			batch->token[k] = first[j];
+			batch->pos[k] = (llama_pos)j;
+			batch->n_seq_id[k] = 1;
+			batch->seq_id[k][0] = lease[0];
+			batch->logits[k] = false;
 		}
-		batch.n_tokens = total_tokens;
-		
-		// Process the batch to compute reranking score
-		if (llama_decode(server->ctx, batch) != 0) {
-			llama_batch_free(batch);
-			env->DeleteLocalRef(doc_jstr);
-			continue; // Skip this document
+		if (llama_decode(ctx, *batch) != 0) {
+			JNI_LOG_WARN("Failed to decode shared rerank prefix");
+			return;
 		}
-		
-		// Get embeddings for reranking score
-		enum llama_pooling_type pooling_type = llama_pooling_type(server->ctx);
-		
-		const float* embd = nullptr;
-		if (pooling_type == LLAMA_POOLING_TYPE_RANK) {
-			// For reranking models, get the sequence embedding which contains the score
-			embd = llama_get_embeddings_seq(server->ctx, 0);
-		} else if (pooling_type == LLAMA_POOLING_TYPE_NONE) {
-			// Fallback: get embedding from last token
-			embd = llama_get_embeddings_ith(server->ctx, total_tokens - 1);
-		} else {
-			// Other pooling types
-			embd = llama_get_embeddings_seq(server->ctx, 0);
+	}
+	
+	ArenaVector<int> last_index(n_seqs, 0, ArenaAllocator<int>(g_scratch_arena));
+	size_t next = 0;
+	while (next < sequences.size()) {
+		// Pack as many documents as fit into the token budget, one sequence each
+		size_t first = next;
+		batch->n_tokens = 0;
+		while (next < sequences.size() && first_slot + (next - first) < n_seqs) {
+			const ArenaVector<llama_token>& tokens = sequences[next];
+			int n_tokens = (int)(tokens.size() - n_prefix);
+			if (n_tokens > n_budget) {
+				if (next == first) {
+					JNI_LOG_WARN("Rerank document %zu has %d tokens, the batch size is %d", next, n_tokens, n_budget);
+					first = ++next;
+					continue;
+				}
+				break;
+			}
+			if (batch->n_tokens + n_tokens > n_budget) break;
+			
+			const size_t slot = first_slot + (next - first);
+			llama_seq_id seq = lease[slot];
+			if (share_prefix) {
+				llama_memory_seq_cp(mem, lease[0], seq, -1, -1);
+			}
+			for (size_t j = n_prefix; j < tokens.size(); j++) {
+				int k = batch->n_tokens++;
+				batch->token[k] = tokens[j];
+				batch->pos[k] = (llama_pos)j;
+				batch->n_seq_id[k] = 1;
+				batch->seq_id[k][0] = seq;
+				batch->logits[k] = true; // We need embeddings for reranking
+			}
+			last_index[slot] = batch->n_tokens - 1;
+			next++;
 		}
+		if (next == first) continue;
 		
-		llama_batch_free(batch);
-		
-		float score = computeRerankScore(embd, pooling_type);
-		
-		// Add document and score to the result map
-		jstring doc_key = env->NewStringUTF(doc_str.c_str());
-		jclass float_class = env->FindClass("java/lang/Float");
-		jmethodID float_constructor = env->GetMethodID(float_class, "<init>", "(F)V");
-		jobject score_obj = env->NewObject(float_class, float_constructor, score);
-		
-		env->CallObjectMethod(probabilities, hashmap_put, doc_key, score_obj);
+		// Process the pack to compute reranking scores, a failed pack skips its documents
+		if (llama_decode(ctx, *batch) == 0) {
+			for (size_t i = first; i < next; i++) {
+				const size_t slot = first_slot + (i - first);
+				const float* embd = pooling_type == LLAMA_POOLING_TYPE_NONE
+					? llama_get_embeddings_ith(ctx, last_index[slot])
+					: llama_get_embeddings_seq(ctx, lease[slot]);
+				if (!embd) continue;
+				scores[i] = computeRerankScore(embd, pooling_type);
+				scored[i] = true;
+			}
+		}
 		
-		env->DeleteLocalRef(doc_key);
-		env->DeleteLocalRef(score_obj);
-		env->DeleteLocalRef(doc_jstr);
+		// Free the document sequences for the next pack, the shared prefix stays in the first one
+		for (size_t slot = first_slot; slot < first_slot + (next - first); slot++) {
+			llama_memory_seq_rm(mem, lease[slot], -1, -1);
+		}
 	}
-	
-	return env->NewObject(output_class, constructor, byte_array, probabilities, (jboolean)true);
-	
-	JNI_CATCH_RET(env, nullptr)
 }
 
-// Helper function implementations
-std::vector<llama_token> RerankingManager::tokenizeText(const llama_vocab* vocab, const std::string& text) {
-	std::vector<llama_token> tokens;
+bool RerankingManager::tokenizeText(const llama_vocab* vocab, const std::string& text, ArenaVector<llama_token>& tokens) {
 	tokens.resize(text.length() + 1);
 	
 	int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
@@ -158,19 +287,20 @@ std::vector<llama_token> RerankingManager::tokenizeText(const llama_vocab* vocab
 	}
 	
 	if (n_tokens < 0) {
-		return std::vector<llama_token>(); // Return empty vector on failure
+		tokens.clear();
+		return false;
 	}
 	
 	tokens.resize(n_tokens);
-	return tokens;
+	return true;
 }
 
-std::vector<llama_token> RerankingManager::buildRerankTokenSequence(
+void RerankingManager::buildRerankTokenSequence(
 	const llama_vocab* vocab,
-	const std::vector<llama_token>& query_tokens,
-	const std::vector<llama_token>& doc_tokens) {
+	const ArenaVector<llama_token>& query_tokens,
+	const ArenaVector<llama_token>& doc_tokens,
+	ArenaVector<llama_token>& rerank_tokens) {
 	
-	std::vector<llama_token> rerank_tokens;
 	rerank_tokens.reserve(query_tokens.size() + doc_tokens.size() + 4);
 	
 	// Add BOS if vocab has it
@@ -201,8 +331,6 @@ std::vector<llama_token> RerankingManager::buildRerankTokenSequence(
 	if (eos_token != LLAMA_TOKEN_NULL) {
 		rerank_tokens.push_back(eos_token);
 	}
-	
-	return rerank_tokens;
 }
 
 float RerankingManager::computeRerankScore(const float* embeddings, enum llama_pooling_type pooling_type) {
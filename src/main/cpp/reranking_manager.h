@@ -5,20 +5,46 @@
 #include <string>
 #include <vector>
 #include "llama.h"
+#include "memory_manager.h"
+
+struct LlamaServer;
+class SequenceLease;
 
 class RerankingManager {
 public:
 	// Rerank documents against a query
 	static jobject rerank(JNIEnv* env, jobject obj, jstring query, jobjectArray documents);
+	
+	// Rerank documents and return the indices and scores of the k best, best first
+	static jobject rerankTopK(JNIEnv* env, jobject obj, jstring query, jobjectArray documents, jint k);
+	
+	// Score documents on the leased sequences of a reranking server and select the k best, best first,
+	// as indices into documents. Returns false with a pending exception if the request is invalid.
+	static bool rankTopK(JNIEnv* env, LlamaServer* server, const SequenceLease& lease, const std::string& query,
+		const std::vector<std::string>& documents, size_t k, std::vector<jint>& indices, std::vector<float>& scores);
 
 private:
 	// Helper functions for reranking
-	static std::vector<llama_token> tokenizeText(const llama_vocab* vocab, const std::string& text);
-	static std::vector<llama_token> buildRerankTokenSequence(
+	static std::vector<std::string> toStrings(JNIEnv* env, jobjectArray documents);
+	// Tokenize and score all documents, doc_indices maps each score to its document.
+	// Returns false with a pending exception if the request is invalid.
+	static bool scoreDocuments(JNIEnv* env, LlamaServer* server, const SequenceLease& lease,
+		const std::string& query, const std::vector<std::string>& documents,
+		std::vector<jsize>& doc_indices, std::vector<float>& scores, std::vector<bool>& scored);
+	static bool tokenizeText(const llama_vocab* vocab, const std::string& text, ArenaVector<llama_token>& tokens);
+	static void buildRerankTokenSequence(
 		const llama_vocab* vocab,
-		const std::vector<llama_token>& query_tokens,
-		const std::vector<llama_token>& doc_tokens
+		const ArenaVector<llama_token>& query_tokens,
+		const ArenaVector<llama_token>& doc_tokens,
+		ArenaVector<llama_token>& rerank_tokens
 	);
+	// Score each rerank sequence, packing as many as fit into one decode on the leased sequences
+	static void scoreSequences(llama_context* ctx, BatchPool& batches, const SequenceLease& lease,
+		const llama_vocab* vocab, const ArenaVector<llama_token>& query_tokens,
+		const ArenaVector<ArenaVector<llama_token>>& sequences,
+		std::vector<float>& scores, std::vector<bool>& scored);
+	// Number of leading tokens every rerank sequence shares: [BOS]query[EOS][SEP]
+	static size_t sharedPrefixLength(const llama_vocab* vocab, const ArenaVector<llama_token>& query_tokens);
 	static float computeRerankScore(const float* embeddings, enum llama_pooling_type pooling_type);
 };
 
@@ -0,0 +1,230 @@
+#include "sampler_pipeline.h"
+#include "jni_logger.h"
+#include "pattern_preprocessor.h"
+#include <nlohmann/json.hpp>
+#include <cmath>
+
+using json = nlohmann::json;
+
+static const char* SAMPLING_KEYS[] = {
+	"temperature", "dynatemp_range", "dynatemp_exponent", "top_k", "top_p", "min_p", "typical_p", "min_keep",
+	"repeat_last_n", "repeat_penalty", "frequency_penalty", "presence_penalty",
+	"dry_multiplier", "dry_base", "dry_allowed_length", "dry_penalty_last_n", "dry_sequence_breakers",
+	"seed", "logit_bias"
+};
+
+// Logit bias entries are [token id, bias] or [text, bias], a bias of false bans the token
+static void parse_logit_bias(const json& entries, const llama_vocab* vocab, std::vector<llama_logit_bias>& out) {
+	if (!entries.is_array()) return;
+	const int n_vocab = llama_vocab_n_tokens(vocab);
+	for (const json& entry : entries) {
+		if (!entry.is_array() || entry.size() != 2) continue;
+
+		float bias;
+		if (entry[1].is_number()) {
+			bias = entry[1].get<float>();
+		} else if (entry[1].is_boolean() && !entry[1].get<bool>()) {
+			bias = -INFINITY;
+		} else {
+			continue;
+		}
+
+		if (entry[0].is_number_integer()) {
+			llama_token token = entry[0].get<llama_token>();
+			if (token >= 0 && token < n_vocab) out.push_back({ token, bias });
+		} else if (entry[0].is_string()) {
+			std::string text = entry[0].get<std::string>();
+			std::vector<llama_token> tokens(text.length() + 1);
+			int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(), tokens.data(), tokens.size(), false, false);
+			for (int i = 0; i < n_tokens; i++) out.push_back({ tokens[i], bias });
+		}
+	}
+}
+
+void SamplingParams::update_key() {
+	// A sorted object of every value, its dump is the cache key
+	json bias = json::array();
+	for (const llama_logit_bias& entry : logit_bias) {
+		// Banned tokens have an infinite bias, which JSON cannot represent
+		if (std::isinf(entry.bias)) bias.push_back({ entry.token, false });
+		else bias.push_back({ entry.token, entry.bias });
+	}
+	json values = {
+		{ "temperature", temperature }, { "dynatemp_range", dynatemp_range }, { "dynatemp_exponent", dynatemp_exponent },
+		{ "top_k", top_k }, { "top_p", top_p }, { "min_p", min_p }, { "typical_p", typical_p }, { "min_keep", min_keep },
+		{ "repeat_last_n", repeat_last_n }, { "repeat_penalty", repeat_penalty },
+		{ "frequency_penalty", frequency_penalty }, { "presence_penalty", presence_penalty },
+		{ "dry_multiplier", dry_multiplier }, { "dry_base", dry_base }, { "dry_allowed_length", dry_allowed_length },
+		{ "dry_penalty_last_n", dry_penalty_last_n }, { "dry_sequence_breakers", dry_sequence_breakers },
+		{ "seed", seed }, { "logit_bias", bias }
+	};
+	key = values.dump();
+}
+
+bool SamplingParams::parse(const json& request, const llama_vocab* vocab, SamplingParams& params) {
+	if (!request.is_object()) return false;
+
+	json sampling = json::object();
+	for (const char* name : SAMPLING_KEYS) {
+		auto it = request.find(name);
+		if (it != request.end() && !it->is_null()) sampling[name] = *it;
+	}
+	if (sampling.empty()) return false;
+
+	auto get = [&](const char* name, auto& value) {
+		auto it = sampling.find(name);
+		if (it != sampling.end() && it->is_number()) value = it->get<std::decay_t<decltype(value)>>();
+	};
+	get("temperature", params.temperature);
+	get("dynatemp_range", params.dynatemp_range);
+	get("dynatemp_exponent", params.dynatemp_exponent);
+	get("top_k", params.top_k);
+	get("top_p", params.top_p);
+	get("min_p", params.min_p);
+	get("typical_p", params.typical_p);
+	get("min_keep", params.min_keep);
+	get("repeat_last_n", params.repeat_last_n);
+	get("repeat_penalty", params.repeat_penalty);
+	get("frequency_penalty", params.frequency_penalty);
+	get("presence_penalty", params.presence_penalty);
+	get("dry_multiplier", params.dry_multiplier);
+	get("dry_base", params.dry_base);
+	get("dry_allowed_length", params.dry_allowed_length);
+	get("dry_penalty_last_n", params.dry_penalty_last_n);
+	get("seed", params.seed);
+
+	auto breakers = sampling.find("dry_sequence_breakers");
+	if (breakers != sampling.end() && breakers->is_array()) {
+		params.dry_sequence_breakers.clear();
+		for (const json& breaker : *breakers) {
+			if (breaker.is_string()) params.dry_sequence_breakers.push_back(breaker.get<std::string>());
+		}
+	}
+
+	auto bias = sampling.find("logit_bias");
+	if (bias != sampling.end()) parse_logit_bias(*bias, vocab, params.logit_bias);
+
+	params.update_key();
+	return true;
+}
+
+llama_sampler* SamplerLru::clone(const std::string& key) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = index.find(key);
+	if (it == index.end()) {
+		misses++;
+		return nullptr;
+	}
+	lru.splice(lru.begin(), lru, it->second);
+	hits++;
+	return llama_sampler_clone(it->second->second);
+}
+
+llama_sampler* SamplerLru::insert_and_clone(const std::string& key, llama_sampler* prototype) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = index.find(key);
+	if (it != index.end()) {
+		// Built concurrently by another request, keep the stored one
+		llama_sampler_free(prototype);
+		lru.splice(lru.begin(), lru, it->second);
+		return llama_sampler_clone(it->second->second);
+	}
+
+	lru.emplace_front(key, prototype);
+	index[key] = lru.begin();
+	while (lru.size() > capacity) {
+		index.erase(lru.back().first);
+		llama_sampler_free(lru.back().second);
+		lru.pop_back();
+	}
+	return llama_sampler_clone(prototype);
+}
+
+void SamplerLru::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto& entry : lru) {
+		llama_sampler_free(entry.second);
+	}
+	lru.clear();
+	index.clear();
+}
+
+llama_sampler* SamplerPipelineCache::acquire(const llama_model* model, uint32_t n_ctx, const SamplingParams& params) {
+	llama_sampler* pipeline = cache.clone(params.key);
+	if (!pipeline) {
+		pipeline = cache.insert_and_clone(params.key, build(model, n_ctx, params));
+	}
+
+	// Reset restarts penalty history and draws a fresh seed for the default random seed,
+	// a fixed seed starts every clone from the same state
+	llama_sampler_reset(pipeline);
+	return pipeline;
+}
+
+llama_sampler* GrammarCache::acquire(const llama_vocab* vocab, const std::string& grammar) {
+	llama_sampler* sampler = cache.clone(grammar);
+	if (sampler) return sampler;
+
+	// Preprocess the regex pattern for llama.cpp's constraint system
+	std::string processed_pattern = PatternPreprocessor::preprocess(grammar);
+	JNI_LOG_DEBUG("Adapted pattern: '%s'", processed_pattern.c_str());
+
+	llama_sampler* prototype = llama_sampler_init_grammar(vocab, processed_pattern.c_str(), "root");
+	if (!prototype) return nullptr;
+	return cache.insert_and_clone(grammar, prototype);
+}
+
+llama_sampler* SamplerPipelineCache::build(const llama_model* model, uint32_t n_ctx, const SamplingParams& params) {
+	const llama_vocab* vocab = llama_model_get_vocab(model);
+	llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+	// Logit modifiers first, they need the full candidate array
+	if (!params.logit_bias.empty()) {
+		llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(llama_vocab_n_tokens(vocab),
+			(int32_t)params.logit_bias.size(), params.logit_bias.data()));
+	}
+	if (params.repeat_penalty != 1.0f || params.frequency_penalty != 0.0f || params.presence_penalty != 0.0f) {
+		int last_n = params.repeat_last_n < 0 ? (int)n_ctx : params.repeat_last_n;
+		llama_sampler_chain_add(chain, llama_sampler_init_penalties(last_n,
+			params.repeat_penalty, params.frequency_penalty, params.presence_penalty));
+	}
+	if (params.dry_multiplier > 0.0f) {
+		std::vector<const char*> breakers;
+		for (const std::string& breaker : params.dry_sequence_breakers) breakers.push_back(breaker.c_str());
+		int last_n = params.dry_penalty_last_n < 0 ? (int)n_ctx : params.dry_penalty_last_n;
+		llama_sampler_chain_add(chain, llama_sampler_init_dry(vocab, llama_model_n_ctx_train(model),
+			params.dry_multiplier, params.dry_base, params.dry_allowed_length, last_n,
+			breakers.data(), breakers.size()));
+	}
+
+	if (params.temperature <= 0.0f) {
+		llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+		return chain;
+	}
+
+	// Truncation: top-k goes first so it does the only sort of the full vocabulary, the samplers
+	// after it see a sorted candidate array of at most k entries and skip their own sort
+	if (params.top_k > 0) {
+		llama_sampler_chain_add(chain, llama_sampler_init_top_k(params.top_k));
+	}
+	if (params.typical_p < 1.0f) {
+		llama_sampler_chain_add(chain, llama_sampler_init_typical(params.typical_p, params.min_keep));
+	}
+	if (params.top_p < 1.0f) {
+		llama_sampler_chain_add(chain, llama_sampler_init_top_p(params.top_p, params.min_keep));
+	}
+	if (params.min_p > 0.0f) {
+		llama_sampler_chain_add(chain, llama_sampler_init_min_p(params.min_p, params.min_keep));
+	}
+
+	if (params.dynatemp_range > 0.0f) {
+		llama_sampler_chain_add(chain, llama_sampler_init_temp_ext(params.temperature,
+			params.dynatemp_range, params.dynatemp_exponent));
+	} else {
+		llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temperature));
+	}
+	llama_sampler_chain_add(chain, llama_sampler_init_dist(params.seed));
+
+	JNI_LOG_DEBUG("Compiled sampler pipeline %s", params.key.c_str());
+	return chain;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <nlohmann/json_fwd.hpp>
+#include "llama.h"
+
+// Sampling parameters of one completion request, parsed once from its JSON params or binary encoding.
+// The defaults follow llama.cpp's common sampling defaults.
+struct SamplingParams {
+	float temperature = 0.8f;
+	float dynatemp_range = 0.0f;
+	float dynatemp_exponent = 1.0f;
+	int top_k = 40;
+	float top_p = 0.95f;
+	float min_p = 0.05f;
+	float typical_p = 1.0f;
+	int min_keep = 0;
+	int repeat_last_n = 64;
+	float repeat_penalty = 1.0f;
+	float frequency_penalty = 0.0f;
+	float presence_penalty = 0.0f;
+	float dry_multiplier = 0.0f;
+	float dry_base = 1.75f;
+	int dry_allowed_length = 2;
+	int dry_penalty_last_n = -1;
+	std::vector<std::string> dry_sequence_breakers = { "\n", ":", "\"", "*" };
+	uint32_t seed = LLAMA_DEFAULT_SEED;
+	std::vector<llama_logit_bias> logit_bias;
+
+	// Canonical form of all parameters above, identical parameter sets share a compiled pipeline
+	std::string key;
+
+	// Fill key from the current values, however they were set
+	void update_key();
+
+	// Parse the sampling keys of a request object. Returns false if the request sets none of them,
+	// in which case the server's default greedy sampler is used.
+	static bool parse(const nlohmann::json& request, const llama_vocab* vocab, SamplingParams& params);
+};
+
+// Bounded LRU of prototype samplers, lookups hand out clones and the prototypes are never sampled from
+class SamplerLru {
+public:
+	explicit SamplerLru(size_t capacity) : capacity(capacity) {}
+	~SamplerLru() { clear(); }
+
+	SamplerLru(const SamplerLru&) = delete;
+	SamplerLru& operator=(const SamplerLru&) = delete;
+
+	// Clone of the prototype stored under key, nullptr on a miss
+	llama_sampler* clone(const std::string& key);
+
+	// Store prototype under key (taking ownership) and return a clone of the stored prototype
+	llama_sampler* insert_and_clone(const std::string& key, llama_sampler* prototype);
+
+	void clear();
+
+	std::atomic<int64_t> hits{0};
+	std::atomic<int64_t> misses{0};
+
+private:
+	size_t capacity;
+	std::mutex mutex;
+	std::list<std::pair<std::string, llama_sampler*>> lru;  // Most recently used first
+	std::unordered_map<std::string, std::list<std::pair<std::string, llama_sampler*>>::iterator> index;
+};
+
+// Compiled sampler chains keyed by their parameter set. Building a chain is not free (DRY
+// preprocesses its sequence breakers against the whole vocabulary, logit bias copies its table),
+// so each distinct parameter set is built once and every task gets a reset clone of it.
+class SamplerPipelineCache {
+public:
+	explicit SamplerPipelineCache(size_t capacity = 32) : cache(capacity) {}
+
+	// Return a new sampler chain for params, owned by the caller
+	llama_sampler* acquire(const llama_model* model, uint32_t n_ctx, const SamplingParams& params);
+
+	void clear() { cache.clear(); }
+
+	SamplerLru cache;
+
+private:
+	static llama_sampler* build(const llama_model* model, uint32_t n_ctx, const SamplingParams& params);
+};
+
+// Parsed grammar samplers keyed by the grammar text as sent by the caller, so a hit skips both
+// PatternPreprocessor's regex passes and llama.cpp's grammar parser
+class GrammarCache {
+public:
+	explicit GrammarCache(size_t capacity = 64) : cache(capacity) {}
+
+	// Return a new grammar sampler in its initial state owned by the caller, nullptr if the grammar does not parse
+	llama_sampler* acquire(const llama_vocab* vocab, const std::string& grammar);
+
+	void clear() { cache.clear(); }
+
+	SamplerLru cache;
+};
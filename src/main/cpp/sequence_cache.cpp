@@ -0,0 +1,238 @@
+#include "sequence_cache.h"
+#include "mapped_file.h"
+#include "jni_logger.h"
+#include <algorithm>
+#include <cstdio>
+#include <unordered_set>
+
+void SequenceCache::configure(const Config& new_config) {
+	clear();
+	config = new_config;
+	config.block_size = std::max<size_t>(1, config.block_size);
+	if (enabled()) {
+		JNI_LOG_INFO("Sequence cache enabled: %zu MiB RAM, spill directory '%s'",
+			config.ram_budget >> 20, config.disk_dir.c_str());
+	}
+}
+
+// FNV-1a over the token ids, recorded at the end of every full block so that each hash
+// fingerprints the whole prefix up to that block, seeded with the salt
+std::vector<uint64_t> SequenceCache::block_hashes(const std::vector<llama_token>& tokens, uint64_t salt) const {
+	std::vector<uint64_t> hashes;
+	hashes.reserve(tokens.size() / config.block_size);
+	uint64_t hash = 1469598103934665603ull;
+	for (int b = 0; b < 8; b++) {
+		hash ^= (salt >> (8 * b)) & 0xFF;
+		hash *= 1099511628211ull;
+	}
+	for (size_t i = 0; i < tokens.size(); i++) {
+		uint32_t token = (uint32_t)tokens[i];
+		for (int b = 0; b < 4; b++) {
+			hash ^= (token >> (8 * b)) & 0xFF;
+			hash *= 1099511628211ull;
+		}
+		if ((i + 1) % config.block_size == 0) hashes.push_back(hash);
+	}
+	return hashes;
+}
+
+void SequenceCache::store(llama_context* ctx, llama_seq_id seq, const std::vector<llama_token>& tokens,
+		uint64_t salt) {
+	if (!enabled() || tokens.size() < config.block_size) return;
+
+	std::vector<uint64_t> hashes = block_hashes(tokens, salt);
+
+	// Nothing to do if a snapshot already holds these tokens
+	auto found = index.find(hashes.back());
+	if (found != index.end()) {
+		Entry& existing = entries.at(found->second);
+		if (existing.salt == salt && existing.tokens.size() >= tokens.size() &&
+				std::equal(tokens.begin(), tokens.end(), existing.tokens.begin())) {
+			touch(found->second, existing);
+			return;
+		}
+	}
+
+	size_t size = llama_state_seq_get_size(ctx, seq);
+	if (size == 0) return;
+
+	Entry entry;
+	entry.state.resize(size);
+	if (llama_state_seq_get_data(ctx, entry.state.data(), size, seq) != size) return;
+	entry.tokens = tokens;
+	entry.hashes = std::move(hashes);
+	entry.salt = salt;
+	entry.size = size;
+
+	uint64_t id = next_id++;
+	Entry& stored = entries.emplace(id, std::move(entry)).first->second;
+	ram_lru.push_front(id);
+	stored.lru_pos = ram_lru.begin();
+	ram_bytes += (int64_t)size;
+
+	for (uint64_t hash : stored.hashes) {
+		auto pos = index.find(hash);
+		if (pos == index.end() || entries.at(pos->second).tokens.size() <= stored.tokens.size()) {
+			index[hash] = id;
+		}
+	}
+	stores++;
+	enforce_budgets();
+}
+
+bool SequenceCache::restore(llama_context* ctx, llama_seq_id seq, const std::vector<llama_token>& prompt,
+		size_t& n_keep, uint64_t salt) {
+	if (!enabled() || prompt.empty()) return false;
+
+	std::vector<uint64_t> hashes = block_hashes(prompt, salt);
+	for (size_t k = hashes.size(); k > 0 && k * config.block_size > n_keep; k--) {
+		auto found = index.find(hashes[k - 1]);
+		if (found == index.end()) continue;
+
+		uint64_t id = found->second;
+		Entry& entry = entries.at(id);
+		if (entry.salt != salt) continue;
+
+		// Hashes only locate candidates, the tokens decide how much of the prompt is covered.
+		// The last prompt token is always decoded again so that it produces logits.
+		size_t common = 0;
+		size_t n = std::min(entry.tokens.size(), prompt.size());
+		while (common < n && entry.tokens[common] == prompt[common]) common++;
+		size_t n_restore = std::min(common, prompt.size() - 1);
+		if (n_restore <= n_keep) continue;
+
+		llama_memory_t memory = llama_get_memory(ctx);
+		llama_memory_seq_rm(memory, seq, -1, -1);
+
+		bool ok;
+		if (entry.path.empty()) {
+			ok = llama_state_seq_set_data(ctx, entry.state.data(), entry.size, seq) > 0;
+			ram_hits++;
+		} else {
+			// Loaded straight from the file mapping, hot snapshots move back to RAM
+			MappedFile file;
+			ok = file.open_read(entry.path) && file.size() == entry.size &&
+				llama_state_seq_set_data(ctx, file.data(), file.size(), seq) > 0;
+			disk_hits++;
+			if (ok && entry.size <= config.ram_budget) {
+				entry.state.assign(file.data(), file.data() + file.size());
+				file.close();
+				std::remove(entry.path.c_str());
+				entry.path.clear();
+				disk_bytes -= (int64_t)entry.size;
+				ram_bytes += (int64_t)entry.size;
+				disk_lru.erase(entry.lru_pos);
+				ram_lru.push_front(id);
+				entry.lru_pos = ram_lru.begin();
+			}
+		}
+
+		// Keep only the part of the snapshot the prompt shares
+		if (ok && entry.tokens.size() > n_restore) {
+			ok = llama_memory_seq_rm(memory, seq, (llama_pos)n_restore, -1);
+		}
+		if (!ok) {
+			JNI_LOG_WARN("Failed to restore cached sequence state, prefilling instead");
+			llama_memory_seq_rm(memory, seq, -1, -1);
+			erase(id);
+			n_keep = 0;
+			return true;
+		}
+
+		touch(id, entry);
+		n_keep = n_restore;
+		enforce_budgets();
+		return true;
+	}
+
+	misses++;
+	return false;
+}
+
+void SequenceCache::touch(uint64_t id, Entry& entry) {
+	std::list<uint64_t>& lru = entry.path.empty() ? ram_lru : disk_lru;
+	lru.splice(lru.begin(), lru, entry.lru_pos);
+}
+
+void SequenceCache::spill(uint64_t id, Entry& entry) {
+	if (config.disk_dir.empty()) {
+		erase(id);
+		return;
+	}
+
+	std::string path = config.disk_dir + "/jllama-" + std::to_string(reinterpret_cast<uintptr_t>(this)) +
+		"-" + std::to_string(id) + ".kv";
+	FILE* file = std::fopen(path.c_str(), "wb");
+	bool ok = file && std::fwrite(entry.state.data(), 1, entry.size, file) == entry.size;
+	if (file) ok = std::fclose(file) == 0 && ok;
+	if (!ok) {
+		JNI_LOG_WARN("Failed to spill sequence state to %s", path.c_str());
+		std::remove(path.c_str());
+		erase(id);
+		return;
+	}
+
+	entry.path = path;
+	std::vector<uint8_t>().swap(entry.state);
+	ram_bytes -= (int64_t)entry.size;
+	disk_bytes += (int64_t)entry.size;
+	ram_lru.erase(entry.lru_pos);
+	disk_lru.push_front(id);
+	entry.lru_pos = disk_lru.begin();
+	spills++;
+}
+
+void SequenceCache::erase(uint64_t id) {
+	auto it = entries.find(id);
+	if (it == entries.end()) return;
+	Entry& entry = it->second;
+
+	std::unordered_set<uint64_t> orphaned;
+	for (uint64_t hash : entry.hashes) {
+		auto pos = index.find(hash);
+		if (pos != index.end() && pos->second == id) {
+			index.erase(pos);
+			orphaned.insert(hash);
+		}
+	}
+	// Shorter snapshots sharing a prefix of the entry are found by the same block hashes again
+	if (!orphaned.empty()) {
+		for (const auto& other : entries) {
+			if (other.first == id) continue;
+			for (uint64_t hash : other.second.hashes) {
+				if (!orphaned.count(hash)) continue;
+				auto pos = index.find(hash);
+				if (pos == index.end() || entries.at(pos->second).tokens.size() < other.second.tokens.size()) {
+					index[hash] = other.first;
+				}
+			}
+		}
+	}
+	if (entry.path.empty()) {
+		ram_lru.erase(entry.lru_pos);
+		ram_bytes -= (int64_t)entry.size;
+	} else {
+		disk_lru.erase(entry.lru_pos);
+		disk_bytes -= (int64_t)entry.size;
+		std::remove(entry.path.c_str());
+	}
+	entries.erase(it);
+}
+
+void SequenceCache::enforce_budgets() {
+	while ((size_t)ram_bytes.load() > config.ram_budget && !ram_lru.empty()) {
+		uint64_t id = ram_lru.back();
+		spill(id, entries.at(id));
+	}
+	while (config.disk_budget > 0 && (size_t)disk_bytes.load() > config.disk_budget && !disk_lru.empty()) {
+		erase(disk_lru.back());
+	}
+}
+
+void SequenceCache::clear() {
+	// Nothing is left for erase to point the block hashes at
+	index.clear();
+	while (!entries.empty()) {
+		erase(entries.begin()->first);
+	}
+}
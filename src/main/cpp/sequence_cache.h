@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+#include "llama.h"
+
+// Two-tier cache of sequence KV states keyed by their tokens. Sequences the scheduler is about to
+// reuse for an unrelated prompt are snapshotted into a bounded host-RAM LRU, colder snapshots spill
+// to files in a directory. A new prompt restores the snapshot sharing its longest prefix instead of
+// prefilling it again.
+//
+// Snapshots are fingerprinted by chained hashes of their token blocks, a snapshot is found by any
+// of its block prefixes and trimmed to the prompt after restoring. A salt keeps apart the states of
+// the same tokens computed with different LoRA adapters. Used under the ctx_mutex of the server.
+class SequenceCache {
+public:
+	struct Config {
+		size_t ram_budget = 0;       // Bytes of snapshots kept in host RAM
+		std::string disk_dir;        // Directory for spilled snapshots, empty to drop them instead
+		size_t disk_budget = 0;      // Bytes of snapshots kept on disk, 0 for no limit
+		size_t block_size = 64;      // Tokens per fingerprinted block, also the shortest snapshot
+	};
+
+	~SequenceCache() { clear(); }
+
+	void configure(const Config& config);
+	bool enabled() const { return config.ram_budget > 0 || !config.disk_dir.empty(); }
+
+	// Snapshot the KV state of seq, which holds tokens, before the server reuses the sequence
+	void store(llama_context* ctx, llama_seq_id seq, const std::vector<llama_token>& tokens, uint64_t salt = 0);
+
+	// Restore the snapshot sharing the longest prefix with prompt into seq if that prefix is longer
+	// than n_keep tokens. Returns true if seq was changed, n_keep is then the number of prompt tokens
+	// the sequence holds (0 if restoring failed and the sequence was cleared).
+	bool restore(llama_context* ctx, llama_seq_id seq, const std::vector<llama_token>& prompt, size_t& n_keep,
+		uint64_t salt = 0);
+
+	// Drop all snapshots and delete their files
+	void clear();
+
+	std::atomic<int64_t> ram_hits{0};
+	std::atomic<int64_t> disk_hits{0};
+	std::atomic<int64_t> misses{0};
+	std::atomic<int64_t> stores{0};
+	std::atomic<int64_t> spills{0};
+	std::atomic<int64_t> ram_bytes{0};
+	std::atomic<int64_t> disk_bytes{0};
+
+private:
+	struct Entry {
+		std::vector<llama_token> tokens;
+		std::vector<uint64_t> hashes;    // Chained hash of every full block of tokens
+		uint64_t salt = 0;
+		std::vector<uint8_t> state;      // Empty once spilled
+		std::string path;                // Set once spilled
+		size_t size = 0;                 // Bytes of the state
+		std::list<uint64_t>::iterator lru_pos;
+	};
+
+	std::vector<uint64_t> block_hashes(const std::vector<llama_token>& tokens, uint64_t salt) const;
+	void touch(uint64_t id, Entry& entry);
+	void spill(uint64_t id, Entry& entry);
+	void erase(uint64_t id);
+	void enforce_budgets();
+
+	Config config;
+	uint64_t next_id = 1;
+	std::unordered_map<uint64_t, Entry> entries;
+	std::unordered_map<uint64_t, uint64_t> index;   // Block hash to the longest entry containing it
+	std::list<uint64_t> ram_lru;                    // Most recently used first
+	std::list<uint64_t> disk_lru;
+};
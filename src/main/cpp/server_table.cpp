@@ -0,0 +1,119 @@
+#include "server_table.h"
+#include "llama_server.h"
+#include <mutex>
+#include <vector>
+
+// Slot state: generation in the upper 32 bits, a live flag and 31 bits of reference count below.
+// Only the last reference of a removed slot destroys the server and bumps the generation.
+static const uint64_t LIVE = 1ull << 31;
+static const uint64_t REFS = LIVE - 1;
+
+namespace {
+
+// One cache line per slot, so that hot servers do not contend on each other's counts
+struct alignas(64) ServerSlot {
+	std::atomic<uint64_t> state{1ull << 32};
+	std::atomic<LlamaServer*> server{nullptr};
+};
+
+ServerSlot g_slots[ServerTable::CAPACITY];
+
+// Slot allocation is rare and takes a lock, lookups never do
+std::mutex g_free_mutex;
+std::vector<uint32_t> g_free_slots;
+uint32_t g_next_slot = 0;
+
+uint32_t generation(uint64_t state) {
+	return (uint32_t)(state >> 32);
+}
+
+}
+
+ServerRef& ServerRef::operator=(ServerRef&& other) noexcept {
+	if (this != &other) {
+		release();
+		slot_ = other.slot_;
+		server_ = other.server_;
+		other.slot_ = 0;
+		other.server_ = nullptr;
+	}
+	return *this;
+}
+
+void ServerRef::release() {
+	if (slot_ != 0) {
+		ServerTable::release(slot_ - 1);
+		slot_ = 0;
+		server_ = nullptr;
+	}
+}
+
+jlong ServerTable::insert(std::unique_ptr<LlamaServer> server) {
+	uint32_t index;
+	{
+		std::lock_guard<std::mutex> lock(g_free_mutex);
+		if (!g_free_slots.empty()) {
+			index = g_free_slots.back();
+			g_free_slots.pop_back();
+		} else if (g_next_slot < CAPACITY) {
+			index = g_next_slot++;
+		} else {
+			return 0;
+		}
+	}
+
+	ServerSlot& slot = g_slots[index];
+	uint64_t state = slot.state.load(std::memory_order_relaxed);
+	slot.server.store(server.release(), std::memory_order_relaxed);
+	// Publishes the server to lookups of the new handle
+	slot.state.store(state | LIVE, std::memory_order_release);
+	return (jlong)(((uint64_t)generation(state) << 32) | (index + 1));
+}
+
+ServerRef ServerTable::acquire(jlong handle) {
+	uint32_t index = (uint32_t)((uint64_t)handle & 0xFFFFFFFFu) - 1;
+	if (index >= CAPACITY) return ServerRef();
+	uint32_t gen = (uint32_t)((uint64_t)handle >> 32);
+
+	ServerSlot& slot = g_slots[index];
+	uint64_t state = slot.state.load(std::memory_order_acquire);
+	do {
+		if (generation(state) != gen || !(state & LIVE) || (state & REFS) == REFS) {
+			return ServerRef();
+		}
+	} while (!slot.state.compare_exchange_weak(state, state + 1,
+		std::memory_order_acquire, std::memory_order_acquire));
+	return ServerRef(index + 1, slot.server.load(std::memory_order_relaxed));
+}
+
+bool ServerTable::remove(jlong handle) {
+	uint32_t index = (uint32_t)((uint64_t)handle & 0xFFFFFFFFu) - 1;
+	if (index >= CAPACITY) return false;
+	uint32_t gen = (uint32_t)((uint64_t)handle >> 32);
+
+	// Clearing the live flag and taking a reference in one step makes exactly one remover win
+	ServerSlot& slot = g_slots[index];
+	uint64_t state = slot.state.load(std::memory_order_acquire);
+	do {
+		if (generation(state) != gen || !(state & LIVE)) return false;
+	} while (!slot.state.compare_exchange_weak(state, (state & ~LIVE) + 1,
+		std::memory_order_acq_rel, std::memory_order_acquire));
+
+	// Calls still holding references see should_stop and return; the last one frees the server
+	ServerRef ref(index + 1, slot.server.load(std::memory_order_relaxed));
+	ref->stop_server();
+	return true;
+}
+
+void ServerTable::release(uint32_t index) {
+	ServerSlot& slot = g_slots[index];
+	uint64_t state = slot.state.fetch_sub(1, std::memory_order_acq_rel) - 1;
+	if ((state & LIVE) || (state & REFS) != 0) return;
+
+	// Nobody can acquire the slot any more, destroy the server and retire its handle
+	delete slot.server.exchange(nullptr, std::memory_order_relaxed);
+	slot.state.store((uint64_t)(generation(state) + 1) << 32, std::memory_order_release);
+
+	std::lock_guard<std::mutex> lock(g_free_mutex);
+	g_free_slots.push_back(index);
+}
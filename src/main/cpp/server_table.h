@@ -0,0 +1,61 @@
+#pragma once
+
+#include <jni.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct LlamaServer;
+
+// A reference keeping a server alive while a JNI call uses it, obtained from the ServerTable.
+// It converts to LlamaServer* for the call, the pointer must not be kept beyond the reference.
+class ServerRef {
+public:
+	ServerRef() = default;
+	ServerRef(std::nullptr_t) {}
+	~ServerRef() { release(); }
+
+	ServerRef(ServerRef&& other) noexcept : slot_(other.slot_), server_(other.server_) {
+		other.slot_ = 0;
+		other.server_ = nullptr;
+	}
+	ServerRef& operator=(ServerRef&& other) noexcept;
+
+	ServerRef(const ServerRef&) = delete;
+	ServerRef& operator=(const ServerRef&) = delete;
+
+	LlamaServer* get() const { return server_; }
+	LlamaServer* operator->() const { return server_; }
+	operator LlamaServer*() const { return server_; }
+
+private:
+	friend class ServerTable;
+	ServerRef(uint32_t slot, LlamaServer* server) : slot_(slot), server_(server) {}
+	void release();
+
+	uint32_t slot_ = 0;  // Index + 1 of the referenced slot, 0 if empty
+	LlamaServer* server_ = nullptr;
+};
+
+// Process-wide table of the servers behind Java handles. A handle carries a slot index and the
+// generation of the slot, so handles of closed servers never resolve to a later server in the same
+// slot. Lookups are lock-free: they only bump a reference count packed into the slot state.
+// Removing a server stops it at once, it is destroyed when the last reference is released.
+class ServerTable {
+public:
+	static const uint32_t CAPACITY = 1024;
+
+	// Take ownership of a started server, returns its handle or 0 if the table is full
+	static jlong insert(std::unique_ptr<LlamaServer> server);
+
+	// Resolve a handle, the reference is empty for unknown or removed handles
+	static ServerRef acquire(jlong handle);
+
+	// Stop the server and drop it from the table, returns false for unknown or removed handles
+	static bool remove(jlong handle);
+
+private:
+	friend class ServerRef;
+	static void release(uint32_t index);
+};
@@ -2,17 +2,57 @@
 #include "jni_utils.h"
 #include "jni_logger.h"
 #include "jni_error_handler.h"
+#include "native_trace.h"
+#include "canny_edge.h"
 
 // Include stable-diffusion.cpp headers
 #include "stable-diffusion.h"
 
+// The encoder bundled with stable-diffusion.cpp, kept private to this file
+#define STB_IMAGE_WRITE_STATIC
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include <fstream>
 #include <filesystem>
 
+// Traces every denoising step, stable-diffusion.cpp reports the step after it finished
+static void trace_sd_step(int step, int steps, float time, void* data) {
+	(void)steps;
+	(void)data;
+	uint64_t end = NativeTrace::now_ns();
+	NativeTrace::record("sd", "sample_step", end - (uint64_t)(time * 1e9f), end, "step", step);
+}
+
+static void append_encoded(void* context, void* data, int size) {
+	auto* out = static_cast<std::vector<uint8_t>*>(context);
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	out->insert(out->end(), bytes, bytes + size);
+}
+
+static bool encode_image(const sd_image_t& image, int format, int quality, std::vector<uint8_t>& out) {
+	const int width = static_cast<int>(image.width);
+	const int height = static_cast<int>(image.height);
+	const int channels = static_cast<int>(image.channel);
+	switch (format) {
+		case StableDiffusionManager::OUTPUT_PNG:
+			return stbi_write_png_to_func(append_encoded, &out, width, height, channels, image.data,
+										  width * channels) != 0;
+		case StableDiffusionManager::OUTPUT_JPEG:
+			return stbi_write_jpg_to_func(append_encoded, &out, width, height, channels, image.data,
+										  std::clamp(quality, 1, 100)) != 0;
+		default:
+			return false;
+	}
+}
+
 // Thread-local error storage
 thread_local std::string StableDiffusionManager::last_error_;
 
@@ -87,7 +127,7 @@ jlong StableDiffusionManager::createContext(const std::string& model_path,
 		// Store context with unique handle
 		std::lock_guard<std::mutex> lock(contexts_mutex_);
 		jlong handle = next_handle_++;
-		contexts_[handle] = std::make_unique<ContextData>(ctx);
+		contexts_[handle] = std::make_shared<ContextData>(ctx);
 		contexts_[handle]->model_path = model_path;
 
 		JNILogger::log(JNILogger::Level::INFO,
@@ -170,7 +210,7 @@ jlong StableDiffusionManager::createContextWithControlNet(const std::string& mod
 		// Store context with unique handle
 		std::lock_guard<std::mutex> lock(contexts_mutex_);
 		jlong handle = next_handle_++;
-		contexts_[handle] = std::make_unique<ContextData>(ctx);
+		contexts_[handle] = std::make_shared<ContextData>(ctx);
 		contexts_[handle]->model_path = model_path;
 
 		JNILogger::log(JNILogger::Level::INFO,
@@ -246,7 +286,7 @@ jlong StableDiffusionManager::createContextFromDiffusers(const std::string& diff
 		// Store context with unique handle
 		std::lock_guard<std::mutex> lock(contexts_mutex_);
 		jlong handle = next_handle_++;
-		contexts_[handle] = std::make_unique<ContextData>(ctx);
+		contexts_[handle] = std::make_shared<ContextData>(ctx);
 		contexts_[handle]->model_path = diffusers_path;
 
 		JNILogger::log(JNILogger::Level::INFO,
@@ -271,78 +311,209 @@ bool StableDiffusionManager::destroyContext(jlong handle) {
 	return false;
 }
 
+void StableDiffusionManager::ImageDeleter::operator()(sd_image_t* image) const {
+	if (image) {
+		free(image->data);
+		free(image);
+	}
+}
+
+// Requests batch when generate_image would do the same for all of them but the seed
+static bool same_batch(const StableDiffusionManager::GenerationParams& a,
+					   const StableDiffusionManager::GenerationParams& b) {
+	return a.prompt == b.prompt && a.negative_prompt == b.negative_prompt &&
+		a.width == b.width && a.height == b.height && a.steps == b.steps &&
+		a.cfg_scale == b.cfg_scale && a.slg_scale == b.slg_scale && a.sample_method == b.sample_method &&
+		a.control_image_data.empty() && a.init_image_data.empty() && a.mask_image_data.empty() &&
+		b.control_image_data.empty() && b.init_image_data.empty() && b.mask_image_data.empty();
+}
+
+// Images of one generate_image call, which need memory for all of them at once
+static const size_t MAX_BATCH_COUNT = 4;
+
+// The progress callback of stable-diffusion.cpp is global, it stays installed while any traced
+// generation runs
+static std::mutex trace_mutex;
+static int traced_generations = 0;
+
+static void begin_trace() {
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	if (traced_generations++ == 0) sd_set_progress_callback(trace_sd_step, nullptr);
+}
+
+static void end_trace() {
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	if (--traced_generations == 0) sd_set_progress_callback(nullptr, nullptr);
+}
+
+std::vector<StableDiffusionManager::PendingRequest*> StableDiffusionManager::takeBatch(
+	std::deque<PendingRequest*>& queue) {
+
+	std::vector<PendingRequest*> batch(1, queue.front());
+	queue.pop_front();
+	const GenerationParams& first = *batch[0]->params;
+
+	// generate_image gives image i the seed of the first plus i, a random first seed makes all random
+	bool random = first.seed <= 0;
+	for (bool found = true; found && batch.size() < MAX_BATCH_COUNT; ) {
+		found = false;
+		for (auto it = queue.begin(); it != queue.end(); ++it) {
+			const GenerationParams& next = *(*it)->params;
+			bool seed_fits = random ? next.seed <= 0 : next.seed == first.seed + (int)batch.size();
+			if (seed_fits && same_batch(first, next)) {
+				batch.push_back(*it);
+				queue.erase(it);
+				found = true;
+				break;
+			}
+		}
+	}
+	return batch;
+}
+
+void StableDiffusionManager::runBatch(ContextData& data, const std::vector<PendingRequest*>& batch) {
+	const GenerationParams& params = *batch[0]->params;
+	auto start_time = std::chrono::high_resolution_clock::now();
+
+	// Initialize image generation parameters
+	sd_img_gen_params_t gen_params;
+	sd_img_gen_params_init(&gen_params);
+
+	// Set generation parameters
+	gen_params.prompt = params.prompt.c_str();
+	gen_params.negative_prompt = params.negative_prompt.c_str();
+	gen_params.width = params.width;
+	gen_params.height = params.height;
+	gen_params.seed = params.seed > 0 ? params.seed : -1;
+	gen_params.batch_count = static_cast<int>(batch.size());
+	gen_params.clip_skip = -1; // Use default
+
+	// Configure sampling parameters
+	sd_sample_params_init(&gen_params.sample_params);
+	gen_params.sample_params.sample_steps = params.steps;
+	gen_params.sample_params.sample_method = static_cast<sample_method_t>(params.sample_method);
+	gen_params.sample_params.scheduler = DEFAULT;
+
+	// Configure guidance parameters
+	gen_params.sample_params.guidance.txt_cfg = params.cfg_scale;
+	gen_params.sample_params.guidance.slg.scale = params.slg_scale;
+
+	// Configure ControlNet if provided
+	sd_image_t control_image = {};
+	if (!params.control_image_data.empty()) {
+		control_image.width = params.control_image_width;
+		control_image.height = params.control_image_height;
+		control_image.channel = params.control_image_channels;
+		control_image.data = const_cast<uint8_t*>(params.control_image_data.data());
+		gen_params.control_image = control_image;
+		gen_params.control_strength = params.control_strength;
+		JNILogger::log(JNILogger::Level::INFO, "Using ControlNet: %dx%d, strength=%.2f",
+					   control_image.width, control_image.height, params.control_strength);
+	}
+
+	// Configure img2img if provided
+	sd_image_t init_image = {};
+	if (!params.init_image_data.empty()) {
+		init_image.width = params.init_image_width;
+		init_image.height = params.init_image_height;
+		init_image.channel = params.init_image_channels;
+		init_image.data = const_cast<uint8_t*>(params.init_image_data.data());
+		gen_params.init_image = init_image;
+		gen_params.strength = params.strength;
+		JNILogger::log(JNILogger::Level::INFO, "Using img2img: %dx%d, strength=%.2f",
+					   init_image.width, init_image.height, params.strength);
+	}
+
+	// Configure inpainting mask if provided
+	sd_image_t mask_image = {};
+	if (!params.mask_image_data.empty()) {
+		mask_image.width = params.mask_image_width;
+		mask_image.height = params.mask_image_height;
+		mask_image.channel = params.mask_image_channels;
+		mask_image.data = const_cast<uint8_t*>(params.mask_image_data.data());
+		gen_params.mask_image = mask_image;
+		JNILogger::log(JNILogger::Level::INFO, "Using inpainting: %dx%d, channels=%d",
+					   mask_image.width, mask_image.height, mask_image.channel);
+	}
+
+	JNILogger::log(JNILogger::Level::INFO,
+		"Generating %zu image(s) %dx%d, steps=%d, cfg=%.1f, slg=%.1f, controlNet=%s, img2img=%s, inpainting=%s, prompt='%s'",
+		batch.size(), params.width, params.height, params.steps, params.cfg_scale, params.slg_scale,
+		!params.control_image_data.empty() ? "yes" : "no",
+		!params.init_image_data.empty() ? "yes" : "no",
+		!params.mask_image_data.empty() ? "yes" : "no",
+		params.prompt.c_str());
+
+	// Generate the images
+	sd_image_t* images;
+	{
+		JLLAMA_TRACE_SPAN("sd", "generate_image");
+		bool traced = NativeTrace::enabled();
+		if (traced) begin_trace();
+		images = generate_image(data.context.get(), &gen_params);
+		if (traced) end_trace();
+	}
+
+	// Calculate generation time, shared by the whole batch
+	auto end_time = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		GenerationResult& result = *batch[i]->result;
+		if (!images) {
+			result.error_message = "Image generation failed - generate_image returned null";
+			continue;
+		}
+		if (!images[i].data) {
+			result.error_message = "Image generation failed - image data is null";
+			continue;
+		}
+
+		// Store result, every request owns its image
+		sd_image_t* image = static_cast<sd_image_t*>(malloc(sizeof(sd_image_t)));
+		if (!image) {
+			free(images[i].data);
+			result.error_message = "Image generation failed - out of memory";
+			continue;
+		}
+		*image = images[i];
+		result.success = true;
+		result.image.reset(image);
+		result.width = image->width;
+		result.height = image->height;
+		result.channels = image->channel;
+		result.generation_time = duration.count() / 1000.0f;
+	}
+	free(images);
+
+	JNILogger::log(JNILogger::Level::INFO,
+		"Generated %zu image(s) in %.2f seconds (%dx%d)",
+		batch.size(), duration.count() / 1000.0f, params.width, params.height);
+}
+
 StableDiffusionManager::GenerationResult StableDiffusionManager::generateImage(
 	jlong handle, const GenerationParams& params) {
 
 	GenerationResult result;
-	auto start_time = std::chrono::high_resolution_clock::now();
 
 	try {
-		// Get context
-		std::lock_guard<std::mutex> lock(contexts_mutex_);
-		auto it = contexts_.find(handle);
-		if (it == contexts_.end()) {
-			result.error_message = "Invalid stable diffusion context handle: " + std::to_string(handle);
-			return result;
+		// Get context, the manager lock is only held for the lookup
+		std::shared_ptr<ContextData> data;
+		{
+			std::lock_guard<std::mutex> lock(contexts_mutex_);
+			auto it = contexts_.find(handle);
+			if (it == contexts_.end()) {
+				result.error_message = "Invalid stable diffusion context handle: " + std::to_string(handle);
+				return result;
+			}
+			data = it->second;
 		}
 
-		sd_ctx_t* ctx = it->second->context.get();
-		if (!ctx) {
+		if (!data->context) {
 			result.error_message = "Stable diffusion context is null";
 			return result;
 		}
 
-		// Initialize image generation parameters
-		sd_img_gen_params_t gen_params;
-		sd_img_gen_params_init(&gen_params);
-
-		// Set generation parameters
-		gen_params.prompt = params.prompt.c_str();
-		gen_params.negative_prompt = params.negative_prompt.c_str();
-		gen_params.width = params.width;
-		gen_params.height = params.height;
-		gen_params.seed = params.seed > 0 ? params.seed : -1;
-		gen_params.batch_count = 1;
-		gen_params.clip_skip = -1; // Use default
-
-		// Configure sampling parameters
-		sd_sample_params_init(&gen_params.sample_params);
-		gen_params.sample_params.sample_steps = params.steps;
-		gen_params.sample_params.sample_method = static_cast<sample_method_t>(params.sample_method);
-		gen_params.sample_params.scheduler = DEFAULT;
-
-		// Configure guidance parameters
-		gen_params.sample_params.guidance.txt_cfg = params.cfg_scale;
-		gen_params.sample_params.guidance.slg.scale = params.slg_scale;
-
-		// Configure ControlNet if provided
-		sd_image_t control_image = {};
-		if (!params.control_image_data.empty()) {
-			control_image.width = params.control_image_width;
-			control_image.height = params.control_image_height;
-			control_image.channel = params.control_image_channels;
-			control_image.data = const_cast<uint8_t*>(params.control_image_data.data());
-			gen_params.control_image = control_image;
-			gen_params.control_strength = params.control_strength;
-			JNILogger::log(JNILogger::Level::INFO, "Using ControlNet: %dx%d, strength=%.2f",
-						   control_image.width, control_image.height, params.control_strength);
-		}
-
-		// Configure img2img if provided
-		sd_image_t init_image = {};
-		if (!params.init_image_data.empty()) {
-			init_image.width = params.init_image_width;
-			init_image.height = params.init_image_height;
-			init_image.channel = params.init_image_channels;
-			init_image.data = const_cast<uint8_t*>(params.init_image_data.data());
-			gen_params.init_image = init_image;
-			gen_params.strength = params.strength;
-			JNILogger::log(JNILogger::Level::INFO, "Using img2img: %dx%d, strength=%.2f",
-						   init_image.width, init_image.height, params.strength);
-		}
-
-		// Configure inpainting mask if provided
-		sd_image_t mask_image = {};
 		if (!params.mask_image_data.empty()) {
 			// Inpainting requires both an init image and a mask
 			if (params.init_image_data.empty()) {
@@ -353,7 +524,7 @@ StableDiffusionManager::GenerationResult StableDiffusionManager::generateImage(
 
 			// Check if this is an SD3 model (SD3 doesn't support inpainting)
 			// SD3 models typically have "sd3" in the model path
-			std::string model_path = it->second->model_path;
+			std::string model_path = data->model_path;
 			std::transform(model_path.begin(), model_path.end(), model_path.begin(), ::tolower);
 			if (model_path.find("sd3") != std::string::npos ||
 				model_path.find("sd_3") != std::string::npos ||
@@ -362,58 +533,243 @@ StableDiffusionManager::GenerationResult StableDiffusionManager::generateImage(
 				JNILogger::log(JNILogger::Level::ERROR, "Attempted to use inpainting with SD3 model: %s", model_path.c_str());
 				return result;
 			}
+		}
 
-			mask_image.width = params.mask_image_width;
-			mask_image.height = params.mask_image_height;
-			mask_image.channel = params.mask_image_channels;
-			mask_image.data = const_cast<uint8_t*>(params.mask_image_data.data());
-			gen_params.mask_image = mask_image;
-			JNILogger::log(JNILogger::Level::INFO, "Using inpainting: %dx%d, channels=%d",
-						   mask_image.width, mask_image.height, mask_image.channel);
+		// Queue on the context. Whoever finds it idle runs the next batch, which need not hold its
+		// own request, until its own request is done.
+		PendingRequest request = { &params, &result };
+		std::unique_lock<std::mutex> lock(data->queue_mutex);
+		data->queue.push_back(&request);
+		while (!request.done) {
+			if (data->busy) {
+				data->queue_cv.wait(lock);
+				continue;
+			}
+			data->busy = true;
+			std::vector<PendingRequest*> batch = takeBatch(data->queue);
+			lock.unlock();
+			try {
+				runBatch(*data, batch);
+			} catch (const std::exception& e) {
+				for (PendingRequest* pending : batch) {
+					pending->result->error_message = "Exception during image generation: " + std::string(e.what());
+				}
+			}
+			lock.lock();
+			for (PendingRequest* pending : batch) {
+				pending->done = true;
+			}
+			data->busy = false;
+			data->queue_cv.notify_all();
 		}
+		lock.unlock();
 
-		JNILogger::log(JNILogger::Level::INFO,
-			"Generating image %dx%d, steps=%d, cfg=%.1f, slg=%.1f, controlNet=%s, img2img=%s, inpainting=%s, prompt='%s'",
-			params.width, params.height, params.steps, params.cfg_scale, params.slg_scale,
-			!params.control_image_data.empty() ? "yes" : "no",
-			!params.init_image_data.empty() ? "yes" : "no",
-			!params.mask_image_data.empty() ? "yes" : "no",
-			params.prompt.c_str());
+		// Encode outside the queue, the context already generates the next batch meanwhile
+		if (result.success && params.output_format != OUTPUT_RAW) {
+			if (!encode_image(*result.image, params.output_format, params.output_quality, result.encoded)) {
+				result.success = false;
+				result.error_message = "Failed to encode the generated image";
+			}
+			result.image.reset();
+		}
 
-		// Generate the image
-		sd_image_t* image = generate_image(ctx, &gen_params);
+		return result;
 
-		if (!image) {
-			result.error_message = "Image generation failed - generate_image returned null";
-			return result;
+	} catch (const std::exception& e) {
+		result.error_message = "Exception during image generation: " + std::string(e.what());
+		return result;
+	}
+}
+
+// Tile origins along one side, the last tile ends at the border
+static std::vector<int> tile_origins(int size, int tile, int step) {
+	std::vector<int> origins;
+	for (int origin = 0; ; origin += step) {
+		if (origin + tile >= size) {
+			origins.push_back(std::max(0, size - tile));
+			return origins;
 		}
+		origins.push_back(origin);
+	}
+}
 
-		if (!image->data) {
-			result.error_message = "Image generation failed - image data is null";
-			return result;
+// Weight of a pixel at offset u of a tile side of the given length, ramping up over the overlap
+// towards every edge that is not the image border
+static float tile_weight(int u, int length, bool ramp_start, bool ramp_end, int overlap) {
+	float weight = 1.0f;
+	if (ramp_start) weight = std::min(weight, (u + 0.5f) / overlap);
+	if (ramp_end) weight = std::min(weight, (length - u - 0.5f) / overlap);
+	return std::max(weight, 1e-3f);
+}
+
+std::unique_ptr<sd_image_t, StableDiffusionManager::ImageDeleter> StableDiffusionManager::upscaleTiled(
+	const UpscaleParams& params, const sd_image_t& input, std::string& error) {
+
+	struct Tile {
+		int x, y, width, height;
+	};
+
+	const int width = static_cast<int>(input.width);
+	const int height = static_cast<int>(input.height);
+	const int channels = static_cast<int>(input.channel);
+	const int tile = std::max(params.tile_size, 64);
+	const int overlap = tile / 8;
+
+	std::vector<Tile> tiles;
+	for (int y : tile_origins(height, tile, tile - overlap)) {
+		for (int x : tile_origins(width, tile, tile - overlap)) {
+			tiles.push_back({ x, y, std::min(tile, width), std::min(tile, height) });
 		}
+	}
 
-		// Calculate generation time
-		auto end_time = std::chrono::high_resolution_clock::now();
-		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+	// The ESRGAN model fixes the scale, the first tile tells it before the output is allocated
+	std::mutex blend_mutex;
+	std::vector<float> accumulated;
+	std::vector<float> weights;
+	int scale = 0;
+	int out_width = 0;
+	std::atomic<size_t> next_tile(0);
+	std::atomic<bool> failed(false);
+
+	auto upscale_tile = [&](upscaler_ctx_t* upscaler, const Tile& t) -> bool {
+		std::vector<uint8_t> pixels(static_cast<size_t>(t.width) * t.height * channels);
+		for (int row = 0; row < t.height; row++) {
+			memcpy(pixels.data() + static_cast<size_t>(row) * t.width * channels,
+				   input.data + (static_cast<size_t>(t.y + row) * width + t.x) * channels,
+				   static_cast<size_t>(t.width) * channels);
+		}
+		sd_image_t in = { static_cast<uint32_t>(t.width), static_cast<uint32_t>(t.height),
+						  static_cast<uint32_t>(channels), pixels.data() };
+		sd_image_t out = upscale(upscaler, in, params.factor);
+		if (!out.data) {
+			return false;
+		}
 
-		// Store result
-		result.success = true;
-		result.image = std::unique_ptr<sd_image_t>(image);
-		result.width = image->width;
-		result.height = image->height;
-		result.generation_time = duration.count() / 1000.0f;
+		std::lock_guard<std::mutex> lock(blend_mutex);
+		if (scale == 0) {
+			scale = static_cast<int>(out.width) / t.width;
+			out_width = width * scale;
+			accumulated.assign(static_cast<size_t>(out_width) * height * scale * channels, 0.0f);
+			weights.assign(static_cast<size_t>(out_width) * height * scale, 0.0f);
+		}
+		if (scale <= 0 || static_cast<int>(out.width) != t.width * scale ||
+			static_cast<int>(out.height) != t.height * scale || static_cast<int>(out.channel) != channels) {
+			free(out.data);
+			return false;
+		}
+		const int ramp = std::max(overlap * scale, 1);
+		for (int row = 0; row < t.height * scale; row++) {
+			float weight_y = tile_weight(row, t.height * scale, t.y > 0, t.y + t.height < height, ramp);
+			for (int col = 0; col < t.width * scale; col++) {
+				float weight = weight_y * tile_weight(col, t.width * scale, t.x > 0, t.x + t.width < width, ramp);
+				size_t target = static_cast<size_t>(t.y * scale + row) * out_width + t.x * scale + col;
+				const uint8_t* source = out.data + (static_cast<size_t>(row) * out.width + col) * channels;
+				for (int c = 0; c < channels; c++) {
+					accumulated[target * channels + c] += weight * source[c];
+				}
+				weights[target] += weight;
+			}
+		}
+		free(out.data);
+		return true;
+	};
 
-		JNILogger::log(JNILogger::Level::INFO,
-			"Image generated successfully in %.2f seconds (%dx%d, %d channels)",
-			result.generation_time, result.width, result.height, image->channel);
+	if (params.upscalers.empty() || tiles.empty() || !upscale_tile(params.upscalers[0], tiles[0])) {
+		error = "Upscaling failed";
+		return nullptr;
+	}
+	next_tile = 1;
+
+	auto work = [&](upscaler_ctx_t* upscaler) {
+		while (!failed) {
+			size_t i = next_tile++;
+			if (i >= tiles.size()) break;
+			if (!upscale_tile(upscaler, tiles[i])) failed = true;
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < params.upscalers.size(); i++) {
+		threads.emplace_back(work, params.upscalers[i]);
+	}
+	work(params.upscalers[0]);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	if (failed) {
+		error = "Upscaling a tile failed";
+		return nullptr;
+	}
 
+	std::unique_ptr<sd_image_t, ImageDeleter> result(static_cast<sd_image_t*>(malloc(sizeof(sd_image_t))));
+	if (!result) {
+		error = "Out of memory for the upscaled image";
+		return nullptr;
+	}
+	result->width = static_cast<uint32_t>(out_width);
+	result->height = static_cast<uint32_t>(height * scale);
+	result->channel = static_cast<uint32_t>(channels);
+	result->data = static_cast<uint8_t*>(malloc(accumulated.size()));
+	if (!result->data) {
+		error = "Out of memory for the upscaled image";
+		return nullptr;
+	}
+	for (size_t i = 0; i < accumulated.size(); i++) {
+		float value = accumulated[i] / weights[i / channels] + 0.5f;
+		result->data[i] = static_cast<uint8_t>(std::clamp(value, 0.0f, 255.0f));
+	}
+	return result;
+}
+
+StableDiffusionManager::GenerationResult StableDiffusionManager::generateUpscaled(
+	jlong handle, const GenerationParams& params, const UpscaleParams& upscale) {
+
+	GenerationParams generation = params;
+	generation.output_format = OUTPUT_RAW;
+
+	// Canny edges of the control image, in place
+	if (upscale.canny_control && !generation.control_image_data.empty()) {
+		uint8_t* control = generation.control_image_data.data();
+		int width = generation.control_image_width;
+		int height = generation.control_image_height;
+		int channels = generation.control_image_channels;
+		if (!CannyEdge::detect(control, width, height, channels, control, width, height, channels, CannyParams())) {
+			GenerationResult result;
+			result.error_message = "Canny preprocessing of the control image failed";
+			return result;
+		}
+	}
+
+	GenerationResult result = generateImage(handle, generation);
+	if (!result.success) {
 		return result;
+	}
 
-	} catch (const std::exception& e) {
-		result.error_message = "Exception during image generation: " + std::string(e.what());
+	auto start_time = std::chrono::high_resolution_clock::now();
+	std::unique_ptr<sd_image_t, ImageDeleter> upscaled;
+	{
+		JLLAMA_TRACE_SPAN("sd", "upscale_tiled");
+		upscaled = upscaleTiled(upscale, *result.image, result.error_message);
+	}
+	if (!upscaled) {
+		result.success = false;
+		result.image.reset();
 		return result;
 	}
+	result.image = std::move(upscaled);
+	result.width = result.image->width;
+	result.height = result.image->height;
+
+	if (params.output_format != OUTPUT_RAW) {
+		if (!encode_image(*result.image, params.output_format, params.output_quality, result.encoded)) {
+			result.success = false;
+			result.error_message = "Failed to encode the upscaled image";
+		}
+		result.image.reset();
+	}
+
+	auto end_time = std::chrono::high_resolution_clock::now();
+	result.generation_time += std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count() / 1000.0f;
+	return result;
 }
 
 bool StableDiffusionManager::isValidImageFormat(const std::string& path) {
@@ -427,6 +783,57 @@ std::string StableDiffusionManager::getErrorMessage() {
 
 // JNI implementations
 
+namespace {
+	// The raw pixels or encoded bytes of a generation as a StableDiffusionResult
+	jobject create_generation_result(JNIEnv* env, const StableDiffusionManager::GenerationResult& result,
+									 int output_format) {
+		const JniCache& jni = JniUtils::cache();
+		jclass resultClass = jni.diffusion_result_class;
+		if (!resultClass) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/ClassNotFoundException",
+				"Could not find StableDiffusionResult class");
+			return nullptr;
+		}
+
+		jmethodID constructor = jni.diffusion_result_init;
+		if (!constructor) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/NoSuchMethodException",
+				"Could not find StableDiffusionResult constructor");
+			return nullptr;
+		}
+
+		jstring errorMsg = result.error_message.empty() ? nullptr : env->NewStringUTF(result.error_message.c_str());
+		jbyteArray imageData = nullptr;
+
+		if (result.success) {
+			const uint8_t* bytes = nullptr;
+			size_t data_size = 0;
+			if (output_format != StableDiffusionManager::OUTPUT_RAW) {
+				bytes = result.encoded.data();
+				data_size = result.encoded.size();
+			} else if (result.image && result.image->data) {
+				bytes = result.image->data;
+				data_size = static_cast<size_t>(result.width) * result.height * result.channels;
+			}
+			imageData = env->NewByteArray(static_cast<jsize>(data_size));
+			if (!imageData) {
+				return nullptr;
+			}
+			env->SetByteArrayRegion(imageData, 0, static_cast<jsize>(data_size), reinterpret_cast<const jbyte*>(bytes));
+		}
+
+		return env->NewObject(resultClass, constructor,
+			static_cast<jboolean>(result.success),
+			errorMsg,
+			imageData,
+			static_cast<jint>(result.width),
+			static_cast<jint>(result.height),
+			static_cast<jfloat>(result.generation_time),
+			static_cast<jint>(output_format),
+			static_cast<jint>(result.channels));
+	}
+}
+
 extern "C" {
 
 JNIEXPORT jlong JNICALL
@@ -487,45 +894,120 @@ Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateImage(
 		params.clip_on_cpu = clip_on_cpu;
 
 		auto result = StableDiffusionManager::getInstance().generateImage(handle, params);
+		return create_generation_result(env, result, StableDiffusionManager::OUTPUT_RAW);
 
-		// Create Java result object
-		jclass resultClass = env->FindClass("de/kherud/llama/diffusion/StableDiffusionResult");
-		if (!resultClass) {
-			JNIErrorHandler::throw_java_exception(env, "java/lang/ClassNotFoundException",
-				"Could not find StableDiffusionResult class");
+	} catch (const std::exception& e) {
+		JNIErrorHandler::throw_java_exception(env, "java/lang/RuntimeException",
+			"Failed to generate image: " + std::string(e.what()));
+		return nullptr;
+	}
+}
+
+JNIEXPORT jobject JNICALL
+Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateImageEncoded(
+	JNIEnv* env, jclass clazz, jlong handle, jstring prompt,
+	jstring negative_prompt, jint width, jint height, jint steps,
+	jfloat cfg_scale, jfloat slg_scale, jint seed, jint sample_method,
+	jboolean clip_on_cpu, jint output_format, jint output_quality) {
+
+	try {
+		if (output_format != StableDiffusionManager::OUTPUT_PNG && output_format != StableDiffusionManager::OUTPUT_JPEG) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
+				"Unsupported output format: " + std::to_string(output_format));
 			return nullptr;
 		}
 
-		jmethodID constructor = env->GetMethodID(resultClass, "<init>", "(ZLjava/lang/String;[BIIF)V");
-		if (!constructor) {
-			JNIErrorHandler::throw_java_exception(env, "java/lang/NoSuchMethodException",
-				"Could not find StableDiffusionResult constructor");
+		StableDiffusionManager::GenerationParams params;
+		params.prompt = JniUtils::jstring_to_string(env, prompt);
+		params.negative_prompt = negative_prompt ? JniUtils::jstring_to_string(env, negative_prompt) : "";
+		params.width = width;
+		params.height = height;
+		params.steps = steps;
+		params.cfg_scale = cfg_scale;
+		params.slg_scale = slg_scale;
+		params.seed = seed;
+		params.sample_method = sample_method;
+		params.clip_on_cpu = clip_on_cpu;
+		params.output_format = output_format;
+		params.output_quality = output_quality;
+
+		auto result = StableDiffusionManager::getInstance().generateImage(handle, params);
+		return create_generation_result(env, result, output_format);
+
+	} catch (const std::exception& e) {
+		JNIErrorHandler::throw_java_exception(env, "java/lang/RuntimeException",
+			"Failed to generate image: " + std::string(e.what()));
+		return nullptr;
+	}
+}
+
+JNIEXPORT jobject JNICALL
+Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateUpscaled(
+	JNIEnv* env, jclass clazz, jlong handle, jlongArray upscaler_handles, jstring prompt,
+	jstring negative_prompt, jint width, jint height, jint steps,
+	jfloat cfg_scale, jfloat slg_scale, jint seed, jint sample_method,
+	jboolean clip_on_cpu, jbyteArray control_image, jint control_image_width,
+	jint control_image_height, jint control_image_channels, jfloat control_strength,
+	jboolean canny_control, jint upscale_factor, jint tile_size,
+	jint output_format, jint output_quality) {
+
+	try {
+		StableDiffusionManager::UpscaleParams upscale;
+		jsize n_upscalers = upscaler_handles ? env->GetArrayLength(upscaler_handles) : 0;
+		std::vector<jlong> handles(n_upscalers);
+		if (n_upscalers > 0) {
+			env->GetLongArrayRegion(upscaler_handles, 0, n_upscalers, handles.data());
+		}
+		for (jlong upscaler : handles) {
+			if (upscaler == 0) {
+				JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException", "Invalid upscaler handle");
+				return nullptr;
+			}
+			upscale.upscalers.push_back(reinterpret_cast<upscaler_ctx_t*>(upscaler));
+		}
+		if (upscale.upscalers.empty()) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException", "At least one upscaler is required");
 			return nullptr;
 		}
+		upscale.factor = static_cast<uint32_t>(upscale_factor);
+		upscale.tile_size = tile_size;
+		upscale.canny_control = canny_control;
 
-		jstring errorMsg = result.error_message.empty() ? nullptr : env->NewStringUTF(result.error_message.c_str());
-		jbyteArray imageData = nullptr;
+		StableDiffusionManager::GenerationParams params;
+		params.prompt = JniUtils::jstring_to_string(env, prompt);
+		params.negative_prompt = negative_prompt ? JniUtils::jstring_to_string(env, negative_prompt) : "";
+		params.width = width;
+		params.height = height;
+		params.steps = steps;
+		params.cfg_scale = cfg_scale;
+		params.slg_scale = slg_scale;
+		params.seed = seed;
+		params.sample_method = sample_method;
+		params.clip_on_cpu = clip_on_cpu;
+		params.output_format = output_format;
+		params.output_quality = output_quality;
 
-		if (result.success && result.image) {
-			sd_image_t* img = result.image.get();
-			size_t data_size = img->width * img->height * img->channel;
-			imageData = env->NewByteArray(data_size);
-			if (imageData) {
-				env->SetByteArrayRegion(imageData, 0, data_size, reinterpret_cast<const jbyte*>(img->data));
+		if (control_image && control_image_width > 0 && control_image_height > 0) {
+			jsize control_len = env->GetArrayLength(control_image);
+			if (control_len != control_image_width * control_image_height * control_image_channels) {
+				JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
+					"Control image data size does not match dimensions");
+				return nullptr;
 			}
+			params.control_image_data.resize(control_len);
+			env->GetByteArrayRegion(control_image, 0, control_len, reinterpret_cast<jbyte*>(params.control_image_data.data()));
+			params.control_image_width = control_image_width;
+			params.control_image_height = control_image_height;
+			params.control_image_channels = control_image_channels;
+			params.control_strength = control_strength;
 		}
 
-		return env->NewObject(resultClass, constructor,
-			static_cast<jboolean>(result.success),
-			errorMsg,
-			imageData,
-			static_cast<jint>(result.width),
-			static_cast<jint>(result.height),
-			static_cast<jfloat>(result.generation_time));
+		auto result = StableDiffusionManager::getInstance().generateUpscaled(handle, params, upscale);
+		return create_generation_result(env, result, output_format);
 
 	} catch (const std::exception& e) {
 		JNIErrorHandler::throw_java_exception(env, "java/lang/RuntimeException",
-			"Failed to generate image: " + std::string(e.what()));
+			"Failed to generate upscaled image: " + std::string(e.what()));
 		return nullptr;
 	}
 }
@@ -674,38 +1156,7 @@ Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateImageAdvanced(
 
 		// Generate image
 		auto result = StableDiffusionManager::getInstance().generateImage(handle, params);
-
-		// Create Java result object
-		jclass resultClass = env->FindClass("de/kherud/llama/diffusion/StableDiffusionResult");
-		if (!resultClass) {
-			JNIErrorHandler::throw_java_exception(env, "java/lang/ClassNotFoundException", "Could not find StableDiffusionResult class");
-			return nullptr;
-		}
-
-		jmethodID constructor = env->GetMethodID(resultClass, "<init>", "(ZLjava/lang/String;[BIIF)V");
-		if (!constructor) {
-			JNIErrorHandler::throw_java_exception(env, "java/lang/NoSuchMethodException", "Could not find StableDiffusionResult constructor");
-			return nullptr;
-		}
-
-		jstring errorMessage = result.success ? nullptr : env->NewStringUTF(result.error_message.c_str());
-		jbyteArray imageData = nullptr;
-
-		if (result.success && result.image && result.image->data) {
-			// Convert image data to byte array
-			size_t dataSize = result.width * result.height * result.image->channel;
-			imageData = env->NewByteArray(static_cast<jsize>(dataSize));
-			env->SetByteArrayRegion(imageData, 0, static_cast<jsize>(dataSize),
-									reinterpret_cast<const jbyte*>(result.image->data));
-		}
-
-		return env->NewObject(resultClass, constructor,
-							  static_cast<jboolean>(result.success),
-							  errorMessage,
-							  imageData,
-							  static_cast<jint>(result.width),
-							  static_cast<jint>(result.height),
-							  static_cast<jfloat>(result.generation_time));
+		return create_generation_result(env, result, StableDiffusionManager::OUTPUT_RAW);
 
 	} catch (const std::exception& e) {
 		JNIErrorHandler::throw_java_exception(env, "java/lang/RuntimeException", e.what());
@@ -720,9 +1171,6 @@ Java_de_kherud_llama_diffusion_NativeStableDiffusion_preprocessCanny(
 	jfloat highThreshold, jfloat lowThreshold,
 	jfloat weak, jfloat strong, jboolean inverse) {
 
-	jbyte* dataPtr = nullptr;
-	uint8_t* mallocedData = nullptr;
-
 	try {
 		if (!imageData) {
 			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
@@ -736,75 +1184,83 @@ Java_de_kherud_llama_diffusion_NativeStableDiffusion_preprocessCanny(
 			return JNI_FALSE;
 		}
 
-		// Get image data from Java byte array
-		jsize dataLength = env->GetArrayLength(imageData);
-		dataPtr = env->GetByteArrayElements(imageData, nullptr);
-
-		if (!dataPtr) {
-			JNIErrorHandler::throw_java_exception(env, "java/lang/RuntimeException",
-												  "Failed to get image data");
-			return JNI_FALSE;
-		}
-
 		// Verify data size matches dimensions
-		jsize expectedSize = width * height * channels;
-		if (dataLength != expectedSize) {
-			env->ReleaseByteArrayElements(imageData, dataPtr, JNI_ABORT);
+		jsize dataLength = env->GetArrayLength(imageData);
+		if ((jlong)dataLength != (jlong)width * height * channels) {
 			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
 												  "Image data size does not match dimensions");
 			return JNI_FALSE;
 		}
 
-		// Create sd_image_t struct with copied data
-		// preprocess_canny will free() the image.data, so we need to malloc a copy
-		sd_image_t image;
-		image.width = static_cast<uint32_t>(width);
-		image.height = static_cast<uint32_t>(height);
-		image.channel = static_cast<uint32_t>(channels);
-		mallocedData = static_cast<uint8_t*>(malloc(dataLength));
-		image.data = mallocedData;
-
-		if (!image.data) {
-			env->ReleaseByteArrayElements(imageData, dataPtr, JNI_ABORT);
-			JNIErrorHandler::throw_java_exception(env, "java/lang/OutOfMemoryError",
-												  "Failed to allocate memory for image copy");
+		// Edges are detected in place, the array is only written back on success
+		std::vector<uint8_t> image(dataLength);
+		env->GetByteArrayRegion(imageData, 0, dataLength, reinterpret_cast<jbyte*>(image.data()));
+
+		CannyParams params;
+		params.high_threshold = highThreshold;
+		params.low_threshold = lowThreshold;
+		params.weak = weak;
+		params.strong = strong;
+		params.inverse = inverse;
+		if (!CannyEdge::detect(image.data(), width, height, channels, image.data(), width, height, channels, params)) {
 			return JNI_FALSE;
 		}
+		env->SetByteArrayRegion(imageData, 0, dataLength, reinterpret_cast<const jbyte*>(image.data()));
+		return JNI_TRUE;
 
-		// Copy data from Java array to malloc'd buffer
-		memcpy(image.data, dataPtr, dataLength);
+	} catch (const std::exception& e) {
+		JNIErrorHandler::throw_java_exception(env, "java/lang/RuntimeException", e.what());
+		return JNI_FALSE;
+	}
+}
+
+JNIEXPORT jboolean JNICALL
+Java_de_kherud_llama_diffusion_NativeStableDiffusion_detectEdges(
+	JNIEnv* env, jclass clazz,
+	jobject source, jint width, jint height, jint channels,
+	jobject target, jint targetWidth, jint targetHeight, jint targetChannels,
+	jfloat highThreshold, jfloat lowThreshold,
+	jfloat weak, jfloat strong, jboolean inverse) {
 
-		// Apply Canny edge detection (this will free image.data and allocate new data)
-		// After this call, mallocedData is invalid (freed by preprocess_canny)
-		mallocedData = nullptr; // Mark as freed to prevent double free in exception handler
+	try {
+		if (!source || !target) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
+												  "Source and target buffers cannot be null");
+			return JNI_FALSE;
+		}
 
-		bool success = preprocess_canny(image,
-										static_cast<float>(highThreshold),
-										static_cast<float>(lowThreshold),
-										static_cast<float>(weak),
-										static_cast<float>(strong),
-										static_cast<bool>(inverse));
+		if (width <= 0 || height <= 0 || targetWidth <= 0 || targetHeight <= 0) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
+												  "Invalid image dimensions");
+			return JNI_FALSE;
+		}
 
-		// Copy processed data back to Java array
-		if (success && image.data) {
-			env->SetByteArrayRegion(imageData, 0, dataLength,
-									reinterpret_cast<const jbyte*>(image.data));
-			free(image.data); // Free the data allocated by preprocess_canny
+		auto* sourceData = static_cast<uint8_t*>(env->GetDirectBufferAddress(source));
+		auto* targetData = static_cast<uint8_t*>(env->GetDirectBufferAddress(target));
+		if (!sourceData || !targetData) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
+												  "Source and target must be direct buffers");
+			return JNI_FALSE;
 		}
 
-		// Release the array
-		env->ReleaseByteArrayElements(imageData, dataPtr, success ? 0 : JNI_ABORT);
+		if (env->GetDirectBufferCapacity(source) < (jlong)width * height * channels ||
+			env->GetDirectBufferCapacity(target) < (jlong)targetWidth * targetHeight * targetChannels) {
+			JNIErrorHandler::throw_java_exception(env, "java/lang/IllegalArgumentException",
+												  "Buffer capacity does not match dimensions");
+			return JNI_FALSE;
+		}
 
+		CannyParams params;
+		params.high_threshold = highThreshold;
+		params.low_threshold = lowThreshold;
+		params.weak = weak;
+		params.strong = strong;
+		params.inverse = inverse;
+		bool success = CannyEdge::detect(sourceData, width, height, channels,
+										 targetData, targetWidth, targetHeight, targetChannels, params);
 		return success ? JNI_TRUE : JNI_FALSE;
 
 	} catch (const std::exception& e) {
-		// Clean up any allocated memory
-		if (mallocedData) {
-			free(mallocedData);
-		}
-		if (dataPtr) {
-			env->ReleaseByteArrayElements(imageData, dataPtr, JNI_ABORT);
-		}
 		JNIErrorHandler::throw_java_exception(env, "java/lang/RuntimeException", e.what());
 		return JNI_FALSE;
 	}
@@ -814,21 +1270,22 @@ Java_de_kherud_llama_diffusion_NativeStableDiffusion_preprocessCanny(
 namespace {
 	jobject create_upscale_result(JNIEnv* env, bool success, jbyteArray image_data,
 								  int width, int height, int channels, const char* error_message) {
-		jclass resultClass = env->FindClass("de/kherud/llama/diffusion/UpscaleResult");
+		const JniCache& jni = JniUtils::cache();
+		jclass resultClass = jni.upscale_result_class;
 		if (!resultClass) {
 			JNIErrorHandler::throw_java_exception(env, "java/lang/ClassNotFoundException", "Could not find UpscaleResult class");
 			return nullptr;
 		}
 
 		if (success) {
-			jmethodID successMethod = env->GetStaticMethodID(resultClass, "success", "([BIII)Lde/kherud/llama/diffusion/UpscaleResult;");
+			jmethodID successMethod = jni.upscale_result_success;
 			if (!successMethod) {
 				JNIErrorHandler::throw_java_exception(env, "java/lang/NoSuchMethodException", "Could not find UpscaleResult.success method");
 				return nullptr;
 			}
 			return env->CallStaticObjectMethod(resultClass, successMethod, image_data, width, height, channels);
 		} else {
-			jmethodID failureMethod = env->GetStaticMethodID(resultClass, "failure", "(Ljava/lang/String;)Lde/kherud/llama/diffusion/UpscaleResult;");
+			jmethodID failureMethod = jni.upscale_result_failure;
 			if (!failureMethod) {
 				JNIErrorHandler::throw_java_exception(env, "java/lang/NoSuchMethodException", "Could not find UpscaleResult.failure method");
 				return nullptr;
@@ -2,6 +2,8 @@
 #define STABLE_DIFFUSION_MANAGER_H
 
 #include <jni.h>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -12,9 +14,21 @@
 /**
  * Manager for Stable Diffusion contexts and operations.
  * Provides native integration between Java and stable-diffusion.cpp.
+ *
+ * Concurrency: the manager lock only guards the handle table. Every context runs one generation
+ * at a time, different contexts generate in parallel. Requests for a busy context queue on it,
+ * the next caller whose request is pending runs the following batch, and text-to-image requests
+ * that differ only in consecutive seeds go into one generate_image call through batch_count.
  */
 class StableDiffusionManager {
 public:
+	// Form of the returned pixels, encoded by the calling thread once its image is generated
+	enum OutputFormat {
+		OUTPUT_RAW = 0,
+		OUTPUT_PNG = 1,
+		OUTPUT_JPEG = 2,
+	};
+
 	struct GenerationParams {
 		std::string prompt;
 		std::string negative_prompt;
@@ -46,17 +60,36 @@ public:
 		int mask_image_width = 0;
 		int mask_image_height = 0;
 		int mask_image_channels = 1;
+
+		// Output encoding
+		int output_format = OUTPUT_RAW;
+		int output_quality = 90; // JPEG only, 1-100
+	};
+
+	// Images of generate_image, their struct and pixels are malloc'ed
+	struct ImageDeleter {
+		void operator()(sd_image_t* image) const;
 	};
 
 	struct GenerationResult {
 		bool success = false;
 		std::string error_message;
-		std::unique_ptr<sd_image_t> image;
+		std::unique_ptr<sd_image_t, ImageDeleter> image;
+		std::vector<uint8_t> encoded; // Replaces image unless the output format is raw
 		int width = 0;
 		int height = 0;
+		int channels = 0;
 		float generation_time = 0.0f;
 	};
 
+	// Upscaling of a generated image without it leaving native memory
+	struct UpscaleParams {
+		std::vector<upscaler_ctx_t*> upscalers; // Tiles are spread over all of them, one thread each
+		uint32_t factor = 4;
+		int tile_size = 512;                    // Input pixels per tile side, tiles overlap by an eighth
+		bool canny_control = false;             // Replace the control image by its Canny edges first
+	};
+
 	static StableDiffusionManager& getInstance();
 
 	// Context management
@@ -84,6 +117,14 @@ public:
 	// Image generation
 	GenerationResult generateImage(jlong handle, const GenerationParams& params);
 
+	// Preprocess the control image, generate and upscale, then encode in the output format
+	GenerationResult generateUpscaled(jlong handle, const GenerationParams& params, const UpscaleParams& upscale);
+
+	// Upscale in overlapping tiles, blended linearly across the overlaps, so that memory is bounded
+	// by the tile size and not by the image
+	static std::unique_ptr<sd_image_t, ImageDeleter> upscaleTiled(const UpscaleParams& params,
+																  const sd_image_t& input, std::string& error);
+
 	// Utility functions
 	static bool isValidImageFormat(const std::string& path);
 	static std::string getErrorMessage();
@@ -92,17 +133,35 @@ private:
 	StableDiffusionManager() = default;
 	~StableDiffusionManager();
 
+	struct PendingRequest {
+		const GenerationParams* params;
+		GenerationResult* result;
+		bool done = false;
+	};
+
 	struct ContextData {
 		std::unique_ptr<sd_ctx_t, void(*)(sd_ctx_t*)> context;
 		std::string model_path;
 
+		// Requests waiting for the context, guarded by queue_mutex
+		std::mutex queue_mutex;
+		std::condition_variable queue_cv;
+		std::deque<PendingRequest*> queue;
+		bool busy = false;
+
 		ContextData(sd_ctx_t* ctx) : context(ctx, [](sd_ctx_t* p) {
 			if (p) free_sd_ctx(p);
 		}) {}
 	};
 
+	// Remove the next batch from a queue: its first request and the requests that can share its
+	// generate_image call
+	static std::vector<PendingRequest*> takeBatch(std::deque<PendingRequest*>& queue);
+	static void runBatch(ContextData& data, const std::vector<PendingRequest*>& batch);
+
 	std::mutex contexts_mutex_;
-	std::unordered_map<jlong, std::unique_ptr<ContextData>> contexts_;
+	// Shared so that a context destroyed while it generates is freed once the generation is done
+	std::unordered_map<jlong, std::shared_ptr<ContextData>> contexts_;
 	jlong next_handle_ = 1;
 
 	static thread_local std::string last_error_;
@@ -140,6 +199,23 @@ Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateImage(
 	jfloat cfg_scale, jfloat slg_scale, jint seed, jint sample_method,
 	jboolean clip_on_cpu);
 
+JNIEXPORT jobject JNICALL
+Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateImageEncoded(
+	JNIEnv* env, jclass clazz, jlong handle, jstring prompt,
+	jstring negative_prompt, jint width, jint height, jint steps,
+	jfloat cfg_scale, jfloat slg_scale, jint seed, jint sample_method,
+	jboolean clip_on_cpu, jint output_format, jint output_quality);
+
+JNIEXPORT jobject JNICALL
+Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateUpscaled(
+	JNIEnv* env, jclass clazz, jlong handle, jlongArray upscaler_handles, jstring prompt,
+	jstring negative_prompt, jint width, jint height, jint steps,
+	jfloat cfg_scale, jfloat slg_scale, jint seed, jint sample_method,
+	jboolean clip_on_cpu, jbyteArray control_image, jint control_image_width,
+	jint control_image_height, jint control_image_channels, jfloat control_strength,
+	jboolean canny_control, jint upscale_factor, jint tile_size,
+	jint output_format, jint output_quality);
+
 JNIEXPORT jobject JNICALL
 Java_de_kherud_llama_diffusion_NativeStableDiffusion_generateImageAdvanced(
 	JNIEnv* env, jclass clazz, jlong handle, jstring prompt,
@@ -168,6 +244,14 @@ Java_de_kherud_llama_diffusion_NativeStableDiffusion_preprocessCanny(
 	jfloat highThreshold, jfloat lowThreshold,
 	jfloat weak, jfloat strong, jboolean inverse);
 
+JNIEXPORT jboolean JNICALL
+Java_de_kherud_llama_diffusion_NativeStableDiffusion_detectEdges(
+	JNIEnv* env, jclass clazz,
+	jobject source, jint width, jint height, jint channels,
+	jobject target, jint targetWidth, jint targetHeight, jint targetChannels,
+	jfloat highThreshold, jfloat lowThreshold,
+	jfloat weak, jfloat strong, jboolean inverse);
+
 // Image upscaling
 JNIEXPORT jlong JNICALL
 Java_de_kherud_llama_diffusion_NativeStableDiffusion_createUpscalerContext(
@@ -1,26 +1,28 @@
 #include "state_manager.h"
 #include "jni_utils.h"
 #include "jni_error_handler.h"
+#include "mapped_file.h"
+#include "native_trace.h"
 #include <mutex>
 #include <unordered_map>
 #include <memory>
-
-// External global server management (defined in jllama.cpp)
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#ifdef JLLAMA_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 jlong StateManager::getStateSize(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	size_t state_size = llama_state_get_size(server->ctx);
 	return (jlong)state_size;
@@ -31,9 +33,12 @@ jlong StateManager::getStateSize(JNIEnv* env, jobject obj) {
 jbyteArray StateManager::getStateData(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	JLLAMA_TRACE_SPAN("state", "get_state_data");
+	
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL(env, server, "server");
 	JNI_CHECK_NULL(env, server->ctx, "server->ctx");
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	size_t state_size = llama_state_get_size(server->ctx);
 	// Note: llama.cpp returns 0 on error, but may also return 0 for valid empty states
@@ -72,13 +77,16 @@ jbyteArray StateManager::getStateData(JNIEnv* env, jobject obj) {
 jlong StateManager::setStateData(JNIEnv* env, jobject obj, jbyteArray state_data) {
 	JNI_TRY(env)
 	
+	JLLAMA_TRACE_SPAN("state", "set_state_data");
+	
 	if (!JNIErrorHandler::validate_array(env, state_data, "state_data", 1)) {
 		return -1;
 	}
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	jsize data_size = env->GetArrayLength(state_data);
 	jbyte* state_bytes = env->GetByteArrayElements(state_data, nullptr);
@@ -101,13 +109,16 @@ jlong StateManager::setStateData(JNIEnv* env, jobject obj, jbyteArray state_data
 jboolean StateManager::saveStateToFile(JNIEnv* env, jobject obj, jstring path, jintArray tokens) {
 	JNI_TRY(env)
 	
+	JLLAMA_TRACE_SPAN("state", "save_state_file");
+	
 	if (!JNIErrorHandler::validate_string(env, path, "path")) {
 		return JNI_FALSE;
 	}
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", JNI_FALSE);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", JNI_FALSE);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	std::string file_path = JniUtils::jstring_to_string(env, path);
 	
@@ -144,13 +155,16 @@ jboolean StateManager::saveStateToFile(JNIEnv* env, jobject obj, jstring path, j
 jintArray StateManager::loadStateFromFile(JNIEnv* env, jobject obj, jstring path, jint max_tokens) {
 	JNI_TRY(env)
 	
+	JLLAMA_TRACE_SPAN("state", "load_state_file");
+	
 	if (!JNIErrorHandler::validate_string(env, path, "path")) {
 		return nullptr;
 	}
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL(env, server, "server");
 	JNI_CHECK_NULL(env, server->ctx, "server->ctx");
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	std::string file_path = JniUtils::jstring_to_string(env, path);
 	
@@ -186,9 +200,10 @@ jintArray StateManager::loadStateFromFile(JNIEnv* env, jobject obj, jstring path
 jlong StateManager::getSequenceStateSize(JNIEnv* env, jobject obj, jint seq_id) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	size_t state_size = llama_state_seq_get_size(server->ctx, seq_id);
 	// If state size is 0, it might mean the sequence is empty or doesn't exist
@@ -201,9 +216,12 @@ jlong StateManager::getSequenceStateSize(JNIEnv* env, jobject obj, jint seq_id)
 jbyteArray StateManager::getSequenceStateData(JNIEnv* env, jobject obj, jint seq_id) {
 	JNI_TRY(env)
 	
-	LlamaServer* server = getServer(env, obj);
+	JLLAMA_TRACE_SPAN("state", "get_sequence_state");
+	
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL(env, server, "server");
 	JNI_CHECK_NULL(env, server->ctx, "server->ctx");
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	size_t state_size = llama_state_seq_get_size(server->ctx, seq_id);
 	if (state_size == 0) {
@@ -245,13 +263,16 @@ jbyteArray StateManager::getSequenceStateData(JNIEnv* env, jobject obj, jint seq
 jlong StateManager::setSequenceStateData(JNIEnv* env, jobject obj, jbyteArray state_data, jint seq_id) {
 	JNI_TRY(env)
 	
+	JLLAMA_TRACE_SPAN("state", "set_sequence_state");
+	
 	if (!JNIErrorHandler::validate_array(env, state_data, "state_data", 1)) {
 		return -1;
 	}
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	jsize data_size = env->GetArrayLength(state_data);
 	jbyte* state_bytes = env->GetByteArrayElements(state_data, nullptr);
@@ -274,13 +295,16 @@ jlong StateManager::setSequenceStateData(JNIEnv* env, jobject obj, jbyteArray st
 jlong StateManager::saveSequenceToFile(JNIEnv* env, jobject obj, jstring path, jint seq_id, jintArray tokens) {
 	JNI_TRY(env)
 	
+	JLLAMA_TRACE_SPAN("state", "save_sequence_file");
+	
 	if (!JNIErrorHandler::validate_string(env, path, "path")) {
 		return -1;
 	}
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL_RET(env, server, "server", -1);
 	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	std::string file_path = JniUtils::jstring_to_string(env, path);
 	
@@ -317,13 +341,16 @@ jlong StateManager::saveSequenceToFile(JNIEnv* env, jobject obj, jstring path, j
 jintArray StateManager::loadSequenceFromFile(JNIEnv* env, jobject obj, jstring path, jint seq_id, jint max_tokens) {
 	JNI_TRY(env)
 	
+	JLLAMA_TRACE_SPAN("state", "load_sequence_file");
+	
 	if (!JNIErrorHandler::validate_string(env, path, "path")) {
 		return nullptr;
 	}
 	
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL(env, server, "server");
 	JNI_CHECK_NULL(env, server->ctx, "server->ctx");
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
 	
 	std::string file_path = JniUtils::jstring_to_string(env, path);
 	
@@ -356,19 +383,436 @@ jintArray StateManager::loadSequenceFromFile(JNIEnv* env, jobject obj, jstring p
 	JNI_CATCH_RET(env, nullptr)
 }
 
-LlamaServer* StateManager::getServer(JNIEnv* env, jobject obj) {
+// Streaming state export and import. A sequence id of -1 stands for the whole context state.
+// Files and channels carry a small header followed by the raw or zstd-compressed state bytes.
+
+namespace {
+
+struct StateStreamHeader {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t raw_size;
+};
+
+constexpr uint32_t STATE_STREAM_MAGIC = 0x4C535331;  // "LSS1"
+constexpr uint32_t STATE_FLAG_ZSTD = 1;
+constexpr size_t STATE_CHUNK_SIZE = 1 << 20;
+
+bool valid_state_seq(LlamaServer* server, jint seq_id) {
+	return seq_id >= -1 && seq_id < (jint)llama_n_seq_max(server->ctx);
+}
+
+size_t state_size(llama_context* ctx, jint seq_id) {
+	return seq_id < 0 ? llama_state_get_size(ctx) : llama_state_seq_get_size(ctx, seq_id);
+}
+
+size_t state_get(llama_context* ctx, jint seq_id, uint8_t* dst, size_t size) {
+	return seq_id < 0 ? llama_state_get_data(ctx, dst, size) : llama_state_seq_get_data(ctx, dst, size, seq_id);
+}
+
+size_t state_set(llama_context* ctx, jint seq_id, const uint8_t* src, size_t size) {
+	return seq_id < 0 ? llama_state_set_data(ctx, src, size) : llama_state_seq_set_data(ctx, src, size, seq_id);
+}
+
+// Copy the state into a scratch file mapping, so that compressing or writing it out happens
+// without holding the context and without an anonymous copy of the whole state
+bool stage_state(LlamaServer* server, jint seq_id, MappedFile& staging) {
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+	size_t size = state_size(server->ctx, seq_id);
+	if (!staging.create_temporary(size)) return false;
+	return state_get(server->ctx, seq_id, staging.data(), size) == size;
+}
+
+bool write_channel(JNIEnv* env, jobject channel, jmethodID write, uint8_t* data, size_t size) {
+	// The bytes are handed to Java in place, wrapped in a direct buffer
+	jobject buffer = env->NewDirectByteBuffer(data, (jlong)size);
+	if (!buffer) return false;
+	size_t written = 0;
+	while (written < size) {
+		jint n = env->CallIntMethod(channel, write, buffer);
+		if (env->ExceptionCheck()) break;
+		if (n > 0) written += (size_t)n;
+	}
+	env->DeleteLocalRef(buffer);
+	return written == size;
+}
+
+// Read up to size bytes, fewer only at the end of the channel
+size_t read_channel(JNIEnv* env, jobject channel, jmethodID read, uint8_t* data, size_t size) {
+	jobject buffer = env->NewDirectByteBuffer(data, (jlong)size);
+	if (!buffer) return 0;
+	size_t filled = 0;
+	while (filled < size) {
+		jint n = env->CallIntMethod(channel, read, buffer);
+		if (env->ExceptionCheck() || n < 0) break;
+		filled += (size_t)n;
+	}
+	env->DeleteLocalRef(buffer);
+	return filled;
+}
+
+#ifdef JLLAMA_HAVE_ZSTD
+// Fast levels keep compression close to disk and network speed
+constexpr int STATE_ZSTD_LEVEL = 1;
+
+bool compress_state(const uint8_t* src, size_t size, size_t chunk_size,
+		const std::function<bool(const uint8_t*, size_t)>& sink) {
+	ZSTD_CCtx* cctx = ZSTD_createCCtx();
+	if (!cctx) return false;
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, STATE_ZSTD_LEVEL);
+	ZSTD_CCtx_setPledgedSrcSize(cctx, size);
+
+	std::vector<uint8_t> out(std::max(chunk_size, ZSTD_CStreamOutSize()));
+	ZSTD_inBuffer input = { src, size, 0 };
+	bool ok = true;
+	size_t remaining;
+	do {
+		ZSTD_outBuffer output = { out.data(), out.size(), 0 };
+		remaining = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+		if (ZSTD_isError(remaining) || (output.pos > 0 && !sink(out.data(), output.pos))) {
+			ok = false;
+			break;
+		}
+	} while (remaining != 0);
+	ZSTD_freeCCtx(cctx);
+	return ok;
+}
+
+// Decompress the stream fed by source (which returns 0 at its end) into exactly size bytes of dst
+bool decompress_state(uint8_t* dst, size_t size, size_t chunk_size,
+		const std::function<size_t(uint8_t*, size_t)>& source) {
+	ZSTD_DCtx* dctx = ZSTD_createDCtx();
+	if (!dctx) return false;
+
+	std::vector<uint8_t> in(std::max(chunk_size, ZSTD_DStreamInSize()));
+	ZSTD_outBuffer output = { dst, size, 0 };
+	size_t ret = 1;
+	while (ret != 0) {
+		size_t n = source(in.data(), in.size());
+		if (n == 0) break;
+		ZSTD_inBuffer input = { in.data(), n, 0 };
+		while (input.pos < input.size) {
+			ret = ZSTD_decompressStream(dctx, &output, &input);
+			if (ZSTD_isError(ret) || (ret != 0 && output.pos == output.size && input.pos < input.size)) {
+				ZSTD_freeDCtx(dctx);
+				return false;
+			}
+			if (ret == 0) break;
+		}
+	}
+	ZSTD_freeDCtx(dctx);
+	return ret == 0 && output.pos == size;
+}
+#endif
+
+bool check_compression(JNIEnv* env, jboolean compress) {
+#ifndef JLLAMA_HAVE_ZSTD
+	if (compress) {
+		JNIErrorHandler::throw_illegal_argument(env, "State compression is not available, jllama was built without zstd");
+		return false;
+	}
+#endif
+	return true;
+}
+
+bool parse_header(JNIEnv* env, const StateStreamHeader& header) {
+	if (header.magic != STATE_STREAM_MAGIC) {
+		JNIErrorHandler::throw_illegal_argument(env, "Not an exported state stream");
+		return false;
+	}
+	if ((header.flags & STATE_FLAG_ZSTD) && !check_compression(env, JNI_TRUE)) {
+		return false;
+	}
+	return true;
+}
+
+} // namespace
+
+jboolean StateManager::isStateCompressionAvailable(JNIEnv* env, jclass cls) {
+#ifdef JLLAMA_HAVE_ZSTD
+	return JNI_TRUE;
+#else
+	return JNI_FALSE;
+#endif
+}
+
+jlong StateManager::getStateInto(JNIEnv* env, jobject obj, jint seq_id, jobject buffer, jint offset, jint length) {
+	JNI_TRY(env)
+	
+	JLLAMA_TRACE_SPAN("state", "get_state_into");
+	
+	ServerRef server = getServer(env, obj);
+	JNI_CHECK_NULL_RET(env, server, "server", -1);
+	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	if (!valid_state_seq(server, seq_id)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Invalid sequence id " + std::to_string(seq_id));
+		return -1;
+	}
+	
+	uint8_t* data = buffer ? static_cast<uint8_t*>(env->GetDirectBufferAddress(buffer)) : nullptr;
+	jlong capacity = buffer ? env->GetDirectBufferCapacity(buffer) : -1;
+	if (!data || offset < 0 || length < 0 || (jlong)offset + length > capacity) {
+		JNIErrorHandler::throw_illegal_argument(env, "State buffer must be a direct ByteBuffer");
+		return -1;
+	}
+	
+	// Written straight into the caller's buffer, no intermediate copy
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+	size_t size = state_size(server->ctx, seq_id);
+	if (size > (size_t)length) {
+		JNIErrorHandler::throw_illegal_argument(env, "State buffer too small, " + std::to_string(size) + " bytes needed");
+		return -1;
+	}
+	size_t written = state_get(server->ctx, seq_id, data + offset, size);
+	return written == size ? (jlong)written : -1;
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jlong StateManager::setStateFrom(JNIEnv* env, jobject obj, jint seq_id, jobject buffer, jint offset, jint length) {
+	JNI_TRY(env)
+	
+	JLLAMA_TRACE_SPAN("state", "set_state_from");
+	
+	ServerRef server = getServer(env, obj);
+	JNI_CHECK_NULL_RET(env, server, "server", -1);
+	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	if (!valid_state_seq(server, seq_id)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Invalid sequence id " + std::to_string(seq_id));
+		return -1;
+	}
+	
+	const uint8_t* data = buffer ? static_cast<const uint8_t*>(env->GetDirectBufferAddress(buffer)) : nullptr;
+	jlong capacity = buffer ? env->GetDirectBufferCapacity(buffer) : -1;
+	if (!data || offset < 0 || length <= 0 || (jlong)offset + length > capacity) {
+		JNIErrorHandler::throw_illegal_argument(env, "State buffer must be a non-empty direct ByteBuffer");
+		return -1;
+	}
+	
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+	size_t loaded = state_set(server->ctx, seq_id, data + offset, (size_t)length);
+	return loaded > 0 ? (jlong)loaded : -1;
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jlong StateManager::exportStateFile(JNIEnv* env, jobject obj, jint seq_id, jstring path, jboolean compress) {
+	JNI_TRY(env)
+	
+	JLLAMA_TRACE_SPAN("state", "export_state_file");
+	
+	if (!JNIErrorHandler::validate_string(env, path, "path") || !check_compression(env, compress)) {
+		return -1;
+	}
+	
+	ServerRef server = getServer(env, obj);
+	JNI_CHECK_NULL_RET(env, server, "server", -1);
+	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	if (!valid_state_seq(server, seq_id)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Invalid sequence id " + std::to_string(seq_id));
+		return -1;
+	}
+	
+	std::string file_path = JniUtils::jstring_to_string(env, path);
+	StateStreamHeader header = { STATE_STREAM_MAGIC, compress ? STATE_FLAG_ZSTD : 0u, 0 };
+	
+	if (!compress) {
+		// The state is written into the mapped file, the kernel streams it to disk
+		std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+		header.raw_size = state_size(server->ctx, seq_id);
+		MappedFile out;
+		if (!out.create(file_path, sizeof(header) + header.raw_size)) return -1;
+		std::memcpy(out.data(), &header, sizeof(header));
+		if (state_get(server->ctx, seq_id, out.data() + sizeof(header), header.raw_size) != header.raw_size) {
+			return -1;
+		}
+		return (jlong)out.size();
+	}
+	
+#ifdef JLLAMA_HAVE_ZSTD
+	MappedFile staging;
+	if (!stage_state(server, seq_id, staging)) return -1;
+	header.raw_size = staging.size();
+	
+	FILE* out = std::fopen(file_path.c_str(), "wb");
+	if (!out) return -1;
+	bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+	jlong written = sizeof(header);
+	ok = ok && compress_state(staging.data(), staging.size(), STATE_CHUNK_SIZE,
+		[&](const uint8_t* data, size_t size) {
+			written += (jlong)size;
+			return std::fwrite(data, 1, size, out) == size;
+		});
+	ok = std::fclose(out) == 0 && ok;
+	return ok ? written : -1;
+#else
+	return -1;
+#endif
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jlong StateManager::importStateFile(JNIEnv* env, jobject obj, jint seq_id, jstring path) {
+	JNI_TRY(env)
+	
+	JLLAMA_TRACE_SPAN("state", "import_state_file");
+	
+	if (!JNIErrorHandler::validate_string(env, path, "path")) {
+		return -1;
+	}
+	
+	ServerRef server = getServer(env, obj);
+	JNI_CHECK_NULL_RET(env, server, "server", -1);
+	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	if (!valid_state_seq(server, seq_id)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Invalid sequence id " + std::to_string(seq_id));
+		return -1;
+	}
+	
+	MappedFile in;
+	if (!in.open_read(JniUtils::jstring_to_string(env, path)) || in.size() < sizeof(StateStreamHeader)) return -1;
+	StateStreamHeader header;
+	std::memcpy(&header, in.data(), sizeof(header));
+	if (!parse_header(env, header)) return -1;
+	
+	const uint8_t* payload = in.data() + sizeof(header);
+	size_t payload_size = in.size() - sizeof(header);
+	
+	if (!(header.flags & STATE_FLAG_ZSTD)) {
+		// Loaded straight from the mapping
+		if (payload_size < header.raw_size) return -1;
+		std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+		size_t loaded = state_set(server->ctx, seq_id, payload, header.raw_size);
+		return loaded > 0 ? (jlong)loaded : -1;
+	}
+	
+#ifdef JLLAMA_HAVE_ZSTD
+	MappedFile staging;
+	if (!staging.create_temporary(header.raw_size)) return -1;
+	if (ZSTD_decompress(staging.data(), staging.size(), payload, payload_size) != header.raw_size) return -1;
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+	size_t loaded = state_set(server->ctx, seq_id, staging.data(), staging.size());
+	return loaded > 0 ? (jlong)loaded : -1;
+#else
+	return -1;
+#endif
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jlong StateManager::exportStateChannel(JNIEnv* env, jobject obj, jint seq_id, jobject channel,
+		jint chunk_size, jboolean compress) {
+	JNI_TRY(env)
+	
+	JLLAMA_TRACE_SPAN("state", "export_state_channel");
+	
+	JNI_CHECK_NULL_RET(env, channel, "channel", -1);
+	if (!check_compression(env, compress)) return -1;
+	
+	ServerRef server = getServer(env, obj);
+	JNI_CHECK_NULL_RET(env, server, "server", -1);
+	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	if (!valid_state_seq(server, seq_id)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Invalid sequence id " + std::to_string(seq_id));
+		return -1;
+	}
+	
+	jmethodID write = JniUtils::cache().writable_channel_write;
+	if (!write) return -1;
+	
+	MappedFile staging;
+	if (!stage_state(server, seq_id, staging)) return -1;
+	
+	StateStreamHeader header = { STATE_STREAM_MAGIC, compress ? STATE_FLAG_ZSTD : 0u, staging.size() };
+	if (!write_channel(env, channel, write, reinterpret_cast<uint8_t*>(&header), sizeof(header))) return -1;
+	jlong written = sizeof(header);
+	size_t chunk = chunk_size > 0 ? (size_t)chunk_size : STATE_CHUNK_SIZE;
+	
+	if (!compress) {
+		// Chunks are slices of the staging mapping, nothing is copied
+		for (size_t pos = 0; pos < staging.size(); pos += chunk) {
+			size_t n = std::min(chunk, staging.size() - pos);
+			if (!write_channel(env, channel, write, staging.data() + pos, n)) return -1;
+			written += (jlong)n;
+		}
+		return written;
+	}
+	
+#ifdef JLLAMA_HAVE_ZSTD
+	bool ok = compress_state(staging.data(), staging.size(), chunk, [&](const uint8_t* data, size_t size) {
+		written += (jlong)size;
+		return write_channel(env, channel, write, const_cast<uint8_t*>(data), size);
+	});
+	return ok ? written : -1;
+#else
+	return -1;
+#endif
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jlong StateManager::importStateChannel(JNIEnv* env, jobject obj, jint seq_id, jobject channel, jint chunk_size) {
+	JNI_TRY(env)
+	
+	JLLAMA_TRACE_SPAN("state", "import_state_channel");
+	
+	JNI_CHECK_NULL_RET(env, channel, "channel", -1);
+	
+	ServerRef server = getServer(env, obj);
+	JNI_CHECK_NULL_RET(env, server, "server", -1);
+	JNI_CHECK_NULL_RET(env, server->ctx, "server->ctx", -1);
+	if (!valid_state_seq(server, seq_id)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Invalid sequence id " + std::to_string(seq_id));
+		return -1;
+	}
+	
+	jmethodID read = JniUtils::cache().readable_channel_read;
+	if (!read) return -1;
+	
+	StateStreamHeader header;
+	if (read_channel(env, channel, read, reinterpret_cast<uint8_t*>(&header), sizeof(header)) != sizeof(header)) {
+		if (!env->ExceptionCheck()) JNIErrorHandler::throw_illegal_argument(env, "Truncated state stream");
+		return -1;
+	}
+	if (!parse_header(env, header)) return -1;
+	
+	MappedFile staging;
+	if (!staging.create_temporary(header.raw_size)) return -1;
+	
+	if (!(header.flags & STATE_FLAG_ZSTD)) {
+		// Read straight into the staging mapping
+		if (read_channel(env, channel, read, staging.data(), staging.size()) != staging.size()) return -1;
+	} else {
+#ifdef JLLAMA_HAVE_ZSTD
+		size_t chunk = chunk_size > 0 ? (size_t)chunk_size : STATE_CHUNK_SIZE;
+		bool ok = decompress_state(staging.data(), staging.size(), chunk, [&](uint8_t* data, size_t size) {
+			return env->ExceptionCheck() ? 0 : read_channel(env, channel, read, data, size);
+		});
+		if (!ok) return -1;
+#endif
+	}
+	if (env->ExceptionCheck()) return -1;
+	
+	std::lock_guard<std::mutex> ctx_lock(server->ctx_mutex);
+	size_t loaded = state_set(server->ctx, seq_id, staging.data(), staging.size());
+	return loaded > 0 ? (jlong)loaded : -1;
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+ServerRef StateManager::getServer(JNIEnv* env, jobject obj) {
 	jclass cls = env->GetObjectClass(obj);
 	if (!cls) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get object class");
 		return nullptr;
 	}
 	
-	jfieldID field = env->GetFieldID(cls, "ctx", "J");
+	jfieldID field = JniUtils::ctx_field(env, cls);
 	if (!field) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get ctx field");
 		return nullptr;
 	}
 	
 	jlong handle = env->GetLongField(obj, field);
-	return get_server(handle);
+	return ServerTable::acquire(handle);
 }
\ No newline at end of file
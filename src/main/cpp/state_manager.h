@@ -4,6 +4,7 @@
 #include <string>
 #include "llama.h"
 #include "llama_server.h"
+#include "server_table.h"
 
 /**
  * Handles state persistence operations for llama.cpp contexts.
@@ -106,6 +107,55 @@ public:
 	 */
 	static jintArray loadSequenceFromFile(JNIEnv* env, jobject obj, jstring path, jint seq_id, jint max_tokens);
 
+	/**
+	 * Copy the context or a sequence state into a direct ByteBuffer, without an intermediate copy.
+	 * @param seq_id Sequence ID, or -1 for the whole context
+	 * @param buffer Direct ByteBuffer receiving the state at offset, at most length bytes
+	 * @return Number of bytes written, or -1 on error
+	 */
+	static jlong getStateInto(JNIEnv* env, jobject obj, jint seq_id, jobject buffer, jint offset, jint length);
+
+	/**
+	 * Restore the context or a sequence state from length bytes of a direct ByteBuffer.
+	 * @param seq_id Sequence ID, or -1 for the whole context
+	 * @return Number of bytes loaded, or -1 on error
+	 */
+	static jlong setStateFrom(JNIEnv* env, jobject obj, jint seq_id, jobject buffer, jint offset, jint length);
+
+	/**
+	 * Export the context or a sequence state to a file through a memory mapping, optionally zstd-compressed.
+	 * @param seq_id Sequence ID, or -1 for the whole context
+	 * @return Number of bytes written to the file, or -1 on error
+	 */
+	static jlong exportStateFile(JNIEnv* env, jobject obj, jint seq_id, jstring path, jboolean compress);
+
+	/**
+	 * Import a state written by exportStateFile or exportStateChannel.
+	 * @param seq_id Sequence ID, or -1 for the whole context
+	 * @return Number of state bytes loaded, or -1 on error
+	 */
+	static jlong importStateFile(JNIEnv* env, jobject obj, jint seq_id, jstring path);
+
+	/**
+	 * Stream the context or a sequence state to a WritableByteChannel in chunks of chunk_size bytes.
+	 * @param seq_id Sequence ID, or -1 for the whole context
+	 * @return Number of bytes written to the channel, or -1 on error
+	 */
+	static jlong exportStateChannel(JNIEnv* env, jobject obj, jint seq_id, jobject channel, jint chunk_size,
+		jboolean compress);
+
+	/**
+	 * Restore a state streamed by exportStateChannel or written by exportStateFile from a ReadableByteChannel.
+	 * @param seq_id Sequence ID, or -1 for the whole context
+	 * @return Number of state bytes loaded, or -1 on error
+	 */
+	static jlong importStateChannel(JNIEnv* env, jobject obj, jint seq_id, jobject channel, jint chunk_size);
+
+	/**
+	 * Whether jllama was built with zstd, which state exports use for compression.
+	 */
+	static jboolean isStateCompressionAvailable(JNIEnv* env, jclass cls);
+
 private:
 	/**
 	 * Get server handle from Java object.
@@ -113,5 +163,5 @@ private:
 	 * @param obj Java LlamaModel object
 	 * @return LlamaServer pointer, or nullptr if not found
 	 */
-	static LlamaServer* getServer(JNIEnv* env, jobject obj);
+	static ServerRef getServer(JNIEnv* env, jobject obj);
 };
\ No newline at end of file
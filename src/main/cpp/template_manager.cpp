@@ -2,28 +2,20 @@
 #include "jni_utils.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
+#include "server_table.h"
+#include "chat_conversation.h"
 #include <vector>
 #include <string>
 #include <mutex>
 #include <unordered_map>
 #include <memory>
-
-// These are defined in jllama.cpp but we need access to them
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_template_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
+#include <algorithm>
 
 jstring TemplateManager::applyTemplate(JNIEnv* env, jobject obj, jstring params) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_template_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return nullptr;
 	
 	std::string param_str = JniUtils::jstring_to_string(env, params);
@@ -31,61 +23,282 @@ jstring TemplateManager::applyTemplate(JNIEnv* env, jobject obj, jstring params)
 	// Parse JSON parameters to extract messages array
 	std::vector<std::pair<std::string, std::string>> messages = parseMessages(param_str);
 	
-	// Get the model's chat template
-	const char* tmpl = llama_model_chat_template(server->model, nullptr);
-	if (!tmpl) {
-		// Fallback to ChatML template if model doesn't have one
-		tmpl = getDefaultChatMLTemplate();
+	// Apply the template, adding the generation prompt
+	std::string result;
+	if (!renderMessages(chatTemplate(server), messages, 0, messages.size(), true, result)) {
+		JNIErrorHandler::throw_runtime_exception(env,
+			"Failed to apply chat template");
+		return nullptr;
 	}
 	
-	// Create llama_chat_message array from parsed messages
-	std::vector<llama_chat_message> chat_messages;
+	return JniUtils::string_to_jstring(env, result);
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+static std::shared_ptr<ChatConversation> find_conversation(LlamaServer* server, jlong conversation) {
+	std::lock_guard<std::mutex> lock(server->conversations_mutex);
+	auto it = server->conversations.find(conversation);
+	return (it != server->conversations.end()) ? it->second : nullptr;
+}
+
+// Chat templates mark message boundaries with special tokens, so they are parsed as such
+static bool tokenize_append(const llama_vocab* vocab, const std::string& text, bool add_special,
+		std::vector<llama_token>& out) {
+	if (text.empty()) return true;
+	
+	size_t n_old = out.size();
+	out.resize(n_old + text.length() + 2);
+	int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
+								  out.data() + n_old, out.size() - n_old, add_special, true);
+	if (n_tokens < 0) {
+		out.resize(n_old + -n_tokens);
+		n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
+								  out.data() + n_old, out.size() - n_old, add_special, true);
+	}
+	if (n_tokens < 0) {
+		out.resize(n_old);
+		return false;
+	}
+	out.resize(n_old + n_tokens);
+	return true;
+}
+
+jlong TemplateManager::createConversation(JNIEnv* env, jobject obj) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return 0;
+	}
+	
+	std::lock_guard<std::mutex> lock(server->conversations_mutex);
+	jlong id = server->next_conversation_id++;
+	server->conversations[id] = std::make_shared<ChatConversation>();
+	return id;
+	
+	JNI_CATCH_RET(env, 0)
+}
+
+void TemplateManager::appendConversationMessage(JNIEnv* env, jobject obj, jlong conversation,
+		jstring role, jstring content) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return;
+	
+	auto conv = find_conversation(server, conversation);
+	if (!conv) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown conversation handle");
+		return;
+	}
+	
+	// Rendering is deferred until the prompt is needed, so several messages share one pass
+	std::lock_guard<std::mutex> lock(conv->mutex);
+	conv->messages.emplace_back(JniUtils::jstring_to_string(env, role), JniUtils::jstring_to_string(env, content));
+	
+	JNI_CATCH(env)
+}
+
+jstring TemplateManager::renderConversation(JNIEnv* env, jobject obj, jlong conversation) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return nullptr;
+	
+	std::vector<llama_token> tokens;
+	std::string text;
+	if (!conversationPrompt(server, conversation, tokens, &text)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown conversation handle or failed to apply chat template");
+		return nullptr;
+	}
+	return JniUtils::string_to_jstring(env, text);
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jintArray TemplateManager::getConversationTokens(JNIEnv* env, jobject obj, jlong conversation) {
+	JNI_TRY(env)
 	
-	// Add all messages from the JSON array
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return nullptr;
+	
+	std::vector<llama_token> tokens;
+	if (!conversationPrompt(server, conversation, tokens)) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown conversation handle or failed to apply chat template");
+		return nullptr;
+	}
+	
+	jintArray result = env->NewIntArray(tokens.size());
+	if (!result) return nullptr;
+	env->SetIntArrayRegion(result, 0, tokens.size(), reinterpret_cast<const jint*>(tokens.data()));
+	return result;
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+void TemplateManager::freeConversation(JNIEnv* env, jobject obj, jlong conversation) {
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) return;
+	
+	std::lock_guard<std::mutex> lock(server->conversations_mutex);
+	server->conversations.erase(conversation);
+}
+
+bool TemplateManager::conversationPrompt(LlamaServer* server, jlong conversation,
+		std::vector<llama_token>& tokens, std::string* text) {
+	auto conv = find_conversation(server, conversation);
+	if (!conv) return false;
+	
+	std::lock_guard<std::mutex> lock(conv->mutex);
+	if (conv->messages.empty() || !syncConversation(server, *conv)) return false;
+	
+	if (!conv->has_generation_prompt) {
+		// The generation prompt is the text the template adds past the rendered history
+		std::string with_prompt;
+		if (!renderMessages(chatTemplate(server), conv->messages, 0, conv->messages.size(), true, with_prompt)) {
+			return false;
+		}
+		if (with_prompt.compare(0, conv->rendered.size(), conv->rendered) != 0) {
+			// The template rewrites the history when opening the assistant turn, nothing to reuse
+			tokens.clear();
+			if (!tokenize_append(llama_model_get_vocab(server->model), with_prompt, true, tokens)) return false;
+			if (text) *text = with_prompt;
+			return true;
+		}
+		conv->generation_prompt = with_prompt.substr(conv->rendered.size());
+		conv->generation_tokens.clear();
+		if (!tokenize_append(llama_model_get_vocab(server->model), conv->generation_prompt, false,
+				conv->generation_tokens)) {
+			return false;
+		}
+		conv->has_generation_prompt = true;
+	}
+	
+	tokens.reserve(conv->tokens.size() + conv->generation_tokens.size());
+	tokens.assign(conv->tokens.begin(), conv->tokens.end());
+	tokens.insert(tokens.end(), conv->generation_tokens.begin(), conv->generation_tokens.end());
+	if (text) *text = conv->rendered + conv->generation_prompt;
+	return true;
+}
+
+bool TemplateManager::syncConversation(LlamaServer* server, ChatConversation& conv) {
+	const char* tmpl = chatTemplate(server);
+	const llama_vocab* vocab = llama_model_get_vocab(server->model);
+	
+	size_t i = conv.n_rendered;
+	while (i < conv.messages.size()) {
+		const std::string& role = conv.messages[i].first;
+		std::string piece;
+		
+		if (i > 0 && conv.separable_roles.count(role)) {
+			// Messages of this role render the same with or without the history, render only the new one
+			if (!renderMessages(tmpl, conv.messages, i, i + 1, false, piece)) return false;
+		} else {
+			std::string text;
+			if (!renderMessages(tmpl, conv.messages, 0, i + 1, false, text)) return false;
+			
+			if (text.compare(0, conv.rendered.size(), conv.rendered) != 0) {
+				// The template rewrote earlier messages, keep the tokens of the unchanged ones only
+				size_t common = 0;
+				size_t n = std::min(text.size(), conv.rendered.size());
+				while (common < n && text[common] == conv.rendered[common]) common++;
+				
+				size_t keep = 0;
+				while (keep < conv.text_ends.size() && conv.text_ends[keep] <= common) keep++;
+				
+				conv.rendered.resize(keep ? conv.text_ends[keep - 1] : 0);
+				conv.tokens.resize(keep ? conv.token_ends[keep - 1] : 0);
+				conv.text_ends.resize(keep);
+				conv.token_ends.resize(keep);
+				conv.n_rendered = keep;
+				i = keep;
+				continue;
+			}
+			piece = text.substr(conv.rendered.size());
+			
+			// Learn once per role whether its messages can be rendered without the history
+			if (i > 0 && !conv.joined_roles.count(role)) {
+				std::string alone;
+				if (renderMessages(tmpl, conv.messages, i, i + 1, false, alone) && alone == piece) {
+					conv.separable_roles.insert(role);
+				} else {
+					conv.joined_roles.insert(role);
+				}
+			}
+		}
+		
+		// Only the new text is tokenized, the history keeps its tokens
+		if (!tokenize_append(vocab, piece, conv.tokens.empty(), conv.tokens)) return false;
+		conv.rendered += piece;
+		conv.text_ends.push_back(conv.rendered.size());
+		conv.token_ends.push_back(conv.tokens.size());
+		conv.n_rendered = ++i;
+	}
+	return true;
+}
+
+bool TemplateManager::renderMessages(const char* tmpl, const std::vector<std::pair<std::string, std::string>>& messages,
+		size_t begin, size_t end, bool add_assistant, std::string& out) {
 	// The messages vector already has stable string storage since it contains pairs of strings
-	for (const auto& msg : messages) {
+	std::vector<llama_chat_message> chat_messages;
+	chat_messages.reserve(end - begin);
+	for (size_t i = begin; i < end; i++) {
 		llama_chat_message chat_msg;
-		chat_msg.role = msg.first.c_str();
-		chat_msg.content = msg.second.c_str();
+		chat_msg.role = messages[i].first.c_str();
+		chat_msg.content = messages[i].second.c_str();
 		chat_messages.push_back(chat_msg);
 	}
 	
-	// Apply the template
-	std::string result_buffer;
-	result_buffer.resize(8192); // Initial buffer size
+	size_t total = 0;
+	for (size_t i = begin; i < end; i++) total += messages[i].second.size();
+	out.resize(total * 2 + 256);
 	
 	int32_t result_len = llama_chat_apply_template(
 		tmpl,
 		chat_messages.data(),
 		chat_messages.size(),
-		true,  // add_assistant (add generation prompt)
-		&result_buffer[0],
-		result_buffer.size()
+		add_assistant,
+		&out[0],
+		out.size()
 	);
 	
-	if (result_len < 0) {
+	if (result_len > (int32_t)out.size()) {
 		// Buffer too small, resize and try again
-		result_buffer.resize(-result_len);
+		out.resize(result_len);
 		result_len = llama_chat_apply_template(
 			tmpl,
 			chat_messages.data(),
 			chat_messages.size(),
-			true,
-			&result_buffer[0],
-			result_buffer.size()
+			add_assistant,
+			&out[0],
+			out.size()
 		);
 	}
 	
 	if (result_len < 0) {
-		JNIErrorHandler::throw_runtime_exception(env,
-			"Failed to apply chat template");
-		return nullptr;
+		out.clear();
+		return false;
 	}
 	
-	result_buffer.resize(result_len);
-	return JniUtils::string_to_jstring(env, result_buffer);
-	
-	JNI_CATCH_RET(env, nullptr)
+	out.resize(result_len);
+	return true;
+}
+
+const char* TemplateManager::chatTemplate(LlamaServer* server) {
+	// Get the model's chat template
+	const char* tmpl = llama_model_chat_template(server->model, nullptr);
+	if (!tmpl) {
+		// Fallback to ChatML template if model doesn't have one
+		tmpl = getDefaultChatMLTemplate();
+	}
+	return tmpl;
 }
 
 // Helper functions
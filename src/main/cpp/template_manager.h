@@ -6,15 +6,37 @@
 #include <vector>
 #include "llama.h"
 
+struct LlamaServer;
+struct ChatConversation;
+
 class TemplateManager {
 public:
 	// Apply chat template to messages
 	static jstring applyTemplate(JNIEnv* env, jobject obj, jstring params);
+	
+	// Conversation handles keep the rendered history and its tokens between turns
+	static jlong createConversation(JNIEnv* env, jobject obj);
+	static void appendConversationMessage(JNIEnv* env, jobject obj, jlong conversation, jstring role, jstring content);
+	static jstring renderConversation(JNIEnv* env, jobject obj, jlong conversation);
+	static jintArray getConversationTokens(JNIEnv* env, jobject obj, jlong conversation);
+	static void freeConversation(JNIEnv* env, jobject obj, jlong conversation);
+	
+	// Tokens of a conversation followed by the generation prompt, false if the handle is unknown or empty
+	static bool conversationPrompt(LlamaServer* server, jlong conversation, std::vector<llama_token>& tokens,
+		std::string* text = nullptr);
 
 private:
 	// Helper functions for message parsing
 	static std::vector<std::pair<std::string, std::string>> parseMessages(const std::string& json);
 	static const char* getDefaultChatMLTemplate();
+	static const char* chatTemplate(LlamaServer* server);
+	
+	// Render messages [begin, end) on their own, false if the template fails
+	static bool renderMessages(const char* tmpl, const std::vector<std::pair<std::string, std::string>>& messages,
+		size_t begin, size_t end, bool add_assistant, std::string& out);
+	
+	// Render and tokenize the messages appended since the last call
+	static bool syncConversation(LlamaServer* server, ChatConversation& conversation);
 };
 
 #endif // TEMPLATE_MANAGER_H
\ No newline at end of file
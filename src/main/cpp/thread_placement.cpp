@@ -0,0 +1,161 @@
+#include "thread_placement.h"
+#include "jni_logger.h"
+#include "ggml-cpu.h"
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Servers placed on every node, guarded by g_nodes_mutex
+static std::mutex g_nodes_mutex;
+static std::vector<int> g_node_servers;
+
+// Parse a sysfs CPU list like "0-15,32-47"
+static std::vector<int> parse_cpu_list(const std::string& list) {
+	std::vector<int> cpus;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		size_t next = list.find(',', pos);
+		if (next == std::string::npos) next = list.size();
+		std::string part = list.substr(pos, next - pos);
+		size_t dash = part.find('-');
+		try {
+			int first = std::stoi(part.substr(0, dash));
+			int last = dash == std::string::npos ? first : std::stoi(part.substr(dash + 1));
+			for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+		} catch (const std::exception&) {
+			// Trailing newline or an empty list
+		}
+		pos = next + 1;
+	}
+	return cpus;
+}
+
+static bool read_node_cpus(int node, std::vector<int>& cpus) {
+	std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	if (!file) return false;
+	std::string list;
+	std::getline(file, list);
+	cpus = parse_cpu_list(list);
+	return true;
+}
+
+int ThreadPlacement::node_count() {
+	static const int count = [] {
+		int n = 0;
+		std::vector<int> cpus;
+		while (read_node_cpus(n, cpus)) n++;
+		return std::max(1, n);
+	}();
+	return count;
+}
+
+std::vector<int> ThreadPlacement::node_cpus(int node) {
+	if (node < 0 || node >= node_count()) return {};
+	std::vector<int> cpus;
+	if (!read_node_cpus(node, cpus)) {
+		// No topology, the host is one node with every CPU
+		unsigned n = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned cpu = 0; cpu < n; cpu++) cpus.push_back((int)cpu);
+	}
+	return cpus;
+}
+
+int ThreadPlacement::acquire_node(int node) {
+	std::lock_guard<std::mutex> lock(g_nodes_mutex);
+	g_node_servers.resize(node_count(), 0);
+	if (node < 0) {
+		node = (int)(std::min_element(g_node_servers.begin(), g_node_servers.end()) - g_node_servers.begin());
+	} else if (node >= (int)g_node_servers.size()) {
+		return -1;
+	}
+	g_node_servers[node]++;
+	return node;
+}
+
+void ThreadPlacement::release_node(int node) {
+	std::lock_guard<std::mutex> lock(g_nodes_mutex);
+	if (node >= 0 && node < (int)g_node_servers.size() && g_node_servers[node] > 0) {
+		g_node_servers[node]--;
+	}
+}
+
+void ThreadPlacement::apply_node(int node, cpu_params& params) {
+	std::vector<int> cpus = node_cpus(node);
+	if (cpus.empty()) return;
+	if (params.n_threads <= 0) {
+		params.n_threads = std::min<int>((int)cpus.size(), GGML_MAX_N_THREADS);
+	}
+	if (params.mask_valid) return;
+	for (int cpu : cpus) {
+		if (cpu < GGML_MAX_N_THREADS) params.cpumask[cpu] = true;
+	}
+	params.mask_valid = true;
+}
+
+ggml_threadpool_t ThreadPlacement::create_pool(const cpu_params& params) {
+	ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(params);
+	return ggml_threadpool_new(&tpp);
+}
+
+bool ThreadPlacement::attach(llama_context* ctx, const ThreadPoolOptions& options,
+		ggml_threadpool_t& pool, ggml_threadpool_t& pool_batch) {
+	ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(options.cpu);
+	ggml_threadpool_params tpp_batch = ggml_threadpool_params_from_cpu_params(options.cpu_batch);
+
+	pool = nullptr;
+	pool_batch = nullptr;
+	if (!ggml_threadpool_params_match(&tpp, &tpp_batch)) {
+		pool_batch = ggml_threadpool_new(&tpp_batch);
+		if (!pool_batch) return false;
+		// Only one of the pools is busy at a time, the generation pool starts paused
+		tpp.paused = true;
+	}
+	pool = ggml_threadpool_new(&tpp);
+	if (!pool) {
+		free_pool(pool_batch);
+		pool_batch = nullptr;
+		return false;
+	}
+	llama_attach_threadpool(ctx, pool, pool_batch);
+	return true;
+}
+
+void ThreadPlacement::free_pool(ggml_threadpool_t pool) {
+	if (pool) ggml_threadpool_free(pool);
+}
+
+NodeAffinityScope::NodeAffinityScope(int node) {
+#ifdef __linux__
+	std::vector<int> cpus = ThreadPlacement::node_cpus(node);
+	if (cpus.empty()) return;
+
+	cpu_set_t previous;
+	if (pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) != 0) return;
+	cpu_set_t pinned;
+	CPU_ZERO(&pinned);
+	for (int cpu : cpus) {
+		if (cpu < CPU_SETSIZE) CPU_SET(cpu, &pinned);
+	}
+	if (pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned) == 0) {
+		saved_.assign(reinterpret_cast<unsigned char*>(&previous),
+			reinterpret_cast<unsigned char*>(&previous) + sizeof(previous));
+	} else {
+		JNI_LOG_WARN("Failed to pin the loading thread to NUMA node %d", node);
+	}
+#else
+	(void)node;
+#endif
+}
+
+NodeAffinityScope::~NodeAffinityScope() {
+#ifdef __linux__
+	if (saved_.size() == sizeof(cpu_set_t)) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), reinterpret_cast<cpu_set_t*>(saved_.data()));
+	}
+#endif
+}
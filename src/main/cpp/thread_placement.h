@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "llama.h"
+#include "common.h"
+
+// Placement of a server's compute threads, filled from the model arguments
+struct ThreadPoolOptions {
+	cpu_params cpu;            // Generation pool
+	cpu_params cpu_batch;      // Prompt processing pool
+	bool custom = false;       // Any affinity, priority, polling or node option was given
+	int numa_node = -2;        // NUMA node to place on, -1 for the least used one, -2 for no placement
+};
+
+// Thread pools with CPU affinity, priority and polling level, and placement of whole servers on
+// NUMA nodes. The node topology is read from sysfs, a host without it is a single node.
+//
+// Placement pins both pools to the CPUs of one node, and the loading thread as well so that the
+// pages of the weights are allocated there. Loads without ggml's NUMA strategy are expected:
+// with a strategy, ggml re-pins every compute thread and overrides the pool masks.
+class ThreadPlacement {
+public:
+	// Number of NUMA nodes, at least 1
+	static int node_count();
+
+	// CPUs of a node, empty for an unknown node
+	static std::vector<int> node_cpus(int node);
+
+	// Claim a node for a server, -1 picks the node with the fewest placed servers.
+	// Returns the node, or -1 if it does not exist.
+	static int acquire_node(int node);
+
+	// Give back a node claimed by acquire_node
+	static void release_node(int node);
+
+	// Restrict a pool to the CPUs of node unless it has its own mask, defaults its size to the node
+	static void apply_node(int node, cpu_params& params);
+
+	// Create a pool, nullptr on failure
+	static ggml_threadpool_t create_pool(const cpu_params& params);
+
+	// Create the generation and, if configured differently, the batch pool and attach them to ctx.
+	// pool_batch stays nullptr when both phases share the generation pool.
+	static bool attach(llama_context* ctx, const ThreadPoolOptions& options,
+		ggml_threadpool_t& pool, ggml_threadpool_t& pool_batch);
+
+	static void free_pool(ggml_threadpool_t pool);
+};
+
+// Pins the calling thread to the CPUs of a node while it lives, restoring the previous affinity.
+// Does nothing for node -1 or where thread affinity is not supported.
+class NodeAffinityScope {
+public:
+	explicit NodeAffinityScope(int node);
+	~NodeAffinityScope();
+
+	NodeAffinityScope(const NodeAffinityScope&) = delete;
+	NodeAffinityScope& operator=(const NodeAffinityScope&) = delete;
+
+private:
+	std::vector<unsigned char> saved_;  // Previous affinity, empty if unchanged
+};
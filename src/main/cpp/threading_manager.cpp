@@ -1,11 +1,17 @@
 #include "threading_manager.h"
 #include "jni_utils.h"
 #include "jni_error_handler.h"
+#include "llama_server.h"
+#include "thread_placement.h"
+#include <algorithm>
+#include <string>
+#include <vector>
 
 void ThreadingManager::setModelThreading(JNIEnv* env, jobject model, jint generationThreads, jint batchThreads) {
 	JNI_TRY(env)
 	
-	struct llama_context* ctx = getContextFromModel(env, model);
+	ServerRef server = getServerFromModel(env, model);
+	llama_context* ctx = server ? server->ctx : nullptr;
 	if (!ctx) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get context from model");
 		return;
@@ -30,7 +36,8 @@ void ThreadingManager::setModelThreading(JNIEnv* env, jobject model, jint genera
 jintArray ThreadingManager::getModelThreading(JNIEnv* env, jobject model) {
 	JNI_TRY(env)
 	
-	struct llama_context* ctx = getContextFromModel(env, model);
+	ServerRef server = getServerFromModel(env, model);
+	llama_context* ctx = server ? server->ctx : nullptr;
 	if (!ctx) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get context from model");
 		return nullptr;
@@ -55,18 +62,102 @@ jintArray ThreadingManager::getModelThreading(JNIEnv* env, jobject model) {
 	JNI_CATCH_RET(env, nullptr)
 }
 
-struct llama_context* ThreadingManager::getContextFromModel(JNIEnv* env, jobject model) {
-	if (!model) {
+jlong ThreadingManager::createThreadPool(JNIEnv* env, jclass cls, jint nThreads, jintArray cpus, jint priority,
+		jint poll, jboolean strictCpu) {
+	JNI_TRY(env)
+	
+	if (nThreads < 1 || nThreads > GGML_MAX_N_THREADS) {
+		JNIErrorHandler::throw_illegal_argument(env, "Thread count must be between 1 and " +
+			std::to_string(GGML_MAX_N_THREADS));
+		return 0;
+	}
+	if (priority < 0 || priority > 3) {
+		JNIErrorHandler::throw_illegal_argument(env, "Priority must be between 0 and 3");
+		return 0;
+	}
+	
+	cpu_params params;
+	params.n_threads = nThreads;
+	params.priority = static_cast<ggml_sched_priority>(priority);
+	params.poll = static_cast<uint32_t>(std::min(100, std::max(0, static_cast<int>(poll))));
+	params.strict_cpu = strictCpu;
+	if (cpus) {
+		jsize n_cpus = env->GetArrayLength(cpus);
+		std::vector<jint> ids(n_cpus);
+		env->GetIntArrayRegion(cpus, 0, n_cpus, ids.data());
+		for (jint cpu : ids) {
+			if (cpu < 0 || cpu >= GGML_MAX_N_THREADS) {
+				JNIErrorHandler::throw_illegal_argument(env, "Invalid CPU " + std::to_string(cpu));
+				return 0;
+			}
+			params.cpumask[cpu] = true;
+		}
+		params.mask_valid = n_cpus > 0;
+	}
+	
+	ggml_threadpool_t pool = ThreadPlacement::create_pool(params);
+	if (!pool) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to create thread pool");
+		return 0;
+	}
+	return reinterpret_cast<jlong>(pool);
+	
+	JNI_CATCH_RET(env, 0)
+}
+
+void ThreadingManager::freeThreadPool(JNIEnv* env, jclass cls, jlong pool) {
+	ThreadPlacement::free_pool(reinterpret_cast<ggml_threadpool_t>(pool));
+}
+
+jint ThreadingManager::getNumaNodeCount(JNIEnv* env, jclass cls) {
+	return static_cast<jint>(ThreadPlacement::node_count());
+}
+
+jintArray ThreadingManager::getNumaNodeCpus(JNIEnv* env, jclass cls, jint node) {
+	JNI_TRY(env)
+	
+	std::vector<int> cpus = ThreadPlacement::node_cpus(node);
+	if (cpus.empty()) {
+		JNIErrorHandler::throw_illegal_argument(env, "Unknown NUMA node " + std::to_string(node));
 		return nullptr;
 	}
 	
-	// Get the context handle from the Java model object
+	jintArray result = env->NewIntArray(static_cast<jsize>(cpus.size()));
+	if (!result) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to create result array");
+		return nullptr;
+	}
+	std::vector<jint> ids(cpus.begin(), cpus.end());
+	env->SetIntArrayRegion(result, 0, static_cast<jsize>(ids.size()), ids.data());
+	return result;
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jint ThreadingManager::getModelNumaNode(JNIEnv* env, jobject model) {
+	JNI_TRY(env)
+	
+	ServerRef server = getServerFromModel(env, model);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return -1;
+	}
+	return static_cast<jint>(server->numa_node);
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+ServerRef ThreadingManager::getServerFromModel(JNIEnv* env, jobject model) {
+	if (!model) {
+		return ServerRef();
+	}
+	
+	// The handle of the Java model object refers to the server owning the context
 	jclass modelClass = env->GetObjectClass(model);
-	jfieldID ctxField = env->GetFieldID(modelClass, "ctx", "J");
+	jfieldID ctxField = JniUtils::ctx_field(env, modelClass);
 	if (!ctxField) {
-		return nullptr;
+		return ServerRef();
 	}
 	
-	jlong ctxHandle = env->GetLongField(model, ctxField);
-	return reinterpret_cast<struct llama_context*>(ctxHandle);
+	return ServerTable::acquire(env->GetLongField(model, ctxField));
 }
\ No newline at end of file
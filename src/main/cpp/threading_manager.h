@@ -3,6 +3,7 @@
 
 #include <jni.h>
 #include "llama.h"
+#include "server_table.h"
 
 /**
  * Threading Manager for fine-grained thread control in llama.cpp contexts.
@@ -16,9 +17,23 @@ public:
 	// Get current threading configuration from a model context
 	static jintArray getModelThreading(JNIEnv* env, jobject model);
 	
+	// Create a ggml thread pool pinned to the given CPUs (null for no affinity), returns its handle
+	static jlong createThreadPool(JNIEnv* env, jclass cls, jint nThreads, jintArray cpus, jint priority,
+		jint poll, jboolean strictCpu);
+	
+	// Free a thread pool created by createThreadPool, it must not be attached to a context anymore
+	static void freeThreadPool(JNIEnv* env, jclass cls, jlong pool);
+	
+	// NUMA topology of the host
+	static jint getNumaNodeCount(JNIEnv* env, jclass cls);
+	static jintArray getNumaNodeCpus(JNIEnv* env, jclass cls, jint node);
+	
+	// NUMA node a model was placed on, -1 if it was not placed
+	static jint getModelNumaNode(JNIEnv* env, jobject model);
+	
 private:
-	// Helper method to get context from Java model object
-	static struct llama_context* getContextFromModel(JNIEnv* env, jobject model);
+	// Helper method to get the server owning the context of a Java model object
+	static ServerRef getServerFromModel(JNIEnv* env, jobject model);
 };
 
 #endif // THREADING_MANAGER_H
\ No newline at end of file
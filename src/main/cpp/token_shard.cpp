@@ -0,0 +1,140 @@
+#include "token_shard.h"
+#include "worker_pool.h"
+#include "common.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+static const char SHARD_MAGIC[4] = { 'J', 'L', 'T', 'S' };
+static const uint32_t SHARD_VERSION = 1;
+static const size_t LINES_PER_BLOCK = 4096;  // Lines read and tokenized together
+
+bool TokenShard::is_shard(const std::string& path) {
+    char magic[4] = {0};
+    std::ifstream in(path, std::ios::binary);
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, SHARD_MAGIC, sizeof(magic)) == 0;
+}
+
+int64_t TokenShard::write(const llama_vocab* vocab, const std::string& text_path, const std::string& shard_path,
+        std::string& error) {
+    std::ifstream in(text_path);
+    if (!in.is_open()) {
+        error = "Failed to open dataset: " + text_path;
+        return -1;
+    }
+    FILE* out = fopen(shard_path.c_str(), "wb");
+    if (!out) {
+        error = "Failed to create shard: " + shard_path;
+        return -1;
+    }
+
+    // The header is rewritten with its magic once everything else is on disk
+    TokenShardHeader header = {};
+    header.version = SHARD_VERSION;
+    header.token_size = sizeof(llama_token);
+    header.n_vocab = (uint32_t)llama_vocab_n_tokens(vocab);
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    std::vector<uint64_t> offsets(1, 0);
+    std::vector<std::string> lines;
+    std::vector<std::vector<llama_token>> block;
+    std::string line;
+    bool more = true;
+    while (ok && more) {
+        lines.clear();
+        while (lines.size() < LINES_PER_BLOCK && (more = (bool)std::getline(in, line))) {
+            if (!line.empty()) lines.push_back(line);
+        }
+        block.assign(lines.size(), {});
+        WorkerPool::shared().run(lines.size(), [&](size_t i) {
+            block[i] = common_tokenize(vocab, lines[i], /*add_special*/ true, /*parse_special*/ false);
+        });
+        for (const std::vector<llama_token>& tokens : block) {
+            ok = ok && fwrite(tokens.data(), sizeof(llama_token), tokens.size(), out) == tokens.size();
+            offsets.push_back(offsets.back() + tokens.size());
+        }
+    }
+
+    header.n_samples = offsets.size() - 1;
+    header.n_tokens = offsets.back();
+    header.index_offset = sizeof(header) + header.n_tokens * sizeof(llama_token);
+    std::memcpy(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+    ok = ok && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), out) == offsets.size();
+    ok = ok && fflush(out) == 0 && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        std::remove(shard_path.c_str());
+        error = "Failed to write shard: " + shard_path;
+        return -1;
+    }
+    return (int64_t)header.n_samples;
+}
+
+bool TokenShard::open(const std::string& path, std::string& error) {
+    header_ = nullptr;
+    tokens_ = nullptr;
+    offsets_ = nullptr;
+    if (!file_.open_read(path) || file_.size() < sizeof(TokenShardHeader)) {
+        error = "Failed to map shard: " + path;
+        return false;
+    }
+
+    const TokenShardHeader* header = reinterpret_cast<const TokenShardHeader*>(file_.data());
+    if (std::memcmp(header->magic, SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0 || header->version != SHARD_VERSION ||
+            header->token_size != sizeof(llama_token)) {
+        error = "Not a token shard of this version: " + path;
+        return false;
+    }
+    uint64_t index_end = header->index_offset + (header->n_samples + 1) * sizeof(uint64_t);
+    if (header->index_offset != sizeof(TokenShardHeader) + header->n_tokens * sizeof(llama_token) ||
+            index_end > file_.size()) {
+        error = "Truncated token shard: " + path;
+        return false;
+    }
+    const uint64_t* offsets = reinterpret_cast<const uint64_t*>(file_.data() + header->index_offset);
+    if (offsets[0] != 0 || offsets[header->n_samples] != header->n_tokens) {
+        error = "Corrupt sample index in token shard: " + path;
+        return false;
+    }
+
+    header_ = header;
+    tokens_ = reinterpret_cast<const llama_token*>(file_.data() + sizeof(TokenShardHeader));
+    offsets_ = offsets;
+    return true;
+}
+
+const llama_token* TokenShard::sample(uint64_t index, size_t& n_tokens) const {
+    if (!header_ || index >= header_->n_samples) {
+        n_tokens = 0;
+        return nullptr;
+    }
+    n_tokens = (size_t)(offsets_[index + 1] - offsets_[index]);
+    return tokens_ + offsets_[index];
+}
+
+int64_t TokenShard::n_windows(const llama_context* ctx, int64_t stride) const {
+    const int64_t ne_datapoint = llama_n_ctx(ctx);
+    const int64_t n_tokens = (int64_t)this->n_tokens();
+    if (stride <= 0 || n_tokens < ne_datapoint + 1) return 0;
+    return (n_tokens - ne_datapoint - 1) / stride;
+}
+
+ggml_opt_dataset_t TokenShard::dataset(const llama_context* ctx, int64_t stride, int64_t first_window,
+        int64_t n_windows) const {
+    const int64_t ne_datapoint = llama_n_ctx(ctx);
+    n_windows = std::min(n_windows, this->n_windows(ctx, stride) - first_window);
+    if (n_windows <= 0) return nullptr;
+
+    ggml_opt_dataset_t result = ggml_opt_dataset_init(GGML_TYPE_I32, GGML_TYPE_I32, ne_datapoint, ne_datapoint,
+        n_windows, /*ndata_shard*/ 1);
+    llama_token* data = static_cast<llama_token*>(ggml_opt_dataset_data(result)->data);
+    llama_token* labels = static_cast<llama_token*>(ggml_opt_dataset_labels(result)->data);
+    for (int64_t i = 0; i < n_windows; i++) {
+        const llama_token* window = tokens_ + (first_window + i) * stride;
+        std::memcpy(data + i * ne_datapoint, window, ne_datapoint * sizeof(llama_token));
+        std::memcpy(labels + i * ne_datapoint, window + 1, ne_datapoint * sizeof(llama_token));
+    }
+    return result;
+}
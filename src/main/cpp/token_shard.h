@@ -0,0 +1,61 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "llama.h"
+#include "ggml-opt.h"
+#include <cstdint>
+#include <string>
+
+// Pre-tokenized training data, written once from text and memory-mapped for training so that a
+// corpus is never tokenized again. A shard is this header, the tokens of all samples packed back
+// to back and the offset of every sample into them:
+//
+//   TokenShardHeader | llama_token tokens[n_tokens] | uint64_t offsets[n_samples + 1]
+//
+// The magic is written last, a shard whose write did not finish is not recognized as one.
+struct TokenShardHeader {
+    char magic[4];          // "JLTS"
+    uint32_t version;
+    uint32_t token_size;    // sizeof(llama_token)
+    uint32_t n_vocab;       // Vocabulary size of the tokenizer, checked against the trained model
+    uint64_t n_samples;
+    uint64_t n_tokens;
+    uint64_t index_offset;  // Byte offset of the sample offsets
+    uint64_t reserved[3];
+};
+
+class TokenShard {
+public:
+    // Whether the file starts like a shard, without validating it
+    static bool is_shard(const std::string& path);
+
+    // Tokenize every non-empty line of a text file as a sample, in parallel on the shared worker
+    // pool. Returns the number of samples written, or -1 with the error set.
+    static int64_t write(const llama_vocab* vocab, const std::string& text_path, const std::string& shard_path,
+        std::string& error);
+
+    // Map and validate a shard
+    bool open(const std::string& path, std::string& error);
+
+    uint64_t n_samples() const { return header_ ? header_->n_samples : 0; }
+    uint64_t n_tokens() const { return header_ ? header_->n_tokens : 0; }
+    uint32_t n_vocab() const { return header_ ? header_->n_vocab : 0; }
+
+    // The tokens of all samples, in order
+    const llama_token* tokens() const { return tokens_; }
+
+    // The tokens of one sample
+    const llama_token* sample(uint64_t index, size_t& n_tokens) const;
+
+    // Training windows of llama_n_ctx(ctx) tokens every stride tokens, as common_opt_dataset_init
+    // lays them out. A multi-GB corpus does not fit a ggml_opt_dataset at once, so datasets are
+    // built from the mapping a slice of windows at a time.
+    int64_t n_windows(const llama_context* ctx, int64_t stride) const;
+    ggml_opt_dataset_t dataset(const llama_context* ctx, int64_t stride, int64_t first_window, int64_t n_windows) const;
+
+private:
+    MappedFile file_;
+    const TokenShardHeader* header_ = nullptr;
+    const llama_token* tokens_ = nullptr;
+    const uint64_t* offsets_ = nullptr;
+};
@@ -1,20 +1,13 @@
 #include "tokenization_handler.h"
 #include "jni_utils.h"
 #include "jni_error_handler.h"
+#include "worker_pool.h"
+#include "native_trace.h"
+#include <algorithm>
 #include <mutex>
 #include <unordered_map>
 #include <memory>
 
-// External global server management (defined in jllama.cpp)
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
-
 jintArray TokenizationHandler::encode(JNIEnv* env, jobject obj, jstring text) {
 	// Validate input parameters first 
 	if (!JNIErrorHandler::validate_string(env, text, "text")) {
@@ -29,8 +22,10 @@ jintArray TokenizationHandler::encode(JNIEnv* env, jobject obj, jstring text) {
 	
 	JNI_TRY(env)
 	
+	JLLAMA_TRACE_SPAN("tokenize", "encode");
+	
 	// Get server handle
-	LlamaServer* server = getServer(env, obj);
+	ServerRef server = getServer(env, obj);
 	JNI_CHECK_NULL(env, server, "server");
 	
 	std::string input = JniUtils::jstring_to_string(env, text);
@@ -55,10 +50,91 @@ jintArray TokenizationHandler::encode(JNIEnv* env, jobject obj, jstring text) {
 	JNI_CATCH_RET(env, nullptr)
 }
 
+jobject TokenizationHandler::encodeBatch(JNIEnv* env, jobject obj, jobjectArray texts) {
+	JNI_TRY(env)
+	
+	ServerRef server = getServer(env, obj);
+	JNI_CHECK_NULL(env, server, "server");
+	
+	// Strings are read on the calling thread, the JNIEnv cannot be used from the workers
+	jsize n_texts = env->GetArrayLength(texts);
+	std::vector<std::string> inputs(n_texts);
+	for (jsize i = 0; i < n_texts; i++) {
+		jstring text = (jstring)env->GetObjectArrayElement(texts, i);
+		inputs[i] = JniUtils::jstring_to_string(env, text);
+		env->DeleteLocalRef(text);
+	}
+	
+	// Contiguous ranges of texts, a few per worker so that uneven lengths balance out
+	WorkerPool& pool = WorkerPool::shared();
+	size_t n_parts = std::min<size_t>(n_texts, pool.size() * 4);
+	std::vector<std::vector<llama_token>> part_tokens(n_parts);
+	std::vector<std::vector<jint>> part_counts(n_parts);
+	
+	const llama_vocab* vocab = llama_model_get_vocab(server->model);
+	pool.run(n_parts, [&](size_t part) {
+		// Scratch buffer of the worker thread, grows to the longest input seen and is kept across calls
+		thread_local std::vector<llama_token> scratch;
+		
+		size_t begin = n_texts * part / n_parts;
+		size_t end = n_texts * (part + 1) / n_parts;
+		for (size_t i = begin; i < end; i++) {
+			const std::string& text = inputs[i];
+			if (scratch.size() < text.length() + 1) scratch.resize(text.length() + 1);
+			
+			int n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
+				scratch.data(), scratch.size(), true, false);
+			if (n_tokens < 0) {
+				scratch.resize(-n_tokens);
+				n_tokens = llama_tokenize(vocab, text.c_str(), text.length(),
+					scratch.data(), scratch.size(), true, false);
+			}
+			n_tokens = std::max(n_tokens, 0);
+			
+			part_tokens[part].insert(part_tokens[part].end(), scratch.begin(), scratch.begin() + n_tokens);
+			part_counts[part].push_back(n_tokens);
+		}
+	});
+	
+	// Concatenate the parts in order, text i spans offsets[i] to offsets[i + 1]
+	size_t n_total = 0;
+	for (const auto& tokens : part_tokens) n_total += tokens.size();
+	
+	jintArray token_array = env->NewIntArray((jsize)n_total);
+	jintArray offset_array = env->NewIntArray(n_texts + 1);
+	if (!token_array || !offset_array) {
+		JNIErrorHandler::throw_out_of_memory(env, "Could not allocate token arrays");
+		return nullptr;
+	}
+	
+	std::vector<jint> offsets;
+	offsets.reserve(n_texts + 1);
+	offsets.push_back(0);
+	jsize position = 0;
+	for (size_t part = 0; part < n_parts; part++) {
+		if (!part_tokens[part].empty()) {
+			env->SetIntArrayRegion(token_array, position, (jsize)part_tokens[part].size(),
+				reinterpret_cast<const jint*>(part_tokens[part].data()));
+			position += (jsize)part_tokens[part].size();
+		}
+		for (jint count : part_counts[part]) {
+			offsets.push_back(offsets.back() + count);
+		}
+	}
+	env->SetIntArrayRegion(offset_array, 0, (jsize)offsets.size(), offsets.data());
+	
+	const JniCache& jni = JniUtils::cache();
+	jobject result = env->NewObject(jni.token_batch_class, jni.token_batch_init, token_array, offset_array);
+	env->DeleteLocalRef(token_array);
+	env->DeleteLocalRef(offset_array);
+	return result;
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
 jbyteArray TokenizationHandler::decodeBytes(JNIEnv* env, jobject obj, jintArray token_array) {
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) return nullptr;
 	
 	// Get tokens from Java array
@@ -81,21 +157,21 @@ jbyteArray TokenizationHandler::decodeBytes(JNIEnv* env, jobject obj, jintArray
 	return byte_array;
 }
 
-LlamaServer* TokenizationHandler::getServer(JNIEnv* env, jobject obj) {
+ServerRef TokenizationHandler::getServer(JNIEnv* env, jobject obj) {
 	jclass cls = env->GetObjectClass(obj);
 	if (!cls) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get object class");
 		return nullptr;
 	}
 	
-	jfieldID field = env->GetFieldID(cls, "ctx", "J");
+	jfieldID field = JniUtils::ctx_field(env, cls);
 	if (!field) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get ctx field");
 		return nullptr;
 	}
 	
 	jlong handle = env->GetLongField(obj, field);
-	return get_server(handle);
+	return ServerTable::acquire(handle);
 }
 
 int TokenizationHandler::tokenizeText(const llama_vocab* vocab, const std::string& text, 
@@ -3,6 +3,7 @@
 #include <jni.h>
 #include "llama.h"
 #include "llama_server.h"
+#include "server_table.h"
 
 /**
  * Handles text tokenization and detokenization operations.
@@ -19,6 +20,15 @@ public:
 	 */
 	static jintArray encode(JNIEnv* env, jobject obj, jstring text);
 
+	/**
+	 * Encode many texts at once, tokenizing in parallel on the shared worker pool.
+	 * @param env JNI environment
+	 * @param obj Java LlamaModel object
+	 * @param texts Texts to encode
+	 * @return Java TokenBatch with all tokens in one flat array plus per-text offsets, or nullptr on error
+	 */
+	static jobject encodeBatch(JNIEnv* env, jobject obj, jobjectArray texts);
+
 	/**
 	 * Decode token array to byte array.
 	 * @param env JNI environment
@@ -35,7 +45,7 @@ private:
 	 * @param obj Java LlamaModel object
 	 * @return LlamaServer pointer, or nullptr if not found
 	 */
-	static LlamaServer* getServer(JNIEnv* env, jobject obj);
+	static ServerRef getServer(JNIEnv* env, jobject obj);
 
 	/**
 	 * Tokenize text using llama.cpp vocabulary.
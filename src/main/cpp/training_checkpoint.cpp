@@ -0,0 +1,126 @@
+#include "training_checkpoint.h"
+#include "ggml-backend.h"
+#include "gguf.h"
+#include <cstdio>
+#include <fstream>
+
+// Replace a file only once its new content is complete
+static bool commit_part(const std::string& path) {
+    std::remove(path.c_str());
+    return std::rename((path + ".part").c_str(), path.c_str()) == 0;
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    std::string ignored;
+    wait(ignored);
+    release();
+}
+
+bool CheckpointWriter::record_parameter(const ggml_tensor* tensor, void* userdata) {
+    if (!llama_opt_param_filter_all(tensor, nullptr)) return false;
+    static_cast<std::vector<ggml_tensor*>*>(userdata)->push_back(const_cast<ggml_tensor*>(tensor));
+    return true;
+}
+
+void CheckpointWriter::release() {
+    if (weights_) {
+        ggml_free(weights_);
+        weights_ = nullptr;
+    }
+    state_.clear();
+    state_.shrink_to_fit();
+}
+
+bool CheckpointWriter::start(llama_context* ctx, const std::vector<ggml_tensor*>& tensors, const std::string& metadata,
+        const std::string& path, std::string& error) {
+    if (!wait(error)) return false;
+    release();
+
+    size_t size = 0;
+    for (const ggml_tensor* tensor : tensors) {
+        size += ggml_nbytes(tensor) + ggml_tensor_overhead() + GGML_MEM_ALIGN;
+    }
+    ggml_init_params params = { size, nullptr, /*no_alloc*/ false };
+    weights_ = ggml_init(params);
+    if (!weights_) {
+        error = "Failed to allocate the checkpoint snapshot";
+        return false;
+    }
+    for (const ggml_tensor* tensor : tensors) {
+        ggml_tensor* copy = ggml_dup_tensor(weights_, tensor);
+        ggml_set_name(copy, ggml_get_name(tensor));
+        ggml_backend_tensor_get(tensor, copy->data, 0, ggml_nbytes(tensor));
+    }
+
+    state_.resize(llama_state_get_size(ctx));
+    state_.resize(llama_state_get_data(ctx, state_.data(), state_.size()));
+    metadata_ = metadata;
+    thread_ = std::thread(&CheckpointWriter::write, this, path);
+    return true;
+}
+
+bool CheckpointWriter::wait(std::string& error) {
+    if (thread_.joinable()) thread_.join();
+    if (error_.empty()) return true;
+    error = error_;
+    error_.clear();
+    return false;
+}
+
+void CheckpointWriter::write(std::string path) {
+    const std::string weights_path = path + ".weights.gguf";
+    gguf_context* gguf = gguf_init_empty();
+    for (ggml_tensor* tensor = ggml_get_first_tensor(weights_); tensor; tensor = ggml_get_next_tensor(weights_, tensor)) {
+        gguf_add_tensor(gguf, tensor);
+    }
+    bool ok = gguf_write_to_file(gguf, (weights_path + ".part").c_str(), /*only_meta*/ false);
+    gguf_free(gguf);
+    if (!ok || !commit_part(weights_path)) {
+        error_ = "Failed to write checkpoint weights: " + weights_path;
+        return;
+    }
+
+    // The layout of llama_state_save_file without tokens, so that llama_state_load_file reads it
+    const std::string state_path = path + ".state";
+    FILE* state = fopen((state_path + ".part").c_str(), "wb");
+    const uint32_t header[3] = { LLAMA_SESSION_MAGIC, LLAMA_SESSION_VERSION, /*n_token_count*/ 0 };
+    ok = state && fwrite(header, sizeof(header), 1, state) == 1 &&
+        fwrite(state_.data(), 1, state_.size(), state) == state_.size();
+    ok = state && fclose(state) == 0 && ok;
+    if (!ok || !commit_part(state_path)) {
+        error_ = "Failed to write checkpoint state: " + state_path;
+        return;
+    }
+
+    const std::string meta_path = path + ".meta";
+    std::ofstream meta(meta_path + ".part");
+    meta << metadata_;
+    meta.close();
+    if (!meta || !commit_part(meta_path)) {
+        error_ = "Failed to write checkpoint metadata: " + meta_path;
+    }
+}
+
+bool CheckpointWriter::load_weights(const std::string& path, const std::vector<ggml_tensor*>& tensors, std::string& error) {
+    ggml_context* data = nullptr;
+    gguf_init_params params = { /*no_alloc*/ false, &data };
+    gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+    if (!gguf) {
+        error = "Failed to read checkpoint weights: " + path;
+        return false;
+    }
+
+    bool ok = true;
+    for (ggml_tensor* tensor : tensors) {
+        const ggml_tensor* saved = ggml_get_tensor(data, ggml_get_name(tensor));
+        if (!saved || saved->type != tensor->type || ggml_nbytes(saved) != ggml_nbytes(tensor)) {
+            error = std::string("Checkpoint weights do not match tensor ") + ggml_get_name(tensor);
+            ok = false;
+            break;
+        }
+        ggml_backend_tensor_set(tensor, saved->data, 0, ggml_nbytes(tensor));
+    }
+    gguf_free(gguf);
+    ggml_free(data);
+    return ok;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "llama.h"
+#include "ggml.h"
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Checkpoints of a running fine-tune. Training only waits while the trained tensors and the
+// context state are copied into host memory, the files are then written on a background thread:
+//
+//   <path>.weights.gguf  the tensors llama_opt_init made trainable, by name
+//   <path>.state         the context state, as llama_state_save_file writes it
+//   <path>.meta          key=value training metadata
+//
+// Every file is written to <file>.part first and renamed once complete.
+class CheckpointWriter {
+public:
+    ~CheckpointWriter();
+
+    // A llama_opt_params::param_filter that trains every tensor llama_opt_param_filter_all does
+    // and appends it to the std::vector<ggml_tensor*> passed as userdata
+    static bool record_parameter(const ggml_tensor* tensor, void* userdata);
+
+    // Wait for the previous write, snapshot and start writing. False with the error if the
+    // previous write failed or the snapshot could not be taken, nothing is written then.
+    bool start(llama_context* ctx, const std::vector<ggml_tensor*>& tensors, const std::string& metadata,
+        const std::string& path, std::string& error);
+
+    // Wait for the running write, false with its error if it failed
+    bool wait(std::string& error);
+
+    // Copy the tensors of a <path>.weights.gguf back into the trained tensors of the same names
+    static bool load_weights(const std::string& path, const std::vector<ggml_tensor*>& tensors, std::string& error);
+
+private:
+    void write(std::string path);
+    void release();
+
+    ggml_context* weights_ = nullptr;
+    std::vector<uint8_t> state_;
+    std::string metadata_;
+    std::thread thread_;
+    std::string error_;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+// Protocol between the JVM and training_process, see TrainingProcess.java for the other side.
+//
+// Without arguments the process reads one JSON command per stdin line and answers one JSON line.
+// With --framed both directions carry frames instead, little-endian:
+//
+//   uint32 payload_size | uint8 type | uint8 reserved[3] | payload
+//
+// Commands and responses stay JSON payloads, they are rare. Progress is a binary ProgressRecord,
+// sent during epochs at most every PROGRESS_INTERVAL_US. With --metrics <path> the process also
+// publishes the progress of every step into a small shared file, which the JVM reads without any
+// syscall of either side.
+
+#include <atomic>
+#include <cstdint>
+
+namespace training_ipc {
+
+enum FrameType : uint8_t {
+	FRAME_COMMAND = 1,   // JSON, JVM to process
+	FRAME_RESPONSE = 2,  // JSON, answers every command
+	FRAME_PROGRESS = 3,  // ProgressRecord, while a command runs
+};
+
+struct FrameHeader {
+	uint32_t payload_size;
+	uint8_t type;
+	uint8_t reserved[3];
+};
+static_assert(sizeof(FrameHeader) == 8, "frame header is 8 bytes");
+
+// Largest command accepted, a guard against a desynchronized stream
+const uint32_t MAX_COMMAND_SIZE = 16u << 20;
+
+const int64_t PROGRESS_INTERVAL_US = 100000;
+
+struct ProgressRecord {
+	int32_t epoch;
+	int32_t training;    // 1 while training, 0 while evaluating the held-out windows
+	int64_t step;        // Batches done in the current phase
+	int64_t n_steps;
+	int64_t elapsed_us;  // Since the phase started
+	double loss;         // Mean so far, refreshed at most every PROGRESS_INTERVAL_US
+	double loss_unc;
+	double accuracy;
+};
+static_assert(sizeof(ProgressRecord) == 56, "progress record layout is shared with Java");
+
+// Layout of the --metrics file. The sequence is odd while the record is written, a reader retries
+// until it read the same even sequence before and after copying the record.
+struct MetricsRegion {
+	char magic[4];       // "JLTM"
+	uint32_t version;
+	std::atomic<uint64_t> sequence;
+	ProgressRecord progress;
+};
+static_assert(sizeof(std::atomic<uint64_t>) == 8, "lock-free 64-bit sequence");
+
+const char METRICS_MAGIC[4] = { 'J', 'L', 'T', 'M' };
+const uint32_t METRICS_VERSION = 1;
+const uint32_t METRICS_PROGRESS_OFFSET = 16;
+
+}
@@ -1,6 +1,9 @@
 #include "training_manager.h"
 #include "jni_utils.h"
 #include "jni_error_handler.h"
+#include "token_shard.h"
+#include "llama_server.h"
+#include "server_table.h"
 #include "ggml-opt.h"
 #include "common.h"
 #include "llama.h"
@@ -20,6 +23,9 @@
 // ✅ REAL: saveCheckpoint, loadCheckpoint (model state persistence)
 // =============================================================================
 
+// Windows per dataset built from a token shard, a bounded copy however large the corpus
+static const int64_t SHARD_SLICE_WINDOWS = 1024;
+
 static std::mutex trainingMutex;
 static std::unordered_map<jlong, std::unique_ptr<TrainingSession>> trainingSessions;
 static jlong nextTrainingId = 1;
@@ -27,7 +33,7 @@ static jlong nextTrainingId = 1;
 // Helper function to get context from model object
 static llama_context* getContext(JNIEnv* env, jobject obj) {
 	jclass cls = env->GetObjectClass(obj);
-	jfieldID fieldId = env->GetFieldID(cls, "ctx", "J");
+	jfieldID fieldId = JniUtils::ctx_field(env, cls);
 	if (!fieldId) {
 		JNIErrorHandler::throw_runtime_exception(env, "Failed to get context field");
 		return nullptr;
@@ -37,6 +43,28 @@ static llama_context* getContext(JNIEnv* env, jobject obj) {
 	return reinterpret_cast<llama_context*>(ctxHandle);
 }
 
+jlong TrainingManager::writeTokenShard(JNIEnv* env, jobject model, jstring textPath, jstring shardPath) {
+    JNI_TRY(env)
+
+    if (!textPath || !shardPath) {
+        JNIErrorHandler::throw_illegal_argument(env, "Dataset and shard paths cannot be null");
+        return -1;
+    }
+    ServerRef server = ServerTable::acquire(JniUtils::get_handle(env, model));
+    if (!server) return -1;
+
+    std::string error;
+    int64_t n_samples = TokenShard::write(llama_model_get_vocab(server->model), JniUtils::jstring_to_string(env, textPath),
+        JniUtils::jstring_to_string(env, shardPath), error);
+    if (n_samples < 0) {
+        JNIErrorHandler::throw_runtime_exception(env, error);
+        return -1;
+    }
+    return n_samples;
+
+    JNI_CATCH_RET(env, -1)
+}
+
 TrainingSession* TrainingManager::getTrainingSession(jlong handle) {
     std::lock_guard<std::mutex> lock(trainingMutex);
     auto it = trainingSessions.find(handle);
@@ -47,13 +75,21 @@ void TrainingManager::cleanupTrainingSession(TrainingSession* session) {
     if (session) {
         session->is_active = false;
 
+        // A checkpoint still being written only reads its snapshot
+        std::string error;
+        session->checkpoint.wait(error);
+
         // Free dataset if allocated
         if (session->dataset) {
             ggml_opt_dataset_free(session->dataset);
             session->dataset = nullptr;
         }
 
-        // Note: We don't free model/context as they're managed externally
+        // Note: We don't free model/context as they're managed externally, unless the context was made for training
+        if (session->owns_ctx) {
+            llama_free(session->ctx);
+            session->owns_ctx = false;
+        }
         session->model = nullptr;
         session->ctx = nullptr;
         session->opt_ctx = nullptr;
@@ -70,6 +106,12 @@ jboolean TrainingManager::validateDataset(JNIEnv* env, jclass cls, jstring datas
 
     std::string pathStr = JniUtils::jstring_to_string(env, datasetPath);
 
+    if (TokenShard::is_shard(pathStr)) {
+        TokenShard shard;
+        std::string error;
+        return shard.open(pathStr, error) && shard.n_samples() > 0 ? JNI_TRUE : JNI_FALSE;
+    }
+
     // Basic file existence and format validation
     std::ifstream file(pathStr);
     if (!file.is_open()) {
@@ -102,7 +144,7 @@ jlong TrainingManager::prepareTraining(JNIEnv* env, jclass cls, jobject model, j
 
     // Get context pointer
     jclass modelClass = env->GetObjectClass(model);
-    jfieldID ctxField = env->GetFieldID(modelClass, "ctx", "J");
+    jfieldID ctxField = JniUtils::ctx_field(env, modelClass);
     if (!ctxField) {
         JNIErrorHandler::throw_illegal_state(env, "Cannot access context");
         return -1;
@@ -135,6 +177,7 @@ jlong TrainingManager::prepareTraining(JNIEnv* env, jclass cls, jobject model, j
     session->is_active = true;
 
     // Extract training parameters from Java object
+    int accumulation_steps = 1;
     if (params) {
         jclass paramsClass = env->GetObjectClass(params);
 
@@ -174,14 +217,22 @@ jlong TrainingManager::prepareTraining(JNIEnv* env, jclass cls, jobject model, j
             use_adamw = env->CallBooleanMethod(params, getUseAdamWMethod);
         }
 
+        // Get gradient accumulation steps, older parameter classes have none
+        jmethodID getAccumulationMethod = env->GetMethodID(paramsClass, "getGradientAccumulationSteps", "()I");
+        if (getAccumulationMethod) {
+            accumulation_steps = env->CallIntMethod(params, getAccumulationMethod);
+        } else {
+            env->ExceptionClear();
+        }
+
         // Setup learning rate config
         session->learning_rate_config.epochs = session->total_epochs;
         session->learning_rate_config.epoch = session->current_epoch;
 
         // Setup llama_opt_params
         session->opt_params.n_ctx_train = 0; // Use default
-        session->opt_params.param_filter = llama_opt_param_filter_all;
-        session->opt_params.param_filter_ud = nullptr;
+        session->opt_params.param_filter = CheckpointWriter::record_parameter;
+        session->opt_params.param_filter_ud = &session->parameters;
         session->opt_params.get_opt_pars = common_opt_lr_pars;
         session->opt_params.get_opt_pars_ud = &session->learning_rate_config;
         session->opt_params.optimizer_type = use_adamw ? GGML_OPT_OPTIMIZER_TYPE_ADAMW : GGML_OPT_OPTIMIZER_TYPE_SGD;
@@ -191,13 +242,38 @@ jlong TrainingManager::prepareTraining(JNIEnv* env, jclass cls, jobject model, j
         session->learning_rate_config.epoch = session->current_epoch;
 
         session->opt_params.n_ctx_train = 0;
-        session->opt_params.param_filter = llama_opt_param_filter_all;
-        session->opt_params.param_filter_ud = nullptr;
+        session->opt_params.param_filter = CheckpointWriter::record_parameter;
+        session->opt_params.param_filter_ud = &session->parameters;
         session->opt_params.get_opt_pars = common_opt_lr_pars;
         session->opt_params.get_opt_pars_ud = &session->learning_rate_config;
         session->opt_params.optimizer_type = GGML_OPT_OPTIMIZER_TYPE_ADAMW;
     }
 
+    // llama_opt_init steps the optimizer once every n_batch / n_ubatch evaluations and accumulates
+    // the gradients in between. A context of its own with one window per batch and micro-batches of
+    // n_ctx / steps tokens keeps the optimizer batch at n_ctx while activations only need memory for
+    // a micro-batch.
+    if (accumulation_steps > 1) {
+        const uint32_t n_ctx = llama_n_ctx(ctx);
+        if (n_ctx % accumulation_steps != 0) {
+            JNIErrorHandler::throw_illegal_argument(env, "Gradient accumulation steps must divide the context size");
+            return -1;
+        }
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx = n_ctx;
+        ctx_params.n_batch = n_ctx;
+        ctx_params.n_ubatch = n_ctx / accumulation_steps;
+        ctx_params.n_seq_max = 1;
+        ctx_params.n_threads = llama_n_threads(ctx);
+        ctx_params.n_threads_batch = llama_n_threads_batch(ctx);
+        session->ctx = llama_init_from_model(const_cast<llama_model*>(session->model), ctx_params);
+        if (!session->ctx) {
+            JNIErrorHandler::throw_runtime_exception(env, "Failed to create the training context");
+            return -1;
+        }
+        session->owns_ctx = true;
+    }
+
     // Initialize training via llama_opt_init
     fprintf(stderr, "Initializing training via llama_opt_init...\n");
     fflush(stderr);
@@ -239,60 +315,95 @@ jobject TrainingManager::trainEpoch(JNIEnv* env, jclass cls, jlong trainingHandl
 
     std::string pathStr = JniUtils::jstring_to_string(env, datasetPath);
 
-    // Load and tokenize dataset
-    std::vector<std::string> samples;
-    if (!loadDataset(pathStr, samples)) {
-        JNIErrorHandler::throw_runtime_exception(env, "Failed to load dataset");
-        return nullptr;
-    }
-
-    if (samples.empty()) {
-        JNIErrorHandler::throw_illegal_argument(env, "Dataset is empty");
-        return nullptr;
-    }
-
-    // Concatenate all samples and tokenize
-    std::string full_text;
-    for (const auto& sample : samples) {
-        full_text += sample + " ";
-    }
-
-    // Tokenize the text using common_tokenize
-    session->tokens = common_tokenize(session->ctx, full_text, true);
-    if (session->tokens.empty()) {
-        JNIErrorHandler::throw_runtime_exception(env, "Failed to tokenize dataset");
-        return nullptr;
-    }
-
-    // Create dataset from tokens
-    int n_ctx = llama_n_ctx(session->ctx) / 2; // Use half context for training
-    session->dataset = common_opt_dataset_init(session->ctx, session->tokens, n_ctx);
-    if (!session->dataset) {
-        JNIErrorHandler::throw_runtime_exception(env, "Failed to initialize training dataset");
-        return nullptr;
-    }
-
-    auto startTime = std::chrono::steady_clock::now();
-
-    // Calculate data split for training vs validation
+    // Training windows start every half context
+    const int64_t stride = llama_n_ctx(session->ctx) / 2;
     const float val_split = 0.1f; // Use 10% for validation
-    const int64_t idata_split = ggml_opt_dataset_ndata(session->dataset) * (1.0f - val_split);
+    auto startTime = std::chrono::steady_clock::now();
 
-    // Initialize result objects for training and evaluation
+    // Initialize result objects for training and evaluation, accumulated over all datasets of the epoch
     ggml_opt_result_t result_train = ggml_opt_result_init();
     ggml_opt_result_t result_eval = ggml_opt_result_init();
+    int totalSteps = 0;
+    auto trainOn = [&](ggml_opt_dataset_t dataset) {
+        const int64_t idata_split = ggml_opt_dataset_ndata(dataset) * (1.0f - val_split);
+
+        // ✅ REAL TRAINING: This calls llama.cpp's actual optimization routine
+        // This WILL modify model weights and perform gradient descent
+        llama_opt_epoch(session->ctx, dataset, result_train, result_eval, idata_split,
+                        nullptr, nullptr); // Using null callbacks for now
+        totalSteps += ggml_opt_dataset_ndata(dataset);
+    };
+
+    if (TokenShard::is_shard(pathStr)) {
+        // Pre-tokenized, the windows come straight from the mapped shard a slice at a time
+        TokenShard shard;
+        std::string error;
+        if (!shard.open(pathStr, error)) {
+            ggml_opt_result_free(result_train);
+            ggml_opt_result_free(result_eval);
+            JNIErrorHandler::throw_runtime_exception(env, error);
+            return nullptr;
+        }
+        const int64_t n_windows = shard.n_windows(session->ctx, stride);
+        if (shard.n_vocab() != (uint32_t)llama_vocab_n_tokens(llama_model_get_vocab(session->model)) || n_windows == 0) {
+            ggml_opt_result_free(result_train);
+            ggml_opt_result_free(result_eval);
+            JNIErrorHandler::throw_illegal_argument(env, "Token shard was made for another vocabulary or holds less than one window");
+            return nullptr;
+        }
+        for (int64_t first = 0; first < n_windows; first += SHARD_SLICE_WINDOWS) {
+            ggml_opt_dataset_t dataset = shard.dataset(session->ctx, stride, first, SHARD_SLICE_WINDOWS);
+            trainOn(dataset);
+            ggml_opt_dataset_free(dataset);
+        }
+    } else {
+        // Load and tokenize dataset
+        std::vector<std::string> samples;
+        if (!loadDataset(pathStr, samples) || samples.empty()) {
+            ggml_opt_result_free(result_train);
+            ggml_opt_result_free(result_eval);
+            if (samples.empty()) {
+                JNIErrorHandler::throw_illegal_argument(env, "Dataset is empty");
+            } else {
+                JNIErrorHandler::throw_runtime_exception(env, "Failed to load dataset");
+            }
+            return nullptr;
+        }
 
-    // ✅ REAL TRAINING: This calls llama.cpp's actual optimization routine
-    // This WILL modify model weights and perform gradient descent
-    llama_opt_epoch(session->ctx, session->dataset, result_train, result_eval, idata_split,
-                    nullptr, nullptr); // Using null callbacks for now
+        // Concatenate all samples and tokenize
+        std::string full_text;
+        for (const auto& sample : samples) {
+            full_text += sample + " ";
+        }
+
+        // Tokenize the text using common_tokenize
+        session->tokens = common_tokenize(session->ctx, full_text, true);
+        if (session->tokens.empty()) {
+            ggml_opt_result_free(result_train);
+            ggml_opt_result_free(result_eval);
+            JNIErrorHandler::throw_runtime_exception(env, "Failed to tokenize dataset");
+            return nullptr;
+        }
+
+        // Create dataset from tokens
+        if (session->dataset) {
+            ggml_opt_dataset_free(session->dataset);
+        }
+        session->dataset = common_opt_dataset_init(session->ctx, session->tokens, stride);
+        if (!session->dataset) {
+            ggml_opt_result_free(result_train);
+            ggml_opt_result_free(result_eval);
+            JNIErrorHandler::throw_runtime_exception(env, "Failed to initialize training dataset");
+            return nullptr;
+        }
+        trainOn(session->dataset);
+    }
 
     // Get training metrics from results
     double loss_value = 0.0;
     double loss_unc = 0.0;
     ggml_opt_result_loss(result_train, &loss_value, &loss_unc);
     float avgLoss = (float)loss_value;
-    int totalSteps = ggml_opt_dataset_ndata(session->dataset);
 
     // Clean up result objects
     ggml_opt_result_free(result_train);
@@ -311,7 +422,11 @@ jobject TrainingManager::trainEpoch(JNIEnv* env, jclass cls, jlong trainingHandl
         invokeProgressCallback(env, callback, session->current_epoch, totalSteps, avgLoss, session->current_learning_rate);
     }
 
-    return createTrainingMetrics(env, avgLoss, session->current_learning_rate, totalSteps, trainingTime);
+    // Checkpoints are reported apart from the epoch they interrupted
+    long checkpointTime = session->checkpoint_time;
+    session->checkpoint_time = 0;
+
+    return createTrainingMetrics(env, avgLoss, session->current_learning_rate, totalSteps, trainingTime, checkpointTime);
 
     JNI_CATCH_RET(env, nullptr)
 }
@@ -469,32 +584,9 @@ void TrainingManager::saveCheckpoint(JNIEnv* env, jclass cls, jlong trainingHand
     }
 
     std::string pathStr = JniUtils::jstring_to_string(env, checkpointPath);
+    auto startTime = std::chrono::steady_clock::now();
 
-    // Save model weights to GGUF file
-    std::string modelPath = pathStr + ".model.gguf";
-    llama_model_save_to_file(const_cast<llama_model*>(session->model), modelPath.c_str());
-
-    // Save context state (KV cache, etc.)
-    std::string statePath = pathStr + ".state";
-
-    // Get current tokens from the session for state saving
-    // For now, we'll save the state without tokens (fresh start on load)
-    // In production, you'd track the tokens used during training
-    std::vector<llama_token> empty_tokens;
-    if (!llama_state_save_file(session->ctx, statePath.c_str(),
-                                empty_tokens.data(), empty_tokens.size())) {
-        JNIErrorHandler::throw_runtime_exception(env, "Failed to save model state");
-        return;
-    }
-
-    // Save training metadata
-    std::string metaPath = pathStr + ".meta";
-    std::ofstream metadata(metaPath);
-    if (!metadata.is_open()) {
-        JNIErrorHandler::throw_runtime_exception(env, "Failed to create metadata file");
-        return;
-    }
-
+    std::ostringstream metadata;
     metadata << "epoch=" << session->current_epoch << std::endl;
     metadata << "learning_rate=" << session->current_learning_rate << std::endl;
     metadata << "total_epochs=" << session->total_epochs << std::endl;
@@ -502,7 +594,15 @@ void TrainingManager::saveCheckpoint(JNIEnv* env, jclass cls, jlong trainingHand
     // Adam parameters are not directly accessible in current llama.cpp version
     // These would need to be stored separately if needed
 
-    metadata.close();
+    // Training only waits for the snapshot, and for the previous checkpoint if it is still being written
+    std::string error;
+    bool started = session->checkpoint.start(session->ctx, session->parameters, metadata.str(), pathStr, error);
+    session->checkpoint_time += std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - startTime).count();
+    if (!started) {
+        JNIErrorHandler::throw_runtime_exception(env, error);
+        return;
+    }
 
     JNI_CATCH_RET(env, )
 }
@@ -524,6 +624,13 @@ void TrainingManager::loadCheckpoint(JNIEnv* env, jclass cls, jlong trainingHand
 
     std::string pathStr = JniUtils::jstring_to_string(env, checkpointPath);
 
+    // The checkpoint may be the one still being written
+    std::string error;
+    if (!session->checkpoint.wait(error)) {
+        JNIErrorHandler::throw_runtime_exception(env, error);
+        return;
+    }
+
     // Load context state
     std::string statePath = pathStr + ".state";
     std::vector<llama_token> loaded_tokens(llama_n_ctx(session->ctx));
@@ -571,11 +678,32 @@ void TrainingManager::loadCheckpoint(JNIEnv* env, jclass cls, jlong trainingHand
         metadata.close();
     }
 
+    // Restore the trained weights in place, checkpoints of older versions hold none
+    std::string weightsPath = pathStr + ".weights.gguf";
+    if (std::ifstream(weightsPath).good() &&
+            !CheckpointWriter::load_weights(weightsPath, session->parameters, error)) {
+        JNIErrorHandler::throw_runtime_exception(env, error);
+        return;
+    }
+
     session->is_active = true;
 
-    // Note: Model weights would need to be reloaded separately through the Java API
-    // as we can't replace the model pointer in an existing session
-    // The saved .model.gguf file can be loaded as a new LlamaModel in Java
+    JNI_CATCH_RET(env, )
+}
+
+void TrainingManager::awaitCheckpoint(JNIEnv* env, jclass cls, jlong trainingHandle) {
+    JNI_TRY(env)
+
+    TrainingSession* session = getTrainingSession(trainingHandle);
+    if (!session) {
+        JNIErrorHandler::throw_illegal_state(env, "Invalid training session");
+        return;
+    }
+
+    std::string error;
+    if (!session->checkpoint.wait(error)) {
+        JNIErrorHandler::throw_runtime_exception(env, error);
+    }
 
     JNI_CATCH_RET(env, )
 }
@@ -583,36 +711,45 @@ void TrainingManager::loadCheckpoint(JNIEnv* env, jclass cls, jlong trainingHand
 void TrainingManager::finishTraining(JNIEnv* env, jclass cls, jlong trainingHandle) {
     JNI_TRY(env)
 
+    // A failed checkpoint write is reported before the session goes away
+    std::string error;
     std::lock_guard<std::mutex> lock(trainingMutex);
     auto it = trainingSessions.find(trainingHandle);
     if (it != trainingSessions.end()) {
+        it->second->checkpoint.wait(error);
         cleanupTrainingSession(it->second.get());
         trainingSessions.erase(it);
     }
+    if (!error.empty()) {
+        JNIErrorHandler::throw_runtime_exception(env, error);
+    }
 
     JNI_CATCH_RET(env, )
 }
 
 // Helper methods
 
-jobject TrainingManager::createTrainingMetrics(JNIEnv* env, float loss, float learningRate, int totalSteps, long trainingTime) {
-    jclass metricsClass = env->FindClass("de/kherud/llama/LlamaTrainer$TrainingMetrics");
-    if (!metricsClass) return nullptr;
-
-    jmethodID constructor = env->GetMethodID(metricsClass, "<init>", "(FFIJ)V");
-    if (!constructor) return nullptr;
+jobject TrainingManager::createTrainingMetrics(JNIEnv* env, float loss, float learningRate, int totalSteps, long trainingTime,
+        long checkpointTime) {
+    const JniCache& jni = JniUtils::cache();
+    if (!jni.training_metrics_init) {
+        JNIErrorHandler::throw_runtime_exception(env, "Failed to find TrainingMetrics class");
+        return nullptr;
+    }
 
-    return env->NewObject(metricsClass, constructor, loss, learningRate, totalSteps, trainingTime);
+    return env->NewObject(jni.training_metrics_class, jni.training_metrics_init, loss, learningRate, totalSteps,
+        (jlong)trainingTime, (jlong)checkpointTime);
 }
 
 jobject TrainingManager::createEvaluationMetrics(JNIEnv* env, float loss, float accuracy, float perplexity, int totalSamples) {
-    jclass metricsClass = env->FindClass("de/kherud/llama/LlamaTrainer$EvaluationMetrics");
-    if (!metricsClass) return nullptr;
-
-    jmethodID constructor = env->GetMethodID(metricsClass, "<init>", "(FFFI)V");
-    if (!constructor) return nullptr;
+    const JniCache& jni = JniUtils::cache();
+    if (!jni.evaluation_metrics_init) {
+        JNIErrorHandler::throw_runtime_exception(env, "Failed to find EvaluationMetrics class");
+        return nullptr;
+    }
 
-    return env->NewObject(metricsClass, constructor, loss, accuracy, perplexity, totalSamples);
+    return env->NewObject(jni.evaluation_metrics_class, jni.evaluation_metrics_init, loss, accuracy, perplexity,
+        totalSamples);
 }
 
 void TrainingManager::invokeProgressCallback(JNIEnv* env, jobject callback, int epoch, int step, float loss, float learningRate) {
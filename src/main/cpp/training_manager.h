@@ -4,6 +4,7 @@
 #include "llama.h"
 #include "ggml-opt.h"
 #include "common.h"
+#include "training_checkpoint.h"
 #include <string>
 #include <vector>
 
@@ -19,9 +20,14 @@ struct TrainingSession {
     float current_learning_rate;
     bool is_active;
     std::vector<llama_token> tokens;
+    bool owns_ctx;                          // ctx was created for gradient accumulation and is freed with the session
+    std::vector<ggml_tensor*> parameters;   // The trained tensors, as llama_opt_init selected them
+    CheckpointWriter checkpoint;
+    long checkpoint_time;                   // Milliseconds training waited for checkpoints since the last epoch
 
     TrainingSession() : model(nullptr), ctx(nullptr), opt_ctx(nullptr), dataset(nullptr),
-                       current_epoch(0), total_epochs(1), current_learning_rate(0.0001f), is_active(false) {
+                       current_epoch(0), total_epochs(1), current_learning_rate(0.0001f), is_active(false),
+                       owns_ctx(false), checkpoint_time(0) {
         // Initialize learning rate configuration
         learning_rate_config.lr0 = 0.0001f;
         learning_rate_config.lr_min = -1;
@@ -42,12 +48,17 @@ public:
     static jobject evaluate(JNIEnv* env, jclass cls, jlong trainingHandle, jstring validationDatasetPath);
     static void saveCheckpoint(JNIEnv* env, jclass cls, jlong trainingHandle, jstring checkpointPath);
     static void loadCheckpoint(JNIEnv* env, jclass cls, jlong trainingHandle, jstring checkpointPath);
+    // Wait until the checkpoint saveCheckpoint started is written, throws if writing it failed
+    static void awaitCheckpoint(JNIEnv* env, jclass cls, jlong trainingHandle);
     static void finishTraining(JNIEnv* env, jclass cls, jlong trainingHandle);
 
+    // Tokenize a text dataset with the vocabulary of the model into a token shard, returns the samples written
+    static jlong writeTokenShard(JNIEnv* env, jobject model, jstring textPath, jstring shardPath);
+
 private:
     static TrainingSession* getTrainingSession(jlong handle);
     static void cleanupTrainingSession(TrainingSession* session);
-    static jobject createTrainingMetrics(JNIEnv* env, float loss, float learningRate, int totalSteps, long trainingTime);
+    static jobject createTrainingMetrics(JNIEnv* env, float loss, float learningRate, int totalSteps, long trainingTime, long checkpointTime);
     static jobject createEvaluationMetrics(JNIEnv* env, float loss, float accuracy, float perplexity, int totalSamples);
     static void invokeProgressCallback(JNIEnv* env, jobject callback, int epoch, int step, float loss, float learningRate);
     static bool loadDataset(const std::string& datasetPath, std::vector<std::string>& samples);
@@ -1,7 +1,10 @@
 // Standalone training process that runs outside JVM
-// Communicates via stdin/stdout using JSON protocol
+// Communicates via stdin/stdout using JSON lines or binary frames, see training_ipc.h
 
+#include <atomic>
+#include <cstdio>
 #include <iostream>
+#include <new>
 #include <string>
 #include <sstream>
 #include <fstream>
@@ -17,6 +20,10 @@
 #include "common.h"
 #include "ggml-opt.h"
 #include "json.hpp"
+#include "token_shard.h"
+#include "training_ipc.h"
+#include "training_checkpoint.h"
+#include "mapped_file.h"
 
 using json = nlohmann::json;
 
@@ -31,14 +38,114 @@ void signal_handler(int sig) {
 	g_interrupted = true;
 }
 
-// Debug logging macro - write to file to avoid stdout/stderr mixing issues
-#define DEBUG_LOG(msg) do { \
-	std::ofstream debug_file("/tmp/training_process_debug.log", std::ios::app); \
-	if (debug_file.is_open()) { \
-		debug_file << "[DEBUG " << __FILE__ << ":" << __LINE__ << "] " << msg << std::endl; \
-		debug_file.close(); \
+// Buffered log file of the process, opened once. JLLAMA_TRAINING_LOG_LEVEL selects debug, info
+// (the default), error or off, JLLAMA_TRAINING_LOG the file. Messages below the level are never
+// formatted, errors are flushed right away.
+enum TrainLogLevel { TRAIN_LOG_DEBUG = 0, TRAIN_LOG_INFO = 1, TRAIN_LOG_ERROR = 2, TRAIN_LOG_OFF = 3 };
+static TrainLogLevel g_log_level = TRAIN_LOG_INFO;
+static FILE* g_log_file = nullptr;
+
+static void open_log() {
+	const char* level = std::getenv("JLLAMA_TRAINING_LOG_LEVEL");
+	if (level) {
+		std::string name = level;
+		g_log_level = name == "debug" ? TRAIN_LOG_DEBUG : name == "error" ? TRAIN_LOG_ERROR
+			: name == "off" ? TRAIN_LOG_OFF : TRAIN_LOG_INFO;
+	}
+	if (g_log_level == TRAIN_LOG_OFF) return;
+	const char* path = std::getenv("JLLAMA_TRAINING_LOG");
+	g_log_file = fopen(path && *path ? path : "/tmp/training_process_debug.log", "a");
+	if (g_log_file) setvbuf(g_log_file, nullptr, _IOFBF, 64 * 1024);
+}
+
+static void write_log(TrainLogLevel level, int line, const std::string& message) {
+	static const char* names[] = { "DEBUG", "INFO", "ERROR" };
+	fprintf(g_log_file, "[%s training_process.cpp:%d] %s\n", names[level], line, message.c_str());
+	if (level >= TRAIN_LOG_ERROR) fflush(g_log_file);
+}
+
+#define TRAIN_LOG(level, msg) do { \
+	if ((level) >= g_log_level && g_log_file) { \
+		std::ostringstream train_log_line_; \
+		train_log_line_ << msg; \
+		write_log(level, __LINE__, train_log_line_.str()); \
 	} \
 } while(0)
+#define DEBUG_LOG(msg) TRAIN_LOG(TRAIN_LOG_DEBUG, msg)
+#define INFO_LOG(msg) TRAIN_LOG(TRAIN_LOG_INFO, msg)
+#define ERROR_LOG(msg) TRAIN_LOG(TRAIN_LOG_ERROR, msg)
+
+// Framed protocol and shared progress, see training_ipc.h
+static bool g_framed = false;
+static MappedFile g_metrics_file;
+static training_ipc::MetricsRegion* g_metrics = nullptr;
+
+static void write_frame(training_ipc::FrameType type, const void* payload, uint32_t size) {
+	training_ipc::FrameHeader header = { size, type, {0, 0, 0} };
+	fwrite(&header, sizeof(header), 1, stdout);
+	fwrite(payload, 1, size, stdout);
+	fflush(stdout);
+}
+
+// Read the next command, false at the end of input
+static bool read_command(std::string& command) {
+	if (!g_framed) {
+		return (bool)std::getline(std::cin, command);
+	}
+	training_ipc::FrameHeader header;
+	if (fread(&header, sizeof(header), 1, stdin) != 1) return false;
+	if (header.type != training_ipc::FRAME_COMMAND || header.payload_size > training_ipc::MAX_COMMAND_SIZE) {
+		ERROR_LOG("Unexpected frame type " << (int)header.type << " of " << header.payload_size << " bytes");
+		return false;
+	}
+	command.resize(header.payload_size);
+	return header.payload_size == 0 || fread(&command[0], 1, header.payload_size, stdin) == header.payload_size;
+}
+
+static bool open_metrics(const std::string& path) {
+	if (!g_metrics_file.create(path, sizeof(training_ipc::MetricsRegion))) return false;
+	g_metrics = new (g_metrics_file.data()) training_ipc::MetricsRegion();
+	std::memcpy(g_metrics->magic, training_ipc::METRICS_MAGIC, sizeof(g_metrics->magic));
+	g_metrics->version = training_ipc::METRICS_VERSION;
+	g_metrics->sequence.store(0, std::memory_order_release);
+	return true;
+}
+
+static void publish_metrics(const training_ipc::ProgressRecord& record) {
+	if (!g_metrics) return;
+	uint64_t sequence = g_metrics->sequence.load(std::memory_order_relaxed);
+	g_metrics->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	g_metrics->progress = record;
+	g_metrics->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// Step callback of llama_opt_epoch. Every step publishes its counters, the loss is only computed,
+// and a progress frame only sent, every PROGRESS_INTERVAL_US, so reporting never slows training.
+static int g_progress_epoch = 0;
+static int64_t g_progress_last_us = 0;
+static training_ipc::ProgressRecord g_progress = {};
+
+static void progress_callback(bool train, ggml_opt_context_t opt_ctx, ggml_opt_dataset_t dataset,
+		ggml_opt_result_t result, int64_t ibatch, int64_t ibatch_max, int64_t t_start_us) {
+	const int64_t now_us = ggml_time_us();
+	g_progress.epoch = g_progress_epoch;
+	g_progress.training = train ? 1 : 0;
+	g_progress.step = ibatch;
+	g_progress.n_steps = ibatch_max;
+	g_progress.elapsed_us = now_us - t_start_us;
+	const bool report = ibatch == ibatch_max || now_us - g_progress_last_us >= training_ipc::PROGRESS_INTERVAL_US;
+	if (report) {
+		g_progress_last_us = now_us;
+		double accuracy_unc = 0.0;
+		ggml_opt_result_loss(result, &g_progress.loss, &g_progress.loss_unc);
+		ggml_opt_result_accuracy(result, &g_progress.accuracy, &accuracy_unc);
+	}
+	publish_metrics(g_progress);
+	if (report && g_framed) {
+		write_frame(training_ipc::FRAME_PROGRESS, &g_progress, sizeof(g_progress));
+	}
+}
 
 // Training session state
 struct TrainingState {
@@ -51,6 +158,8 @@ struct TrainingState {
 	int total_epochs = 1;
 	float current_learning_rate = 0.0001f;
 	std::vector<llama_token> tokens;
+	std::vector<ggml_tensor*> parameters;  // The trained tensors, as llama_opt_init selected them
+	CheckpointWriter checkpoint;
 	bool is_initialized = false;
 
 	~TrainingState() {
@@ -74,6 +183,10 @@ struct TrainingState {
 void send_response(const json& response) {
 	std::string response_str = response.dump();
 	DEBUG_LOG("Sending response: " << response_str);
+	if (g_framed) {
+		write_frame(training_ipc::FRAME_RESPONSE, response_str.data(), (uint32_t)response_str.size());
+		return;
+	}
 	std::cout << response_str << std::endl;
 	std::cout.flush();
 }
@@ -97,7 +210,7 @@ void send_success(const json& data = json::object()) {
 
 // Initialize training
 void handle_init(const json& params, TrainingState& state) {
-	DEBUG_LOG("=== STARTING TRAINING INITIALIZATION ===");
+	INFO_LOG("=== STARTING TRAINING INITIALIZATION ===");
 
 	try {
 		// Extract parameters
@@ -108,6 +221,7 @@ void handle_init(const json& params, TrainingState& state) {
 		int epochs = params.value("epochs", 1);
 		bool use_adamw = params.value("use_adamw", true);
 		int batch_size = params.value("batch_size", 32);
+		int accumulation_steps = params.value("gradient_accumulation_steps", 1);
 
 		DEBUG_LOG("Parameters received:");
 		DEBUG_LOG("  model_path: " << model_path);
@@ -117,6 +231,7 @@ void handle_init(const json& params, TrainingState& state) {
 		DEBUG_LOG("  epochs: " << epochs);
 		DEBUG_LOG("  use_adamw: " << use_adamw);
 		DEBUG_LOG("  batch_size: " << batch_size);
+		DEBUG_LOG("  gradient_accumulation_steps: " << accumulation_steps);
 
 		// Initialize llama backend
 		DEBUG_LOG("Step 1: Initializing llama backend...");
@@ -156,6 +271,15 @@ void handle_init(const json& params, TrainingState& state) {
 		ctx_params.n_ctx = n_ctx;
 		ctx_params.n_batch = std::min(batch_size, 8); // Further limit batch size
 		ctx_params.n_ubatch = std::min(batch_size, 8);
+		if (accumulation_steps > 1) {
+			// The optimizer steps once per window, gradients accumulate over micro-batches of
+			// n_ctx / steps tokens, which alone bound the activation memory
+			if (n_ctx % accumulation_steps != 0) {
+				throw std::runtime_error("gradient_accumulation_steps must divide n_ctx");
+			}
+			ctx_params.n_batch = n_ctx;
+			ctx_params.n_ubatch = n_ctx / accumulation_steps;
+		}
 		DEBUG_LOG("  Context params: n_ctx=" << ctx_params.n_ctx <<
 		          ", n_batch=" << ctx_params.n_batch <<
 		          ", n_ubatch=" << ctx_params.n_ubatch);
@@ -195,8 +319,8 @@ void handle_init(const json& params, TrainingState& state) {
 		// Setup llama_opt_params
 		DEBUG_LOG("Step 6: Setting up llama_opt_params...");
 		state.opt_params.n_ctx_train = 0; // Use default
-		state.opt_params.param_filter = llama_opt_param_filter_all;
-		state.opt_params.param_filter_ud = nullptr;
+		state.opt_params.param_filter = CheckpointWriter::record_parameter;
+		state.opt_params.param_filter_ud = &state.parameters;
 		state.opt_params.get_opt_pars = common_opt_lr_pars;
 		state.opt_params.get_opt_pars_ud = &state.learning_rate_config;
 		state.opt_params.optimizer_type = use_adamw ?
@@ -229,18 +353,71 @@ void handle_init(const json& params, TrainingState& state) {
 		data["learning_rate"] = learning_rate;
 		data["epochs"] = epochs;
 
-		DEBUG_LOG("=== TRAINING INITIALIZATION COMPLETED SUCCESSFULLY ===");
+		INFO_LOG("=== TRAINING INITIALIZATION COMPLETED SUCCESSFULLY ===");
 		send_success(data);
 
 	} catch (const std::exception& e) {
-		DEBUG_LOG("ERROR during initialization: " << e.what());
+		ERROR_LOG("Error during initialization: " << e.what());
 		send_error(std::string("Initialization failed: ") + e.what(), "INIT_ERROR");
 	}
 }
 
+// Windows per dataset built from a token shard, a bounded copy however large the corpus
+static const int64_t SHARD_SLICE_WINDOWS = 1024;
+
+// Train one epoch on a pre-tokenized shard, its windows taken from the mapping a slice at a time
+void train_epoch_on_shard(const json& params, const std::string& dataset_path, TrainingState& state) {
+	TokenShard shard;
+	std::string error;
+	if (!shard.open(dataset_path, error)) {
+		throw std::runtime_error(error);
+	}
+	if (shard.n_vocab() != (uint32_t)llama_vocab_n_tokens(llama_model_get_vocab(state.model))) {
+		throw std::runtime_error("Token shard was made for another vocabulary");
+	}
+	const int64_t stride = params.value("stride", (int64_t)llama_n_ctx(state.ctx) / 2);
+	const int64_t n_windows = shard.n_windows(state.ctx, stride);
+	if (n_windows <= 0) {
+		throw std::runtime_error("Dataset too small: " + std::to_string(shard.n_tokens()) + " tokens");
+	}
+	DEBUG_LOG("Token shard: " << shard.n_samples() << " samples, " << shard.n_tokens() << " tokens, "
+		<< n_windows << " windows");
+
+	const float val_split = 0.1f;
+	ggml_opt_result_t result_train = ggml_opt_result_init();
+	ggml_opt_result_t result_eval = ggml_opt_result_init();
+	g_progress_epoch = state.current_epoch + 1;
+	auto start_time = std::chrono::steady_clock::now();
+	for (int64_t first = 0; first < n_windows && !g_interrupted; first += SHARD_SLICE_WINDOWS) {
+		ggml_opt_dataset_t dataset = shard.dataset(state.ctx, stride, first, SHARD_SLICE_WINDOWS);
+		const int64_t idata_split = ggml_opt_dataset_ndata(dataset) * (1.0f - val_split);
+		llama_opt_epoch(state.ctx, dataset, result_train, result_eval, idata_split, progress_callback, progress_callback);
+		ggml_opt_dataset_free(dataset);
+	}
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start_time).count();
+
+	double loss_value = 0.0;
+	double loss_unc = 0.0;
+	ggml_opt_result_loss(result_train, &loss_value, &loss_unc);
+	ggml_opt_result_free(result_train);
+	ggml_opt_result_free(result_eval);
+
+	state.current_epoch++;
+	state.current_learning_rate *= 0.995f;
+
+	json data;
+	data["loss"] = loss_value;
+	data["learning_rate"] = state.current_learning_rate;
+	data["epoch"] = state.current_epoch;
+	data["duration_ms"] = duration;
+	data["total_tokens"] = shard.n_tokens();
+	send_success(data);
+}
+
 // Train one epoch
 void handle_train_epoch(const json& params, TrainingState& state) {
-	DEBUG_LOG("=== STARTING TRAINING EPOCH ===");
+	INFO_LOG("=== STARTING TRAINING EPOCH ===");
 
 	if (!state.is_initialized) {
 		send_error("Training not initialized", "NOT_INITIALIZED");
@@ -250,6 +427,10 @@ void handle_train_epoch(const json& params, TrainingState& state) {
 	try {
 		std::string dataset_path = params["dataset_path"];
 		DEBUG_LOG("Loading dataset from: " << dataset_path);
+		if (TokenShard::is_shard(dataset_path)) {
+			train_epoch_on_shard(params, dataset_path, state);
+			return;
+		}
 
 		// Load dataset
 		std::ifstream file(dataset_path);
@@ -349,10 +530,11 @@ void handle_train_epoch(const json& params, TrainingState& state) {
 
 		// Perform training
 		DEBUG_LOG("Starting llama_opt_epoch...");
+		g_progress_epoch = state.current_epoch + 1;
 		auto start_time = std::chrono::steady_clock::now();
 
 		llama_opt_epoch(state.ctx, state.dataset, result_train, result_eval,
-		                idata_split, nullptr, nullptr);
+		                idata_split, progress_callback, progress_callback);
 
 		auto end_time = std::chrono::steady_clock::now();
 		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -389,18 +571,18 @@ void handle_train_epoch(const json& params, TrainingState& state) {
 		data["duration_ms"] = duration;
 		data["total_tokens"] = state.tokens.size();
 
-		DEBUG_LOG("=== TRAINING EPOCH COMPLETED ===");
+		INFO_LOG("=== TRAINING EPOCH COMPLETED ===");
 		send_success(data);
 
 	} catch (const std::exception& e) {
-		DEBUG_LOG("ERROR during training: " << e.what());
+		ERROR_LOG("Error during training: " << e.what());
 		send_error(std::string("Training failed: ") + e.what(), "TRAIN_ERROR");
 	}
 }
 
 // Evaluate model
 void handle_evaluate(const json& params, TrainingState& state) {
-	DEBUG_LOG("=== STARTING EVALUATION ===");
+	INFO_LOG("=== STARTING EVALUATION ===");
 
 	if (!state.is_initialized) {
 		send_error("Training not initialized", "NOT_INITIALIZED");
@@ -523,18 +705,18 @@ void handle_evaluate(const json& params, TrainingState& state) {
 		data["accuracy"] = accuracy;
 		data["total_samples"] = count;
 
-		DEBUG_LOG("=== EVALUATION COMPLETED ===");
+		INFO_LOG("=== EVALUATION COMPLETED ===");
 		send_success(data);
 
 	} catch (const std::exception& e) {
-		DEBUG_LOG("ERROR during evaluation: " << e.what());
+		ERROR_LOG("Error during evaluation: " << e.what());
 		send_error(std::string("Evaluation failed: ") + e.what(), "EVAL_ERROR");
 	}
 }
 
 // Save checkpoint
 void handle_save_checkpoint(const json& params, TrainingState& state) {
-	DEBUG_LOG("=== SAVING CHECKPOINT ===");
+	INFO_LOG("=== SAVING CHECKPOINT ===");
 
 	if (!state.is_initialized) {
 		send_error("Training not initialized", "NOT_INITIALIZED");
@@ -544,60 +726,74 @@ void handle_save_checkpoint(const json& params, TrainingState& state) {
 	try {
 		std::string checkpoint_path = params["checkpoint_path"];
 		DEBUG_LOG("Saving checkpoint to: " << checkpoint_path);
-
-		// Save model weights
-		std::string model_path = checkpoint_path + ".model.gguf";
-		DEBUG_LOG("Saving model weights to: " << model_path);
-		llama_model_save_to_file(state.model, model_path.c_str());
-
-		// Save context state
-		std::string state_path = checkpoint_path + ".state";
-		DEBUG_LOG("Saving context state to: " << state_path);
-		std::vector<llama_token> empty_tokens;
-		if (!llama_state_save_file(state.ctx, state_path.c_str(),
-		                           empty_tokens.data(), empty_tokens.size())) {
-			DEBUG_LOG("Warning: Failed to save context state");
-		}
-
-		// Save metadata
-		std::string meta_path = checkpoint_path + ".meta";
-		DEBUG_LOG("Saving metadata to: " << meta_path);
-		std::ofstream metadata(meta_path);
-		if (metadata.is_open()) {
-			metadata << "epoch=" << state.current_epoch << std::endl;
-			metadata << "learning_rate=" << state.current_learning_rate << std::endl;
-			metadata << "total_epochs=" << state.total_epochs << std::endl;
-			metadata << "optimizer_type=" << state.opt_params.optimizer_type << std::endl;
-			metadata.close();
+		auto start = std::chrono::steady_clock::now();
+
+		std::ostringstream metadata;
+		metadata << "epoch=" << state.current_epoch << std::endl;
+		metadata << "learning_rate=" << state.current_learning_rate << std::endl;
+		metadata << "total_epochs=" << state.total_epochs << std::endl;
+		metadata << "optimizer_type=" << state.opt_params.optimizer_type << std::endl;
+
+		// Only the snapshot is taken here, the files are written while training goes on
+		std::string error;
+		if (!state.checkpoint.start(state.ctx, state.parameters, metadata.str(), checkpoint_path, error)) {
+			throw std::runtime_error(error);
 		}
 
 		json data;
 		data["checkpoint_path"] = checkpoint_path;
-		data["files_saved"] = json::array({model_path, state_path, meta_path});
+		data["files_saved"] = json::array({checkpoint_path + ".weights.gguf", checkpoint_path + ".state",
+			checkpoint_path + ".meta"});
+		data["snapshot_ms"] = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start).count();
 
-		DEBUG_LOG("=== CHECKPOINT SAVED ===");
+		INFO_LOG("=== CHECKPOINT SNAPSHOT TAKEN ===");
 		send_success(data);
 
 	} catch (const std::exception& e) {
-		DEBUG_LOG("ERROR saving checkpoint: " << e.what());
+		ERROR_LOG("Error saving checkpoint: " << e.what());
 		send_error(std::string("Save checkpoint failed: ") + e.what(), "SAVE_ERROR");
 	}
 }
 
+// Wait until the last checkpoint is written
+void handle_await_checkpoint(TrainingState& state) {
+	std::string error;
+	if (!state.checkpoint.wait(error)) {
+		ERROR_LOG("Error writing checkpoint: " << error);
+		send_error("Save checkpoint failed: " + error, "SAVE_ERROR");
+		return;
+	}
+	send_success();
+}
+
 // Main message processing loop
 int main(int argc, char** argv) {
 	// Set up signal handlers
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
+	open_log();
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--framed") {
+			g_framed = true;
+		} else if (arg == "--metrics" && i + 1 < argc) {
+			if (!open_metrics(argv[++i])) {
+				ERROR_LOG("Failed to create metrics file " << argv[i]);
+				return 1;
+			}
+		}
+	}
 
-	DEBUG_LOG("=== TRAINING PROCESS STARTED ===");
+	INFO_LOG("=== TRAINING PROCESS STARTED ===");
 	DEBUG_LOG("PID: " << getpid());
 	DEBUG_LOG("Waiting for commands on stdin...");
 
 	TrainingState state;
 	std::string line;
 
-	while (!g_interrupted && std::getline(std::cin, line)) {
+	while (!g_interrupted && read_command(line)) {
 		try {
 			DEBUG_LOG("Received command: " << line);
 
@@ -614,6 +810,8 @@ int main(int argc, char** argv) {
 				handle_evaluate(command["params"], state);
 			} else if (action == "save_checkpoint") {
 				handle_save_checkpoint(command["params"], state);
+			} else if (action == "await_checkpoint") {
+				handle_await_checkpoint(state);
 			} else if (action == "shutdown") {
 				DEBUG_LOG("Shutdown command received");
 				break;
@@ -622,19 +820,20 @@ int main(int argc, char** argv) {
 			}
 
 		} catch (const json::exception& e) {
-			DEBUG_LOG("JSON parsing error: " << e.what());
+			ERROR_LOG("JSON parsing error: " << e.what());
 			send_error(std::string("Invalid JSON: ") + e.what(), "JSON_ERROR");
 		} catch (const std::exception& e) {
-			DEBUG_LOG("Unexpected error: " << e.what());
+			ERROR_LOG("Unexpected error: " << e.what());
 			send_error(std::string("Unexpected error: ") + e.what(), "UNKNOWN_ERROR");
 		}
 	}
 
-	DEBUG_LOG("=== TRAINING PROCESS SHUTTING DOWN ===");
+	INFO_LOG("=== TRAINING PROCESS SHUTTING DOWN ===");
 
 	// Cleanup is handled by TrainingState destructor
 	llama_backend_free();
 
-	DEBUG_LOG("=== TRAINING PROCESS TERMINATED ===");
+	INFO_LOG("=== TRAINING PROCESS TERMINATED ===");
+	if (g_log_file) fclose(g_log_file);
 	return 0;
 }
\ No newline at end of file
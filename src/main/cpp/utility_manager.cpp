@@ -2,22 +2,18 @@
 #include "jni_utils.h"
 #include "jni_error_handler.h"
 #include "llama_server.h"
+#include "server_table.h"
+#include "auto_tuner.h"
+#include "native_trace.h"
+#include "adapter_registry.h"
+#include "memory_manager.h"
+#include "log_router.h"
 #include <llama.h>
 #include <string>
 #include <memory>
 #include <mutex>
 #include <unordered_map>
 
-// These are defined in jllama.cpp but we need access to them
-extern std::mutex g_servers_mutex;
-extern std::unordered_map<jlong, std::unique_ptr<LlamaServer>> g_servers;
-
-static LlamaServer* get_utility_server(jlong handle) {
-	std::lock_guard<std::mutex> lock(g_servers_mutex);
-	auto it = g_servers.find(handle);
-	return (it != g_servers.end()) ? it->second.get() : nullptr;
-}
-
 jboolean UtilityManager::supportsGpuOffload(JNIEnv* env, jclass cls) {
 	JNI_TRY(env)
 	
@@ -88,49 +84,69 @@ jlong UtilityManager::timeUs(JNIEnv* env, jclass cls) {
 	JNI_CATCH_RET(env, 0)
 }
 
+void UtilityManager::startTracing(JNIEnv* env, jclass cls) {
+	JNI_TRY(env)
+	
+	NativeTrace::start();
+	
+	JNI_CATCH_RET(env, /* void */)
+}
+
+void UtilityManager::stopTracing(JNIEnv* env, jclass cls) {
+	JNI_TRY(env)
+	
+	NativeTrace::stop();
+	
+	JNI_CATCH_RET(env, /* void */)
+}
+
+jboolean UtilityManager::isTracing(JNIEnv* env, jclass cls) {
+	return NativeTrace::enabled() ? JNI_TRUE : JNI_FALSE;
+}
+
+jlong UtilityManager::writeTrace(JNIEnv* env, jclass cls, jstring path) {
+	JNI_TRY(env)
+	
+	if (!JNIErrorHandler::validate_string(env, path, "path")) {
+		return -1;
+	}
+	std::string file = JniUtils::jstring_to_string(env, path);
+	long written = NativeTrace::write(file);
+	if (written < 0) {
+		JNIErrorHandler::throw_runtime_exception(env, "Failed to write trace to " + file);
+		return -1;
+	}
+	uint64_t dropped = NativeTrace::dropped();
+	if (dropped > 0) {
+		JNI_LOG_WARN("Trace buffers were full, %llu spans were dropped", (unsigned long long)dropped);
+	}
+	return (jlong)written;
+	
+	JNI_CATCH_RET(env, -1)
+}
+
 // Global log callback storage
 static JavaVM* g_jvm = nullptr;
 static jobject g_log_callback = nullptr;
 static std::mutex g_log_mutex;
 
-// C callback function that llama.cpp will call
-static void native_log_callback(ggml_log_level level, const char* text, void* user_data) {
+// Runs on the logger's drain thread, which is attached to the JVM
+static void deliver_log_callback(JNIEnv* env, int level, const char* text) {
 	std::lock_guard<std::mutex> lock(g_log_mutex);
 	
-	if (!g_jvm || !g_log_callback) {
+	jmethodID callback_method = JniUtils::cache().log_callback_on_log;
+	if (!g_log_callback || !callback_method) {
 		return;
 	}
 	
-	JNIEnv* env = nullptr;
-	bool detach_needed = false;
-	
-	// Get JNI environment
-	int get_env_result = g_jvm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6);
-	if (get_env_result == JNI_EDETACHED) {
-		if (g_jvm->AttachCurrentThread(reinterpret_cast<void**>(&env), nullptr) == JNI_OK) {
-			detach_needed = true;
-		} else {
-			return;
-		}
-	} else if (get_env_result != JNI_OK) {
-		return;
-	}
-	
-	// Call Java callback
-	jclass callback_class = env->GetObjectClass(g_log_callback);
-	jmethodID callback_method = env->GetMethodID(callback_class, "onLog", "(ILjava/lang/String;)V");
-	
-	if (callback_method) {
-		jstring j_text = env->NewStringUTF(text);
-		env->CallVoidMethod(g_log_callback, callback_method, static_cast<jint>(level), j_text);
-		env->DeleteLocalRef(j_text);
-	}
-	
-	env->DeleteLocalRef(callback_class);
-	
-	if (detach_needed) {
-		g_jvm->DetachCurrentThread();
-	}
+	jstring j_text = env->NewStringUTF(text);
+	env->CallVoidMethod(g_log_callback, callback_method, static_cast<jint>(level), j_text);
+	env->DeleteLocalRef(j_text);
+}
+
+// C callback function that llama.cpp will call, queued so that ggml threads never wait on the JVM
+static void native_log_callback(ggml_log_level level, const char* text, void* user_data) {
+	JNILogger::submit_callback(static_cast<int>(level), text);
 }
 
 void UtilityManager::setLogCallback(JNIEnv* env, jclass cls, jobject callback) {
@@ -152,12 +168,13 @@ void UtilityManager::setLogCallback(JNIEnv* env, jclass cls, jobject callback) {
 		
 		// Create global reference to callback
 		g_log_callback = env->NewGlobalRef(callback);
+		JNILogger::initialize(env);
+		JNILogger::set_callback_handler(deliver_log_callback);
 		
-		// Set native callback in llama.cpp
-		llama_log_set(native_log_callback, nullptr);
+		LogRouter::set_sink(native_log_callback);
 	} else {
-		// Clear callback in llama.cpp (default to stderr)
-		llama_log_set(nullptr, nullptr);
+		// Default to stderr
+		LogRouter::set_sink(nullptr);
 		g_jvm = nullptr;
 	}
 	
@@ -195,16 +212,13 @@ static bool native_abort_callback(void* user_data) {
 	
 	// Call Java callback
 	jobject callback = it->second;
-	jclass callback_class = env->GetObjectClass(callback);
-	jmethodID callback_method = env->GetMethodID(callback_class, "shouldAbort", "()Z");
+	jmethodID callback_method = JniUtils::cache().abort_callback_should_abort;
 	
 	bool should_abort = false;
 	if (callback_method) {
 		should_abort = env->CallBooleanMethod(callback, callback_method) == JNI_TRUE;
 	}
 	
-	env->DeleteLocalRef(callback_class);
-	
 	if (detach_needed) {
 		g_jvm->DetachCurrentThread();
 	}
@@ -215,9 +229,8 @@ static bool native_abort_callback(void* user_data) {
 void UtilityManager::setAbortCallback(JNIEnv* env, jobject obj, jobject callback) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -242,11 +255,11 @@ void UtilityManager::setAbortCallback(JNIEnv* env, jobject obj, jobject callback
 		jobject global_callback = env->NewGlobalRef(callback);
 		g_abort_callbacks[handle] = global_callback;
 		
-		// Set native callback in llama.cpp
-		llama_set_abort_callback(server->ctx, native_abort_callback, reinterpret_cast<void*>(handle));
+		// Chain the native callback behind the server's own, which owns the context's abort hook
+		server->user_abort_data.store(reinterpret_cast<void*>(handle));
+		server->user_abort_callback.store(native_abort_callback);
 	} else {
-		// Clear callback in llama.cpp
-		llama_set_abort_callback(server->ctx, nullptr, nullptr);
+		server->user_abort_callback.store(nullptr);
 	}
 	
 	JNI_CATCH_RET(env, /* void */)
@@ -257,9 +270,8 @@ void UtilityManager::setAbortCallback(JNIEnv* env, jobject obj, jobject callback
 void UtilityManager::setThreadCount(JNIEnv* env, jobject obj, jint threads) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -279,9 +291,8 @@ void UtilityManager::setThreadCount(JNIEnv* env, jobject obj, jint threads) {
 void UtilityManager::synchronizeOperations(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -296,9 +307,8 @@ void UtilityManager::synchronizeOperations(JNIEnv* env, jobject obj) {
 void UtilityManager::setEmbeddingMode(JNIEnv* env, jobject obj, jboolean embeddings) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -313,9 +323,8 @@ void UtilityManager::setEmbeddingMode(JNIEnv* env, jobject obj, jboolean embeddi
 void UtilityManager::setCausalAttention(JNIEnv* env, jobject obj, jboolean causal) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -358,9 +367,8 @@ jstring UtilityManager::splitPath(JNIEnv* env, jclass cls, jstring path, jint sp
 jlong UtilityManager::getContextSize(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -374,9 +382,8 @@ jlong UtilityManager::getContextSize(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getBatchSize(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -390,9 +397,8 @@ jlong UtilityManager::getBatchSize(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getUbatchSize(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -406,9 +412,8 @@ jlong UtilityManager::getUbatchSize(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getMaxSequences(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -422,9 +427,8 @@ jlong UtilityManager::getMaxSequences(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getCurrentThreads(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -438,9 +442,8 @@ jlong UtilityManager::getCurrentThreads(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getCurrentThreadsBatch(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -454,9 +457,8 @@ jlong UtilityManager::getCurrentThreadsBatch(JNIEnv* env, jobject obj) {
 void UtilityManager::attachThreadPool(JNIEnv* env, jobject obj, jlong threadpool, jlong threadpool_batch) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -473,9 +475,8 @@ void UtilityManager::attachThreadPool(JNIEnv* env, jobject obj, jlong threadpool
 void UtilityManager::detachThreadPool(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -492,9 +493,8 @@ void UtilityManager::detachThreadPool(JNIEnv* env, jobject obj) {
 jstring UtilityManager::getPerformanceData(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return nullptr;
@@ -511,7 +511,75 @@ jstring UtilityManager::getPerformanceData(JNIEnv* env, jobject obj) {
 	perf_json += "\"eval_time_ms\":" + std::to_string(perf_data.t_eval_ms) + ",";
 	perf_json += "\"prompt_eval_count\":" + std::to_string(perf_data.n_p_eval) + ",";
 	perf_json += "\"eval_count\":" + std::to_string(perf_data.n_eval) + ",";
-	perf_json += "\"reused_count\":" + std::to_string(perf_data.n_reused);
+	perf_json += "\"reused_count\":" + std::to_string(server->n_prompt_tokens_reused.load()) + ",";
+	perf_json += "\"graph_reused_count\":" + std::to_string(perf_data.n_reused) + ",";
+	
+	// Warm start prefix and whether it was restored from the warm image
+	perf_json += "\"warm_start_tokens\":" + std::to_string(server->warm_tokens.size()) + ",";
+	perf_json += "\"warm_start_restored\":" + std::string(server->warm_restored ? "true" : "false") + ",";
+	
+	// Context shifts of sequences that outgrew their share of the context
+	perf_json += "\"context_shift_count\":" + std::to_string(server->n_context_shifts.load()) + ",";
+	perf_json += "\"context_rebuild_count\":" + std::to_string(server->n_context_rebuilds.load()) + ",";
+	
+	// Scheduler token budgets of a step
+	perf_json += "\"step_tokens\":" + std::to_string(server->n_step_tokens) + ",";
+	perf_json += "\"prefill_chunk\":" + std::to_string(server->n_prefill_chunk) + ",";
+	
+	// Admission control: waiting tasks per priority class, rejections and projected KV use
+	perf_json += "\"queue_depth_interactive\":" + std::to_string(server->queue_depth(TASK_PRIORITY_INTERACTIVE)) + ",";
+	perf_json += "\"queue_depth_normal\":" + std::to_string(server->queue_depth(TASK_PRIORITY_NORMAL)) + ",";
+	perf_json += "\"queue_depth_batch\":" + std::to_string(server->queue_depth(TASK_PRIORITY_BATCH)) + ",";
+	perf_json += "\"rejected_queue_full_count\":" + std::to_string(server->n_rejected_queue_full.load()) + ",";
+	perf_json += "\"rejected_oversized_count\":" + std::to_string(server->n_rejected_oversized.load()) + ",";
+	perf_json += "\"deadline_miss_count\":" + std::to_string(server->n_deadline_misses.load()) + ",";
+	perf_json += "\"kv_reserved_cells\":" + std::to_string(server->n_cells_reserved.load()) + ",";
+	perf_json += "\"kv_capacity_cells\":" + std::to_string(llama_n_ctx(server->ctx)) + ",";
+	
+	// Branches of n-best requests forked from a shared prompt
+	perf_json += "\"forked_branch_count\":" + std::to_string(server->n_forks.load()) + ",";
+	
+	// Preempted tasks swapped to host memory and restored
+	perf_json += "\"preemption_count\":" + std::to_string(server->n_preemptions.load()) + ",";
+	perf_json += "\"swap_restore_count\":" + std::to_string(server->n_swap_restores.load()) + ",";
+	perf_json += "\"swap_bytes\":" + std::to_string(server->swap_bytes.load()) + ",";
+	
+	// Changes of the LoRA adapter set between scheduler steps
+	perf_json += "\"lora_switch_count\":" + std::to_string(server->n_lora_switches.load()) + ",";
+	
+	// Adapters resident in the process-wide registry, shared with the other models' servers
+	perf_json += "\"lora_cache\":" + AdapterRegistry::stats_json() + ",";
+	
+	// Decodes interrupted because a task of the batch was cancelled
+	perf_json += "\"aborted_decode_count\":" + std::to_string(server->n_decodes_aborted.load()) + ",";
+	
+	// Speculative decoding statistics, all zero without a draft model
+	int64_t n_drafted = server->n_draft_tokens.load();
+	int64_t n_accepted = server->n_draft_accepted.load();
+	perf_json += "\"draft_count\":" + std::to_string(n_drafted) + ",";
+	perf_json += "\"draft_accepted_count\":" + std::to_string(n_accepted) + ",";
+	perf_json += "\"draft_acceptance_rate\":" + std::to_string(n_drafted > 0 ? (double)n_accepted / n_drafted : 0.0) + ",";
+	
+	// Compiled sampler and grammar caches
+	perf_json += "\"sampler_cache_hits\":" + std::to_string(server->sampler_cache.cache.hits.load()) + ",";
+	perf_json += "\"sampler_cache_misses\":" + std::to_string(server->sampler_cache.cache.misses.load()) + ",";
+	perf_json += "\"grammar_cache_hits\":" + std::to_string(server->grammar_cache.cache.hits.load()) + ",";
+	perf_json += "\"grammar_cache_misses\":" + std::to_string(server->grammar_cache.cache.misses.load()) + ",";
+	
+	// Sequence snapshot cache, restored prefixes also count into reused_count
+	const SequenceCache& seq_cache = server->seq_cache;
+	perf_json += "\"seq_cache_ram_hits\":" + std::to_string(seq_cache.ram_hits.load()) + ",";
+	perf_json += "\"seq_cache_disk_hits\":" + std::to_string(seq_cache.disk_hits.load()) + ",";
+	perf_json += "\"seq_cache_misses\":" + std::to_string(seq_cache.misses.load()) + ",";
+	perf_json += "\"seq_cache_stores\":" + std::to_string(seq_cache.stores.load()) + ",";
+	perf_json += "\"seq_cache_spills\":" + std::to_string(seq_cache.spills.load()) + ",";
+	perf_json += "\"seq_cache_ram_bytes\":" + std::to_string(seq_cache.ram_bytes.load()) + ",";
+	perf_json += "\"seq_cache_disk_bytes\":" + std::to_string(seq_cache.disk_bytes.load()) + ",";
+	
+	// Native memory counted by MemoryTracker (request arenas) and idle arenas kept for reuse
+	perf_json += "\"tracked_native_bytes\":" + std::to_string(MemoryTracker::get_current_usage()) + ",";
+	perf_json += "\"tracked_native_peak_bytes\":" + std::to_string(MemoryTracker::get_peak_usage()) + ",";
+	perf_json += "\"pooled_arenas\":" + std::to_string(ArenaPool::shared().pooled());
 	perf_json += "}";
 	
 	return JniUtils::string_to_jstring(env, perf_json);
@@ -522,9 +590,8 @@ jstring UtilityManager::getPerformanceData(JNIEnv* env, jobject obj) {
 void UtilityManager::printPerformanceData(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -536,19 +603,34 @@ void UtilityManager::printPerformanceData(JNIEnv* env, jobject obj) {
 	JNI_CATCH_RET(env, /* void */)
 }
 
+jstring UtilityManager::getLatencyStats(JNIEnv* env, jobject obj) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return nullptr;
+	}
+	
+	return JniUtils::string_to_jstring(env, server->latency.to_json());
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
 void UtilityManager::resetPerformanceData(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
 	}
 	
-	// Reset performance counters
+	// Reset performance counters and the latency histograms
 	llama_perf_context_reset(server->ctx);
+	server->latency.reset();
 	
 	JNI_CATCH_RET(env, /* void */)
 }
@@ -556,9 +638,8 @@ void UtilityManager::resetPerformanceData(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getModelLayerCount(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -572,9 +653,8 @@ jlong UtilityManager::getModelLayerCount(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getModelTrainingContextSize(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -588,9 +668,8 @@ jlong UtilityManager::getModelTrainingContextSize(JNIEnv* env, jobject obj) {
 jboolean UtilityManager::hasEncoder(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return JNI_FALSE;
@@ -604,9 +683,8 @@ jboolean UtilityManager::hasEncoder(JNIEnv* env, jobject obj) {
 jboolean UtilityManager::hasDecoder(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return JNI_FALSE;
@@ -620,9 +698,8 @@ jboolean UtilityManager::hasDecoder(JNIEnv* env, jobject obj) {
 jint UtilityManager::getRopeType(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -636,9 +713,8 @@ jint UtilityManager::getRopeType(JNIEnv* env, jobject obj) {
 jfloat UtilityManager::getRopeFrequencyScale(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0.0f;
@@ -654,9 +730,8 @@ jfloat UtilityManager::getRopeFrequencyScale(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getModelEmbeddingDimension(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -670,9 +745,8 @@ jlong UtilityManager::getModelEmbeddingDimension(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getModelAttentionHeads(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -686,9 +760,8 @@ jlong UtilityManager::getModelAttentionHeads(JNIEnv* env, jobject obj) {
 jlong UtilityManager::getModelKeyValueHeads(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -699,12 +772,80 @@ jlong UtilityManager::getModelKeyValueHeads(JNIEnv* env, jobject obj) {
 	JNI_CATCH_RET(env, 0)
 }
 
+jstring UtilityManager::getMemoryPlan(JNIEnv* env, jobject obj) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return nullptr;
+	}
+	
+	return JniUtils::string_to_jstring(env, server->memory_plan);
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jstring UtilityManager::getDevicePlacement(JNIEnv* env, jobject obj) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return nullptr;
+	}
+	
+	return JniUtils::string_to_jstring(env, server->device_placement);
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jstring UtilityManager::tuneModel(JNIEnv* env, jobject obj, jint nPrompt, jint nGenerate, jint maxThreads,
+		jint repetitions, jstring profilePath) {
+	JNI_TRY(env)
+	
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
+	if (!server) {
+		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
+		return nullptr;
+	}
+	
+	std::string path = profilePath ? JniUtils::jstring_to_string(env, profilePath) : "";
+	std::string fingerprint = AutoTuner::fingerprint(server->model);
+	
+	// A stored profile of the same model and host is returned without measuring again
+	TuningProfile profile;
+	std::string json;
+	if (!path.empty() && AutoTuner::load(path, fingerprint, profile, json)) {
+		return JniUtils::string_to_jstring(env, json);
+	}
+	
+	TuningRequest request;
+	request.n_prompt = nPrompt;
+	request.n_generate = nGenerate;
+	request.max_threads = maxThreads;
+	request.repetitions = repetitions;
+	std::string error;
+	if (!AutoTuner::tune(server->model, request, profile, json, error)) {
+		JNIErrorHandler::throw_runtime_exception(env, "Tuning failed: " + error);
+		return nullptr;
+	}
+	if (!path.empty() && !AutoTuner::save(path, json)) {
+		JNI_LOG_WARN("Failed to write tuning profile %s", path.c_str());
+	}
+	return JniUtils::string_to_jstring(env, json);
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
 jboolean UtilityManager::isRecurrentModel(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return JNI_FALSE;
@@ -718,9 +859,8 @@ jboolean UtilityManager::isRecurrentModel(JNIEnv* env, jobject obj) {
 jboolean UtilityManager::isDiffusionModel(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return JNI_FALSE;
@@ -734,9 +874,8 @@ jboolean UtilityManager::isDiffusionModel(JNIEnv* env, jobject obj) {
 void UtilityManager::setWarmupMode(JNIEnv* env, jobject obj, jboolean warmup) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return;
@@ -750,9 +889,8 @@ void UtilityManager::setWarmupMode(JNIEnv* env, jobject obj, jboolean warmup) {
 jstring UtilityManager::getFlashAttentionType(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return nullptr;
@@ -794,9 +932,8 @@ void UtilityManager::initializeNuma(JNIEnv* env, jclass cls, jint strategy) {
 jstring UtilityManager::getModelDescription(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return nullptr;
@@ -817,9 +954,8 @@ jstring UtilityManager::getModelDescription(JNIEnv* env, jobject obj) {
 jstring UtilityManager::getModelChatTemplate(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return nullptr;
@@ -835,9 +971,8 @@ jstring UtilityManager::getModelChatTemplate(JNIEnv* env, jobject obj) {
 jint UtilityManager::getVocabMaskToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return -1;
@@ -852,9 +987,8 @@ jint UtilityManager::getVocabMaskToken(JNIEnv* env, jobject obj) {
 jboolean UtilityManager::shouldAddBosToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return JNI_FALSE;
@@ -869,9 +1003,8 @@ jboolean UtilityManager::shouldAddBosToken(JNIEnv* env, jobject obj) {
 jboolean UtilityManager::shouldAddEosToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return JNI_FALSE;
@@ -886,9 +1019,8 @@ jboolean UtilityManager::shouldAddEosToken(JNIEnv* env, jobject obj) {
 jboolean UtilityManager::shouldAddSepToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return JNI_FALSE;
@@ -904,9 +1036,8 @@ jboolean UtilityManager::shouldAddSepToken(JNIEnv* env, jobject obj) {
 jstring UtilityManager::getModelClassifierLabel(JNIEnv* env, jobject obj, jint index) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return nullptr;
@@ -922,9 +1053,8 @@ jstring UtilityManager::getModelClassifierLabel(JNIEnv* env, jobject obj, jint i
 jlong UtilityManager::getModelClassifierOutputCount(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return 0;
@@ -938,9 +1068,8 @@ jlong UtilityManager::getModelClassifierOutputCount(JNIEnv* env, jobject obj) {
 jint UtilityManager::getVocabFimPreToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return -1;
@@ -955,9 +1084,8 @@ jint UtilityManager::getVocabFimPreToken(JNIEnv* env, jobject obj) {
 jint UtilityManager::getVocabFimSufToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return -1;
@@ -972,9 +1100,8 @@ jint UtilityManager::getVocabFimSufToken(JNIEnv* env, jobject obj) {
 jint UtilityManager::getVocabFimMidToken(JNIEnv* env, jobject obj) {
 	JNI_TRY(env)
 	
-	jlong handle = env->GetLongField(obj, 
-		env->GetFieldID(env->GetObjectClass(obj), "ctx", "J"));
-	LlamaServer* server = get_utility_server(handle);
+	jlong handle = JniUtils::get_handle(env, obj);
+	ServerRef server = ServerTable::acquire(handle);
 	if (!server) {
 		JNIErrorHandler::throw_illegal_state(env, "Model not loaded");
 		return -1;
@@ -1152,13 +1279,7 @@ jobjectArray UtilityManager::getChatBuiltinTemplates(JNIEnv* env, jclass cls) {
 	}
 
 	// Create Java string array
-	jclass stringClass = env->FindClass("java/lang/String");
-	if (!stringClass) {
-		JNIErrorHandler::throw_runtime_exception(env, "Failed to find String class");
-		return nullptr;
-	}
-
-	jobjectArray result = env->NewObjectArray(template_count, stringClass, nullptr);
+	jobjectArray result = env->NewObjectArray(template_count, JniUtils::cache().string_class, nullptr);
 	if (!result) {
 		JNIErrorHandler::throw_out_of_memory(env, "Could not allocate template array");
 		return nullptr;
@@ -19,6 +19,12 @@ public:
 	// Performance timing
 	static jlong timeUs(JNIEnv* env, jclass cls);
 	
+	// Span tracing of native operations
+	static void startTracing(JNIEnv* env, jclass cls);
+	static void stopTracing(JNIEnv* env, jclass cls);
+	static jboolean isTracing(JNIEnv* env, jclass cls);
+	static jlong writeTrace(JNIEnv* env, jclass cls, jstring path);
+	
 	// Logging control
 	static void setLogCallback(JNIEnv* env, jclass cls, jobject callback);
 	
@@ -46,6 +52,7 @@ public:
 	static jstring getPerformanceData(JNIEnv* env, jobject obj);
 	static void printPerformanceData(JNIEnv* env, jobject obj);
 	static void resetPerformanceData(JNIEnv* env, jobject obj);
+	static jstring getLatencyStats(JNIEnv* env, jobject obj);
 	static jlong getModelLayerCount(JNIEnv* env, jobject obj);
 	static jlong getModelTrainingContextSize(JNIEnv* env, jobject obj);
 	static jboolean hasEncoder(JNIEnv* env, jobject obj);
@@ -57,6 +64,11 @@ public:
 	static jlong getModelEmbeddingDimension(JNIEnv* env, jobject obj);
 	static jlong getModelAttentionHeads(JNIEnv* env, jobject obj);
 	static jlong getModelKeyValueHeads(JNIEnv* env, jobject obj);
+	static jstring getMemoryPlan(JNIEnv* env, jobject obj);
+	// Layers and memory of every device after loading, as JSON
+	static jstring getDevicePlacement(JNIEnv* env, jobject obj);
+	static jstring tuneModel(JNIEnv* env, jobject obj, jint nPrompt, jint nGenerate, jint maxThreads,
+		jint repetitions, jstring profilePath);
 	static jboolean isRecurrentModel(JNIEnv* env, jobject obj);
 	static jboolean isDiffusionModel(JNIEnv* env, jobject obj);
 	static void setWarmupMode(JNIEnv* env, jobject obj, jboolean warmup);
@@ -0,0 +1,466 @@
+#include "vector_index.h"
+#include "worker_pool.h"
+#include "embedding_format.h"
+#include "ggml.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <queue>
+
+static const char INDEX_MAGIC[4] = { 'J', 'L', 'V', 'I' };
+static const uint32_t INDEX_VERSION = 1;
+static const size_t VECTORS_PER_PART = 4096;  // Vectors scanned or encoded together
+static const uint32_t MAX_LEVEL = 16;
+
+struct VectorIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t storage;
+    uint32_t metric;
+    uint32_t hnsw_m;
+    uint32_t ef_construction;
+    int32_t entry_point;
+    uint32_t max_level;
+    uint32_t reserved;
+    uint64_t n_vectors;
+    uint64_t n_text_bytes;
+    uint64_t n_upper_links;
+    uint64_t level_seed;
+};
+static_assert(sizeof(VectorIndexHeader) == 72, "index header layout is part of the file format");
+
+// Byte sizes of the sections following the header, in file order, each padded to 8 bytes
+static const int N_SECTIONS = 8;
+static void section_sizes(const VectorIndexHeader& h, size_t row_bytes, uint64_t sizes[N_SECTIONS]) {
+    const bool graph = h.hnsw_m > 0;
+    sizes[0] = h.n_vectors * row_bytes;
+    sizes[1] = (h.storage == VECTOR_I8 ? h.n_vectors : 0) * sizeof(float);
+    sizes[2] = (h.n_vectors + 1) * sizeof(uint64_t);
+    sizes[3] = h.n_text_bytes;
+    sizes[4] = graph ? h.n_vectors : 0;
+    sizes[5] = (graph ? h.n_vectors * 2 * h.hnsw_m : 0) * sizeof(int32_t);
+    sizes[6] = (graph ? h.n_vectors + 1 : 0) * sizeof(uint64_t);
+    sizes[7] = h.n_upper_links * sizeof(int32_t);
+}
+
+static uint64_t padded(uint64_t size) {
+    return (size + 7) & ~(uint64_t)7;
+}
+
+static float dot(const float* a, const float* b, uint32_t n) {
+    float sum = 0.0f;
+    for (uint32_t i = 0; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static void normalize(const float* in, float* out, uint32_t n) {
+    float norm = std::sqrt(dot(in, in, n));
+    float inv = norm > 0.0f ? 1.0f / norm : 0.0f;
+    for (uint32_t i = 0; i < n; i++) out[i] = in[i] * inv;
+}
+
+VectorIndex::VectorIndex(uint32_t dim, VectorStorage storage, VectorMetric metric, uint32_t hnsw_m,
+        uint32_t ef_construction)
+    : dim_(dim), storage_(storage), metric_(metric), hnsw_m_(hnsw_m),
+      ef_construction_(std::max(ef_construction, hnsw_m)) {
+    text_offsets_.owned.push_back(0);
+    if (hnsw_m_ > 0) upper_offsets_.owned.push_back(0);
+}
+
+size_t VectorIndex::size() const {
+    return text_offsets_.count() - 1;
+}
+
+size_t VectorIndex::row_bytes() const {
+    switch (storage_) {
+        case VECTOR_F16: return dim_ * sizeof(ggml_fp16_t);
+        case VECTOR_I8: return dim_;
+        default: return dim_ * sizeof(float);
+    }
+}
+
+void VectorIndex::encode(const float* vector, uint8_t* row, float& scale) const {
+    // VectorStorage values are the matching EmbeddingEncoding values
+    scale = EmbeddingFormat::encode(vector, dim_, metric_ == METRIC_COSINE, (EmbeddingEncoding)storage_, row);
+}
+
+void VectorIndex::decode(uint32_t entry, float* out) const {
+    const uint8_t* row = codes_.data() + (size_t)entry * row_bytes();
+    switch (storage_) {
+        case VECTOR_F16:
+            ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t*>(row), out, dim_);
+            break;
+        case VECTOR_I8: {
+            const int8_t* codes = reinterpret_cast<const int8_t*>(row);
+            const float scale = scales_.data()[entry];
+            for (uint32_t i = 0; i < dim_; i++) out[i] = codes[i] * scale;
+            break;
+        }
+        default:
+            std::memcpy(out, row, dim_ * sizeof(float));
+    }
+}
+
+float VectorIndex::score(const float* query, uint32_t entry) const {
+    const uint8_t* row = codes_.data() + (size_t)entry * row_bytes();
+    switch (storage_) {
+        case VECTOR_F16: {
+            thread_local std::vector<float> scratch;
+            scratch.resize(dim_);
+            ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t*>(row), scratch.data(), dim_);
+            return dot(query, scratch.data(), dim_);
+        }
+        case VECTOR_I8: {
+            const int8_t* codes = reinterpret_cast<const int8_t*>(row);
+            float sum = 0.0f;
+            for (uint32_t i = 0; i < dim_; i++) sum += query[i] * codes[i];
+            return sum * scales_.data()[entry];
+        }
+        default:
+            return dot(query, reinterpret_cast<const float*>(row), dim_);
+    }
+}
+
+void VectorIndex::materialize() {
+    if (!file_.data()) return;
+    codes_.materialize();
+    scales_.materialize();
+    text_offsets_.materialize();
+    text_bytes_.materialize();
+    levels_.materialize();
+    links0_.materialize();
+    upper_offsets_.materialize();
+    upper_links_.materialize();
+    file_.close();
+}
+
+uint32_t VectorIndex::add(const float* vectors, size_t n, const std::string* texts) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    materialize();
+
+    const uint32_t first = (uint32_t)size();
+    const size_t bytes = row_bytes();
+    codes_.owned.resize((first + n) * bytes);
+    if (storage_ == VECTOR_I8) scales_.owned.resize(first + n);
+
+    const size_t n_parts = (n + VECTORS_PER_PART - 1) / VECTORS_PER_PART;
+    WorkerPool::shared().run(n_parts, [&](size_t part) {
+        size_t end = std::min(n, (part + 1) * VECTORS_PER_PART);
+        for (size_t i = part * VECTORS_PER_PART; i < end; i++) {
+            float scale;
+            encode(vectors + i * dim_, codes_.owned.data() + (first + i) * bytes, scale);
+            if (storage_ == VECTOR_I8) scales_.owned[first + i] = scale;
+        }
+    });
+
+    for (size_t i = 0; i < n; i++) {
+        if (texts) text_bytes_.owned.insert(text_bytes_.owned.end(), texts[i].begin(), texts[i].end());
+        text_offsets_.owned.push_back(text_bytes_.owned.size());
+    }
+
+    // Graph insertion depends on every node before it and stays on this thread
+    if (hnsw_m_ > 0) {
+        const double level_scale = 1.0 / std::log((double)std::max(hnsw_m_, 2u));
+        for (size_t i = 0; i < n; i++) {
+            // xorshift64*, kept in the index so that saved graphs continue the same sequence
+            level_seed_ ^= level_seed_ >> 12;
+            level_seed_ ^= level_seed_ << 25;
+            level_seed_ ^= level_seed_ >> 27;
+            double uniform = ((level_seed_ * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+            uint32_t level = std::min(MAX_LEVEL, (uint32_t)(-std::log(1.0 - uniform) * level_scale));
+
+            levels_.owned.push_back((uint8_t)level);
+            links0_.owned.resize(links0_.owned.size() + max_links(0), -1);
+            upper_links_.owned.resize(upper_links_.owned.size() + (size_t)level * hnsw_m_, -1);
+            upper_offsets_.owned.push_back(upper_links_.owned.size());
+            insert(first + (uint32_t)i);
+        }
+    }
+    return first;
+}
+
+const int32_t* VectorIndex::links(uint32_t node, uint32_t level) const {
+    if (level == 0) return links0_.data() + (size_t)node * max_links(0);
+    return upper_links_.data() + upper_offsets_.data()[node] + (size_t)(level - 1) * hnsw_m_;
+}
+
+int32_t* VectorIndex::links_mut(uint32_t node, uint32_t level) {
+    return const_cast<int32_t*>(links(node, level));
+}
+
+void VectorIndex::connect(uint32_t node, uint32_t level, uint32_t neighbour) {
+    int32_t* slots = links_mut(node, level);
+    const uint32_t n_slots = max_links(level);
+    for (uint32_t i = 0; i < n_slots; i++) {
+        if (slots[i] < 0) {
+            slots[i] = (int32_t)neighbour;
+            return;
+        }
+    }
+
+    // Full, the farthest of the node's neighbours and the new one is dropped
+    std::vector<float> center(dim_);
+    decode(node, center.data());
+    uint32_t worst = n_slots;
+    float worst_score = score(center.data(), neighbour);
+    for (uint32_t i = 0; i < n_slots; i++) {
+        float s = score(center.data(), (uint32_t)slots[i]);
+        if (s < worst_score) {
+            worst_score = s;
+            worst = i;
+        }
+    }
+    if (worst < n_slots) slots[worst] = (int32_t)neighbour;
+}
+
+void VectorIndex::insert(uint32_t node) {
+    const uint32_t level = levels_.owned[node];
+    if (entry_point_ < 0) {
+        entry_point_ = (int32_t)node;
+        max_level_ = level;
+        return;
+    }
+
+    std::vector<float> query(dim_);
+    decode(node, query.data());
+    uint32_t entry = (uint32_t)entry_point_;
+    for (uint32_t l = max_level_; l > level; l--) {
+        entry = search_layer(query.data(), entry, 1, l)[0].entry;
+    }
+    for (uint32_t l = std::min(level, max_level_) + 1; l-- > 0;) {
+        std::vector<VectorHit> candidates = search_layer(query.data(), entry, ef_construction_, l);
+        size_t n_neighbours = std::min(candidates.size(), (size_t)hnsw_m_);
+        for (size_t i = 0; i < n_neighbours; i++) {
+            connect(node, l, candidates[i].entry);
+            connect(candidates[i].entry, l, node);
+        }
+        entry = candidates[0].entry;
+    }
+    if (level > max_level_) {
+        max_level_ = level;
+        entry_point_ = (int32_t)node;
+    }
+}
+
+std::vector<VectorHit> VectorIndex::search_layer(const float* query, uint32_t entry, size_t ef, uint32_t level) const {
+    // Visited marks are stamped per search instead of cleared
+    thread_local std::vector<uint32_t> visited;
+    thread_local uint32_t stamp = 0;
+    if (visited.size() < size()) visited.resize(size(), 0);
+    if (++stamp == 0) {
+        std::fill(visited.begin(), visited.end(), 0);
+        stamp = 1;
+    }
+
+    auto better = [](const VectorHit& a, const VectorHit& b) { return a.score < b.score; };
+    auto worse = [](const VectorHit& a, const VectorHit& b) { return a.score > b.score; };
+    std::priority_queue<VectorHit, std::vector<VectorHit>, decltype(better)> candidates(better);  // Best on top
+    std::priority_queue<VectorHit, std::vector<VectorHit>, decltype(worse)> results(worse);       // Worst on top
+
+    VectorHit start = { entry, score(query, entry) };
+    visited[entry] = stamp;
+    candidates.push(start);
+    results.push(start);
+    const uint32_t n_slots = max_links(level);
+    while (!candidates.empty()) {
+        VectorHit current = candidates.top();
+        if (results.size() >= ef && current.score < results.top().score) break;
+        candidates.pop();
+
+        const int32_t* neighbours = links(current.entry, level);
+        for (uint32_t i = 0; i < n_slots && neighbours[i] >= 0; i++) {
+            uint32_t neighbour = (uint32_t)neighbours[i];
+            if (visited[neighbour] == stamp) continue;
+            visited[neighbour] = stamp;
+            VectorHit hit = { neighbour, score(query, neighbour) };
+            if (results.size() < ef || hit.score > results.top().score) {
+                candidates.push(hit);
+                results.push(hit);
+                if (results.size() > ef) results.pop();
+            }
+        }
+    }
+
+    std::vector<VectorHit> hits(results.size());
+    for (size_t i = hits.size(); i-- > 0;) {
+        hits[i] = results.top();
+        results.pop();
+    }
+    return hits;
+}
+
+std::vector<VectorHit> VectorIndex::search_graph(const float* query, size_t k, size_t ef) const {
+    uint32_t entry = (uint32_t)entry_point_;
+    for (uint32_t l = max_level_; l > 0; l--) {
+        entry = search_layer(query, entry, 1, l)[0].entry;
+    }
+    std::vector<VectorHit> hits = search_layer(query, entry, std::max(ef, k), 0);
+    if (hits.size() > k) hits.resize(k);
+    return hits;
+}
+
+std::vector<VectorHit> VectorIndex::search_flat(const float* query, size_t k) const {
+    const size_t n = size();
+    const size_t n_parts = (n + VECTORS_PER_PART - 1) / VECTORS_PER_PART;
+    auto by_score = [](const VectorHit& a, const VectorHit& b) {
+        return a.score > b.score || (a.score == b.score && a.entry < b.entry);
+    };
+
+    // Every part keeps its own k best, they are merged at the end
+    std::vector<std::vector<VectorHit>> best(n_parts);
+    WorkerPool::shared().run(n_parts, [&](size_t part) {
+        std::vector<VectorHit>& heap = best[part];  // Worst of the part's best on top
+        size_t end = std::min(n, (part + 1) * VECTORS_PER_PART);
+        for (size_t i = part * VECTORS_PER_PART; i < end; i++) {
+            VectorHit hit = { (uint32_t)i, score(query, (uint32_t)i) };
+            if (heap.size() < k) {
+                heap.push_back(hit);
+                std::push_heap(heap.begin(), heap.end(), by_score);
+            } else if (by_score(hit, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), by_score);
+                heap.back() = hit;
+                std::push_heap(heap.begin(), heap.end(), by_score);
+            }
+        }
+    });
+
+    std::vector<VectorHit> hits;
+    for (const std::vector<VectorHit>& part : best) hits.insert(hits.end(), part.begin(), part.end());
+    size_t n_top = std::min(k, hits.size());
+    std::partial_sort(hits.begin(), hits.begin() + n_top, hits.end(), by_score);
+    hits.resize(n_top);
+    return hits;
+}
+
+std::vector<VectorHit> VectorIndex::search(const float* query, size_t k, size_t ef) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (k == 0 || size() == 0) return {};
+
+    std::vector<float> normalized;
+    if (metric_ == METRIC_COSINE) {
+        normalized.resize(dim_);
+        normalize(query, normalized.data(), dim_);
+        query = normalized.data();
+    }
+    return hnsw_m_ > 0 ? search_graph(query, k, ef) : search_flat(query, k);
+}
+
+std::string VectorIndex::text(uint32_t entry) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (entry >= size()) return std::string();
+    const uint64_t* offsets = text_offsets_.data();
+    return std::string(text_bytes_.data() + offsets[entry], offsets[entry + 1] - offsets[entry]);
+}
+
+bool VectorIndex::save(const std::string& path, std::string& error) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    VectorIndexHeader header = {};
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.dim = dim_;
+    header.storage = storage_;
+    header.metric = metric_;
+    header.hnsw_m = hnsw_m_;
+    header.ef_construction = ef_construction_;
+    header.entry_point = entry_point_;
+    header.max_level = max_level_;
+    header.n_vectors = size();
+    header.n_text_bytes = text_bytes_.count();
+    header.n_upper_links = upper_links_.count();
+    header.level_seed = level_seed_;
+
+    uint64_t sizes[N_SECTIONS];
+    section_sizes(header, row_bytes(), sizes);
+    const void* sections[N_SECTIONS] = {
+        codes_.data(), scales_.data(), text_offsets_.data(), text_bytes_.data(),
+        levels_.data(), links0_.data(), upper_offsets_.data(), upper_links_.data(),
+    };
+
+    const std::string part = path + ".part";
+    FILE* out = fopen(part.c_str(), "wb");
+    if (!out) {
+        error = "Failed to create vector index: " + part;
+        return false;
+    }
+    static const char zeros[8] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (int i = 0; i < N_SECTIONS && ok; i++) {
+        ok = sizes[i] == 0 || fwrite(sections[i], 1, sizes[i], out) == sizes[i];
+        size_t padding = padded(sizes[i]) - sizes[i];
+        ok = ok && (padding == 0 || fwrite(zeros, 1, padding, out) == padding);
+    }
+    ok = fclose(out) == 0 && ok;
+    std::remove(path.c_str());
+    if (!ok || std::rename(part.c_str(), path.c_str()) != 0) {
+        std::remove(part.c_str());
+        error = "Failed to write vector index: " + path;
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<VectorIndex> VectorIndex::open(const std::string& path, std::string& error) {
+    MappedFile probe;
+    if (!probe.open_read(path) || probe.size() < sizeof(VectorIndexHeader)) {
+        error = "Failed to map vector index: " + path;
+        return nullptr;
+    }
+    VectorIndexHeader header;
+    std::memcpy(&header, probe.data(), sizeof(header));
+    probe.close();
+    if (std::memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header.version != INDEX_VERSION ||
+            header.dim == 0 || header.storage > VECTOR_I8 || header.metric > METRIC_DOT) {
+        error = "Not a vector index of this version: " + path;
+        return nullptr;
+    }
+
+    std::unique_ptr<VectorIndex> index(new VectorIndex(header.dim, (VectorStorage)header.storage,
+        (VectorMetric)header.metric, header.hnsw_m, header.ef_construction));
+    MappedFile& file = index->file_;
+    uint64_t sizes[N_SECTIONS];
+    section_sizes(header, index->row_bytes(), sizes);
+    uint64_t offsets[N_SECTIONS];
+    uint64_t end = sizeof(VectorIndexHeader);
+    for (int i = 0; i < N_SECTIONS; i++) {
+        offsets[i] = end;
+        end += padded(sizes[i]);
+    }
+    if (!file.open_read(path) || end > file.size()) {
+        error = "Truncated vector index: " + path;
+        return nullptr;
+    }
+
+    const uint8_t* data = file.data();
+    const size_t n = header.n_vectors;
+    auto map = [&](auto& section, int i) {
+        using T = typename std::remove_reference<decltype(section)>::type::value_type;
+        section.owned.clear();
+        section.mapped = reinterpret_cast<const T*>(data + offsets[i]);
+        section.mapped_count = sizes[i] / sizeof(T);
+    };
+    map(index->codes_, 0);
+    map(index->scales_, 1);
+    map(index->text_offsets_, 2);
+    map(index->text_bytes_, 3);
+    map(index->levels_, 4);
+    map(index->links0_, 5);
+    map(index->upper_offsets_, 6);
+    map(index->upper_links_, 7);
+
+    const bool graph = header.hnsw_m > 0;
+    if (index->text_offsets_.mapped[n] != header.n_text_bytes ||
+            (graph && index->upper_offsets_.mapped[n] != header.n_upper_links) ||
+            (graph && n > 0 && (header.entry_point < 0 || (uint64_t)header.entry_point >= n))) {
+        error = "Corrupt vector index: " + path;
+        return nullptr;
+    }
+
+    index->entry_point_ = header.entry_point;
+    index->max_level_ = header.max_level;
+    index->level_seed_ = header.level_seed;
+    return index;
+}
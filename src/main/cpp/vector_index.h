@@ -0,0 +1,112 @@
+#pragma once
+
+#include "mapped_file.h"
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// Nearest-neighbour index over embeddings, filled by embedBatch without a round trip through Java.
+// Vectors are stored as f32, f16 or int8 with one scale per vector, and searched either exactly,
+// with a flat scan spread over the worker pool, or approximately through an HNSW graph. Every
+// vector may carry its text, so that the hits can be reranked without the caller resending them.
+//
+// An index saved to disk is opened by mapping the file, searches then read the vectors and the
+// graph from the page cache. Adding to an opened index copies it into memory first.
+// The values of the matching EmbeddingEncoding
+enum VectorStorage : uint32_t {
+    VECTOR_F32 = 0,
+    VECTOR_F16 = 1,
+    VECTOR_I8 = 2,
+};
+
+enum VectorMetric : uint32_t {
+    METRIC_COSINE = 0,  // Vectors and queries are normalized, scores are the cosine similarity
+    METRIC_DOT = 1,
+};
+
+struct VectorHit {
+    uint32_t entry;  // Position of the vector in the order it was added
+    float score;     // Higher is closer
+};
+
+class VectorIndex {
+public:
+    // hnsw_m neighbours per node and graph layer, or 0 for an exact flat index
+    VectorIndex(uint32_t dim, VectorStorage storage, VectorMetric metric, uint32_t hnsw_m, uint32_t ef_construction);
+
+    // Map an index written by save, nullptr with the error if it is not one
+    static std::unique_ptr<VectorIndex> open(const std::string& path, std::string& error);
+
+    // Write the index to path, through path.part renamed once complete
+    bool save(const std::string& path, std::string& error) const;
+
+    uint32_t dim() const { return dim_; }
+    size_t size() const;
+
+    // Add n vectors of dim floats with their texts, or without if texts is null. Returns the entry
+    // of the first vector, the others follow it.
+    uint32_t add(const float* vectors, size_t n, const std::string* texts);
+
+    // The k best entries for a query of dim floats, best first. ef is the HNSW candidate list size,
+    // raised to k, and ignored by a flat index.
+    std::vector<VectorHit> search(const float* query, size_t k, size_t ef) const;
+
+    std::string text(uint32_t entry) const;
+
+private:
+    // An array that is either owned or points into the mapped file
+    template <typename T>
+    struct Section {
+        using value_type = T;
+        std::vector<T> owned;
+        const T* mapped = nullptr;
+        size_t mapped_count = 0;
+
+        const T* data() const { return mapped ? mapped : owned.data(); }
+        size_t count() const { return mapped ? mapped_count : owned.size(); }
+        void materialize() {
+            if (!mapped) return;
+            owned.assign(mapped, mapped + mapped_count);
+            mapped = nullptr;
+        }
+    };
+
+    size_t row_bytes() const;
+    void encode(const float* vector, uint8_t* row, float& scale) const;
+    void decode(uint32_t entry, float* out) const;
+    float score(const float* query, uint32_t entry) const;
+    void materialize();
+
+    std::vector<VectorHit> search_flat(const float* query, size_t k) const;
+    std::vector<VectorHit> search_graph(const float* query, size_t k, size_t ef) const;
+    // Best candidates at one graph layer, starting from entry, best first
+    std::vector<VectorHit> search_layer(const float* query, uint32_t entry, size_t ef, uint32_t level) const;
+    const int32_t* links(uint32_t node, uint32_t level) const;
+    int32_t* links_mut(uint32_t node, uint32_t level);
+    uint32_t max_links(uint32_t level) const { return level == 0 ? 2 * hnsw_m_ : hnsw_m_; }
+    void insert(uint32_t node);
+    void connect(uint32_t node, uint32_t level, uint32_t neighbour);
+
+    uint32_t dim_;
+    VectorStorage storage_;
+    VectorMetric metric_;
+    uint32_t hnsw_m_;
+    uint32_t ef_construction_;
+    int32_t entry_point_ = -1;
+    uint32_t max_level_ = 0;
+    uint64_t level_seed_ = 0x9E3779B97F4A7C15ull;
+
+    Section<uint8_t> codes_;           // row_bytes() per vector
+    Section<float> scales_;            // Per vector, int8 storage only
+    Section<uint64_t> text_offsets_;   // n + 1 offsets into text_bytes_
+    Section<char> text_bytes_;
+    Section<uint8_t> levels_;          // Top graph layer of every node
+    Section<int32_t> links0_;          // max_links(0) per node, -1 padded
+    Section<uint64_t> upper_offsets_;  // n + 1 offsets into upper_links_, hnsw_m_ per layer above 0
+    Section<int32_t> upper_links_;
+
+    MappedFile file_;
+    mutable std::shared_mutex mutex_;
+};
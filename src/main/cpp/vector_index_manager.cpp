@@ -0,0 +1,156 @@
+#include "vector_index_manager.h"
+#include "jni_utils.h"
+#include "jni_error_handler.h"
+#include "native_trace.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+jlong VectorIndexManager::create(JNIEnv* env, jclass cls, jint dimension, jint storage, jint metric, jint m,
+		jint efConstruction) {
+	JNI_TRY(env)
+	
+	if (dimension <= 0 || storage < (jint)VECTOR_F32 || storage > (jint)VECTOR_I8 || metric < (jint)METRIC_COSINE ||
+			metric > (jint)METRIC_DOT || m < 0 || efConstruction < 0) {
+		JNIErrorHandler::throw_illegal_argument(env, "Invalid vector index parameters");
+		return 0;
+	}
+	VectorIndex* index = new VectorIndex((uint32_t)dimension, (VectorStorage)storage, (VectorMetric)metric,
+		(uint32_t)m, (uint32_t)efConstruction);
+	return reinterpret_cast<jlong>(index);
+	
+	JNI_CATCH_RET(env, 0)
+}
+
+jlong VectorIndexManager::open(JNIEnv* env, jclass cls, jstring path) {
+	JNI_TRY(env)
+	
+	std::string error;
+	std::unique_ptr<VectorIndex> index = VectorIndex::open(JniUtils::jstring_to_string(env, path), error);
+	if (!index) {
+		JNIErrorHandler::throw_runtime_exception(env, error);
+		return 0;
+	}
+	return reinterpret_cast<jlong>(index.release());
+	
+	JNI_CATCH_RET(env, 0)
+}
+
+void VectorIndexManager::save(JNIEnv* env, jclass cls, jlong handle, jstring path) {
+	JNI_TRY(env)
+	
+	VectorIndex* index = get(env, handle);
+	if (!index) return;
+	std::string error;
+	if (!index->save(JniUtils::jstring_to_string(env, path), error)) {
+		JNIErrorHandler::throw_runtime_exception(env, error);
+	}
+	
+	JNI_CATCH(env)
+}
+
+void VectorIndexManager::free(JNIEnv* env, jclass cls, jlong handle) {
+	delete reinterpret_cast<VectorIndex*>(handle);
+}
+
+jlong VectorIndexManager::size(JNIEnv* env, jclass cls, jlong handle) {
+	VectorIndex* index = get(env, handle);
+	return index ? (jlong)index->size() : 0;
+}
+
+jint VectorIndexManager::dimension(JNIEnv* env, jclass cls, jlong handle) {
+	VectorIndex* index = get(env, handle);
+	return index ? (jint)index->dim() : 0;
+}
+
+jint VectorIndexManager::add(JNIEnv* env, jclass cls, jlong handle, jfloatArray vectors, jobjectArray texts) {
+	JNI_TRY(env)
+	
+	VectorIndex* index = get(env, handle);
+	if (!index) return -1;
+	
+	jsize length = env->GetArrayLength(vectors);
+	if (length % index->dim() != 0) {
+		JNIErrorHandler::throw_illegal_argument(env, "Vectors have " + std::to_string(length) +
+			" floats, not a multiple of the dimension " + std::to_string(index->dim()));
+		return -1;
+	}
+	size_t n = length / index->dim();
+	
+	std::vector<std::string> strings;
+	if (texts) {
+		if ((size_t)env->GetArrayLength(texts) != n) {
+			JNIErrorHandler::throw_illegal_argument(env, "Expected one text per vector");
+			return -1;
+		}
+		strings.reserve(n);
+		for (size_t i = 0; i < n; i++) {
+			jstring text = (jstring)env->GetObjectArrayElement(texts, (jsize)i);
+			strings.push_back(text ? JniUtils::jstring_to_string(env, text) : std::string());
+			env->DeleteLocalRef(text);
+		}
+	}
+	
+	jfloat* data = env->GetFloatArrayElements(vectors, nullptr);
+	if (!data) {
+		JNIErrorHandler::throw_out_of_memory(env, "Could not access vectors");
+		return -1;
+	}
+	uint32_t first = index->add(data, n, texts ? strings.data() : nullptr);
+	env->ReleaseFloatArrayElements(vectors, data, JNI_ABORT);
+	return (jint)first;
+	
+	JNI_CATCH_RET(env, -1)
+}
+
+jobject VectorIndexManager::search(JNIEnv* env, jclass cls, jlong handle, jfloatArray query, jint k, jint ef) {
+	JNI_TRY(env)
+	JLLAMA_TRACE_SPAN("vector_index", "search");
+	
+	VectorIndex* index = get(env, handle);
+	if (!index) return nullptr;
+	if ((uint32_t)env->GetArrayLength(query) != index->dim()) {
+		JNIErrorHandler::throw_illegal_argument(env, "Query has " + std::to_string(env->GetArrayLength(query)) +
+			" floats, the index dimension is " + std::to_string(index->dim()));
+		return nullptr;
+	}
+	
+	std::vector<float> values(index->dim());
+	env->GetFloatArrayRegion(query, 0, (jsize)values.size(), values.data());
+	return newResult(env, index->search(values.data(), (size_t)std::max(0, (int)k), (size_t)std::max(0, (int)ef)));
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+jstring VectorIndexManager::text(JNIEnv* env, jclass cls, jlong handle, jint entry) {
+	JNI_TRY(env)
+	
+	VectorIndex* index = get(env, handle);
+	if (!index) return nullptr;
+	if (entry < 0 || (size_t)entry >= index->size()) {
+		JNIErrorHandler::throw_illegal_argument(env, "No entry " + std::to_string(entry));
+		return nullptr;
+	}
+	return JniUtils::string_to_jstring(env, index->text((uint32_t)entry));
+	
+	JNI_CATCH_RET(env, nullptr)
+}
+
+VectorIndex* VectorIndexManager::get(JNIEnv* env, jlong handle) {
+	VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+	if (!index) {
+		JNIErrorHandler::throw_illegal_state(env, "Vector index is closed");
+	}
+	return index;
+}
+
+jobject VectorIndexManager::newResult(JNIEnv* env, const std::vector<VectorHit>& hits) {
+	std::vector<jint> entries(hits.size());
+	std::vector<float> scores(hits.size());
+	for (size_t i = 0; i < hits.size(); i++) {
+		entries[i] = (jint)hits[i].entry;
+		scores[i] = hits[i].score;
+	}
+	return JniUtils::new_rerank_result(env, entries, scores);
+}
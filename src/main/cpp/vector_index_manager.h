@@ -0,0 +1,32 @@
+#ifndef VECTOR_INDEX_MANAGER_H
+#define VECTOR_INDEX_MANAGER_H
+
+#include <jni.h>
+#include <vector>
+#include "vector_index.h"
+
+// JNI side of de.kherud.llama.VectorIndex, indices are referenced by their VectorIndex pointer
+class VectorIndexManager {
+public:
+	static jlong create(JNIEnv* env, jclass cls, jint dimension, jint storage, jint metric, jint m, jint efConstruction);
+	static jlong open(JNIEnv* env, jclass cls, jstring path);
+	static void save(JNIEnv* env, jclass cls, jlong handle, jstring path);
+	static void free(JNIEnv* env, jclass cls, jlong handle);
+	static jlong size(JNIEnv* env, jclass cls, jlong handle);
+	static jint dimension(JNIEnv* env, jclass cls, jlong handle);
+	
+	// Add n * dimension floats with their texts, texts may be null. Returns the entry of the first vector.
+	static jint add(JNIEnv* env, jclass cls, jlong handle, jfloatArray vectors, jobjectArray texts);
+	
+	// The k nearest entries and their similarities, best first
+	static jobject search(JNIEnv* env, jclass cls, jlong handle, jfloatArray query, jint k, jint ef);
+	static jstring text(JNIEnv* env, jclass cls, jlong handle, jint entry);
+	
+	// The index of a handle, nullptr with a pending exception if it is 0
+	static VectorIndex* get(JNIEnv* env, jlong handle);
+	
+	// Hits as a RerankResult, with entries as indices
+	static jobject newResult(JNIEnv* env, const std::vector<VectorHit>& hits);
+};
+
+#endif // VECTOR_INDEX_MANAGER_H
@@ -0,0 +1,166 @@
+#include "warm_start.h"
+#include "mapped_file.h"
+#include "jni_logger.h"
+#include "native_trace.h"
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static const uint32_t WARM_IMAGE_MAGIC = 0x4957524a; // "JRWI"
+static const uint32_t WARM_IMAGE_VERSION = 1;
+
+struct WarmImageHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint64_t n_tokens;
+	uint64_t state_size;
+};
+
+static uint64_t fnv1a(const std::string& text) {
+	uint64_t hash = 1469598103934665603ull;
+	for (unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::string WarmStart::key(const std::vector<std::string>& paths, const llama_context_params& ctx_params,
+		const std::string& prompt) {
+	// Files are identified by size and modification time, a replaced model invalidates the image
+	std::string key;
+	for (const std::string& path : paths) {
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0) return "";
+		key += path + ":" + std::to_string((long long)info.st_size) + ":" + std::to_string((long long)info.st_mtime) + ";";
+	}
+	key += "ctx=" + std::to_string(ctx_params.n_ctx) + ";seq=" + std::to_string(ctx_params.n_seq_max);
+	key += ";k=" + std::to_string((int)ctx_params.type_k) + ";v=" + std::to_string((int)ctx_params.type_v);
+	key += ";fa=" + std::to_string((int)ctx_params.flash_attn_type) + ";";
+	key += prompt;
+	return key;
+}
+
+std::vector<llama_token> WarmStart::apply(llama_context* ctx, const WarmStartConfig& config,
+		const std::string& key, bool& restored) {
+	JLLAMA_TRACE_SPAN("state", "warm_start");
+	restored = false;
+	const llama_vocab* vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+	// Tokenized like completion prompts so that their prefixes match
+	std::vector<llama_token> tokens(config.prompt.length() + 1);
+	int n_tokens = llama_tokenize(vocab, config.prompt.c_str(), config.prompt.length(),
+		tokens.data(), tokens.size(), true, false);
+	if (n_tokens < 0) {
+		tokens.resize(-n_tokens);
+		n_tokens = llama_tokenize(vocab, config.prompt.c_str(), config.prompt.length(),
+			tokens.data(), tokens.size(), true, false);
+	}
+	if (n_tokens <= 0 || (uint32_t)n_tokens > llama_n_ctx(ctx) / llama_n_seq_max(ctx)) {
+		JNI_LOG_WARN("Warmup prompt is empty or does not fit into a sequence, skipping warm start");
+		return {};
+	}
+	tokens.resize(n_tokens);
+
+	size_t n_image = tokens.size() - 1;
+	uint64_t hash = fnv1a(key);
+	bool use_image = !config.image.empty() && !key.empty() && n_image > 0;
+
+	if (use_image) {
+		restored = restore(ctx, config.image, hash, tokens, n_image);
+	}
+	if (!restored) {
+		if (!decode(ctx, tokens, 0, n_image)) {
+			JNI_LOG_WARN("Failed to decode the warmup prompt, skipping warm start");
+			llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+			return {};
+		}
+		if (use_image && !save(ctx, config.image, hash, tokens, n_image)) {
+			JNI_LOG_WARN("Failed to write warm image %s", config.image.c_str());
+		}
+	}
+
+	// The last token runs the backend once on every start
+	if (!decode(ctx, tokens, n_image, tokens.size())) {
+		JNI_LOG_WARN("Failed to decode the warmup prompt, skipping warm start");
+		llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+		restored = false;
+		return {};
+	}
+	llama_synchronize(ctx);
+
+	// Requests are measured from a clean slate
+	llama_perf_context_reset(ctx);
+
+	JNI_LOG_INFO("Warm start %s %zu prompt tokens", restored ? "restored" : "decoded", tokens.size());
+	return tokens;
+}
+
+bool WarmStart::decode(llama_context* ctx, const std::vector<llama_token>& tokens, size_t begin, size_t end) {
+	const size_t n_batch = std::max<uint32_t>(1, llama_n_batch(ctx));
+	for (size_t i = begin; i < end; i += n_batch) {
+		int32_t n = (int32_t)std::min(n_batch, end - i);
+		// Single sequence batches continue at the end of sequence 0
+		llama_batch batch = llama_batch_get_one(const_cast<llama_token*>(tokens.data() + i), n);
+		if (llama_decode(ctx, batch) != 0) return false;
+	}
+	return true;
+}
+
+bool WarmStart::restore(llama_context* ctx, const std::string& image, uint64_t key,
+		const std::vector<llama_token>& tokens, size_t n_image) {
+	MappedFile file;
+	if (!file.open_read(image)) return false;
+
+	WarmImageHeader header;
+	if (file.size() < sizeof(header)) return false;
+	std::memcpy(&header, file.data(), sizeof(header));
+	size_t tokens_bytes = n_image * sizeof(llama_token);
+	if (header.magic != WARM_IMAGE_MAGIC || header.version != WARM_IMAGE_VERSION || header.key != key ||
+			header.n_tokens != n_image || file.size() != sizeof(header) + tokens_bytes + header.state_size) {
+		JNI_LOG_INFO("Warm image %s does not match the model and context, rebuilding it", image.c_str());
+		return false;
+	}
+	const uint8_t* data = file.data() + sizeof(header);
+	if (std::memcmp(data, tokens.data(), tokens_bytes) != 0) return false;
+
+	// Loaded straight from the mapping
+	if (llama_state_seq_set_data(ctx, data + tokens_bytes, header.state_size, 0) == 0) {
+		JNI_LOG_WARN("Failed to restore warm image %s, prefilling instead", image.c_str());
+		llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+		return false;
+	}
+	return true;
+}
+
+bool WarmStart::save(llama_context* ctx, const std::string& image, uint64_t key,
+		const std::vector<llama_token>& tokens, size_t n_image) {
+	WarmImageHeader header = { WARM_IMAGE_MAGIC, WARM_IMAGE_VERSION, key, n_image, llama_state_seq_get_size(ctx, 0) };
+	if (header.state_size == 0) return false;
+	size_t tokens_bytes = n_image * sizeof(llama_token);
+
+	// Written next to the image and renamed, so that concurrent starts never read a partial one
+	std::string staging = image + ".tmp" + std::to_string(reinterpret_cast<uintptr_t>(ctx));
+	bool ok;
+	{
+		MappedFile file;
+		ok = file.create(staging, sizeof(header) + tokens_bytes + header.state_size);
+		if (ok) {
+			std::memcpy(file.data(), &header, sizeof(header));
+			std::memcpy(file.data() + sizeof(header), tokens.data(), tokens_bytes);
+			ok = llama_state_seq_get_data(ctx, file.data() + sizeof(header) + tokens_bytes,
+				header.state_size, 0) == header.state_size;
+		}
+	}
+	if (ok) {
+#ifdef _WIN32
+		// rename does not replace existing files on Windows
+		std::remove(image.c_str());
+#endif
+		ok = std::rename(staging.c_str(), image.c_str()) == 0;
+	}
+	if (!ok) std::remove(staging.c_str());
+	return ok;
+}
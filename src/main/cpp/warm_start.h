@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "llama.h"
+
+// What a warm start prepares before the server is ready, filled from the model arguments
+struct WarmStartConfig {
+	std::string prompt;   // Shared prefix of the expected requests, e.g. the system prompt, empty to skip
+	std::string image;    // File keeping the decoded prefix for later loads, empty to always decode
+};
+
+// Fills sequence 0 of a fresh context with the warmup prompt, so that the first request finds its
+// prefix in the KV cache and the graphs and backend buffers were already used once.
+//
+// The image holds the sequence state of all but the last prompt token together with a key of the
+// model files and context settings. A matching image is restored instead of prefilling the prompt,
+// the last token is always decoded so that every start runs the backend once. A missing or stale
+// image is written after prefilling.
+class WarmStart {
+public:
+	// Warm the context, key identifies the weights and context layout the image is only valid for.
+	// Returns the tokens now held by sequence 0, empty if warming failed and the sequence was cleared.
+	static std::vector<llama_token> apply(llama_context* ctx, const WarmStartConfig& config,
+		const std::string& key, bool& restored);
+
+	// Key of the model files and context settings that an image depends on
+	static std::string key(const std::vector<std::string>& paths, const llama_context_params& ctx_params,
+		const std::string& prompt);
+
+private:
+	static bool restore(llama_context* ctx, const std::string& image, uint64_t key,
+		const std::vector<llama_token>& tokens, size_t n_image);
+	static bool save(llama_context* ctx, const std::string& image, uint64_t key,
+		const std::vector<llama_token>& tokens, size_t n_image);
+	static bool decode(llama_context* ctx, const std::vector<llama_token>& tokens, size_t begin, size_t end);
+};
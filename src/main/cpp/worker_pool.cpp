@@ -0,0 +1,72 @@
+#include "worker_pool.h"
+#include <algorithm>
+
+WorkerPool& WorkerPool::shared() {
+    static WorkerPool pool(std::min(16u, std::max(1u, std::thread::hardware_concurrency())) - 1);
+    return pool;
+}
+
+WorkerPool::WorkerPool(size_t n_threads) {
+    threads_.reserve(n_threads);
+    for (size_t i = 0; i < n_threads; i++) {
+        threads_.emplace_back(&WorkerPool::worker_loop, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkerPool::run(size_t n_parts, const std::function<void(size_t)>& fn) {
+    if (threads_.empty() || n_parts <= 1) {
+        for (size_t i = 0; i < n_parts; i++) fn(i);
+        return;
+    }
+
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job_ = &fn;
+        n_parts_ = n_parts;
+        next_part_ = 0;
+        n_busy_ = threads_.size();
+        generation_++;
+    }
+    work_cv_.notify_all();
+
+    drain();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return n_busy_ == 0; });
+    job_ = nullptr;
+}
+
+void WorkerPool::drain() {
+    for (size_t part = next_part_++; part < n_parts_; part = next_part_++) {
+        (*job_)(part);
+    }
+}
+
+void WorkerPool::worker_loop() {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_cv_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+            if (stopping_) return;
+            seen = generation_;
+        }
+
+        drain();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--n_busy_ == 0) done_cv_.notify_all();
+    }
+}
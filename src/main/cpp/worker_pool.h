@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Process-wide pool of persistent worker threads for CPU-bound work outside of llama_decode,
+// e.g. tokenizing many inputs. Workers are started once and keep their thread_local scratch
+// buffers between jobs. Only one job runs at a time, the calling thread works on it as well.
+class WorkerPool {
+public:
+    static WorkerPool& shared();
+
+    // Number of threads a job is spread over, including the calling thread
+    size_t size() const { return threads_.size() + 1; }
+
+    // Call fn(part) for every part in [0, n_parts) and return once all parts are done
+    void run(size_t n_parts, const std::function<void(size_t)>& fn);
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+private:
+    explicit WorkerPool(size_t n_threads);
+    ~WorkerPool();
+
+    void worker_loop();
+    void drain();
+
+    std::vector<std::thread> threads_;
+    std::mutex run_mutex_;   // Serializes jobs
+    std::mutex mutex_;       // Guards the fields below
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    const std::function<void(size_t)>* job_ = nullptr;
+    size_t n_parts_ = 0;
+    std::atomic<size_t> next_part_{0};
+    size_t n_busy_ = 0;
+    uint64_t generation_ = 0;
+    bool stopping_ = false;
+};
@@ -1,5 +1,8 @@
 package de.kherud.llama;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.FloatBuffer;
 
 public class BatchProcessor implements AutoCloseable {
 	private static final System.Logger LOGGER = System.getLogger(BatchProcessor.class.getName());
@@ -8,7 +11,12 @@ public class BatchProcessor implements AutoCloseable {
 
 	static { LlamaLoader.initialize(); }
 
+	// Bytes before the arrays of a packed batch: the int32 token count and 4 reserved bytes
+	private static final int PACKED_HEADER_BYTES = 8;
+
 	private final long batchHandle;
+	private final int maxTokenCount;
+	private final int embeddingDimension;
 	private final SafeBatchProcessor safeFallback;
 	private final boolean usingSafeFallback;
 	private boolean closed = false;
@@ -38,6 +46,8 @@ public class BatchProcessor implements AutoCloseable {
 		}
 
 		this.batchHandle = tempBatchHandle;
+		this.maxTokenCount = maxTokenCount;
+		this.embeddingDimension = embeddingDimension;
 		this.safeFallback = tempSafeFallback;
 		this.usingSafeFallback = tempUsingSafeFallback;
 	}
@@ -151,6 +161,122 @@ public class BatchProcessor implements AutoCloseable {
 		return getBatchTokenCountNative(batchHandle);
 	}
 
+	/**
+	 * Allocate a buffer for {@link #fillBatch(ByteBuffer)} and {@link #decodeAndCollect}, direct and in native
+	 * byte order. It holds the int32 token count at offset 0, then arrays sized to the batch capacity at
+	 * {@link #packedInputsOffset()}, {@link #packedPositionsOffset()}, {@link #packedSequenceIdsOffset()} and
+	 * {@link #packedLogitFlagsOffset()}: int32 tokens, or {@code embeddingDimension} floats per token for
+	 * embedding batches, int32 positions, one int32 sequence id per token and one byte logit flag per token.
+	 */
+	public ByteBuffer allocatePackedBuffer() {
+		return ByteBuffer.allocateDirect(packedSize()).order(ByteOrder.nativeOrder());
+	}
+
+	public int packedSize() {
+		return packedLogitFlagsOffset() + maxTokenCount;
+	}
+
+	public int packedInputsOffset() {
+		return PACKED_HEADER_BYTES;
+	}
+
+	public int packedPositionsOffset() {
+		return packedInputsOffset() + maxTokenCount * Integer.BYTES * Math.max(1, embeddingDimension);
+	}
+
+	public int packedSequenceIdsOffset() {
+		return packedPositionsOffset() + maxTokenCount * Integer.BYTES;
+	}
+
+	public int packedLogitFlagsOffset() {
+		return packedSequenceIdsOffset() + maxTokenCount * Integer.BYTES;
+	}
+
+	/**
+	 * Write a token batch to a buffer of {@link #allocatePackedBuffer()}.
+	 *
+	 * @param positions one position per token
+	 * @param sequenceIds one sequence id per token
+	 * @param logitFlags non-zero for the tokens to output logits or embeddings for
+	 */
+	public void pack(ByteBuffer packed, int[] tokens, int[] positions, int[] sequenceIds, byte[] logitFlags) {
+		int n = tokens.length;
+		if (n > maxTokenCount || positions.length != n || sequenceIds.length != n || logitFlags.length != n) {
+			throw new IllegalArgumentException("Batch fields must have one entry per token, at most " + maxTokenCount);
+		}
+		if (embeddingDimension > 0) {
+			throw new IllegalStateException("Batch holds embeddings, not tokens");
+		}
+		packed.putInt(0, n);
+		for (int i = 0; i < n; i++) {
+			packed.putInt(packedInputsOffset() + i * Integer.BYTES, tokens[i]);
+			packed.putInt(packedPositionsOffset() + i * Integer.BYTES, positions[i]);
+			packed.putInt(packedSequenceIdsOffset() + i * Integer.BYTES, sequenceIds[i]);
+			packed.put(packedLogitFlagsOffset() + i, logitFlags[i]);
+		}
+	}
+
+	/**
+	 * Set all fields of the batch from a packed buffer in one call, see {@link #allocatePackedBuffer()}.
+	 */
+	public void fillBatch(ByteBuffer packed) {
+		checkClosed();
+		if (usingSafeFallback) {
+			unpackInto(packed);
+			return;
+		}
+		fillBatchNative(batchHandle, packed);
+	}
+
+	/**
+	 * Fill the batch from a packed buffer, decode it and write one row per token with a logit flag, in batch
+	 * order, to {@code output}: the logits of the token, or its embedding when {@code embeddings} is set, the
+	 * embedding of its sequence if the context pools. A decode loop takes one native call per step.
+	 *
+	 * @param output a direct buffer with room for {@code rows * width} floats after {@code offset}
+	 * @return the number of rows written
+	 * @throws UnsupportedOperationException with the Java fallback, which decodes token by token
+	 */
+	public int decodeAndCollect(LlamaModel model, ByteBuffer packed, FloatBuffer output, int offset, boolean embeddings) {
+		checkClosed();
+		if (usingSafeFallback) {
+			throw new UnsupportedOperationException("decodeAndCollect needs the native batch, set llama.batch.safe_fallback=false");
+		}
+		return decodeAndCollectNative(model, batchHandle, packed, output, offset, embeddings);
+	}
+
+	private void unpackInto(ByteBuffer packed) {
+		ByteBuffer view = packed.duplicate().order(ByteOrder.nativeOrder());
+		int n = view.getInt(0);
+		if (n <= 0 || n > maxTokenCount) {
+			throw new IllegalArgumentException("Packed token count " + n + " is outside of 1.." + maxTokenCount);
+		}
+		int[] positions = new int[n];
+		int[] sequenceIds = new int[n];
+		byte[] logitFlags = new byte[n];
+		for (int i = 0; i < n; i++) {
+			positions[i] = view.getInt(packedPositionsOffset() + i * Integer.BYTES);
+			sequenceIds[i] = view.getInt(packedSequenceIdsOffset() + i * Integer.BYTES);
+			logitFlags[i] = view.get(packedLogitFlagsOffset() + i);
+		}
+		if (embeddingDimension > 0) {
+			float[] embeddings = new float[n * embeddingDimension];
+			for (int i = 0; i < embeddings.length; i++) {
+				embeddings[i] = view.getFloat(packedInputsOffset() + i * Float.BYTES);
+			}
+			safeFallback.setEmbeddings(embeddings);
+		} else {
+			int[] tokens = new int[n];
+			for (int i = 0; i < n; i++) {
+				tokens[i] = view.getInt(packedInputsOffset() + i * Integer.BYTES);
+			}
+			safeFallback.setTokens(tokens);
+		}
+		safeFallback.setPositions(positions);
+		safeFallback.setSequenceIds(sequenceIds);
+		safeFallback.setLogitFlags(logitFlags);
+	}
+
 	private void checkClosed() {
 		if (closed) {
 			throw new IllegalStateException("BatchProcessor has been closed");
@@ -173,6 +299,9 @@ public class BatchProcessor implements AutoCloseable {
 	private static native void freeBatchNative(long batchHandle);
 	private static native int encodeContextNative(LlamaModel model, long batchHandle);
 	private static native int decodeTokensNative(LlamaModel model, long batchHandle);
+	private static native void fillBatchNative(long batchHandle, ByteBuffer packed);
+	private static native int decodeAndCollectNative(LlamaModel model, long batchHandle, ByteBuffer packed,
+		FloatBuffer output, int offset, boolean embeddings);
 	private static native void setBatchTokensNative(long batchHandle, int[] tokens);
 	private static native void setBatchEmbeddingsNative(long batchHandle, float[] embeddings);
 	private static native void setBatchPositionsNative(long batchHandle, int[] positions);
@@ -0,0 +1,64 @@
+package de.kherud.llama;
+
+import java.util.Objects;
+
+/**
+ * A chat history whose chat template rendering and tokens are kept natively between turns, see
+ * {@link LlamaModel#createConversation()}. Appending a message only renders and tokenizes that message, and
+ * completions of the conversation reuse the KV cache of the previous turn's prompt.
+ * <p>
+ * Replies are not appended automatically, append them as {@code "assistant"} messages to continue the conversation.
+ */
+public final class ChatConversation implements AutoCloseable {
+
+    private final LlamaModel model;
+    private long handle;
+
+    ChatConversation(LlamaModel model, long handle) {
+        this.model = model;
+        this.handle = handle;
+    }
+
+    /**
+     * Append a message to the conversation.
+     *
+     * @param role the role of the message author, for example {@code "system"}, {@code "user"} or {@code "assistant"}
+     * @param content the message text
+     * @return this conversation
+     */
+    public ChatConversation append(String role, String content) {
+        Objects.requireNonNull(role, "role");
+        Objects.requireNonNull(content, "content");
+        model.appendConversationMessageNative(handle(), role, content);
+        return this;
+    }
+
+    /**
+     * @return the conversation rendered with the model's chat template, including the generation prompt
+     */
+    public String getPrompt() {
+        return model.renderConversationNative(handle());
+    }
+
+    /**
+     * @return the tokens of {@link #getPrompt()}, as they are submitted for completion
+     */
+    public int[] getPromptTokens() {
+        return model.getConversationTokensNative(handle());
+    }
+
+    synchronized long handle() {
+        if (handle == 0) {
+            throw new IllegalStateException("Conversation is closed");
+        }
+        return handle;
+    }
+
+    @Override
+    public synchronized void close() {
+        if (handle != 0) {
+            model.freeConversationNative(handle);
+            handle = 0;
+        }
+    }
+}
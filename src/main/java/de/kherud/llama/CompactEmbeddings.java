@@ -0,0 +1,78 @@
+package de.kherud.llama;
+
+import java.util.Arrays;
+
+/**
+ * Embeddings encoded by {@link LlamaModel#embedCompact(EmbeddingFormat, String...)}, one row of
+ * {@link #bytesPerEmbedding()} bytes per text in {@link #data}.
+ */
+public final class CompactEmbeddings {
+
+	/** The encoded rows one after another */
+	public final byte[] data;
+
+	/** The scale of every row of an {@link EmbeddingFormat.Encoding#INT8} encoding, 1 for the others */
+	public final float[] scales;
+
+	private final EmbeddingFormat.Encoding encoding;
+	private final int dimensions;
+
+	CompactEmbeddings(EmbeddingFormat.Encoding encoding, int dimensions, byte[] data, float[] scales) {
+		this.encoding = encoding;
+		this.dimensions = dimensions;
+		this.data = data;
+		this.scales = scales;
+	}
+
+	public EmbeddingFormat.Encoding getEncoding() {
+		return encoding;
+	}
+
+	public int getDimensions() {
+		return dimensions;
+	}
+
+	public int size() {
+		return scales.length;
+	}
+
+	public int bytesPerEmbedding() {
+		return encoding.bytes(dimensions);
+	}
+
+	/**
+	 * @return the encoded bytes of embedding {@code i}
+	 */
+	public byte[] row(int i) {
+		int bytes = bytesPerEmbedding();
+		return Arrays.copyOfRange(data, i * bytes, (i + 1) * bytes);
+	}
+
+	/**
+	 * Decode embedding {@code i} back to floats, binary rows decode to +1 and -1.
+	 */
+	public float[] decode(int i) {
+		int offset = i * bytesPerEmbedding();
+		float[] values = new float[dimensions];
+		for (int d = 0; d < dimensions; d++) {
+			switch (encoding) {
+				case F32:
+					values[d] = Float.intBitsToFloat((data[offset + 4 * d] & 0xff)
+						| (data[offset + 4 * d + 1] & 0xff) << 8
+						| (data[offset + 4 * d + 2] & 0xff) << 16
+						| (data[offset + 4 * d + 3] & 0xff) << 24);
+					break;
+				case F16:
+					values[d] = Float.float16ToFloat((short) ((data[offset + 2 * d] & 0xff)
+						| (data[offset + 2 * d + 1] & 0xff) << 8));
+					break;
+				case INT8:
+					values[d] = data[offset + d] * scales[i];
+					break;
+				default:
+					values[d] = (data[offset + d / 8] & (0x80 >> (d % 8))) != 0 ? 1.0f : -1.0f;
+			}
+		}
+		return values;
+	}
+}
@@ -0,0 +1,254 @@
+package de.kherud.llama;
+
+import de.kherud.llama.args.Priority;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+import java.util.Arrays;
+
+/**
+ * A completion request in a compact binary encoding, an alternative to {@link InferenceParameters} for callers that
+ * want to skip JSON serialization. The prompt can be given as tokens (see {@link #setPromptTokens(int...)}), which also
+ * skips tokenization, for example when the tokens were produced by {@link LlamaModel#encodeBatch(String...)}.
+ * <p>
+ * The request is encoded into a reused direct buffer which native code reads in place, so a request object should not
+ * be shared between threads. Sampling parameters default to llama.cpp's defaults and are only applied once one of them
+ * was set, otherwise greedy sampling is used, like for {@link InferenceParameters}.
+ */
+public final class CompletionRequest {
+
+    private static final int MAGIC = 0x4C524331;
+    private static final int FLAG_STREAM = 1;
+    private static final int FLAG_SAMPLING = 1 << 1;
+    private static final int HEADER_FIELDS = 10;
+    private static final int SAMPLING_FIELDS = 17;
+
+    private String prompt = "";
+    private int[] promptTokens = new int[0];
+    private byte[] grammar = new byte[0];
+    private int nPredict = 10;
+    private int nProbs = 0;
+    private boolean stream = true;
+    private Priority priority = Priority.NORMAL;
+    private int deadlineMs = 0;
+
+    private boolean sampling = false;
+    private float temperature = 0.8f;
+    private float dynatempRange = 0.0f;
+    private float dynatempExponent = 1.0f;
+    private int topK = 40;
+    private float topP = 0.95f;
+    private float minP = 0.05f;
+    private float typicalP = 1.0f;
+    private int minKeep = 0;
+    private int repeatLastN = 64;
+    private float repeatPenalty = 1.0f;
+    private float frequencyPenalty = 0.0f;
+    private float presencePenalty = 0.0f;
+    private float dryMultiplier = 0.0f;
+    private float dryBase = 1.75f;
+    private int dryAllowedLength = 2;
+    private int dryPenaltyLastN = -1;
+    private int seed = -1;
+    private int[] biasTokens = new int[0];
+    private float[] biasValues = new float[0];
+
+    private ByteBuffer buffer;
+
+    /**
+     * Set a text prompt, it is tokenized natively. Ignored if prompt tokens are set.
+     */
+    public CompletionRequest setPrompt(String prompt) {
+        this.prompt = prompt == null ? "" : prompt;
+        return this;
+    }
+
+    /**
+     * Set a pre-tokenized prompt, which is used as it is, without adding any special tokens.
+     */
+    public CompletionRequest setPromptTokens(int... tokens) {
+        this.promptTokens = tokens == null ? new int[0] : tokens.clone();
+        return this;
+    }
+
+    /**
+     * Set the number of tokens to predict, a negative value generates until the context is full.
+     */
+    public CompletionRequest setNPredict(int nPredict) {
+        this.nPredict = nPredict;
+        return this;
+    }
+
+    /**
+     * Set the number of most probable tokens reported for every generated token.
+     */
+    public CompletionRequest setNProbs(int nProbs) {
+        this.nProbs = nProbs;
+        return this;
+    }
+
+    /**
+     * Set a BNF-like grammar to constrain generations.
+     */
+    public CompletionRequest setGrammar(String grammar) {
+        this.grammar = grammar == null ? new byte[0] : grammar.getBytes(StandardCharsets.UTF_8);
+        return this;
+    }
+
+    /**
+     * Set the scheduling class of the request, see {@link InferenceParameters#setPriority(Priority)}.
+     */
+    public CompletionRequest setPriority(Priority priority) {
+        this.priority = priority;
+        return this;
+    }
+
+    /**
+     * Set the deadline of the request in milliseconds after submission, see
+     * {@link InferenceParameters#setDeadline(long)}.
+     */
+    public CompletionRequest setDeadline(int deadlineMs) {
+        this.deadlineMs = deadlineMs;
+        return this;
+    }
+
+    CompletionRequest setStream(boolean stream) {
+        this.stream = stream;
+        return this;
+    }
+
+    public CompletionRequest setTemperature(float temperature) {
+        this.temperature = temperature;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setDynamicTemperature(float range, float exponent) {
+        this.dynatempRange = range;
+        this.dynatempExponent = exponent;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setTopK(int topK) {
+        this.topK = topK;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setTopP(float topP) {
+        this.topP = topP;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setMinP(float minP) {
+        this.minP = minP;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setTypicalP(float typicalP) {
+        this.typicalP = typicalP;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setMinKeep(int minKeep) {
+        this.minKeep = minKeep;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setRepeatPenalty(int lastN, float penalty) {
+        this.repeatLastN = lastN;
+        this.repeatPenalty = penalty;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setFrequencyPenalty(float frequencyPenalty) {
+        this.frequencyPenalty = frequencyPenalty;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setPresencePenalty(float presencePenalty) {
+        this.presencePenalty = presencePenalty;
+        sampling = true;
+        return this;
+    }
+
+    /**
+     * Set the DRY repetition penalty, see {@link InferenceParameters#setDryMultiplier(float)}. The default sequence
+     * breakers are used.
+     */
+    public CompletionRequest setDry(float multiplier, float base, int allowedLength, int penaltyLastN) {
+        this.dryMultiplier = multiplier;
+        this.dryBase = base;
+        this.dryAllowedLength = allowedLength;
+        this.dryPenaltyLastN = penaltyLastN;
+        sampling = true;
+        return this;
+    }
+
+    public CompletionRequest setSeed(int seed) {
+        this.seed = seed;
+        sampling = true;
+        return this;
+    }
+
+    /**
+     * Add a bias to the logit of a token, {@link Float#NEGATIVE_INFINITY} bans the token.
+     */
+    public CompletionRequest addTokenBias(int token, float bias) {
+        int n = biasTokens.length;
+        biasTokens = Arrays.copyOf(biasTokens, n + 1);
+        biasValues = Arrays.copyOf(biasValues, n + 1);
+        biasTokens[n] = token;
+        biasValues[n] = bias;
+        sampling = true;
+        return this;
+    }
+
+    /**
+     * Encode the request, the returned buffer is reused by the next call.
+     */
+    ByteBuffer encode() {
+        byte[] promptBytes = promptTokens.length > 0 ? new byte[0] : prompt.getBytes(StandardCharsets.UTF_8);
+        int size = Integer.BYTES * (HEADER_FIELDS + SAMPLING_FIELDS + promptTokens.length + 2 * biasTokens.length)
+                + promptBytes.length + grammar.length;
+        if (buffer == null || buffer.capacity() < size) {
+            buffer = ByteBuffer.allocateDirect(Math.max(size, 256)).order(ByteOrder.nativeOrder());
+        }
+        buffer.clear();
+
+        buffer.putInt(MAGIC)
+                .putInt((stream ? FLAG_STREAM : 0) | (sampling ? FLAG_SAMPLING : 0))
+                .putInt(nPredict)
+                .putInt(nProbs)
+                .putInt(promptTokens.length)
+                .putInt(promptBytes.length)
+                .putInt(grammar.length)
+                .putInt(biasTokens.length)
+                .putInt(priority.ordinal())
+                .putInt(deadlineMs);
+
+        buffer.putFloat(temperature).putFloat(dynatempRange).putFloat(dynatempExponent)
+                .putInt(topK).putFloat(topP).putFloat(minP).putFloat(typicalP).putInt(minKeep)
+                .putInt(repeatLastN).putFloat(repeatPenalty).putFloat(frequencyPenalty).putFloat(presencePenalty)
+                .putFloat(dryMultiplier).putFloat(dryBase).putInt(dryAllowedLength).putInt(dryPenaltyLastN)
+                .putInt(seed);
+
+        buffer.asIntBuffer().put(promptTokens);
+        buffer.position(buffer.position() + Integer.BYTES * promptTokens.length);
+        for (int i = 0; i < biasTokens.length; i++) {
+            buffer.putInt(biasTokens[i]).putFloat(biasValues[i]);
+        }
+        buffer.put(promptBytes).put(grammar);
+
+        buffer.flip();
+        return buffer;
+    }
+}
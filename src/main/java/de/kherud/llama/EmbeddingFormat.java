@@ -0,0 +1,85 @@
+package de.kherud.llama;
+
+/**
+ * How {@link LlamaModel#embedCompact(EmbeddingFormat, String...)} returns embeddings. The embedding is truncated to its
+ * leading dimensions first, as Matryoshka embedding models allow, then optionally normalized to unit length and
+ * finally encoded. Everything happens natively, only the encoded bytes are copied to Java.
+ */
+public final class EmbeddingFormat {
+
+	public enum Encoding {
+		/** 4 bytes per dimension */
+		F32(32),
+		/** IEEE half precision, 2 bytes per dimension */
+		F16(16),
+		/** Symmetric 8-bit, one byte per dimension, {@code value = code * scale} with one scale per embedding */
+		INT8(8),
+		/** One sign bit per dimension, the most significant bit first, set for positive values */
+		BINARY(1);
+
+		private final int bits;
+
+		Encoding(int bits) {
+			this.bits = bits;
+		}
+
+		/**
+		 * @return the bytes of one encoded embedding of {@code dimensions} dimensions
+		 */
+		public int bytes(int dimensions) {
+			return (dimensions * bits + 7) / 8;
+		}
+	}
+
+	private final Encoding encoding;
+	private final int dimensions;
+	private final boolean normalize;
+
+	private EmbeddingFormat(Encoding encoding, int dimensions, boolean normalize) {
+		this.encoding = encoding;
+		this.dimensions = dimensions;
+		this.normalize = normalize;
+	}
+
+	/**
+	 * @return a format of all dimensions, not normalized
+	 */
+	public static EmbeddingFormat of(Encoding encoding) {
+		if (encoding == null) {
+			throw new IllegalArgumentException("Encoding must not be null");
+		}
+		return new EmbeddingFormat(encoding, 0, false);
+	}
+
+	/**
+	 * @param dimensions the number of leading dimensions to keep, at most the embedding size of the model
+	 */
+	public EmbeddingFormat truncatedTo(int dimensions) {
+		if (dimensions <= 0) {
+			throw new IllegalArgumentException("Dimensions must be positive");
+		}
+		return new EmbeddingFormat(encoding, dimensions, normalize);
+	}
+
+	/**
+	 * Normalize the (truncated) embedding to unit length before encoding it.
+	 */
+	public EmbeddingFormat normalized() {
+		return new EmbeddingFormat(encoding, dimensions, true);
+	}
+
+	public Encoding getEncoding() {
+		return encoding;
+	}
+
+	/**
+	 * @return the number of kept dimensions, or 0 for all
+	 */
+	public int getDimensions() {
+		return dimensions;
+	}
+
+	public boolean isNormalized() {
+		return normalize;
+	}
+}
@@ -1,6 +1,7 @@
 package de.kherud.llama;
 
 import de.kherud.llama.args.MiroStat;
+import de.kherud.llama.args.Priority;
 import de.kherud.llama.args.Sampler;
 
 import java.util.Collection;
@@ -32,6 +33,10 @@ public final class InferenceParameters extends JsonParameters {
 	private static final String PARAM_REPEAT_PENALTY = "repeat_penalty";
 	private static final String PARAM_FREQUENCY_PENALTY = "frequency_penalty";
 	private static final String PARAM_PRESENCE_PENALTY = "presence_penalty";
+	private static final String PARAM_DRY_MULTIPLIER = "dry_multiplier";
+	private static final String PARAM_DRY_BASE = "dry_base";
+	private static final String PARAM_DRY_ALLOWED_LENGTH = "dry_allowed_length";
+	private static final String PARAM_DRY_PENALTY_LAST_N = "dry_penalty_last_n";
 	private static final String PARAM_MIROSTAT = "mirostat";
 	private static final String PARAM_MIROSTAT_TAU = "mirostat_tau";
 	private static final String PARAM_MIROSTAT_ETA = "mirostat_eta";
@@ -39,6 +44,8 @@ public final class InferenceParameters extends JsonParameters {
 	private static final String PARAM_N_KEEP = "n_keep";
 	private static final String PARAM_SEED = "seed";
 	private static final String PARAM_N_PROBS = "n_probs";
+	private static final String PARAM_N_CANDIDATES = "n";
+	private static final String PARAM_LORA = "lora";
 	private static final String PARAM_MIN_KEEP = "min_keep";
 	private static final String PARAM_GRAMMAR = "grammar";
 	private static final String PARAM_PENALTY_PROMPT = "penalty_prompt";
@@ -47,6 +54,8 @@ public final class InferenceParameters extends JsonParameters {
 	private static final String PARAM_STOP = "stop";
 	private static final String PARAM_SAMPLERS = "samplers";
 	private static final String PARAM_STREAM = "stream";
+	private static final String PARAM_PRIORITY = "priority";
+	private static final String PARAM_DEADLINE_MS = "deadline_ms";
 	private static final String PARAM_USE_CHAT_TEMPLATE = "use_chat_template";
 	private static final String PARAM_USE_JINJA = "use_jinja";
 	private static final String PARAM_MESSAGES = "messages";
@@ -192,6 +201,38 @@ public final class InferenceParameters extends JsonParameters {
 		return this;
 	}
 
+	/**
+	 * Set the DRY (Don't Repeat Yourself) repetition penalty multiplier (default: 0.0, 0.0 = disabled)
+	 */
+	public InferenceParameters setDryMultiplier(float dryMultiplier) {
+		parameters.put(PARAM_DRY_MULTIPLIER, String.valueOf(dryMultiplier));
+		return this;
+	}
+
+	/**
+	 * Set the DRY repetition penalty base value (default: 1.75)
+	 */
+	public InferenceParameters setDryBase(float dryBase) {
+		parameters.put(PARAM_DRY_BASE, String.valueOf(dryBase));
+		return this;
+	}
+
+	/**
+	 * Set the length of repeated sequences DRY tolerates before penalizing (default: 2)
+	 */
+	public InferenceParameters setDryAllowedLength(int dryAllowedLength) {
+		parameters.put(PARAM_DRY_ALLOWED_LENGTH, String.valueOf(dryAllowedLength));
+		return this;
+	}
+
+	/**
+	 * Set the number of last tokens DRY scans for repetitions (default: -1, 0 = disabled, -1 = context size)
+	 */
+	public InferenceParameters setDryPenaltyLastN(int dryPenaltyLastN) {
+		parameters.put(PARAM_DRY_PENALTY_LAST_N, String.valueOf(dryPenaltyLastN));
+		return this;
+	}
+
 	/**
 	 * Set MiroStat sampling strategies.
 	 */
@@ -547,6 +588,59 @@ public final class InferenceParameters extends JsonParameters {
         return this;
     }
 
+	/**
+	 * Set the number of candidate completions {@link LlamaModel#completeCandidates(InferenceParameters)} generates
+	 * (default: 1). The prompt is decoded once and shared by all candidates, which need a parallel sequence each
+	 * and a sampler with a seed or randomness to differ.
+	 */
+	public InferenceParameters setNCandidates(int n) {
+		parameters.put(PARAM_N_CANDIDATES, String.valueOf(n));
+		return this;
+	}
+
+	/**
+	 * Set the LoRA adapters the request decodes with, by the handles of {@link LlamaModel#loadLoRAAdapter(String)}
+	 * and their scales. An empty map selects the base model, without this the adapters set with
+	 * {@link LlamaModel#setLoRAAdapter(long, float)} are used. Requests of several adapter sets share the model,
+	 * the scheduler decodes the requests of one set per step. The adapters must stay loaded until the request is
+	 * done.
+	 */
+	public InferenceParameters setLoraAdapters(Map<Long, Float> adapters) {
+		StringBuilder builder = new StringBuilder();
+		builder.append("[");
+		int i = 0;
+		for (Map.Entry<Long, Float> entry : adapters.entrySet()) {
+			builder.append("{\"id\": ")
+					.append(entry.getKey())
+					.append(", \"scale\": ")
+					.append(entry.getValue())
+					.append("}");
+			if (i++ < adapters.size() - 1) {
+				builder.append(", ");
+			}
+		}
+		builder.append("]");
+		parameters.put(PARAM_LORA, builder.toString());
+		return this;
+	}
+
+	/**
+	 * Set the scheduling class of the request (default: {@link Priority#NORMAL}).
+	 */
+	public InferenceParameters setPriority(Priority priority) {
+		parameters.put(PARAM_PRIORITY, String.valueOf(priority.ordinal()));
+		return this;
+	}
+
+	/**
+	 * Set the time in milliseconds after submission by which the request must be done. A request still waiting
+	 * for a sequence at its deadline is rejected, a running one ends with an error (default: 0, no deadline).
+	 */
+	public InferenceParameters setDeadline(long deadlineMs) {
+		parameters.put(PARAM_DEADLINE_MS, String.valueOf(deadlineMs));
+		return this;
+	}
+
 	InferenceParameters setStream(boolean stream) {
 		parameters.put(PARAM_STREAM, String.valueOf(stream));
 		return this;
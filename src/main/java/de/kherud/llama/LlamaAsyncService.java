@@ -5,6 +5,7 @@ import java.util.concurrent.ExecutorService;
 import java.util.concurrent.Executors;
 import java.util.concurrent.ThreadFactory;
 import java.util.concurrent.atomic.AtomicInteger;
+import java.util.function.Consumer;
 import java.util.stream.Stream;
 import java.util.stream.StreamSupport;
 
@@ -85,6 +86,49 @@ public class LlamaAsyncService implements AutoCloseable {
 		return generateAsync(new InferenceParameters(prompt));
 	}
 
+	/**
+	 * Stream generated outputs to a consumer without occupying a Java thread: tokens are pushed from the
+	 * native dispatcher thread as they are generated. Cancelling the returned future cancels the generation.
+	 *
+	 * @return a future completed after the last output, or exceptionally if generation failed
+	 */
+	public CompletableFuture<Void> streamAsync(InferenceParameters parameters, Consumer<LlamaOutput> consumer) {
+		CompletableFuture<Void> future = new CompletableFuture<>();
+		int taskId = model.generate(parameters, new LlamaModel.CompletionCallback() {
+			@Override
+			public void onOutput(LlamaOutput output) {
+				consumer.accept(output);
+			}
+
+			@Override
+			public void onComplete() {
+				future.complete(null);
+			}
+
+			@Override
+			public void onError(String message) {
+				future.completeExceptionally(new LlamaException(message));
+			}
+		});
+		if (taskId < 0) {
+			future.completeExceptionally(new LlamaException("Failed to start the completion"));
+			return future;
+		}
+		future.whenComplete((result, error) -> {
+			if (future.isCancelled()) {
+				model.cancel(taskId);
+			}
+		});
+		return future;
+	}
+
+	/**
+	 * Stream generated outputs for a prompt, see {@link #streamAsync(InferenceParameters, Consumer)}
+	 */
+	public CompletableFuture<Void> streamAsync(String prompt, Consumer<LlamaOutput> consumer) {
+		return streamAsync(new InferenceParameters(prompt), consumer);
+	}
+
 	/**
 	 * Asynchronously generate embeddings
 	 */
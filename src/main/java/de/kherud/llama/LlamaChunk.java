@@ -0,0 +1,68 @@
+package de.kherud.llama;
+
+import java.nio.charset.StandardCharsets;
+
+/**
+ * A batch of generated tokens returned by a single native call, see {@link LlamaIterator#nextChunk(int, long)}.
+ * The text of all tokens is packed into one UTF-8 byte array, token {@code i} covers the bytes
+ * {@code offsets[i]} (inclusive) to {@code offsets[i + 1]} (exclusive).
+ */
+public final class LlamaChunk {
+
+    /**
+     * The UTF-8 encoded text of all tokens in this chunk.
+     */
+    public final byte[] bytes;
+
+    /**
+     * The ids of the generated tokens, may be empty if the timeout elapsed before a token was generated.
+     */
+    public final int[] tokens;
+
+    /**
+     * Byte offsets of every token into {@link #bytes}, with one additional entry holding the total length.
+     */
+    public final int[] offsets;
+
+    /**
+     * The ids of the {@link InferenceParameters#setNProbs(int) n_probs} most probable candidates of every token,
+     * best first. Entry {@code i * nProbs + j} is the {@code j}-th candidate of token {@code i}. Empty if no
+     * probabilities were requested.
+     */
+    public final int[] topTokens;
+
+    /**
+     * The probabilities of the candidates in {@link #topTokens}.
+     */
+    public final float[] topProbabilities;
+
+    final boolean stop;
+
+    LlamaChunk(byte[] bytes, int[] tokens, int[] offsets, boolean stop, int[] topTokens, float[] topProbabilities) {
+        this.bytes = bytes;
+        this.tokens = tokens;
+        this.offsets = offsets;
+        this.stop = stop;
+        this.topTokens = topTokens != null ? topTokens : new int[0];
+        this.topProbabilities = topProbabilities != null ? topProbabilities : new float[0];
+    }
+
+    /**
+     * @return whether the generation has finished with this chunk
+     */
+    public boolean isStop() {
+        return stop;
+    }
+
+    /**
+     * @return the text of all tokens in this chunk
+     */
+    public String getText() {
+        return new String(bytes, StandardCharsets.UTF_8);
+    }
+
+    @Override
+    public String toString() {
+        return getText();
+    }
+}
@@ -1,6 +1,7 @@
 package de.kherud.llama;
 
 import java.lang.annotation.Native;
+import java.nio.ByteBuffer;
 import java.util.Iterator;
 import java.util.NoSuchElementException;
 
@@ -23,6 +24,19 @@ public final class LlamaIterator implements Iterator<LlamaOutput> {
         taskId = model.requestCompletion(parameters.toString());
     }
 
+    LlamaIterator(LlamaModel model, CompletionRequest request) {
+        this.model = model;
+        request.setStream(true);
+        ByteBuffer buffer = request.encode();
+        taskId = model.requestCompletionBinary(buffer, buffer.limit());
+    }
+
+    LlamaIterator(LlamaModel model, ChatConversation conversation, InferenceParameters parameters) {
+        this.model = model;
+        parameters.setStream(true);
+        taskId = model.requestConversationCompletion(conversation.handle(), parameters.toString());
+    }
+
     @Override
     public boolean hasNext() {
         return hasNext;
@@ -42,7 +56,32 @@ public final class LlamaIterator implements Iterator<LlamaOutput> {
     }
 
     /**
-     * Cancel the ongoing generation process.
+     * Receive all tokens generated since the last call with a single native call, instead of one call per token.
+     * Waits at most {@code timeoutMs} milliseconds for the first token (a negative timeout waits indefinitely), so the
+     * returned chunk may be empty.
+     *
+     * @param maxTokens the maximum number of tokens to return
+     * @param timeoutMs the maximum time to wait for a token in milliseconds
+     * @return the tokens generated so far
+     */
+    public LlamaChunk nextChunk(int maxTokens, long timeoutMs) {
+        if (!hasNext) {
+            throw new NoSuchElementException();
+        }
+        if (maxTokens <= 0) {
+            throw new IllegalArgumentException("maxTokens must be positive");
+        }
+        LlamaChunk chunk = model.receiveCompletionChunk(taskId, maxTokens, timeoutMs);
+        hasNext = !chunk.stop;
+        if (chunk.stop) {
+            model.releaseTask(taskId);
+        }
+        return chunk;
+    }
+
+    /**
+     * Cancel the ongoing generation process. A prompt that is being decoded is interrupted
+     * within one micro-batch and the KV cache cells of the completion are freed.
      */
     public void cancel() {
         model.cancelCompletion(taskId);
@@ -3,7 +3,13 @@ package de.kherud.llama;
 import de.kherud.llama.args.LogFormat;
 
 import java.lang.annotation.Native;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.FloatBuffer;
+import java.nio.channels.ReadableByteChannel;
+import java.nio.channels.WritableByteChannel;
 import java.nio.charset.StandardCharsets;
+import java.nio.file.Path;
 import java.util.ArrayList;
 import java.util.List;
 import java.util.Map;
@@ -28,9 +34,15 @@ public class LlamaModel implements AutoCloseable {
 		LlamaLoader.initialize();
 	}
 
+	// Chunk size of streamed state exports and imports
+	private static final int STATE_CHUNK_SIZE = 1 << 20;
+
 	@Native
 	private long ctx;
 
+	// Exported once on first use, the vocabulary does not change while the model is loaded
+	private volatile Vocabulary vocabulary;
+
 	/**
 	 * Load with the given {@link ModelParameters}. Make sure to either set
 	 * <ul>
@@ -39,6 +51,9 @@ public class LlamaModel implements AutoCloseable {
 	 *     <li>{@link ModelParameters#setHfRepo(String)}, {@link ModelParameters#setHfFile(String)}</li>
 	 * </ul>
 	 *
+	 * Models loading the same file with the same weight placement (GPU layers, split mode, main GPU, mmap and mlock)
+	 * share one copy of the weights, each with its own context. The weights are freed with the last model using them.
+	 *
 	 * @param parameters the set of options
 	 * @throws LlamaException if no model could be loaded from the given file path
 	 */
@@ -48,6 +63,40 @@ public class LlamaModel implements AutoCloseable {
 		loadModel(optimizedParams.toArray());
 	}
 
+	private LlamaModel(long handle) {
+		this.ctx = handle;
+	}
+
+	/**
+	 * Load a model split into several GGUF files, see {@link LlamaUtils#buildSplitPath(String, int)}. All model
+	 * parameters apply like for {@link #LlamaModel(ModelParameters)}, the model path is ignored.
+	 *
+	 * @param parameters the set of options
+	 * @param paths all split files of the model, in order
+	 * @return the loaded model
+	 * @throws RuntimeException if the model could not be loaded
+	 */
+	public static LlamaModel loadFromSplits(ModelParameters parameters, String... paths) {
+		return new LlamaModel(loadModelFromSplits(paths, SmartDefaults.apply(parameters).toArray()));
+	}
+
+	/**
+	 * Start loading a model in the background. The returned {@link ModelLoad} reports the load progress, can be
+	 * cancelled and yields the model once it is loaded.
+	 *
+	 * @param parameters the set of options
+	 * @param paths all split files of a split model, or none to load {@link ModelParameters#setModel(String)}
+	 * @return the running load
+	 * @throws IllegalArgumentException if the parameters are invalid
+	 */
+	public static ModelLoad loadAsync(ModelParameters parameters, String... paths) {
+		return new ModelLoad(startModelLoad(paths, SmartDefaults.apply(parameters).toArray()));
+	}
+
+	static LlamaModel fromHandle(long handle) {
+		return new LlamaModel(handle);
+	}
+
 	/**
 	 * Create a model optimized for text completion and generation workloads.
 	 * This applies completion-specific optimizations including threading, batch sizes, and continuous batching.
@@ -114,6 +163,29 @@ public class LlamaModel implements AutoCloseable {
 		return output.text;
 	}
 
+	/**
+	 * Generate {@link InferenceParameters#setNCandidates(int) n} candidate answers for one prompt, e.g. for ranking.
+	 * The prompt is decoded once, every candidate continues from a copy of its KV cache with its own sampler, and
+	 * all candidates are decoded together in the same batches.
+	 *
+	 * @return the candidates in order of their sampler seeds
+	 */
+	public List<String> completeCandidates(InferenceParameters parameters) {
+		parameters.setStream(false);
+		int[] taskIds = requestCompletions(parameters.toString());
+		List<String> candidates = new ArrayList<>(taskIds.length);
+		try {
+			for (int taskId : taskIds) {
+				candidates.add(receiveCompletion(taskId).text);
+			}
+		} finally {
+			for (int taskId : taskIds) {
+				releaseTask(taskId);
+			}
+		}
+		return candidates;
+	}
+
 	/**
 	 * Generate and stream outputs with custom inference parameters. Note, that the prompt isn't preprocessed in any
 	 * way, nothing like "User: ", "###Instruction", etc. is added.
@@ -124,6 +196,86 @@ public class LlamaModel implements AutoCloseable {
 		return () -> new LlamaIterator(this, parameters);
 	}
 
+	/**
+	 * Generate with custom inference parameters and push every output to a callback instead of returning an
+	 * iterator. Generation runs on native threads and the outputs are delivered by a native thread attached to
+	 * the JVM, so no Java thread waits for tokens and this method returns right away. Callbacks of all
+	 * callback-driven completions of this model run on that one thread and should not block.
+	 *
+	 * @return the id of the completion, see {@link #cancel(int)}
+	 */
+	public int generate(InferenceParameters parameters, CompletionCallback callback) {
+		parameters.setStream(true);
+		return requestCompletionCallback(parameters.toString(), callback);
+	}
+
+	/**
+	 * Stop a completion started with {@link #generate(InferenceParameters, CompletionCallback)}, its callback
+	 * still receives {@link CompletionCallback#onComplete()}. Decoding of its prompt is interrupted if in
+	 * progress.
+	 */
+	public void cancel(int taskId) {
+		cancelCompletion(taskId);
+	}
+
+	/**
+	 * Generate and return a whole answer for a binary encoded request, which skips JSON serialization and, for
+	 * pre-tokenized prompts, tokenization.
+	 *
+	 * @return an LLM response
+	 */
+	public String complete(CompletionRequest request) {
+		request.setStream(false);
+		ByteBuffer buffer = request.encode();
+		int taskId = requestCompletionBinary(buffer, buffer.limit());
+		LlamaOutput output = receiveCompletion(taskId);
+		return output.text;
+	}
+
+	/**
+	 * Generate and stream outputs for a binary encoded request, see {@link #complete(CompletionRequest)}.
+	 *
+	 * @return iterable LLM outputs
+	 */
+	public LlamaIterable generate(CompletionRequest request) {
+		return () -> new LlamaIterator(this, request);
+	}
+
+	/**
+	 * Start a chat conversation. The conversation keeps its rendered chat template and tokens between turns, so
+	 * every turn only renders and tokenizes the newly appended messages, and its prompt shares the previous turn's
+	 * tokens exactly, letting the server reuse their KV cache.
+	 *
+	 * @return a new, empty conversation that must be closed when no longer needed
+	 */
+	public ChatConversation createConversation() {
+		return new ChatConversation(this, createConversationNative());
+	}
+
+	/**
+	 * Generate and return the assistant's reply to a conversation. The prompt of the parameters is ignored, the
+	 * conversation's messages are rendered with the model's chat template instead. The reply is not appended to the
+	 * conversation.
+	 *
+	 * @return an LLM response
+	 */
+	public String complete(ChatConversation conversation, InferenceParameters parameters) {
+		parameters.setStream(false);
+		int taskId = requestConversationCompletion(conversation.handle(), parameters.toString());
+		LlamaOutput output = receiveCompletion(taskId);
+		return output.text;
+	}
+
+	/**
+	 * Generate and stream the assistant's reply to a conversation, see {@link #complete(ChatConversation,
+	 * InferenceParameters)}.
+	 *
+	 * @return iterable LLM outputs
+	 */
+	public LlamaIterable generate(ChatConversation conversation, InferenceParameters parameters) {
+		return () -> new LlamaIterator(this, conversation, parameters);
+	}
+
 
 
 	/**
@@ -136,6 +288,120 @@ public class LlamaModel implements AutoCloseable {
 	 */
 	public  native float[] embed(String prompt);
 
+	/**
+	 * Get the embeddings of several strings at once. The inputs are packed into as few decode calls as the context
+	 * allows, using one sequence per input (see {@link ModelParameters#setParallel(int)}).
+	 *
+	 * @param texts the strings to embed
+	 * @return a flat array of {@code texts.length * n_embd} floats, the embedding of {@code texts[i]} starts at
+	 * {@code i * n_embd}
+	 * @throws IllegalStateException if embedding mode was not activated (see {@link ModelParameters#enableEmbedding()})
+	 */
+	public float[] embedBatch(String... texts) {
+		if (texts == null) {
+			throw new IllegalArgumentException("Texts must not be null");
+		}
+		if (texts.length == 0) {
+			return new float[0];
+		}
+		return embedBatchNative(texts);
+	}
+
+	/**
+	 * Embed several strings like {@link #embedBatch(String...)}, but truncated, normalized and quantized natively as
+	 * {@code format} describes. Only the encoded rows are copied to Java, an int8 row of 256 dimensions is 16 times
+	 * smaller than the float embedding of a 4096-dimensional model.
+	 *
+	 * @param format the truncation, normalization and encoding of the embeddings
+	 * @param texts the strings to embed
+	 * @return the encoded embeddings, row {@code i} belongs to {@code texts[i]}
+	 * @throws IllegalStateException if embedding mode was not activated (see {@link ModelParameters#enableEmbedding()})
+	 */
+	public CompactEmbeddings embedCompact(EmbeddingFormat format, String... texts) {
+		if (format == null || texts == null) {
+			throw new IllegalArgumentException("Format and texts must not be null");
+		}
+		int dimensions = format.getDimensions() == 0 ? (int) getModelEmbeddingDimension() : format.getDimensions();
+		float[] scales = new float[texts.length];
+		byte[] data = texts.length == 0 ? new byte[0] : embedCompactNative(texts, format.getDimensions(),
+			format.isNormalized(), format.getEncoding().ordinal(), scales);
+		return new CompactEmbeddings(format.getEncoding(), dimensions, data, scales);
+	}
+
+	/**
+	 * Embed several strings like {@link #embedBatch(String...)} and add the embeddings with their texts to an index,
+	 * without copying them into Java.
+	 *
+	 * @param index an index with the embedding size of this model as its dimension
+	 * @param texts the strings to embed
+	 * @return the entry of the first text, the others follow it
+	 * @throws IllegalStateException if embedding mode was not activated (see {@link ModelParameters#enableEmbedding()})
+	 */
+	public int embedBatch(VectorIndex index, String... texts) {
+		if (index == null || texts == null) {
+			throw new IllegalArgumentException("Index and texts must not be null");
+		}
+		if (texts.length == 0) {
+			return (int) index.size();
+		}
+		return embedIntoIndexNative(index.handle(), texts);
+	}
+
+	/**
+	 * Embed a query and search an index with it in one native call.
+	 *
+	 * @param index an index filled with embeddings of this model
+	 * @param query the text to search for
+	 * @param k the maximum number of entries to return
+	 * @return the most similar entries and their similarities, best first
+	 * @throws IllegalStateException if embedding mode was not activated (see {@link ModelParameters#enableEmbedding()})
+	 */
+	public RerankResult search(VectorIndex index, String query, int k) {
+		if (index == null || query == null) {
+			throw new IllegalArgumentException("Index and query must not be null");
+		}
+		return searchIndexNative(index.handle(), query, k, Math.max(k, VectorIndex.DEFAULT_EF_SEARCH));
+	}
+
+	/**
+	 * Retrieve and rerank in one native call: embed the query, take the {@code candidates} nearest entries of the
+	 * index and rerank their texts with {@code reranker}. Neither embeddings nor texts pass through Java.
+	 *
+	 * @param index an index filled with embeddings and texts of this model
+	 * @param query the text to search for
+	 * @param candidates the number of entries retrieved for reranking
+	 * @param reranker a model loaded with {@link ModelParameters#enableReranking()}, may be this model
+	 * @param k the maximum number of entries to return
+	 * @return the best entries by rerank score, best first
+	 */
+	public RerankResult searchAndRerank(VectorIndex index, String query, int candidates, LlamaModel reranker, int k) {
+		if (index == null || query == null || reranker == null) {
+			throw new IllegalArgumentException("Index, query and reranker must not be null");
+		}
+		if (candidates < 0 || k < 0) {
+			throw new IllegalArgumentException("candidates and k must be non-negative");
+		}
+		return searchAndRerankNative(index.handle(), query, candidates,
+			Math.max(candidates, VectorIndex.DEFAULT_EF_SEARCH), reranker, k);
+	}
+
+	/**
+	 * Get the embedding of a string without allocating a Java array. The embedding is copied from the native
+	 * context straight into {@code out}, starting at its current position, and the position is advanced past it.
+	 *
+	 * @param prompt the string to embed
+	 * @param out a direct, writable buffer in native byte order with at least n_embd floats remaining
+	 * @return the number of floats written (n_embd)
+	 * @throws IllegalArgumentException if the buffer is not direct, read-only, in the wrong byte order or too small
+	 * @throws IllegalStateException if embedding mode was not activated (see {@link ModelParameters#enableEmbedding()})
+	 */
+	public int embed(String prompt, FloatBuffer out) {
+		checkOutputBuffer(out);
+		int written = embedIntoNative(prompt, out, out.position());
+		out.position(out.position() + written);
+		return written;
+	}
+
 
 	/**
 	 * Tokenize a prompt given the native tokenizer
@@ -145,6 +411,25 @@ public class LlamaModel implements AutoCloseable {
 	 */
 	public native int[] encode(String prompt);
 
+	/**
+	 * Tokenize many prompts with one native call. The prompts are split across a native worker pool, which makes
+	 * this much faster than calling {@link #encode(String)} in a loop, e.g. to preprocess a dataset.
+	 *
+	 * @param prompts the prompts to tokenize
+	 * @return the tokens of all prompts in one flat array, with the offsets of every prompt
+	 */
+	public TokenBatch encodeBatch(String... prompts) {
+		if (prompts == null) {
+			throw new IllegalArgumentException("Prompts must not be null");
+		}
+		for (String prompt : prompts) {
+			if (prompt == null) {
+				throw new IllegalArgumentException("Prompts must not contain null");
+			}
+		}
+		return encodeBatchNative(prompts);
+	}
+
 	/**
 	 * Convert an array of token ids to its string representation
 	 *
@@ -196,6 +481,58 @@ public class LlamaModel implements AutoCloseable {
 		return embeddings;
 	}
 
+	/**
+	 * Copy the logits for a specific token position into a direct buffer instead of a new array, so they can be
+	 * inspected every step without garbage. The floats are written at the buffer's position, which is advanced.
+	 *
+	 * @param i the token position index (0-based)
+	 * @param out a direct, writable buffer in native byte order with at least n_vocab floats remaining
+	 * @return the number of floats written (n_vocab)
+	 * @throws IllegalArgumentException if position index or buffer is invalid
+	 * @throws IllegalStateException if no inference has been performed yet
+	 */
+	public int getLogitsIth(int i, FloatBuffer out) {
+		if (i < 0) {
+			throw new IllegalArgumentException("Position index must be non-negative");
+		}
+		checkOutputBuffer(out);
+		int written = getLogitsIthIntoNative(i, out, out.position());
+		out.position(out.position() + written);
+		return written;
+	}
+
+	/**
+	 * Copy the embeddings for a specific sequence position into a direct buffer instead of a new array.
+	 * The floats are written at the buffer's position, which is advanced.
+	 *
+	 * @param i the sequence position index (0-based)
+	 * @param out a direct, writable buffer in native byte order with at least n_embd floats remaining
+	 * @return the number of floats written (n_embd)
+	 * @throws IllegalArgumentException if position index or buffer is invalid
+	 * @throws IllegalStateException if embedding mode is not enabled or no inference performed
+	 */
+	public int getEmbeddingsIth(int i, FloatBuffer out) {
+		if (i < 0) {
+			throw new IllegalArgumentException("Position index must be non-negative");
+		}
+		checkOutputBuffer(out);
+		int written = getEmbeddingsIthIntoNative(i, out, out.position());
+		out.position(out.position() + written);
+		return written;
+	}
+
+	private static void checkOutputBuffer(FloatBuffer out) {
+		if (out == null) {
+			throw new IllegalArgumentException("Output buffer must not be null");
+		}
+		if (!out.isDirect() || out.isReadOnly()) {
+			throw new IllegalArgumentException("Output buffer must be a direct, writable FloatBuffer");
+		}
+		if (out.order() != ByteOrder.nativeOrder()) {
+			throw new IllegalArgumentException("Output buffer must use the native byte order");
+		}
+	}
+
 	/**
 	 * Get the size in bytes needed to store the complete model state.
 	 * This includes the KV cache, logits, and embeddings.
@@ -424,6 +761,202 @@ public class LlamaModel implements AutoCloseable {
 		return loadSequenceState(filePath, sequenceId, -1);
 	}
 
+	/**
+	 * Write the complete model state into a direct buffer, starting at its position, without copying it through the
+	 * Java heap. The buffer needs {@link #getModelStateSize()} bytes remaining, its position is advanced past the state.
+	 *
+	 * @param buffer direct buffer receiving the state
+	 * @return number of bytes written
+	 * @throws LlamaException if the state cannot be retrieved
+	 */
+	public int getModelState(ByteBuffer buffer) throws LlamaException {
+		return getStateInto(-1, buffer);
+	}
+
+	/**
+	 * Restore the complete model state from the remaining bytes of a direct buffer, its position is advanced past the
+	 * bytes loaded.
+	 *
+	 * @param buffer direct buffer holding the state
+	 * @return number of bytes loaded
+	 * @throws LlamaException if the state cannot be restored
+	 */
+	public int setModelState(ByteBuffer buffer) throws LlamaException {
+		return setStateFrom(-1, buffer);
+	}
+
+	/**
+	 * Write the state of a sequence into a direct buffer, see {@link #getModelState(ByteBuffer)}.
+	 *
+	 * @param sequenceId the sequence identifier
+	 * @param buffer direct buffer receiving the state
+	 * @return number of bytes written
+	 * @throws LlamaException if the sequence state cannot be retrieved
+	 */
+	public int getSequenceState(int sequenceId, ByteBuffer buffer) throws LlamaException {
+		return getStateInto(checkSequenceId(sequenceId), buffer);
+	}
+
+	/**
+	 * Restore the state of a sequence from a direct buffer, see {@link #setModelState(ByteBuffer)}.
+	 *
+	 * @param buffer direct buffer holding the state
+	 * @param sequenceId target sequence identifier
+	 * @return number of bytes loaded
+	 * @throws LlamaException if the sequence state cannot be restored
+	 */
+	public int setSequenceState(ByteBuffer buffer, int sequenceId) throws LlamaException {
+		return setStateFrom(checkSequenceId(sequenceId), buffer);
+	}
+
+	/**
+	 * Export the complete model state to a file. The state is written through a memory mapping, or streamed through
+	 * zstd when compressing, so exporting never needs a heap copy of the state.
+	 *
+	 * @param file the file to write
+	 * @param compress whether to compress the state, see {@link #isStateCompressionAvailable()}
+	 * @return number of bytes written to the file
+	 * @throws LlamaException if the state cannot be exported
+	 */
+	public long exportModelState(Path file, boolean compress) throws LlamaException {
+		return checkStateResult(exportStateFileNative(-1, file.toString(), compress), "export state to " + file);
+	}
+
+	/**
+	 * Import a model state written by {@link #exportModelState(Path, boolean)} or
+	 * {@link #exportModelState(WritableByteChannel, boolean)}.
+	 *
+	 * @param file the file to read
+	 * @return number of state bytes loaded
+	 * @throws LlamaException if the state cannot be imported
+	 */
+	public long importModelState(Path file) throws LlamaException {
+		return checkStateResult(importStateFileNative(-1, file.toString()), "import state from " + file);
+	}
+
+	/**
+	 * Export the state of a sequence to a file, see {@link #exportModelState(Path, boolean)}.
+	 *
+	 * @param file the file to write
+	 * @param sequenceId the sequence identifier
+	 * @param compress whether to compress the state
+	 * @return number of bytes written to the file
+	 * @throws LlamaException if the sequence state cannot be exported
+	 */
+	public long exportSequenceState(Path file, int sequenceId, boolean compress) throws LlamaException {
+		return checkStateResult(exportStateFileNative(checkSequenceId(sequenceId), file.toString(), compress),
+			"export sequence state to " + file);
+	}
+
+	/**
+	 * Import the state of a sequence written by {@link #exportSequenceState(Path, int, boolean)}.
+	 *
+	 * @param file the file to read
+	 * @param sequenceId target sequence identifier
+	 * @return number of state bytes loaded
+	 * @throws LlamaException if the sequence state cannot be imported
+	 */
+	public long importSequenceState(Path file, int sequenceId) throws LlamaException {
+		return checkStateResult(importStateFileNative(checkSequenceId(sequenceId), file.toString()),
+			"import sequence state from " + file);
+	}
+
+	/**
+	 * Stream the complete model state to a channel, for example a socket or a {@link java.nio.channels.FileChannel},
+	 * in chunks that are written straight from native memory.
+	 *
+	 * @param channel the channel to write to
+	 * @param compress whether to compress the state, see {@link #isStateCompressionAvailable()}
+	 * @return number of bytes written to the channel
+	 * @throws LlamaException if the state cannot be exported
+	 */
+	public long exportModelState(WritableByteChannel channel, boolean compress) throws LlamaException {
+		return checkStateResult(exportStateChannelNative(-1, channel, STATE_CHUNK_SIZE, compress), "stream state");
+	}
+
+	/**
+	 * Restore a model state streamed by {@link #exportModelState(WritableByteChannel, boolean)}.
+	 *
+	 * @param channel the channel to read from, positioned at the start of the exported state
+	 * @return number of state bytes loaded
+	 * @throws LlamaException if the state cannot be imported
+	 */
+	public long importModelState(ReadableByteChannel channel) throws LlamaException {
+		return checkStateResult(importStateChannelNative(-1, channel, STATE_CHUNK_SIZE), "read streamed state");
+	}
+
+	/**
+	 * Stream the state of a sequence to a channel, see {@link #exportModelState(WritableByteChannel, boolean)}.
+	 *
+	 * @param channel the channel to write to
+	 * @param sequenceId the sequence identifier
+	 * @param compress whether to compress the state
+	 * @return number of bytes written to the channel
+	 * @throws LlamaException if the sequence state cannot be exported
+	 */
+	public long exportSequenceState(WritableByteChannel channel, int sequenceId, boolean compress) throws LlamaException {
+		return checkStateResult(exportStateChannelNative(checkSequenceId(sequenceId), channel, STATE_CHUNK_SIZE, compress),
+			"stream sequence state");
+	}
+
+	/**
+	 * Restore the state of a sequence streamed by {@link #exportSequenceState(WritableByteChannel, int, boolean)}.
+	 *
+	 * @param channel the channel to read from
+	 * @param sequenceId target sequence identifier
+	 * @return number of state bytes loaded
+	 * @throws LlamaException if the sequence state cannot be imported
+	 */
+	public long importSequenceState(ReadableByteChannel channel, int sequenceId) throws LlamaException {
+		return checkStateResult(importStateChannelNative(checkSequenceId(sequenceId), channel, STATE_CHUNK_SIZE),
+			"read streamed sequence state");
+	}
+
+	/**
+	 * @return whether state exports can be compressed, which requires jllama to be built with zstd
+	 */
+	public static native boolean isStateCompressionAvailable();
+
+	private int getStateInto(int sequenceId, ByteBuffer buffer) throws LlamaException {
+		checkStateBuffer(buffer);
+		long written = getStateIntoNative(sequenceId, buffer, buffer.position(), buffer.remaining());
+		if (written < 0) {
+			throw new LlamaException("Failed to get state data");
+		}
+		buffer.position(buffer.position() + (int) written);
+		return (int) written;
+	}
+
+	private int setStateFrom(int sequenceId, ByteBuffer buffer) throws LlamaException {
+		checkStateBuffer(buffer);
+		long loaded = setStateFromNative(sequenceId, buffer, buffer.position(), buffer.remaining());
+		if (loaded < 0) {
+			throw new LlamaException("Failed to restore state data");
+		}
+		buffer.position(buffer.position() + (int) loaded);
+		return (int) loaded;
+	}
+
+	private static void checkStateBuffer(ByteBuffer buffer) {
+		if (buffer == null || !buffer.isDirect()) {
+			throw new IllegalArgumentException("State buffer must be a direct ByteBuffer");
+		}
+	}
+
+	private static int checkSequenceId(int sequenceId) {
+		if (sequenceId < 0) {
+			throw new IllegalArgumentException("Sequence id must not be negative");
+		}
+		return sequenceId;
+	}
+
+	private static long checkStateResult(long result, String action) throws LlamaException {
+		if (result < 0) {
+			throw new LlamaException("Failed to " + action);
+		}
+		return result;
+	}
+
 	// ===== ADVANCED SAMPLING METHODS =====
 
 	/**
@@ -764,6 +1297,9 @@ public class LlamaModel implements AutoCloseable {
 	/**
 	 * Load a LoRA adapter from file.
 	 * LoRA (Low-Rank Adaptation) allows fine-tuning models with minimal parameters.
+	 * Adapters are shared by all models loaded from the same weights, loading a file again returns the same
+	 * handle. Within the budget of {@link ModelParameters#setLoraCacheBudget(int)} unused adapters may be
+	 * evicted, they are loaded again when used.
 	 *
 	 * @param loraPath path to the LoRA adapter file
 	 * @return handle to the loaded adapter
@@ -781,7 +1317,8 @@ public class LlamaModel implements AutoCloseable {
 	}
 
 	/**
-	 * Free a LoRA adapter and release its resources.
+	 * Free a LoRA adapter and release its resources. Each load of an adapter is freed separately, an adapter
+	 * still in use by a request stays loaded until the request is done.
 	 *
 	 * @param adapterHandle handle to the adapter
 	 */
@@ -792,7 +1329,8 @@ public class LlamaModel implements AutoCloseable {
 	}
 
 	/**
-	 * Apply a LoRA adapter to the current context with the specified scale.
+	 * Apply a LoRA adapter to the current context with the specified scale. Requests that name no adapters
+	 * with {@link InferenceParameters#setLoraAdapters(Map)} and start afterwards decode with it.
 	 *
 	 * @param adapterHandle handle to the adapter
 	 * @param scale scale factor for the adapter (typically 1.0)
@@ -1072,10 +1610,12 @@ public class LlamaModel implements AutoCloseable {
 	}
 
 	/**
-	 * Clear the KV cache memory with options for data clearing.
+	 * Clear the KV cache memory with options for data clearing. Prompt prefixes kept for reuse by
+	 * later completions are dropped as well.
 	 *
 	 * @param clearData if true, clear the actual data; if false, only clear metadata
 	 * @throws LlamaException if the operation fails
+	 * @throws IllegalStateException while completions are running
 	 */
 	public void clearMemory(boolean clearData) throws LlamaException {
 		clearMemoryNative(clearData);
@@ -1288,6 +1828,29 @@ public class LlamaModel implements AutoCloseable {
 		return getTokenAttributesNative(tokenId);
 	}
 
+	/**
+	 * Get the bytes, scores and attributes of every token at once. The first call exports the whole vocabulary
+	 * in a single native call, later calls return the same snapshot. Prefer this over {@link #getTokenText(int)}
+	 * and friends when building per-vocabulary structures such as token tries, which otherwise take one JNI call
+	 * per token.
+	 *
+	 * @return the vocabulary of this model
+	 * @throws LlamaException if the operation fails
+	 */
+	public Vocabulary exportVocabulary() throws LlamaException {
+		Vocabulary result = vocabulary;
+		if (result == null) {
+			synchronized (this) {
+				result = vocabulary;
+				if (result == null) {
+					result = exportVocabularyNative();
+					vocabulary = result;
+				}
+			}
+		}
+		return result;
+	}
+
 	// ===== SPECIAL TOKENS =====
 
 	/**
@@ -1400,17 +1963,45 @@ public class LlamaModel implements AutoCloseable {
 		delete();
 	}
 
+	/**
+	 * @return the number of distinct models whose weights are resident in this process, see
+	 * {@link #LlamaModel(ModelParameters)}
+	 */
+	public static native int getResidentModelCount();
+
 	// don't overload native methods since the C++ function names get nasty
 	native int requestCompletion(String params) throws LlamaException;
 
+	native int requestCompletionBinary(ByteBuffer request, int length) throws LlamaException;
+
+	native int requestCompletionCallback(String params, CompletionCallback callback) throws LlamaException;
+
+	native int[] requestCompletions(String params) throws LlamaException;
+
+	native int requestConversationCompletion(long conversation, String params) throws LlamaException;
+
 	native LlamaOutput receiveCompletion(int taskId) throws LlamaException;
 
+	native LlamaChunk receiveCompletionChunk(int taskId, int maxTokens, long timeoutMs) throws LlamaException;
+
 	native void cancelCompletion(int taskId);
 
 	native byte[] decodeBytes(int[] tokens);
 
 	private native void loadModel(String... parameters) throws LlamaException;
 
+	private static native long loadModelFromSplits(String[] paths, String[] parameters);
+
+	private static native long startModelLoad(String[] paths, String[] parameters);
+
+	static native float getModelLoadProgress(long job);
+
+	static native boolean awaitModelLoad(long job, long timeoutMs);
+
+	static native void cancelModelLoad(long job);
+
+	static native long finishModelLoad(long job);
+
 	private native void delete();
 
 	native void releaseTask(int taskId);
@@ -1431,6 +2022,14 @@ public class LlamaModel implements AutoCloseable {
 	private native long saveSequenceToFile(String path, int sequenceId, int[] tokens);
 	private native int[] loadSequenceFromFile(String path, int sequenceId, int maxTokens);
 
+	// Streaming state export and import, a sequence id of -1 stands for the whole context
+	private native long getStateIntoNative(int sequenceId, ByteBuffer buffer, int offset, int length);
+	private native long setStateFromNative(int sequenceId, ByteBuffer buffer, int offset, int length);
+	private native long exportStateFileNative(int sequenceId, String path, boolean compress);
+	private native long importStateFileNative(int sequenceId, String path);
+	private native long exportStateChannelNative(int sequenceId, WritableByteChannel channel, int chunkSize, boolean compress);
+	private native long importStateChannelNative(int sequenceId, ReadableByteChannel channel, int chunkSize);
+
 	// LoRA adapter native methods
 	private native long loadLoRAAdapterNative(String loraPath);
 	private native void freeLoRAAdapterNative(long adapterHandle);
@@ -1556,6 +2155,7 @@ public class LlamaModel implements AutoCloseable {
 	private native String getTokenTextNative(int tokenId);
 	private native float getTokenScoreNative(int tokenId);
 	private native int getTokenAttributesNative(int tokenId);
+	private native Vocabulary exportVocabularyNative();
 	private native int getBosTokenNative();
 	private native int getEosTokenNative();
 	private native int getEotTokenNative();
@@ -1592,11 +2192,90 @@ public class LlamaModel implements AutoCloseable {
 
 	public native LlamaOutput rerank(String query, String... documents);
 
+	/**
+	 * Rerank documents against a query and return only the {@code k} best, as indices into {@code documents}.
+	 * Unlike {@link #rerank(String, String...)} no strings are copied back and duplicate documents keep
+	 * their own score.
+	 *
+	 * @param query the query to rank the documents against
+	 * @param k the maximum number of documents to return
+	 * @param documents the candidate documents
+	 * @return the indices and scores of the best documents, best first
+	 * @throws IllegalStateException if reranking mode was not activated (see {@link ModelParameters#enableReranking()})
+	 */
+	public RerankResult rerankTopK(String query, int k, String... documents) {
+		if (query == null || documents == null) {
+			throw new IllegalArgumentException("Query and documents must not be null");
+		}
+		if (k < 0) {
+			throw new IllegalArgumentException("k must be non-negative");
+		}
+		return rerankTopKNative(query, documents, k);
+	}
+
+	/**
+	 * Score a tokenized corpus, for example to check that a quantization did not regress. The corpus is split into
+	 * windows of {@code windowSize} tokens and {@code parallel} windows are decoded at once as separate sequences,
+	 * on a context of their own. The second half of every window is scored with the first half as its context, like
+	 * the perplexity tool of llama.cpp.
+	 * <p>
+	 * To compare against a reference model, evaluate the reference first with {@code savePath}, which writes the
+	 * log-probabilities of every scored token, then this model with the file as {@code referencePath}. Both runs
+	 * must use the same corpus and window size.
+	 *
+	 * @param tokens the corpus, see {@link #encode(String)}
+	 * @param windowSize the tokens of every window
+	 * @param parallel the windows decoded at once
+	 * @param savePath where to save the log-probabilities of this model, or null
+	 * @param referencePath log-probabilities of a reference model to measure the KL divergence against, or null
+	 * @return the perplexity, the loss of every window and the divergence from the reference
+	 */
+	public PerplexityResult evaluatePerplexity(int[] tokens, int windowSize, int parallel, String savePath,
+			String referencePath) {
+		if (tokens == null) {
+			throw new IllegalArgumentException("Tokens must not be null");
+		}
+		return evaluatePerplexityNative(tokens, windowSize, parallel, savePath, referencePath);
+	}
+
+	/**
+	 * Score a tokenized corpus, see {@link #evaluatePerplexity(int[], int, int, String, String)}.
+	 */
+	public PerplexityResult evaluatePerplexity(int[] tokens, int windowSize, int parallel) {
+		return evaluatePerplexity(tokens, windowSize, parallel, null, null);
+	}
+
+	/**
+	 * Tokenize a training dataset once into a binary token shard, with every non-empty line of the text file as a
+	 * sample. Training accepts the shard wherever it accepts the text file and memory-maps it instead of tokenizing
+	 * the text on every run. The shard only fits models sharing the vocabulary of this one.
+	 *
+	 * @param textPath the dataset, one sample per line
+	 * @param shardPath where to write the shard
+	 * @return the number of samples written
+	 */
+	public long writeTokenShard(String textPath, String shardPath) {
+		if (textPath == null || shardPath == null) {
+			throw new IllegalArgumentException("Dataset and shard paths must not be null");
+		}
+		return writeTokenShardNative(textPath, shardPath);
+	}
+
 	public  String applyTemplate(InferenceParameters parameters) {
 		return applyTemplate(parameters.toString());
 	}
 	public native String applyTemplate(String parametersJson);
 
+	native long createConversationNative();
+
+	native void appendConversationMessageNative(long conversation, String role, String content);
+
+	native String renderConversationNative(long conversation);
+
+	native int[] getConversationTokensNative(long conversation);
+
+	native void freeConversationNative(long conversation);
+
 	/**
 	 * Set a callback to allow interruption of long-running operations.
 	 * Pass null to clear the callback.
@@ -1748,13 +2427,35 @@ public class LlamaModel implements AutoCloseable {
 	}
 
 	/**
-	 * Reset all performance counters to zero.
+	 * Reset all performance counters and {@link #getLatencyStats() latency histograms} to zero.
 	 * Call this to start fresh performance measurements.
 	 */
 	public void resetPerformanceData() {
 		resetPerformanceDataNative();
 	}
 
+	/**
+	 * Get the latency breakdown of completion requests as a JSON string. Every entry holds the count, mean, p50,
+	 * p95, p99 and maximum in microseconds:
+	 * <ul>
+	 *     <li>{@code queue_wait}: submission until the request got a sequence</li>
+	 *     <li>{@code tokenize}: tokenizing the prompt</li>
+	 *     <li>{@code prefill}: decoding the prompt</li>
+	 *     <li>{@code first_token}: submission until the first generated token</li>
+	 *     <li>{@code decode}: one decode call of the scheduler, shared by all requests in the batch</li>
+	 *     <li>{@code token_interval}: between consecutive tokens of a request</li>
+	 *     <li>{@code sampling}: sampling the tokens of a request in one step</li>
+	 *     <li>{@code marshal}: turning results into Java objects</li>
+	 * </ul>
+	 * A slow stream with long decodes is compute bound, long intervals between short decodes point at the
+	 * scheduler or a slow reader, and a large marshal time at the JNI boundary.
+	 *
+	 * @return JSON string with one histogram summary per stage
+	 */
+	public String getLatencyStats() {
+		return getLatencyStatsNative();
+	}
+
 	/**
 	 * Get the number of layers in this model.
 	 * Useful for understanding model architecture and complexity.
@@ -1845,6 +2546,57 @@ public class LlamaModel implements AutoCloseable {
 		return getModelKeyValueHeadsNative();
 	}
 
+	/**
+	 * Get the memory plan the context was created with as a JSON string: context size, KV cache types and the
+	 * bytes of weights, KV cache and (estimated) compute buffers. See {@link ModelParameters#setMemoryBudget(int)}.
+	 *
+	 * @return JSON string describing the memory plan
+	 */
+	public String getMemoryPlan() {
+		return getMemoryPlanNative();
+	}
+
+	/**
+	 * Get where the model was placed as a JSON string: the split mode, the device of the output layer and, for
+	 * every device, its name, type, number of layers, the bytes the load allocated on it and its free and total
+	 * memory. See {@link ModelParameters#setDevices(String)} and {@link ModelParameters#setRpcServers(String)}.
+	 *
+	 * @return JSON string describing the device placement
+	 */
+	public String getDevicePlacement() {
+		return getDevicePlacementNative();
+	}
+
+	/**
+	 * Measure the generation threads, batch threads, batch size and micro batch size that are fastest for this
+	 * model on this host, with a default workload of 256 prompt tokens and 32 generated tokens. See
+	 * {@link #tune(int, int, int, int, String)}.
+	 *
+	 * @return JSON string with the best settings, their throughput and every measurement
+	 */
+	public String tune() {
+		return tune(256, 32, 0, 2, null);
+	}
+
+	/**
+	 * Measure the generation threads, batch threads, batch size and micro batch size that are fastest for this
+	 * model on this host. The settings are swept one after another on scratch contexts, so the context of this model
+	 * is left alone, but tuning competes with running requests for the CPU.
+	 * <p>
+	 * With a profile path, a profile stored there for the same model and host is returned without measuring, and
+	 * a new one is written otherwise. Load the model with {@link ModelParameters#setTuningProfile(String)} to use it.
+	 *
+	 * @param promptTokens prompt tokens decoded to measure prompt processing
+	 * @param generateTokens tokens generated one by one to measure generation
+	 * @param maxThreads largest thread count tried, 0 for all hardware threads
+	 * @param repetitions runs per setting, the fastest counts
+	 * @param profilePath file caching the profile, or null
+	 * @return JSON string with the best settings, their throughput and every measurement
+	 */
+	public String tune(int promptTokens, int generateTokens, int maxThreads, int repetitions, String profilePath) {
+		return tuneNative(promptTokens, generateTokens, maxThreads, repetitions, profilePath);
+	}
+
 	/**
 	 * Check if this model uses a recurrent architecture (e.g., Mamba, RWKV).
 	 * Recurrent models process sequences differently than transformer models.
@@ -2016,6 +2768,7 @@ public class LlamaModel implements AutoCloseable {
 	private native String getPerformanceDataNative();
 	private native void printPerformanceDataNative();
 	private native void resetPerformanceDataNative();
+	private native String getLatencyStatsNative();
 	private native long getModelLayerCountNative();
 	private native long getModelTrainingContextSizeNative();
 	private native boolean hasEncoderNative();
@@ -2027,6 +2780,9 @@ public class LlamaModel implements AutoCloseable {
 	private native long getModelEmbeddingDimensionNative();
 	private native long getModelAttentionHeadsNative();
 	private native long getModelKeyValueHeadsNative();
+	private native String getMemoryPlanNative();
+	private native String getDevicePlacementNative();
+	private native String tuneNative(int promptTokens, int generateTokens, int maxThreads, int repetitions, String profilePath);
 	private native boolean isRecurrentModelNative();
 	private native boolean isDiffusionModelNative();
 	private native void setWarmupModeNative(boolean warmup);
@@ -2046,6 +2802,21 @@ public class LlamaModel implements AutoCloseable {
 	private native int getVocabFimMidTokenNative();
 
 	// Advanced inference functions for AI IDE integration
+	private native float[] embedBatchNative(String[] texts);
+	private native TokenBatch encodeBatchNative(String[] prompts);
+	private native RerankResult rerankTopKNative(String query, String[] documents, int k);
+	private native byte[] embedCompactNative(String[] texts, int dimensions, boolean normalize, int encoding,
+			float[] scales);
+	private native int embedIntoIndexNative(long indexHandle, String[] texts);
+	private native RerankResult searchIndexNative(long indexHandle, String query, int k, int ef);
+	private native RerankResult searchAndRerankNative(long indexHandle, String query, int candidates, int ef,
+			LlamaModel reranker, int k);
+	private native long writeTokenShardNative(String textPath, String shardPath);
+	private native PerplexityResult evaluatePerplexityNative(int[] tokens, int windowSize, int parallel, String savePath,
+			String referencePath);
+	private native int embedIntoNative(String prompt, FloatBuffer out, int offset);
+	private native int getLogitsIthIntoNative(int i, FloatBuffer out, int offset);
+	private native int getEmbeddingsIthIntoNative(int i, FloatBuffer out, int offset);
 	private native float[] getLogitsIthNative(int i);
 	private native float[] getEmbeddingsIthNative(int i);
 
@@ -2060,4 +2831,27 @@ public class LlamaModel implements AutoCloseable {
 		 */
 		boolean shouldAbort();
 	}
+
+	/**
+	 * Receives the outputs of a completion started with {@link #generate(InferenceParameters, CompletionCallback)}.
+	 * All methods are called from a native thread.
+	 */
+	public interface CompletionCallback {
+		/**
+		 * Called for every generated piece of text, in order.
+		 */
+		void onOutput(LlamaOutput output);
+
+		/**
+		 * Called once after the last output, also when the completion was cancelled.
+		 */
+		default void onComplete() {
+		}
+
+		/**
+		 * Called instead of {@link #onComplete()} if the completion failed or the model was closed.
+		 */
+		default void onError(String message) {
+		}
+	}
 }
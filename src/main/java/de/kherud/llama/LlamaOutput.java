@@ -20,12 +20,27 @@ public final class LlamaOutput {
      */
     public final Map<String, Float> probabilities;
 
+    /**
+     * The ids of the {@link InferenceParameters#setNProbs(int) n_probs} most probable tokens for every generated
+     * token of this output, best first. Entry {@code i * nProbs + j} is the {@code j}-th candidate of token
+     * {@code i}. Empty if no probabilities were requested.
+     */
+    public final int[] topTokens;
+
+    /**
+     * The probabilities of the tokens in {@link #topTokens}, computed with a softmax over the raw logits.
+     */
+    public final float[] topProbabilities;
+
     final boolean stop;
 
-    LlamaOutput(byte[] generated, Map<String, Float> probabilities, boolean stop) {
+    LlamaOutput(byte[] generated, Map<String, Float> probabilities, boolean stop, int[] topTokens,
+                float[] topProbabilities) {
         this.text = new String(generated, StandardCharsets.UTF_8);
         this.probabilities = probabilities;
         this.stop = stop;
+        this.topTokens = topTokens != null ? topTokens : new int[0];
+        this.topProbabilities = topProbabilities != null ? topProbabilities : new float[0];
     }
 
     @Override
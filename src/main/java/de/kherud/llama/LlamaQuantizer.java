@@ -1,5 +1,9 @@
 package de.kherud.llama;
 
+import java.util.Arrays;
+import java.util.LinkedHashMap;
+import java.util.Map;
+
 public class LlamaQuantizer {
 
 	static {
@@ -14,11 +18,22 @@ public class LlamaQuantizer {
 		public boolean onlyCopy = false;
 		public boolean pure = false;
 		public boolean keepSplit = false;
+		public String outputTensorType = null; // ggml type name, null for the default of the ftype
+		public String tokenEmbeddingType = null;
+		public String imatrixPath = null;
+		String[] tensorTypePatterns = new String[0];
+		String[] tensorTypeNames = new String[0];
 
 		public QuantizationParams() {
 		}
 
+		/**
+		 * Set the threads quantizing each tensor, 0 for all cores. Jobs running at once each use their own threads.
+		 */
 		public QuantizationParams setThreadCount(int nthread) {
+			if (nthread < 0) {
+				throw new IllegalArgumentException("Thread count cannot be negative");
+			}
 			this.nthread = nthread;
 			return this;
 		}
@@ -53,6 +68,57 @@ public class LlamaQuantizer {
 			return this;
 		}
 
+		/**
+		 * Quantize the output tensor to a ggml type, such as "q8_0", instead of the choice of the ftype.
+		 */
+		public QuantizationParams setOutputTensorType(String type) {
+			this.outputTensorType = type;
+			return this;
+		}
+
+		/**
+		 * Quantize the token embeddings to a ggml type, such as "q8_0", instead of the choice of the ftype.
+		 */
+		public QuantizationParams setTokenEmbeddingType(String type) {
+			this.tokenEmbeddingType = type;
+			return this;
+		}
+
+		/**
+		 * Quantize the tensors whose names match a regex to a ggml type, such as "attn_v=q6_K". Overrides apply in
+		 * the order they were added, the first matching one wins.
+		 */
+		public QuantizationParams setTensorType(String pattern, String type) {
+			if (pattern == null || pattern.isEmpty() || type == null || type.isEmpty()) {
+				throw new IllegalArgumentException("Tensor pattern and type cannot be null or empty");
+			}
+			int n = tensorTypePatterns.length;
+			tensorTypePatterns = Arrays.copyOf(tensorTypePatterns, n + 1);
+			tensorTypeNames = Arrays.copyOf(tensorTypeNames, n + 1);
+			tensorTypePatterns[n] = pattern;
+			tensorTypeNames[n] = type;
+			return this;
+		}
+
+		/**
+		 * @return the tensor type overrides by pattern, in the order they apply
+		 */
+		public Map<String, String> getTensorTypes() {
+			Map<String, String> types = new LinkedHashMap<>();
+			for (int i = 0; i < tensorTypePatterns.length; i++) {
+				types.put(tensorTypePatterns[i], tensorTypeNames[i]);
+			}
+			return types;
+		}
+
+		/**
+		 * Weight the quantization error by an importance matrix of llama-imatrix, in its GGUF or legacy format.
+		 */
+		public QuantizationParams setImatrixPath(String imatrixPath) {
+			this.imatrixPath = imatrixPath;
+			return this;
+		}
+
 		public int getThreadCount() {
 			return nthread;
 		}
@@ -179,7 +245,37 @@ public class LlamaQuantizer {
 		}
 	}
 
+	/**
+	 * Quantize a model on a background thread.
+	 *
+	 * @return the running job, to follow its tensors, cancel it or wait for it
+	 */
+	public static QuantizationJob quantizeAsync(String inputPath, String outputPath, QuantizationParams params) {
+		if (inputPath == null || inputPath.trim().isEmpty()) {
+			throw new IllegalArgumentException("Input path cannot be null or empty");
+		}
+		if (outputPath == null || outputPath.trim().isEmpty()) {
+			throw new IllegalArgumentException("Output path cannot be null or empty");
+		}
+		if (params == null) {
+			params = getDefaultParams();
+		}
+		return new QuantizationJob(startQuantizeNative(inputPath, outputPath, params));
+	}
+
 	private static native QuantizationParams getDefaultQuantizationParamsNative();
 
 	private static native int quantizeModelNative(String inputPath, String outputPath, QuantizationParams params);
+
+	private static native long startQuantizeNative(String inputPath, String outputPath, QuantizationParams params);
+
+	static native int getQuantizeTensorCountNative(long job);
+
+	static native String[] getQuantizeTensorsNative(long job, int from);
+
+	static native boolean awaitQuantizeNative(long job, long timeoutMs);
+
+	static native void cancelQuantizeNative(long job);
+
+	static native void finishQuantizeNative(long job);
 }
\ No newline at end of file
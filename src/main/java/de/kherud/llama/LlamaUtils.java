@@ -90,6 +90,41 @@ public class LlamaUtils {
 		return timeUsNative();
 	}
 
+	/**
+	 * Start recording spans of native operations: prefill and decode steps, sampling, grammar compilation,
+	 * tokenization, state I/O, embedding, reranking, quantization and Stable Diffusion steps. Spans recorded
+	 * before are discarded. Timestamps use the clock of {@link System#nanoTime()} and spans carry the native
+	 * thread id, so the trace lines up with JVM profiles such as async-profiler's.
+	 */
+	public static void startTracing() {
+		startTracingNative();
+	}
+
+	/**
+	 * Stop recording spans, the recorded ones stay available to {@link #writeTrace(String)}.
+	 */
+	public static void stopTracing() {
+		stopTracingNative();
+	}
+
+	/**
+	 * @return whether spans are being recorded
+	 */
+	public static boolean isTracing() {
+		return isTracingNative();
+	}
+
+	/**
+	 * Write the spans recorded since {@link #startTracing()} as Chrome trace JSON, viewable in chrome://tracing
+	 * or Perfetto. Every thread keeps up to 65536 spans, later ones are dropped.
+	 *
+	 * @param path file to write
+	 * @return number of spans written
+	 */
+	public static long writeTrace(String path) {
+		return writeTraceNative(path);
+	}
+
 	/**
 	 * Set a custom logging callback to receive llama.cpp log messages.
 	 * Pass null to clear the callback and revert to default stderr logging.
@@ -231,6 +266,10 @@ public class LlamaUtils {
 	private static native long maxParallelSequencesNative();
 	private static native String printSystemInfoNative();
 	private static native long timeUsNative();
+	private static native void startTracingNative();
+	private static native void stopTracingNative();
+	private static native boolean isTracingNative();
+	private static native long writeTraceNative(String path);
 	private static native void setLogCallbackNative(LogCallback callback);
 	private static native String splitPathNative(String path, int split);
 	
@@ -0,0 +1,203 @@
+package de.kherud.llama;
+
+import com.fasterxml.jackson.core.JsonProcessingException;
+import com.fasterxml.jackson.databind.JsonNode;
+import com.fasterxml.jackson.databind.ObjectMapper;
+
+import java.nio.file.Path;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.List;
+
+/**
+ * The header of a GGUF model file: its metadata, tensor infos and the hyperparameters a context is sized from,
+ * read natively without mapping or loading any weights. Reading a header takes milliseconds where
+ * {@link LlamaModel} takes seconds, so schedulers like {@link ModelPool} and {@link MultiModelManager} can pick
+ * and size models before loading them.
+ */
+public final class ModelHeader {
+
+	static {
+		LlamaLoader.initialize();
+	}
+
+	private static final ObjectMapper MAPPER = new ObjectMapper();
+
+	public record Tensor(String name, String type, long[] shape, long bytes, long offset) {
+	}
+
+	private final Path path;
+	private final JsonNode root;
+	private final List<Tensor> tensors;
+
+	private ModelHeader(Path path, JsonNode root) {
+		this.path = path;
+		this.root = root;
+		List<Tensor> list = new ArrayList<>();
+		for (JsonNode tensor : root.path("tensors")) {
+			JsonNode dims = tensor.path("shape");
+			long[] shape = new long[dims.size()];
+			for (int i = 0; i < shape.length; i++) {
+				shape[i] = dims.get(i).asLong();
+			}
+			list.add(new Tensor(tensor.path("name").asText(), tensor.path("type").asText(), shape,
+				tensor.path("bytes").asLong(), tensor.path("offset").asLong()));
+		}
+		this.tensors = Collections.unmodifiableList(list);
+	}
+
+	/**
+	 * Read the header of a model file, with its tensor infos.
+	 *
+	 * @throws IllegalArgumentException if the file is not a readable GGUF file
+	 */
+	public static ModelHeader read(Path path) {
+		return read(path, true);
+	}
+
+	/**
+	 * @param includeTensors whether to keep the infos of every tensor, see {@link #getTensors()}
+	 * @throws IllegalArgumentException if the file is not a readable GGUF file
+	 */
+	public static ModelHeader read(Path path, boolean includeTensors) {
+		return new ModelHeader(path, parse(readNative(path.toString(), includeTensors)));
+	}
+
+	/**
+	 * Estimate the memory a context of this model takes: weights, KV cache and compute buffers, as the JSON of
+	 * {@link LlamaModel#getMemoryPlan()}.
+	 *
+	 * @param contextSize number of KV cache cells over all sequences
+	 * @param cacheTypeK K cache type, e.g. "f16" or "q8_0"
+	 * @param cacheTypeV V cache type, quantized types need flash attention
+	 */
+	public String estimateMemory(int contextSize, String cacheTypeK, String cacheTypeV) {
+		return estimateMemory(contextSize, cacheTypeK, cacheTypeV, false);
+	}
+
+	/**
+	 * @param flashAttention whether the context uses flash attention, which does not materialize attention scores
+	 * @see #estimateMemory(int, String, String)
+	 */
+	public String estimateMemory(int contextSize, String cacheTypeK, String cacheTypeV, boolean flashAttention) {
+		if (contextSize <= 0) {
+			throw new IllegalArgumentException("Context size must be positive");
+		}
+		return estimateMemoryNative(path.toString(), contextSize, cacheTypeK, cacheTypeV, flashAttention);
+	}
+
+	/**
+	 * @return the total bytes of an estimate of {@link #estimateMemory(int, String, String)}
+	 */
+	public long estimateMemoryBytes(int contextSize, String cacheTypeK, String cacheTypeV) {
+		return parse(estimateMemory(contextSize, cacheTypeK, cacheTypeV)).path("total_bytes").asLong();
+	}
+
+	public Path getPath() {
+		return path;
+	}
+
+	public String getArchitecture() {
+		return root.path("architecture").asText();
+	}
+
+	public String getName() {
+		return root.path("name").asText();
+	}
+
+	/**
+	 * @return general.file_type, the llama_ftype the file was quantized to, or -1 if absent
+	 */
+	public int getFileType() {
+		return root.path("file_type").asInt(-1);
+	}
+
+	/**
+	 * @return the tensor type holding most of the weight bytes, e.g. "q4_K"
+	 */
+	public String getWeightType() {
+		return root.path("weight_type").asText();
+	}
+
+	public long getParameterCount() {
+		return root.path("parameter_count").asLong();
+	}
+
+	public long getWeightBytes() {
+		return root.path("weight_bytes").asLong();
+	}
+
+	public long getFileBytes() {
+		return root.path("file_bytes").asLong();
+	}
+
+	public int getContextLength() {
+		return root.path("context_length").asInt();
+	}
+
+	public int getLayerCount() {
+		return root.path("n_layer").asInt();
+	}
+
+	public int getEmbeddingDimension() {
+		return root.path("n_embd").asInt();
+	}
+
+	public int getAttentionHeads() {
+		return root.path("n_head").asInt();
+	}
+
+	public int getVocabularySize() {
+		return root.path("n_vocab").asInt();
+	}
+
+	/**
+	 * @return whether the model keeps a fixed size recurrent state instead of a KV cache
+	 */
+	public boolean isRecurrent() {
+		return root.path("recurrent").asBoolean();
+	}
+
+	/**
+	 * @return every key-value pair of the header, arrays longer than 64 elements as an object with their
+	 * element type and length
+	 */
+	public JsonNode getMetadata() {
+		return root.path("metadata");
+	}
+
+	/**
+	 * @return a metadata value as text, or null if the key is absent
+	 */
+	public String getMetadataValue(String key) {
+		JsonNode value = root.path("metadata").get(key);
+		return value == null ? null : value.isTextual() ? value.asText() : value.toString();
+	}
+
+	/**
+	 * @return the infos of every tensor, empty if read without them
+	 */
+	public List<Tensor> getTensors() {
+		return tensors;
+	}
+
+	/**
+	 * @return the header as JSON
+	 */
+	@Override
+	public String toString() {
+		return root.toString();
+	}
+
+	private static JsonNode parse(String json) {
+		try {
+			return MAPPER.readTree(json);
+		} catch (JsonProcessingException e) {
+			throw new LlamaException("Malformed model header: " + e.getMessage());
+		}
+	}
+
+	private static native String readNative(String path, boolean includeTensors);
+	private static native String estimateMemoryNative(String path, int contextSize, String cacheTypeK,
+		String cacheTypeV, boolean flashAttention);
+}
@@ -0,0 +1,107 @@
+package de.kherud.llama;
+
+import java.util.concurrent.TimeUnit;
+import java.util.function.DoubleConsumer;
+
+/**
+ * A model load running in the background, see {@link LlamaModel#loadAsync(ModelParameters, String...)}. The caller
+ * stays responsive while the weights are read, for example to answer health checks, and can watch the progress or
+ * cancel the load.
+ * <p>
+ * {@link #get()} must be called once to obtain the model, or {@link #close()} to abandon the load.
+ */
+public final class ModelLoad implements AutoCloseable {
+
+    private static final long PROGRESS_INTERVAL_MS = 100;
+
+    private long job;
+
+    ModelLoad(long job) {
+        this.job = job;
+    }
+
+    /**
+     * @return the fraction of the weights loaded so far, from 0 to 1
+     */
+    public float getProgress() {
+        return job == 0 ? 1.0f : LlamaModel.getModelLoadProgress(job);
+    }
+
+    /**
+     * @return whether the load finished, failed or was cancelled
+     */
+    public boolean isDone() {
+        return job == 0 || LlamaModel.awaitModelLoad(job, 0);
+    }
+
+    /**
+     * Wait for the load to end.
+     *
+     * @return whether the load ended within the timeout
+     */
+    public boolean await(long timeout, TimeUnit unit) {
+        return job == 0 || LlamaModel.awaitModelLoad(job, unit.toMillis(timeout));
+    }
+
+    /**
+     * Abort the load, {@link #get()} then throws a {@link RuntimeException}.
+     */
+    public void cancel() {
+        if (job != 0) {
+            LlamaModel.cancelModelLoad(job);
+        }
+    }
+
+    /**
+     * Wait for the load and return the model.
+     *
+     * @return the loaded model
+     * @throws RuntimeException if loading failed or was cancelled
+     * @throws IllegalArgumentException if the model does not fit into the memory budget
+     */
+    public LlamaModel get() {
+        if (job == 0) {
+            throw new IllegalStateException("Model load was already finished");
+        }
+        // The native job is freed even if the load failed
+        long finished = job;
+        job = 0;
+        return LlamaModel.fromHandle(LlamaModel.finishModelLoad(finished));
+    }
+
+    /**
+     * Wait for the load and return the model, reporting the progress on the calling thread whenever it changed.
+     *
+     * @param onProgress receives the fraction of the weights loaded so far
+     * @return the loaded model
+     * @throws RuntimeException if loading failed or was cancelled
+     */
+    public LlamaModel get(DoubleConsumer onProgress) {
+        float reported = -1.0f;
+        while (!await(PROGRESS_INTERVAL_MS, TimeUnit.MILLISECONDS)) {
+            float progress = getProgress();
+            if (progress != reported) {
+                onProgress.accept(progress);
+                reported = progress;
+            }
+        }
+        onProgress.accept(1.0);
+        return get();
+    }
+
+    /**
+     * Cancel the load if it is still running and free a model it produced.
+     */
+    @Override
+    public void close() {
+        if (job == 0) {
+            return;
+        }
+        cancel();
+        try {
+            get().close();
+        } catch (RuntimeException ignored) {
+            // The load failed or was cancelled, nothing to free
+        }
+    }
+}
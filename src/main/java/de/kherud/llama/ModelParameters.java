@@ -66,7 +66,7 @@ public final class ModelParameters extends CliParameters {
 	}
 
 	/**
-	 * Set the polling level to wait for work (0 - no polling, default: 0).
+	 * Set the polling level to wait for work (0 - no polling, default: 50).
 	 */
 	public ModelParameters setPoll(int poll) {
 		parameters.put("--poll", String.valueOf(poll));
@@ -149,7 +149,76 @@ public final class ModelParameters extends CliParameters {
 	}
 
 	/**
-	 * Set the number of tokens to keep from the initial prompt (default: -1 = all).
+	 * Set the most tokens a scheduler step decodes for all sequences together (default: the batch size).
+	 * Generating sequences are served first, prompts share the rest, so a smaller budget bounds the time
+	 * between tokens of running streams while long prompts are prefilled.
+	 */
+	public ModelParameters setStepTokens(int stepTokens) {
+		parameters.put("--step-tokens", String.valueOf(stepTokens));
+		return this;
+	}
+
+	/**
+	 * Set the most prompt tokens a single request prefills per scheduler step (default: the physical
+	 * batch size).
+	 */
+	public ModelParameters setPrefillChunk(int prefillChunk) {
+		parameters.put("--prefill-chunk", String.valueOf(prefillChunk));
+		return this;
+	}
+
+	/**
+	 * Set the most requests that wait for a free sequence (default: 0, no limit). Beyond that a request
+	 * displaces the newest waiting one of a lower {@link de.kherud.llama.args.Priority} or is rejected.
+	 */
+	public ModelParameters setMaxQueued(int maxQueued) {
+		parameters.put("--max-queued", String.valueOf(maxQueued));
+		return this;
+	}
+
+	/**
+	 * Set the host memory in MiB for the KV state of preempted requests (default: 0, no preemption). With a
+	 * budget, a request waiting for a sequence swaps out a running request of a lower
+	 * {@link de.kherud.llama.args.Priority}, which continues where it stopped once a sequence is free.
+	 */
+	public ModelParameters setKvSwapBudget(int mib) {
+		parameters.put("--kv-swap-budget", String.valueOf(mib));
+		return this;
+	}
+
+	/**
+	 * Set the most scheduler steps the requests of one LoRA adapter set are decoded in a row while requests of
+	 * other sets wait (default: 16). Higher values switch adapters less often, lower values share the steps
+	 * between tenants more evenly.
+	 */
+	public ModelParameters setLoraQuantum(int steps) {
+		parameters.put("--lora-quantum", String.valueOf(steps));
+		return this;
+	}
+
+	/**
+	 * Set the memory in MiB LoRA adapters may keep resident (default: 0, no limit). The budget is shared by all
+	 * models of the process; beyond it the least recently used adapters no request or context uses are freed and
+	 * loaded again when a request names them.
+	 */
+	public ModelParameters setLoraCacheBudget(int mib) {
+		parameters.put("--lora-cache-budget", String.valueOf(mib));
+		return this;
+	}
+
+	/**
+	 * Take thread counts and batch sizes from a profile written by {@link LlamaModel#tune}. Settings given
+	 * explicitly, e.g. with {@link #setThreads(int)}, take precedence. The profile is ignored if it was made for
+	 * another model or host.
+	 */
+	public ModelParameters setTuningProfile(String path) {
+		parameters.put("--tuning-profile", path);
+		return this;
+	}
+
+	/**
+	 * Set the number of tokens to keep from the initial prompt when the context is shifted, -1 keeps the whole prompt.
+	 * At most half of a sequence's context is kept (default: 0).
 	 */
 	public ModelParameters setKeep(int keep) {
 		parameters.put("--keep", String.valueOf(keep));
@@ -157,13 +226,33 @@ public final class ModelParameters extends CliParameters {
 	}
 
 	/**
-	 * Disable context shift on infinite text generation (default: enabled).
+	 * Enable context shift on long text generation (default: disabled). When a sequence outgrows its share of the
+	 * context, the tokens kept by {@link #setKeep(int)} stay and the oldest of the rest are discarded, see
+	 * {@link #setContextShiftDiscard(float)}. Positions are shifted in place if the model's memory supports it,
+	 * otherwise the kept tokens are prefilled again. Without context shift, a generation ends once its sequence is
+	 * full.
+	 */
+	public ModelParameters enableContextShift() {
+		parameters.put("--context-shift", null);
+		return this;
+	}
+
+	/**
+	 * Disable context shift on long text generation, overrides {@link #enableContextShift()}.
 	 */
 	public ModelParameters disableContextShift() {
 		parameters.put("--no-context-shift", null);
 		return this;
 	}
 
+	/**
+	 * Set the fraction of the tokens after the kept ones that a context shift discards (default: 0.5).
+	 */
+	public ModelParameters setContextShiftDiscard(float fraction) {
+		parameters.put("--context-shift-discard", String.valueOf(fraction));
+		return this;
+	}
+
 	/**
 	 * Enable Flash Attention (default: disabled).
 	 */
@@ -212,6 +301,27 @@ public final class ModelParameters extends CliParameters {
 		return this;
 	}
 
+	/**
+	 * Decode a prompt prefix shared by the expected requests, e.g. the system prompt, while loading. The model is
+	 * ready only after the prefix is in the KV cache, so the first request neither prefills it nor pays for the first
+	 * use of the backend. Completion prompts starting with the prefix reuse it, see also
+	 * {@link #setWarmImage(String)}.
+	 */
+	public ModelParameters setWarmupPrompt(String prompt) {
+		parameters.put("--warmup-prompt", prompt);
+		return this;
+	}
+
+	/**
+	 * Keep the decoded {@link #setWarmupPrompt(String) warmup prompt} in the given file. Later loads of the same model
+	 * files with the same context settings and prompt restore the file instead of decoding the prompt, a stale file
+	 * is replaced. Together with memory mapped weights this brings a fresh process to its first request quickly.
+	 */
+	public ModelParameters setWarmImage(String path) {
+		parameters.put("--warm-image", path);
+		return this;
+	}
+
 	/**
 	 * Use Suffix/Prefix/Middle pattern for infill (instead of Prefix/Suffix/Middle) as some models prefer this.
 	 * (default: disabled)
@@ -574,7 +684,7 @@ public final class ModelParameters extends CliParameters {
 	}
 
 	/**
-	 * Set KV cache data type for K (allowed values: F16).
+	 * Set KV cache data type for K (default: F16). Quantized types trade accuracy for a smaller cache.
 	 */
 	public ModelParameters setCacheTypeK(CacheType type) {
 		parameters.put("--cache-type-k", type.name().toLowerCase());
@@ -582,13 +692,24 @@ public final class ModelParameters extends CliParameters {
 	}
 
 	/**
-	 * Set KV cache data type for V (allowed values: F16).
+	 * Set KV cache data type for V (default: F16). Quantized types require {@link #enableFlashAttn()}.
 	 */
 	public ModelParameters setCacheTypeV(CacheType type) {
 		parameters.put("--cache-type-v", type.name().toLowerCase());
 		return this;
 	}
 
+	/**
+	 * Plan the context for a memory budget in MiB covering the model weights, the KV cache and the compute buffers.
+	 * Without {@link #setCtxSize(int)}, the largest context that fits is used, up to the training context of every
+	 * parallel sequence. Unless cache types are set, the best KV cache type that reaches the context is chosen, from
+	 * F16 down to Q4_0. Loading fails if the model does not fit, see {@link LlamaModel#getMemoryPlan()}.
+	 */
+	public ModelParameters setMemoryBudget(int mebibytes) {
+		parameters.put("--memory-budget", String.valueOf(mebibytes));
+		return this;
+	}
+
 	/**
 	 * Set KV cache defragmentation threshold (default: 0.1, &lt; 0 - disabled).
 	 */
@@ -605,6 +726,43 @@ public final class ModelParameters extends CliParameters {
 		return this;
 	}
 
+	/**
+	 * Keep up to the given MiB of sequence KV snapshots in host RAM. Sequences are snapshotted before they are reused
+	 * for an unrelated prompt, and a later prompt sharing their prefix restores the snapshot instead of prefilling it
+	 * again (default: 0, disabled).
+	 */
+	public ModelParameters setSequenceCacheRam(int mebibytes) {
+		parameters.put("--seq-cache-ram", String.valueOf(mebibytes));
+		return this;
+	}
+
+	/**
+	 * Spill sequence snapshots evicted from host RAM to files in the given directory, ideally on a fast SSD, instead
+	 * of dropping them (see {@link #setSequenceCacheRam(int)}).
+	 */
+	public ModelParameters setSequenceCacheDir(String directory) {
+		parameters.put("--seq-cache-dir", directory);
+		return this;
+	}
+
+	/**
+	 * Limit the spilled sequence snapshots to the given MiB, the least recently used are deleted first
+	 * (default: 0, no limit).
+	 */
+	public ModelParameters setSequenceCacheDisk(int mebibytes) {
+		parameters.put("--seq-cache-disk", String.valueOf(mebibytes));
+		return this;
+	}
+
+	/**
+	 * Set the number of tokens per fingerprinted block of the sequence cache, prefixes are matched in whole blocks
+	 * (default: 64).
+	 */
+	public ModelParameters setSequenceCacheBlock(int tokens) {
+		parameters.put("--seq-cache-block", String.valueOf(tokens));
+		return this;
+	}
+
 	/**
 	 * Enable continuous batching (a.k.a dynamic batching) (default: disabled).
 	 */
@@ -638,13 +796,33 @@ public final class ModelParameters extends CliParameters {
 	}
 
 	/**
-	 * Set NUMA optimization type for system.
+	 * Set NUMA optimization type for system. The strategy is process wide and takes effect for the models loaded
+	 * after it was set, it is not combined with {@link #setNumaNode(int)}.
 	 */
 	public ModelParameters setNuma(NumaStrategy numaStrategy) {
 		parameters.put("--numa", numaStrategy.name().toLowerCase());
 		return this;
 	}
 
+	/**
+	 * Place the model on a NUMA node: its generation and batch thread pools are pinned to the CPUs of the node, they
+	 * default to as many threads as the node has CPUs, and the weights are loaded from a thread on the node so that
+	 * their pages are allocated in its memory. Several models on a multi-socket host then keep to their own caches
+	 * and memory. CPU masks or ranges given explicitly take precedence over the node's CPUs.
+	 */
+	public ModelParameters setNumaNode(int node) {
+		parameters.put("--numa-node", String.valueOf(node));
+		return this;
+	}
+
+	/**
+	 * Place the model on the NUMA node with the fewest models placed so far, see {@link #setNumaNode(int)}.
+	 */
+	public ModelParameters enableNumaPlacement() {
+		parameters.put("--numa-node", "auto");
+		return this;
+	}
+
 	/**
 	 * Set comma-separated list of devices to use for offloading &lt;dev1,dev2,..&gt; (none = don't offload).
 	 */
@@ -653,6 +831,15 @@ public final class ModelParameters extends CliParameters {
 		return this;
 	}
 
+	/**
+	 * Set comma-separated list of RPC servers &lt;host:port,..&gt; to offload to. Every server becomes a device,
+	 * named like {@code RPC[host:port]} in {@link #setDevices(String)}, and takes layers like a local GPU.
+	 */
+	public ModelParameters setRpcServers(String servers) {
+		parameters.put("--rpc", servers);
+		return this;
+	}
+
 	/**
 	 * Set the number of layers to store in VRAM.
 	 */
@@ -1,5 +1,6 @@
 package de.kherud.llama;
 
+import java.nio.file.Path;
 import java.util.ArrayList;
 import java.util.Comparator;
 import java.util.HashMap;
@@ -311,6 +312,13 @@ public class MultiModelManager implements AutoCloseable {
 				throw new IllegalArgumentException("Model already registered: " + config.modelId);
 			}
 
+			// Read the header first, a file that is not a model fails before the load
+			ModelHeader header = ModelHeader.read(Path.of(config.modelPath), false);
+			config.metadata.putIfAbsent("architecture", header.getArchitecture());
+			config.metadata.putIfAbsent("context_length", header.getContextLength());
+			config.metadata.putIfAbsent("parameter_count", header.getParameterCount());
+			config.metadata.putIfAbsent("weight_type", header.getWeightType());
+
 			// Load the model
 			LlamaModel model = new LlamaModel(config.parameters.setModel(config.modelPath));
 			EnhancedModelInstance instance = new EnhancedModelInstance(config, model);
@@ -0,0 +1,56 @@
+package de.kherud.llama;
+
+/**
+ * The scores of a corpus, see {@link LlamaModel#evaluatePerplexity(int[], int, int, String, String)}. The corpus
+ * is split into windows of equal size, chunk {@code i} is the {@code i}-th window; its second half is scored.
+ */
+public final class PerplexityResult {
+
+    /**
+     * Perplexity over all scored tokens.
+     */
+    public final double perplexity;
+
+    /**
+     * The mean negative log-likelihood of the scored tokens of every window.
+     */
+    public final double[] chunkNll;
+
+    /**
+     * The mean KL divergence of every window from the reference, empty without one.
+     */
+    public final double[] chunkKl;
+
+    /**
+     * The mean KL divergence from the reference over all scored tokens, 0 without one.
+     */
+    public final double meanKl;
+
+    /**
+     * The fraction of scored tokens for which the model and the reference agree on the most likely next token,
+     * 0 without a reference.
+     */
+    public final double topTokenAgreement;
+
+    /**
+     * The number of tokens scored.
+     */
+    public final long scoredTokens;
+
+    PerplexityResult(double perplexity, double[] chunkNll, double[] chunkKl, double meanKl, double topTokenAgreement,
+            long scoredTokens) {
+        this.perplexity = perplexity;
+        this.chunkNll = chunkNll;
+        this.chunkKl = chunkKl;
+        this.meanKl = meanKl;
+        this.topTokenAgreement = topTokenAgreement;
+        this.scoredTokens = scoredTokens;
+    }
+
+    /**
+     * @return whether the KL divergence against a reference was measured
+     */
+    public boolean hasReference() {
+        return chunkKl.length > 0;
+    }
+}
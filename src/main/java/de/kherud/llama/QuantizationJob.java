@@ -0,0 +1,127 @@
+package de.kherud.llama;
+
+import java.util.concurrent.TimeUnit;
+
+/**
+ * A quantization running in the background, see {@link LlamaQuantizer#quantizeAsync(String, String,
+ * LlamaQuantizer.QuantizationParams)}. Several jobs may run at once, each with the threads of its parameters, so a
+ * pipeline can quantize many models in parallel and split the cores between them.
+ * <p>
+ * The output appears at its path only once it is complete, a failed or cancelled job leaves none behind, unless
+ * {@link LlamaQuantizer.QuantizationParams#setKeepSplit(boolean) keepSplit} writes the shards directly.
+ * {@link #get()} must be called once to end the job, or {@link #close()} to abandon it.
+ */
+public final class QuantizationJob implements AutoCloseable {
+
+	private static final long PROGRESS_INTERVAL_MS = 100;
+
+	/**
+	 * Receives every tensor of the model as quantization reaches it.
+	 */
+	@FunctionalInterface
+	public interface TensorListener {
+		/**
+		 * @param index the position of the tensor, counting from 1
+		 * @param count the tensors of the model
+		 * @param name the tensor name
+		 */
+		void onTensor(int index, int count, String name);
+	}
+
+	private long job;
+	private int reported;
+
+	QuantizationJob(long job) {
+		this.job = job;
+	}
+
+	/**
+	 * @return the fraction of the tensors quantized so far, from 0 to 1
+	 */
+	public float getProgress() {
+		if (job == 0 || isDone()) {
+			return 1.0f;
+		}
+		int count = LlamaQuantizer.getQuantizeTensorCountNative(job);
+		int reached = LlamaQuantizer.getQuantizeTensorsNative(job, 0).length;
+		return count == 0 ? 0.0f : Math.max(0, reached - 1) / (float) count;
+	}
+
+	/**
+	 * @return whether the job finished, failed or was cancelled
+	 */
+	public boolean isDone() {
+		return job == 0 || LlamaQuantizer.awaitQuantizeNative(job, 0);
+	}
+
+	/**
+	 * Wait for the job to end.
+	 *
+	 * @return whether the job ended within the timeout
+	 */
+	public boolean await(long timeout, TimeUnit unit) {
+		return job == 0 || LlamaQuantizer.awaitQuantizeNative(job, unit.toMillis(timeout));
+	}
+
+	/**
+	 * Abort the job before its next tensor, {@link #get()} then throws a {@link LlamaException}.
+	 */
+	public void cancel() {
+		if (job != 0) {
+			LlamaQuantizer.cancelQuantizeNative(job);
+		}
+	}
+
+	/**
+	 * Wait for the job to end.
+	 *
+	 * @throws LlamaException if quantization failed or was cancelled
+	 */
+	public void get() {
+		if (job == 0) {
+			throw new IllegalStateException("Quantization was already finished");
+		}
+		// The native job is freed even if quantization failed
+		long finished = job;
+		job = 0;
+		LlamaQuantizer.finishQuantizeNative(finished);
+	}
+
+	/**
+	 * Wait for the job to end, reporting each tensor on the calling thread in model order.
+	 *
+	 * @param listener receives the tensors as quantization reaches them
+	 * @throws LlamaException if quantization failed or was cancelled
+	 */
+	public void get(TensorListener listener) {
+		boolean done;
+		do {
+			done = await(PROGRESS_INTERVAL_MS, TimeUnit.MILLISECONDS);
+			report(listener);
+		} while (!done);
+		get();
+	}
+
+	private void report(TensorListener listener) {
+		int count = LlamaQuantizer.getQuantizeTensorCountNative(job);
+		for (String name : LlamaQuantizer.getQuantizeTensorsNative(job, reported)) {
+			listener.onTensor(++reported, count, name);
+		}
+	}
+
+	/**
+	 * Cancel the job if it is still running.
+	 */
+	@Override
+	public void close() {
+		if (job == 0) {
+			return;
+		}
+		cancel();
+		try {
+			get();
+		} catch (LlamaException ignored) {
+			// Cancelled or failed, nothing was written
+		}
+	}
+}
@@ -0,0 +1,31 @@
+package de.kherud.llama;
+
+/**
+ * The best documents of a reranking request, see {@link LlamaModel#rerankTopK(String, int, String...)}.
+ * Entry {@code i} is the {@code i}-th best document, documents are referenced by their index in the request.
+ * Searches of a {@link VectorIndex} return the same, with the entries of the index as indices.
+ */
+public final class RerankResult {
+
+    /**
+     * Indices of the best documents into the array passed to the request, best first.
+     */
+    public final int[] indices;
+
+    /**
+     * The score of every document in {@link #indices}, in descending order.
+     */
+    public final float[] scores;
+
+    RerankResult(int[] indices, float[] scores) {
+        this.indices = indices;
+        this.scores = scores;
+    }
+
+    /**
+     * @return the number of documents in this result
+     */
+    public int size() {
+        return indices.length;
+    }
+}
@@ -141,7 +141,51 @@ public class ThreadingManager {
 		return new ThreadConfig(generationThreads, batchThreads, numaOptimized, description);
 	}
 
+	/**
+	 * Create a ggml thread pool, to be bound to a model with {@link LlamaModel#attachThreadPool(long, long)}. Separate
+	 * pools for prompt processing and generation let both phases use differently sized and placed threads.
+	 *
+	 * @param nThreads number of threads
+	 * @param cpus CPUs the threads may run on, for example {@link #getNumaNodeCpus(int)}, null for no affinity
+	 * @param priority 0-normal, 1-medium, 2-high, 3-realtime
+	 * @param poll polling level to wait for work, from 0 (no polling) to 100
+	 * @param strictCpu pin every thread to one CPU of the mask instead of letting them share all of them
+	 * @return handle of the pool, to be freed with {@link #freeThreadPool(long)} once no model uses it
+	 */
+	public static native long createThreadPool(int nThreads, int[] cpus, int priority, int poll, boolean strictCpu);
+
+	/**
+	 * Free a thread pool created by {@link #createThreadPool(int, int[], int, int, boolean)}. Models using it must be
+	 * closed or detached first.
+	 */
+	public static native void freeThreadPool(long pool);
+
+	/**
+	 * @return the number of NUMA nodes of the host, 1 if it has no NUMA topology
+	 */
+	public static native int getNumaNodeCount();
+
+	/**
+	 * @return the CPUs of a NUMA node
+	 * @throws IllegalArgumentException if the node does not exist
+	 */
+	public static native int[] getNumaNodeCpus(int node);
+
+	/**
+	 * Get the NUMA node a model was placed on with {@link ModelParameters#setNumaNode(int)} or
+	 * {@link ModelParameters#enableNumaPlacement()}.
+	 *
+	 * @return the node, or -1 if the model was not placed
+	 */
+	public static int getNumaNode(LlamaModel model) {
+		if (model == null) {
+			throw new IllegalArgumentException("Model cannot be null");
+		}
+		return getModelNumaNode(model);
+	}
+
 	// Native method declarations
 	private static native void setModelThreading(LlamaModel model, int generationThreads, int batchThreads);
 	private static native int[] getModelThreading(LlamaModel model);
+	private static native int getModelNumaNode(LlamaModel model);
 }
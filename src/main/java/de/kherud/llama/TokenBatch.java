@@ -0,0 +1,49 @@
+package de.kherud.llama;
+
+import java.util.Arrays;
+
+/**
+ * The tokens of several texts encoded by a single native call, see {@link LlamaModel#encodeBatch(String...)}.
+ * All tokens are packed into one array, the tokens of text {@code i} are {@code tokens[offsets[i]]} (inclusive)
+ * to {@code tokens[offsets[i + 1]]} (exclusive).
+ */
+public final class TokenBatch {
+
+    /**
+     * The tokens of all texts, in input order.
+     */
+    public final int[] tokens;
+
+    /**
+     * Start of every text's tokens in {@link #tokens}, with one additional entry holding the total count.
+     */
+    public final int[] offsets;
+
+    TokenBatch(int[] tokens, int[] offsets) {
+        this.tokens = tokens;
+        this.offsets = offsets;
+    }
+
+    /**
+     * @return the number of encoded texts
+     */
+    public int size() {
+        return offsets.length - 1;
+    }
+
+    /**
+     * @param i the index of the text
+     * @return the number of tokens of text {@code i}
+     */
+    public int length(int i) {
+        return offsets[i + 1] - offsets[i];
+    }
+
+    /**
+     * @param i the index of the text
+     * @return a copy of the tokens of text {@code i}
+     */
+    public int[] get(int i) {
+        return Arrays.copyOfRange(tokens, offsets[i], offsets[i + 1]);
+    }
+}
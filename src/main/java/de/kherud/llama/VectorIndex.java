@@ -0,0 +1,155 @@
+package de.kherud.llama;
+
+import java.nio.file.Path;
+
+/**
+ * A native nearest-neighbour index over embeddings. {@link LlamaModel#embedBatch(VectorIndex, String...)} adds
+ * embeddings without copying them into Java, {@link LlamaModel#search(VectorIndex, String, int)} embeds a query and
+ * searches in one call, and {@link LlamaModel#searchAndRerank(VectorIndex, String, int, LlamaModel, int)} also reranks
+ * the texts of the hits.
+ * <p>
+ * A flat index compares the query with every vector, in parallel. An HNSW index searches a graph of neighbours
+ * instead, which is approximate but scales to large collections. Vectors are stored as {@link Storage#F32},
+ * half-precision {@link Storage#F16} or {@link Storage#INT8} with one scale per vector.
+ * <p>
+ * Entries are numbered in the order they were added, starting at 0. Search results are {@link RerankResult}s whose
+ * indices are entries. An index saved with {@link #save(Path)} is opened by mapping the file, so searches read it
+ * from the page cache without loading it first.
+ * <p>
+ * Searches may run concurrently, adding waits for running searches.
+ */
+public final class VectorIndex implements AutoCloseable {
+
+	static {
+		LlamaLoader.initialize();
+	}
+
+	/** Default candidate list size of HNSW searches */
+	public static final int DEFAULT_EF_SEARCH = 64;
+
+	public enum Storage {
+		F32, F16, INT8
+	}
+
+	public enum Metric {
+		/** Vectors and queries are normalized, scores are cosine similarities */
+		COSINE,
+		/** Scores are inner products of the vectors as given */
+		DOT
+	}
+
+	private long handle;
+
+	private VectorIndex(long handle) {
+		this.handle = handle;
+	}
+
+	/**
+	 * Create an exact index, searched by comparing the query with every vector.
+	 *
+	 * @param dimension the number of floats per vector, the embedding size of the model
+	 */
+	public static VectorIndex flat(int dimension, Storage storage, Metric metric) {
+		return new VectorIndex(createNative(dimension, storage.ordinal(), metric.ordinal(), 0, 0));
+	}
+
+	/**
+	 * Create an approximate index, searched through an HNSW graph.
+	 *
+	 * @param dimension the number of floats per vector, the embedding size of the model
+	 * @param m the number of neighbours of every vector per graph layer, twice as many in the bottom layer, e.g. 16
+	 * @param efConstruction the candidate list size while adding, e.g. 200, larger builds a better graph
+	 */
+	public static VectorIndex hnsw(int dimension, Storage storage, Metric metric, int m, int efConstruction) {
+		if (m <= 0) {
+			throw new IllegalArgumentException("m must be positive");
+		}
+		return new VectorIndex(createNative(dimension, storage.ordinal(), metric.ordinal(), m, efConstruction));
+	}
+
+	/**
+	 * Map an index written by {@link #save(Path)}.
+	 */
+	public static VectorIndex open(Path path) {
+		return new VectorIndex(openNative(path.toString()));
+	}
+
+	/**
+	 * Write the index to a file, replaced only once the new content is complete.
+	 */
+	public void save(Path path) {
+		saveNative(handle(), path.toString());
+	}
+
+	/**
+	 * Add vectors computed elsewhere.
+	 *
+	 * @param vectors {@code n * dimension} floats, the vectors one after another
+	 * @param texts one text per vector, kept for reranking, or none
+	 * @return the entry of the first vector, the others follow it
+	 */
+	public int add(float[] vectors, String... texts) {
+		if (vectors == null) {
+			throw new IllegalArgumentException("Vectors must not be null");
+		}
+		return addNative(handle(), vectors, texts == null || texts.length == 0 ? null : texts);
+	}
+
+	/**
+	 * @return the {@code k} entries most similar to the query, best first
+	 */
+	public RerankResult search(float[] query, int k) {
+		return search(query, k, DEFAULT_EF_SEARCH);
+	}
+
+	/**
+	 * @param ef the HNSW candidate list size, at least {@code k}, ignored by flat indices
+	 * @return the {@code k} entries most similar to the query, best first
+	 */
+	public RerankResult search(float[] query, int k, int ef) {
+		if (query == null) {
+			throw new IllegalArgumentException("Query must not be null");
+		}
+		return searchNative(handle(), query, k, ef);
+	}
+
+	/**
+	 * @return the text added with an entry, empty if it was added without one
+	 */
+	public String text(int entry) {
+		return textNative(handle(), entry);
+	}
+
+	public long size() {
+		return sizeNative(handle());
+	}
+
+	public int dimension() {
+		return dimensionNative(handle());
+	}
+
+	long handle() {
+		if (handle == 0) {
+			throw new IllegalStateException("Vector index is closed");
+		}
+		return handle;
+	}
+
+	@Override
+	public synchronized void close() {
+		if (handle != 0) {
+			freeNative(handle);
+			handle = 0;
+		}
+	}
+
+	private static native long createNative(int dimension, int storage, int metric, int m, int efConstruction);
+	private static native long openNative(String path);
+	private static native void saveNative(long handle, String path);
+	private static native void freeNative(long handle);
+	private static native long sizeNative(long handle);
+	private static native int dimensionNative(long handle);
+	private static native int addNative(long handle, float[] vectors, String[] texts);
+	private static native RerankResult searchNative(long handle, float[] query, int k, int ef);
+	private static native String textNative(long handle, int entry);
+}
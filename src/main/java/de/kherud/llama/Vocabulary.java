@@ -0,0 +1,69 @@
+package de.kherud.llama;
+
+import java.nio.charset.StandardCharsets;
+
+/**
+ * A snapshot of the whole vocabulary of a model, see {@link LlamaModel#exportVocabulary()}.
+ * Token {@code i} is the bytes {@code bytes[offsets[i]]} up to {@code bytes[offsets[i + 1]]}, the bytes the
+ * detokenizer emits for it, special tokens included. Pieces of byte-level vocabularies are not always valid UTF-8
+ * on their own, so constrained samplers and tries should match on the bytes rather than on {@link #text(int)}.
+ */
+public final class Vocabulary {
+
+    /**
+     * The bytes of all tokens, one after another.
+     */
+    public final byte[] bytes;
+
+    /**
+     * {@link #size()} + 1 offsets into {@link #bytes}, token {@code i} ends where token {@code i + 1} starts.
+     */
+    public final int[] offsets;
+
+    /**
+     * The score of every token, see {@link LlamaModel#getTokenScore(int)}.
+     */
+    public final float[] scores;
+
+    /**
+     * The attribute flags of every token, see {@link LlamaModel#getTokenAttributes(int)}.
+     */
+    public final int[] attributes;
+
+    Vocabulary(byte[] bytes, int[] offsets, float[] scores, int[] attributes) {
+        this.bytes = bytes;
+        this.offsets = offsets;
+        this.scores = scores;
+        this.attributes = attributes;
+    }
+
+    /**
+     * @return the number of tokens
+     */
+    public int size() {
+        return scores.length;
+    }
+
+    /**
+     * @return the number of bytes of a token
+     */
+    public int length(int token) {
+        return offsets[token + 1] - offsets[token];
+    }
+
+    /**
+     * @return a copy of the bytes of a token
+     */
+    public byte[] piece(int token) {
+        byte[] piece = new byte[length(token)];
+        System.arraycopy(bytes, offsets[token], piece, 0, piece.length);
+        return piece;
+    }
+
+    /**
+     * @return the bytes of a token decoded as UTF-8, with replacement characters for incomplete sequences
+     */
+    public String text(int token) {
+        return new String(bytes, offsets[token], length(token), StandardCharsets.UTF_8);
+    }
+}
@@ -0,0 +1,12 @@
+package de.kherud.llama.args;
+
+/**
+ * Scheduling class of a completion. Waiting requests of a class are admitted before all requests of the
+ * classes after it, and a full queue makes room for a request by rejecting one of a later class.
+ */
+public enum Priority {
+
+	INTERACTIVE,
+	NORMAL,
+	BATCH
+}
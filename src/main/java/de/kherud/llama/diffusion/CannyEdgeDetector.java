@@ -1,17 +1,13 @@
 package de.kherud.llama.diffusion;
 
+import java.nio.ByteBuffer;
+
 /**
- * Utility class for Canny edge detection preprocessing.
- *
- * IMPORTANT: Canny edge detection is currently DISABLED due to a memory management
- * bug in the stable-diffusion.cpp library. The preprocess_canny() function takes
- * sd_image_t by value instead of by reference, causing double-free crashes.
- *
- * All methods will throw UnsupportedOperationException until the underlying
- * library is fixed. The implementation is complete and ready to be re-enabled
- * when the library issue is resolved.
+ * Utility class for Canny edge detection preprocessing, such as ControlNet inputs.
  *
- * @see <a href="https://github.com/leejet/stable-diffusion.cpp/issues">Report issue</a>
+ * Edges are detected natively by jllama, in parallel over rows, with the parameters of stable-diffusion.cpp's
+ * preprocess_canny. That function itself is not used, it frees the image it is given and crashes with a double
+ * free.
  */
 public final class CannyEdgeDetector {
 
@@ -19,14 +15,6 @@ public final class CannyEdgeDetector {
 		throw new AssertionError("Utility class should not be instantiated");
 	}
 
-	private static void throwUnsupported() {
-		throw new UnsupportedOperationException(
-			"Canny edge detection is disabled due to a memory management bug in stable-diffusion.cpp. " +
-			"The preprocess_canny() function causes double-free crashes. " +
-			"This feature will be re-enabled when the underlying library is fixed."
-		);
-	}
-
 	/**
 	 * Default Canny parameters based on stable-diffusion.cpp defaults.
 	 */
@@ -44,11 +32,9 @@ public final class CannyEdgeDetector {
 	 * @param height Image height in pixels
 	 * @param channels Image channels (typically 3 for RGB)
 	 * @return true if edge detection succeeded
-	 * @throws UnsupportedOperationException always (feature disabled due to library bug)
 	 */
 	public static boolean detectEdges(byte[] imageData, int width, int height, int channels) {
-		throwUnsupported();
-		return false; // unreachable
+		return detectEdges(imageData, width, height, channels, DEFAULT_HIGH_THRESHOLD, DEFAULT_LOW_THRESHOLD);
 	}
 
 	/**
@@ -61,12 +47,11 @@ public final class CannyEdgeDetector {
 	 * @param highThreshold High threshold for edge detection (0.0-1.0)
 	 * @param lowThreshold Low threshold for edge detection (0.0-1.0)
 	 * @return true if edge detection succeeded
-	 * @throws UnsupportedOperationException always (feature disabled due to library bug)
 	 */
 	public static boolean detectEdges(byte[] imageData, int width, int height, int channels,
 									  float highThreshold, float lowThreshold) {
-		throwUnsupported();
-		return false; // unreachable
+		return detectEdges(imageData, width, height, channels, highThreshold, lowThreshold,
+			DEFAULT_WEAK, DEFAULT_STRONG, DEFAULT_INVERSE);
 	}
 
 	/**
@@ -82,13 +67,34 @@ public final class CannyEdgeDetector {
 	 * @param strong Strong edge value (0.0-1.0)
 	 * @param inverse Whether to invert the edge detection result
 	 * @return true if edge detection succeeded
-	 * @throws UnsupportedOperationException always (feature disabled due to library bug)
 	 */
 	public static boolean detectEdges(byte[] imageData, int width, int height, int channels,
 									  float highThreshold, float lowThreshold,
 									  float weak, float strong, boolean inverse) {
-		throwUnsupported();
-		return false; // unreachable
+		validateParameters(highThreshold, lowThreshold, weak, strong);
+		return NativeStableDiffusion.preprocessCanny(imageData, width, height, channels,
+			highThreshold, lowThreshold, weak, strong, inverse);
+	}
+
+	/**
+	 * Detect the edges of an image in a direct buffer, resized to the target size in the same pass. Suited to
+	 * ControlNet inputs that are decoded at one size and conditioned at another, without copies through the heap.
+	 *
+	 * @param source Source pixels (gray, RGB or RGBA bytes), a direct buffer
+	 * @param width Source width in pixels
+	 * @param height Source height in pixels
+	 * @param channels Source channels (1, 3 or 4)
+	 * @param target Direct buffer receiving the edges in every channel, may be the source at the same size
+	 * @param targetWidth Target width in pixels
+	 * @param targetHeight Target height in pixels
+	 * @param targetChannels Target channels (1, 3 or 4)
+	 * @return true if edge detection succeeded
+	 */
+	public static boolean detectEdges(ByteBuffer source, int width, int height, int channels,
+									  ByteBuffer target, int targetWidth, int targetHeight, int targetChannels) {
+		return NativeStableDiffusion.detectEdges(source, width, height, channels,
+			target, targetWidth, targetHeight, targetChannels,
+			DEFAULT_HIGH_THRESHOLD, DEFAULT_LOW_THRESHOLD, DEFAULT_WEAK, DEFAULT_STRONG, DEFAULT_INVERSE);
 	}
 
 	/**
@@ -99,11 +105,10 @@ public final class CannyEdgeDetector {
 	 * @param height Image height in pixels
 	 * @param channels Image channels (typically 3 for RGB)
 	 * @return new byte array with edge detection applied, or null if failed
-	 * @throws UnsupportedOperationException always (feature disabled due to library bug)
 	 */
 	public static byte[] detectEdgesCopy(byte[] originalData, int width, int height, int channels) {
-		throwUnsupported();
-		return null; // unreachable
+		byte[] copy = originalData.clone();
+		return detectEdges(copy, width, height, channels) ? copy : null;
 	}
 
 	/**
@@ -111,6 +111,11 @@ public final class ImageUpscaler implements AutoCloseable {
 		}
 	}
 
+	long getHandle() {
+		ensureNotClosed();
+		return handle;
+	}
+
 	/**
 	 * Check if this upscaler is valid and not closed.
 	 *
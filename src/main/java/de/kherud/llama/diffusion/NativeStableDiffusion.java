@@ -2,6 +2,8 @@ package de.kherud.llama.diffusion;
 
 import de.kherud.llama.LlamaLoader;
 
+import java.nio.ByteBuffer;
+
 /**
  * Native interface for Stable Diffusion image generation using stable-diffusion.cpp.
  *
@@ -35,6 +37,11 @@ public final class NativeStableDiffusion {
 	public static final int SAMPLE_METHOD_DPMPP2Mv2 = 6;
 	public static final int SAMPLE_METHOD_EULER_A = 50;
 
+	// Output format constants
+	public static final int OUTPUT_FORMAT_RAW = 0;
+	public static final int OUTPUT_FORMAT_PNG = 1;
+	public static final int OUTPUT_FORMAT_JPEG = 2;
+
 	/**
 	 * Create a new Stable Diffusion context.
 	 *
@@ -88,6 +95,10 @@ public final class NativeStableDiffusion {
 
 	/**
 	 * Generate an image using Stable Diffusion.
+	 * <p>
+	 * Thread-safe. Different contexts generate in parallel, calls on one context queue up and run one
+	 * generation at a time. Queued calls that differ only in consecutive seeds (or all use a random
+	 * seed) are generated together as one batch.
 	 *
 	 * @param handle Handle to the Stable Diffusion context
 	 * @param prompt Text prompt describing the desired image
@@ -107,6 +118,71 @@ public final class NativeStableDiffusion {
 															 int steps, float cfgScale, float slgScale,
 															 int seed, int sampleMethod, boolean clipOnCpu);
 
+	/**
+	 * Generate an image and encode it natively, so only the compressed file reaches the Java heap.
+	 * The image is encoded by the calling thread after the context moved on to the next request.
+	 *
+	 * @param handle Handle to the Stable Diffusion context
+	 * @param prompt Text prompt describing the desired image
+	 * @param negativePrompt Text describing what to avoid in the image (optional)
+	 * @param width Image width in pixels
+	 * @param height Image height in pixels
+	 * @param steps Number of denoising steps (higher = better quality, slower)
+	 * @param cfgScale Classifier-free guidance scale (how closely to follow prompt)
+	 * @param slgScale Skip Layer Guidance scale (for SD3.5 Medium)
+	 * @param seed Random seed for reproducible generation (-1 for random)
+	 * @param sampleMethod Sampling method (use SAMPLE_METHOD_* constants)
+	 * @param clipOnCpu Whether to run CLIP on CPU
+	 * @param outputFormat {@link #OUTPUT_FORMAT_PNG} or {@link #OUTPUT_FORMAT_JPEG}
+	 * @param outputQuality JPEG quality from 1 to 100, ignored for PNG
+	 * @return StableDiffusionResult containing the encoded image or error information
+	 */
+	public static native StableDiffusionResult generateImageEncoded(long handle, String prompt,
+																	String negativePrompt, int width, int height,
+																	int steps, float cfgScale, float slgScale,
+																	int seed, int sampleMethod, boolean clipOnCpu,
+																	int outputFormat, int outputQuality);
+
+	/**
+	 * Generate an image and upscale it in one native call, the intermediate image never reaches Java.
+	 * Upscaling runs in overlapping tiles blended across the overlaps, with the tiles spread over all
+	 * given upscalers (one thread each, for instance one per device), so memory is bounded by the
+	 * tile size rather than by the output.
+	 *
+	 * @param handle Handle to the Stable Diffusion context
+	 * @param upscalerHandles Upscaler contexts to spread the tiles over, at least one
+	 * @param prompt Text prompt describing the desired image
+	 * @param negativePrompt Text describing what to avoid in the image (optional)
+	 * @param width Image width in pixels
+	 * @param height Image height in pixels
+	 * @param steps Number of denoising steps (higher = better quality, slower)
+	 * @param cfgScale Classifier-free guidance scale (how closely to follow prompt)
+	 * @param slgScale Skip Layer Guidance scale (for SD3.5 Medium)
+	 * @param seed Random seed for reproducible generation (-1 for random)
+	 * @param sampleMethod Sampling method (use SAMPLE_METHOD_* constants)
+	 * @param clipOnCpu Whether to run CLIP on CPU
+	 * @param controlImage Control image data (RGB bytes, can be null)
+	 * @param controlImageWidth Control image width
+	 * @param controlImageHeight Control image height
+	 * @param controlImageChannels Control image channels
+	 * @param controlStrength ControlNet influence strength (0.0-1.0)
+	 * @param cannyControl Whether to replace the control image by its Canny edges first
+	 * @param upscaleFactor Upscale factor
+	 * @param tileSize Tile side in generated pixels
+	 * @param outputFormat One of the OUTPUT_FORMAT_* constants
+	 * @param outputQuality JPEG quality from 1 to 100, ignored otherwise
+	 * @return StableDiffusionResult containing the upscaled image or error information
+	 */
+	public static native StableDiffusionResult generateUpscaled(long handle, long[] upscalerHandles, String prompt,
+																String negativePrompt, int width, int height,
+																int steps, float cfgScale, float slgScale,
+																int seed, int sampleMethod, boolean clipOnCpu,
+																byte[] controlImage, int controlImageWidth,
+																int controlImageHeight, int controlImageChannels,
+																float controlStrength, boolean cannyControl,
+																int upscaleFactor, int tileSize,
+																int outputFormat, int outputQuality);
+
 	/**
 	 * Generate an image with ControlNet, img2img, and/or inpainting support.
 	 *
@@ -164,28 +240,49 @@ public final class NativeStableDiffusion {
 	public static native String getLastError();
 
 	/**
-	 * Apply Canny edge detection preprocessing to an image.
+	 * Apply Canny edge detection preprocessing to an image, in place. The edges are detected by jllama itself,
+	 * multithreaded, with the semantics of stable-diffusion.cpp's preprocess_canny: thresholds are fractions of
+	 * the strongest gradient, the low one relative to the high one.
 	 *
-	 * DISABLED: This method is currently disabled due to a memory management bug
-	 * in stable-diffusion.cpp that causes double-free crashes.
-	 *
-	 * @param imageData Image data (RGB bytes)
+	 * @param imageData Image data (gray, RGB or RGBA bytes)
 	 * @param width Image width in pixels
 	 * @param height Image height in pixels
-	 * @param channels Image channels (typically 3 for RGB)
+	 * @param channels Image channels (1, 3 or 4)
 	 * @param highThreshold High threshold for edge detection
 	 * @param lowThreshold Low threshold for edge detection
 	 * @param weak Weak edge value (0.0-1.0)
 	 * @param strong Strong edge value (0.0-1.0)
 	 * @param inverse Whether to invert the edge detection result
 	 * @return true if preprocessing succeeded, false otherwise
-	 * @deprecated This method is disabled due to library bugs
 	 */
-	@Deprecated
 	public static native boolean preprocessCanny(byte[] imageData, int width, int height, int channels,
 												 float highThreshold, float lowThreshold,
 												 float weak, float strong, boolean inverse);
 
+	/**
+	 * Apply Canny edge detection from one direct buffer into another, resizing to the target size in the same
+	 * pass. The target may be the source buffer when both sizes and channel counts match.
+	 *
+	 * @param source Source pixels (gray, RGB or RGBA bytes), a direct buffer
+	 * @param width Source width in pixels
+	 * @param height Source height in pixels
+	 * @param channels Source channels (1, 3 or 4)
+	 * @param target Receives the edges in every channel, a direct buffer
+	 * @param targetWidth Target width in pixels
+	 * @param targetHeight Target height in pixels
+	 * @param targetChannels Target channels (1, 3 or 4)
+	 * @param highThreshold High threshold for edge detection
+	 * @param lowThreshold Low threshold for edge detection
+	 * @param weak Weak edge value (0.0-1.0)
+	 * @param strong Strong edge value (0.0-1.0)
+	 * @param inverse Whether to invert the edge detection result
+	 * @return true if edge detection succeeded, false otherwise
+	 */
+	public static native boolean detectEdges(ByteBuffer source, int width, int height, int channels,
+											 ByteBuffer target, int targetWidth, int targetHeight, int targetChannels,
+											 float highThreshold, float lowThreshold,
+											 float weak, float strong, boolean inverse);
+
 	/**
 	 * Convenience method to create a context with default settings.
 	 *
@@ -254,11 +351,9 @@ public final class NativeStableDiffusion {
 	 * @param height Image height in pixels
 	 * @param channels Image channels (typically 3 for RGB)
 	 * @return true if preprocessing succeeded, false otherwise
-	 * @deprecated This method is disabled due to library bugs
 	 */
-	@Deprecated
 	public static boolean preprocessCanny(byte[] imageData, int width, int height, int channels) {
-		throw new UnsupportedOperationException("Canny preprocessing is disabled due to stable-diffusion.cpp library bugs");
+		return preprocessCanny(imageData, width, height, channels, 0.08f, 0.08f);
 	}
 
 	/**
@@ -271,12 +366,10 @@ public final class NativeStableDiffusion {
 	 * @param highThreshold High threshold for edge detection
 	 * @param lowThreshold Low threshold for edge detection
 	 * @return true if preprocessing succeeded, false otherwise
-	 * @deprecated This method is disabled due to library bugs
 	 */
-	@Deprecated
 	public static boolean preprocessCanny(byte[] imageData, int width, int height, int channels,
 										  float highThreshold, float lowThreshold) {
-		throw new UnsupportedOperationException("Canny preprocessing is disabled due to stable-diffusion.cpp library bugs");
+		return preprocessCanny(imageData, width, height, channels, highThreshold, lowThreshold, 0.8f, 1.0f, false);
 	}
 
 	/**
@@ -54,6 +54,10 @@ public class NativeStableDiffusionWrapper implements AutoCloseable {
 		public int maskImageHeight = 0;
 		public int maskImageChannels = 1;
 
+		// Output encoding, applies to text-to-image generation
+		public int outputFormat = NativeStableDiffusion.OUTPUT_FORMAT_RAW;
+		public int outputQuality = 90;
+
 		public static GenerationParameters defaults() {
 			return new GenerationParameters();
 		}
@@ -159,6 +163,12 @@ public class NativeStableDiffusionWrapper implements AutoCloseable {
 			return this;
 		}
 
+		public GenerationParameters withOutputFormat(int outputFormat, int outputQuality) {
+			this.outputFormat = outputFormat;
+			this.outputQuality = outputQuality;
+			return this;
+		}
+
 		public GenerationParameters withMaskImage(byte[] maskImage, int width, int height) {
 			return withMaskImage(maskImage, width, height, 1);
 		}
@@ -367,6 +377,24 @@ public class NativeStableDiffusionWrapper implements AutoCloseable {
 				params.width, params.height, params.steps, params.cfgScale, params.slgScale,
 				params.prompt);
 
+			if (params.outputFormat != NativeStableDiffusion.OUTPUT_FORMAT_RAW) {
+				return NativeStableDiffusion.generateImageEncoded(
+					contextHandle,
+					params.prompt,
+					params.negativePrompt,
+					params.width,
+					params.height,
+					params.steps,
+					params.cfgScale,
+					params.slgScale,
+					params.seed,
+					params.sampleMethod,
+					params.clipOnCpu,
+					params.outputFormat,
+					params.outputQuality
+				);
+			}
+
 			return NativeStableDiffusion.generateImage(
 				contextHandle,
 				params.prompt,
@@ -383,6 +411,59 @@ public class NativeStableDiffusionWrapper implements AutoCloseable {
 		}
 	}
 
+	/**
+	 * Generate an image and upscale it natively in tiles, see
+	 * {@link NativeStableDiffusion#generateUpscaled}. Img2img and inpainting images are not used.
+	 *
+	 * @param params Generation parameters, including the output format
+	 * @param cannyControl Whether to replace the control image by its Canny edges first
+	 * @param upscaleFactor Upscale factor
+	 * @param tileSize Tile side in generated pixels
+	 * @param upscalers Upscalers to spread the tiles over
+	 * @return StableDiffusionResult containing the upscaled image or error information
+	 * @throws IllegalStateException if the wrapper has been closed
+	 */
+	public StableDiffusionResult generateUpscaled(GenerationParameters params, boolean cannyControl,
+												  int upscaleFactor, int tileSize, ImageUpscaler... upscalers) {
+		checkNotClosed();
+
+		if (params.prompt == null || params.prompt.trim().isEmpty()) {
+			throw new IllegalArgumentException("Prompt cannot be null or empty");
+		}
+		if (upscalers.length == 0) {
+			throw new IllegalArgumentException("At least one upscaler is required");
+		}
+		long[] upscalerHandles = new long[upscalers.length];
+		for (int i = 0; i < upscalers.length; i++) {
+			upscalerHandles[i] = upscalers[i].getHandle();
+		}
+
+		return NativeStableDiffusion.generateUpscaled(
+			contextHandle,
+			upscalerHandles,
+			params.prompt,
+			params.negativePrompt,
+			params.width,
+			params.height,
+			params.steps,
+			params.cfgScale,
+			params.slgScale,
+			params.seed,
+			params.sampleMethod,
+			params.clipOnCpu,
+			params.controlImage,
+			params.controlImageWidth,
+			params.controlImageHeight,
+			params.controlImageChannels,
+			params.controlStrength,
+			cannyControl,
+			upscaleFactor,
+			tileSize,
+			params.outputFormat,
+			params.outputQuality
+		);
+	}
+
 	/**
 	 * Generate an image with a simple prompt and default parameters.
 	 *
@@ -425,8 +506,14 @@ public class NativeStableDiffusionWrapper implements AutoCloseable {
 			throw new IllegalArgumentException("No image data in result");
 		}
 
-		// Convert RGB data to PNG format
-		byte[] pngData = convertRgbToPng(imageData.get(), result.getWidth(), result.getHeight(), result.getChannels());
+		if (result.getFormat() == NativeStableDiffusion.OUTPUT_FORMAT_JPEG) {
+			throw new IllegalArgumentException("Result holds a JPEG, write its image data as is");
+		}
+
+		// Convert RGB data to PNG format, unless it was encoded natively
+		byte[] pngData = result.getFormat() == NativeStableDiffusion.OUTPUT_FORMAT_PNG
+			? imageData.get()
+			: convertRgbToPng(imageData.get(), result.getWidth(), result.getHeight(), result.getChannels());
 		Files.write(outputPath, pngData);
 
 		LOGGER.log(System.Logger.Level.INFO, "Saved image to: " + outputPath);
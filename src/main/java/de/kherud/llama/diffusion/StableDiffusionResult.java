@@ -12,15 +12,25 @@ public class StableDiffusionResult {
 	private final int width;
 	private final int height;
 	private final float generationTime;
+	private final int format;
+	private final int channels;
 
 	public StableDiffusionResult(boolean success, String errorMessage, byte[] imageData,
 								 int width, int height, float generationTime) {
+		this(success, errorMessage, imageData, width, height, generationTime,
+			NativeStableDiffusion.OUTPUT_FORMAT_RAW, 0);
+	}
+
+	public StableDiffusionResult(boolean success, String errorMessage, byte[] imageData,
+								 int width, int height, float generationTime, int format, int channels) {
 		this.success = success;
 		this.errorMessage = errorMessage;
 		this.imageData = imageData;
 		this.width = width;
 		this.height = height;
 		this.generationTime = generationTime;
+		this.format = format;
+		this.channels = channels;
 	}
 
 	/**
@@ -38,7 +48,8 @@ public class StableDiffusionResult {
 	}
 
 	/**
-	 * @return raw image data (RGB format) if generation was successful
+	 * @return image data if generation was successful, raw pixels (RGB format) or the encoded file
+	 * depending on {@link #getFormat()}
 	 */
 	public Optional<byte[]> getImageData() {
 		return Optional.ofNullable(imageData);
@@ -66,7 +77,14 @@ public class StableDiffusionResult {
 	}
 
 	/**
-	 * @return size of image data in bytes (width * height * channels)
+	 * @return one of the {@code NativeStableDiffusion.OUTPUT_FORMAT_*} constants
+	 */
+	public int getFormat() {
+		return format;
+	}
+
+	/**
+	 * @return size of image data in bytes (width * height * channels when raw)
 	 */
 	public int getImageDataSize() {
 		return imageData != null ? imageData.length : 0;
@@ -76,6 +94,9 @@ public class StableDiffusionResult {
 	 * @return number of color channels (usually 3 for RGB)
 	 */
 	public int getChannels() {
+		if (channels > 0) {
+			return channels;
+		}
 		if (imageData == null || width == 0 || height == 0) {
 			return 0;
 		}
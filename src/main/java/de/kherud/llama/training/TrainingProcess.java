@@ -0,0 +1,214 @@
+package de.kherud.llama.training;
+
+import com.fasterxml.jackson.databind.JsonNode;
+import com.fasterxml.jackson.databind.ObjectMapper;
+import com.fasterxml.jackson.databind.node.ObjectNode;
+
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
+import java.io.DataInputStream;
+import java.io.IOException;
+import java.io.OutputStream;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.StandardOpenOption;
+import java.util.concurrent.TimeUnit;
+import java.util.function.Consumer;
+
+/**
+ * Client of the native {@code training_process} executable, which trains outside of the JVM. Commands and responses
+ * are JSON carried in binary frames, progress arrives as compact binary records while an epoch runs. With a metrics
+ * file the latest progress of every step is also readable at any time through {@link #readMetrics()}, from shared
+ * memory, without waiting for a frame.
+ */
+public final class TrainingProcess implements AutoCloseable {
+
+	private static final int FRAME_COMMAND = 1;
+	private static final int FRAME_RESPONSE = 2;
+	private static final int FRAME_PROGRESS = 3;
+	private static final int FRAME_HEADER_SIZE = 8;
+	private static final int PROGRESS_SIZE = 56;
+	private static final int METRICS_SIZE = 16 + PROGRESS_SIZE;
+	private static final int METRICS_SEQUENCE_OFFSET = 8;
+	private static final int METRICS_PROGRESS_OFFSET = 16;
+
+	private static final ObjectMapper MAPPER = new ObjectMapper();
+
+	/**
+	 * Progress of the running epoch.
+	 */
+	public static final class Progress {
+		public final int epoch;
+		/** Whether the step trained, otherwise it evaluated the held-out windows */
+		public final boolean training;
+		public final long step;
+		public final long steps;
+		public final long elapsedMicros;
+		/** The mean loss of the phase so far, refreshed about every 100 ms */
+		public final double loss;
+		public final double lossUncertainty;
+		public final double accuracy;
+
+		private Progress(ByteBuffer record) {
+			epoch = record.getInt();
+			training = record.getInt() != 0;
+			step = record.getLong();
+			steps = record.getLong();
+			elapsedMicros = record.getLong();
+			loss = record.getDouble();
+			lossUncertainty = record.getDouble();
+			accuracy = record.getDouble();
+		}
+	}
+
+	private final Process process;
+	private final DataInputStream in;
+	private final OutputStream out;
+	private final MappedByteBuffer metrics;
+
+	private TrainingProcess(Process process, MappedByteBuffer metrics) {
+		this.process = process;
+		this.in = new DataInputStream(new BufferedInputStream(process.getInputStream()));
+		this.out = new BufferedOutputStream(process.getOutputStream());
+		this.metrics = metrics;
+	}
+
+	/**
+	 * Start the training process.
+	 *
+	 * @param executable the {@code training_process} binary
+	 * @param metricsFile where the process publishes the progress of every step, or null for none
+	 */
+	public static TrainingProcess start(Path executable, Path metricsFile) throws IOException {
+		ProcessBuilder builder = metricsFile == null
+			? new ProcessBuilder(executable.toString(), "--framed")
+			: new ProcessBuilder(executable.toString(), "--framed", "--metrics", metricsFile.toString());
+		builder.redirectError(ProcessBuilder.Redirect.INHERIT);
+		Process process = builder.start();
+		if (metricsFile == null) {
+			return new TrainingProcess(process, null);
+		}
+		try {
+			return new TrainingProcess(process, mapMetrics(metricsFile));
+		} catch (IOException e) {
+			process.destroyForcibly();
+			throw e;
+		}
+	}
+
+	// The process creates the file before it reads its first command
+	private static MappedByteBuffer mapMetrics(Path metricsFile) throws IOException {
+		long deadline = System.nanoTime() + TimeUnit.SECONDS.toNanos(10);
+		while (!Files.exists(metricsFile) || Files.size(metricsFile) < METRICS_SIZE) {
+			if (System.nanoTime() > deadline) {
+				throw new IOException("Training process did not create " + metricsFile);
+			}
+			try {
+				Thread.sleep(10);
+			} catch (InterruptedException e) {
+				Thread.currentThread().interrupt();
+				throw new IOException("Interrupted while waiting for " + metricsFile, e);
+			}
+		}
+		try (FileChannel channel = FileChannel.open(metricsFile, StandardOpenOption.READ)) {
+			MappedByteBuffer buffer = channel.map(FileChannel.MapMode.READ_ONLY, 0, METRICS_SIZE);
+			buffer.order(ByteOrder.LITTLE_ENDIAN);
+			return buffer;
+		}
+	}
+
+	/**
+	 * Run a command, such as {@code init}, {@code train_epoch}, {@code evaluate}, {@code save_checkpoint} or
+	 * {@code await_checkpoint}, which waits until the files of the last checkpoint are written.
+	 *
+	 * @param action the command
+	 * @param params its parameters
+	 * @param onProgress receives the progress frames sent while the command runs, or null
+	 * @return the response, with {@code "status"} either {@code "success"} or {@code "error"}
+	 */
+	public synchronized JsonNode call(String action, JsonNode params, Consumer<Progress> onProgress) throws IOException {
+		ObjectNode command = MAPPER.createObjectNode();
+		command.put("action", action);
+		command.set("params", params == null ? MAPPER.createObjectNode() : params);
+		writeFrame(MAPPER.writeValueAsBytes(command));
+
+		byte[] header = new byte[FRAME_HEADER_SIZE];
+		for (;;) {
+			in.readFully(header);
+			ByteBuffer frame = ByteBuffer.wrap(header).order(ByteOrder.LITTLE_ENDIAN);
+			int size = frame.getInt();
+			int type = frame.get();
+			byte[] payload = new byte[size];
+			in.readFully(payload);
+			if (type == FRAME_RESPONSE) {
+				return MAPPER.readTree(new String(payload, StandardCharsets.UTF_8));
+			}
+			if (type == FRAME_PROGRESS && size == PROGRESS_SIZE && onProgress != null) {
+				onProgress.accept(new Progress(ByteBuffer.wrap(payload).order(ByteOrder.LITTLE_ENDIAN)));
+			}
+		}
+	}
+
+	/**
+	 * @return the progress of the latest step, or null without a metrics file or before the first step
+	 */
+	public Progress readMetrics() {
+		if (metrics == null) {
+			return null;
+		}
+		// The sequence is odd while the process writes, and changes with every write
+		for (;;) {
+			long before = metrics.getLong(METRICS_SEQUENCE_OFFSET);
+			if (before == 0) {
+				return null;
+			}
+			ByteBuffer record = ByteBuffer.allocate(PROGRESS_SIZE).order(ByteOrder.LITTLE_ENDIAN);
+			for (int i = 0; i < PROGRESS_SIZE; i++) {
+				record.put(metrics.get(METRICS_PROGRESS_OFFSET + i));
+			}
+			long after = metrics.getLong(METRICS_SEQUENCE_OFFSET);
+			if ((before & 1) == 0 && before == after) {
+				record.flip();
+				return new Progress(record);
+			}
+			Thread.onSpinWait();
+		}
+	}
+
+	private void writeFrame(byte[] payload) throws IOException {
+		ByteBuffer header = ByteBuffer.allocate(FRAME_HEADER_SIZE).order(ByteOrder.LITTLE_ENDIAN);
+		header.putInt(payload.length).put((byte) FRAME_COMMAND);
+		out.write(header.array());
+		out.write(payload);
+		out.flush();
+	}
+
+	/**
+	 * Ask the process to shut down and wait for it, killing it if it does not exit in time.
+	 */
+	@Override
+	public void close() throws IOException {
+		try {
+			ObjectNode command = MAPPER.createObjectNode();
+			command.put("action", "shutdown");
+			writeFrame(MAPPER.writeValueAsBytes(command));
+		} catch (IOException ignored) {
+			// Already gone
+		}
+		try {
+			if (!process.waitFor(10, TimeUnit.SECONDS)) {
+				process.destroyForcibly();
+			}
+		} catch (InterruptedException e) {
+			Thread.currentThread().interrupt();
+			process.destroyForcibly();
+		} finally {
+			in.close();
+		}
+	}
+}
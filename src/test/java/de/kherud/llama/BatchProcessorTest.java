@@ -2,9 +2,14 @@ package de.kherud.llama;
 
 import org.junit.After;
 import org.junit.Assert;
+import org.junit.Assume;
 import org.junit.Before;
 import org.junit.Test;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.FloatBuffer;
+
 import static java.lang.System.Logger.Level.DEBUG;
 
 public class BatchProcessorTest {
@@ -156,6 +161,53 @@ public class BatchProcessorTest {
 		}
 	}
 
+	@Test
+	public void testPackedFill() {
+		try (BatchProcessor batch = new BatchProcessor(32, 0, 1)) {
+			int[] tokens = model.encode("Hello world");
+			ByteBuffer packed = batch.allocatePackedBuffer();
+			Assert.assertEquals(8 + 32 * 13, batch.packedSize());
+
+			int[] positions = new int[tokens.length];
+			for (int i = 0; i < tokens.length; i++) {
+				positions[i] = i;
+			}
+			batch.pack(packed, tokens, positions, new int[tokens.length], new byte[tokens.length]);
+			batch.fillBatch(packed);
+
+			Assert.assertEquals(tokens.length, batch.getTokenCount());
+			Assert.assertArrayEquals(tokens, batch.getTokens());
+		}
+	}
+
+	@Test
+	public void testDecodeAndCollect() {
+		Assume.assumeFalse("Needs the native batch",
+			Boolean.parseBoolean(System.getProperty("llama.batch.safe_fallback", "true")));
+		try (BatchProcessor batch = new BatchProcessor(32, 0, 1)) {
+			int[] tokens = model.encode("def main():");
+			int[] positions = new int[tokens.length];
+			byte[] flags = new byte[tokens.length];
+			for (int i = 0; i < tokens.length; i++) {
+				positions[i] = i;
+			}
+			flags[tokens.length - 1] = 1;
+
+			ByteBuffer packed = batch.allocatePackedBuffer();
+			batch.pack(packed, tokens, positions, new int[tokens.length], flags);
+			int vocabSize = model.getVocabularySize();
+			FloatBuffer logits = ByteBuffer.allocateDirect(vocabSize * Float.BYTES)
+				.order(ByteOrder.nativeOrder()).asFloatBuffer();
+
+			Assert.assertEquals(1, batch.decodeAndCollect(model, packed, logits, 0, false));
+			float max = Float.NEGATIVE_INFINITY;
+			for (int i = 0; i < vocabSize; i++) {
+				max = Math.max(max, logits.get(i));
+			}
+			Assert.assertTrue(Float.isFinite(max));
+		}
+	}
+
 	@Test(expected = IllegalStateException.class)
 	public void testClosedBatchThrowsException() {
 		BatchProcessor batch = new BatchProcessor(32, 0, 1);
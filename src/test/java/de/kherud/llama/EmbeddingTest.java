@@ -6,6 +6,10 @@ import org.junit.BeforeClass;
 import org.junit.Ignore;
 import org.junit.Test;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.FloatBuffer;
+
 import static java.lang.System.Logger.Level.DEBUG;
 
 public class EmbeddingTest {
@@ -116,6 +120,91 @@ public class EmbeddingTest {
 		logger.log(DEBUG, "✅ Embedding consistency test passed!");
 	}
 
+	@Test
+	public void testEmbedBatch() {
+		logger.log(DEBUG, "\n=== Batched Embedding Test ===");
+
+		String[] texts = {"Hello world", "The quick brown fox jumps over the lazy dog", "Hello world"};
+		float[] batch = model.embedBatch(texts);
+
+		int nEmbd = batch.length / texts.length;
+		Assert.assertEquals("Batch should hold one embedding per text", texts.length * nEmbd, batch.length);
+
+		float[] single = model.embed(texts[0]);
+		Assert.assertEquals(single.length, nEmbd);
+
+		float[] first = java.util.Arrays.copyOfRange(batch, 0, nEmbd);
+		float[] last = java.util.Arrays.copyOfRange(batch, 2 * nEmbd, 3 * nEmbd);
+		Assert.assertTrue("Batched embedding should match single embedding", cosineSimilarity(first, single) > 0.99);
+		Assert.assertTrue("Equal texts should have equal embeddings", cosineSimilarity(first, last) > 0.99);
+
+		logger.log(DEBUG, "✅ Batched embedding test passed!");
+	}
+
+	@Test
+	public void testCompactEmbedding() {
+		String[] texts = {"Hello world", "Compact embeddings"};
+		float[] full = model.embed(texts[0]);
+
+		// Reference: truncate and normalize on the Java side
+		float[] expected = java.util.Arrays.copyOf(full, 256);
+		double norm = 0;
+		for (float v : expected) {
+			norm += v * v;
+		}
+		for (int i = 0; i < expected.length; i++) {
+			expected[i] /= (float) Math.sqrt(norm);
+		}
+
+		EmbeddingFormat int8 = EmbeddingFormat.of(EmbeddingFormat.Encoding.INT8).truncatedTo(256).normalized();
+		CompactEmbeddings compact = model.embedCompact(int8, texts);
+		Assert.assertEquals(texts.length, compact.size());
+		Assert.assertEquals(texts.length * 256, compact.data.length);
+		Assert.assertTrue("int8 should keep the direction", cosineSimilarity(expected, compact.decode(0)) > 0.99);
+
+		EmbeddingFormat binary = EmbeddingFormat.of(EmbeddingFormat.Encoding.BINARY).truncatedTo(256);
+		CompactEmbeddings bits = model.embedCompact(binary, texts);
+		Assert.assertEquals(texts.length * 32, bits.data.length);
+		float[] signs = bits.decode(0);
+		for (int i = 0; i < 256; i++) {
+			Assert.assertEquals(full[i] > 0 ? 1.0f : -1.0f, signs[i], 0.0f);
+		}
+	}
+
+	@Test
+	public void testEmbedIntoIndex() {
+		String[] texts = {"The cat sat on the mat", "Stock markets fell sharply today", "A kitten naps on a rug"};
+		float[] single = model.embed(texts[0]);
+
+		try (VectorIndex index = VectorIndex.flat(single.length, VectorIndex.Storage.F16, VectorIndex.Metric.COSINE)) {
+			Assert.assertEquals(0, model.embedBatch(index, texts));
+			Assert.assertEquals(texts.length, index.size());
+
+			RerankResult hits = model.search(index, texts[1], 1);
+			Assert.assertEquals("A text should find itself", 1, hits.indices[0]);
+			Assert.assertEquals(texts[1], index.text(hits.indices[0]));
+
+			RerankResult direct = index.search(single, 1);
+			Assert.assertEquals(0, direct.indices[0]);
+		}
+	}
+
+	@Test
+	public void testEmbedIntoBuffer() {
+		float[] expected = model.embed("Hello world");
+
+		FloatBuffer out = ByteBuffer.allocateDirect(expected.length * Float.BYTES)
+			.order(ByteOrder.nativeOrder())
+			.asFloatBuffer();
+		int written = model.embed("Hello world", out);
+
+		Assert.assertEquals(expected.length, written);
+		Assert.assertEquals(expected.length, out.position());
+		for (int i = 0; i < expected.length; i++) {
+			Assert.assertEquals(expected[i], out.get(i), 1e-5f);
+		}
+	}
+
 //	@Test
 	@Ignore
 	public void testEmbeddingWithoutEmbeddingMode() {
@@ -124,6 +124,31 @@ public class GpuOffloadingTest {
 		return benchmarkModel(gpuLayers, prompt, nPredict);
 	}
 
+	@Test
+	public void testDevicePlacementReport() {
+		try (LlamaModel model = new LlamaModel(
+			new ModelParameters()
+				.setModel("models/codellama-7b.Q2_K.gguf")
+				.setGpuLayers(0)
+		)) {
+			String placement = model.getDevicePlacement();
+			logger.log(DEBUG, "Device placement: " + placement);
+			// Without offloading every layer and the output stay on the CPU
+			Assert.assertTrue(placement, placement.contains("\"n_gpu_layers\":0"));
+			Assert.assertTrue(placement, placement.contains("\"output_device\":\"CPU\""));
+			Assert.assertTrue(placement, placement.contains("\"type\":\"cpu\""));
+		}
+	}
+
+	@Test(expected = IllegalArgumentException.class)
+	public void testUnknownDeviceRejected() {
+		new LlamaModel(
+			new ModelParameters()
+				.setModel("models/codellama-7b.Q2_K.gguf")
+				.setDevices("NoSuchDevice0")
+		).close();
+	}
+
 	private long benchmarkModel(int gpuLayers, String prompt, int nPredict) {
 		try (LlamaModel model = new LlamaModel(
 			new ModelParameters()
@@ -1,6 +1,7 @@
 package de.kherud.llama;
 
 import de.kherud.llama.args.LogFormat;
+import de.kherud.llama.args.Priority;
 import org.junit.AfterClass;
 import org.junit.Assert;
 import org.junit.BeforeClass;
@@ -8,12 +9,20 @@ import org.junit.Ignore;
 import org.junit.Test;
 
 import java.io.ByteArrayOutputStream;
+import java.io.IOException;
 import java.io.PrintStream;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
 import java.util.ArrayList;
+import java.util.Arrays;
 import java.util.HashMap;
 import java.util.List;
 import java.util.Map;
 import java.util.Scanner;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.TimeUnit;
+import java.util.regex.Matcher;
 import java.util.regex.Pattern;
 
 import static java.lang.System.Logger.Level.DEBUG;
@@ -41,6 +50,7 @@ public class LlamaModelTest {
 				.setModel("models/codellama-7b.Q2_K.gguf")
 				//.setModelUrl("https://huggingface.co/TheBloke/CodeLlama-7B-GGUF/resolve/main/codellama-7b.Q2_K.gguf")
 				.setGpuLayers(43)
+				.setParallel(2)
 				.enableEmbedding()
 		);
 	}
@@ -69,6 +79,37 @@ public class LlamaModelTest {
 		Assert.assertTrue(generated > 0 && generated <= nPredict + 1);
 	}
 
+	@Test
+	public void testGenerateWithCallback() throws Exception {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(new InferenceParameters(prefix).setNPredict(nPredict));
+
+		StringBuilder text = new StringBuilder();
+		List<String> errors = new ArrayList<>();
+		CountDownLatch done = new CountDownLatch(1);
+		int taskId = model.generate(params, new LlamaModel.CompletionCallback() {
+			@Override
+			public void onOutput(LlamaOutput output) {
+				text.append(output.text);
+			}
+
+			@Override
+			public void onComplete() {
+				done.countDown();
+			}
+
+			@Override
+			public void onError(String message) {
+				errors.add(message);
+				done.countDown();
+			}
+		});
+		Assert.assertTrue(taskId >= 0);
+		Assert.assertTrue(done.await(60, TimeUnit.SECONDS));
+		Assert.assertTrue(errors.toString(), errors.isEmpty());
+		Assert.assertEquals(expected, text.toString());
+	}
+
 	@Test
 	public void testGenerateInfill() {
 		Map<Integer, Float> logitBias = new HashMap<>();
@@ -105,6 +146,91 @@ public class LlamaModelTest {
 		Assert.assertTrue(generated > 0 && generated <= nPredict + 1);
 	}
 
+	@Test
+	public void testGenerateConcurrent() throws InterruptedException {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+
+		int[] generated = new int[2];
+		Thread[] threads = new Thread[2];
+		for (int i = 0; i < threads.length; i++) {
+			final int index = i;
+			threads[i] = new Thread(() -> {
+				for (LlamaOutput ignored : model.generate(params)) {
+					generated[index]++;
+				}
+			});
+			threads[i].start();
+		}
+		for (Thread thread : threads) {
+			thread.join();
+		}
+
+		for (int count : generated) {
+			Assert.assertTrue(count > 0 && count <= nPredict + 1);
+		}
+	}
+
+	@Test
+	public void testGenerateMatchesComplete() {
+		InferenceParameters params = new InferenceParameters("Translate to Japanese: good morning\n").setNPredict(nPredict);
+
+		// Greedy streaming must produce the exact text of a non-streamed completion, no partial UTF-8 pieces
+		StringBuilder sb = new StringBuilder();
+		for (LlamaOutput output : model.generate(params)) {
+			Assert.assertFalse(output.text.contains("\uFFFD"));
+			sb.append(output.text);
+		}
+		Assert.assertEquals(model.complete(params), sb.toString());
+	}
+
+	@Test
+	public void testBinaryRequestMatchesJson() {
+		String prompt = "Translate to \"Japanese\": good morning\n";
+		String expected = model.complete(new InferenceParameters(prompt).setNPredict(nPredict));
+
+		// Text and pre-tokenized prompts decode the same request as its JSON form
+		CompletionRequest request = new CompletionRequest().setPrompt(prompt).setNPredict(nPredict);
+		Assert.assertEquals(expected, model.complete(request));
+		request.setPromptTokens(model.encode(prompt));
+		Assert.assertEquals(expected, model.complete(request));
+	}
+
+	@Test
+	public void testGenerateChunks() {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+
+		int generated = 0;
+		StringBuilder sb = new StringBuilder();
+		LlamaIterator iterator = model.generate(params).iterator();
+		while (iterator.hasNext()) {
+			LlamaChunk chunk = iterator.nextChunk(4, 50);
+			Assert.assertEquals(chunk.tokens.length + 1, chunk.offsets.length);
+			Assert.assertEquals(chunk.bytes.length, chunk.offsets[chunk.tokens.length]);
+			generated += chunk.tokens.length;
+			sb.append(chunk.getText());
+		}
+		Assert.assertTrue(generated > 0 && generated <= nPredict);
+		Assert.assertFalse(sb.toString().isEmpty());
+	}
+
+	@Test
+	public void testGenerateTopProbabilities() {
+		int nProbs = 5;
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict).setNProbs(nProbs);
+
+		LlamaIterator iterator = model.generate(params).iterator();
+		while (iterator.hasNext()) {
+			LlamaChunk chunk = iterator.nextChunk(4, 50);
+			Assert.assertEquals(chunk.tokens.length * nProbs, chunk.topTokens.length);
+			Assert.assertEquals(chunk.topTokens.length, chunk.topProbabilities.length);
+			for (int i = 0; i < chunk.tokens.length; i++) {
+				for (int j = 1; j < nProbs; j++) {
+					Assert.assertTrue(chunk.topProbabilities[i * nProbs + j - 1] >= chunk.topProbabilities[i * nProbs + j]);
+				}
+			}
+		}
+	}
+
 	@Test
 	public void testCompleteAnswer() {
 		Map<Integer, Float> logitBias = new HashMap<>();
@@ -120,6 +246,21 @@ public class LlamaModelTest {
 		Assert.assertFalse(output.isEmpty());
 	}
 
+	@Test
+	public void testCompleteSeedReproducible() {
+		InferenceParameters params = new InferenceParameters(prefix)
+			.setTemperature(0.9f)
+			.setTopK(40)
+			.setRepeatPenalty(1.1f)
+			.setNPredict(nPredict)
+			.setSeed(1234);
+
+		// The second request is served from the compiled pipeline cache and must sample the same tokens
+		String first = model.complete(params);
+		String second = model.complete(params);
+		Assert.assertEquals(first, second);
+	}
+
 	@Test
 	public void testCompleteInfillCustom() {
 		Map<Integer, Float> logitBias = new HashMap<>();
@@ -149,6 +290,70 @@ public class LlamaModelTest {
 
 	}
 
+	@Test
+	public void testCompleteGrammarCached() {
+		InferenceParameters params = new InferenceParameters("")
+			.setGrammar("root ::= (\"c\" | \"d\")+")
+			.setNPredict(nPredict);
+		String first = model.complete(params);
+		String second = model.complete(params);
+		Assert.assertTrue(first.matches("[cd]+"));
+		Assert.assertTrue(second.matches("[cd]+"));
+
+		String perf = model.getPerformanceData();
+		Assert.assertTrue(perf, perf.contains("\"grammar_cache_hits\":"));
+		Assert.assertFalse(perf, perf.contains("\"grammar_cache_hits\":0,"));
+	}
+
+	@Test
+	public void testRequestArenasAreTracked() {
+		model.complete(new InferenceParameters("def remove_non_ascii(s: str) -> str:").setNPredict(nPredict));
+
+		// The request arenas stay allocated for reuse, their blocks are counted by the tracker
+		String perf = model.getPerformanceData();
+		Assert.assertTrue(perf, perf.contains("\"tracked_native_bytes\":"));
+		Assert.assertFalse(perf, perf.contains("\"tracked_native_bytes\":0,"));
+		Assert.assertTrue(perf, perf.contains("\"pooled_arenas\":"));
+	}
+
+	@Test
+	public void testNativeTrace() throws IOException {
+		Path trace = Files.createTempFile("jllama_trace_", ".json");
+		try {
+			LlamaUtils.startTracing();
+			Assert.assertTrue(LlamaUtils.isTracing());
+			model.complete(new InferenceParameters(prefix).setNPredict(nPredict));
+			LlamaUtils.stopTracing();
+
+			long spans = LlamaUtils.writeTrace(trace.toString());
+			Assert.assertTrue(spans > 0);
+			String json = new String(Files.readAllBytes(trace), StandardCharsets.UTF_8);
+			Assert.assertTrue(json.startsWith("{\"displayTimeUnit\""));
+			Assert.assertTrue(json.contains("\"name\":\"prefill\"") || json.contains("\"name\":\"decode\""));
+			Assert.assertTrue(json.contains("\"name\":\"sample\""));
+		} finally {
+			LlamaUtils.stopTracing();
+			Files.deleteIfExists(trace);
+		}
+	}
+
+	@Test
+	public void testLatencyStats() {
+		model.resetPerformanceData();
+		int generated = 0;
+		for (LlamaOutput ignored : model.generate(new InferenceParameters(prefix).setNPredict(nPredict))) {
+			generated++;
+		}
+		Assert.assertTrue(generated > 1);
+
+		String stats = model.getLatencyStats();
+		Assert.assertTrue(stats, stats.contains("\"queue_wait\":{\"count\":1,"));
+		Assert.assertTrue(stats, stats.contains("\"first_token\":{\"count\":1,"));
+		Assert.assertFalse(stats, stats.contains("\"token_interval\":{\"count\":0,"));
+		Assert.assertFalse(stats, stats.contains("\"marshal\":{\"count\":0,"));
+		Assert.assertTrue(stats, stats.contains("\"p99_us\":"));
+	}
+
 	@Test
 	public void testCancelGenerating() {
 		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
@@ -165,12 +370,230 @@ public class LlamaModelTest {
 		Assert.assertEquals(5, generated);
 	}
 
+	@Test
+	public void testChunkedPrefill() {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(params);
+
+		// A prompt prefilled a few tokens per step completes the same as one prefilled at once
+		try (LlamaModel chunked = new LlamaModel(new ModelParameters()
+				.setCtxSize(512)
+				.setModel("models/codellama-7b.Q2_K.gguf")
+				.setGpuLayers(43)
+				.setParallel(2)
+				.setStepTokens(8)
+				.setPrefillChunk(4))) {
+			Assert.assertEquals(expected, chunked.complete(params));
+			String perf = chunked.getPerformanceData();
+			Assert.assertTrue(perf, perf.contains("\"step_tokens\":8,"));
+			Assert.assertTrue(perf, perf.contains("\"prefill_chunk\":4,"));
+		}
+	}
+
+	@Test
+	public void testPriorityAndDeadline() {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(params);
+		Assert.assertEquals(expected, model.complete(new InferenceParameters(prefix).setNPredict(nPredict)
+			.setPriority(Priority.INTERACTIVE)));
+
+		// A deadline that cannot be met ends the request with an error
+		InferenceParameters overdue = new InferenceParameters(prefix).setNPredict(-1).setDeadline(1);
+		Assert.assertThrows(RuntimeException.class, () -> model.complete(overdue));
+
+		String perf = model.getPerformanceData();
+		Assert.assertTrue(perf, perf.contains("\"queue_depth_interactive\":"));
+		Assert.assertFalse(perf, perf.contains("\"deadline_miss_count\":0,"));
+	}
+
+	@Test
+	public void testPreemptionSwapsToHost() {
+		// Long enough to still be decoding when the interactive request arrives
+		InferenceParameters background = new InferenceParameters(prefix).setNPredict(128)
+			.setPriority(Priority.BATCH);
+		InferenceParameters interactive = new InferenceParameters("int main() {").setNPredict(4)
+			.setPriority(Priority.INTERACTIVE);
+		String expected = model.complete(background);
+
+		// With a single sequence the interactive request swaps out the running batch request
+		try (LlamaModel single = new LlamaModel(new ModelParameters()
+				.setCtxSize(256)
+				.setModel("models/codellama-7b.Q2_K.gguf")
+				.setGpuLayers(43)
+				.setParallel(1)
+				.setKvSwapBudget(256))) {
+			StringBuilder sb = new StringBuilder();
+			LlamaIterator iterator = single.generate(background).iterator();
+			sb.append(iterator.next().text);
+			Assert.assertFalse(single.complete(interactive).isEmpty());
+			while (iterator.hasNext()) {
+				sb.append(iterator.next().text);
+			}
+
+			// The swapped request continued where it stopped
+			Assert.assertEquals(expected, sb.toString());
+			String perf = single.getPerformanceData();
+			Assert.assertTrue(perf, counter(perf, "preemption_count") > 0);
+			Assert.assertTrue(perf, counter(perf, "swap_restore_count") > 0);
+			Assert.assertTrue(perf, perf.contains("\"swap_bytes\":0,"));
+		}
+	}
+
+	private static long counter(String perf, String name) {
+		Matcher matcher = Pattern.compile("\"" + name + "\":(\\d+)").matcher(perf);
+		Assert.assertTrue(perf, matcher.find());
+		return Long.parseLong(matcher.group(1));
+	}
+
+	@Test
+	public void testCompleteCandidates() {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(params);
+
+		// Greedy branches of the shared prompt all follow the single completion
+		List<String> greedy = model.completeCandidates(new InferenceParameters(prefix).setNPredict(nPredict)
+			.setNCandidates(2));
+		Assert.assertEquals(Arrays.asList(expected, expected), greedy);
+
+		List<String> sampled = model.completeCandidates(new InferenceParameters(prefix).setNPredict(nPredict)
+			.setNCandidates(2).setTemperature(1.0f).setSeed(42));
+		Assert.assertEquals(2, sampled.size());
+		Assert.assertFalse(model.getPerformanceData().contains("\"forked_branch_count\":0,"));
+	}
+
+	@Test
+	public void testBaseModelAdapterSet() {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(params);
+
+		// An empty adapter set is the base model, the same set as requests naming none
+		String base = model.complete(new InferenceParameters(prefix).setNPredict(nPredict)
+			.setLoraAdapters(new HashMap<>()));
+		Assert.assertEquals(expected, base);
+		Assert.assertTrue(model.getPerformanceData().contains("\"lora_switch_count\":0,"));
+	}
+
+	@Test
+	public void testLoraCacheStats() {
+		String perf = model.getPerformanceData();
+		Assert.assertTrue(perf.contains("\"lora_cache\":{\"resident_count\":"));
+		Assert.assertTrue(perf.contains("\"load_latency\":{\"count\":"));
+	}
+
+	@Test
+	public void testEvaluatePerplexity() throws java.io.IOException {
+		StringBuilder text = new StringBuilder();
+		for (int i = 0; i < 16; i++) {
+			text.append(prefix);
+		}
+		int[] tokens = model.encode(text.toString());
+		int windowSize = 32;
+		PerplexityResult serial = model.evaluatePerplexity(tokens, windowSize, 1);
+		Assert.assertEquals(tokens.length / windowSize, serial.chunkNll.length);
+		Assert.assertTrue(serial.perplexity >= 1.0);
+		Assert.assertFalse(serial.hasReference());
+
+		// Windows decoded side by side score as they do alone, and a model does not diverge from itself
+		java.io.File reference = java.io.File.createTempFile("jllama-logprobs", ".bin");
+		try {
+			PerplexityResult parallel = model.evaluatePerplexity(tokens, windowSize, 4, reference.getPath(), null);
+			Assert.assertEquals(serial.perplexity, parallel.perplexity, 1e-2 * serial.perplexity);
+			PerplexityResult compared = model.evaluatePerplexity(tokens, windowSize, 4, null, reference.getPath());
+			Assert.assertTrue(compared.hasReference());
+			Assert.assertEquals(0.0, compared.meanKl, 1e-2);
+			Assert.assertEquals(1.0, compared.topTokenAgreement, 1e-2);
+		} finally {
+			reference.delete();
+		}
+	}
+
+	@Test
+	public void testWriteTokenShard() throws java.io.IOException {
+		java.io.File text = java.io.File.createTempFile("jllama-dataset", ".txt");
+		java.io.File shard = java.io.File.createTempFile("jllama-dataset", ".shard");
+		try {
+			java.nio.file.Files.write(text.toPath(), java.util.Arrays.asList(prefix, "", prefix, "def add(a, b):"));
+			Assert.assertEquals(3, model.writeTokenShard(text.getPath(), shard.getPath()));
+			byte[] magic = java.util.Arrays.copyOf(java.nio.file.Files.readAllBytes(shard.toPath()), 4);
+			Assert.assertEquals("JLTS", new String(magic, java.nio.charset.StandardCharsets.US_ASCII));
+		} finally {
+			text.delete();
+			shard.delete();
+		}
+	}
+
+	@Test
+	public void testCancelDuringPrefill() {
+		InferenceParameters reference = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(reference);
+
+		// Cancelled before its prompt is decoded, possibly while it is, the stream just ends
+		StringBuilder prompt = new StringBuilder();
+		for (int i = 0; i < 20; i++) {
+			prompt.append("// line ").append(i).append(" of a long comment\n");
+		}
+		LlamaIterator iterator = model.generate(new InferenceParameters(prompt.toString()).setNPredict(nPredict)).iterator();
+		iterator.cancel();
+		int generated = 0;
+		while (iterator.hasNext()) {
+			iterator.next();
+			generated++;
+		}
+		Assert.assertTrue(generated <= nPredict);
+
+		// The sequence was reclaimed and the scheduler keeps working
+		Assert.assertEquals(expected, model.complete(reference));
+		Assert.assertTrue(model.getPerformanceData().contains("\"aborted_decode_count\":"));
+	}
+
 	@Test
 	public void testEmbedding() {
 		float[] embedding = model.embed(prefix);
 		Assert.assertEquals(4096, embedding.length);
 	}
 
+	@Test
+	public void testEmbeddingKeepsCompletionPrefix() {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(params);
+
+		// Embeddings decode on a sequence of their own, the prompt prefix kept by the first completion stays valid
+		model.embed("Embeddings do not disturb the completions");
+		long reused = counter(model.getPerformanceData(), "reused_count");
+		Assert.assertEquals(expected, model.complete(params));
+		Assert.assertTrue(counter(model.getPerformanceData(), "reused_count") > reused);
+	}
+
+	@Test
+	public void testEmbedBatchDuringGeneration() {
+		InferenceParameters params = new InferenceParameters(prefix).setNPredict(nPredict);
+		String expected = model.complete(params);
+		String[] texts = { "good morning", "machine learning", prefix };
+
+		// The batch shares the context with the running stream, neither may touch the other's sequence
+		StringBuilder sb = new StringBuilder();
+		float[] batch = null;
+		for (LlamaOutput output : model.generate(params)) {
+			sb.append(output.text);
+			if (batch == null) {
+				batch = model.embedBatch(texts);
+			}
+		}
+		Assert.assertEquals(expected, sb.toString());
+		Assert.assertNotNull(batch);
+		for (int i = 0; i < texts.length; i++) {
+			float[] single = model.embed(texts[i]);
+			double dot = 0, norm = 0, batchNorm = 0;
+			for (int j = 0; j < single.length; j++) {
+				float value = batch[i * single.length + j];
+				dot += single[j] * value;
+				norm += single[j] * single[j];
+				batchNorm += value * value;
+			}
+			Assert.assertEquals(1.0, dot / Math.sqrt(norm * batchNorm), 1e-3);
+		}
+	}
+
 	@Ignore
 	public void testReRanking() {
 		String query = "Machine learning is";
@@ -194,6 +617,21 @@ public class LlamaModelTest {
 		Assert.assertTrue("Decoded text should contain original prompt", decoded.contains("Hello") && decoded.contains("world"));
 	}
 
+	@Test
+	public void testBatchTokenization() {
+		String[] prompts = new String[100];
+		for (int i = 0; i < prompts.length; i++) {
+			prompts[i] = "Prompt number " + i + " with " + "some text ".repeat(i % 7);
+		}
+
+		TokenBatch batch = model.encodeBatch(prompts);
+		Assert.assertEquals(prompts.length, batch.size());
+		Assert.assertEquals(batch.tokens.length, batch.offsets[prompts.length]);
+		for (int i = 0; i < prompts.length; i++) {
+			Assert.assertArrayEquals(model.encode(prompts[i]), batch.get(i));
+		}
+	}
+
 	@Ignore
 	public void testLogText() {
 		List<LogMessage> messages = new ArrayList<>();
@@ -305,4 +743,28 @@ public class LlamaModelTest {
 		String result = model.applyTemplate(params);
 		Assert.assertEquals("<|im_start|>system\nBook<|im_end|>\n<|im_start|>user\nWhat is the best book?<|im_end|>\n<|im_start|>assistant\nIt depends on your interests. Do you like fiction or non-fiction?<|im_end|>\n<|im_start|>assistant\n", result);
 	}
+
+	@Test
+	public void testConversation() {
+		try (ChatConversation conversation = model.createConversation()) {
+			conversation.append("system", "Book").append("user", "What is the best book?");
+			int[] firstTurn = conversation.getPromptTokens();
+			String reply = model.complete(conversation, new InferenceParameters("").setNPredict(nPredict));
+
+			conversation.append("assistant", reply).append("user", "Why?");
+			List<Pair<String, String>> messages = new ArrayList<>();
+			messages.add(new Pair<>("user", "What is the best book?"));
+			messages.add(new Pair<>("assistant", reply));
+			messages.add(new Pair<>("user", "Why?"));
+			String expected = model.applyTemplate(new InferenceParameters("").setMessages("Book", messages));
+			Assert.assertEquals(expected, conversation.getPrompt());
+
+			// Later turns keep the history's tokens, so the earlier prompt's KV cache can be reused, only the
+			// generation prompt may tokenize differently once the reply follows it
+			int[] secondTurn = conversation.getPromptTokens();
+			Assert.assertTrue(secondTurn.length > firstTurn.length);
+			int common = Arrays.mismatch(firstTurn, Arrays.copyOf(secondTurn, firstTurn.length));
+			Assert.assertTrue(common < 0 || common >= firstTurn.length - 1);
+		}
+	}
 }
@@ -347,4 +347,61 @@ public class MemoryKVCacheTest {
 			logger.log(DEBUG, "Result length: " + result.length());
 		}
 	}
+
+	@Test
+	public void testContextShiftLongGeneration() {
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99)
+			.setCtxSize(64)
+			.setKeep(4)
+			.enableContextShift();
+		try (LlamaModel model = new LlamaModel(params)) {
+			// Generates past the end of the context without failing or restarting the stream
+			int generated = 0;
+			for (LlamaOutput ignored : model.generate(new InferenceParameters(TEST_PROMPT).setNPredict(160))) {
+				generated++;
+			}
+			Assert.assertTrue(generated > 0);
+
+			String perf = model.getPerformanceData();
+			if (generated > 64) {
+				Assert.assertFalse(perf, perf.contains("\"context_shift_count\":0,")
+					&& perf.contains("\"context_rebuild_count\":0,"));
+			}
+			logger.log(DEBUG, "Generated " + generated + " tokens in a 64 token context");
+		}
+	}
+
+	@Test
+	public void testMemoryPlanReportsContext() {
+		try (LlamaModel model = createModel()) {
+			String plan = model.getMemoryPlan();
+			Assert.assertTrue(plan, plan.contains("\"n_ctx\":512,"));
+			Assert.assertTrue(plan, plan.contains("\"type_k\":\"f16\""));
+		}
+	}
+
+	@Test
+	public void testMemoryBudgetPlansContext() {
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99)
+			.setParallel(2)
+			.setMemoryBudget(4096);
+		try (LlamaModel model = new LlamaModel(params)) {
+			String plan = model.getMemoryPlan();
+			Assert.assertTrue(plan, plan.contains("\"fits\":true"));
+			Assert.assertFalse(plan, plan.contains("\"n_ctx\":0,"));
+			logger.log(DEBUG, "Memory plan: " + plan);
+		}
+	}
+
+	@Test
+	public void testMemoryBudgetTooSmall() {
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setMemoryBudget(64);
+		Assert.assertThrows(IllegalArgumentException.class, () -> new LlamaModel(params).close());
+	}
 }
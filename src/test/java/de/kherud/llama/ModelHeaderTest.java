@@ -0,0 +1,58 @@
+package de.kherud.llama;
+
+import org.junit.Assert;
+import org.junit.Test;
+
+import java.nio.file.Path;
+
+import static java.lang.System.Logger.Level.DEBUG;
+
+public class ModelHeaderTest {
+	private static final System.Logger logger = System.getLogger(ModelHeaderTest.class.getName());
+	private static final Path MODEL = Path.of("models/codellama-7b.Q2_K.gguf");
+
+	@Test
+	public void testHeaderMatchesLoadedModel() {
+		ModelHeader header = ModelHeader.read(MODEL);
+		logger.log(DEBUG, "Header: " + header.getArchitecture() + ", " + header.getParameterCount() + " parameters, "
+			+ header.getWeightType());
+
+		Assert.assertEquals("llama", header.getArchitecture());
+		Assert.assertEquals("llama", header.getMetadataValue("general.architecture"));
+		Assert.assertFalse(header.getTensors().isEmpty());
+		Assert.assertTrue(header.getWeightBytes() < header.getFileBytes());
+
+		try (LlamaModel model = new LlamaModel(new ModelParameters().setModel(MODEL.toString()))) {
+			Assert.assertEquals(model.getModelParameterCount(), header.getParameterCount());
+			Assert.assertEquals(model.getModelSize(), header.getWeightBytes());
+			Assert.assertEquals(model.getVocabularySize(), header.getVocabularySize());
+			Assert.assertEquals(model.getModelLayerCount(), header.getLayerCount());
+			Assert.assertEquals(model.getModelTrainingContextSize(), header.getContextLength());
+		}
+	}
+
+	@Test
+	public void testReadWithoutTensors() {
+		ModelHeader header = ModelHeader.read(MODEL, false);
+		Assert.assertTrue(header.getTensors().isEmpty());
+		Assert.assertTrue(header.getParameterCount() > 6_000_000_000L);
+	}
+
+	@Test
+	public void testEstimateMemory() {
+		ModelHeader header = ModelHeader.read(MODEL, false);
+		String plan = header.estimateMemory(4096, "f16", "f16");
+		Assert.assertTrue(plan, plan.contains("\"n_ctx\":4096,"));
+
+		// A quantized K cache halves the K part of the cache
+		long f16 = header.estimateMemoryBytes(4096, "f16", "f16");
+		long q8 = header.estimateMemoryBytes(4096, "q8_0", "f16");
+		Assert.assertTrue(q8 < f16);
+		Assert.assertTrue(f16 > header.getWeightBytes());
+	}
+
+	@Test(expected = IllegalArgumentException.class)
+	public void testNotAModel() {
+		ModelHeader.read(Path.of("pom.xml"));
+	}
+}
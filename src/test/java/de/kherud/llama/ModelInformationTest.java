@@ -163,6 +163,33 @@ public class ModelInformationTest {
 		}
 	}
 
+	@Test
+	public void testExportVocabulary() {
+		try (LlamaModel model = createModel()) {
+			Vocabulary vocabulary = model.exportVocabulary();
+			int vocabSize = model.getVocabularySize();
+
+			Assert.assertEquals(vocabSize, vocabulary.size());
+			Assert.assertEquals(vocabSize + 1, vocabulary.offsets.length);
+			Assert.assertEquals(vocabulary.bytes.length, vocabulary.offsets[vocabSize]);
+			Assert.assertSame("Vocabulary should be exported once", vocabulary, model.exportVocabulary());
+
+			for (int i = 0; i < Math.min(100, vocabSize); i++) {
+				Assert.assertTrue(vocabulary.length(i) >= 0);
+				Assert.assertEquals(model.getTokenScore(i), vocabulary.scores[i], 0.0f);
+				Assert.assertEquals(model.getTokenAttributes(i), vocabulary.attributes[i]);
+			}
+
+			// Token pieces concatenate to the text
+			int[] tokens = model.encode("Hello world");
+			StringBuilder joined = new StringBuilder();
+			for (int token : tokens) {
+				joined.append(vocabulary.text(token));
+			}
+			Assert.assertTrue(joined.toString().endsWith("Hello world"));
+		}
+	}
+
 	@Test
 	public void testTokenChecking() {
 		try (LlamaModel model = createModel()) {
@@ -62,6 +62,77 @@ public class MultiModelSystemTest {
 		}
 	}
 
+	@Test
+	public void testModelWeightsShared() {
+		int resident = LlamaModel.getResidentModelCount();
+		ModelParameters chat = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99)
+			.setCtxSize(512);
+		ModelParameters embeddings = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99)
+			.setCtxSize(256)
+			.enableEmbedding();
+
+		// Differently configured contexts on the same weights load them once
+		try (LlamaModel first = new LlamaModel(chat); LlamaModel second = new LlamaModel(embeddings)) {
+			Assert.assertEquals(resident + 1, LlamaModel.getResidentModelCount());
+			Assert.assertNotNull(first.complete(new InferenceParameters("int main() {").setNPredict(4)));
+			Assert.assertTrue(second.embed("int main() {").length > 0);
+
+			first.close();
+			Assert.assertEquals(resident + 1, LlamaModel.getResidentModelCount());
+			Assert.assertTrue(second.embed("return 0;").length > 0);
+		}
+		Assert.assertEquals(resident, LlamaModel.getResidentModelCount());
+	}
+
+	@Test
+	public void testAsyncLoadReportsProgress() {
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99);
+		List<Double> progress = new java.util.ArrayList<>();
+		try (ModelLoad load = LlamaModel.loadAsync(params); LlamaModel model = load.get(progress::add)) {
+			Assert.assertEquals(1.0, progress.get(progress.size() - 1), 0.0);
+			Assert.assertNotNull(model.complete(new InferenceParameters("int main() {").setNPredict(4)));
+		}
+	}
+
+	@Test
+	public void testAsyncLoadCancellation() {
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99);
+		ModelLoad load = LlamaModel.loadAsync(params);
+		load.cancel();
+		Assert.assertThrows(RuntimeException.class, load::get);
+		Assert.assertTrue(load.isDone());
+	}
+
+	@Test
+	public void testCloseWhileGenerating() throws Exception {
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99);
+		LlamaModel model = new LlamaModel(params);
+		Thread generator = new Thread(() -> {
+			try {
+				model.complete(new InferenceParameters("int main() {").setNPredict(512));
+			} catch (RuntimeException e) {
+				// The model was closed under the request
+			}
+		});
+		generator.start();
+		Thread.sleep(200);
+
+		// The generating call returns instead of using a freed server
+		model.close();
+		generator.join(30_000);
+		Assert.assertFalse(generator.isAlive());
+	}
+
 	@Test
 	public void testMultiModelManagerCreation() {
 		logger.log(DEBUG, "\n=== Multi-Model Manager Creation Test ===");
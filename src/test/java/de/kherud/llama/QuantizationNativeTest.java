@@ -50,4 +50,32 @@ public class QuantizationNativeTest {
 			logger.log(DEBUG, "Convenience method with defaults correctly failed: " + e.getMessage());
 		}
 	}
+
+	@Test
+	public void testQuantizeAsyncNonexistentModel() {
+		LlamaQuantizer.QuantizationParams params = LlamaQuantizer.getDefaultParams()
+			.setThreadCount(2)
+			.setTensorType("attn_v", "q6_K");
+		QuantizationJob job = LlamaQuantizer.quantizeAsync("nonexistent.gguf", "output.gguf", params);
+		try {
+			job.get((index, count, name) -> Assert.fail("No tensor should be reached"));
+			Assert.fail("Should throw LlamaException for nonexistent input file");
+		} catch (LlamaException e) {
+			logger.log(DEBUG, "Async quantization correctly failed: " + e.getMessage());
+		}
+		Assert.assertTrue(job.isDone());
+		Assert.assertFalse(new java.io.File("output.gguf").exists());
+	}
+
+	@Test
+	public void testQuantizeUnknownTensorType() {
+		LlamaQuantizer.QuantizationParams params = LlamaQuantizer.getDefaultParams()
+			.setOutputTensorType("q9_X");
+		try {
+			LlamaQuantizer.quantizeAsync("nonexistent.gguf", "output.gguf", params).close();
+			Assert.fail("Should reject an unknown tensor type");
+		} catch (IllegalArgumentException e) {
+			logger.log(DEBUG, "Unknown tensor type correctly rejected: " + e.getMessage());
+		}
+	}
 }
@@ -82,6 +82,32 @@ public class RerankingTest {
 		logger.log(DEBUG, "✅ Basic reranking test passed!");
 	}
 
+	@Test
+	public void testRerankTopK() {
+		String query = "Machine learning is";
+		String[] documents = {
+			"A machine is a physical system that uses power to apply forces.",
+			"Machine learning is a field of study in artificial intelligence.",
+			"Paris is the capital city of France and a major cultural center.",
+			"Machine learning is a field of study in artificial intelligence."
+		};
+
+		LlamaOutput output = model.rerank(query, documents);
+		RerankResult top = model.rerankTopK(query, 2, documents);
+
+		Assert.assertEquals(2, top.size());
+		Assert.assertTrue("Scores should be sorted descending", top.scores[0] >= top.scores[1]);
+		for (int i = 0; i < top.size(); i++) {
+			Float expected = output.probabilities.get(documents[top.indices[i]]);
+			Assert.assertNotNull(expected);
+			Assert.assertEquals(expected, top.scores[i], 1e-4f);
+		}
+
+		// Duplicate documents keep their own entry
+		RerankResult all = model.rerankTopK(query, documents.length, documents);
+		Assert.assertEquals(documents.length, all.size());
+	}
+
 	@Test
 	public void testRerankingConsistency() {
 		logger.log(DEBUG, "\n=== Reranking Consistency Test ===");
@@ -3,9 +3,15 @@ package de.kherud.llama;
 import org.junit.Assert;
 import org.junit.Test;
 
+import java.io.ByteArrayInputStream;
+import java.io.ByteArrayOutputStream;
 import java.io.File;
+import java.nio.ByteBuffer;
+import java.nio.channels.Channels;
 import java.nio.file.Files;
 import java.nio.file.Path;
+import java.util.regex.Matcher;
+import java.util.regex.Pattern;
 
 import static java.lang.System.Logger.Level.DEBUG;
 
@@ -319,4 +325,152 @@ public class StatePersistenceTest {
 			}
 		}
 	}
+
+	@Test
+	public void testStreamingStateExport() throws Exception {
+		try (LlamaModel model = createModel()) {
+			model.complete(new InferenceParameters(TEST_PROMPT).setNPredict(4));
+			long stateSize = model.getModelStateSize();
+
+			// Direct buffers are filled in place and advance like any other buffer write
+			ByteBuffer buffer = ByteBuffer.allocateDirect((int) stateSize);
+			Assert.assertEquals(stateSize, model.getModelState(buffer));
+			Assert.assertFalse(buffer.hasRemaining());
+			buffer.flip();
+			Assert.assertEquals(stateSize, model.setModelState(buffer));
+
+			boolean compress = LlamaModel.isStateCompressionAvailable();
+			Path tempFile = Files.createTempFile("llama_state_stream_", ".bin");
+			try {
+				Assert.assertTrue(model.exportModelState(tempFile, compress) > 0);
+				Assert.assertEquals(stateSize, model.importModelState(tempFile));
+			} finally {
+				Files.deleteIfExists(tempFile);
+			}
+
+			ByteArrayOutputStream out = new ByteArrayOutputStream();
+			long streamed = model.exportModelState(Channels.newChannel(out), compress);
+			Assert.assertEquals(streamed, out.size());
+			ByteArrayInputStream in = new ByteArrayInputStream(out.toByteArray());
+			Assert.assertEquals(stateSize, model.importModelState(Channels.newChannel(in)));
+		}
+	}
+
+	@Test
+	public void testSequenceCacheRestoresPrefix() throws Exception {
+		Path cacheDir = Files.createTempDirectory("llama_seq_cache_");
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99)
+			.setParallel(1)
+			.setSequenceCacheRam(64)
+			.setSequenceCacheDir(cacheDir.toString())
+			.setSequenceCacheBlock(8);
+		try (LlamaModel model = new LlamaModel(params)) {
+			String session = "public class Session {\n    // A returning agent session with a long shared prefix\n    private int id;";
+			InferenceParameters first = new InferenceParameters(session).setNPredict(8);
+			String expected = model.complete(first);
+
+			// An unrelated prompt takes over the only sequence, the session is snapshotted first
+			model.complete(new InferenceParameters("The quick brown fox jumps over").setNPredict(8));
+
+			// The returning session is restored from the snapshot and generates the same greedy output
+			Assert.assertEquals(expected, model.complete(first));
+			String perf = model.getPerformanceData();
+			Assert.assertFalse(perf, perf.contains("\"seq_cache_stores\":0,"));
+			Assert.assertFalse(perf, perf.contains("\"seq_cache_ram_hits\":0,"));
+		} finally {
+			try (var files = Files.list(cacheDir)) {
+				files.forEach(file -> file.toFile().delete());
+			}
+			Files.deleteIfExists(cacheDir);
+		}
+	}
+
+	@Test
+	public void testSequenceCacheKeepsShorterSnapshotReachable() throws Exception {
+		String shortPrompt = "public class Session {\n    // A returning agent session sharing its prefix with a longer one\n    private final int id;\n";
+		String longPrompt = shortPrompt + "    private final String name;\n    private final long created;\n    private final java.util.List<String> history;\n";
+		InferenceParameters shortRequest = new InferenceParameters(shortPrompt).setNPredict(8);
+		InferenceParameters longRequest = new InferenceParameters(longPrompt).setNPredict(8);
+		InferenceParameters otherRequest = new InferenceParameters(TEST_PROMPT).setNPredict(8);
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99)
+			.setParallel(1);
+
+		// Snapshots grow with the tokens of their sequence, the budget is sized from a measured one
+		double mib = 1024.0 * 1024.0;
+		double sizeShort, sizeLong, sizeOther;
+		try (LlamaModel model = new LlamaModel(params)) {
+			int nShort = model.encode(shortPrompt).length + 8;
+			int nLong = model.encode(longPrompt).length + 8;
+			int nOther = model.encode(TEST_PROMPT).length + 8;
+			model.complete(longRequest);
+			double perToken = (double) model.getSequenceStateSize(0) / nLong;
+			sizeShort = perToken * nShort / mib;
+			sizeLong = perToken * nLong / mib;
+			sizeOther = perToken * nOther / mib;
+		}
+		// The long and the other snapshot fit, adding the short one evicts both of them
+		int budget = (int) Math.round(sizeLong + (sizeOther + sizeShort) / 2);
+
+		try (LlamaModel model = new LlamaModel(params.setSequenceCacheRam(budget).setSequenceCacheBlock(8))) {
+			model.complete(longRequest);
+			model.complete(otherRequest);
+			// Restored from the long snapshot, whose block hashes also cover the short prompt
+			String expected = model.complete(shortRequest);
+			model.complete(otherRequest);
+
+			// The long snapshot is gone, the short prompt still finds its own one
+			long hits = counter(model.getPerformanceData(), "seq_cache_ram_hits");
+			Assert.assertEquals(expected, model.complete(shortRequest));
+			Assert.assertTrue(counter(model.getPerformanceData(), "seq_cache_ram_hits") > hits);
+		}
+	}
+
+	private static long counter(String perf, String name) {
+		Matcher matcher = Pattern.compile("\"" + name + "\":(\\d+)").matcher(perf);
+		Assert.assertTrue(perf, matcher.find());
+		return Long.parseLong(matcher.group(1));
+	}
+
+	@Test
+	public void testWarmImageRestoresSystemPrompt() throws Exception {
+		Path imageDir = Files.createTempDirectory("llama_warm_image_");
+		Path image = imageDir.resolve("warm.bin");
+		String system = "// You are a careful Java assistant.\n// Answer with compilable code only.\n";
+		ModelParameters params = new ModelParameters()
+			.setModel("models/codellama-7b.Q2_K.gguf")
+			.setGpuLayers(99)
+			.setWarmupPrompt(system)
+			.setWarmImage(image.toString());
+		InferenceParameters request = new InferenceParameters(system + "public class Main {").setNPredict(8);
+		try {
+			String expected;
+			try (LlamaModel model = new LlamaModel(params)) {
+				String perf = model.getPerformanceData();
+				Assert.assertTrue(perf, perf.contains("\"warm_start_restored\":false,"));
+				Assert.assertTrue(Files.size(image) > 0);
+				expected = model.complete(request);
+			}
+
+			// The second load restores the image and serves the prefix from the KV cache
+			try (LlamaModel model = new LlamaModel(params)) {
+				String perf = model.getPerformanceData();
+				Assert.assertTrue(perf, perf.contains("\"warm_start_restored\":true,"));
+				Assert.assertFalse(perf, perf.contains("\"warm_start_tokens\":0,"));
+				Assert.assertEquals(expected, model.complete(request));
+				Assert.assertFalse(model.getPerformanceData().contains("\"reused_count\":0,"));
+
+				// A cleared context no longer holds the warm prefix, the prompt is decoded in full again
+				model.clearMemory();
+				Assert.assertTrue(model.getPerformanceData().contains("\"warm_start_tokens\":0,"));
+				Assert.assertEquals(expected, model.complete(request));
+			}
+		} finally {
+			Files.deleteIfExists(image);
+			Files.deleteIfExists(imageDir);
+		}
+	}
 }
@@ -5,6 +5,11 @@ import org.junit.Assert;
 import org.junit.BeforeClass;
 import org.junit.Test;
 
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.util.regex.Matcher;
+import java.util.regex.Pattern;
+
 import static java.lang.System.Logger.Level.DEBUG;
 
 public class ThreadingControlTest {
@@ -163,4 +168,68 @@ public class ThreadingControlTest {
 
 		logger.log(DEBUG, "✅ Error handling test passed!");
 	}
+
+	@Test
+	public void testNumaPlacementPinsThreadPools() {
+		int[] cpus = ThreadingManager.getNumaNodeCpus(0);
+		Assert.assertTrue(ThreadingManager.getNumaNodeCount() >= 1);
+		Assert.assertTrue(cpus.length > 0);
+
+		try (LlamaModel placed = new LlamaModel(new ModelParameters()
+				.setCtxSize(512)
+				.setModel("models/codellama-7b.Q2_K.gguf")
+				.setGpuLayers(10)
+				.setNumaNode(0))) {
+			Assert.assertEquals(0, ThreadingManager.getNumaNode(placed));
+			ThreadingManager.ThreadConfig current = ThreadingManager.getCurrentConfiguration(placed);
+			Assert.assertEquals(cpus.length, current.generationThreads());
+			Assert.assertEquals(cpus.length, current.batchThreads());
+			Assert.assertFalse(placed.complete(new InferenceParameters("int main() {").setNPredict(4)).isEmpty());
+		}
+		Assert.assertEquals(-1, ThreadingManager.getNumaNode(model));
+	}
+
+	@Test
+	public void testSeparateThreadPools() {
+		int[] cpus = ThreadingManager.getNumaNodeCpus(0);
+		long generation = ThreadingManager.createThreadPool(1, new int[] { cpus[0] }, 0, 0, true);
+		long batch = ThreadingManager.createThreadPool(Math.min(4, cpus.length), cpus, 0, 50, false);
+		try {
+			model.attachThreadPool(generation, batch);
+			Assert.assertFalse(model.complete(new InferenceParameters("int main() {").setNPredict(4)).isEmpty());
+		} finally {
+			model.detachThreadPool();
+			ThreadingManager.freeThreadPool(generation);
+			ThreadingManager.freeThreadPool(batch);
+		}
+	}
+
+	@Test
+	public void testTuningProfileIsCachedAndApplied() throws Exception {
+		Path profile = Files.createTempFile("llama_tuning_", ".json");
+		Files.delete(profile);
+		try {
+			String tuned = model.tune(32, 4, 2, 1, profile.toString());
+			Assert.assertTrue(tuned, tuned.contains("\"fingerprint\":"));
+			Assert.assertTrue(tuned, tuned.contains("\"measurements\":["));
+			Assert.assertTrue(Files.exists(profile));
+
+			// The stored profile is returned without measuring again
+			Assert.assertEquals(tuned, model.tune(32, 4, 2, 1, profile.toString()));
+
+			Matcher threads = Pattern.compile("\"n_threads\":(\\d+)").matcher(tuned);
+			Assert.assertTrue(threads.find());
+			try (LlamaModel applied = new LlamaModel(new ModelParameters()
+					.setCtxSize(512)
+					.setModel("models/codellama-7b.Q2_K.gguf")
+					.setGpuLayers(10)
+					.setTuningProfile(profile.toString()))) {
+				ThreadingManager.ThreadConfig current = ThreadingManager.getCurrentConfiguration(applied);
+				Assert.assertEquals(Integer.parseInt(threads.group(1)), current.generationThreads());
+			}
+			logger.log(DEBUG, "Tuning profile: " + tuned);
+		} finally {
+			Files.deleteIfExists(profile);
+		}
+	}
 }
@@ -0,0 +1,93 @@
+package de.kherud.llama;
+
+import org.junit.Assert;
+import org.junit.Rule;
+import org.junit.Test;
+import org.junit.rules.TemporaryFolder;
+
+import java.nio.file.Path;
+import java.util.Arrays;
+import java.util.Random;
+
+public class VectorIndexTest {
+
+	private static final int DIMENSION = 32;
+	private static final int COUNT = 2000;
+
+	@Rule
+	public TemporaryFolder folder = new TemporaryFolder();
+
+	private static float[] randomVectors(int count, long seed) {
+		Random random = new Random(seed);
+		float[] vectors = new float[count * DIMENSION];
+		for (int i = 0; i < vectors.length; i++) {
+			vectors[i] = (float) random.nextGaussian();
+		}
+		return vectors;
+	}
+
+	private static float[] vector(float[] vectors, int i) {
+		return Arrays.copyOfRange(vectors, i * DIMENSION, (i + 1) * DIMENSION);
+	}
+
+	@Test
+	public void testFlatSearchFindsItself() {
+		float[] vectors = randomVectors(COUNT, 1);
+		for (VectorIndex.Storage storage : VectorIndex.Storage.values()) {
+			try (VectorIndex index = VectorIndex.flat(DIMENSION, storage, VectorIndex.Metric.COSINE)) {
+				Assert.assertEquals(0, index.add(vectors));
+				Assert.assertEquals(COUNT, index.size());
+
+				RerankResult hits = index.search(vector(vectors, 42), 5);
+				Assert.assertEquals(5, hits.size());
+				Assert.assertEquals("Nearest vector should be the query itself", 42, hits.indices[0]);
+				Assert.assertEquals(1.0f, hits.scores[0], 0.02f);
+				for (int i = 1; i < hits.size(); i++) {
+					Assert.assertTrue("Hits should be best first", hits.scores[i - 1] >= hits.scores[i]);
+				}
+			}
+		}
+	}
+
+	@Test
+	public void testHnswSaveAndOpen() throws Exception {
+		float[] vectors = randomVectors(COUNT, 2);
+		String[] texts = new String[COUNT];
+		for (int i = 0; i < COUNT; i++) {
+			texts[i] = "document " + i;
+		}
+
+		Path path = folder.getRoot().toPath().resolve("index.jlvi");
+		try (VectorIndex index = VectorIndex.hnsw(DIMENSION, VectorIndex.Storage.F16, VectorIndex.Metric.COSINE, 16, 100)) {
+			index.add(vectors, texts);
+			Assert.assertEquals(7, index.search(vector(vectors, 7), 1).indices[0]);
+			index.save(path);
+		}
+
+		try (VectorIndex index = VectorIndex.open(path)) {
+			Assert.assertEquals(COUNT, index.size());
+			Assert.assertEquals(DIMENSION, index.dimension());
+			RerankResult hits = index.search(vector(vectors, 7), 3);
+			Assert.assertEquals(7, hits.indices[0]);
+			Assert.assertEquals("document 7", index.text(hits.indices[0]));
+
+			// Adding to a mapped index continues its entries
+			Assert.assertEquals(COUNT, index.add(vector(vectors, 0), "copy"));
+			Assert.assertEquals("copy", index.text(COUNT));
+		}
+	}
+
+	@Test(expected = IllegalArgumentException.class)
+	public void testDimensionMismatch() {
+		try (VectorIndex index = VectorIndex.flat(DIMENSION, VectorIndex.Storage.F32, VectorIndex.Metric.DOT)) {
+			index.add(new float[DIMENSION + 1]);
+		}
+	}
+
+	@Test(expected = IllegalStateException.class)
+	public void testClosedIndex() {
+		VectorIndex index = VectorIndex.flat(DIMENSION, VectorIndex.Storage.F32, VectorIndex.Metric.DOT);
+		index.close();
+		index.size();
+	}
+}
@@ -3,8 +3,11 @@ package de.kherud.llama.diffusion;
 import org.junit.Before;
 import org.junit.Test;
 
+import java.nio.ByteBuffer;
+
 import static org.junit.Assert.assertEquals;
 import static org.junit.Assert.assertFalse;
+import static org.junit.Assert.assertNotNull;
 import static org.junit.Assert.assertTrue;
 import static org.junit.Assert.fail;
 
@@ -65,41 +68,40 @@ public class CannyEdgeDetectorTest {
 	}
 
 	@Test
-	public void testDisabledFunctionality() {
-		System.out.println("\n🚫 Testing Disabled Canny Functionality");
-
-		byte[] testImage = new byte[3 * 3 * 3]; // 3x3 RGB
-
-		// Test that all methods throw UnsupportedOperationException
-		try {
-			CannyEdgeDetector.detectEdges(testImage, 3, 3, 3);
-			fail("Should throw UnsupportedOperationException");
-		} catch (UnsupportedOperationException e) {
-			assertTrue("Should mention disabled", e.getMessage().contains("disabled"));
-			assertTrue("Should mention library bug", e.getMessage().contains("bug"));
-		}
-
-		try {
-			CannyEdgeDetector.detectEdges(testImage, 3, 3, 3, 0.1f, 0.05f);
-			fail("Should throw UnsupportedOperationException");
-		} catch (UnsupportedOperationException e) {
-			assertTrue("Should mention disabled", e.getMessage().contains("disabled"));
+	public void testStepEdge() {
+		System.out.println("\n🔍 Testing Canny Edges of a Step Image");
+
+		// Black left half, white right half
+		int width = 64;
+		int height = 48;
+		byte[] image = new byte[width * height * 3];
+		for (int y = 0; y < height; y++) {
+			for (int x = width / 2; x < width; x++) {
+				for (int c = 0; c < 3; c++) {
+					image[(y * width + x) * 3 + c] = (byte) 255;
+				}
+			}
 		}
 
-		try {
-			CannyEdgeDetector.detectEdges(testImage, 3, 3, 3, 0.1f, 0.05f, 0.8f, 1.0f, false);
-			fail("Should throw UnsupportedOperationException");
-		} catch (UnsupportedOperationException e) {
-			assertTrue("Should mention disabled", e.getMessage().contains("disabled"));
+		byte[] edges = CannyEdgeDetector.detectEdgesCopy(image, width, height, 3);
+		assertNotNull("Edge detection should succeed", edges);
+
+		int edgeColumns = 0;
+		for (int x = 0; x < width; x++) {
+			int value = edges[(height / 2 * width + x) * 3] & 0xff;
+			if (Math.abs(x - width / 2) <= 3) {
+				edgeColumns += value == 255 ? 1 : 0;
+			} else if (x > 4 && x < width - 4) {
+				assertEquals("Flat regions should have no edges", 0, value);
+			}
 		}
+		assertTrue("The step should be an edge", edgeColumns > 0);
 
-		try {
-			CannyEdgeDetector.detectEdgesCopy(testImage, 3, 3, 3);
-			fail("Should throw UnsupportedOperationException");
-		} catch (UnsupportedOperationException e) {
-			assertTrue("Should mention disabled", e.getMessage().contains("disabled"));
-		}
+		ByteBuffer source = ByteBuffer.allocateDirect(image.length).put(image);
+		ByteBuffer target = ByteBuffer.allocateDirect((width / 2) * (height / 2));
+		assertTrue("Resized edge detection should succeed",
+			CannyEdgeDetector.detectEdges(source, width, height, 3, target, width / 2, height / 2, 1));
 
-		System.out.println("✅ Disabled functionality test passed");
+		System.out.println("✅ Step edge test passed");
 	}
 }